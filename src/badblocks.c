@@ -31,220 +31,164 @@
 
 #include "badblocks.h"
 #include "file.h"
+#include "ext2fs/ext2fsP.h"
 
 FILE* log_fd = NULL;
 static const char abort_msg[] = "Too many bad blocks, aborting test\n";
 static const char bb_prefix[] = "Bad Blocks: ";
 
 /*
- *From e2fsprogs/lib/ext2fs/badblocks.c
+ * from e2fsprogs/misc/badblocks.c
  */
+static int v_flag = 1;					/* verbose */
+static int s_flag = 1;					/* show progress of test */
+static int cancel_ops = 0;				/* abort current operation */
+static int cur_pattern, nr_pattern;
+static int cur_op;
+static BOOL one_pass_mode = FALSE;
+/* Abort test if more than this number of bad blocks has been encountered */
+static unsigned int max_bb = BB_BAD_BLOCKS_THRESHOLD;
+static blk64_t currently_testing = 0;
+static blk64_t num_blocks = 0;
+static uint32_t num_read_errors = 0;
+static uint32_t num_write_errors = 0;
+static uint32_t num_corruption_errors = 0;
+/* Bad blocks found during the scan are stored in a red-black tree backed
+   bitmap (see blkmap64_rb.c), which keeps insertion and lookup O(log n)
+   even when a failing drive spews thousands of bad blocks */
+static ext2fs_generic_bitmap bb_map = NULL;
+/* Consecutive bad blocks of the same error type are coalesced into a single
+   range, which is streamed to the caller's callback as soon as it closes */
+static bad_block_callback_t bb_callback = NULL;
+static blk64_t range_start, range_end;
+static enum error_types range_type;
+static BOOL range_open = FALSE;
 
-/*
- * Badblocks list
- */
-struct bb_struct_u64_list {
-	int   magic;
-	int   num;
-	int   size;
-	uint64_t *list;
-	int   badblocks_flags;
-};
-
-struct bb_struct_u64_iterate {
-	int         magic;
-	bb_u64_list bb;
-	int         ptr;
-};
-
-static errcode_t make_u64_list(int size, int num, uint64_t *list, bb_u64_list *ret)
-{
-	bb_u64_list bb;
-
-	bb = calloc(1, sizeof(struct bb_struct_u64_list));
-	if (bb == NULL)
-		return BB_ET_NO_MEMORY;
-	bb->magic = BB_ET_MAGIC_BADBLOCKS_LIST;
-	bb->size = size ? size : 10;
-	bb->num = num;
-	bb->list = malloc(sizeof(blk64_t) * bb->size);
-	if (bb->list == NULL) {
-		free(bb);
-		bb = NULL;
-		return BB_ET_NO_MEMORY;
-	}
-	if (list)
-		memcpy(bb->list, list, bb->size * sizeof(blk64_t));
-	else
-		memset(bb->list, 0, bb->size * sizeof(blk64_t));
-	*ret = bb;
-	return 0;
+static __inline void *allocate_buffer(size_t size) {
+	return _mm_malloc(size, BB_SYS_PAGE_SIZE);
 }
 
-/*
- * This procedure creates an empty badblocks list.
- */
-static errcode_t bb_badblocks_list_create(bb_badblocks_list *ret, int size)
-{
-	return make_u64_list(size, 0, 0, (bb_badblocks_list *) ret);
+static __inline void free_buffer(void* p) {
+	_mm_free(p);
 }
 
 /*
- * This procedure adds a block to a badblocks list.
+ * Overlapped I/O machinery. The drive handle Rufus passes us was not opened
+ * with FILE_FLAG_OVERLAPPED, so an overlapped alias is created with
+ * ReOpenFile() and each sequence of blocks is issued as up to BB_MAX_INFLIGHT
+ * in-flight requests: flash media that needs queue depth > 1 to reach its
+ * rated throughput then gets scanned at full speed. If the alias can't be
+ * created the test simply runs with the synchronous calls, as before.
  */
-static errcode_t bb_u64_list_add(bb_u64_list bb, uint64_t blk)
-{
-	int		i, j;
-	uint64_t* old_bb_list = bb->list;
-
-	BB_CHECK_MAGIC(bb, BB_ET_MAGIC_BADBLOCKS_LIST);
-
-	if (bb->num >= bb->size) {
-		bb->size += 100;
-		bb->list = realloc(bb->list, bb->size * sizeof(uint64_t));
-		if (bb->list == NULL) {
-			bb->list = old_bb_list;
-			bb->size -= 100;
-			return BB_ET_NO_MEMORY;
-		}
-		// coverity[suspicious_sizeof]
-		memset(&bb->list[bb->size-100], 0, 100 * sizeof(uint64_t));
-	}
+static HANDLE hOverlapped = INVALID_HANDLE_VALUE;
+static HANDLE ovl_event[BB_MAX_INFLIGHT];
 
-	/*
-	 * Add special case code for appending to the end of the list
-	 */
-	i = bb->num-1;
-	if ((bb->num != 0) && (bb->list[i] == blk))
-		return 0;
-	if ((bb->num == 0) || (bb->list[i] < blk)) {
-		bb->list[bb->num++] = blk;
-		return 0;
-	}
+static void overlapped_exit(void)
+{
+	int i;
 
-	j = bb->num;
-	for (i=0; i < bb->num; i++) {
-		if (bb->list[i] == blk)
-			return 0;
-		if (bb->list[i] > blk) {
-			j = i;
-			break;
-		}
+	for (i = 0; i < BB_MAX_INFLIGHT; i++) {
+		if (ovl_event[i] != NULL)
+			CloseHandle(ovl_event[i]);
+		ovl_event[i] = NULL;
 	}
-	for (i=bb->num; i > j; i--)
-		bb->list[i] = bb->list[i-1];
-	bb->list[j] = blk;
-	bb->num++;
-	return 0;
-}
-
-static errcode_t bb_badblocks_list_add(bb_badblocks_list bb, blk64_t blk)
-{
-	return bb_u64_list_add((bb_u64_list) bb, blk);
+	if (hOverlapped != INVALID_HANDLE_VALUE)
+		CloseHandle(hOverlapped);
+	hOverlapped = INVALID_HANDLE_VALUE;
 }
 
-/*
- * This procedure finds a particular block is on a badblocks
- * list.
- */
-static int bb_u64_list_find(bb_u64_list bb, blk64_t blk)
+static BOOL overlapped_init(HANDLE hDrive)
 {
-	int	low, high, mid;
-
-	if (bb->magic != BB_ET_MAGIC_BADBLOCKS_LIST)
-		return -1;
-
-	if (bb->num == 0)
-		return -1;
-
-	low = 0;
-	high = bb->num-1;
-	if (blk == bb->list[low])
-		return low;
-	if (blk == bb->list[high])
-		return high;
+	int i;
 
-	while (low < high) {
-		mid = ((unsigned)low + (unsigned)high)/2;
-		if (mid == low || mid == high)
-			break;
-		if (blk == bb->list[mid])
-			return mid;
-		if (blk < bb->list[mid])
-			high = mid;
-		else
-			low = mid;
+	hOverlapped = ReOpenFile(hDrive, GENERIC_READ | GENERIC_WRITE,
+		FILE_SHARE_READ | FILE_SHARE_WRITE, FILE_FLAG_OVERLAPPED);
+	if (hOverlapped == INVALID_HANDLE_VALUE) {
+		uprintf("%sCould not reopen drive for overlapped I/O: %s\n", bb_prefix, WindowsErrorString());
+		return FALSE;
 	}
-	return -1;
+	for (i = 0; i < BB_MAX_INFLIGHT; i++) {
+		/* Manual reset, as GetOverlappedResult() expects */
+		ovl_event[i] = CreateEvent(NULL, TRUE, FALSE, NULL);
+		if (ovl_event[i] == NULL) {
+			overlapped_exit();
+			return FALSE;
+		}
+	}
+	return TRUE;
 }
 
 /*
- * This procedure tests to see if a particular block is on a badblocks
- * list.
+ * Issue a sequence of blocks as multiple in-flight requests and return the
+ * number of sequentially successful blocks, which is what the retry logic
+ * in test_rw() works from.
  */
-static int bb_u64_list_test(bb_u64_list bb, blk64_t blk)
-{
-	if (bb_u64_list_find(bb, blk) < 0)
-		return 0;
-	else
-		return 1;
-}
-
-static int bb_badblocks_list_test(bb_badblocks_list bb, blk64_t blk)
-{
-	return bb_u64_list_test((bb_u64_list) bb, blk);
-}
-
-static int bb_u64_list_iterate(bb_u64_iterate iter, blk64_t *blk)
+static int64_t do_io_overlapped(unsigned char* buffer, uint64_t tryout,
+								uint64_t block_size, blk64_t current_block, BOOL is_write)
 {
-	bb_u64_list bb;
-
-	if (iter->magic != BB_ET_MAGIC_BADBLOCKS_ITERATE)
-		return 0;
-
-	bb = iter->bb;
-
-	if (bb->magic != BB_ET_MAGIC_BADBLOCKS_LIST)
-		return 0;
+	OVERLAPPED ovl[BB_MAX_INFLIGHT];
+	uint64_t chunk_blocks, pos = 0, offset, nb[BB_MAX_INFLIGHT];
+	BOOL issued[BB_MAX_INFLIGHT], failed = FALSE;
+	int64_t got = 0;
+	DWORD size;
+	BOOL r;
+	int i, nr;
+
+	/* Aim for BB_MAX_INFLIGHT in-flight requests per sequence */
+	chunk_blocks = tryout / BB_MAX_INFLIGHT;
+	if (chunk_blocks == 0)
+		chunk_blocks = 1;
+	for (nr = 0; (nr < BB_MAX_INFLIGHT) && (pos < tryout); nr++) {
+		nb[nr] = (chunk_blocks < tryout - pos) ? chunk_blocks : (tryout - pos);
+		memset(&ovl[nr], 0, sizeof(OVERLAPPED));
+		ovl[nr].hEvent = ovl_event[nr];
+		offset = (current_block + pos) * block_size;
+		ovl[nr].Offset = (DWORD)offset;
+		ovl[nr].OffsetHigh = (DWORD)(offset >> 32);
+		if (is_write)
+			r = WriteFile(hOverlapped, buffer + pos * block_size,
+				(DWORD)(nb[nr] * block_size), NULL, &ovl[nr]);
+		else
+			r = ReadFile(hOverlapped, buffer + pos * block_size,
+				(DWORD)(nb[nr] * block_size), NULL, &ovl[nr]);
+		issued[nr] = (r || (GetLastError() == ERROR_IO_PENDING));
+		pos += nb[nr];
+		if (!issued[nr]) {
+			/* Could not even queue the request */
+			nr++;
+			break;
+		}
+	}
 
-	if (iter->ptr < bb->num) {
-		*blk = bb->list[iter->ptr++];
-		return 1;
+	/* Reap in order, counting the sequential prefix of successes but
+	 * always waiting out every request that was queued */
+	for (i = 0; i < nr; i++) {
+		if (!issued[i]) {
+			failed = TRUE;
+			continue;
+		}
+		r = GetOverlappedResult(hOverlapped, &ovl[i], &size, TRUE);
+		if (!r || (size != nb[i] * block_size)) {
+			if (!failed)
+				uprintf("%s%s error at block %" PRIu64 ": %s\n", bb_prefix,
+					is_write ? "Write" : "Read",
+					(uint64_t)current_block + (uint64_t)got,
+					(GetLastError() != ERROR_SUCCESS) ? WindowsErrorString() : "");
+			failed = TRUE;
+		} else if (!failed) {
+			got += nb[i];
+		}
 	}
-	*blk = 0;
-	return 0;
+	return got;
 }
 
-static int bb_badblocks_list_iterate(bb_badblocks_iterate iter, blk64_t *blk)
+static void flush_bad_block_range(void)
 {
-	return bb_u64_list_iterate((bb_u64_iterate) iter, blk);
-}
-
-/*
- * from e2fsprogs/misc/badblocks.c
- */
-static int v_flag = 1;					/* verbose */
-static int s_flag = 1;					/* show progress of test */
-static int cancel_ops = 0;				/* abort current operation */
-static int cur_pattern, nr_pattern;
-static int cur_op;
-/* Abort test if more than this number of bad blocks has been encountered */
-static unsigned int max_bb = BB_BAD_BLOCKS_THRESHOLD;
-static blk64_t currently_testing = 0;
-static blk64_t num_blocks = 0;
-static uint32_t num_read_errors = 0;
-static uint32_t num_write_errors = 0;
-static uint32_t num_corruption_errors = 0;
-static bb_badblocks_list bb_list = NULL;
-static blk64_t next_bad = 0;
-static bb_badblocks_iterate bb_iter = NULL;
-
-static __inline void *allocate_buffer(size_t size) {
-	return _mm_malloc(size, BB_SYS_PAGE_SIZE);
-}
-
-static __inline void free_buffer(void* p) {
-	_mm_free(p);
+	if (!range_open)
+		return;
+	if (bb_callback != NULL)
+		bb_callback(range_start, range_end, range_type);
+	range_open = FALSE;
 }
 
 /*
@@ -253,28 +197,24 @@ static __inline void free_buffer(void* p) {
  */
 static int bb_output (blk64_t bad, enum error_types error_type)
 {
-	errcode_t error_code;
-
-	if (bb_badblocks_list_test(bb_list, bad))
+	if (ext2fs_test_generic_bmap(bb_map, bad))
 		return 0;
 
-	uprintf("%s%lu\n", bb_prefix, (unsigned long)bad);
 	fprintf(log_fd, "Block %lu: %s error\n", (unsigned long)bad, (error_type==READ_ERROR)?"read":
 		((error_type == WRITE_ERROR)?"write":"corruption"));
 	fflush(log_fd);
 
-	error_code = bb_badblocks_list_add(bb_list, bad);
-	if (error_code) {
-		uprintf("%sError %d adding to in-memory bad block list", bb_prefix, error_code);
-		return 0;
-	}
+	ext2fs_mark_generic_bmap(bb_map, bad);
 
-	/* kludge:
-	   increment the iteration through the bb_list if
-	   an element was just added before the current iteration
-	   position.  This should not cause next_bad to change. */
-	if (bb_iter && bad < next_bad)
-		bb_badblocks_list_iterate (bb_iter, &next_bad);
+	if (range_open && (bad == range_end + 1) && (error_type == range_type)) {
+		range_end = bad;
+	} else {
+		flush_bad_block_range();
+		range_start = bad;
+		range_end = bad;
+		range_type = error_type;
+		range_open = TRUE;
+	}
 
 	if (error_type == READ_ERROR) {
 	  num_read_errors++;
@@ -310,8 +250,13 @@ static void print_status(void)
 				num_read_errors,
 				num_write_errors,
 				num_corruption_errors);
-	percent = (percent/2.0f) + ((cur_op==OP_READ)? 50.0f : 0.0f);
-	UpdateProgress(OP_BADBLOCKS, (((cur_pattern-1)*100.0f) + percent) / nr_pattern);
+	if (one_pass_mode) {
+		/* Write and verify fronts progress together through a single pass */
+		UpdateProgress(OP_BADBLOCKS, percent);
+	} else {
+		percent = (percent/2.0f) + ((cur_op==OP_READ)? 50.0f : 0.0f);
+		UpdateProgress(OP_BADBLOCKS, (((cur_pattern-1)*100.0f) + percent) / nr_pattern);
+	}
 }
 
 static void CALLBACK alarm_intr(HWND hwnd, UINT uMsg, UINT_PTR idEvent, DWORD dwTime)
@@ -326,16 +271,119 @@ static void CALLBACK alarm_intr(HWND hwnd, UINT uMsg, UINT_PTR idEvent, DWORD dw
 	print_status();
 }
 
+/*
+ * On x86, the read-verify pass can compare 32 bytes per instruction with AVX2,
+ * which keeps the CPU-side pattern checks well ahead of fast NVMe-bridge
+ * devices. Runtime detected, with a portable memcmp() based fallback.
+ */
+#if (defined(_M_X64) || defined(__x86_64__) || defined(_M_IX86) || defined(__i386__))
+#define CPU_HAS_AVX2_SUPPORT 1
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define TARGET_XSAVE
+#define TARGET_AVX2
+#else
+#include <cpuid.h>
+#define TARGET_XSAVE __attribute__ ((target("xsave")))
+#define TARGET_AVX2 __attribute__ ((target("avx2")))
+#endif
+
+/* Runtime detection of AVX2 (cached after the first call) */
+TARGET_XSAVE static BOOL HasAvx2(void)
+{
+	static int has_avx2 = -1;
+	uint32_t regs[4] = { 0 };
+
+	if (has_avx2 < 0) {
+		has_avx2 = 0;
+#if defined(_MSC_VER)
+		__cpuid((int*)regs, 1);
+#else
+		__get_cpuid(1, &regs[0], &regs[1], &regs[2], &regs[3]);
+#endif
+		/* Needs AVX and OSXSAVE, plus the OS having enabled the YMM state */
+		if ((regs[2] & (1 << 27)) && (regs[2] & (1 << 28)) && ((_xgetbv(0) & 6) == 6)) {
+#if defined(_MSC_VER)
+			__cpuidex((int*)regs, 7, 0);
+#else
+			__get_cpuid_count(7, 0, &regs[0], &regs[1], &regs[2], &regs[3]);
+#endif
+			has_avx2 = (regs[1] & (1 << 5)) ? 1 : 0;
+		}
+		if (has_avx2)
+			uprintf("%sAVX2 detected - using vectorized block compare\n", bb_prefix);
+	}
+	return (BOOL)has_avx2;
+}
+
+TARGET_AVX2 static size_t block_compare_avx2(const unsigned char *a,
+			 const unsigned char *b, size_t n)
+{
+	size_t i;
+	int mask;
+	__m256i va, vb;
+
+	for (i = 0; i + 32 <= n; i += 32) {
+		va = _mm256_loadu_si256((const __m256i*)&a[i]);
+		vb = _mm256_loadu_si256((const __m256i*)&b[i]);
+		mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(va, vb));
+		if (mask != -1) {
+#if defined(_MSC_VER)
+			unsigned long bit;
+			_BitScanForward(&bit, (unsigned long)~mask);
+			return i + bit;
+#else
+			return i + __builtin_ctz(~(unsigned int)mask);
+#endif
+		}
+	}
+	for (; i < n; i++) {
+		if (a[i] != b[i])
+			break;
+	}
+	return i;
+}
+#endif /* CPU_HAS_AVX2_SUPPORT */
+
+/*
+ * Compare a written block against its read back copy and return the offset
+ * of the first mismatch, or n when both copies are identical.
+ */
+static size_t block_compare(const unsigned char *a, const unsigned char *b,
+			 size_t n)
+{
+	size_t i;
+
+#if defined(CPU_HAS_AVX2_SUPPORT)
+	if (HasAvx2())
+		return block_compare_avx2(a, b, n);
+#endif
+	if (memcmp(a, b, n) == 0)
+		return n;
+	for (i = 0; i < n; i++) {
+		if (a[i] != b[i])
+			break;
+	}
+	return i;
+}
+
 static void pattern_fill(unsigned char *buffer, unsigned int pattern,
 			 size_t n)
 {
 	unsigned int	i, nb;
 	unsigned char	bpattern[sizeof(pattern)], *ptr;
+	size_t		filled, period;
 
 	if (pattern == (unsigned int) ~0) {
 		PrintInfo(3500, MSG_236);
 		srand((unsigned int)GetTickCount64());
-		for (ptr = buffer; ptr < buffer + n; ptr++) {
+		/* Fill a word at a time - rand() only provides 15 bits, so combine three calls */
+		for (ptr = buffer; ptr + sizeof(unsigned int) <= buffer + n; ptr += sizeof(unsigned int)) {
+			// coverity[dont_call]
+			*(unsigned int*)ptr = ((unsigned int)rand() << 17) ^ ((unsigned int)rand() << 2) ^ (unsigned int)rand();
+		}
+		for (; ptr < buffer + n; ptr++) {
 			// coverity[dont_call]
 			(*ptr) = rand() % (1 << (8 * sizeof(char)));
 		}
@@ -349,12 +397,26 @@ static void pattern_fill(unsigned char *buffer, unsigned int pattern,
 			pattern = pattern >> 8;
 		}
 		nb = i ? (i-1) : 0;
-		for (ptr = buffer, i = nb; ptr < buffer + n; ptr++) {
-			*ptr = bpattern[i];
-			if (i == 0)
-				i = nb;
-			else
-				i--;
+		if (nb == 0) {
+			/* Single byte patterns (the usual case) are a plain fill */
+			memset(buffer, bpattern[0], n);
+		} else {
+			/* Multi-byte patterns: lay down one period, then double the
+			   filled region with memcpy until the buffer is complete */
+			period = (size_t)nb + 1;
+			if (period > n)
+				period = n;
+			for (ptr = buffer, i = nb; ptr < buffer + period; ptr++) {
+				*ptr = bpattern[i];
+				if (i == 0)
+					i = nb;
+				else
+					i--;
+			}
+			for (filled = period; filled < n; filled += period) {
+				period = (filled < n - filled) ? filled : n - filled;
+				memcpy(buffer + filled, buffer, period);
+			}
 		}
 		cur_pattern++;
 	}
@@ -373,6 +435,8 @@ static int64_t do_read (HANDLE hDrive, unsigned char * buffer, uint64_t tryout,
 		print_status();
 
 	/* Try the read */
+	if (hOverlapped != INVALID_HANDLE_VALUE)
+		return do_io_overlapped(buffer, tryout, block_size, current_block, FALSE);
 	got = read_sectors(hDrive, block_size, current_block, tryout, buffer);
 	if (got < 0)
 		got = 0;
@@ -395,6 +459,8 @@ static int64_t do_write(HANDLE hDrive, unsigned char * buffer, uint64_t tryout,
 		print_status();
 
 	/* Try the write */
+	if (hOverlapped != INVALID_HANDLE_VALUE)
+		return do_io_overlapped(buffer, tryout, block_size, current_block, TRUE);
 	got = write_sectors(hDrive, block_size, current_block, tryout, buffer);
 	if (got < 0)
 		got = 0;
@@ -541,9 +607,9 @@ static unsigned int test_rw(HANDLE hDrive, blk64_t last_block, size_t block_size
 				recover_block = ~0;
 			}
 			for (i=0; i < got; i++) {
-				if (memcmp(read_buffer + i * block_size,
+				if (block_compare(read_buffer + i * block_size,
 					   buffer + i * block_size,
-					   block_size))
+					   block_size) < block_size)
 					bb_count += bb_output(currently_testing+i-got, CORRUPTION_ERROR);
 			}
 			if (v_flag > 1)
@@ -557,8 +623,224 @@ out:
 	return bb_count;
 }
 
+/*
+ * One-pass variant of the above: a single pattern is written with a sliding
+ * window, with each window of blocks read back and compared as soon as the
+ * write front has moved one full window past it, which finds the same bad
+ * cells in about half the total I/O of separate write and read passes.
+ */
+static unsigned int test_rw_one_pass(HANDLE hDrive, blk64_t last_block, size_t block_size,
+									 blk64_t first_block, size_t blocks_at_once, int pattern_type)
+{
+	const unsigned int pattern[BADLOCKS_PATTERN_TYPES][BADBLOCK_PATTERN_COUNT] =
+		{ BADBLOCK_PATTERN_ONE_PASS, BADBLOCK_PATTERN_TWO_PASSES, BADBLOCK_PATTERN_SLC,
+		  BADCLOCK_PATTERN_MLC, BADBLOCK_PATTERN_TLC };
+	unsigned char *buffer = NULL, *read_buffer;
+	int i;
+	unsigned int bb_count = 0;
+	blk64_t got, tryout, write_block, verify_block, write_end, verify_end, *blk_id;
+	size_t id_offset = 0;
+
+	if ((pattern_type < 0) || (pattern_type >= BADLOCKS_PATTERN_TYPES)) {
+		uprintf("%sInvalid pattern type\n", bb_prefix);
+		cancel_ops = -1;
+		return 0;
+	}
+
+	buffer = allocate_buffer(2 * blocks_at_once * block_size);
+	if (!buffer) {
+		uprintf("%sError while allocating buffers\n", bb_prefix);
+		cancel_ops = -1;
+		return 0;
+	}
+	read_buffer = buffer + blocks_at_once * block_size;
+
+	uprintf("%sChecking from block %lu to %lu (1 block = %s, one-pass write+verify)\n", bb_prefix,
+		(unsigned long) first_block, (unsigned long) last_block - 1,
+		SizeToHumanReadable(BADBLOCK_BLOCK_SIZE, FALSE, FALSE));
+	nr_pattern = 1;
+	cur_pattern = 0;
+
+	if (detect_fakes) {
+		srand((unsigned int)GetTickCount64());
+		id_offset = rand() * (block_size - sizeof(blk64_t)) / RAND_MAX;
+		uprintf("%sUsing offset %d for fake device check\n", bb_prefix, id_offset);
+	}
+	// coverity[dont_call]
+	pattern_fill(buffer, pattern[pattern_type][0], blocks_at_once * block_size);
+	num_blocks = last_block;
+	currently_testing = first_block;
+	if (s_flag | v_flag)
+		uprintf("%sWriting and verifying test pattern 0x%02X (%s window)\n", bb_prefix,
+			pattern[pattern_type][0], SizeToHumanReadable(blocks_at_once * block_size, FALSE, FALSE));
+
+	write_block = verify_block = first_block;
+	while (verify_block < last_block) {
+		if (cancel_ops)
+			goto out;
+		if (max_bb && bb_count >= max_bb) {
+			if (s_flag || v_flag) {
+				uprintf(abort_msg);
+				fprintf(log_fd, "%s", abort_msg);
+				fflush(log_fd);
+			}
+			cancel_ops = -1;
+			goto out;
+		}
+
+		/* Advance the write front by one window */
+		if (write_block < last_block) {
+			cur_op = OP_WRITE;
+			write_end = write_block + blocks_at_once;
+			if (write_end > last_block)
+				write_end = last_block;
+			tryout = blocks_at_once;
+			while (write_block < write_end) {
+				if (cancel_ops)
+					goto out;
+				if (write_block + tryout > write_end)
+					tryout = write_end - write_block;
+				if (detect_fakes) {
+					/* Add the block number at a fixed (random) offset to allow for the
+					   detection of 'fake' media (eg. 2GB USB masquerading as 16GB) */
+					for (i=0; i<(int)blocks_at_once; i++) {
+						blk_id = (blk64_t*)(intptr_t)(buffer + id_offset + i*block_size);
+						*blk_id = (blk64_t)(write_block + i);
+					}
+				}
+				got = do_write(hDrive, buffer, tryout, block_size, write_block);
+				if (v_flag > 1)
+					print_status();
+				if (got == 0 && tryout == 1)
+					bb_count += bb_output(write_block++, WRITE_ERROR);
+				write_block += got;
+				if (got != tryout)
+					tryout = 1;
+			}
+		}
+
+		/* Read back and compare the window one full window behind the write
+		   front, so the device can't serve the data straight from its cache */
+		verify_end = verify_block + blocks_at_once;
+		if (verify_end > last_block)
+			verify_end = last_block;
+		if ((write_block < last_block) && (write_block < verify_end + blocks_at_once))
+			continue;
+		cur_op = OP_READ;
+		tryout = blocks_at_once;
+		while (verify_block < verify_end) {
+			if (cancel_ops)
+				goto out;
+			if (verify_block + tryout > verify_end)
+				tryout = verify_end - verify_block;
+			if (detect_fakes) {
+				for (i=0; i<(int)blocks_at_once; i++) {
+					blk_id = (blk64_t*)(intptr_t)(buffer + id_offset + i*block_size);
+					*blk_id = (blk64_t)(verify_block + i);
+				}
+			}
+			got = do_read(hDrive, read_buffer, tryout, block_size, verify_block);
+			if (got == 0 && tryout == 1)
+				bb_count += bb_output(verify_block++, READ_ERROR);
+			verify_block += got;
+			if (got != tryout)
+				tryout = 1;
+			for (i=0; i < got; i++) {
+				if (block_compare(read_buffer + i * block_size,
+					   buffer + i * block_size,
+					   block_size) < block_size)
+					bb_count += bb_output(verify_block+i-got, CORRUPTION_ERROR);
+			}
+			currently_testing = verify_block;
+			if (v_flag > 1)
+				print_status();
+		}
+	}
+	num_blocks = 0;
+out:
+	free_buffer(buffer);
+	return bb_count;
+}
+
+/*
+ * Fast counterfeit capacity probe: write a uniquely tagged block at
+ * exponentially spaced offsets across the claimed capacity, then read
+ * everything back once all the writes are done. Fake flash remaps writes
+ * past its real capacity onto lower addresses, so a block read back with
+ * another probe's tag (or unreadable altogether) gives the device away in
+ * seconds where the full surface scan takes hours.
+ */
+static unsigned int test_fake_capacity(HANDLE hDrive, blk64_t last_block, size_t block_size)
+{
+	unsigned char *buffer = NULL, *read_buffer;
+	unsigned int bb_count = 0;
+	blk64_t probe[64], b, got, *blk_id;
+	int i, nb_probes = 0;
+	size_t id_offset;
+
+	buffer = allocate_buffer(2 * block_size);
+	if (!buffer) {
+		uprintf("%sError while allocating buffers\n", bb_prefix);
+		cancel_ops = -1;
+		return 0;
+	}
+	read_buffer = buffer + block_size;
+
+	/* Probe block 0, exponentially spaced offsets, then the very last block */
+	probe[nb_probes++] = 0;
+	for (b = 1; (b < last_block - 1) && (nb_probes < ARRAYSIZE(probe) - 1); b *= 2)
+		probe[nb_probes++] = b;
+	if (probe[nb_probes - 1] != last_block - 1)
+		probe[nb_probes++] = last_block - 1;
+
+	uprintf("%sProbing %d blocks at exponentially spaced offsets up to block %lu (1 block = %s)\n",
+		bb_prefix, nb_probes, (unsigned long) last_block - 1,
+		SizeToHumanReadable(BADBLOCK_BLOCK_SIZE, FALSE, FALSE));
+	nr_pattern = 1;
+	cur_pattern = 1;
+	srand((unsigned int)GetTickCount64());
+	id_offset = rand() * (block_size - sizeof(blk64_t)) / RAND_MAX;
+	uprintf("%sUsing offset %d for the block tags\n", bb_prefix, id_offset);
+	// coverity[dont_call]
+	pattern_fill(buffer, (unsigned int)~0, block_size);
+	blk_id = (blk64_t*)(intptr_t)(buffer + id_offset);
+
+	cur_op = OP_WRITE;
+	num_blocks = nb_probes;
+	currently_testing = 0;
+	for (i = 0; i < nb_probes; i++) {
+		if (cancel_ops)
+			goto out;
+		*blk_id = probe[i];
+		got = do_write(hDrive, buffer, 1, block_size, probe[i]);
+		if (got != 1)
+			bb_count += bb_output(probe[i], WRITE_ERROR);
+		currently_testing = i + 1;
+	}
+
+	cur_op = OP_READ;
+	currently_testing = 0;
+	for (i = 0; i < nb_probes; i++) {
+		if (cancel_ops)
+			goto out;
+		*blk_id = probe[i];
+		got = do_read(hDrive, read_buffer, 1, block_size, probe[i]);
+		if (got != 1)
+			bb_count += bb_output(probe[i], READ_ERROR);
+		else if (block_compare(read_buffer, buffer, block_size) < block_size)
+			bb_count += bb_output(probe[i], CORRUPTION_ERROR);
+		currently_testing = i + 1;
+	}
+	if (bb_count)
+		uprintf("%sCapacity probe FAILED - this device is likely counterfeit!\n", bb_prefix);
+	num_blocks = 0;
+out:
+	free_buffer(buffer);
+	return bb_count;
+}
+
 BOOL BadBlocks(HANDLE hPhysicalDrive, ULONGLONG disk_size, int nb_passes,
-			   int flash_type, badblocks_report *report, FILE* fd)
+			   int flash_type, int mode, bad_block_callback_t callback, badblocks_report *report, FILE* fd)
 {
 	errcode_t error_code;
 	blk64_t last_block = disk_size / BADBLOCK_BLOCK_SIZE;
@@ -574,19 +856,38 @@ BOOL BadBlocks(HANDLE hPhysicalDrive, ULONGLONG disk_size, int nb_passes,
 		log_fd = freopen(NULL, "w", stderr);
 	}
 
-	error_code = bb_badblocks_list_create(&bb_list, 0);
+	error_code = ext2fs_alloc_generic_bmap(NULL, EXT2_ET_MAGIC_GENERIC_BITMAP64,
+		EXT2FS_BMAP64_RBTREE, 0, last_block - 1, last_block - 1, "bad blocks", &bb_map);
 	if (error_code) {
-		uprintf("%sError %d while creating in-memory bad blocks list", bb_prefix, error_code);
+		uprintf("%sError %d while creating in-memory bad blocks map", bb_prefix, error_code);
 		return FALSE;
 	}
 
 	cancel_ops = 0;
+	one_pass_mode = (mode == BB_MODE_ONE_PASS);
+	bb_callback = callback;
+	range_open = FALSE;
+	overlapped_init(hPhysicalDrive);
 	/* use a timer to update status every second */
 	SetTimer(hMainDialog, TID_BADBLOCKS_UPDATE, 1000, alarm_intr);
-	report->bb_count = test_rw(hPhysicalDrive, last_block, BADBLOCK_BLOCK_SIZE, 0, BB_BLOCKS_AT_ONCE, flash_type, nb_passes);
+	switch (mode) {
+	case BB_MODE_ONE_PASS:
+		report->bb_count = test_rw_one_pass(hPhysicalDrive, last_block, BADBLOCK_BLOCK_SIZE, 0, BB_BLOCKS_AT_ONCE, flash_type);
+		break;
+	case BB_MODE_CAPACITY_PROBE:
+		report->bb_count = test_fake_capacity(hPhysicalDrive, last_block, BADBLOCK_BLOCK_SIZE);
+		break;
+	default:
+		report->bb_count = test_rw(hPhysicalDrive, last_block, BADBLOCK_BLOCK_SIZE, 0, BB_BLOCKS_AT_ONCE, flash_type, nb_passes);
+		break;
+	}
 	KillTimer(hMainDialog, TID_BADBLOCKS_UPDATE);
-	free(bb_list->list);
-	free(bb_list);
+	flush_bad_block_range();
+	bb_callback = NULL;
+	overlapped_exit();
+	one_pass_mode = FALSE;
+	ext2fs_free_generic_bmap(bb_map);
+	bb_map = NULL;
 	report->num_read_errors = num_read_errors;
 	report->num_write_errors = num_write_errors;
 	report->num_corruption_errors = num_corruption_errors;
@@ -23,23 +23,14 @@
 
 #include "ext2fs/ext2fs.h"
 
-typedef struct bb_struct_u64_list         *bb_badblocks_list;
-typedef struct bb_struct_u64_iterate      *bb_badblocks_iterate;
-typedef struct bb_struct_u64_list         *bb_u64_list;
-typedef struct bb_struct_u64_iterate      *bb_u64_iterate;
-
-#define BB_ET_NO_MEMORY                   (ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|ERROR_NOT_ENOUGH_MEMORY)
-#define BB_ET_MAGIC_BADBLOCKS_LIST        (ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|ERROR_OBJECT_IN_LIST)
-#define BB_ET_MAGIC_BADBLOCKS_ITERATE     (ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|ERROR_INVALID_BLOCK)
-
-#define BB_CHECK_MAGIC(struct, code) \
-	if ((struct)->magic != (code)) return (code)
 #define BB_BAD_BLOCKS_THRESHOLD           256
 #define BB_BLOCKS_AT_ONCE                 64
+#define BB_MAX_INFLIGHT                   8
 #define BB_SYS_PAGE_SIZE                  4096
 
 enum error_types { READ_ERROR, WRITE_ERROR, CORRUPTION_ERROR };
 enum op_type { OP_READ, OP_WRITE };
+enum bb_mode { BB_MODE_STANDARD = 0, BB_MODE_ONE_PASS, BB_MODE_CAPACITY_PROBE };
 
 /*
  * Badblocks report
@@ -51,8 +42,14 @@ typedef struct {
 	uint32_t num_corruption_errors;
 } badblocks_report;
 
+/*
+ * Callback streaming coalesced ranges of bad blocks to the caller as they
+ * are found, so that consumers don't need a materialized list after the scan
+ */
+typedef void (*bad_block_callback_t)(blk64_t start, blk64_t end, enum error_types error_type);
+
 /*
  * Shared prototypes
  */
 BOOL BadBlocks(HANDLE hPhysicalDrive, ULONGLONG disk_size, int nb_passes,
-	int flash_type, badblocks_report *report, FILE* fd);
+	int flash_type, int mode, bad_block_callback_t callback, badblocks_report *report, FILE* fd);
@@ -0,0 +1,323 @@
+/*
+ * Rufus: The Reliable USB Formatting Utility
+ * Device read/write benchmark
+ * Copyright © 2022 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Memory leaks detection - define _CRTDBG_MAP_ALLOC as preprocessor macro */
+#ifdef _CRTDBG_MAP_ALLOC
+#include <stdlib.h>
+#include <crtdbg.h>
+#endif
+
+#include <windows.h>
+#include <windowsx.h>
+#include <commctrl.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <malloc.h>
+
+#include "rufus.h"
+#include "missing.h"
+#include "resource.h"
+#include "msapi_utf8.h"
+#include "localization.h"
+
+#include "drive.h"
+#include "winio.h"
+
+// How long each individual measurement should run for, in ms. Longer runs
+// produce more stable figures but a full benchmark is 14 of these...
+#define BENCH_RUN_TIME_MS       2000
+// How long we wait on a single I/O before declaring the device wedged
+#define BENCH_IO_TIMEOUT        30000
+// The benchmark is confined to the start of the drive, so that runs complete
+// in a sane amount of time even on large (or slow) devices.
+#define BENCH_SPAN              (1 * GB)
+#define BENCH_MAX_BLOCK_SIZE    (16 * MB)
+#define BENCH_RANDOM_BLOCK_SIZE (4 * KB)
+
+static const DWORD bench_block_size[] = { (DWORD)(128 * KB), (DWORD)(1 * MB), (DWORD)(16 * MB) };
+static const DWORD bench_queue_depth[] = { 1, ASYNC_MAX_IN_FLIGHT };
+// Sequential read + write for each block size and queue depth, plus random 4K read + write
+#define BENCH_NUM_RUNS (2 * (int)(ARRAYSIZE(bench_block_size) * ARRAYSIZE(bench_queue_depth)) + 2)
+
+static HWND hBenchmarkDialog = NULL;
+static HANDLE benchmark_thread = NULL;
+static BOOL benchmark_cancelled = FALSE, benchmark_close_requested = FALSE;
+
+// Log one report line and queue it for display in the benchmark dialog
+static void BenchReport(const char* line)
+{
+	uprintf("%s", line);
+	PostMessage(hBenchmarkDialog, UM_BENCHMARK_LINE, 0, (LPARAM)safe_strdup(line));
+}
+
+static __inline uint64_t BenchRandomBlock(uint64_t num_blocks)
+{
+	// coverity[dont_call]
+	return ((((uint64_t)rand() << 31) ^ ((uint64_t)rand() << 16) ^ (uint64_t)rand()) % num_blocks);
+}
+
+/*
+ * Run one measurement: issue 'qd' requests of 'block_size' bytes against the
+ * async handle and keep the queue full until BENCH_RUN_TIME_MS have elapsed,
+ * then drain. Returns the average throughput in MB/s through 'speed'.
+ */
+static BOOL BenchRun(HANDLE h, BOOL write_test, BOOL random_access, DWORD block_size,
+	DWORD qd, uint64_t span, uint8_t* buffer, double* speed)
+{
+	BOOL ok = TRUE;
+	DWORD i, slot = 0, size, in_flight = 0;
+	uint64_t start, elapsed = 0, total = 0, pos = 0, num_blocks = span / block_size;
+
+	*speed = 0.0;
+	start = GetTickCount64();
+	for (i = 0; i < qd; i++) {
+		SeekFileAsyncEx(h, i, random_access ? BenchRandomBlock(num_blocks) * block_size : pos);
+		pos += block_size;
+		if (!(write_test ? WriteFileAsyncEx(h, i, &buffer[i * block_size], block_size) :
+			ReadFileAsyncEx(h, i, &buffer[i * block_size], block_size))) {
+			uprintf("Benchmark I/O error: %s", WindowsErrorString());
+			ok = FALSE;
+			break;
+		}
+		in_flight++;
+	}
+
+	// Requests complete in issue order, so always service the oldest slot
+	while (in_flight > 0) {
+		if (ok && WaitFileAsyncEx(h, slot, BENCH_IO_TIMEOUT) &&
+			GetSizeAsyncEx(h, slot, &size) && (size == block_size)) {
+			total += size;
+			elapsed = GetTickCount64() - start;
+			if ((elapsed < BENCH_RUN_TIME_MS) && !benchmark_cancelled) {
+				if (pos + block_size > span)
+					pos = 0;
+				SeekFileAsyncEx(h, slot, random_access ? BenchRandomBlock(num_blocks) * block_size : pos);
+				pos += block_size;
+				if (!(write_test ? WriteFileAsyncEx(h, slot, &buffer[slot * block_size], block_size) :
+					ReadFileAsyncEx(h, slot, &buffer[slot * block_size], block_size))) {
+					uprintf("Benchmark I/O error: %s", WindowsErrorString());
+					ok = FALSE;
+					in_flight--;
+				}
+			} else {
+				in_flight--;
+			}
+		} else {
+			if (ok) {
+				uprintf("Benchmark I/O error: %s", WindowsErrorString());
+				ok = FALSE;
+			}
+			// On error, we still need to wait out the requests that are in flight
+			// before anyone frees the buffer they are targeting.
+			WaitFileAsyncEx(h, slot, BENCH_IO_TIMEOUT);
+			IGNORE_RETVAL(GetSizeAsyncEx(h, slot, &size));
+			in_flight--;
+		}
+		slot = (slot + 1) % qd;
+	}
+
+	if (elapsed == 0)
+		elapsed = 1;
+	*speed = (double)total / (1000.0 * (double)elapsed);
+	return ok;
+}
+
+DWORD WINAPI BenchmarkThread(void* param)
+{
+	BOOL ok = TRUE;
+	DWORD DriveIndex = (DWORD)(uintptr_t)param;
+	HANDLE hPhysical = INVALID_HANDLE_VALUE, hAsync = NULL;
+	HWND hProgressBar = GetDlgItem(hBenchmarkDialog, IDC_BENCHMARK_PROGRESS);
+	uint8_t* buffer = NULL;
+	uint32_t* wb;
+	uint64_t span;
+	size_t n;
+	int i, j, pass, run = 0;
+	double speed;
+	char line[128], *name = NULL;
+
+	name = GetPhysicalName(DriveIndex);
+	hPhysical = GetPhysicalHandle(DriveIndex, TRUE, TRUE, FALSE);
+	if (hPhysical == INVALID_HANDLE_VALUE) {
+		BenchReport("Could not open device - benchmark aborted");
+		ok = FALSE;
+		goto out;
+	}
+	// Reopen the locked handle unbuffered, so that the figures reflect the
+	// device rather than the system cache
+	hAsync = WrapFileAsync(hPhysical, GENERIC_READ | GENERIC_WRITE,
+		FILE_SHARE_READ | FILE_SHARE_WRITE, FILE_FLAG_NO_BUFFERING | FILE_FLAG_WRITE_THROUGH);
+	if (hAsync == NULL) {
+		BenchReport("Could not reopen device for async access - benchmark aborted");
+		ok = FALSE;
+		goto out;
+	}
+	buffer = (uint8_t*)_mm_malloc((size_t)BENCH_MAX_BLOCK_SIZE * ASYNC_MAX_IN_FLIGHT, SelectedDrive.SectorSize);
+	if (buffer == NULL) {
+		BenchReport("Could not allocate I/O buffer - benchmark aborted");
+		ok = FALSE;
+		goto out;
+	}
+	// Fill the write data with noise, so that bridges that compress or
+	// deduplicate can't inflate the figures
+	wb = (uint32_t*)buffer;
+	for (n = 0; n < ((size_t)BENCH_MAX_BLOCK_SIZE * ASYNC_MAX_IN_FLIGHT) / sizeof(uint32_t); n++)
+		// coverity[dont_call]
+		wb[n] = ((uint32_t)rand() << 17) ^ ((uint32_t)rand() << 2) ^ (uint32_t)rand();
+
+	span = min(SelectedDrive.DiskSize, (uint64_t)BENCH_SPAN);
+	static_sprintf(line, "Benchmarking %s over a %s span:",
+		(name == NULL) ? "device" : name, SizeToHumanReadable(span, FALSE, FALSE));
+	BenchReport(line);
+
+	// Sequential passes. Reads come first, while the original data is still there to read.
+	for (pass = 0; (pass < 2) && ok; pass++) {
+		for (i = 0; (i < ARRAYSIZE(bench_block_size)) && ok; i++) {
+			for (j = 0; (j < ARRAYSIZE(bench_queue_depth)) && ok; j++) {
+				if ((uint64_t)bench_block_size[i] * bench_queue_depth[j] > span)
+					continue;
+				ok = BenchRun(hAsync, pass == 1, FALSE, bench_block_size[i],
+					bench_queue_depth[j], span, buffer, &speed);
+				if (benchmark_cancelled)
+					goto out;
+				if (!ok)
+					break;
+				static_sprintf(line, "  Sequential %s, %6s blocks, depth %lu: %8.1f MB/s",
+					(pass == 1) ? "write" : "read ",
+					SizeToHumanReadable(bench_block_size[i], FALSE, FALSE),
+					bench_queue_depth[j], speed);
+				BenchReport(line);
+				PostMessage(hProgressBar, PBM_SETPOS, (WPARAM)++run, 0);
+			}
+		}
+	}
+
+	// Random 4K passes
+	for (pass = 0; (pass < 2) && ok; pass++) {
+		ok = BenchRun(hAsync, pass == 1, TRUE, (DWORD)BENCH_RANDOM_BLOCK_SIZE, 1, span, buffer, &speed);
+		if (benchmark_cancelled)
+			goto out;
+		if (!ok)
+			break;
+		static_sprintf(line, "  Random     %s, %6s blocks, depth 1: %8.1f MB/s (%.0f IOPS)",
+			(pass == 1) ? "write" : "read ",
+			SizeToHumanReadable(BENCH_RANDOM_BLOCK_SIZE, FALSE, FALSE),
+			speed, speed * 1.0e6 / (double)BENCH_RANDOM_BLOCK_SIZE);
+		BenchReport(line);
+		PostMessage(hProgressBar, PBM_SETPOS, (WPARAM)++run, 0);
+	}
+
+out:
+	if (benchmark_cancelled)
+		BenchReport("Benchmark cancelled");
+	else if (!ok)
+		BenchReport("Benchmark aborted on error");
+	else
+		BenchReport("Benchmark complete");
+	if (buffer != NULL)
+		_mm_free(buffer);
+	CloseFileAsync(hAsync);
+	safe_closehandle(hPhysical);
+	safe_free(name);
+	PostMessage(hBenchmarkDialog, UM_BENCHMARK_EXIT, 0, 0);
+	ExitThread(0);
+}
+
+/*
+ * Benchmark dialog callback
+ */
+INT_PTR CALLBACK BenchmarkCallback(HWND hDlg, UINT message, WPARAM wParam, LPARAM lParam)
+{
+	int len;
+	DWORD DeviceNum;
+	HFONT hFont;
+	HDC hDC;
+	char* line;
+
+	switch (message) {
+	case WM_INITDIALOG:
+		hBenchmarkDialog = hDlg;
+		benchmark_cancelled = FALSE;
+		benchmark_close_requested = FALSE;
+		// Use a fixed width font so that the report columns line up
+		hDC = GetDC(hDlg);
+		hFont = CreateFontA(-MulDiv(9, GetDeviceCaps(hDC, LOGPIXELSY), 72),
+			0, 0, 0, FW_NORMAL, FALSE, FALSE, FALSE, DEFAULT_CHARSET,
+			0, 0, PROOF_QUALITY, 0, "Courier New");
+		safe_release_dc(hDlg, hDC);
+		SendDlgItemMessageA(hDlg, IDC_BENCHMARK_REPORT, WM_SETFONT, (WPARAM)hFont, TRUE);
+		SendDlgItemMessage(hDlg, IDC_BENCHMARK_PROGRESS, PBM_SETRANGE, 0, MAKELPARAM(0, BENCH_NUM_RUNS));
+		ResizeButtonHeight(hDlg, IDC_BENCHMARK_START);
+		ResizeButtonHeight(hDlg, IDCANCEL);
+		CenterDialog(hDlg, NULL);
+		break;
+	case WM_COMMAND:
+		switch (LOWORD(wParam)) {
+		case IDC_BENCHMARK_START:
+			if ((benchmark_thread != NULL) || (ComboBox_GetCurSel(hDeviceList) < 0))
+				return (INT_PTR)TRUE;
+			DeviceNum = (DWORD)ComboBox_GetItemData(hDeviceList, ComboBox_GetCurSel(hDeviceList));
+			if (MessageBoxExU(hDlg, "The benchmark writes test patterns directly to the device.\n"
+				"ALL DATA ON THE DEVICE WILL BE IRRECOVERABLY DESTROYED.\n\n"
+				"Do you want to continue?", "Device Benchmark",
+				MB_YESNO | MB_ICONWARNING | MB_IS_RTL, selected_langid) != IDYES)
+				return (INT_PTR)TRUE;
+			SetWindowTextA(GetDlgItem(hDlg, IDC_BENCHMARK_REPORT), "");
+			SendDlgItemMessage(hDlg, IDC_BENCHMARK_PROGRESS, PBM_SETPOS, 0, 0);
+			benchmark_cancelled = FALSE;
+			benchmark_thread = CreateThread(NULL, 0, BenchmarkThread, (LPVOID)(uintptr_t)DeviceNum, 0, NULL);
+			if (benchmark_thread == NULL)
+				uprintf("Unable to start benchmark thread");
+			else
+				EnableWindow(GetDlgItem(hDlg, IDC_BENCHMARK_START), FALSE);
+			return (INT_PTR)TRUE;
+		case IDCANCEL:
+			if (benchmark_thread != NULL) {
+				// Ask the thread to wind down and close once it has exited
+				benchmark_cancelled = TRUE;
+				benchmark_close_requested = TRUE;
+				return (INT_PTR)TRUE;
+			}
+			EndDialog(hDlg, LOWORD(wParam));
+			return (INT_PTR)TRUE;
+		}
+		break;
+	case UM_BENCHMARK_LINE:
+		line = (char*)lParam;
+		if (line != NULL) {
+			len = GetWindowTextLengthA(GetDlgItem(hDlg, IDC_BENCHMARK_REPORT));
+			SendDlgItemMessageA(hDlg, IDC_BENCHMARK_REPORT, EM_SETSEL, (WPARAM)len, (LPARAM)len);
+			SendDlgItemMessageA(hDlg, IDC_BENCHMARK_REPORT, EM_REPLACESEL, (WPARAM)FALSE, (LPARAM)line);
+			SendDlgItemMessageA(hDlg, IDC_BENCHMARK_REPORT, EM_REPLACESEL, (WPARAM)FALSE, (LPARAM)"\r\n");
+			free(line);
+		}
+		return (INT_PTR)TRUE;
+	case UM_BENCHMARK_EXIT:
+		if (benchmark_thread != NULL) {
+			CloseHandle(benchmark_thread);
+			benchmark_thread = NULL;
+		}
+		EnableWindow(GetDlgItem(hDlg, IDC_BENCHMARK_START), TRUE);
+		if (benchmark_close_requested)
+			EndDialog(hDlg, IDCANCEL);
+		return (INT_PTR)TRUE;
+	}
+	return (INT_PTR)FALSE;
+}
@@ -210,11 +210,14 @@ typedef struct transformer_state_t {
 
 	/* Source */
 	int         src_fd;
+	const char  *mem_input_buf;         /* if non-NULL, decompress from RAM instead of src_fd */
+	size_t      mem_input_size;
 	/* Output */
 	int         dst_fd;
 	const char  *dst_dir;               /* if non-NULL, extract to dir */
 	char        *dst_name;
 	uint64_t    dst_size;
+	uint64_t    dst_skip;               /* discard this many leading output bytes (resume support) */
 	size_t      mem_output_size_max;    /* if non-zero, decompress to RAM instead of fd */
 	size_t      mem_output_size;
 	char        *mem_output_buf;
@@ -267,6 +270,7 @@ IF_DESKTOP(long long) int unpack_bz2_stream(transformer_state_t *xstate) FAST_FU
 IF_DESKTOP(long long) int unpack_lzma_stream(transformer_state_t *xstate) FAST_FUNC;
 IF_DESKTOP(long long) int unpack_xz_stream(transformer_state_t *xstate) FAST_FUNC;
 IF_DESKTOP(long long) int unpack_vtsi_stream(transformer_state_t *xstate) FAST_FUNC;
+IF_DESKTOP(long long) int unpack_zstd_stream(transformer_state_t *xstate) FAST_FUNC;
 
 char* append_ext(char *filename, const char *expected_ext) FAST_FUNC;
 int bbunpack(char **argv,
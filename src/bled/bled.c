@@ -26,6 +26,7 @@ write_t bled_write = NULL;
 progress_t bled_progress = NULL;
 switch_t bled_switch = NULL;
 unsigned long* bled_cancel_request;
+uint32_t bled_buffer_size = BB_BUFSIZE;
 static bool bled_initialized = 0;
 jmp_buf bb_error_jmp;
 char* bb_virtual_buf = NULL;
@@ -38,6 +39,46 @@ static long long int unpack_none(transformer_state_t *xstate)
 	return -1;
 }
 
+/*
+ * Decompressor buffer pool. The large scratch buffers the decompressors use
+ * (LZ77 windows, bzip2 block buffers, I/O staging) used to be allocated and
+ * freed on every call, even when WriteDrive() or uncompress_to_dir() process
+ * many archive members back-to-back. The pool hands the same allocations back
+ * across calls, keyed by compression type plus a per-decompressor slot number,
+ * which removes the repeated multi-MB allocations (and their page zeroing
+ * cost) from the archive hot path. The buffers belong to the pool: callers
+ * must not free them, and they are only released on bled_exit().
+ */
+static struct {
+	void* buf;
+	size_t size;
+} bled_pool[BLED_COMPRESSION_MAX][BLED_POOL_SLOTS];
+
+void* bled_pool_get(int type, int slot, size_t size)
+{
+	if ((type < 0) || (type >= BLED_COMPRESSION_MAX) || (slot < 0) || (slot >= BLED_POOL_SLOTS))
+		return NULL;
+	if (bled_pool[type][slot].size < size) {
+		free(bled_pool[type][slot].buf);
+		bled_pool[type][slot].buf = malloc(size);
+		bled_pool[type][slot].size = (bled_pool[type][slot].buf == NULL) ? 0 : size;
+	}
+	return bled_pool[type][slot].buf;
+}
+
+static void bled_pool_drop(void)
+{
+	int i, j;
+
+	for (i = 0; i < BLED_COMPRESSION_MAX; i++) {
+		for (j = 0; j < BLED_POOL_SLOTS; j++) {
+			free(bled_pool[i][j].buf);
+			bled_pool[i][j].buf = NULL;
+			bled_pool[i][j].size = 0;
+		}
+	}
+}
+
 unpacker_t unpacker[BLED_COMPRESSION_MAX] = {
 	unpack_none,
 	unpack_zip_stream,
@@ -48,6 +89,7 @@ unpacker_t unpacker[BLED_COMPRESSION_MAX] = {
 	unpack_xz_stream,
 	unpack_none,
 	unpack_vtsi_stream,
+	unpack_zstd_stream,
 };
 
 /* Uncompress file 'src', compressed using 'type', to file 'dst' */
@@ -84,14 +126,20 @@ int64_t bled_uncompress(const char* src, const char* dst, int type)
 		goto err;
 	}
 
+	// zip seeks its source, which a sequential prefetcher can't deal with
+	if (type != BLED_COMPRESSION_ZIP)
+		bb_read_ahead_start(xstate.src_fd);
+
 	if (setjmp(bb_error_jmp))
 		goto err;
 	ret = unpacker[type](&xstate);
+	bb_read_ahead_stop();
 	_close(xstate.src_fd);
 	_close(xstate.dst_fd);
 	return ret;
 
 err:
+	bb_read_ahead_stop();
 	if (xstate.src_fd > 0)
 		_close(xstate.src_fd);
 	if (xstate.dst_fd > 0)
@@ -99,10 +147,11 @@ err:
 	return -1;
 }
 
-/* Uncompress using Windows handles */
-int64_t bled_uncompress_with_handles(HANDLE hSrc, HANDLE hDst, int type)
+/* Uncompress using Windows handles, resuming output at 'dst_offset' */
+int64_t bled_uncompress_with_handles_at(HANDLE hSrc, HANDLE hDst, int type, uint64_t dst_offset)
 {
 	transformer_state_t xstate;
+	int64_t ret;
 
 	if (!bled_initialized) {
 		bb_error_msg("The library has not been initialized");
@@ -114,6 +163,7 @@ int64_t bled_uncompress_with_handles(HANDLE hSrc, HANDLE hDst, int type)
 	xstate.src_fd = -1;
 	xstate.dst_fd = -1;
 	xstate.check_signature = 1;
+	xstate.dst_skip = dst_offset;
 
 	xstate.src_fd = _open_osfhandle((intptr_t)hSrc, _O_RDONLY);
 	if (xstate.src_fd < 0) {
@@ -132,9 +182,22 @@ int64_t bled_uncompress_with_handles(HANDLE hSrc, HANDLE hDst, int type)
 		return -1;
 	}
 
-	if (setjmp(bb_error_jmp))
+	if (type != BLED_COMPRESSION_ZIP)
+		bb_read_ahead_start(xstate.src_fd);
+
+	if (setjmp(bb_error_jmp)) {
+		bb_read_ahead_stop();
 		return -1;
-	return unpacker[type](&xstate);
+	}
+	ret = unpacker[type](&xstate);
+	bb_read_ahead_stop();
+	return ret;
+}
+
+/* Uncompress using Windows handles */
+int64_t bled_uncompress_with_handles(HANDLE hSrc, HANDLE hDst, int type)
+{
+	return bled_uncompress_with_handles_at(hSrc, hDst, type, 0);
 }
 
 /* Uncompress file 'src', compressed using 'type', to buffer 'buf' of size 'size' */
@@ -178,14 +241,19 @@ int64_t bled_uncompress_to_buffer(const char* src, char* buf, size_t size, int t
 		goto err;
 	}
 
+	if ((src[0] != 0) && (type != BLED_COMPRESSION_ZIP))
+		bb_read_ahead_start(xstate.src_fd);
+
 	if (setjmp(bb_error_jmp))
 		goto err;
 	ret = unpacker[type](&xstate);
+	bb_read_ahead_stop();
 	if (src[0] != 0)
 		_close(xstate.src_fd);
 	return ret;
 
 err:
+	bb_read_ahead_stop();
 	if (xstate.src_fd > 0)
 		_close(xstate.src_fd);
 	return -1;
@@ -272,7 +340,10 @@ int64_t bled_uncompress_from_buffer_to_buffer(const char* src, const size_t src_
 }
 
 /* Initialize the library.
- * When the parameters are not NULL you can:
+ * When the parameters are not 0/NULL you can:
+ * - specify the size of the buffers used for decompression, so that large
+ *   dictionary images don't have to cycle through small embedded-sized chunks
+ *   (anything smaller than the default is ignored);
  * - specify the printf-like function you want to use to output message
  *   void print_function(const char* format, ...);
  * - specify the read/write functions you want to use;
@@ -282,12 +353,13 @@ int64_t bled_uncompress_from_buffer_to_buffer(const char* src, const size_t src_
  *   void switch_function(const char* filename, const uint64_t filesize);
  * - point to an unsigned long variable, to be used to cancel operations when set to non zero
  */
-int bled_init(printf_t print_function, read_t read_function, write_t write_function, 
+int bled_init(uint32_t buffer_size, printf_t print_function, read_t read_function, write_t write_function, 
 	progress_t progress_function, switch_t switch_function, unsigned long* cancel_request)
 {
 	if (bled_initialized)
 		return -1;
 	bled_initialized = true;
+	bled_buffer_size = MAX(buffer_size, BB_BUFSIZE);
 	bled_printf = print_function;
 	bled_read = read_function;
 	bled_write = write_function;
@@ -300,10 +372,12 @@ int bled_init(printf_t print_function, read_t read_function, write_t write_funct
 /* This call frees any resource used by the library */
 void bled_exit(void)
 {
+	bled_buffer_size = BB_BUFSIZE;
 	bled_printf = NULL;
 	bled_progress = NULL;
 	bled_switch = NULL;
 	bled_cancel_request = NULL;
+	bled_pool_drop();
 	if (global_crc32_table) {
 		free(global_crc32_table);
 		global_crc32_table = NULL;
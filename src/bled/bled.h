@@ -31,6 +31,7 @@ typedef enum {
 	BLED_COMPRESSION_XZ,		// .xz
 	BLED_COMPRESSION_7ZIP,		// .7z
 	BLED_COMPRESSION_VTSI,		// .vtsi
+	BLED_COMPRESSION_ZSTD,		// .zst
 	BLED_COMPRESSION_MAX
 } bled_compression_type;
 
@@ -40,6 +41,12 @@ int64_t bled_uncompress(const char* src, const char* dst, int type);
 /* Uncompress using Windows handles */
 int64_t bled_uncompress_with_handles(HANDLE hSrc, HANDLE hDst, int type);
 
+/* Same as the above, but resume output at uncompressed offset 'dst_offset'.
+ * Decompression restarts from the nearest independent unit in the archive
+ * (e.g. a Zstandard frame boundary) and earlier output is discarded, so a
+ * retry at offset X does not rewrite the [0, X) range. */
+int64_t bled_uncompress_with_handles_at(HANDLE hSrc, HANDLE hDst, int type, uint64_t dst_offset);
+
 /* Uncompress file 'src', compressed using 'type', to buffer 'buf' of size 'size' */
 int64_t bled_uncompress_to_buffer(const char* src, char* buf, size_t size, int type);
 
@@ -50,7 +57,9 @@ int64_t bled_uncompress_to_dir(const char* src, const char* dir, int type);
 int64_t bled_uncompress_from_buffer_to_buffer(const char* src, const size_t src_len, char* dst, size_t dst_len, int type);
 
 /* Initialize the library.
- * When the parameters are not NULL you can:
+ * When the parameters are not 0/NULL you can:
+ * - specify the size of the buffers used for decompression (e.g. the xz
+ *   input/output chunks), with anything smaller than the default ignored;
  * - specify the printf-like function you want to use to output message
  *   void print_function(const char* format, ...);
  * - specify the read/write functions you want to use;
@@ -60,7 +69,7 @@ int64_t bled_uncompress_from_buffer_to_buffer(const char* src, const size_t src_
  *   void switch_function(const char* filename, const uint64_t filesize);
  * - point to an unsigned long variable, to be used to cancel operations when set to non zero
  */
-int bled_init(printf_t print_function, read_t read_function, write_t write_function,
+int bled_init(uint32_t buffer_size, printf_t print_function, read_t read_function, write_t write_function,
     progress_t progress_function, switch_t switch_function, unsigned long* cancel_request);
 
 /* This call frees any resource used by the library */
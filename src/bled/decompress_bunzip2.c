@@ -39,8 +39,10 @@
 	Manuel
  */
 
+#include <windows.h>	/* Worker pool for multi-stream (pbzip2) files */
 #include "libbb.h"
 #include "bb_archive.h"
+#include "bled.h"
 
 #if 0
 # define dbg(...) bb_error_msg(__VA_ARGS__)
@@ -678,8 +680,17 @@ int FAST_FUNC start_bunzip(bunzip_data **bdp, int in_fd,
 	i = sizeof(bunzip_data);
 	if (in_fd != -1) i += IOBUF_SIZE;
 
-	/* Allocate bunzip_data.  Most fields initialize to zero. */
-	bd = *bdp = xzalloc(i);
+	/* Allocate bunzip_data.  Most fields initialize to zero.
+	 * The file-backed (sequential) path runs once per BZ stream, so it draws
+	 * its state from the buffer pool; the memory-backed path is used by the
+	 * parallel workers, which must keep their own private allocations. */
+	if (in_fd != -1) {
+		bd = *bdp = bled_pool_get(BLED_COMPRESSION_BZIP2, 0, i);
+		if (bd != NULL)
+			memset(bd, 0, i);
+	} else {
+		bd = *bdp = xzalloc(i);
+	}
 	if (bd == NULL)
 		return -1;
 
@@ -716,21 +727,272 @@ int FAST_FUNC start_bunzip(bunzip_data **bdp, int in_fd,
 	bd->dbufSize = 100000 * (i - h0);
 
 	/* Cannot use xmalloc - may leak bd in NOFORK case! */
-	bd->dbuf = malloc_or_warn(bd->dbufSize * sizeof(bd->dbuf[0]));
+	if (bd->in_fd != -1)
+		bd->dbuf = bled_pool_get(BLED_COMPRESSION_BZIP2, 1, bd->dbufSize * sizeof(bd->dbuf[0]));
+	else
+		bd->dbuf = malloc_or_warn(bd->dbufSize * sizeof(bd->dbuf[0]));
 	if (!bd->dbuf) {
-		free(bd);
-		xfunc_die();
+		/* Can't xfunc_die() here: start_bunzip() may now be running on a
+		 * worker thread, where longjmp'ing to the main thread's error
+		 * handler would be fatal. Report the failure to the caller. */
+		if (bd->in_fd == -1) {
+			free(bd);
+			*bdp = NULL;
+		}
+		return RETVAL_OUT_OF_MEMORY;
 	}
 	return RETVAL_OK;
 }
 
 void FAST_FUNC dealloc_bunzip(bunzip_data *bd)
 {
+	if (bd == NULL)
+		return;
+	/* The file-backed state belongs to the buffer pool */
+	if (bd->in_fd != -1)
+		return;
 	free(bd->dbuf);
 	free(bd);
 }
 
 
+/*
+ * Parallel decode of multi-stream (pbzip2-style) files.
+ *
+ * A plain bzip2 file is a single stream whose blocks start at arbitrary *bit*
+ * offsets, which makes intra-stream parallelism impractical here. But pbzip2
+ * and friends produce a concatenation of small independent "BZh" streams,
+ * each byte aligned, and those can be carved out with a signature scan and
+ * decoded concurrently. The main thread scans the input, hands one stream per
+ * job to a small pool of workers, and writes the decoded data back in stream
+ * order through the usual transformer_write() plumbing.
+ */
+
+#define BZ2_NUM_WORKERS     4
+#define BZ2_SCAN_CHUNK      IOBUF_SIZE
+#define BZ2_SIG_LEN         10
+
+typedef struct {
+	HANDLE thread;
+	HANDLE start;		/* Signaled by main thread: job ready (or quit) */
+	HANDLE done;		/* Signaled by worker: job complete */
+	uint8_t *in;		/* Compressed stream, starting at "BZ" */
+	size_t in_len, in_cap;
+	char *out;		/* Decoded stream data */
+	size_t out_len, out_cap;
+	int status;		/* RETVAL_OK or RETVAL_* error */
+	smallint quit;
+} bz2_worker_t;
+
+/* Find the next byte aligned stream signature: "BZh['1'-'9']" immediately
+ * followed by the first block magic (pi digits). A 10 byte match can not
+ * realistically occur inside compressed data. */
+static size_t bz2_find_sig(const uint8_t *buf, size_t start, size_t len)
+{
+	static const uint8_t block_magic[6] = { 0x31, 0x41, 0x59, 0x26, 0x53, 0x59 };
+	size_t i;
+
+	for (i = start; i + BZ2_SIG_LEN <= len; i++) {
+		if (buf[i] == 'B' && buf[i + 1] == 'Z' && buf[i + 2] == 'h'
+		 && (unsigned)(buf[i + 3] - '1') <= 8
+		 && memcmp(&buf[i + 4], block_magic, sizeof(block_magic)) == 0)
+			return i;
+	}
+	return (size_t)-1;
+}
+
+static DWORD WINAPI bz2_worker_thread(LPVOID param)
+{
+	bz2_worker_t *w = (bz2_worker_t*)param;
+	bunzip_data *bd;
+	char *p;
+	int i;
+
+	for (;;) {
+		WaitForSingleObject(w->start, INFINITE);
+		if (w->quit)
+			return 0;
+		w->out_len = 0;
+		i = start_bunzip(&bd, -1, w->in + 2, (int)(w->in_len - 2));
+		if (i == 0) {
+			while (1) {
+				if (w->out_cap - w->out_len < IOBUF_SIZE) {
+					/* Plain realloc: the x*() allocators die through a
+					 * longjmp on the main thread and can't be used here */
+					p = realloc(w->out, w->out_cap + 8 * IOBUF_SIZE);
+					if (p == NULL) {
+						i = RETVAL_OUT_OF_MEMORY;
+						break;
+					}
+					w->out = p;
+					w->out_cap += 8 * IOBUF_SIZE;
+				}
+				i = read_bunzip(bd, w->out + w->out_len, IOBUF_SIZE);
+				if (i < 0) /* error? */
+					break;
+				i = IOBUF_SIZE - i; /* number of bytes produced */
+				if (i == 0) /* EOF? */
+					break;
+				w->out_len += i;
+			}
+			/* RETVAL_LAST_BLOCK is the normal end of stream (see the
+			 * sequential loop below for the RETVAL_OK oddity) */
+			if (i == RETVAL_LAST_BLOCK || i == RETVAL_OK)
+				i = (bd->headerCRC != bd->totalCRC) ? RETVAL_DATA_ERROR : RETVAL_OK;
+		}
+		dealloc_bunzip(bd);
+		w->status = i;
+		SetEvent(w->done);
+	}
+}
+
+/* Wait for a worker's job and write its output in order. Returns RETVAL_OK,
+ * a RETVAL_* error, or xstate->mem_output_size_max on -ENOSPC (mirroring the
+ * sequential loop). With discard set, output and errors are thrown away. */
+static int bz2_collect(transformer_state_t *xstate, bz2_worker_t *w,
+		long long *written, smallint discard)
+{
+	int nwrote;
+
+	WaitForSingleObject(w->done, INFINITE);
+	if (discard)
+		return RETVAL_OK;
+	if (w->status != 0)
+		return w->status;
+	if (w->out_len != 0) {
+		nwrote = (int)transformer_write(xstate, w->out, w->out_len);
+		if (nwrote != (int)w->out_len)
+			return (nwrote == -ENOSPC)?(int)xstate->mem_output_size_max:RETVAL_SHORT_WRITE;
+		*written += w->out_len;
+	}
+	return RETVAL_OK;
+}
+
+/* Decode the remaining streams of a multi-stream file on a worker pool.
+ * seed holds the first seed_len bytes of the next stream (starting with "BZ").
+ * Returns TRUE if the parallel path ran, with *status and *written filled in,
+ * or FALSE if no pool could be set up (caller should decode sequentially). */
+static smallint unpack_bz2_parallel(transformer_state_t *xstate,
+		const void *seed, unsigned seed_len, int *status, long long *written)
+{
+	bz2_worker_t worker[BZ2_NUM_WORKERS];
+	bz2_worker_t *w;
+	uint8_t *inbuf = NULL, *p;
+	size_t in_len, in_cap, scan, next;
+	unsigned job = 0, collected = 0;
+	smallint eof = 0, ok = 1;
+	int i, rb;
+
+	*status = RETVAL_OK;
+	*written = 0;
+	memset(worker, 0, sizeof(worker));
+	for (i = 0; i < BZ2_NUM_WORKERS; i++) {
+		worker[i].start = CreateEvent(NULL, FALSE, FALSE, NULL);
+		worker[i].done = CreateEvent(NULL, FALSE, FALSE, NULL);
+		if (worker[i].start != NULL && worker[i].done != NULL)
+			worker[i].thread = CreateThread(NULL, 0, bz2_worker_thread, &worker[i], 0, NULL);
+		if (worker[i].thread == NULL)
+			goto no_pool;
+	}
+	in_cap = seed_len + BZ2_SCAN_CHUNK;
+	inbuf = malloc(in_cap);
+	if (inbuf == NULL)
+		goto no_pool;
+	memcpy(inbuf, seed, seed_len);
+	in_len = seed_len;
+	scan = 1;
+
+	while (1) {
+		next = bz2_find_sig(inbuf, scan, in_len);
+		if (next == (size_t)-1) {
+			if (!eof) {
+				/* Resume past the point a boundary signature could straddle */
+				scan = (in_len >= BZ2_SIG_LEN) ? in_len - (BZ2_SIG_LEN - 1) : 1;
+				while (in_cap - in_len < BZ2_SCAN_CHUNK)
+					in_cap *= 2;
+				p = realloc(inbuf, in_cap);
+				if (p == NULL) {
+					*status = RETVAL_OUT_OF_MEMORY;
+					break;
+				}
+				inbuf = p;
+				rb = safe_read(xstate->src_fd, inbuf + in_len, BZ2_SCAN_CHUNK);
+				if (rb < 0) {
+					*status = RETVAL_UNEXPECTED_INPUT_EOF;
+					break;
+				}
+				if (rb == 0)
+					eof = 1;
+				in_len += rb;
+				continue;
+			}
+			if (in_len == 0)
+				break;
+			next = in_len;	/* Last stream runs to end of input */
+		}
+		/* Hand the [0, next) stream to the next worker, collecting the
+		 * job it ran BZ2_NUM_WORKERS dispatches ago first */
+		w = &worker[job % BZ2_NUM_WORKERS];
+		if (job >= BZ2_NUM_WORKERS) {
+			i = bz2_collect(xstate, w, written, FALSE);
+			collected++;
+			if (i != RETVAL_OK) {
+				*status = i;
+				break;
+			}
+		}
+		if (w->in_cap < next) {
+			p = realloc(w->in, next);
+			if (p == NULL) {
+				*status = RETVAL_OUT_OF_MEMORY;
+				break;
+			}
+			w->in = p;
+			w->in_cap = next;
+		}
+		memcpy(w->in, inbuf, next);
+		w->in_len = next;
+		SetEvent(w->start);
+		job++;
+		memmove(inbuf, inbuf + next, in_len - next);
+		in_len -= next;
+		scan = 1;
+		if (eof && in_len == 0)
+			break;
+	}
+
+	/* Drain the remaining jobs, in order, discarding output after an error */
+	for (; collected < job; collected++) {
+		w = &worker[collected % BZ2_NUM_WORKERS];
+		i = bz2_collect(xstate, w, written, *status != RETVAL_OK);
+		if (*status == RETVAL_OK)
+			*status = i;
+	}
+	goto out;
+
+ no_pool:
+	ok = 0;
+ out:
+	for (i = 0; i < BZ2_NUM_WORKERS; i++) {
+		w = &worker[i];
+		if (w->thread != NULL) {
+			w->quit = 1;
+			SetEvent(w->start);
+			WaitForSingleObject(w->thread, INFINITE);
+			CloseHandle(w->thread);
+		}
+		if (w->start != NULL)
+			CloseHandle(w->start);
+		if (w->done != NULL)
+			CloseHandle(w->done);
+		free(w->in);
+		free(w->out);
+	}
+	free(inbuf);
+	return ok;
+}
+
+
 /* Decompress src_fd to dst_fd.  Stops at end of bzip data, not end of file. */
 IF_DESKTOP(long long) int FAST_FUNC
 unpack_bz2_stream(transformer_state_t *xstate)
@@ -744,7 +1006,7 @@ unpack_bz2_stream(transformer_state_t *xstate)
 	if (check_signature16(xstate, BZIP2_MAGIC))
 		return -1;
 
-	outbuf = xmalloc(IOBUF_SIZE);
+	outbuf = bled_pool_get(BLED_COMPRESSION_BZIP2, 2, IOBUF_SIZE);
 	if (outbuf == NULL)
 		return -1;
 	len = 0;
@@ -800,13 +1062,24 @@ unpack_bz2_stream(transformer_state_t *xstate)
 		}
 		if (*(uint16_t*)outbuf != BZIP2_MAGIC) /* "BZ"? */
 			break;
+		/* Multi-stream (pbzip2-style) file: decode the remaining streams
+		 * on a worker pool. Falls back to the sequential loop below if
+		 * the pool can't be created. */
+		{
+			long long parallel_written;
+			if (unpack_bz2_parallel(xstate, outbuf, len, &i, &parallel_written)) {
+				if (i < 0)
+					bb_error_msg("bunzip error %d", i);
+				IF_DESKTOP(total_written += parallel_written;)
+				break;
+			}
+		}
 		dealloc_bunzip(bd);
 		len -= 2;
 	}
 
  release_mem:
 	dealloc_bunzip(bd);
-	free(outbuf);
 
 	return i ? i : IF_DESKTOP(total_written) + 0;
 }
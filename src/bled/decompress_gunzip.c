@@ -36,6 +36,7 @@
 #include <setjmp.h>
 #include "libbb.h"
 #include "bb_archive.h"
+#include "bled.h"
 
 typedef struct huft_t {
 	unsigned char e;	/* number of extra bits or operation */
@@ -86,6 +87,9 @@ typedef struct state_t {
 	/* input (compressed) data */
 	unsigned char *bytebuffer;      /* buffer itself */
 	off_t to_read;			/* compressed bytes to read (unzip only, -1 for gunzip) */
+	const unsigned char *mem_input; /* if non-NULL, read compressed data from RAM instead of gunzip_src_fd */
+	size_t mem_input_len;
+	size_t mem_input_pos;
 //	unsigned bytebuffer_max;        /* buffer size */
 	unsigned bytebuffer_offset;     /* buffer position */
 	unsigned bytebuffer_size;       /* how much data is there (size <= max) */
@@ -128,6 +132,9 @@ typedef struct state_t {
 #define gunzip_bb           (S()gunzip_bb          )
 #define gunzip_bk           (S()gunzip_bk          )
 #define to_read             (S()to_read            )
+#define mem_input           (S()mem_input          )
+#define mem_input_len       (S()mem_input_len      )
+#define mem_input_pos       (S()mem_input_pos      )
 #define bytebuffer_max      BB_BUFSIZE
 #define bytebuffer          (S()bytebuffer         )
 #define bytebuffer_offset   (S()bytebuffer_offset  )
@@ -258,7 +265,15 @@ static unsigned fill_bitbuffer(STATE_PARAM unsigned bitbuffer, unsigned *current
 				sz = (unsigned)to_read;
 			/* Leave the first 4 bytes empty so we can always unwind the bitbuffer
 			 * to the front of the bytebuffer */
-			bytebuffer_size = safe_read(gunzip_src_fd, &bytebuffer[4], sz);
+			if (mem_input != NULL) {
+				if (sz > mem_input_len - mem_input_pos)
+					sz = (unsigned)(mem_input_len - mem_input_pos);
+				memcpy(&bytebuffer[4], &mem_input[mem_input_pos], sz);
+				mem_input_pos += sz;
+				bytebuffer_size = sz;
+			} else {
+				bytebuffer_size = safe_read(gunzip_src_fd, &bytebuffer[4], sz);
+			}
 			if ((int)bytebuffer_size < 1) {
 				error_msg = "unexpected end of file";
 				abort_unzip(PASS_STATE_ONLY);
@@ -976,7 +991,9 @@ inflate_unzip_internal(STATE_PARAM transformer_state_t *xstate)
 	ssize_t nwrote;
 
 	/* Allocate all global buffers (for DYN_ALLOC option) */
-	gunzip_window = xmalloc(GUNZIP_WSIZE);
+	gunzip_window = bled_pool_get(BLED_COMPRESSION_GZIP, 0, GUNZIP_WSIZE);
+	if (gunzip_window == NULL)
+		bb_error_msg_and_die("alloc error");
 	gunzip_outbuf_count = 0;
 	gunzip_bytes_out = 0;
 	gunzip_src_fd = xstate->src_fd;
@@ -1021,8 +1038,7 @@ inflate_unzip_internal(STATE_PARAM transformer_state_t *xstate)
 		gunzip_bk -= 8;
 	}
  ret:
-	/* Cleanup */
-	free(gunzip_window);
+	/* Cleanup (gunzip_window belongs to the pool) */
 	free(gunzip_crc_table);
 	return n;
 }
@@ -1043,11 +1059,17 @@ inflate_unzip(transformer_state_t *xstate)
 		return -1;
 
 	to_read = xstate->bytes_in;
+	mem_input = (const unsigned char*)xstate->mem_input_buf;
+	mem_input_len = xstate->mem_input_size;
+	mem_input_pos = 0;
 //	bytebuffer_max = 0x8000;
 	bytebuffer_offset = 4;
-	bytebuffer = xmalloc(bytebuffer_max);
+	bytebuffer = bled_pool_get(BLED_COMPRESSION_GZIP, 1, bytebuffer_max);
+	if (bytebuffer == NULL) {
+		DEALLOC_STATE;
+		return -1;
+	}
 	n = inflate_unzip_internal(PASS_STATE xstate);
-	free(bytebuffer);
 
 	xstate->crc32 = gunzip_crc;
 	xstate->bytes_out = gunzip_bytes_out;
@@ -1220,7 +1242,7 @@ unpack_gz_stream(transformer_state_t *xstate)
 	}
 	to_read = -1;
 //	bytebuffer_max = 0x8000;
-	bytebuffer = xmalloc(bytebuffer_max);
+	bytebuffer = bled_pool_get(BLED_COMPRESSION_GZIP, 1, bytebuffer_max);
 	if (bytebuffer == NULL) {
 		bb_error_msg("alloc error");
 		total = -1;
@@ -1276,7 +1298,6 @@ unpack_gz_stream(transformer_state_t *xstate)
 	/*bb_error_msg("decompression OK, trailing garbage ignored");*/
 
  ret:
-	free(bytebuffer);
 	DEALLOC_STATE;
 	return total;
 }
@@ -10,6 +10,7 @@
  */
 #include "libbb.h"
 #include "bb_archive.h"
+#include "bled.h"
 
 #if ENABLE_FEATURE_LZMA_FAST
 #  define speed_inline ALWAYS_INLINE
@@ -250,13 +251,17 @@ unpack_lzma_stream(transformer_state_t *xstate)
 	if (header.dict_size == 0)
 		header.dict_size++;
 
-	buffer = xmalloc((size_t)MIN(header.dst_size, header.dict_size));
+	buffer = bled_pool_get(BLED_COMPRESSION_LZMA, 0, (size_t)MIN(header.dst_size, header.dict_size));
+	if (buffer == NULL)
+		bb_error_msg_and_die("alloc error");
 
 	{
 		int num_probs;
 
 		num_probs = LZMA_BASE_SIZE + (LZMA_LIT_SIZE << (lc + lp));
-		p = xmalloc(num_probs * sizeof(*p));
+		p = bled_pool_get(BLED_COMPRESSION_LZMA, 1, num_probs * sizeof(*p));
+		if (p == NULL)
+			bb_error_msg_and_die("alloc error");
 		num_probs += LZMA_LITERAL - LZMA_BASE_SIZE;
 		for (i = 0; i < num_probs; i++)
 			p[i] = (1 << RC_MODEL_TOTAL_BITS) >> 1;
@@ -466,8 +471,6 @@ unpack_lzma_stream(transformer_state_t *xstate)
 			total_written = (nwrote == -ENOSPC)?xstate->mem_output_size_max:-1;
 		}
 		rc_free(rc);
-		free(p);
-		free(buffer);
 		return total_written;
 	}
 }
@@ -7,14 +7,18 @@
  * Licensed under GPLv2 or later, see file LICENSE in this source tree.
  */
 
+#include <windows.h>	/* Worker pool for block-parallel files */
 #include "libbb.h"
 #include "bb_archive.h"
+#include "bled.h"
 
 #define XZ_EXTERN static
 // We get XZ_OPTIONS_ERROR in xz_dec_stream if this is not defined
 #define XZ_DEC_ANY_CHECK
 
-#define XZ_BUFSIZE BB_BUFSIZE
+// Runtime sized, so that bled_init() callers on desktop hosts can enlarge
+// the chunks instead of cycling the embedded-profile 256 KB buffers.
+#define XZ_BUFSIZE bled_buffer_size
 
 #include "xz_dec_bcj.c"
 #include "xz_dec_lzma2.c"
@@ -32,6 +36,349 @@ static uint32_t XZ_FUNC xz_crc32(const uint8_t *buf, size_t size, uint32_t crc)
 	return ~crc32_block_endian0(~crc, buf, size, global_crc32_table);
 }
 
+
+/*
+ * Block-parallel decoding. xz archives produced in multi-threaded mode (the
+ * default for xz -T) consist of independent blocks whose headers carry both
+ * the compressed and the uncompressed size, which lets us carve the stream
+ * into blocks without decoding anything. Each block is wrapped into a
+ * synthetic single-block .xz stream and decoded on a small worker pool, with
+ * the output stitched back in order. Archives without per-block sizes (the
+ * single-threaded xz default) fall back to the sequential path below.
+ */
+
+#define XZ_NUM_WORKERS      4
+/* Per-block sanity cap; even xz -9e keeps blocks well below this */
+#define XZ_PAR_MAX_BLOCK    (1ULL << 30)
+
+typedef struct {
+	HANDLE thread;
+	HANDLE start;		/* Signaled by main thread: job ready (or quit) */
+	HANDLE done;		/* Signaled by worker: job complete */
+	uint8_t *in;		/* Synthetic single-block .xz stream */
+	size_t in_len, in_cap;
+	uint8_t *out;
+	size_t out_len, out_cap;
+	enum xz_ret status;
+	smallint quit;
+} xz_worker_t;
+
+static size_t xz_varint_enc(uint8_t *buf, uint64_t v)
+{
+	size_t n = 0;
+
+	while (v >= 0x80) {
+		buf[n++] = (uint8_t)(v | 0x80);
+		v >>= 7;
+	}
+	buf[n++] = (uint8_t)v;
+	return n;
+}
+
+static int xz_varint_dec(const uint8_t *buf, size_t len, size_t *pos, uint64_t *v)
+{
+	uint64_t val = 0;
+	int shift = 0;
+	uint8_t c;
+
+	while (*pos < len && shift < 63) {
+		c = buf[(*pos)++];
+		val |= (uint64_t)(c & 0x7F) << shift;
+		if (!(c & 0x80)) {
+			*v = val;
+			return 0;
+		}
+		shift += 7;
+	}
+	return -1;
+}
+
+/* Read exactly 'len' bytes, in BB_BUFSIZE sized reads */
+static int xz_read_all(int fd, uint8_t *buf, size_t len)
+{
+	int rb;
+
+	while (len > 0) {
+		rb = safe_read(fd, buf, (unsigned int)MIN(len, (size_t)BB_BUFSIZE));
+		if (rb <= 0)
+			return -1;
+		buf += rb;
+		len -= rb;
+	}
+	return 0;
+}
+
+static DWORD WINAPI xz_worker_thread(LPVOID param)
+{
+	xz_worker_t *w = (xz_worker_t*)param;
+	struct xz_dec *s;
+	struct xz_buf b;
+
+	for (;;) {
+		WaitForSingleObject(w->start, INFINITE);
+		if (w->quit)
+			return 0;
+		w->out_len = 0;
+		/* Single-call mode uses the output buffer as the dictionary,
+		 * so no per-block dictionary allocation is needed */
+		s = xz_dec_init(XZ_SINGLE, 0);
+		if (s == NULL) {
+			w->status = XZ_MEM_ERROR;
+		} else {
+			b.in = w->in;
+			b.in_pos = 0;
+			b.in_size = w->in_len;
+			b.out = w->out;
+			b.out_pos = 0;
+			b.out_size = w->out_cap;
+			w->status = xz_dec_run(s, &b);
+			w->out_len = b.out_pos;
+			if (w->status == XZ_STREAM_END)
+				w->status = XZ_OK;
+			else if (w->status == XZ_OK)
+				w->status = XZ_DATA_ERROR;
+			xz_dec_end(s);
+		}
+		SetEvent(w->done);
+	}
+}
+
+static enum xz_ret xz_collect(transformer_state_t *xstate, xz_worker_t *w,
+		long long *written, smallint discard)
+{
+	ssize_t nwrote;
+
+	WaitForSingleObject(w->done, INFINITE);
+	if (discard)
+		return XZ_OK;
+	if (w->status != XZ_OK)
+		return w->status;
+	nwrote = transformer_write(xstate, w->out, w->out_len);
+	if (nwrote == -ENOSPC)
+		return XZ_BUF_FULL;
+	if (nwrote != (ssize_t)w->out_len)
+		return XZ_DATA_ERROR;
+	*written += nwrote;
+	return XZ_OK;
+}
+
+/*
+ * Returns 1 if the pool ran (with the outcome in 'status'/'written'), or 0 if
+ * the caller should fall back to sequential decode, in which case *seed
+ * holds the input bytes this probe consumed, to be replayed first.
+ */
+static smallint unpack_xz_parallel(transformer_state_t *xstate, enum xz_ret *status,
+		long long *written, uint8_t **seed, size_t *seed_len)
+{
+	xz_worker_t worker[XZ_NUM_WORKERS];
+	xz_worker_t *w;
+	uint8_t *hdr = NULL, *p;
+	uint8_t idx[64], ftr[12];
+	uint64_t comp, uncomp, unpadded;
+	size_t header_size = 0, pad, pos, idx_len, total, consumed;
+	unsigned job = 0, collected = 0;
+	unsigned check_size, syn_check_size;
+	smallint ok = 1, drop_check = 0, warned = 0;
+	enum xz_ret r;
+	uint32_t crc;
+	int i, rb;
+
+	*status = XZ_OK;
+	*written = 0;
+	*seed = NULL;
+	*seed_len = 0;
+	memset(worker, 0, sizeof(worker));
+	for (i = 0; i < XZ_NUM_WORKERS; i++) {
+		worker[i].start = CreateEvent(NULL, FALSE, FALSE, NULL);
+		worker[i].done = CreateEvent(NULL, FALSE, FALSE, NULL);
+		if (worker[i].start != NULL && worker[i].done != NULL)
+			worker[i].thread = CreateThread(NULL, 0, xz_worker_thread, &worker[i], 0, NULL);
+		if (worker[i].thread == NULL)
+			goto no_pool;
+	}
+
+	/* 12 byte stream header plus the largest possible block header */
+	hdr = malloc(12 + 1024);
+	if (hdr == NULL)
+		goto no_pool;
+	rb = safe_read(xstate->src_fd, hdr, 12);
+	consumed = (rb > 0) ? rb : 0;
+	/* Anything unexpected in the headers is handed back to the sequential
+	 * path, which has the proper diagnostics for it */
+	if (rb != 12)
+		goto fallback;
+	if (memcmp(hdr, HEADER_MAGIC, HEADER_MAGIC_SIZE) != 0 || hdr[6] != 0 ||
+	    (hdr[7] & 0xF0) != 0 || (hdr[7] & 0x0F) > XZ_CHECK_MAX)
+		goto fallback;
+	check_size = (hdr[7] == 0) ? 0 : (4U << ((hdr[7] - 1) / 3));
+	/* Of the integrity checks only none and CRC32 can be verified (same as
+	 * the sequential path with XZ_DEC_ANY_CHECK): anything else is dropped
+	 * from the synthetic per-block streams */
+	drop_check = (hdr[7] > XZ_CHECK_CRC32);
+	syn_check_size = drop_check ? 0 : check_size;
+
+	for (;;) {
+		rb = safe_read(xstate->src_fd, &hdr[12], 1);
+		if (rb != 1 || hdr[12] == 0) {
+			if (job == 0) {
+				/* Empty or truncated stream */
+				consumed = 12 + ((rb == 1) ? 1 : 0);
+				goto fallback;
+			}
+			if (rb != 1) {
+				*status = XZ_DATA_ERROR;
+				break;
+			}
+			/* Index reached: every block is in flight, and each job
+			 * seals its own index and footer, so just drain the rest */
+			while (safe_read(xstate->src_fd, hdr, 1024) > 0);
+			break;
+		}
+		header_size = ((size_t)hdr[12] + 1) * 4;
+		if (xz_read_all(xstate->src_fd, &hdr[13], header_size - 1) < 0) {
+			if (job == 0) {
+				consumed = 13;
+				goto fallback;
+			}
+			*status = XZ_DATA_ERROR;
+			break;
+		}
+		/* Both size fields are needed to carve; single-threaded xz
+		 * doesn't store them, in which case we decode sequentially */
+		pos = 2;
+		if ((hdr[13] & 0xC0) != 0xC0 ||
+		    xz_varint_dec(&hdr[12], header_size, &pos, &comp) < 0 ||
+		    xz_varint_dec(&hdr[12], header_size, &pos, &uncomp) < 0 ||
+		    comp == 0 || comp > XZ_PAR_MAX_BLOCK || uncomp > XZ_PAR_MAX_BLOCK) {
+			if (job == 0) {
+				consumed = 12 + header_size;
+				goto fallback;
+			}
+			*status = XZ_DATA_ERROR;
+			break;
+		}
+		pad = (size_t)(-(int64_t)comp & 3);
+		unpadded = header_size + comp + syn_check_size;
+
+		if (drop_check && !warned) {
+			bb_error_msg("unsupported check; not verifying file integrity");
+			warned = 1;
+		}
+
+		/* Hand this block to the next worker, collecting the job it
+		 * ran XZ_NUM_WORKERS dispatches ago first */
+		w = &worker[job % XZ_NUM_WORKERS];
+		if (job >= XZ_NUM_WORKERS) {
+			r = xz_collect(xstate, w, written, FALSE);
+			collected++;
+			if (r != XZ_OK) {
+				*status = r;
+				break;
+			}
+		}
+
+		/* Synthetic index covering this one block, and its footer */
+		idx[0] = 0;
+		idx_len = 1;
+		idx_len += xz_varint_enc(&idx[idx_len], 1);
+		idx_len += xz_varint_enc(&idx[idx_len], unpadded);
+		idx_len += xz_varint_enc(&idx[idx_len], uncomp);
+		while (idx_len & 3)
+			idx[idx_len++] = 0;
+		crc = xz_crc32(idx, idx_len, 0);
+		put_unaligned_le32(crc, &idx[idx_len]);
+		idx_len += 4;
+		put_unaligned_le32((uint32_t)(idx_len / 4 - 1), &ftr[4]);
+		ftr[8] = 0;
+		ftr[9] = drop_check ? 0 : hdr[7];
+		put_unaligned_le32(xz_crc32(&ftr[4], 6, 0), ftr);
+		ftr[10] = 'Y';
+		ftr[11] = 'Z';
+
+		total = 12 + header_size + (size_t)comp + pad + syn_check_size + idx_len + 12;
+		if (w->in_cap < total) {
+			p = realloc(w->in, total);
+			if (p == NULL) {
+				*status = XZ_MEM_ERROR;
+				break;
+			}
+			w->in = p;
+			w->in_cap = total;
+		}
+		/* Stream header, with the check type possibly rewritten */
+		memcpy(w->in, hdr, 6);
+		w->in[6] = 0;
+		w->in[7] = drop_check ? 0 : hdr[7];
+		put_unaligned_le32(xz_crc32(&w->in[6], 2, 0), &w->in[8]);
+		memcpy(&w->in[12], &hdr[12], header_size);
+		pos = 12 + header_size;
+		if (xz_read_all(xstate->src_fd, &w->in[pos], (size_t)comp + pad) < 0) {
+			*status = XZ_DATA_ERROR;
+			break;
+		}
+		pos += (size_t)comp + pad;
+		if (check_size != 0) {
+			/* A check we can't verify is consumed but not forwarded */
+			if (xz_read_all(xstate->src_fd, drop_check ? &hdr[12] : &w->in[pos], check_size) < 0) {
+				*status = XZ_DATA_ERROR;
+				break;
+			}
+			pos += syn_check_size;
+		}
+		memcpy(&w->in[pos], idx, idx_len);
+		pos += idx_len;
+		memcpy(&w->in[pos], ftr, 12);
+		pos += 12;
+		w->in_len = pos;
+		if (w->out_cap < uncomp) {
+			p = realloc(w->out, (size_t)uncomp);
+			if (p == NULL) {
+				*status = XZ_MEM_ERROR;
+				break;
+			}
+			w->out = p;
+			w->out_cap = (size_t)uncomp;
+		}
+		w->status = XZ_OK;
+		SetEvent(w->start);
+		job++;
+	}
+
+	/* Drain the remaining jobs, in order, discarding output after an error */
+	for (; collected < job; collected++) {
+		w = &worker[collected % XZ_NUM_WORKERS];
+		r = xz_collect(xstate, w, written, *status != XZ_OK);
+		if (*status == XZ_OK)
+			*status = r;
+	}
+	goto out;
+
+ fallback:
+	*seed = hdr;
+	*seed_len = consumed;
+	hdr = NULL;
+ no_pool:
+	ok = 0;
+ out:
+	for (i = 0; i < XZ_NUM_WORKERS; i++) {
+		w = &worker[i];
+		if (w->thread != NULL) {
+			w->quit = 1;
+			SetEvent(w->start);
+			WaitForSingleObject(w->thread, INFINITE);
+			CloseHandle(w->thread);
+		}
+		if (w->start != NULL)
+			CloseHandle(w->start);
+		if (w->done != NULL)
+			CloseHandle(w->done);
+		free(w->in);
+		free(w->out);
+	}
+	free(hdr);
+	return ok;
+}
+
 IF_DESKTOP(long long) int FAST_FUNC unpack_xz_stream(transformer_state_t *xstate)
 {
 	IF_DESKTOP(long long) int n = 0;
@@ -39,24 +386,49 @@ IF_DESKTOP(long long) int FAST_FUNC unpack_xz_stream(transformer_state_t *xstate
 	struct xz_dec *s;
 	enum xz_ret ret = XZ_STREAM_END;
 	uint8_t *in = NULL, *out = NULL;
+	uint8_t *seed = NULL;
+	size_t seed_len = 0;
 	ssize_t nwrote;
 
 	xz_crc32_init();
 
+	{
+		long long parallel_written;
+		enum xz_ret pstatus;
+
+		if (unpack_xz_parallel(xstate, &pstatus, &parallel_written, &seed, &seed_len)) {
+			if (pstatus == XZ_BUF_FULL)
+				return xstate->mem_output_size_max;
+			if (pstatus != XZ_OK) {
+				bb_error_msg("corrupted archive (xz error %d)", (int)pstatus);
+				return -(int)pstatus;
+			}
+			return parallel_written;
+		}
+	}
+
 	/*
-	 * Support up to 64 MiB dictionary. The actually needed memory
-	 * is allocated once the headers have been parsed.
+	 * Support up to 64 MiB dictionary, preallocated in full up front so
+	 * that decode never has to grow (or worse, cycle) the LZMA2 window.
 	 */
-	s = xz_dec_init(XZ_DYNALLOC, 1 << 26);
+	s = xz_dec_init(XZ_PREALLOC, 1 << 26);
 	if (!s)
 		bb_error_msg_and_err("memory allocation error");
 
-	in = xmalloc(XZ_BUFSIZE);
-	out = xmalloc(XZ_BUFSIZE);
+	in = bled_pool_get(BLED_COMPRESSION_XZ, 0, XZ_BUFSIZE);
+	out = bled_pool_get(BLED_COMPRESSION_XZ, 1, XZ_BUFSIZE);
+	if ((in == NULL) || (out == NULL))
+		bb_error_msg_and_err("memory allocation error");
 
 	b.in = in;
 	b.in_pos = 0;
 	b.in_size = 0;
+	if (seed != NULL) {
+		/* Replay the header bytes the parallel carve probe consumed */
+		memcpy(in, seed, seed_len);
+		b.in_size = seed_len;
+		free(seed);
+	}
 	b.out = out;
 	b.out_pos = 0;
 	b.out_size = XZ_BUFSIZE;
@@ -131,8 +503,6 @@ IF_DESKTOP(long long) int FAST_FUNC unpack_xz_stream(transformer_state_t *xstate
 out:
 err:
 	xz_dec_end(s);
-	free(in);
-	free(out);
 	if (ret == XZ_OK)
 		return n;
 	else if (ret == XZ_BUF_FULL)
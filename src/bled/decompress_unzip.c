@@ -239,12 +239,303 @@ static void unzip_skip(int fd, off_t skip)
 			bb_copyfd_exact_size(fd, -1, skip);
 }
 
+#if ENABLE_DESKTOP
+
+/*
+ * Parallel extraction of an archive to a directory.
+ *
+ * Zip entries are independently deflated streams whose compressed and
+ * uncompressed sizes are known up front, so the main thread can walk the
+ * local file headers as usual, hand each entry's compressed data to a small
+ * pool of workers for in-memory inflation, and create and fill the output
+ * files back in archive order as the jobs complete. All source reads,
+ * destination writes and UI callbacks stay on the main thread; only the
+ * inflate itself is spread over the cores.
+ */
+
+#define ZIP_NUM_WORKERS     4
+
+typedef struct {
+	HANDLE thread;
+	HANDLE start;		/* Signaled by main thread: job ready (or quit) */
+	HANDLE done;		/* Signaled by worker: job complete */
+	char *in;		/* Compressed entry data */
+	size_t in_len, in_cap;
+	char *out;		/* Inflated entry data */
+	size_t out_len, out_cap;
+	uint32_t crc32;		/* Expected crc32 of the inflated data */
+	char *name;		/* Entry name, relative to the target dir */
+	size_t name_cap;
+	int status;		/* 0, or -1 on inflate/validation error */
+	smallint quit;
+} zip_worker_t;
+
+static DWORD WINAPI zip_worker_thread(LPVOID param)
+{
+	zip_worker_t *w = (zip_worker_t*)param;
+	transformer_state_t xstate;
+
+	for (;;) {
+		WaitForSingleObject(w->start, INFINITE);
+		if (w->quit)
+			return 0;
+		init_transformer_state(&xstate);
+		xstate.src_fd = -1;
+		xstate.dst_fd = -1;
+		xstate.mem_input_buf = w->in;
+		xstate.mem_input_size = w->in_len;
+		xstate.bytes_in = w->in_len;
+		xstate.mem_output_buf = w->out;
+		/* A zero size max would mean "write to dst_fd", so never pass one */
+		xstate.mem_output_size_max = (w->out_len != 0) ? w->out_len : 1;
+		w->status = 0;
+		if (inflate_unzip(&xstate) < 0
+		 || xstate.bytes_out != w->out_len
+		 || w->crc32 != (xstate.crc32 ^ 0xffffffffL))
+			w->status = -1;
+		SetEvent(w->done);
+	}
+}
+
+/* Wait for a worker's job, then create its file and write the inflated data.
+ * With discard set, output and errors are thrown away. */
+static int zip_flush(transformer_state_t *xstate, zip_worker_t *w, smallint discard)
+{
+	int r;
+
+	WaitForSingleObject(w->done, INFINITE);
+	if (discard)
+		return 0;
+	if (w->status < 0) {
+		bb_error_msg("inflate error");
+		return w->status;
+	}
+	xstate->dst_size = w->out_len;
+	xstate->dst_name = w->name;
+	r = transformer_switch_file(xstate);
+	xstate->dst_name = NULL;
+	if (r < 0)
+		return r;
+	if ((w->out_len != 0)
+	 && (full_write(xstate->dst_fd, w->out, (unsigned int)w->out_len) != (int)w->out_len)) {
+		bb_error_msg("write error");
+		return -1;
+	}
+	xstate->bytes_out = w->out_len;
+	return 0;
+}
+
+/* Read exactly len bytes, looping over short reads */
+static int zip_read_exact(int fd, void *buf, size_t len)
+{
+	size_t pos = 0;
+	int rb;
+
+	while (pos < len) {
+		rb = safe_read(fd, (char*)buf + pos, (unsigned int)MIN(len - pos, (size_t)bled_buffer_size));
+		if (rb <= 0)
+			return -1;
+		pos += rb;
+	}
+	return 0;
+}
+
+/* Extract all files to xstate->dst_dir on a worker pool. Returns TRUE if the
+ * parallel path ran, with *status holding the value to return, or FALSE if no
+ * pool could be set up (caller should extract sequentially). */
+static smallint unpack_zip_parallel(transformer_state_t *xstate, long long *status)
+{
+	zip_worker_t worker[ZIP_NUM_WORKERS];
+	zip_worker_t *w;
+	zip_header_t zip_header;
+	uint32_t cdf_offset = 0;
+	unsigned job = 0, collected = 0;
+	smallint ok = 1, failed = 0;
+	int i;
+	char *p;
+
+	memset(worker, 0, sizeof(worker));
+	for (i = 0; i < ZIP_NUM_WORKERS; i++) {
+		worker[i].start = CreateEvent(NULL, FALSE, FALSE, NULL);
+		worker[i].done = CreateEvent(NULL, FALSE, FALSE, NULL);
+		if (worker[i].start != NULL && worker[i].done != NULL)
+			worker[i].thread = CreateThread(NULL, 0, zip_worker_thread, &worker[i], 0, NULL);
+		if (worker[i].thread == NULL)
+			goto no_pool;
+	}
+
+	while (1) {
+		uint32_t magic;
+		bool is_dir = false;
+
+		/* Check magic number */
+		safe_read(xstate->src_fd, &magic, 4);
+		/* Central directory? It's at the end, so exit */
+		if (magic == ZIP_CDF_MAGIC)
+			break;
+		/* Data descriptor? It was a streaming file, go on */
+		if (magic == ZIP_DD_MAGIC) {
+			/* skip over duplicate crc32, cmpsize and ucmpsize */
+			unzip_skip(xstate->src_fd, 3 * 4);
+			continue;
+		}
+		if (magic != ZIP_FILEHEADER_MAGIC) {
+			bb_error_msg("invalid zip magic 0x%08X", magic);
+			goto err;
+		}
+
+		/* Read the file header */
+		safe_read(xstate->src_fd, zip_header.raw, ZIP_HEADER_LEN);
+		FIX_ENDIANNESS_ZIP(zip_header);
+		if ((zip_header.formatted.method != 8) && (zip_header.formatted.method != 0)) {
+			bb_error_msg("zip method method %d is not supported", zip_header.formatted.method);
+			goto err;
+		}
+		if (zip_header.formatted.zip_flags & SWAP_LE16(0x0001)) {
+			/* 0x0001 - encrypted */
+			bb_error_msg("zip flag 1 (encryption) is not supported");
+			goto err;
+		}
+
+		if (cdf_offset != BAD_CDF_OFFSET) {
+			cdf_header_t cdf_header;
+			cdf_offset = read_next_cdf(xstate->src_fd, cdf_offset, &cdf_header);
+			/*
+			 * Note: cdf_offset can become BAD_CDF_OFFSET after the above call.
+			 */
+			if (zip_header.formatted.zip_flags & SWAP_LE16(0x0008)) {
+				/* 0x0008 - streaming. [u]cmpsize can be reliably gotten
+				 * only from Central Directory. See unzip_doc.txt
+				 */
+				zip_header.formatted.crc32    = cdf_header.formatted.crc32;
+				zip_header.formatted.cmpsize  = cdf_header.formatted.cmpsize;
+				zip_header.formatted.ucmpsize = cdf_header.formatted.ucmpsize;
+			}
+			/* Check for UNIX/DOS/WIN directory */
+			is_dir = cdf_header.formatted.external_file_attributes & 0x40000010;
+		}
+		if (cdf_offset == BAD_CDF_OFFSET
+			&& (zip_header.formatted.zip_flags & SWAP_LE16(0x0008))
+		) {
+			/* If it's a streaming zip, we _require_ CDF */
+			bb_error_msg("can't find file table");
+			goto err;
+		}
+
+		if (is_dir || (zip_header.formatted.method == 0)) {
+			if (!is_dir) {
+				bb_error_msg("zip method method 0 is only supported for directories");
+				goto err;
+			}
+			/* Directories are created on demand, when their files are written */
+			unzip_skip(xstate->src_fd, zip_header.formatted.filename_len + zip_header.formatted.extra_len);
+			unzip_skip(xstate->src_fd, zip_header.formatted.cmpsize);
+			continue;
+		}
+
+		/* Hand this entry to the next worker, collecting the job it ran
+		 * ZIP_NUM_WORKERS dispatches ago first */
+		w = &worker[job % ZIP_NUM_WORKERS];
+		if (job >= ZIP_NUM_WORKERS) {
+			i = zip_flush(xstate, w, FALSE);
+			collected++;
+			if (i < 0)
+				goto err;
+		}
+		if (w->name_cap < (size_t)zip_header.formatted.filename_len + 1) {
+			p = realloc(w->name, (size_t)zip_header.formatted.filename_len + 1);
+			if (p == NULL)
+				goto err_mem;
+			w->name = p;
+			w->name_cap = (size_t)zip_header.formatted.filename_len + 1;
+		}
+		if (zip_read_exact(xstate->src_fd, w->name, zip_header.formatted.filename_len) < 0)
+			goto err_read;
+		w->name[zip_header.formatted.filename_len] = 0;
+
+		/* Skip extra header bytes */
+		unzip_skip(xstate->src_fd, zip_header.formatted.extra_len);
+
+		/* The +1's keep the buffers allocated for zero byte entries */
+		if (w->in_cap < (size_t)zip_header.formatted.cmpsize + 1) {
+			p = realloc(w->in, (size_t)zip_header.formatted.cmpsize + 1);
+			if (p == NULL)
+				goto err_mem;
+			w->in = p;
+			w->in_cap = (size_t)zip_header.formatted.cmpsize + 1;
+		}
+		if (w->out_cap < (size_t)zip_header.formatted.ucmpsize + 1) {
+			p = realloc(w->out, (size_t)zip_header.formatted.ucmpsize + 1);
+			if (p == NULL)
+				goto err_mem;
+			w->out = p;
+			w->out_cap = (size_t)zip_header.formatted.ucmpsize + 1;
+		}
+		if (zip_read_exact(xstate->src_fd, w->in, zip_header.formatted.cmpsize) < 0)
+			goto err_read;
+		w->in_len = zip_header.formatted.cmpsize;
+		w->out_len = zip_header.formatted.ucmpsize;
+		w->crc32 = zip_header.formatted.crc32;
+		SetEvent(w->start);
+		job++;
+	}
+	goto drain;
+
+ err_mem:
+	bb_error_msg("out of memory");
+	goto err;
+ err_read:
+	bb_error_msg("unexpected end of file");
+ err:
+	failed = 1;
+
+ drain:
+	/* Collect the remaining jobs, in order, discarding output after an error */
+	for (; collected < job; collected++) {
+		w = &worker[collected % ZIP_NUM_WORKERS];
+		if (zip_flush(xstate, w, failed) < 0)
+			failed = 1;
+	}
+	*status = (failed || (job == 0)) ? -EFAULT : (long long)xstate->bytes_out;
+	goto out;
+
+ no_pool:
+	ok = 0;
+ out:
+	for (i = 0; i < ZIP_NUM_WORKERS; i++) {
+		w = &worker[i];
+		if (w->thread != NULL) {
+			w->quit = 1;
+			SetEvent(w->start);
+			WaitForSingleObject(w->thread, INFINITE);
+			CloseHandle(w->thread);
+		}
+		if (w->start != NULL)
+			CloseHandle(w->start);
+		if (w->done != NULL)
+			CloseHandle(w->done);
+		free(w->in);
+		free(w->out);
+		free(w->name);
+	}
+	return ok;
+}
+#endif
+
 IF_DESKTOP(long long) int FAST_FUNC unpack_zip_stream(transformer_state_t *xstate)
 {
 	IF_DESKTOP(long long) int n = -EFAULT;
 	zip_header_t zip_header;
 #if ENABLE_DESKTOP
 	uint32_t cdf_offset = 0;
+
+	/* Directory extraction inflates the entries on a worker pool. Falls
+	 * back to the sequential loop below if the pool can't be created. */
+	if (xstate->dst_dir != NULL) {
+		long long status;
+		if (unpack_zip_parallel(xstate, &status))
+			return status;
+	}
 #endif
 
 	while (1) {
@@ -0,0 +1,1508 @@
+/*
+ * unzstd implementation for Bled
+ *
+ * Copyright © 2026 Pete Batard <pete@akeo.ie>
+ *
+ * Self contained Zstandard (RFC 8878) frame decoder. Single frames are
+ * decoded with a streaming window, so arbitrarily large images only cost
+ * one window's worth of memory. Multi-frame files, as produced by pzstd
+ * or 'zstd --seekable', are additionally decoded on a small worker pool,
+ * one frame per job, with the output written back in frame order.
+ *
+ * Dictionaries are not supported (disk images don't use them).
+ *
+ * Licensed under GPLv2 or later, see file LICENSE in this source tree.
+ */
+
+#include <windows.h>	/* Worker pool for multi-frame files */
+#include "libbb.h"
+#include "bb_archive.h"
+
+#define ZSTD_MAGIC          0xFD2FB528
+#define ZSTD_MAGIC_SKIP     0x184D2A50	/* ..0x184D2A5F */
+#define ZSTD_MAGIC_SKIP_MASK 0xFFFFFFF0
+
+#define ZSTD_BLOCK_MAX      (128 * 1024)
+/* Same default limit as the reference decoder (--long archives beyond
+ * a 128 MB window are rejected rather than silently eating memory) */
+#define ZSTD_WINDOW_MAX     (1UL << 27)
+
+#define ZSTD_MAX_LL_CODE    35
+#define ZSTD_MAX_ML_CODE    52
+#define ZSTD_MAX_OF_CODE    31
+#define ZSTD_MAX_FSE_LOG    9	/* LL/ML 9, OF 8, Huffman weights 6 */
+#define ZSTD_MAX_HUF_LOG    11
+
+static uint16_t zstd_le16(const uint8_t *p)
+{
+	return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+static uint32_t zstd_le32(const uint8_t *p)
+{
+	return (uint32_t)p[0] | ((uint32_t)p[1] << 8) |
+		((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint64_t zstd_le64(const uint8_t *p)
+{
+	return (uint64_t)zstd_le32(p) | ((uint64_t)zstd_le32(p + 4) << 32);
+}
+
+/* floor(log2(v)), v must not be 0 */
+static int zstd_log2(uint32_t v)
+{
+	int r = 0;
+
+	while (v >>= 1)
+		r++;
+	return r;
+}
+
+/*
+ * XXH64 (needed for the optional frame content checksum)
+ */
+
+#define XXH_P1 11400714785074694791ULL
+#define XXH_P2 14029467366897019727ULL
+#define XXH_P3  1609587929392839161ULL
+#define XXH_P4  9650029242287828579ULL
+#define XXH_P5  2870177450012600261ULL
+
+typedef struct {
+	uint64_t acc[4];
+	uint64_t total;
+	uint8_t buf[32];
+	size_t buf_len;
+} zstd_xxh64_t;
+
+static uint64_t xxh_rotl64(uint64_t x, int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t xxh_round(uint64_t acc, uint64_t lane)
+{
+	acc += lane * XXH_P2;
+	acc = xxh_rotl64(acc, 31);
+	return acc * XXH_P1;
+}
+
+static void zstd_xxh64_init(zstd_xxh64_t *x)
+{
+	memset(x, 0, sizeof(*x));
+	x->acc[0] = XXH_P1 + XXH_P2;
+	x->acc[1] = XXH_P2;
+	x->acc[2] = 0;
+	x->acc[3] = 0ULL - XXH_P1;
+}
+
+static void zstd_xxh64_update(zstd_xxh64_t *x, const uint8_t *p, size_t len)
+{
+	size_t n;
+	int i;
+
+	x->total += len;
+	if (x->buf_len != 0) {
+		n = MIN(len, 32 - x->buf_len);
+		memcpy(&x->buf[x->buf_len], p, n);
+		x->buf_len += n;
+		p += n;
+		len -= n;
+		if (x->buf_len < 32)
+			return;
+		for (i = 0; i < 4; i++)
+			x->acc[i] = xxh_round(x->acc[i], zstd_le64(&x->buf[8 * i]));
+		x->buf_len = 0;
+	}
+	while (len >= 32) {
+		for (i = 0; i < 4; i++)
+			x->acc[i] = xxh_round(x->acc[i], zstd_le64(p + 8 * i));
+		p += 32;
+		len -= 32;
+	}
+	if (len != 0) {
+		memcpy(x->buf, p, len);
+		x->buf_len = len;
+	}
+}
+
+static uint64_t zstd_xxh64_digest(const zstd_xxh64_t *x)
+{
+	uint64_t h;
+	const uint8_t *p = x->buf;
+	size_t len = x->buf_len;
+	int i;
+
+	if (x->total >= 32) {
+		h = xxh_rotl64(x->acc[0], 1) + xxh_rotl64(x->acc[1], 7) +
+			xxh_rotl64(x->acc[2], 12) + xxh_rotl64(x->acc[3], 18);
+		for (i = 0; i < 4; i++) {
+			h ^= xxh_round(0, x->acc[i]);
+			h = h * XXH_P1 + XXH_P4;
+		}
+	} else {
+		h = XXH_P5;
+	}
+	h += x->total;
+	while (len >= 8) {
+		h ^= xxh_round(0, zstd_le64(p));
+		h = xxh_rotl64(h, 27) * XXH_P1 + XXH_P4;
+		p += 8;
+		len -= 8;
+	}
+	if (len >= 4) {
+		h ^= (uint64_t)zstd_le32(p) * XXH_P1;
+		h = xxh_rotl64(h, 23) * XXH_P2 + XXH_P3;
+		p += 4;
+		len -= 4;
+	}
+	while (len > 0) {
+		h ^= *p++ * XXH_P5;
+		h = xxh_rotl64(h, 11) * XXH_P1;
+		len--;
+	}
+	h ^= h >> 33;
+	h *= XXH_P2;
+	h ^= h >> 29;
+	h *= XXH_P3;
+	h ^= h >> 32;
+	return h;
+}
+
+/*
+ * Bitstreams. The entropy coded parts of a frame use two layouts:
+ * - FSE table descriptions are read forward, LSB first;
+ * - Huffman/FSE data streams are read *backwards* from their last byte,
+ *   whose highest set bit is a padding sentinel.
+ */
+
+typedef struct {
+	const uint8_t *buf;
+	size_t len;
+	size_t pos;	/* bits consumed */
+} zstd_fbits_t;
+
+static uint32_t zstd_fbits_read(zstd_fbits_t *fb, int n)
+{
+	uint64_t v = 0;
+	size_t first = fb->pos, i;
+	size_t last = fb->pos + n - 1;	/* inclusive */
+
+	fb->pos += n;
+	if (n == 0)
+		return 0;
+	for (i = last >> 3; ; i--) {
+		v = (v << 8) | ((i < fb->len) ? fb->buf[i] : 0);
+		if (i == (first >> 3))
+			break;
+	}
+	v >>= (first & 7);
+	return (uint32_t)(v & ((1ULL << n) - 1));
+}
+
+typedef struct {
+	const uint8_t *buf;
+	int64_t pos;	/* bits still available below the sentinel */
+} zstd_rbits_t;
+
+static int zstd_rbits_init(zstd_rbits_t *rb, const uint8_t *buf, size_t len)
+{
+	if (len == 0 || buf[len - 1] == 0)
+		return -1;
+	rb->buf = buf;
+	rb->pos = (int64_t)(len - 1) * 8 + zstd_log2(buf[len - 1]);
+	return 0;
+}
+
+static uint32_t zstd_rbits_read(zstd_rbits_t *rb, int n)
+{
+	uint64_t v = 0;
+	int64_t first, last;
+	int64_t i;
+
+	rb->pos -= n;
+	if (n == 0)
+		return 0;
+	first = (rb->pos < 0) ? 0 : rb->pos;
+	last = rb->pos + n - 1;
+	for (i = last >> 3; i >= (first >> 3); i--)
+		v = (v << 8) | rb->buf[i];
+	v >>= (first & 7);
+	if (rb->pos < 0)
+		v <<= -rb->pos;	/* reads past the start are zero filled */
+	return (uint32_t)(v & ((1ULL << n) - 1));
+}
+
+/*
+ * FSE (tANS) decoding tables
+ */
+
+typedef struct {
+	uint8_t symbol[1 << ZSTD_MAX_FSE_LOG];
+	uint8_t nbits[1 << ZSTD_MAX_FSE_LOG];
+	uint16_t base[1 << ZSTD_MAX_FSE_LOG];
+	int log;
+} zstd_fse_t;
+
+static void zstd_fse_rle(zstd_fse_t *t, uint8_t sym)
+{
+	t->log = 0;
+	t->symbol[0] = sym;
+	t->nbits[0] = 0;
+	t->base[0] = 0;
+}
+
+static int zstd_fse_build(zstd_fse_t *t, const int16_t *counts, int nsym, int log)
+{
+	int size = 1 << log;
+	int high = size - 1;
+	int pos = 0;
+	int step = (size >> 1) + (size >> 3) + 3;
+	int next[ZSTD_MAX_ML_CODE + 1];
+	int s, i, c;
+
+	if (nsym > ZSTD_MAX_ML_CODE + 1 || log > ZSTD_MAX_FSE_LOG)
+		return -1;
+	/* "Less than one" probabilities get one cell each, at the top */
+	for (s = 0; s < nsym; s++) {
+		if (counts[s] == -1) {
+			t->symbol[high--] = (uint8_t)s;
+			next[s] = 1;
+		} else {
+			next[s] = counts[s];
+		}
+	}
+	/* Spread the other symbols */
+	for (s = 0; s < nsym; s++) {
+		for (i = 0; i < counts[s]; i++) {
+			t->symbol[pos] = (uint8_t)s;
+			do {
+				pos = (pos + step) & (size - 1);
+			} while (pos > high);
+		}
+	}
+	if (pos != 0)
+		return -1;
+	for (i = 0; i < size; i++) {
+		s = t->symbol[i];
+		c = next[s]++;
+		if (c <= 0)
+			return -1;
+		t->nbits[i] = (uint8_t)(log - zstd_log2((uint32_t)c));
+		t->base[i] = (uint16_t)((c << t->nbits[i]) - size);
+	}
+	t->log = log;
+	return 0;
+}
+
+/* Parse an FSE table description, returns bytes consumed or -1 */
+static int zstd_fse_read(zstd_fse_t *t, const uint8_t *src, size_t len,
+		int max_log, int max_sym)
+{
+	zstd_fbits_t fb;
+	int16_t counts[ZSTD_MAX_ML_CODE + 1] = { 0 };
+	int log, remaining, sym = 0;
+	int bits, lower_mask, threshold, repeat, i;
+	int32_t val, proba;
+
+	fb.buf = src;
+	fb.len = len;
+	fb.pos = 0;
+	log = zstd_fbits_read(&fb, 4) + 5;
+	if (log > max_log)
+		return -1;
+	remaining = (1 << log) + 1;
+	while (remaining > 1 && sym <= max_sym) {
+		bits = zstd_log2((uint32_t)remaining) + 1;
+		val = zstd_fbits_read(&fb, bits);
+		lower_mask = (1 << (bits - 1)) - 1;
+		threshold = (1 << bits) - 1 - remaining;
+		if ((val & lower_mask) < threshold) {
+			fb.pos--;	/* small value, rewind the extra bit */
+			val &= lower_mask;
+		} else if (val > lower_mask) {
+			val -= threshold;
+		}
+		proba = val - 1;
+		remaining -= (proba < 0) ? -proba : proba;
+		counts[sym++] = (int16_t)proba;
+		if (proba == 0) {
+			/* Runs of zero probabilities are coded with 2-bit repeats */
+			do {
+				repeat = zstd_fbits_read(&fb, 2);
+				for (i = 0; i < repeat && sym <= max_sym; i++)
+					counts[sym++] = 0;
+			} while (repeat == 3 && sym <= max_sym);
+		}
+	}
+	if (remaining != 1 || fb.pos > len * 8)
+		return -1;
+	if (zstd_fse_build(t, counts, sym, log) < 0)
+		return -1;
+	return (int)((fb.pos + 7) / 8);
+}
+
+/*
+ * Huffman decoding table (for the literals)
+ */
+
+typedef struct {
+	uint8_t symbol[1 << ZSTD_MAX_HUF_LOG];
+	uint8_t nbits[1 << ZSTD_MAX_HUF_LOG];
+	int log;
+} zstd_huf_t;
+
+static int zstd_huf_build(zstd_huf_t *h, uint8_t *weights, int nsym)
+{
+	uint32_t sum = 0, left, cells;
+	int s, w, log, pos = 0;
+
+	/* The last symbol's weight is implied: total must reach a power of 2 */
+	for (s = 0; s < nsym; s++) {
+		if (weights[s] > ZSTD_MAX_HUF_LOG)
+			return -1;
+		sum += weights[s] ? 1u << (weights[s] - 1) : 0;
+	}
+	if (sum == 0)
+		return -1;
+	log = zstd_log2(sum) + 1;
+	if (log > ZSTD_MAX_HUF_LOG)
+		return -1;
+	left = (1u << log) - sum;
+	if (left == 0 || (left & (left - 1)) != 0)
+		return -1;	/* must be a power of 2 */
+	weights[nsym++] = (uint8_t)(zstd_log2(left) + 1);
+	/* Canonical table: lower weights (longer codes) fill the low indices */
+	for (w = 1; w <= log; w++) {
+		for (s = 0; s < nsym; s++) {
+			if (weights[s] != w)
+				continue;
+			cells = 1u << (w - 1);
+			memset(&h->symbol[pos], s, cells);
+			memset(&h->nbits[pos], log + 1 - w, cells);
+			pos += cells;
+		}
+	}
+	if (pos != (1 << log))
+		return -1;
+	h->log = log;
+	return 0;
+}
+
+/* Parse a Huffman tree description, returns bytes consumed or -1 */
+static int zstd_huf_read(zstd_huf_t *h, const uint8_t *src, size_t len)
+{
+	uint8_t weights[256];
+	zstd_fse_t fse;
+	zstd_rbits_t rb;
+	uint32_t s1, s2;
+	int n, hb, csize, used, i;
+
+	if (len < 1)
+		return -1;
+	hb = src[0];
+	src++;
+	len--;
+	if (hb >= 128) {
+		/* Direct representation: 4 bits per weight */
+		n = hb - 127;
+		if (len < (size_t)(n + 1) / 2)
+			return -1;
+		for (i = 0; i < n; i++)
+			weights[i] = (src[i / 2] >> (i & 1 ? 0 : 4)) & 0xF;
+		used = 1 + (n + 1) / 2;
+	} else {
+		/* FSE compressed weights, two interleaved states */
+		csize = hb;
+		if (len < (size_t)csize)
+			return -1;
+		/* Weights are at most 11, so cap the symbol range well below
+		 * the sequence-code maximum that sizes the FSE work arrays. */
+		used = zstd_fse_read(&fse, src, csize, 6, 15);
+		if (used < 0 || used >= csize)
+			return -1;
+		if (zstd_rbits_init(&rb, src + used, csize - used) < 0)
+			return -1;
+		s1 = zstd_rbits_read(&rb, fse.log);
+		s2 = zstd_rbits_read(&rb, fse.log);
+		if (rb.pos < 0)
+			return -1;
+		n = 0;
+		while (1) {
+			if (n >= 255)
+				return -1;
+			weights[n++] = fse.symbol[s1];
+			s1 = fse.base[s1] + zstd_rbits_read(&rb, fse.nbits[s1]);
+			if (rb.pos < 0) {
+				if (n >= 255)
+					return -1;
+				weights[n++] = fse.symbol[s2];
+				break;
+			}
+			if (n >= 255)
+				return -1;
+			weights[n++] = fse.symbol[s2];
+			s2 = fse.base[s2] + zstd_rbits_read(&rb, fse.nbits[s2]);
+			if (rb.pos < 0) {
+				if (n >= 255)
+					return -1;
+				weights[n++] = fse.symbol[s1];
+				break;
+			}
+		}
+		used = 1 + csize;
+	}
+	if (zstd_huf_build(h, weights, n) < 0)
+		return -1;
+	return used;
+}
+
+/* Decode one backwards Huffman bitstream of exactly n literals */
+static int zstd_huf_stream(const zstd_huf_t *h, const uint8_t *src, size_t len,
+		uint8_t *dst, size_t n)
+{
+	zstd_rbits_t rb;
+	uint32_t state, mask = (1u << h->log) - 1;
+	size_t i;
+	int nb;
+
+	if (zstd_rbits_init(&rb, src, len) < 0)
+		return -1;
+	state = zstd_rbits_read(&rb, h->log);
+	if (rb.pos < 0 && n > 0)
+		return -1;
+	for (i = 0; i < n; i++) {
+		dst[i] = h->symbol[state];
+		nb = h->nbits[state];
+		state = ((state << nb) | zstd_rbits_read(&rb, nb)) & mask;
+	}
+	/* The stream must be fully consumed, bar the zero filled tail reads */
+	if (rb.pos != -(int64_t)h->log)
+		return -1;
+	return 0;
+}
+
+/*
+ * Sequence codes: baselines and extra bits (RFC 8878 3.1.1.3.2.1)
+ */
+
+static const uint32_t zstd_ll_base[ZSTD_MAX_LL_CODE + 1] = {
+	0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,
+	16, 18, 20, 22, 24, 28, 32, 40, 48, 64, 128, 256, 512, 1024,
+	2048, 4096, 8192, 16384, 32768, 65536
+};
+static const uint8_t zstd_ll_bits[ZSTD_MAX_LL_CODE + 1] = {
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	1, 1, 1, 1, 2, 2, 3, 3, 4, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16
+};
+static const uint32_t zstd_ml_base[ZSTD_MAX_ML_CODE + 1] = {
+	3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17, 18,
+	19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29, 30, 31, 32, 33, 34,
+	35, 37, 39, 41, 43, 47, 51, 59, 67, 83, 99, 131, 259, 515, 1027, 2051,
+	4099, 8195, 16387, 32771, 65539
+};
+static const uint8_t zstd_ml_bits[ZSTD_MAX_ML_CODE + 1] = {
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	1, 1, 1, 1, 2, 2, 3, 3, 4, 4, 5, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16
+};
+
+/* Predefined FSE distributions (RFC 8878 3.1.1.3.2.2) */
+static const int16_t zstd_ll_default[36] = {
+	4, 3, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 1, 1, 1,
+	2, 2, 2, 2, 2, 2, 2, 2, 2, 3, 2, 1, 1, 1, 1, 1, -1, -1, -1, -1
+};
+static const int16_t zstd_ml_default[53] = {
+	1, 4, 3, 2, 2, 2, 2, 2, 2, 1, 1, 1, 1, 1, 1, 1,
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, -1, -1, -1, -1, -1, -1, -1
+};
+static const int16_t zstd_of_default[29] = {
+	1, 1, 1, 1, 1, 1, 2, 2, 2, 1, 1, 1, 1, 1, 1, 1,
+	1, 1, 1, 1, 1, 1, 1, 1, -1, -1, -1, -1, -1
+};
+
+/*
+ * Decoder context. The entropy tables, repeat offsets and window persist
+ * across the blocks of a frame; the window buffer itself is reused across
+ * frames and only grows.
+ */
+
+typedef int (*zstd_emit_fn)(void *ctx, const void *buf, size_t len);
+
+typedef struct {
+	/* Input: either a file descriptor or a memory buffer */
+	int fd;
+	const uint8_t *mem;
+	size_t mem_len, mem_pos;
+	/* Per block scratch */
+	uint8_t *bbuf;	/* compressed block data */
+	uint8_t *lits;	/* decoded literals */
+	/* Entropy state */
+	zstd_fse_t ll_table, of_table, ml_table;
+	zstd_huf_t huf;
+	smallint ll_valid, of_valid, ml_valid, huf_valid;
+	uint32_t rep[3];
+	/* Output window */
+	uint8_t *win;
+	size_t win_cap, win_pos;
+	uint32_t window_size;
+	uint64_t frame_total;
+	uint64_t fast_skip;	/* remaining output bytes a resume may step over */
+	smallint has_checksum;
+	zstd_xxh64_t xxh;
+	/* Sink */
+	zstd_emit_fn emit;
+	void *emit_ctx;
+	int emit_err;	/* sticky emit error (-ENOSPC or -1) */
+} zstd_dctx;
+
+static zstd_dctx *zstd_dctx_new(void)
+{
+	zstd_dctx *d = calloc(1, sizeof(zstd_dctx));
+
+	if (d == NULL)
+		return NULL;
+	d->bbuf = malloc(ZSTD_BLOCK_MAX);
+	d->lits = malloc(ZSTD_BLOCK_MAX);
+	if (d->bbuf == NULL || d->lits == NULL) {
+		free(d->bbuf);
+		free(d->lits);
+		free(d);
+		return NULL;
+	}
+	d->fd = -1;
+	return d;
+}
+
+static void zstd_dctx_free(zstd_dctx *d)
+{
+	if (d == NULL)
+		return;
+	free(d->bbuf);
+	free(d->lits);
+	free(d->win);
+	free(d);
+}
+
+/* Read exactly n bytes from the context's input, 0 on success */
+static int zstd_src_read(zstd_dctx *d, void *buf, size_t n)
+{
+	uint8_t *p = buf;
+	int rb;
+
+	if (d->fd == -1) {
+		if (d->mem_len - d->mem_pos < n)
+			return -1;
+		memcpy(buf, &d->mem[d->mem_pos], n);
+		d->mem_pos += n;
+		return 0;
+	}
+	while (n > 0) {
+		rb = safe_read(d->fd, p, (unsigned int)MIN(n, (size_t)ZSTD_BLOCK_MAX));
+		if (rb <= 0)
+			return -1;
+		p += rb;
+		n -= rb;
+	}
+	return 0;
+}
+
+/* Returns the number of bytes read (0 at EOF), or -1 on error */
+static int zstd_src_read_upto(zstd_dctx *d, void *buf, size_t n)
+{
+	size_t avail;
+	int rb;
+
+	if (d->fd == -1) {
+		avail = MIN(n, d->mem_len - d->mem_pos);
+		memcpy(buf, &d->mem[d->mem_pos], avail);
+		d->mem_pos += avail;
+		return (int)avail;
+	}
+	rb = safe_read(d->fd, buf, (unsigned int)n);
+	return (rb < 0) ? -1 : rb;
+}
+
+static int zstd_src_skip(zstd_dctx *d, uint64_t n)
+{
+	size_t chunk;
+
+	if (d->fd == -1) {
+		if (d->mem_len - d->mem_pos < n)
+			return -1;
+		d->mem_pos += (size_t)n;
+		return 0;
+	}
+	while (n > 0) {
+		chunk = (size_t)MIN(n, (uint64_t)ZSTD_BLOCK_MAX);
+		if (zstd_src_read(d, d->bbuf, chunk) < 0)
+			return -1;
+		n -= chunk;
+	}
+	return 0;
+}
+
+/*
+ * Literals section. Decodes into d->lits, returns the number of header +
+ * data bytes consumed from src, or -1. *lit_len receives the regenerated
+ * size.
+ */
+static int zstd_decode_literals(zstd_dctx *d, const uint8_t *src, size_t len,
+		size_t *lit_len)
+{
+	uint32_t v, rs, cs;
+	size_t used, total, rs_part, rs_last;
+	const uint8_t *stream;
+	int type, sf, streams, r = 0, i;
+	uint32_t ssize[4];
+
+	if (len < 1)
+		return -1;
+	type = src[0] & 3;
+	sf = (src[0] >> 2) & 3;
+	if (type <= 1) {
+		/* Raw or RLE literals */
+		if ((sf & 1) == 0) {
+			rs = src[0] >> 3;
+			used = 1;
+		} else if (sf == 1) {
+			if (len < 2)
+				return -1;
+			rs = zstd_le16(src) >> 4;
+			used = 2;
+		} else {
+			if (len < 3)
+				return -1;
+			rs = (zstd_le32(src) & 0xFFFFFF) >> 4;
+			used = 3;
+		}
+		if (rs > ZSTD_BLOCK_MAX)
+			return -1;
+		if (type == 0) {
+			if (len - used < rs)
+				return -1;
+			memcpy(d->lits, src + used, rs);
+			used += rs;
+		} else {
+			if (len - used < 1)
+				return -1;
+			memset(d->lits, src[used], rs);
+			used += 1;
+		}
+		*lit_len = rs;
+		return (int)used;
+	}
+	/* Compressed (2) or treeless (3) literals */
+	streams = (sf == 0) ? 1 : 4;
+	if (sf <= 1) {
+		if (len < 3)
+			return -1;
+		v = zstd_le32(src) & 0xFFFFFF;
+		rs = (v >> 4) & 0x3FF;
+		cs = v >> 14;
+		used = 3;
+	} else if (sf == 2) {
+		if (len < 4)
+			return -1;
+		v = zstd_le32(src);
+		rs = (v >> 4) & 0x3FFF;
+		cs = v >> 18;
+		used = 4;
+	} else {
+		if (len < 5)
+			return -1;
+		rs = (zstd_le32(src) >> 4) & 0x3FFFF;
+		cs = (zstd_le32(src + 2) >> 6) & 0x3FFFF;
+		used = 5;
+	}
+	if (rs > ZSTD_BLOCK_MAX || len - used < cs)
+		return -1;
+	stream = src + used;
+	if (type == 2) {
+		r = zstd_huf_read(&d->huf, stream, cs);
+		if (r < 0 || (uint32_t)r > cs)
+			return -1;
+		d->huf_valid = 1;
+		stream += r;
+		cs -= r;
+	} else if (!d->huf_valid) {
+		return -1;	/* treeless literals before any tree */
+	}
+	if (streams == 1) {
+		if (zstd_huf_stream(&d->huf, stream, cs, d->lits, rs) < 0)
+			return -1;
+	} else {
+		if (cs < 6)
+			return -1;
+		ssize[0] = zstd_le16(stream);
+		ssize[1] = zstd_le16(stream + 2);
+		ssize[2] = zstd_le16(stream + 4);
+		if ((uint32_t)ssize[0] + ssize[1] + ssize[2] > cs - 6)
+			return -1;
+		ssize[3] = cs - 6 - ssize[0] - ssize[1] - ssize[2];
+		rs_part = (rs + 3) / 4;
+		if (3 * rs_part > rs)
+			return -1;
+		rs_last = rs - 3 * rs_part;
+		stream += 6;
+		total = 0;
+		for (i = 0; i < 4; i++) {
+			if (zstd_huf_stream(&d->huf, stream, ssize[i],
+					d->lits + total, (i < 3) ? rs_part : rs_last) < 0)
+				return -1;
+			stream += ssize[i];
+			total += (i < 3) ? rs_part : rs_last;
+		}
+	}
+	*lit_len = rs;
+	return (int)(used + cs + ((type == 2) ? r : 0));
+}
+
+/* Set up one of the three sequence tables according to its compression mode */
+static int zstd_seq_table(zstd_fse_t *t, int mode, const uint8_t **pp,
+		const uint8_t *end, const int16_t *def, int def_nsym, int def_log,
+		int max_log, int max_sym, smallint *valid)
+{
+	int r;
+
+	switch (mode) {
+	case 0:	/* Predefined */
+		if (zstd_fse_build(t, def, def_nsym, def_log) < 0)
+			return -1;
+		break;
+	case 1:	/* RLE */
+		if (*pp >= end || **pp > max_sym)
+			return -1;
+		zstd_fse_rle(t, **pp);
+		(*pp)++;
+		break;
+	case 2:	/* FSE compressed */
+		r = zstd_fse_read(t, *pp, end - *pp, max_log, max_sym);
+		if (r < 0)
+			return -1;
+		*pp += r;
+		break;
+	default:	/* Repeat */
+		if (!*valid)
+			return -1;
+		break;
+	}
+	*valid = 1;
+	return 0;
+}
+
+/*
+ * Decode one compressed block from src into the window at d->win_pos.
+ * Returns the number of bytes produced, or -1.
+ */
+static int zstd_decode_block(zstd_dctx *d, const uint8_t *src, size_t len)
+{
+	const uint8_t *p, *end = src + len;
+	uint8_t *out = d->win + d->win_pos;
+	size_t out_pos = 0, out_max, lit_len = 0, lit_pos = 0;
+	zstd_rbits_t rb;
+	uint32_t ll_state, of_state, ml_state;
+	uint32_t ll, ml, ofval, offset, idx;
+	size_t src_idx;
+	int r, nbseq, modes, i;
+
+	out_max = MIN((size_t)ZSTD_BLOCK_MAX, d->win_cap - d->win_pos);
+	r = zstd_decode_literals(d, src, len, &lit_len);
+	if (r < 0)
+		return -1;
+	p = src + r;
+
+	/* Sequences section header */
+	if (p >= end)
+		return -1;
+	nbseq = *p++;
+	if (nbseq == 255) {
+		if (end - p < 2)
+			return -1;
+		nbseq = zstd_le16(p) + 0x7F00;
+		p += 2;
+	} else if (nbseq >= 128) {
+		if (end - p < 1)
+			return -1;
+		nbseq = ((nbseq - 128) << 8) + *p++;
+	}
+	if (nbseq == 0) {
+		/* Literals only; nothing else may follow in the block */
+		if (p != end || lit_len > out_max)
+			return -1;
+		memcpy(out, d->lits, lit_len);
+		d->win_pos += lit_len;
+		return (int)lit_len;
+	}
+	if (p >= end)
+		return -1;
+	modes = *p++;
+	if (modes & 3)
+		return -1;	/* reserved bits */
+	if (zstd_seq_table(&d->ll_table, (modes >> 6) & 3, &p, end,
+			zstd_ll_default, 36, 6, 9, ZSTD_MAX_LL_CODE, &d->ll_valid) < 0)
+		return -1;
+	if (zstd_seq_table(&d->of_table, (modes >> 4) & 3, &p, end,
+			zstd_of_default, 29, 5, 8, ZSTD_MAX_OF_CODE, &d->of_valid) < 0)
+		return -1;
+	if (zstd_seq_table(&d->ml_table, (modes >> 2) & 3, &p, end,
+			zstd_ml_default, 53, 6, 9, ZSTD_MAX_ML_CODE, &d->ml_valid) < 0)
+		return -1;
+
+	if (zstd_rbits_init(&rb, p, end - p) < 0)
+		return -1;
+	ll_state = zstd_rbits_read(&rb, d->ll_table.log);
+	of_state = zstd_rbits_read(&rb, d->of_table.log);
+	ml_state = zstd_rbits_read(&rb, d->ml_table.log);
+	if (rb.pos < 0)
+		return -1;
+
+	for (i = 0; i < nbseq; i++) {
+		int ll_code = d->ll_table.symbol[ll_state];
+		int of_code = d->of_table.symbol[of_state];
+		int ml_code = d->ml_table.symbol[ml_state];
+
+		if (ll_code > ZSTD_MAX_LL_CODE || of_code > ZSTD_MAX_OF_CODE ||
+		    ml_code > ZSTD_MAX_ML_CODE)
+			return -1;
+		ofval = (1u << of_code) + zstd_rbits_read(&rb, of_code);
+		ml = zstd_ml_base[ml_code] + zstd_rbits_read(&rb, zstd_ml_bits[ml_code]);
+		ll = zstd_ll_base[ll_code] + zstd_rbits_read(&rb, zstd_ll_bits[ll_code]);
+		if (rb.pos < 0)
+			return -1;
+
+		/* Offsets 1-3 are repeat codes (RFC 8878 3.1.1.5) */
+		if (ofval > 3) {
+			offset = ofval - 3;
+			d->rep[2] = d->rep[1];
+			d->rep[1] = d->rep[0];
+			d->rep[0] = offset;
+		} else {
+			idx = ofval - 1 + (ll == 0 ? 1 : 0);
+			if (idx == 0) {
+				offset = d->rep[0];
+			} else {
+				offset = (idx < 3) ? d->rep[idx] : d->rep[0] - 1;
+				if (offset == 0)
+					return -1;
+				/* rep[1] only swaps with rep[0]; rep[2] is untouched */
+				if (idx > 1)
+					d->rep[2] = d->rep[1];
+				d->rep[1] = d->rep[0];
+				d->rep[0] = offset;
+			}
+		}
+
+		if (i != nbseq - 1) {
+			/* Update order: literals length, match length, offset */
+			ll_state = d->ll_table.base[ll_state] +
+				zstd_rbits_read(&rb, d->ll_table.nbits[ll_state]);
+			ml_state = d->ml_table.base[ml_state] +
+				zstd_rbits_read(&rb, d->ml_table.nbits[ml_state]);
+			of_state = d->of_table.base[of_state] +
+				zstd_rbits_read(&rb, d->of_table.nbits[of_state]);
+			if (rb.pos < 0)
+				return -1;
+		}
+
+		/* Execute: literals copy, then match copy */
+		if (ll > lit_len - lit_pos || out_pos + ll + ml > out_max)
+			return -1;
+		memcpy(out + out_pos, &d->lits[lit_pos], ll);
+		lit_pos += ll;
+		out_pos += ll;
+		if ((uint64_t)offset > (uint64_t)(d->win_pos + out_pos))
+			return -1;
+		src_idx = d->win_pos + out_pos - offset;
+		if (offset >= ml) {
+			memcpy(out + out_pos, d->win + src_idx, ml);
+			out_pos += ml;
+		} else {
+			while (ml-- > 0)
+				out[out_pos++] = d->win[src_idx++];
+		}
+	}
+	if (rb.pos != 0)
+		return -1;	/* bitstream not fully consumed */
+
+	/* Remaining literals */
+	lit_len -= lit_pos;
+	if (out_pos + lit_len > out_max)
+		return -1;
+	memcpy(out + out_pos, &d->lits[lit_pos], lit_len);
+	out_pos += lit_len;
+	d->win_pos += out_pos;
+	return (int)out_pos;
+}
+
+/*
+ * Decode one frame (magic already consumed) through d->emit.
+ * Returns 0 on success, -1 on error (d->emit_err is sticky if the sink
+ * failed, e.g. -ENOSPC when decompressing to a bounded buffer).
+ */
+static int zstd_decode_frame(zstd_dctx *d, long long *frame_size)
+{
+	uint8_t hdr[14], cks[4];
+	uint64_t fcs = 0, window = 0;
+	uint32_t bh;
+	size_t hlen, keep, start, produced;
+	int fcs_flag, fcs_len, did_len, single, last, btype;
+	uint32_t bsize;
+	smallint has_fcs;
+	static const uint8_t did_bytes[4] = { 0, 1, 2, 4 };
+	int r;
+
+	if (zstd_src_read(d, hdr, 1) < 0)
+		return -1;
+	if (hdr[0] & 0x08)
+		return -1;	/* reserved bit */
+	single = hdr[0] & 0x20;
+	d->has_checksum = (hdr[0] & 0x04) ? 1 : 0;
+	fcs_flag = hdr[0] >> 6;
+	did_len = did_bytes[hdr[0] & 3];
+	fcs_len = (fcs_flag == 0) ? (single ? 1 : 0) : (1 << fcs_flag);
+	hlen = (single ? 0 : 1) + did_len + fcs_len;
+	if (hlen > 0 && zstd_src_read(d, &hdr[1], hlen) < 0)
+		return -1;
+	hlen = 1;
+	if (!single) {
+		window = 1ULL << (10 + (hdr[hlen] >> 3));
+		window += (window >> 3) * (hdr[hlen] & 7);
+		hlen++;
+	}
+	if (did_len > 0) {
+		uint32_t did = 0;
+		memcpy(&did, &hdr[hlen], did_len);
+		did = zstd_le32((uint8_t*)&did);
+		if (did != 0) {
+			bb_error_msg("dictionaries are not supported");
+			return -1;
+		}
+		hlen += did_len;
+	}
+	has_fcs = (fcs_len > 0);
+	if (has_fcs) {
+		switch (fcs_len) {
+		case 1: fcs = hdr[hlen]; break;
+		case 2: fcs = zstd_le16(&hdr[hlen]) + 256; break;
+		case 4: fcs = zstd_le32(&hdr[hlen]); break;
+		default: fcs = zstd_le64(&hdr[hlen]); break;
+		}
+	}
+	if (single)
+		window = fcs;
+	if (window > ZSTD_WINDOW_MAX) {
+		bb_error_msg("window size too large (%llu)", (unsigned long long)window);
+		return -1;
+	}
+	d->window_size = (uint32_t)window;
+
+	/* Resume fast path: a frame whose content lies entirely below the
+	 * remaining output skip can be stepped over by walking its block
+	 * headers, with no entropy decode at all. */
+	if (d->fast_skip != 0 && has_fcs && fcs <= d->fast_skip) {
+		do {
+			if (zstd_src_read(d, hdr, 3) < 0)
+				return -1;
+			bh = hdr[0] | (hdr[1] << 8) | ((uint32_t)hdr[2] << 16);
+			last = bh & 1;
+			btype = (bh >> 1) & 3;
+			bsize = bh >> 3;
+			if (btype == 3 || bsize > ZSTD_BLOCK_MAX)
+				return -1;
+			if (zstd_src_skip(d, (btype == 1) ? 1 : bsize) < 0)
+				return -1;
+		} while (!last);
+		if (d->has_checksum && zstd_src_read(d, cks, 4) < 0)
+			return -1;
+		d->fast_skip -= fcs;
+		*frame_size = (long long)fcs;
+		return 0;
+	}
+
+	if (d->win_cap < (size_t)window + 2 * ZSTD_BLOCK_MAX) {
+		free(d->win);
+		d->win_cap = (size_t)window + 2 * ZSTD_BLOCK_MAX;
+		d->win = malloc(d->win_cap);
+		if (d->win == NULL) {
+			d->win_cap = 0;
+			return -1;
+		}
+	}
+	d->win_pos = 0;
+	d->frame_total = 0;
+	d->rep[0] = 1;
+	d->rep[1] = 4;
+	d->rep[2] = 8;
+	d->ll_valid = d->of_valid = d->ml_valid = d->huf_valid = 0;
+	zstd_xxh64_init(&d->xxh);
+
+	do {
+		if (zstd_src_read(d, hdr, 3) < 0)
+			return -1;
+		bh = hdr[0] | (hdr[1] << 8) | ((uint32_t)hdr[2] << 16);
+		last = bh & 1;
+		btype = (bh >> 1) & 3;
+		bsize = bh >> 3;
+		/* Flush all bytes the window no longer needs, then compact */
+		if (d->win_cap - d->win_pos < ZSTD_BLOCK_MAX) {
+			keep = MIN(d->win_pos, (size_t)d->window_size);
+			memmove(d->win, d->win + d->win_pos - keep, keep);
+			d->win_pos = keep;
+		}
+		start = d->win_pos;
+		switch (btype) {
+		case 0:	/* Raw */
+			if (bsize > ZSTD_BLOCK_MAX ||
+			    zstd_src_read(d, d->win + d->win_pos, bsize) < 0)
+				return -1;
+			d->win_pos += bsize;
+			break;
+		case 1:	/* RLE */
+			if (bsize > ZSTD_BLOCK_MAX || zstd_src_read(d, hdr, 1) < 0)
+				return -1;
+			memset(d->win + d->win_pos, hdr[0], bsize);
+			d->win_pos += bsize;
+			break;
+		case 2:	/* Compressed */
+			if (bsize > ZSTD_BLOCK_MAX || zstd_src_read(d, d->bbuf, bsize) < 0)
+				return -1;
+			if (zstd_decode_block(d, d->bbuf, bsize) < 0) {
+				bb_error_msg("corrupted zstd block");
+				return -1;
+			}
+			break;
+		default:
+			return -1;	/* reserved */
+		}
+		produced = d->win_pos - start;
+		if (produced > 0) {
+			if (d->has_checksum)
+				zstd_xxh64_update(&d->xxh, d->win + start, produced);
+			r = d->emit(d->emit_ctx, d->win + start, produced);
+			if (r != 0) {
+				d->emit_err = r;
+				return -1;
+			}
+			d->frame_total += produced;
+		}
+	} while (!last);
+
+	if (has_fcs && d->frame_total != fcs) {
+		bb_error_msg("decoded size mismatch");
+		return -1;
+	}
+	if (d->has_checksum) {
+		if (zstd_src_read(d, cks, 4) < 0)
+			return -1;
+		if (zstd_le32(cks) != (uint32_t)zstd_xxh64_digest(&d->xxh)) {
+			bb_error_msg("xxhash checksum mismatch");
+			return -1;
+		}
+	}
+	*frame_size = (long long)d->frame_total;
+	return 0;
+}
+
+/* Decode every frame of the context's input (used for in-memory slices) */
+static int zstd_decode_all(zstd_dctx *d, long long *total)
+{
+	uint8_t hdr[4];
+	uint32_t magic;
+	long long frame_size;
+	int rb;
+
+	*total = 0;
+	for (;;) {
+		rb = zstd_src_read_upto(d, hdr, 4);
+		if (rb == 0)
+			return 0;
+		if (rb != 4)
+			return -1;
+		magic = zstd_le32(hdr);
+		if ((magic & ZSTD_MAGIC_SKIP_MASK) == ZSTD_MAGIC_SKIP) {
+			if (zstd_src_read(d, hdr, 4) < 0 ||
+			    zstd_src_skip(d, zstd_le32(hdr)) < 0)
+				return -1;
+			continue;
+		}
+		if (magic != ZSTD_MAGIC)
+			return -1;
+		if (zstd_decode_frame(d, &frame_size) < 0)
+			return -1;
+		*total += frame_size;
+	}
+}
+
+/*
+ * Multi-frame parallel decode, mirroring the scheme used for pbzip2
+ * files in decompress_bunzip2.c: the main thread carves complete frames
+ * out of the input (cheap, as block headers give every size without
+ * entropy decoding), hands them to a worker pool, and writes the decoded
+ * data back in frame order.
+ */
+
+#define ZSTD_NUM_WORKERS    4
+#define ZSTD_SCAN_CHUNK     (256 * 1024)
+
+typedef struct {
+	HANDLE thread;
+	HANDLE start;		/* Signaled by main thread: job ready (or quit) */
+	HANDLE done;		/* Signaled by worker: job complete */
+	zstd_dctx *dctx;
+	uint8_t *in;		/* One or more complete frames */
+	size_t in_len, in_cap;
+	uint8_t *out;		/* Decoded data */
+	size_t out_len, out_cap;
+	int status;
+	smallint quit;
+} zstd_worker_t;
+
+/*
+ * Walk the frame structure at the start of buf: returns the offset of the
+ * first byte past one content frame (and any skippable frames preceding
+ * it), 0 if more input is needed, or -1 if the data is not a frame.
+ */
+static int64_t zstd_carve(const uint8_t *buf, size_t len)
+{
+	static const uint8_t did_bytes[4] = { 0, 1, 2, 4 };
+	size_t pos = 0;
+	uint32_t magic, bh, bsize;
+	uint64_t need;
+	int fhd, fcs_len;
+
+	for (;;) {
+		if (len - pos < 4)
+			return 0;
+		magic = zstd_le32(buf + pos);
+		if ((magic & ZSTD_MAGIC_SKIP_MASK) == ZSTD_MAGIC_SKIP) {
+			if (len - pos < 8)
+				return 0;
+			need = 8 + (uint64_t)zstd_le32(buf + pos + 4);
+			if (len - pos < need)
+				return 0;
+			pos += (size_t)need;
+			continue;
+		}
+		if (magic != ZSTD_MAGIC)
+			return -1;
+		pos += 4;
+		if (len - pos < 1)
+			return 0;
+		fhd = buf[pos];
+		fcs_len = ((fhd >> 6) == 0) ? ((fhd & 0x20) ? 1 : 0) : (1 << (fhd >> 6));
+		need = 1 + ((fhd & 0x20) ? 0 : 1) + did_bytes[fhd & 3] + fcs_len;
+		if (len - pos < need)
+			return 0;
+		pos += (size_t)need;
+		for (;;) {
+			if (len - pos < 3)
+				return 0;
+			bh = buf[pos] | (buf[pos + 1] << 8) | ((uint32_t)buf[pos + 2] << 16);
+			bsize = bh >> 3;
+			if (((bh >> 1) & 3) == 3)
+				return -1;
+			need = 3 + (((bh >> 1) & 3) == 1 ? 1 : bsize);
+			if (len - pos < need)
+				return 0;
+			pos += (size_t)need;
+			if (bh & 1)
+				break;
+		}
+		if (fhd & 0x04) {	/* content checksum */
+			if (len - pos < 4)
+				return 0;
+			pos += 4;
+		}
+		return (int64_t)pos;
+	}
+}
+
+static int zstd_emit_worker(void *ctx, const void *buf, size_t len)
+{
+	zstd_worker_t *w = ctx;
+	uint8_t *p;
+	size_t cap;
+
+	if (w->out_cap - w->out_len < len) {
+		cap = MAX(w->out_cap * 2, w->out_len + len + ZSTD_SCAN_CHUNK);
+		/* Plain realloc: the x*() allocators die through a longjmp
+		 * on the main thread and can't be used here */
+		p = realloc(w->out, cap);
+		if (p == NULL)
+			return -1;
+		w->out = p;
+		w->out_cap = cap;
+	}
+	memcpy(&w->out[w->out_len], buf, len);
+	w->out_len += len;
+	return 0;
+}
+
+static DWORD WINAPI zstd_worker_thread(LPVOID param)
+{
+	zstd_worker_t *w = (zstd_worker_t*)param;
+	long long total;
+
+	for (;;) {
+		WaitForSingleObject(w->start, INFINITE);
+		if (w->quit)
+			return 0;
+		w->out_len = 0;
+		w->dctx->mem = w->in;
+		w->dctx->mem_len = w->in_len;
+		w->dctx->mem_pos = 0;
+		w->status = zstd_decode_all(w->dctx, &total);
+		SetEvent(w->done);
+	}
+}
+
+static int zstd_collect(transformer_state_t *xstate, zstd_worker_t *w,
+		long long *written, smallint discard)
+{
+	ssize_t nwrote;
+
+	WaitForSingleObject(w->done, INFINITE);
+	if (discard)
+		return 0;
+	if (w->status != 0)
+		return -1;
+	if (w->out_len != 0) {
+		nwrote = transformer_write(xstate, w->out, w->out_len);
+		if (nwrote != (ssize_t)w->out_len)
+			return (nwrote == -ENOSPC) ? -ENOSPC : -1;
+		*written += w->out_len;
+	}
+	return 0;
+}
+
+/*
+ * Decode the remaining frames on a worker pool. seed holds input already
+ * consumed by the caller, starting at a frame magic. Returns TRUE if the
+ * parallel path ran, with *status (0, -1 or -ENOSPC) and *written filled
+ * in, or FALSE if no pool could be set up.
+ */
+static smallint unpack_zstd_parallel(transformer_state_t *xstate,
+		const void *seed, size_t seed_len, int *status, long long *written)
+{
+	zstd_worker_t worker[ZSTD_NUM_WORKERS];
+	zstd_worker_t *w;
+	uint8_t *inbuf = NULL, *p;
+	size_t in_len, in_cap;
+	int64_t next;
+	unsigned job = 0, collected = 0;
+	smallint eof = 0, ok = 1;
+	int i, rb;
+
+	*status = 0;
+	*written = 0;
+	memset(worker, 0, sizeof(worker));
+	for (i = 0; i < ZSTD_NUM_WORKERS; i++) {
+		worker[i].start = CreateEvent(NULL, FALSE, FALSE, NULL);
+		worker[i].done = CreateEvent(NULL, FALSE, FALSE, NULL);
+		worker[i].dctx = zstd_dctx_new();
+		if (worker[i].dctx != NULL) {
+			worker[i].dctx->emit = zstd_emit_worker;
+			worker[i].dctx->emit_ctx = &worker[i];
+		}
+		if (worker[i].start != NULL && worker[i].done != NULL &&
+		    worker[i].dctx != NULL)
+			worker[i].thread = CreateThread(NULL, 0, zstd_worker_thread,
+					&worker[i], 0, NULL);
+		if (worker[i].thread == NULL)
+			goto no_pool;
+	}
+	in_cap = seed_len + ZSTD_SCAN_CHUNK;
+	inbuf = malloc(in_cap);
+	if (inbuf == NULL)
+		goto no_pool;
+	memcpy(inbuf, seed, seed_len);
+	in_len = seed_len;
+
+	while (1) {
+		next = zstd_carve(inbuf, in_len);
+		if (next < 0) {
+			/* Not a frame: treat like trailing garbage and stop */
+			break;
+		}
+		if (next == 0) {
+			if (eof) {
+				if (in_len != 0) {
+					bb_error_msg("truncated zstd frame");
+					*status = -1;
+				}
+				break;
+			}
+			while (in_cap - in_len < ZSTD_SCAN_CHUNK)
+				in_cap *= 2;
+			p = realloc(inbuf, in_cap);
+			if (p == NULL) {
+				*status = -1;
+				break;
+			}
+			inbuf = p;
+			rb = safe_read(xstate->src_fd, inbuf + in_len, ZSTD_SCAN_CHUNK);
+			if (rb < 0) {
+				*status = -1;
+				break;
+			}
+			if (rb == 0)
+				eof = 1;
+			in_len += rb;
+			continue;
+		}
+		/* Hand the [0, next) frame to the next worker, collecting the
+		 * job it ran ZSTD_NUM_WORKERS dispatches ago first */
+		w = &worker[job % ZSTD_NUM_WORKERS];
+		if (job >= ZSTD_NUM_WORKERS) {
+			i = zstd_collect(xstate, w, written, FALSE);
+			collected++;
+			if (i != 0) {
+				*status = i;
+				break;
+			}
+		}
+		if (w->in_cap < (size_t)next) {
+			p = realloc(w->in, (size_t)next);
+			if (p == NULL) {
+				*status = -1;
+				break;
+			}
+			w->in = p;
+			w->in_cap = (size_t)next;
+		}
+		memcpy(w->in, inbuf, (size_t)next);
+		w->in_len = (size_t)next;
+		SetEvent(w->start);
+		job++;
+		memmove(inbuf, inbuf + next, in_len - next);
+		in_len -= (size_t)next;
+		if (eof && in_len == 0)
+			break;
+	}
+
+	/* Drain the remaining jobs, in order, discarding output after an error */
+	for (; collected < job; collected++) {
+		w = &worker[collected % ZSTD_NUM_WORKERS];
+		i = zstd_collect(xstate, w, written, *status != 0);
+		if (*status == 0)
+			*status = i;
+	}
+	goto out;
+
+ no_pool:
+	ok = 0;
+ out:
+	for (i = 0; i < ZSTD_NUM_WORKERS; i++) {
+		w = &worker[i];
+		if (w->thread != NULL) {
+			w->quit = 1;
+			SetEvent(w->start);
+			WaitForSingleObject(w->thread, INFINITE);
+			CloseHandle(w->thread);
+		}
+		if (w->start != NULL)
+			CloseHandle(w->start);
+		if (w->done != NULL)
+			CloseHandle(w->done);
+		zstd_dctx_free(w->dctx);
+		free(w->in);
+		free(w->out);
+	}
+	free(inbuf);
+	return ok;
+}
+
+static int zstd_emit_xstate(void *ctx, const void *buf, size_t len)
+{
+	transformer_state_t *xstate = ctx;
+	ssize_t nwrote = transformer_write(xstate, buf, len);
+
+	if (nwrote == (ssize_t)len)
+		return 0;
+	return (nwrote == -ENOSPC) ? -ENOSPC : -1;
+}
+
+IF_DESKTOP(long long) int FAST_FUNC unpack_zstd_stream(transformer_state_t *xstate)
+{
+	IF_DESKTOP(long long) int n = -1;
+	long long total = 0, frame_size, parallel_written;
+	zstd_dctx *d = NULL;
+	uint8_t hdr[4];
+	uint32_t magic;
+	smallint first = 1;
+	int rb, r;
+
+	if (xstate->dst_dir)
+		bb_error_msg_and_err("decompress to dir is not supported");
+
+	if (safe_read(xstate->src_fd, hdr, 4) != 4)
+		bb_error_msg_and_err("invalid magic");
+	magic = zstd_le32(hdr);
+	if (magic != ZSTD_MAGIC && (magic & ZSTD_MAGIC_SKIP_MASK) != ZSTD_MAGIC_SKIP)
+		bb_error_msg_and_err("invalid magic");
+
+	d = zstd_dctx_new();
+	if (d == NULL)
+		bb_error_msg_and_err("memory allocation error");
+	d->fd = xstate->src_fd;
+	d->emit = zstd_emit_xstate;
+	d->emit_ctx = xstate;
+	d->fast_skip = xstate->dst_skip;
+
+	for (;;) {
+		if ((magic & ZSTD_MAGIC_SKIP_MASK) == ZSTD_MAGIC_SKIP) {
+			if (zstd_src_read(d, hdr, 4) < 0 ||
+			    zstd_src_skip(d, zstd_le32(hdr)) < 0)
+				bb_error_msg_and_err("truncated skippable frame");
+		} else {
+			/* A second content frame means a pzstd/seekable style
+			 * multi-frame file: decode the rest on a worker pool.
+			 * Falls through to sequential decode if no pool. */
+			if (!first && xstate->dst_skip == 0 &&
+			    unpack_zstd_parallel(xstate, hdr, 4,
+					&r, &parallel_written)) {
+				if (r == -ENOSPC)
+					goto nospc;
+				if (r != 0)
+					goto err;
+				total += parallel_written;
+				break;
+			}
+			if (zstd_decode_frame(d, &frame_size) < 0) {
+				if (d->emit_err == -ENOSPC)
+					goto nospc;
+				goto err;
+			}
+			total += frame_size;
+			/* A fast-skipped frame decrements fast_skip, a decoded
+			 * one has its output discarded by transformer_write()
+			 * which decrements dst_skip: the lower of the two is
+			 * the remaining skip either way */
+			xstate->dst_skip = d->fast_skip =
+				MIN(xstate->dst_skip, d->fast_skip);
+			first = 0;
+		}
+		rb = zstd_src_read_upto(d, hdr, 4);
+		if (rb == 0)
+			break;
+		if (rb != 4)
+			break;	/* trailing garbage is ignored */
+		magic = zstd_le32(hdr);
+		if (magic != ZSTD_MAGIC &&
+		    (magic & ZSTD_MAGIC_SKIP_MASK) != ZSTD_MAGIC_SKIP)
+			break;
+	}
+	n = total;
+	goto err;
+
+ nospc:
+	/* Same convention as the other unpackers: a full output buffer is
+	 * reported as its size */
+	n = (IF_DESKTOP(long long) int)xstate->mem_output_size_max;
+ err:
+	zstd_dctx_free(d);
+	return n;
+}
@@ -132,6 +132,12 @@ extern void (*bled_switch) (const char* filename, const uint64_t filesize);
 extern int (*bled_read)(int fd, void* buf, unsigned int count);
 extern int (*bled_write)(int fd, const void* buf, unsigned int count);
 extern unsigned long* bled_cancel_request;
+extern uint32_t bled_buffer_size;
+
+/* Per-session decompressor buffer pool, see bled.c. Buffers returned by
+ * bled_pool_get() are owned by the pool and MUST NOT be freed by callers. */
+#define BLED_POOL_SLOTS 4
+extern void* bled_pool_get(int type, int slot, size_t size);
 
 #define xfunc_die() longjmp(bb_error_jmp, 1)
 #define bb_printf(...) do { if (bled_printf != NULL) bled_printf(__VA_ARGS__); \
@@ -165,6 +171,11 @@ static inline int fnmatch(const char *pattern, const char *string, int flags) {r
 static inline pid_t wait(int* status) { *status = 4; return -1; }
 #define wait_any_nohang wait
 
+/* Double-buffered source prefetch thread, see read_ahead.c */
+void bb_read_ahead_start(int fd);
+void bb_read_ahead_stop(void);
+int bb_read_ahead_read(int fd, void *buf, unsigned int count);
+
 /* This enables the display of a progress based on the number of bytes read */
 extern uint64_t bb_total_rb;
 static inline int full_read(int fd, void *buf, unsigned int count) {
@@ -190,7 +201,7 @@ static inline int full_read(int fd, void *buf, unsigned int count) {
 		bb_virtual_pos += count;
 		rb = (int)count;
 	} else {
-		rb = (bled_read != NULL) ? bled_read(fd, buf, count) : _read(fd, buf, count);
+		rb = bb_read_ahead_read(fd, buf, count);
 	}
 	if (rb > 0) {
 		bb_total_rb += rb;
@@ -30,6 +30,21 @@ int FAST_FUNC check_signature16(transformer_state_t *xstate, unsigned magic16)
 ssize_t FAST_FUNC transformer_write(transformer_state_t *xstate, const void *buf, size_t bufsize)
 {
 	ssize_t nwrote;
+	size_t skipped = 0;
+
+	/* When resuming, discard decompressed output up to the requested offset.
+	 * Skipped bytes still count as "written" so that the callers' totals
+	 * keep tracking the uncompressed position. */
+	if (xstate->dst_skip != 0) {
+		if ((uint64_t)bufsize <= xstate->dst_skip) {
+			xstate->dst_skip -= bufsize;
+			return bufsize;
+		}
+		skipped = (size_t)xstate->dst_skip;
+		buf = (const char*)buf + skipped;
+		bufsize -= skipped;
+		xstate->dst_skip = 0;
+	}
 
 	if (xstate->mem_output_size_max != 0) {
 		size_t pos = xstate->mem_output_size;
@@ -53,6 +68,8 @@ ssize_t FAST_FUNC transformer_write(transformer_state_t *xstate, const void *buf
 		}
 	}
  ret:
+	if (nwrote >= 0)
+		nwrote += skipped;
 	return nwrote;
 }
 
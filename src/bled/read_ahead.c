@@ -0,0 +1,166 @@
+/*
+ * Read-ahead for Bled/busybox
+ *
+ * Copyright © 2026 Pete Batard <pete@akeo.ie>
+ *
+ * Double-buffered prefetch thread placed in front of the decompressors'
+ * fill functions, so that source I/O latency (e.g. an ISO residing on a
+ * network share) is hidden from the CPU-bound decode loop.
+ *
+ * Licensed under GPLv2 or later, see file LICENSE in this source tree.
+ */
+
+#include <windows.h>
+#include "libbb.h"
+
+#define RA_NUM_BUFS 2
+
+typedef struct {
+	uint8_t *data;
+	int      len;	/* > 0: data, 0: EOF, < 0: read error */
+	HANDLE   full;
+	HANDLE   empty;
+} ra_buf_t;
+
+static ra_buf_t ra_buf[RA_NUM_BUFS];
+static HANDLE ra_thread = NULL;
+static volatile int ra_quit;
+static int ra_fd = -1;
+static int ra_errno;
+static unsigned int ra_bufsize;
+/* Consumer side cursor */
+static int ra_cur, ra_filled, ra_done;
+static unsigned int ra_pos;
+
+/* The underlying source read, as full_read() used to issue it inline */
+static int ra_source_read(int fd, void *buf, unsigned int count)
+{
+	return (bled_read != NULL) ? bled_read(fd, buf, count) : _read(fd, buf, count);
+}
+
+static DWORD WINAPI ra_thread_func(LPVOID param)
+{
+	int i = 0, len;
+
+	(void)param;
+	while (1) {
+		WaitForSingleObject(ra_buf[i].empty, INFINITE);
+		if (ra_quit)
+			break;
+		len = ra_source_read(ra_fd, ra_buf[i].data, ra_bufsize);
+		if (len < 0)
+			ra_errno = errno;
+		ra_buf[i].len = len;
+		SetEvent(ra_buf[i].full);
+		/* Past EOF or error there is nothing left to prefetch */
+		if (len <= 0)
+			break;
+		i = (i + 1) % RA_NUM_BUFS;
+	}
+	return 0;
+}
+
+/*
+ * Start prefetching 'fd'. Must only be used for sources that are consumed
+ * strictly sequentially (i.e. not for zip, which seeks its input), and is
+ * a no-op if the thread or buffers can't be allocated, in which case reads
+ * simply stay synchronous.
+ */
+void bb_read_ahead_start(int fd)
+{
+	int i;
+
+	if (ra_thread != NULL)
+		bb_read_ahead_stop();
+
+	ra_quit = 0;
+	ra_fd = fd;
+	ra_errno = 0;
+	ra_cur = 0;
+	ra_filled = 0;
+	ra_done = 0;
+	ra_pos = 0;
+	ra_bufsize = bled_buffer_size;
+	for (i = 0; i < RA_NUM_BUFS; i++) {
+		ra_buf[i].data = malloc(ra_bufsize);
+		ra_buf[i].len = 0;
+		/* Auto-reset, with every buffer starting out empty */
+		ra_buf[i].full = CreateEvent(NULL, FALSE, FALSE, NULL);
+		ra_buf[i].empty = CreateEvent(NULL, FALSE, TRUE, NULL);
+		if (ra_buf[i].data == NULL || ra_buf[i].full == NULL || ra_buf[i].empty == NULL)
+			goto err;
+	}
+	ra_thread = CreateThread(NULL, 0, ra_thread_func, NULL, 0, NULL);
+	if (ra_thread != NULL)
+		return;
+
+err:
+	bb_read_ahead_stop();
+}
+
+void bb_read_ahead_stop(void)
+{
+	int i;
+
+	if (ra_thread != NULL) {
+		ra_quit = 1;
+		for (i = 0; i < RA_NUM_BUFS; i++)
+			SetEvent(ra_buf[i].empty);
+		WaitForSingleObject(ra_thread, INFINITE);
+		CloseHandle(ra_thread);
+		ra_thread = NULL;
+	}
+	for (i = 0; i < RA_NUM_BUFS; i++) {
+		free(ra_buf[i].data);
+		ra_buf[i].data = NULL;
+		if (ra_buf[i].full != NULL)
+			CloseHandle(ra_buf[i].full);
+		if (ra_buf[i].empty != NULL)
+			CloseHandle(ra_buf[i].empty);
+		ra_buf[i].full = NULL;
+		ra_buf[i].empty = NULL;
+	}
+	ra_fd = -1;
+}
+
+/*
+ * Serve a read from the prefetched buffers, or fall through to a plain
+ * synchronous read when the prefetcher is not active for this descriptor.
+ */
+int bb_read_ahead_read(int fd, void *buf, unsigned int count)
+{
+	unsigned int copied = 0, chunk;
+
+	if (ra_thread == NULL || fd != ra_fd)
+		return ra_source_read(fd, buf, count);
+
+	while (copied < count && !ra_done) {
+		if (!ra_filled) {
+			WaitForSingleObject(ra_buf[ra_cur].full, INFINITE);
+			ra_filled = 1;
+			ra_pos = 0;
+		}
+		if (ra_buf[ra_cur].len < 0) {
+			ra_done = 1;
+			if (copied == 0) {
+				errno = ra_errno;
+				return -1;
+			}
+			break;
+		}
+		if (ra_buf[ra_cur].len == 0) {
+			ra_done = 1;
+			break;
+		}
+		chunk = MIN(count - copied, (unsigned int)ra_buf[ra_cur].len - ra_pos);
+		memcpy((uint8_t*)buf + copied, &ra_buf[ra_cur].data[ra_pos], chunk);
+		ra_pos += chunk;
+		copied += chunk;
+		if (ra_pos == (unsigned int)ra_buf[ra_cur].len) {
+			ra_filled = 0;
+			SetEvent(ra_buf[ra_cur].empty);
+			ra_cur = (ra_cur + 1) % RA_NUM_BUFS;
+		}
+	}
+	return (int)copied;
+}
@@ -0,0 +1,387 @@
+/*
+ * Rufus: The Reliable USB Formatting Utility
+ * Content-defined chunking dedup store, for golden image libraries
+ * Copyright © 2022 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Labs that keep a library of 'golden' images (same OS base, different
+ * drivers or payloads) end up storing and re-reading the shared 80+% over
+ * and over. This module splits a raw disk image into content-defined chunks
+ * (FastCDC-style gear rolling hash, so an insertion early in the image does
+ * not shift every boundary after it), identifies each chunk by its SHA-256,
+ * and stores the unique chunks in a local directory, with the image itself
+ * reduced to a manifest - an ordered list of chunk IDs. Importing a second
+ * image that shares content only adds its unique chunks, and WriteDrive()
+ * can stream a manifest directly, in sequential chunk order.
+ *
+ * Layout: '<image>.rcm' manifest next to the source image, unique chunks
+ * under '<image dir>\chunks\<2 hex digits>\<64 hex digits>'.
+ */
+
+/* Memory leaks detection - define _CRTDBG_MAP_ALLOC as preprocessor macro */
+#ifdef _CRTDBG_MAP_ALLOC
+#include <stdlib.h>
+#include <crtdbg.h>
+#endif
+
+#include <windows.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rufus.h"
+#include "missing.h"
+#include "msapi_utf8.h"
+
+/* Chunking parameters: 1 MB average, bounded to [256 KB, 4 MB] */
+#define CDC_MIN_SIZE        (256 * KB)
+#define CDC_AVG_SIZE        (1 * MB)
+#define CDC_MAX_SIZE        (4 * MB)
+/* FastCDC normalization: harder mask before the average size, easier after */
+#define CDC_MASK_S          ((1ULL << 22) - 1)
+#define CDC_MASK_L          ((1ULL << 18) - 1)
+#define CDC_SUM_SIZE        32	// SHA-256
+#define CDC_MANIFEST_MAGIC  "RufusCDC"
+
+#pragma pack(push, 1)
+typedef struct {
+	char magic[8];
+	uint32_t version;
+	uint32_t chunk_count;
+	uint64_t image_size;
+} cdc_manifest_hdr;
+
+typedef struct {
+	uint8_t sum[CDC_SUM_SIZE];
+	uint32_t size;
+} cdc_entry;
+#pragma pack(pop)
+
+static uint64_t cdc_gear[256];
+static BOOL cdc_gear_ready = FALSE;
+
+/* Deterministic gear table, so that every build chunks identically */
+static void cdc_gear_init(void)
+{
+	uint64_t x = 0x2545F4914F6CDD1DULL;
+	int i;
+
+	for (i = 0; i < 256; i++) {
+		// xorshift64
+		x ^= x << 13;
+		x ^= x >> 7;
+		x ^= x << 17;
+		cdc_gear[i] = x;
+	}
+	cdc_gear_ready = TRUE;
+}
+
+/* Find the next content-defined cut point in [CDC_MIN_SIZE, CDC_MAX_SIZE] */
+static uint32_t cdc_cut(const uint8_t* buf, size_t len)
+{
+	uint64_t h = 0;
+	size_t i, barrier;
+
+	if (len <= CDC_MIN_SIZE)
+		return (uint32_t)len;
+	barrier = min(len, CDC_AVG_SIZE);
+	for (i = CDC_MIN_SIZE; i < barrier; i++) {
+		h = (h << 1) + cdc_gear[buf[i]];
+		if ((h & CDC_MASK_S) == 0)
+			return (uint32_t)(i + 1);
+	}
+	barrier = min(len, CDC_MAX_SIZE);
+	for (; i < barrier; i++) {
+		h = (h << 1) + cdc_gear[buf[i]];
+		if ((h & CDC_MASK_L) == 0)
+			return (uint32_t)(i + 1);
+	}
+	return (uint32_t)barrier;
+}
+
+static void cdc_chunk_path(char* path, size_t path_size, const char* store_dir, const uint8_t* sum)
+{
+	char hex[2 * CDC_SUM_SIZE + 1];
+	int i;
+
+	for (i = 0; i < CDC_SUM_SIZE; i++)
+		sprintf(&hex[2 * i], "%02x", sum[i]);
+	safe_sprintf(path, path_size, "%s\\%c%c\\%s", store_dir, hex[0], hex[1], hex);
+}
+
+/*
+ * Import a raw disk image into the dedup store, producing '<image>.rcm'.
+ * Returns TRUE on success. Only chunks that aren't already in the store
+ * get written, so importing many related images dedups their shared data.
+ */
+BOOL CdcImportImage(const char* image_path)
+{
+	BOOL ret = FALSE, eof = FALSE;
+	HANDLE hImage = INVALID_HANDLE_VALUE;
+	char store_dir[MAX_PATH], path[MAX_PATH], manifest_path[MAX_PATH];
+	uint8_t *buf = NULL, *manifest = NULL, *p;
+	cdc_manifest_hdr* hdr;
+	cdc_entry* entry;
+	uint32_t valid = 0, cut, entry_cap = 1024, i;
+	uint64_t new_bytes = 0, dup_bytes = 0, new_chunks = 0;
+	DWORD rs;
+
+	if ((image_path == NULL) || (strlen(image_path) > MAX_PATH - 16))
+		return FALSE;
+	if (!cdc_gear_ready)
+		cdc_gear_init();
+
+	static_sprintf(manifest_path, "%s.rcm", image_path);
+	static_strcpy(store_dir, image_path);
+	for (i = (uint32_t)strlen(store_dir); (i > 0) && (store_dir[i - 1] != '\\'); i--);
+	safe_sprintf(&store_dir[i], sizeof(store_dir) - i, "chunks");
+	if (!CreateDirectoryU(store_dir, NULL) && (GetLastError() != ERROR_ALREADY_EXISTS)) {
+		uprintf("Could not create chunk store '%s': %s", store_dir, WindowsErrorString());
+		goto out;
+	}
+
+	hImage = CreateFileU(image_path, GENERIC_READ, FILE_SHARE_READ, NULL,
+		OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (hImage == INVALID_HANDLE_VALUE) {
+		uprintf("Could not open image '%s': %s", image_path, WindowsErrorString());
+		goto out;
+	}
+
+	buf = malloc(2 * CDC_MAX_SIZE);
+	manifest = malloc(sizeof(cdc_manifest_hdr) + entry_cap * sizeof(cdc_entry));
+	if ((buf == NULL) || (manifest == NULL)) {
+		uprintf("Could not allocate chunking buffers");
+		goto out;
+	}
+	hdr = (cdc_manifest_hdr*)manifest;
+	memset(hdr, 0, sizeof(cdc_manifest_hdr));
+	memcpy(hdr->magic, CDC_MANIFEST_MAGIC, sizeof(hdr->magic));
+	hdr->version = 1;
+
+	uprintf("Importing '%s' into the dedup store:", image_path);
+	while (TRUE) {
+		// Keep the window full, so cuts up to CDC_MAX_SIZE are always possible
+		while (!eof && (valid < 2 * CDC_MAX_SIZE)) {
+			if (!ReadFile(hImage, &buf[valid], 2 * CDC_MAX_SIZE - valid, &rs, NULL)) {
+				uprintf("Read error: %s", WindowsErrorString());
+				goto out;
+			}
+			if (rs == 0)
+				eof = TRUE;
+			valid += rs;
+		}
+		if (valid == 0)
+			break;
+
+		cut = cdc_cut(buf, valid);
+		if (hdr->chunk_count >= entry_cap) {
+			entry_cap *= 2;
+			p = realloc(manifest, sizeof(cdc_manifest_hdr) + entry_cap * sizeof(cdc_entry));
+			if (p == NULL) {
+				uprintf("Could not grow the manifest");
+				goto out;
+			}
+			manifest = p;
+			hdr = (cdc_manifest_hdr*)manifest;
+		}
+		entry = &((cdc_entry*)&manifest[sizeof(cdc_manifest_hdr)])[hdr->chunk_count];
+		if (!HashBuffer(CHECKSUM_SHA256, buf, cut, entry->sum)) {
+			uprintf("Could not hash chunk");
+			goto out;
+		}
+		entry->size = cut;
+
+		cdc_chunk_path(path, sizeof(path), store_dir, entry->sum);
+		if (_accessU(path, 0) == 0) {
+			dup_bytes += cut;
+		} else {
+			// Create the '<2 hex digits>' fan-out directory on first use
+			path[strlen(store_dir) + 3] = 0;
+			if (!CreateDirectoryU(path, NULL) && (GetLastError() != ERROR_ALREADY_EXISTS)) {
+				uprintf("Could not create '%s': %s", path, WindowsErrorString());
+				goto out;
+			}
+			cdc_chunk_path(path, sizeof(path), store_dir, entry->sum);
+			if (write_file(path, buf, cut) != cut)
+				goto out;
+			new_bytes += cut;
+			new_chunks++;
+		}
+		hdr->chunk_count++;
+		hdr->image_size += cut;
+		valid -= cut;
+		memmove(buf, &buf[cut], valid);
+	}
+
+	if (write_file(manifest_path, manifest, (uint32_t)(sizeof(cdc_manifest_hdr) +
+		hdr->chunk_count * sizeof(cdc_entry))) == 0)
+		goto out;
+	uprintf("  %u chunks (%llu new), manifest '%s'", hdr->chunk_count, new_chunks, manifest_path);
+	uprintf("  Added %s to the store", SizeToHumanReadable(new_bytes, FALSE, FALSE));
+	uprintf("  Deduplicated %s (%d%% of the image)", SizeToHumanReadable(dup_bytes, FALSE, FALSE),
+		(hdr->image_size == 0) ? 0 : (int)((dup_bytes * 100) / hdr->image_size));
+	ret = TRUE;
+
+out:
+	safe_closehandle(hImage);
+	safe_free(buf);
+	safe_free(manifest);
+	return ret;
+}
+
+/* Check for the chunk manifest magic */
+BOOL IsCdcManifest(const char* path)
+{
+	HANDLE handle;
+	cdc_manifest_hdr hdr;
+	DWORD size;
+	BOOL r;
+
+	if (path == NULL)
+		return FALSE;
+	handle = CreateFileU(path, GENERIC_READ, FILE_SHARE_READ, NULL,
+		OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (handle == INVALID_HANDLE_VALUE)
+		return FALSE;
+	r = ReadFile(handle, &hdr, sizeof(hdr), &size, NULL) && (size == sizeof(hdr)) &&
+		(memcmp(hdr.magic, CDC_MANIFEST_MAGIC, sizeof(hdr.magic)) == 0) && (hdr.version == 1);
+	CloseHandle(handle);
+	return r;
+}
+
+/* Size of the image a manifest references, or 0 if it can't be read */
+uint64_t CdcManifestSize(const char* path)
+{
+	HANDLE handle;
+	cdc_manifest_hdr hdr;
+	DWORD size;
+	BOOL r;
+
+	handle = CreateFileU(path, GENERIC_READ, FILE_SHARE_READ, NULL,
+		OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (handle == INVALID_HANDLE_VALUE)
+		return 0;
+	r = ReadFile(handle, &hdr, sizeof(hdr), &size, NULL) && (size == sizeof(hdr)) &&
+		(memcmp(hdr.magic, CDC_MANIFEST_MAGIC, sizeof(hdr.magic)) == 0);
+	CloseHandle(handle);
+	return r ? hdr.image_size : 0;
+}
+
+/* Streaming read of a manifest's payload, for WriteDrive() */
+static struct {
+	BOOL active;
+	char store_dir[MAX_PATH];
+	cdc_entry* entry;
+	uint32_t chunk_count;
+	uint32_t cur;
+	uint64_t image_size;
+	uint8_t* chunk;
+	uint32_t chunk_len;
+	uint32_t chunk_pos;
+} cdc_stream = { 0 };
+
+BOOL CdcStreamOpen(const char* manifest_path, uint64_t* image_size)
+{
+	cdc_manifest_hdr* hdr;
+	uint8_t* manifest = NULL;
+	uint32_t size, i;
+
+	if (cdc_stream.active || (manifest_path == NULL))
+		return FALSE;
+
+	size = read_file(manifest_path, &manifest);
+	if ((size < sizeof(cdc_manifest_hdr)) || (manifest == NULL))
+		goto err;
+	hdr = (cdc_manifest_hdr*)manifest;
+	if ((memcmp(hdr->magic, CDC_MANIFEST_MAGIC, sizeof(hdr->magic)) != 0) || (hdr->version != 1) ||
+		(size != sizeof(cdc_manifest_hdr) + hdr->chunk_count * sizeof(cdc_entry))) {
+		uprintf("'%s' is not a valid chunk manifest", manifest_path);
+		goto err;
+	}
+
+	static_strcpy(cdc_stream.store_dir, manifest_path);
+	for (i = (uint32_t)strlen(cdc_stream.store_dir); (i > 0) && (cdc_stream.store_dir[i - 1] != '\\'); i--);
+	safe_sprintf(&cdc_stream.store_dir[i], sizeof(cdc_stream.store_dir) - i, "chunks");
+
+	cdc_stream.entry = malloc(hdr->chunk_count * sizeof(cdc_entry));
+	if (cdc_stream.entry == NULL)
+		goto err;
+	memcpy(cdc_stream.entry, &manifest[sizeof(cdc_manifest_hdr)], hdr->chunk_count * sizeof(cdc_entry));
+	cdc_stream.chunk_count = hdr->chunk_count;
+	cdc_stream.image_size = hdr->image_size;
+	cdc_stream.cur = 0;
+	cdc_stream.chunk = NULL;
+	cdc_stream.chunk_len = 0;
+	cdc_stream.chunk_pos = 0;
+	cdc_stream.active = TRUE;
+	if (image_size != NULL)
+		*image_size = hdr->image_size;
+	free(manifest);
+	return TRUE;
+
+err:
+	safe_free(manifest);
+	return FALSE;
+}
+
+/*
+ * Copy up to 'size' sequential bytes of the manifest's payload into 'buf'.
+ * Returns the number of bytes copied (0 at end of image), or -1 on error,
+ * matching the StreamingDownloadRead() semantics WriteDrive() expects.
+ */
+int CdcStreamRead(uint8_t* buf, DWORD size)
+{
+	char path[MAX_PATH];
+	DWORD copied = 0, len;
+
+	if (!cdc_stream.active)
+		return -1;
+	while (copied < size) {
+		if (cdc_stream.chunk_pos >= cdc_stream.chunk_len) {
+			// Current chunk exhausted => pull the next one from the store
+			safe_free(cdc_stream.chunk);
+			cdc_stream.chunk_len = 0;
+			cdc_stream.chunk_pos = 0;
+			if (cdc_stream.cur >= cdc_stream.chunk_count)
+				break;
+			cdc_chunk_path(path, sizeof(path), cdc_stream.store_dir,
+				cdc_stream.entry[cdc_stream.cur].sum);
+			cdc_stream.chunk_len = read_file(path, &cdc_stream.chunk);
+			if (cdc_stream.chunk_len != cdc_stream.entry[cdc_stream.cur].size) {
+				uprintf("Chunk %u of %u is missing or corrupted ('%s')",
+					cdc_stream.cur + 1, cdc_stream.chunk_count, path);
+				return -1;
+			}
+			cdc_stream.cur++;
+		}
+		len = min(size - copied, cdc_stream.chunk_len - cdc_stream.chunk_pos);
+		memcpy(&buf[copied], &cdc_stream.chunk[cdc_stream.chunk_pos], len);
+		cdc_stream.chunk_pos += len;
+		copied += len;
+	}
+	return (int)copied;
+}
+
+void CdcStreamClose(void)
+{
+	if (!cdc_stream.active)
+		return;
+	safe_free(cdc_stream.entry);
+	safe_free(cdc_stream.chunk);
+	memset(&cdc_stream, 0, sizeof(cdc_stream));
+}
@@ -58,6 +58,7 @@
 #include <string.h>
 #include <inttypes.h>
 #include <errno.h>
+#include <assert.h>
 #include <windowsx.h>
 
 #include "db.h"
@@ -67,10 +68,15 @@
 #include "resource.h"
 #include "msapi_utf8.h"
 #include "localization.h"
+#include "settings.h"
 
 #undef BIG_ENDIAN_HOST
 
-#define BUFFER_SIZE         (64*KB)
+/* Default size of the buffers used by the hashing pipeline. Can be overridden
+   through the 'HashBufferSize' setting (in KB), within the bounds below. */
+#define BUFFER_SIZE         (1*MB)
+#define MIN_BUFFER_SIZE     (64*KB)
+#define MAX_BUFFER_SIZE     (32*MB)
 #define WAIT_TIME           5000
 
 /* Blocksize for each algorithm - Must be a power of 2 */
@@ -97,7 +103,8 @@ uint32_t proc_bufnum, sum_count[CHECKSUM_MAX] = { MD5_HASHSIZE, SHA1_HASHSIZE, S
 HANDLE data_ready[CHECKSUM_MAX] = { 0 }, thread_ready[CHECKSUM_MAX] = { 0 };
 DWORD read_size[NUM_BUFFERS];
 BOOL enable_extra_hashes = FALSE;
-uint8_t ALIGNED(64) buffer[NUM_BUFFERS][BUFFER_SIZE];
+uint8_t* buffer[NUM_BUFFERS];
+static DWORD buffer_size = BUFFER_SIZE;
 extern int default_thread_priority;
 
 /*
@@ -208,7 +215,7 @@ static void sha512_init(SUM_CONTEXT* ctx)
 }
 
 /* Transform the message X which consists of 16 32-bit-words (SHA-1) */
-static void sha1_transform(SUM_CONTEXT *ctx, const uint8_t *data)
+static void sha1_transform_cc(SUM_CONTEXT *ctx, const uint8_t *data)
 {
 	uint32_t a, b, c, d, e, tm, x[16];
 
@@ -342,7 +349,7 @@ static void sha1_transform(SUM_CONTEXT *ctx, const uint8_t *data)
 }
 
 /* Transform the message X which consists of 16 32-bit-words (SHA-256) */
-static __inline void sha256_transform(SUM_CONTEXT *ctx, const uint8_t *data)
+static __inline void sha256_transform_cc(SUM_CONTEXT *ctx, const uint8_t *data)
 {
 	uint32_t a, b, c, d, e, f, g, h, j, x[16];
 
@@ -596,6 +603,424 @@ static void md5_transform(SUM_CONTEXT *ctx, const uint8_t *data)
 }
 
 /* Update the message digest with the contents of the buffer (SHA-1) */
+/*
+ * On x86, the SHA extensions (SHA-NI) process SHA-1 and SHA-256 blocks at a
+ * multiple of the speed of the portable transforms, so use them when the CPU
+ * advertises support.
+ */
+#if (defined(_M_X64) || defined(__x86_64__) || defined(_M_IX86) || defined(__i386__))
+#define CPU_HAS_SHA_EXTENSION_SUPPORT 1
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define TARGET_SHA_NI
+#else
+#include <cpuid.h>
+#define TARGET_SHA_NI __attribute__ ((target("ssse3,sse4.1,sha")))
+#endif
+
+// Runtime detection of the SHA extensions (cached after the first call)
+static BOOL HasShaExtensions(void)
+{
+	static int has_sha = -1;
+	uint32_t regs[4] = { 0 };
+
+	if (has_sha < 0) {
+#if defined(_MSC_VER)
+		__cpuidex((int*)regs, 7, 0);
+#else
+		__get_cpuid_count(7, 0, &regs[0], &regs[1], &regs[2], &regs[3]);
+#endif
+		has_sha = (regs[1] & (1 << 29)) ? 1 : 0;
+		if (has_sha)
+			uprintf("SHA extensions detected - using accelerated SHA-1/SHA-256 transforms");
+	}
+	return (BOOL)has_sha;
+}
+#endif
+
+#if defined(CPU_HAS_SHA_EXTENSION_SUPPORT)
+// SHA extensions (SHA-NI) accelerated transforms, based on the public domain
+// implementations by Sean Gulley and Jeffrey Walton.
+TARGET_SHA_NI static void sha1_transform_ni(SUM_CONTEXT* ctx, const uint8_t* data)
+{
+	__m128i abcd, e0, e1, abcd_save, e_save;
+	__m128i msg0, msg1, msg2, msg3;
+	const __m128i shuf_mask = _mm_set_epi64x(0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+	uint32_t s[5];
+	int i;
+
+	for (i = 0; i < 5; i++)
+		s[i] = (uint32_t)ctx->state[i];
+	abcd = _mm_loadu_si128((const __m128i*)s);
+	e0 = _mm_set_epi32((int)s[4], 0, 0, 0);
+	abcd = _mm_shuffle_epi32(abcd, 0x1B);
+	abcd_save = abcd;
+	e_save = e0;
+
+	// Rounds 0-3
+	msg0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)&data[0]), shuf_mask);
+	e0 = _mm_add_epi32(e0, msg0);
+	e1 = abcd;
+	abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+
+	// Rounds 4-7
+	msg1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)&data[16]), shuf_mask);
+	e1 = _mm_sha1nexte_epu32(e1, msg1);
+	e0 = abcd;
+	abcd = _mm_sha1rnds4_epu32(abcd, e1, 0);
+	msg0 = _mm_sha1msg1_epu32(msg0, msg1);
+
+	// Rounds 8-11
+	msg2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)&data[32]), shuf_mask);
+	e0 = _mm_sha1nexte_epu32(e0, msg2);
+	e1 = abcd;
+	abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+	msg1 = _mm_sha1msg1_epu32(msg1, msg2);
+	msg0 = _mm_xor_si128(msg0, msg2);
+
+	// Rounds 12-15
+	msg3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)&data[48]), shuf_mask);
+	e1 = _mm_sha1nexte_epu32(e1, msg3);
+	e0 = abcd;
+	msg0 = _mm_sha1msg2_epu32(msg0, msg3);
+	abcd = _mm_sha1rnds4_epu32(abcd, e1, 0);
+	msg2 = _mm_sha1msg1_epu32(msg2, msg3);
+	msg1 = _mm_xor_si128(msg1, msg3);
+
+	// Rounds 16-19
+	e0 = _mm_sha1nexte_epu32(e0, msg0);
+	e1 = abcd;
+	msg1 = _mm_sha1msg2_epu32(msg1, msg0);
+	abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+	msg3 = _mm_sha1msg1_epu32(msg3, msg0);
+	msg2 = _mm_xor_si128(msg2, msg0);
+
+	// Rounds 20-23
+	e1 = _mm_sha1nexte_epu32(e1, msg1);
+	e0 = abcd;
+	msg2 = _mm_sha1msg2_epu32(msg2, msg1);
+	abcd = _mm_sha1rnds4_epu32(abcd, e1, 1);
+	msg0 = _mm_sha1msg1_epu32(msg0, msg1);
+	msg3 = _mm_xor_si128(msg3, msg1);
+
+	// Rounds 24-27
+	e0 = _mm_sha1nexte_epu32(e0, msg2);
+	e1 = abcd;
+	msg3 = _mm_sha1msg2_epu32(msg3, msg2);
+	abcd = _mm_sha1rnds4_epu32(abcd, e0, 1);
+	msg1 = _mm_sha1msg1_epu32(msg1, msg2);
+	msg0 = _mm_xor_si128(msg0, msg2);
+
+	// Rounds 28-31
+	e1 = _mm_sha1nexte_epu32(e1, msg3);
+	e0 = abcd;
+	msg0 = _mm_sha1msg2_epu32(msg0, msg3);
+	abcd = _mm_sha1rnds4_epu32(abcd, e1, 1);
+	msg2 = _mm_sha1msg1_epu32(msg2, msg3);
+	msg1 = _mm_xor_si128(msg1, msg3);
+
+	// Rounds 32-35
+	e0 = _mm_sha1nexte_epu32(e0, msg0);
+	e1 = abcd;
+	msg1 = _mm_sha1msg2_epu32(msg1, msg0);
+	abcd = _mm_sha1rnds4_epu32(abcd, e0, 1);
+	msg3 = _mm_sha1msg1_epu32(msg3, msg0);
+	msg2 = _mm_xor_si128(msg2, msg0);
+
+	// Rounds 36-39
+	e1 = _mm_sha1nexte_epu32(e1, msg1);
+	e0 = abcd;
+	msg2 = _mm_sha1msg2_epu32(msg2, msg1);
+	abcd = _mm_sha1rnds4_epu32(abcd, e1, 1);
+	msg0 = _mm_sha1msg1_epu32(msg0, msg1);
+	msg3 = _mm_xor_si128(msg3, msg1);
+
+	// Rounds 40-43
+	e0 = _mm_sha1nexte_epu32(e0, msg2);
+	e1 = abcd;
+	msg3 = _mm_sha1msg2_epu32(msg3, msg2);
+	abcd = _mm_sha1rnds4_epu32(abcd, e0, 2);
+	msg1 = _mm_sha1msg1_epu32(msg1, msg2);
+	msg0 = _mm_xor_si128(msg0, msg2);
+
+	// Rounds 44-47
+	e1 = _mm_sha1nexte_epu32(e1, msg3);
+	e0 = abcd;
+	msg0 = _mm_sha1msg2_epu32(msg0, msg3);
+	abcd = _mm_sha1rnds4_epu32(abcd, e1, 2);
+	msg2 = _mm_sha1msg1_epu32(msg2, msg3);
+	msg1 = _mm_xor_si128(msg1, msg3);
+
+	// Rounds 48-51
+	e0 = _mm_sha1nexte_epu32(e0, msg0);
+	e1 = abcd;
+	msg1 = _mm_sha1msg2_epu32(msg1, msg0);
+	abcd = _mm_sha1rnds4_epu32(abcd, e0, 2);
+	msg3 = _mm_sha1msg1_epu32(msg3, msg0);
+	msg2 = _mm_xor_si128(msg2, msg0);
+
+	// Rounds 52-55
+	e1 = _mm_sha1nexte_epu32(e1, msg1);
+	e0 = abcd;
+	msg2 = _mm_sha1msg2_epu32(msg2, msg1);
+	abcd = _mm_sha1rnds4_epu32(abcd, e1, 2);
+	msg0 = _mm_sha1msg1_epu32(msg0, msg1);
+	msg3 = _mm_xor_si128(msg3, msg1);
+
+	// Rounds 56-59
+	e0 = _mm_sha1nexte_epu32(e0, msg2);
+	e1 = abcd;
+	msg3 = _mm_sha1msg2_epu32(msg3, msg2);
+	abcd = _mm_sha1rnds4_epu32(abcd, e0, 2);
+	msg1 = _mm_sha1msg1_epu32(msg1, msg2);
+	msg0 = _mm_xor_si128(msg0, msg2);
+
+	// Rounds 60-63
+	e1 = _mm_sha1nexte_epu32(e1, msg3);
+	e0 = abcd;
+	msg0 = _mm_sha1msg2_epu32(msg0, msg3);
+	abcd = _mm_sha1rnds4_epu32(abcd, e1, 3);
+	msg2 = _mm_sha1msg1_epu32(msg2, msg3);
+	msg1 = _mm_xor_si128(msg1, msg3);
+
+	// Rounds 64-67
+	e0 = _mm_sha1nexte_epu32(e0, msg0);
+	e1 = abcd;
+	msg1 = _mm_sha1msg2_epu32(msg1, msg0);
+	abcd = _mm_sha1rnds4_epu32(abcd, e0, 3);
+	msg3 = _mm_sha1msg1_epu32(msg3, msg0);
+	msg2 = _mm_xor_si128(msg2, msg0);
+
+	// Rounds 68-71
+	e1 = _mm_sha1nexte_epu32(e1, msg1);
+	e0 = abcd;
+	msg2 = _mm_sha1msg2_epu32(msg2, msg1);
+	abcd = _mm_sha1rnds4_epu32(abcd, e1, 3);
+	msg3 = _mm_xor_si128(msg3, msg1);
+
+	// Rounds 72-75
+	e0 = _mm_sha1nexte_epu32(e0, msg2);
+	e1 = abcd;
+	msg3 = _mm_sha1msg2_epu32(msg3, msg2);
+	abcd = _mm_sha1rnds4_epu32(abcd, e0, 3);
+
+	// Rounds 76-79
+	e1 = _mm_sha1nexte_epu32(e1, msg3);
+	e0 = abcd;
+	abcd = _mm_sha1rnds4_epu32(abcd, e1, 3);
+
+	e0 = _mm_sha1nexte_epu32(e0, e_save);
+	abcd = _mm_add_epi32(abcd, abcd_save);
+	abcd = _mm_shuffle_epi32(abcd, 0x1B);
+	_mm_storeu_si128((__m128i*)s, abcd);
+	s[4] = (uint32_t)_mm_extract_epi32(e0, 3);
+	for (i = 0; i < 5; i++)
+		ctx->state[i] = s[i];
+}
+
+TARGET_SHA_NI static void sha256_transform_ni(SUM_CONTEXT* ctx, const uint8_t* data)
+{
+	__m128i state0, state1, msg, tmp, abef_save, cdgh_save;
+	__m128i msg0, msg1, msg2, msg3;
+	const __m128i shuf_mask = _mm_set_epi64x(0x0C0D0E0F08090A0BULL, 0x0405060700010203ULL);
+	uint32_t s[8];
+	int i;
+
+	for (i = 0; i < 8; i++)
+		s[i] = (uint32_t)ctx->state[i];
+	tmp = _mm_loadu_si128((const __m128i*)&s[0]);
+	state1 = _mm_loadu_si128((const __m128i*)&s[4]);
+	tmp = _mm_shuffle_epi32(tmp, 0xB1);          // CDAB
+	state1 = _mm_shuffle_epi32(state1, 0x1B);    // EFGH
+	state0 = _mm_alignr_epi8(tmp, state1, 8);    // ABEF
+	state1 = _mm_blend_epi16(state1, tmp, 0xF0); // CDGH
+	abef_save = state0;
+	cdgh_save = state1;
+
+	// Rounds 0-3
+	msg0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)&data[0]), shuf_mask);
+	msg = _mm_add_epi32(msg0, _mm_set_epi64x(0xE9B5DBA5B5C0FBCFULL, 0x71374491428A2F98ULL));
+	state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+	msg = _mm_shuffle_epi32(msg, 0x0E);
+	state0 = _mm_sha256rnds2_epu32(state0, state1, msg);
+
+	// Rounds 4-7
+	msg1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)&data[16]), shuf_mask);
+	msg = _mm_add_epi32(msg1, _mm_set_epi64x(0xAB1C5ED5923F82A4ULL, 0x59F111F13956C25BULL));
+	state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+	msg = _mm_shuffle_epi32(msg, 0x0E);
+	state0 = _mm_sha256rnds2_epu32(state0, state1, msg);
+	msg0 = _mm_sha256msg1_epu32(msg0, msg1);
+
+	// Rounds 8-11
+	msg2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)&data[32]), shuf_mask);
+	msg = _mm_add_epi32(msg2, _mm_set_epi64x(0x550C7DC3243185BEULL, 0x12835B01D807AA98ULL));
+	state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+	msg = _mm_shuffle_epi32(msg, 0x0E);
+	state0 = _mm_sha256rnds2_epu32(state0, state1, msg);
+	msg1 = _mm_sha256msg1_epu32(msg1, msg2);
+
+	// Rounds 12-15
+	msg3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)&data[48]), shuf_mask);
+	msg = _mm_add_epi32(msg3, _mm_set_epi64x(0xC19BF1749BDC06A7ULL, 0x80DEB1FE72BE5D74ULL));
+	state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+	tmp = _mm_alignr_epi8(msg3, msg2, 4);
+	msg0 = _mm_add_epi32(msg0, tmp);
+	msg0 = _mm_sha256msg2_epu32(msg0, msg3);
+	msg = _mm_shuffle_epi32(msg, 0x0E);
+	state0 = _mm_sha256rnds2_epu32(state0, state1, msg);
+	msg2 = _mm_sha256msg1_epu32(msg2, msg3);
+
+	// Rounds 16-19
+	msg = _mm_add_epi32(msg0, _mm_set_epi64x(0x240CA1CC0FC19DC6ULL, 0xEFBE4786E49B69C1ULL));
+	state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+	tmp = _mm_alignr_epi8(msg0, msg3, 4);
+	msg1 = _mm_add_epi32(msg1, tmp);
+	msg1 = _mm_sha256msg2_epu32(msg1, msg0);
+	msg = _mm_shuffle_epi32(msg, 0x0E);
+	state0 = _mm_sha256rnds2_epu32(state0, state1, msg);
+	msg3 = _mm_sha256msg1_epu32(msg3, msg0);
+
+	// Rounds 20-23
+	msg = _mm_add_epi32(msg1, _mm_set_epi64x(0x76F988DA5CB0A9DCULL, 0x4A7484AA2DE92C6FULL));
+	state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+	tmp = _mm_alignr_epi8(msg1, msg0, 4);
+	msg2 = _mm_add_epi32(msg2, tmp);
+	msg2 = _mm_sha256msg2_epu32(msg2, msg1);
+	msg = _mm_shuffle_epi32(msg, 0x0E);
+	state0 = _mm_sha256rnds2_epu32(state0, state1, msg);
+	msg0 = _mm_sha256msg1_epu32(msg0, msg1);
+
+	// Rounds 24-27
+	msg = _mm_add_epi32(msg2, _mm_set_epi64x(0xBF597FC7B00327C8ULL, 0xA831C66D983E5152ULL));
+	state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+	tmp = _mm_alignr_epi8(msg2, msg1, 4);
+	msg3 = _mm_add_epi32(msg3, tmp);
+	msg3 = _mm_sha256msg2_epu32(msg3, msg2);
+	msg = _mm_shuffle_epi32(msg, 0x0E);
+	state0 = _mm_sha256rnds2_epu32(state0, state1, msg);
+	msg1 = _mm_sha256msg1_epu32(msg1, msg2);
+
+	// Rounds 28-31
+	msg = _mm_add_epi32(msg3, _mm_set_epi64x(0x1429296706CA6351ULL, 0xD5A79147C6E00BF3ULL));
+	state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+	tmp = _mm_alignr_epi8(msg3, msg2, 4);
+	msg0 = _mm_add_epi32(msg0, tmp);
+	msg0 = _mm_sha256msg2_epu32(msg0, msg3);
+	msg = _mm_shuffle_epi32(msg, 0x0E);
+	state0 = _mm_sha256rnds2_epu32(state0, state1, msg);
+	msg2 = _mm_sha256msg1_epu32(msg2, msg3);
+
+	// Rounds 32-35
+	msg = _mm_add_epi32(msg0, _mm_set_epi64x(0x53380D134D2C6DFCULL, 0x2E1B213827B70A85ULL));
+	state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+	tmp = _mm_alignr_epi8(msg0, msg3, 4);
+	msg1 = _mm_add_epi32(msg1, tmp);
+	msg1 = _mm_sha256msg2_epu32(msg1, msg0);
+	msg = _mm_shuffle_epi32(msg, 0x0E);
+	state0 = _mm_sha256rnds2_epu32(state0, state1, msg);
+	msg3 = _mm_sha256msg1_epu32(msg3, msg0);
+
+	// Rounds 36-39
+	msg = _mm_add_epi32(msg1, _mm_set_epi64x(0x92722C8581C2C92EULL, 0x766A0ABB650A7354ULL));
+	state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+	tmp = _mm_alignr_epi8(msg1, msg0, 4);
+	msg2 = _mm_add_epi32(msg2, tmp);
+	msg2 = _mm_sha256msg2_epu32(msg2, msg1);
+	msg = _mm_shuffle_epi32(msg, 0x0E);
+	state0 = _mm_sha256rnds2_epu32(state0, state1, msg);
+	msg0 = _mm_sha256msg1_epu32(msg0, msg1);
+
+	// Rounds 40-43
+	msg = _mm_add_epi32(msg2, _mm_set_epi64x(0xC76C51A3C24B8B70ULL, 0xA81A664BA2BFE8A1ULL));
+	state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+	tmp = _mm_alignr_epi8(msg2, msg1, 4);
+	msg3 = _mm_add_epi32(msg3, tmp);
+	msg3 = _mm_sha256msg2_epu32(msg3, msg2);
+	msg = _mm_shuffle_epi32(msg, 0x0E);
+	state0 = _mm_sha256rnds2_epu32(state0, state1, msg);
+	msg1 = _mm_sha256msg1_epu32(msg1, msg2);
+
+	// Rounds 44-47
+	msg = _mm_add_epi32(msg3, _mm_set_epi64x(0x106AA070F40E3585ULL, 0xD6990624D192E819ULL));
+	state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+	tmp = _mm_alignr_epi8(msg3, msg2, 4);
+	msg0 = _mm_add_epi32(msg0, tmp);
+	msg0 = _mm_sha256msg2_epu32(msg0, msg3);
+	msg = _mm_shuffle_epi32(msg, 0x0E);
+	state0 = _mm_sha256rnds2_epu32(state0, state1, msg);
+	msg2 = _mm_sha256msg1_epu32(msg2, msg3);
+
+	// Rounds 48-51
+	msg = _mm_add_epi32(msg0, _mm_set_epi64x(0x34B0BCB52748774CULL, 0x1E376C0819A4C116ULL));
+	state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+	tmp = _mm_alignr_epi8(msg0, msg3, 4);
+	msg1 = _mm_add_epi32(msg1, tmp);
+	msg1 = _mm_sha256msg2_epu32(msg1, msg0);
+	msg = _mm_shuffle_epi32(msg, 0x0E);
+	state0 = _mm_sha256rnds2_epu32(state0, state1, msg);
+	msg3 = _mm_sha256msg1_epu32(msg3, msg0);
+
+	// Rounds 52-55
+	msg = _mm_add_epi32(msg1, _mm_set_epi64x(0x682E6FF35B9CCA4FULL, 0x4ED8AA4A391C0CB3ULL));
+	state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+	tmp = _mm_alignr_epi8(msg1, msg0, 4);
+	msg2 = _mm_add_epi32(msg2, tmp);
+	msg2 = _mm_sha256msg2_epu32(msg2, msg1);
+	msg = _mm_shuffle_epi32(msg, 0x0E);
+	state0 = _mm_sha256rnds2_epu32(state0, state1, msg);
+
+	// Rounds 56-59
+	msg = _mm_add_epi32(msg2, _mm_set_epi64x(0x8CC7020884C87814ULL, 0x78A5636F748F82EEULL));
+	state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+	tmp = _mm_alignr_epi8(msg2, msg1, 4);
+	msg3 = _mm_add_epi32(msg3, tmp);
+	msg3 = _mm_sha256msg2_epu32(msg3, msg2);
+	msg = _mm_shuffle_epi32(msg, 0x0E);
+	state0 = _mm_sha256rnds2_epu32(state0, state1, msg);
+
+	// Rounds 60-63
+	msg = _mm_add_epi32(msg3, _mm_set_epi64x(0xC67178F2BEF9A3F7ULL, 0xA4506CEB90BEFFFAULL));
+	state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+	msg = _mm_shuffle_epi32(msg, 0x0E);
+	state0 = _mm_sha256rnds2_epu32(state0, state1, msg);
+
+	state0 = _mm_add_epi32(state0, abef_save);
+	state1 = _mm_add_epi32(state1, cdgh_save);
+	tmp = _mm_shuffle_epi32(state0, 0x1B);       // FEBA
+	state1 = _mm_shuffle_epi32(state1, 0xB1);    // DCHG
+	state0 = _mm_blend_epi16(tmp, state1, 0xF0); // DCBA
+	state1 = _mm_alignr_epi8(state1, tmp, 8);    // HGFE
+	_mm_storeu_si128((__m128i*)&s[0], state0);
+	_mm_storeu_si128((__m128i*)&s[4], state1);
+	for (i = 0; i < 8; i++)
+		ctx->state[i] = s[i];
+}
+#endif /* CPU_HAS_SHA_EXTENSION_SUPPORT */
+
+static __inline void sha1_transform(SUM_CONTEXT *ctx, const uint8_t *data)
+{
+#if defined(CPU_HAS_SHA_EXTENSION_SUPPORT)
+	if (HasShaExtensions()) {
+		sha1_transform_ni(ctx, data);
+		return;
+	}
+#endif
+	sha1_transform_cc(ctx, data);
+}
+
+static __inline void sha256_transform(SUM_CONTEXT *ctx, const uint8_t *data)
+{
+#if defined(CPU_HAS_SHA_EXTENSION_SUPPORT)
+	if (HasShaExtensions()) {
+		sha256_transform_ni(ctx, data);
+		return;
+	}
+#endif
+	sha256_transform_cc(ctx, data);
+}
+
 static void sha1_write(SUM_CONTEXT *ctx, const uint8_t *buf, size_t len)
 {
 	size_t num = ctx->bytecount & (SHA1_BLOCKSIZE - 1);
@@ -950,26 +1375,50 @@ sum_init_t *sum_init[CHECKSUM_MAX] = { md5_init, sha1_init , sha256_init, sha512
 sum_write_t *sum_write[CHECKSUM_MAX] = { md5_write, sha1_write , sha256_write, sha512_write };
 sum_final_t *sum_final[CHECKSUM_MAX] = { md5_final, sha1_final , sha256_final, sha512_final };
 
-// Compute an individual checksum without threading or buffering, for a single file
-BOOL HashFile(const unsigned type, const char* path, uint8_t* sum)
+// Largest file we mirror into memory for hashing. Bigger files use sequential
+// reads, so that hashing a multi-GB image can't fail to map on 32-bit or
+// needlessly evict the page cache.
+#define MAX_MAP_SIZE        (64*MB)
+
+// Compute an individual checksum, without threading, on an already opened file.
+// Small files, such as the boot file candidates that the ISO scan feeds to
+// IsFileInDB(), are memory-mapped and hashed in a single pass, which avoids
+// the syscall-per-read overhead of the sequential fallback.
+BOOL HashOpenedFile(const unsigned type, HANDLE h, uint8_t* sum)
 {
 	BOOL r = FALSE;
 	SUM_CONTEXT sum_ctx = { {0} };
-	HANDLE h = INVALID_HANDLE_VALUE;
+	HANDLE hMap = NULL;
+	LARGE_INTEGER li;
+	uint8_t* map = NULL;
 	DWORD rs = 0;
 	uint64_t rb;
 	uint8_t buf[4096];
 
-	if ((type >= CHECKSUM_MAX) || (path == NULL) || (sum == NULL))
+	if ((type >= CHECKSUM_MAX) || (h == INVALID_HANDLE_VALUE) || (h == NULL) ||
+		(sum == NULL) || (!GetFileSizeEx(h, &li)))
 		goto out;
 
-	h = CreateFileU(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
-	if (h == INVALID_HANDLE_VALUE) {
-		uprintf("Could not open file: %s", WindowsErrorString());
-		FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | ERROR_OPEN_FAILED;
-		goto out;
+	// Fast path: map the file and hash it as a single buffer.
+	// NB: CreateFileMapping() rejects zero-length files.
+	if ((li.QuadPart > 0) && (li.QuadPart <= MAX_MAP_SIZE)) {
+		hMap = CreateFileMapping(h, NULL, PAGE_READONLY, 0, 0, NULL);
+		if (hMap != NULL) {
+			map = (uint8_t*)MapViewOfFile(hMap, FILE_MAP_READ, 0, 0, 0);
+			if (map != NULL) {
+				r = HashBuffer(type, map, (size_t)li.QuadPart, sum);
+				UnmapViewOfFile(map);
+			}
+			CloseHandle(hMap);
+			if (r)
+				goto out;
+		}
 	}
 
+	// Fallback: sequential reads from the start of the file
+	li.QuadPart = 0;
+	if (!SetFilePointerEx(h, li, NULL, FILE_BEGIN))
+		goto out;
 	sum_init[type](&sum_ctx);
 	for (rb = 0; ; rb += rs) {
 		CHECK_FOR_USER_CANCEL;
@@ -988,10 +1437,100 @@ BOOL HashFile(const unsigned type, const char* path, uint8_t* sum)
 	r = TRUE;
 
 out:
+	return r;
+}
+
+// Compute an individual checksum without threading or buffering, for a single file
+BOOL HashFile(const unsigned type, const char* path, uint8_t* sum)
+{
+	BOOL r = FALSE;
+	HANDLE h;
+
+	if ((type >= CHECKSUM_MAX) || (path == NULL) || (sum == NULL))
+		return FALSE;
+
+	h = CreateFileU(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (h == INVALID_HANDLE_VALUE) {
+		uprintf("Could not open file: %s", WindowsErrorString());
+		FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | ERROR_OPEN_FAILED;
+		return FALSE;
+	}
+
+	r = HashOpenedFile(type, h, sum);
 	safe_closehandle(h);
 	return r;
 }
 
+// Compute the checksum of the first 'size' bytes of a physical drive, using
+// overlapped double-buffered reads, so that device I/O overlaps with hashing.
+BOOL HashPhysicalDrive(const unsigned type, HANDLE hPhysicalDrive, uint32_t sector_size,
+	uint64_t size, uint8_t* sum)
+{
+	BOOL r = FALSE;
+	SUM_CONTEXT sum_ctx = { {0} };
+	HANDLE hDrive = NULL;
+	DWORD buf_size, chunk_size, read_size[2] = { 0, 0 };
+	uint64_t rb, read_offset;
+	uint8_t* buffer = NULL;
+	int read_bufnum = 0, proc_bufnum = 0;
+
+	if ((type >= CHECKSUM_MAX) || (sum == NULL) || (sector_size == 0) || (size == 0))
+		goto out;
+
+	// Reads from a physical drive must be sector aligned and sector sized
+	buf_size = ((DD_BUFFER_SIZE + sector_size - 1) / sector_size) * sector_size;
+	buffer = (uint8_t*)_mm_malloc((size_t)buf_size * 2, sector_size);
+	if (buffer == NULL) {
+		FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | ERROR_NOT_ENOUGH_MEMORY;
+		uprintf("Could not allocate drive hashing buffer");
+		goto out;
+	}
+
+	hDrive = WrapFileAsync(hPhysicalDrive, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, 0);
+	if (hDrive == NULL) {
+		uprintf("Could not reopen drive for overlapped reads: %s", WindowsErrorString());
+		FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | ERROR_OPEN_FAILED;
+		goto out;
+	}
+
+	sum_init[type](&sum_ctx);
+	read_offset = 0;
+	chunk_size = (DWORD)MIN(buf_size, ((size - read_offset + sector_size - 1) / sector_size) * sector_size);
+	ReadFileAsync(hDrive, &buffer[read_bufnum * buf_size], chunk_size);
+	for (rb = 0; rb < size; rb += read_size[proc_bufnum]) {
+		CHECK_FOR_USER_CANCEL;
+		UpdateProgressWithInfo(OP_FORMAT, MSG_271, rb, size);
+		if ((!WaitFileAsync(hDrive, DRIVE_ACCESS_TIMEOUT)) ||
+			(!GetSizeAsync(hDrive, &read_size[read_bufnum])) ||
+			(read_size[read_bufnum] == 0)) {
+			uprintf("Read error while hashing drive: %s", WindowsErrorString());
+			FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | ERROR_READ_FAULT;
+			goto out;
+		}
+		read_offset += read_size[read_bufnum];
+		proc_bufnum = read_bufnum;
+		read_bufnum = 1 - read_bufnum;
+		// Issue the next read, if any, before we start hashing
+		if (read_offset < size) {
+			chunk_size = (DWORD)MIN(buf_size, ((size - read_offset + sector_size - 1) / sector_size) * sector_size);
+			ReadFileAsync(hDrive, &buffer[read_bufnum * buf_size], chunk_size);
+		}
+		// The last device read may extend past the data we are interested in
+		sum_write[type](&sum_ctx, &buffer[proc_bufnum * buf_size],
+			(size_t)MIN((uint64_t)read_size[proc_bufnum], size - rb));
+	}
+	UpdateProgressWithInfo(OP_FORMAT, MSG_271, size, size);
+	sum_final[type](&sum_ctx);
+
+	memcpy(sum, sum_ctx.buf, sum_count[type]);
+	r = TRUE;
+
+out:
+	CloseFileAsync(hDrive);
+	safe_mm_free(buffer);
+	return r;
+}
+
 BOOL HashBuffer(const unsigned type, const uint8_t* buf, const size_t len, uint8_t* sum)
 {
 	BOOL r = FALSE;
@@ -1011,6 +1550,206 @@ out:
 	return r;
 }
 
+// Maximum number of threads used for tree-hashing
+#define MAX_TREE_THREADS    8
+
+typedef struct {
+	const char* path;
+	unsigned type;
+	uint64_t offset;
+	uint64_t size;
+	uint8_t sum[SHA512_HASHSIZE];
+	BOOL ret;
+} TREE_HASH_CHUNK;
+
+static DWORD WINAPI TreeHashThread(void* param)
+{
+	TREE_HASH_CHUNK* chunk = (TREE_HASH_CHUNK*)param;
+	SUM_CONTEXT sum_ctx = { {0} };
+	HANDLE h = INVALID_HANDLE_VALUE;
+	LARGE_INTEGER li;
+	uint64_t rb;
+	DWORD rs;
+	uint8_t* buf = NULL;
+
+	chunk->ret = FALSE;
+	buf = malloc(1 * MB);
+	if (buf == NULL)
+		goto out;
+
+	// Each thread gets its own handle, so that the chunks can be read in parallel
+	h = CreateFileU(chunk->path, GENERIC_READ, FILE_SHARE_READ, NULL,
+		OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (h == INVALID_HANDLE_VALUE) {
+		uprintf("Could not open file: %s", WindowsErrorString());
+		goto out;
+	}
+	li.QuadPart = chunk->offset;
+	if (!SetFilePointerEx(h, li, NULL, FILE_BEGIN))
+		goto out;
+
+	sum_init[chunk->type](&sum_ctx);
+	for (rb = 0; rb < chunk->size; rb += rs) {
+		if (!ReadFile(h, buf, (DWORD)MIN(1 * MB, chunk->size - rb), &rs, NULL)) {
+			uprintf("  Read error: %s", WindowsErrorString());
+			goto out;
+		}
+		if (rs == 0)
+			break;
+		sum_write[chunk->type](&sum_ctx, buf, (size_t)rs);
+	}
+	if (rb != chunk->size)
+		goto out;
+	sum_final[chunk->type](&sum_ctx);
+	memcpy(chunk->sum, sum_ctx.buf, sum_count[chunk->type]);
+	chunk->ret = TRUE;
+
+out:
+	safe_closehandle(h);
+	free(buf);
+	return chunk->ret ? 0 : 1;
+}
+
+/*
+ * Tree-hash mode, so that single algorithm hashing can scale with the number
+ * of cores: the file is split into up to MAX_TREE_THREADS equal size chunks,
+ * each chunk is hashed on its own thread, and the root hash is the hash of
+ * the concatenated chunk digests, in chunk order:
+ *   root = H(H(chunk[0]) || H(chunk[1]) || ... || H(chunk[n-1]))
+ * The individual chunk digests, which form the manifest, are printed to the
+ * log. Note that the tree hash of a file does NOT match its plain hash.
+ */
+BOOL HashFileTree(const unsigned type, const char* path, uint8_t* sum)
+{
+	BOOL r = FALSE;
+	DWORD_PTR tree_affinity[MAX_TREE_THREADS];
+	TREE_HASH_CHUNK chunk[MAX_TREE_THREADS] = { {0} };
+	HANDLE h = INVALID_HANDLE_VALUE, thread[MAX_TREE_THREADS] = { NULL };
+	LARGE_INTEGER li;
+	uint8_t manifest[MAX_TREE_THREADS * SHA512_HASHSIZE];
+	char str[150];
+	uint64_t chunk_size;
+	uint32_t i, j, num_threads;
+
+	if ((type >= CHECKSUM_MAX) || (path == NULL) || (sum == NULL))
+		goto out;
+
+	h = CreateFileU(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, 0, NULL);
+	if ((h == INVALID_HANDLE_VALUE) || (!GetFileSizeEx(h, &li))) {
+		uprintf("Could not get size of file '%s': %s", path, WindowsErrorString());
+		goto out;
+	}
+	safe_closehandle(h);
+
+	// Don't bother spawning threads for less than 1 MB of data each
+	num_threads = (uint32_t)MIN(MAX_TREE_THREADS, li.QuadPart / (1 * MB));
+	if (num_threads == 0)
+		num_threads = 1;
+	chunk_size = (li.QuadPart + num_threads - 1) / num_threads;
+	if (!SetThreadAffinity(tree_affinity, num_threads))
+		memset(tree_affinity, 0, sizeof(tree_affinity));
+
+	for (i = 0; i < num_threads; i++) {
+		chunk[i].path = path;
+		chunk[i].type = type;
+		chunk[i].offset = i * chunk_size;
+		chunk[i].size = MIN(chunk_size, (uint64_t)li.QuadPart - chunk[i].offset);
+		thread[i] = CreateThread(NULL, 0, TreeHashThread, &chunk[i], 0, NULL);
+		if (thread[i] == NULL) {
+			uprintf("Unable to start tree-hash thread #%d", i);
+			goto out;
+		}
+		SetThreadPriority(thread[i], default_thread_priority);
+		if (tree_affinity[i] != 0)
+			SetThreadAffinityMask(thread[i], tree_affinity[i]);
+	}
+	if (WaitForMultipleObjects(num_threads, thread, TRUE, INFINITE) != WAIT_OBJECT_0) {
+		uprintf("Tree-hash threads did not finalize: %s", WindowsErrorString());
+		goto out;
+	}
+
+	uprintf("Tree-hash manifest for '%s' (%d chunks of %llu bytes):", path, num_threads, chunk_size);
+	for (i = 0; i < num_threads; i++) {
+		if (!chunk[i].ret)
+			goto out;
+		for (j = 0; j < sum_count[type]; j++)
+			sprintf(&str[2 * j], "%02x", chunk[i].sum[j]);
+		uprintf("  %d: %s", i, str);
+		memcpy(&manifest[i * sum_count[type]], chunk[i].sum, sum_count[type]);
+	}
+	r = HashBuffer(type, manifest, num_threads * sum_count[type], sum);
+
+out:
+	safe_closehandle(h);
+	for (i = 0; i < MAX_TREE_THREADS; i++)
+		safe_closehandle(thread[i]);
+	return r;
+}
+
+// Streaming variant of HashBuffer(), so that callers that already walk through
+// the data for another purpose (e.g. WriteDrive() writing an image to a device)
+// can produce a checksum as a by-product, without an extra read of the source.
+static SUM_CONTEXT stream_sum_ctx;
+static unsigned stream_sum_type = CHECKSUM_MAX;
+
+BOOL HashStreamInit(const unsigned type)
+{
+	if (type >= CHECKSUM_MAX)
+		return FALSE;
+	stream_sum_type = type;
+	sum_init[type](&stream_sum_ctx);
+	return TRUE;
+}
+
+void HashStreamWrite(const uint8_t* buf, size_t len)
+{
+	if (stream_sum_type < CHECKSUM_MAX)
+		sum_write[stream_sum_type](&stream_sum_ctx, buf, len);
+}
+
+// Finalize the streaming hash into 'sum' and invalidate the stream.
+// Pass a NULL 'sum' to just abandon the stream (e.g. on error paths).
+BOOL HashStreamFinal(uint8_t* sum)
+{
+	if (stream_sum_type >= CHECKSUM_MAX)
+		return FALSE;
+	if (sum != NULL) {
+		sum_final[stream_sum_type](&stream_sum_ctx);
+		memcpy(sum, stream_sum_ctx.buf, sum_count[stream_sum_type]);
+	}
+	stream_sum_type = CHECKSUM_MAX;
+	return (sum != NULL);
+}
+
+// Save/restore the streaming hash state, so that an operation that gets
+// interrupted partway (e.g. a download that is later resumed with a ranged
+// request) can continue its checksum where it left off, without having to
+// re-read the data that was already processed. The serialized format is the
+// bare hash context, prefixed with the hash type.
+size_t HashStreamSave(uint8_t* buf, size_t len)
+{
+	if ((stream_sum_type >= CHECKSUM_MAX) || (buf == NULL) ||
+		(len < sizeof(unsigned) + sizeof(SUM_CONTEXT)))
+		return 0;
+	memcpy(buf, &stream_sum_type, sizeof(unsigned));
+	memcpy(&buf[sizeof(unsigned)], &stream_sum_ctx, sizeof(SUM_CONTEXT));
+	return sizeof(unsigned) + sizeof(SUM_CONTEXT);
+}
+
+BOOL HashStreamRestore(const uint8_t* buf, size_t len)
+{
+	unsigned type;
+
+	if ((buf == NULL) || (len != sizeof(unsigned) + sizeof(SUM_CONTEXT)))
+		return FALSE;
+	memcpy(&type, buf, sizeof(unsigned));
+	if (type >= CHECKSUM_MAX)
+		return FALSE;
+	memcpy(&stream_sum_ctx, &buf[sizeof(unsigned)], sizeof(SUM_CONTEXT));
+	stream_sum_type = type;
+	return TRUE;
+}
+
 /*
  * Checksum dialog callback
  */
@@ -1123,6 +1862,66 @@ error:
 	return 1;
 }
 
+// Single entry hash cache, persisted through the settings infrastructure, so
+// that reselecting an unchanged image doesn't trigger a full multi-GB rehash.
+// The entry is keyed on the file's identity (path, size, mtime and volume
+// serial), so any modification or replacement of the image invalidates it.
+static const char* hash_cache_setting[CHECKSUM_MAX] = {
+	SETTING_HASH_CACHE_MD5, SETTING_HASH_CACHE_SHA1, SETTING_HASH_CACHE_SHA256, SETTING_HASH_CACHE_SHA512
+};
+
+static char* GetHashCacheId(const char* path)
+{
+	static char id[MAX_PATH + 64];
+	BY_HANDLE_FILE_INFORMATION info;
+	BOOL s;
+	HANDLE h;
+
+	h = CreateFileU(path, 0, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, 0, NULL);
+	if (h == INVALID_HANDLE_VALUE)
+		return NULL;
+	s = GetFileInformationByHandle(h, &info);
+	CloseHandle(h);
+	if (!s)
+		return NULL;
+	static_sprintf(id, "%s|%08x%08x|%08x%08x|%08x", path, info.nFileSizeHigh, info.nFileSizeLow,
+		info.ftLastWriteTime.dwHighDateTime, info.ftLastWriteTime.dwLowDateTime,
+		(uint32_t)info.dwVolumeSerialNumber);
+	return id;
+}
+
+// On a cache hit, repopulate sum_str[] from the persisted values and return TRUE
+static BOOL GetCachedHashes(const char* path)
+{
+	char *id, *val;
+	int i, num_checksums = CHECKSUM_MAX - (enable_extra_hashes ? 0 : 1);
+
+	id = GetHashCacheId(path);
+	if ((id == NULL) || (safe_strcmp(id, ReadSettingStr(SETTING_HASH_CACHE_ID)) != 0))
+		return FALSE;
+	for (i = 0; i < num_checksums; i++) {
+		val = ReadSettingStr(hash_cache_setting[i]);
+		if ((val[0] == 0) || (strlen(val) != 2 * (size_t)sum_count[i]))
+			return FALSE;
+		static_strcpy(sum_str[i], val);
+	}
+	return TRUE;
+}
+
+static void SetCachedHashes(const char* path)
+{
+	char* id = GetHashCacheId(path);
+	int i, num_checksums = CHECKSUM_MAX - (enable_extra_hashes ? 0 : 1);
+
+	if (id == NULL)
+		return;
+	// Invalidate the entry first, so a partial write can't produce a false hit
+	WriteSettingStr(SETTING_HASH_CACHE_ID, "");
+	for (i = 0; i < num_checksums; i++)
+		WriteSettingStr(hash_cache_setting[i], sum_str[i]);
+	WriteSettingStr(SETTING_HASH_CACHE_ID, id);
+}
+
 DWORD WINAPI SumThread(void* param)
 {
 	DWORD_PTR* thread_affinity = (DWORD_PTR*)param;
@@ -1138,6 +1937,27 @@ DWORD WINAPI SumThread(void* param)
 
 	uprintf("\r\nComputing checksum for '%s'...", image_path);
 
+	// An unchanged image may have its checksums cached from a previous run
+	if (GetCachedHashes(image_path)) {
+		uprintf("Reusing values from a previous run (unchanged file)");
+		goto display;
+	}
+
+	// Allow power users to tune the size of the hash pipeline buffers
+	buffer_size = (DWORD)(((int64_t)ReadSetting32(SETTING_HASH_BUFFER_SIZE)) * KB);
+	if ((buffer_size < MIN_BUFFER_SIZE) || (buffer_size > MAX_BUFFER_SIZE))
+		buffer_size = BUFFER_SIZE;
+	else
+		uprintf("Using %s hash buffers", SizeToHumanReadable(buffer_size, FALSE, FALSE));
+	for (i = 0; i < NUM_BUFFERS; i++) {
+		buffer[i] = GetIoBuffer(buffer_size);
+		if (buffer[i] == NULL) {
+			uprintf("Could not allocate hash pipeline buffers");
+			FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | ERROR_NOT_ENOUGH_MEMORY;
+			goto out;
+		}
+	}
+
 	if (thread_affinity[0] != 0)
 		// Use the first affinity mask, as our read thread is the least
 		// CPU intensive (mostly waits on disk I/O or on the other threads)
@@ -1171,6 +1991,9 @@ DWORD WINAPI SumThread(void* param)
 		FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | ERROR_OPEN_FAILED;
 		goto out;
 	}
+	// On a fast local source, read completions arrive well below the
+	// millisecond, so busy-poll them instead of blocking per buffer
+	SetPollModeAsync(fd, TRUE);
 
 	read_bufnum = 0;
 	proc_bufnum = 1;
@@ -1178,7 +2001,7 @@ DWORD WINAPI SumThread(void* param)
 	UpdateProgressWithInfoInit(hMainDialog, FALSE);
 
 	// Start the initial read
-	ReadFileAsync(fd, buffer[read_bufnum], BUFFER_SIZE);
+	ReadFileAsync(fd, buffer[read_bufnum], buffer_size);
 
 	for (processed_bytes = 0; read_size[proc_bufnum] != 0; processed_bytes += read_size[proc_bufnum]) {
 		// 0. Update the progress and check for cancel
@@ -1197,7 +2020,7 @@ DWORD WINAPI SumThread(void* param)
 		read_bufnum = (read_bufnum + 1) % NUM_BUFFERS;
 
 		// 3. Launch the next asynchronous read operation
-		ReadFileAsync(fd, buffer[read_bufnum], BUFFER_SIZE);
+		ReadFileAsync(fd, buffer[read_bufnum], buffer_size);
 
 		// 4. Wait for all the sum threads to indicate that they are ready to process data
 		wr = WaitForMultipleObjects(num_checksums, thread_ready, TRUE, WAIT_TIME);
@@ -1226,7 +2049,9 @@ DWORD WINAPI SumThread(void* param)
 		uprintf("Checksum threads did not finalize: %s", WindowsErrorString());
 		goto out;
 	}
+	SetCachedHashes(image_path);
 
+display:
 	uprintf("  MD5:    %s", sum_str[0]);
 	uprintf("  SHA1:   %s", sum_str[1]);
 	uprintf("  SHA256: %s", sum_str[2]);
@@ -1246,6 +2071,10 @@ out:
 		safe_closehandle(data_ready[i]);
 		safe_closehandle(thread_ready[i]);
 	}
+	for (i = 0; i < NUM_BUFFERS; i++) {
+		ReleaseIoBuffer(buffer[i]);
+		buffer[i] = NULL;
+	}
 	CloseFileAsync(fd);
 	PostMessage(hMainDialog, UM_FORMAT_COMPLETED, (WPARAM)FALSE, 0);
 	if (r == 0)
@@ -1256,28 +2085,83 @@ out:
 /*
  * The following 2 calls are used to check whether a buffer/file is in our hash DB
  */
+// Bloom filter front-end for the DB lookups. Most digests probed during an
+// ISO scan are not in the DB, so an 8 KB bitmap, filled from sha256db on
+// first use, rejects them with four bit tests before the binary search is
+// even attempted. Since SHA-256 output is uniformly distributed, four 16-bit
+// slices of the digest serve directly as the filter's hash functions.
+#define BLOOM_BITS          (64 * 1024)
+static uint8_t bloom_filter[BLOOM_BITS / 8];
+static BOOL bloom_ready = FALSE;
+
+static __inline uint32_t BloomSlice(const uint8_t* sum, int k)
+{
+	return ((((uint32_t)sum[2 * k]) << 8) | sum[2 * k + 1]) & (BLOOM_BITS - 1);
+}
+
+static void BloomInit(void)
+{
+	uint32_t i, b;
+	int k;
+
+	for (i = 0; i < ARRAYSIZE(sha256db) / 32; i++) {
+		for (k = 0; k < 4; k++) {
+			b = BloomSlice(&sha256db[i * 32], k);
+			bloom_filter[b / 8] |= 1 << (b % 8);
+		}
+	}
+	bloom_ready = TRUE;
+}
+
+// The sha256db entries are sorted by digest (the generation command from
+// db.h pipes through 'sort'), so we can use a binary search for the lookup
+static BOOL IsSumInDB(const uint8_t* sum)
+{
+	int cmp, lo = 0, hi = ARRAYSIZE(sha256db) / 32 - 1, mid;
+	int k;
+	uint32_t b;
+
+#if defined(_DEBUG)
+	// Make sure nobody handed us an unsorted table
+	for (cmp = 1; cmp < ARRAYSIZE(sha256db) / 32; cmp++)
+		assert(memcmp(&sha256db[(cmp - 1) * 32], &sha256db[cmp * 32], 32) < 0);
+#endif
+
+	if (!bloom_ready)
+		BloomInit();
+	for (k = 0; k < 4; k++) {
+		b = BloomSlice(sum, k);
+		if (!(bloom_filter[b / 8] & (1 << (b % 8))))
+			return FALSE;
+	}
+
+	while (lo <= hi) {
+		mid = (lo + hi) / 2;
+		cmp = memcmp(sum, &sha256db[mid * 32], 32);
+		if (cmp == 0)
+			return TRUE;
+		if (cmp < 0)
+			hi = mid - 1;
+		else
+			lo = mid + 1;
+	}
+	return FALSE;
+}
+
 BOOL IsBufferInDB(const unsigned char* buf, const size_t len)
 {
-	int i;
 	uint8_t sum[32];
 	if (!HashBuffer(CHECKSUM_SHA256, buf, len, sum))
 		return FALSE;
-	for (i = 0; i < ARRAYSIZE(sha256db); i += 32)
-		if (memcmp(sum, &sha256db[i], 32) == 0)
-			return TRUE;
-	return FALSE;
+	return IsSumInDB(sum);
 }
 
 BOOL IsFileInDB(const char* path)
 {
-	int i;
 	uint8_t sum[32];
 	if (!HashFile(CHECKSUM_SHA256, path, sum))
 		return FALSE;
-	for (i = 0; i < ARRAYSIZE(sha256db); i += 32)
-		if (memcmp(sum, &sha256db[i], 32) == 0)
-			return TRUE;
-	return FALSE;
+	return IsSumInDB(sum);
 }
 
 #if defined(_DEBUG)
@@ -1383,4 +2267,165 @@ int TestChecksum(void)
 	free(msg);
 	return errors;
 }
+
+/*
+ * Times the message digest kernels and the bled gzip decompressor over
+ * synthetic buffers of various sizes, reporting MB/s per kernel, so that
+ * performance regressions between releases can be quantified. Like
+ * TestChecksum(), this is invoked from the Ctrl-T test hook.
+ */
+#include "bled/bled.h"
+
+// ext2fs metadata checksum kernels (see ext2fs/crc16.c and ext2fs/crc32c.c)
+extern unsigned int ext2fs_crc16(unsigned int crc, const void* buffer, unsigned int len);
+extern uint32_t ext2fs_crc32c_le(uint32_t crc, unsigned char const* p, size_t len);
+
+// Bitwise reference CRC32, only used to forge the trailer of the synthetic
+// gzip stream below. Speed is irrelevant here.
+static uint32_t bench_crc32(const uint8_t* buf, size_t len)
+{
+	uint32_t crc = 0xffffffff;
+	int i;
+
+	while (len--) {
+		crc ^= *buf++;
+		for (i = 0; i < 8; i++)
+			crc = (crc >> 1) ^ ((crc & 1) ? 0xedb88320 : 0);
+	}
+	return ~crc;
+}
+
+int BenchmarkSuite(void)
+{
+	const char* hash_name[CHECKSUM_MAX] = { "MD5   ", "SHA1  ", "SHA256", "SHA512" };
+	const size_t buf_size[3] = { 64 * KB, 1 * MB, 16 * MB };
+	const DWORD min_runtime = 500;	// ms per measurement
+	SUM_CONTEXT sum_ctx;
+	uint64_t start, elapsed, processed;
+	uint32_t seed = 0x9e3779b9, crc;
+	size_t i, pos, chunk;
+	int j, s, r = -1;
+	int64_t bled_ret;
+	uint8_t sum[MAX_HASHSIZE];
+	uint8_t *buf = NULL, *gz = NULL, *dst = NULL;
+	char size_str[32];
+
+	buf = malloc(buf_size[ARRAYSIZE(buf_size) - 1]);
+	if (buf == NULL)
+		goto out;
+	// Incompressible pseudo-random content, so decompression timing is honest
+	for (i = 0; i < buf_size[ARRAYSIZE(buf_size) - 1]; i++) {
+		seed = seed * 1664525 + 1013904223;
+		buf[i] = (uint8_t)(seed >> 24);
+	}
+
+	uprintf("\r\nHash benchmarks:");
+	for (j = 0; j < CHECKSUM_MAX; j++) {
+		for (s = 0; s < ARRAYSIZE(buf_size); s++) {
+			processed = 0;
+			start = GetTickCount64();
+			do {
+				sum_init[j](&sum_ctx);
+				sum_write[j](&sum_ctx, buf, buf_size[s]);
+				sum_final[j](&sum_ctx);
+				memcpy(sum, sum_ctx.buf, sum_count[j]);
+				processed += buf_size[s];
+				elapsed = GetTickCount64() - start;
+			} while (elapsed < min_runtime);
+			// NB: SizeToHumanReadable() returns a static buffer
+			static_strcpy(size_str, SizeToHumanReadable(buf_size[s], FALSE, FALSE));
+			uprintf("  %s @ %-8s: %s/s", hash_name[j], size_str,
+				SizeToHumanReadable((processed * 1000) / elapsed, FALSE, FALSE));
+		}
+	}
+
+	// The ext2fs metadata checksum kernels (CRC-16 for group descriptors,
+	// CRC-32C for everything else) go through the same harness, so their
+	// slice-by-8/hardware dispatch can be compared across releases
+	uprintf("Checksum kernel benchmarks:");
+	for (s = 0; s < ARRAYSIZE(buf_size); s++) {
+		processed = 0;
+		start = GetTickCount64();
+		do {
+			crc = ext2fs_crc16(0xffff, buf, (unsigned int)buf_size[s]);
+			processed += buf_size[s];
+			elapsed = GetTickCount64() - start;
+		} while (elapsed < min_runtime);
+		static_strcpy(size_str, SizeToHumanReadable(buf_size[s], FALSE, FALSE));
+		uprintf("  CRC16  @ %-8s: %s/s", size_str,
+			SizeToHumanReadable((processed * 1000) / elapsed, FALSE, FALSE));
+	}
+	for (s = 0; s < ARRAYSIZE(buf_size); s++) {
+		processed = 0;
+		start = GetTickCount64();
+		do {
+			crc = ext2fs_crc32c_le(~0U, buf, buf_size[s]);
+			processed += buf_size[s];
+			elapsed = GetTickCount64() - start;
+		} while (elapsed < min_runtime);
+		static_strcpy(size_str, SizeToHumanReadable(buf_size[s], FALSE, FALSE));
+		uprintf("  CRC32C @ %-8s: %s/s", size_str,
+			SizeToHumanReadable((processed * 1000) / elapsed, FALSE, FALSE));
+	}
+
+	// Forge a gzip stream from stored deflate blocks: header, then
+	// (BFINAL/BTYPE=00, LEN, NLEN, data) blocks, then CRC32 + ISIZE.
+	// This is the only bled format for which we can synthesize valid
+	// input without shipping a compressor, so the other decompressors
+	// are not covered here.
+	gz = malloc(buf_size[ARRAYSIZE(buf_size) - 1] + (buf_size[ARRAYSIZE(buf_size) - 1] / 0xffff + 1) * 5 + 32);
+	dst = malloc(buf_size[ARRAYSIZE(buf_size) - 1]);
+	if ((gz == NULL) || (dst == NULL))
+		goto out;
+
+	uprintf("Decompression benchmarks:");
+	for (s = 0; s < ARRAYSIZE(buf_size); s++) {
+		memcpy(gz, "\x1f\x8b\x08\x00\x00\x00\x00\x00\x00\x03", 10);
+		pos = 10;
+		for (i = 0; i < buf_size[s]; i += chunk) {
+			chunk = MIN(0xffff, buf_size[s] - i);
+			gz[pos++] = (i + chunk == buf_size[s]) ? 0x01 : 0x00;
+			gz[pos++] = (uint8_t)chunk;
+			gz[pos++] = (uint8_t)(chunk >> 8);
+			gz[pos++] = (uint8_t)~chunk;
+			gz[pos++] = (uint8_t)(~chunk >> 8);
+			memcpy(&gz[pos], &buf[i], chunk);
+			pos += chunk;
+		}
+		crc = bench_crc32(buf, buf_size[s]);
+		for (i = 0; i < 4; i++)
+			gz[pos++] = (uint8_t)(crc >> (8 * i));
+		for (i = 0; i < 4; i++)
+			gz[pos++] = (uint8_t)(buf_size[s] >> (8 * i));
+
+		bled_init(0, _uprintf, NULL, NULL, NULL, NULL, &FormatStatus);
+		processed = 0;
+		start = GetTickCount64();
+		do {
+			bled_ret = bled_uncompress_from_buffer_to_buffer((char*)gz, pos, (char*)dst, buf_size[s], BLED_COMPRESSION_GZIP);
+			if (bled_ret < 0) {
+				uprintf("  gzip decompression error (%lld)", bled_ret);
+				bled_exit();
+				goto out;
+			}
+			processed += buf_size[s];
+			elapsed = GetTickCount64() - start;
+		} while (elapsed < min_runtime);
+		bled_exit();
+		if (memcmp(buf, dst, buf_size[s]) != 0) {
+			uprintf("  gzip decompression mismatch!");
+			goto out;
+		}
+		static_strcpy(size_str, SizeToHumanReadable(buf_size[s], FALSE, FALSE));
+		uprintf("  gzip   @ %-8s: %s/s", size_str,
+			SizeToHumanReadable((processed * 1000) / elapsed, FALSE, FALSE));
+	}
+	r = 0;
+
+out:
+	free(buf);
+	free(gz);
+	free(dst);
+	return r;
+}
 #endif
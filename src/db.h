@@ -23,6 +23,9 @@
 /*
  * NB: Table data was generated from the files/ directory on the server with:
  * find . -not -name "*.txt" -not -name "*.sig" -not -name "*.sh" -not -name "*pre*" -type f -print0 | xargs -0 sha256sum | sort | uniq -w 64 | awk -F '' '{ printf "    "; for(i=1; i<=64; i+=2) {printf "0x%s%s, ", $i,$(i+1);}} {print "// " substr($0,69)}'
+ *
+ * The table MUST remain sorted by digest (which the 'sort' above ensures), as
+ * IsBufferInDB()/IsFileInDB() binary search it.
  */
 
 static uint8_t sha256db[] = {
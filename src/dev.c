@@ -131,6 +131,196 @@ out:
 	return r;
 }
 
+/*
+ * The per-device USB property queries above (hub open + node connection
+ * IOCTLs) are what dominates a device list refresh on large hubs, so they
+ * are prefetched in parallel by a small thread pool as soon as the hub
+ * children are known, and GetDevices() then picks the results up from the
+ * cache instead of paying for each query serially.
+ * The cache is persistent, keyed by Device Instance ID, and refreshed
+ * incrementally: a device that was already interrogated during a previous
+ * enumeration is not queried again, and entries whose device has departed
+ * are evicted, so plugging one more stick into a loaded bench only ever
+ * costs the query for that stick.
+ */
+#define USB_PROPS_POOL_SIZE 4
+
+typedef struct {
+	char device_id[MAX_PATH];
+	char hub_path[MAX_PATH];
+	usb_device_props props;
+	BOOL valid;
+	BOOL present;	/* seen during the current enumeration */
+	BOOL queued;	/* needs a (re)query by the pool */
+} usb_props_entry;
+
+static usb_props_entry* usb_props_list = NULL;
+static uint32_t usb_props_count = 0, usb_props_size = 0;
+static volatile LONG usb_props_index = 0;
+static HANDLE usb_props_thread[USB_PROPS_POOL_SIZE];
+
+static void QueueUSBPropertiesQuery(const char* device_id, char* hub_path)
+{
+	usb_props_entry* new_list;
+	uint32_t i;
+
+	for (i = 0; i < usb_props_count; i++) {
+		if (strcmp(usb_props_list[i].device_id, device_id) == 0) {
+			usb_props_list[i].present = TRUE;
+			// Only requery a known device if it moved to another hub
+			// or its previous query failed
+			if (strcmp(usb_props_list[i].hub_path, hub_path) != 0) {
+				static_strcpy(usb_props_list[i].hub_path, hub_path);
+				usb_props_list[i].queued = TRUE;
+			} else if (!usb_props_list[i].valid) {
+				usb_props_list[i].queued = TRUE;
+			}
+			return;
+		}
+	}
+	if (usb_props_count >= usb_props_size) {
+		new_list = realloc(usb_props_list, (usb_props_size + 16) * sizeof(usb_props_entry));
+		if (new_list == NULL)
+			return;
+		usb_props_list = new_list;
+		usb_props_size += 16;
+	}
+	memset(&usb_props_list[usb_props_count], 0, sizeof(usb_props_entry));
+	static_strcpy(usb_props_list[usb_props_count].device_id, device_id);
+	static_strcpy(usb_props_list[usb_props_count].hub_path, hub_path);
+	usb_props_list[usb_props_count].present = TRUE;
+	usb_props_list[usb_props_count].queued = TRUE;
+	usb_props_count++;
+}
+
+/*
+ * Drop the entries of devices that are no longer around, and report whether
+ * any of the remaining ones still needs to be interrogated.
+ */
+static BOOL TrimUSBPropertiesCache(void)
+{
+	BOOL queued = FALSE;
+	uint32_t i, j;
+
+	for (i = 0, j = 0; i < usb_props_count; i++) {
+		if (!usb_props_list[i].present) {
+			uuprintf("Evicted USB properties for departed '%s'", usb_props_list[i].device_id);
+			continue;
+		}
+		if (i != j)
+			usb_props_list[j] = usb_props_list[i];
+		if (usb_props_list[j].queued)
+			queued = TRUE;
+		j++;
+	}
+	usb_props_count = j;
+	return queued;
+}
+
+static DWORD WINAPI USBPropertiesThread(LPVOID param)
+{
+	LONG i;
+
+	while ((i = InterlockedIncrement(&usb_props_index) - 1) < (LONG)usb_props_count) {
+		if (!usb_props_list[i].queued)
+			continue;
+		usb_props_list[i].valid = GetUSBProperties(usb_props_list[i].hub_path,
+			usb_props_list[i].device_id, &usb_props_list[i].props);
+		usb_props_list[i].queued = FALSE;
+	}
+	return 0;
+}
+
+static void StartUSBPropertiesPool(void)
+{
+	uint32_t i;
+
+	usb_props_index = 0;
+	for (i = 0; i < USB_PROPS_POOL_SIZE; i++)
+		usb_props_thread[i] = CreateThread(NULL, 0, USBPropertiesThread, NULL, 0, NULL);
+}
+
+static void WaitUSBPropertiesPool(void)
+{
+	uint32_t i;
+
+	for (i = 0; i < USB_PROPS_POOL_SIZE; i++) {
+		if (usb_props_thread[i] != NULL) {
+			WaitForSingleObject(usb_props_thread[i], INFINITE);
+			CloseHandle(usb_props_thread[i]);
+			usb_props_thread[i] = NULL;
+		}
+	}
+}
+
+/*
+ * Cache frontend to GetUSBProperties(). Only the fields that
+ * GetUSBProperties() fills are copied, as the caller has already
+ * populated the others.
+ */
+static BOOL GetCachedUSBProperties(char* parent_path, char* device_id, usb_device_props* props)
+{
+	uint32_t i;
+
+	WaitUSBPropertiesPool();
+	for (i = 0; i < usb_props_count; i++) {
+		if (strcmp(usb_props_list[i].device_id, device_id) == 0) {
+			if (usb_props_list[i].valid) {
+				props->port = usb_props_list[i].props.port;
+				props->vid = usb_props_list[i].props.vid;
+				props->pid = usb_props_list[i].props.pid;
+				props->speed = usb_props_list[i].props.speed;
+				props->lower_speed = usb_props_list[i].props.lower_speed;
+			}
+			return usb_props_list[i].valid;
+		}
+	}
+	return GetUSBProperties(parent_path, device_id, props);
+}
+
+/*
+ * IsHDD() scoring reopens the physical drive for the type and size queries
+ * and rescans the identifier strings, for every list refresh. None of its
+ * inputs can change while a device stays plugged in, so the score is cached
+ * by Device Instance ID and only computed when a device is first seen.
+ */
+typedef struct {
+	char device_instance_id[MAX_PATH];
+	int score;
+} hdd_score_entry;
+
+static hdd_score_entry* hdd_score_list = NULL;
+static uint32_t hdd_score_count = 0, hdd_score_size = 0;
+
+static int GetCachedHddScore(const char* device_instance_id, DWORD drive_index,
+	uint16_t vid, uint16_t pid, const char* strid)
+{
+	hdd_score_entry* new_list;
+	uint32_t i;
+	int score;
+
+	// Don't cache if the Device Instance ID could not be read, as the
+	// "<N/A>" placeholder would alias every such device to one score
+	if (device_instance_id[0] == '<')
+		return IsHDD(drive_index, vid, pid, strid);
+	for (i = 0; i < hdd_score_count; i++) {
+		if (strcmp(hdd_score_list[i].device_instance_id, device_instance_id) == 0)
+			return hdd_score_list[i].score;
+	}
+	score = IsHDD(drive_index, vid, pid, strid);
+	if (hdd_score_count >= hdd_score_size) {
+		new_list = realloc(hdd_score_list, (hdd_score_size + 16) * sizeof(hdd_score_entry));
+		if (new_list == NULL)
+			return score;
+		hdd_score_list = new_list;
+		hdd_score_size += 16;
+	}
+	static_strcpy(hdd_score_list[hdd_score_count].device_instance_id, device_instance_id);
+	hdd_score_list[hdd_score_count].score = score;
+	hdd_score_count++;
+	return score;
+}
+
 /*
  * Cycle the USB port of the selected device
  */
@@ -466,7 +656,7 @@ BOOL GetDevices(DWORD devnum)
 	char drive_name[] = "?:\\";
 	char uefi_togo_check[] = "?:\\EFI\\Rufus\\ntfs_x64.efi";
 	char scsi_card_name_copy[16];
-	BOOL r = FALSE, found = FALSE, post_backslash;
+	BOOL r = FALSE, found = FALSE, post_backslash, changed;
 	HDEVINFO dev_info = NULL;
 	SP_DEVINFO_DATA dev_info_data;
 	SP_DEVICE_INTERFACE_DATA devint_data;
@@ -481,13 +671,21 @@ BOOL GetDevices(DWORD devnum)
 	char drive_letters[27], *device_id, *devid_list = NULL, entry_msg[128];
 	char *p, *label, *entry, buffer[MAX_PATH], str[MAX_PATH], device_instance_id[MAX_PATH], *method_str, *hub_path;
 	usb_device_props props;
-
-	IGNORE_RETVAL(ComboBox_ResetContent(hDeviceList));
+	// Snapshot of the entries the device combo currently displays, so that a
+	// refresh which enumerates the exact same devices can leave it alone
+	static StrArray combo_entry = { 0 };
+	static DWORD combo_index[MAX_DRIVES];
+	StrArray new_entry;
+	DWORD new_index[MAX_DRIVES];
+
+	// Collect the new entries into a local list first, and only touch the
+	// combo once we know the device list actually changed
+	StrArrayCreate(&new_entry, 8);
 	StrArrayClear(&DriveId);
 	StrArrayClear(&DriveName);
 	StrArrayClear(&DriveLabel);
 	StrArrayClear(&DriveHub);
-	StrArrayCreate(&dev_if_path, 128);
+	StrArrayCreateArena(&dev_if_path, 128, 16384);
 	// Add a dummy for string index zero, as this is what non matching hashes will point to
 	StrArrayAdd(&dev_if_path, "", TRUE);
 
@@ -495,6 +693,11 @@ BOOL GetDevices(DWORD devnum)
 	if (device_id == NULL)
 		goto out;
 
+	// Every cached USB property entry must re-announce itself during this
+	// enumeration, or be evicted as departed
+	for (i = 0; i < usb_props_count; i++)
+		usb_props_list[i].present = FALSE;
+
 	// Build a hash table associating a CM Device ID of a USB device with the SetupDI Device Interface Path
 	// of its parent hub - this is needed to retrieve the device speed
 	dev_info = SetupDiGetClassDevsA(&GUID_DEVINTERFACE_USB_HUB, NULL, NULL, DIGCF_PRESENT | DIGCF_DEVICEINTERFACE);
@@ -522,6 +725,7 @@ BOOL GetDevices(DWORD devnum)
 								ToUpper(device_id);
 								if ((k = htab_hash(device_id, &htab_devid)) != 0) {
 									htab_devid.table[k].data = (void*)(uintptr_t)s;
+									QueueUSBPropertiesQuery(device_id, dev_if_path.String[s]);
 								}
 								uuprintf("  Found ID[%03d]: %s", k, device_id);
 								while (CM_Get_Sibling(&device_inst, device_inst, 0) == CR_SUCCESS) {
@@ -530,6 +734,7 @@ BOOL GetDevices(DWORD devnum)
 										ToUpper(device_id);
 										if ((k = htab_hash(device_id, &htab_devid)) != 0) {
 											htab_devid.table[k].data = (void*)(uintptr_t)s;
+											QueueUSBPropertiesQuery(device_id, dev_if_path.String[s]);
 										}
 										uuprintf("  Found ID[%03d]: %s", k, device_id);
 									}
@@ -545,6 +750,11 @@ BOOL GetDevices(DWORD devnum)
 	}
 	free(device_id);
 
+	// Prefetch the USB properties of the hub children that aren't already
+	// cached, in parallel, while we keep enumerating storage devices below
+	if (TrimUSBPropertiesCache())
+		StartUSBPropertiesPool();
+
 	// Build a single list of Device IDs from all the storage enumerators we know of
 	full_list_size = 0;
 	ulFlags = CM_GETIDLIST_FILTER_SERVICE | CM_GETIDLIST_FILTER_PRESENT;
@@ -749,7 +959,7 @@ BOOL GetDevices(DWORD devnum)
 				if ((uintptr_t)htab_devid.table[j].data > 0) {
 					uuprintf("  Matched with Hub[%d]: '%s'", (uintptr_t)htab_devid.table[j].data,
 							dev_if_path.String[(uintptr_t)htab_devid.table[j].data]);
-					if (GetUSBProperties(dev_if_path.String[(uintptr_t)htab_devid.table[j].data], device_id, &props)) {
+					if (GetCachedUSBProperties(dev_if_path.String[(uintptr_t)htab_devid.table[j].data], device_id, &props)) {
 						method_str = "";
 						hub_path = dev_if_path.String[(uintptr_t)htab_devid.table[j].data];
 					}
@@ -883,7 +1093,8 @@ BOOL GetDevices(DWORD devnum)
 					}
 				}
 				if ((!enable_HDDs) && (!props.is_VHD) && (!props.is_CARD) &&
-					((score = IsHDD(drive_index, (uint16_t)props.vid, (uint16_t)props.pid, buffer)) > 0)) {
+					((score = GetCachedHddScore(device_instance_id, drive_index,
+						(uint16_t)props.vid, (uint16_t)props.pid, buffer)) > 0)) {
 					uprintf("Device eliminated because it was detected as a Hard Drive (score %d > 0)", score);
 					if (!list_non_usb_removable_drives)
 						uprintf("If this device is not a Hard Drive, please e-mail the author of this application");
@@ -956,7 +1167,10 @@ BOOL GetDevices(DWORD devnum)
 				if ((hub_path != NULL) && (StrArrayAdd(&DriveHub, hub_path, TRUE) >= 0))
 					DrivePort[DriveHub.Index - 1] = props.port;
 
-				IGNORE_RETVAL(ComboBox_SetItemData(hDeviceList, ComboBox_AddStringU(hDeviceList, entry), drive_index));
+				if (new_entry.Index < MAX_DRIVES) {
+					new_index[new_entry.Index] = drive_index;
+					StrArrayAdd(&new_entry, entry, TRUE);
+				}
 				maxwidth = max(maxwidth, GetEntryWidth(hDeviceList, entry));
 				safe_free(devint_detail_data);
 				break;
@@ -965,8 +1179,28 @@ BOOL GetDevices(DWORD devnum)
 	}
 	SetupDiDestroyDeviceInfoList(dev_info);
 
-	// Adjust the Dropdown width to the maximum text size
-	SendMessage(hDeviceList, CB_SETDROPPEDWIDTH, (WPARAM)maxwidth, 0);
+	// Diff the fresh enumeration against the current combo content: a hotplug
+	// burst that settles on the same device list (which DBT_DEVNODES_CHANGED
+	// storms routinely produce) must not reset the combo or retrigger the
+	// whole selection chain
+	changed = (combo_entry.String == NULL) || (new_entry.Index != combo_entry.Index);
+	for (i = 0; (!changed) && (i < new_entry.Index); i++)
+		changed = (strcmp(new_entry.String[i], combo_entry.String[i]) != 0) ||
+			(new_index[i] != combo_index[i]);
+	if (changed) {
+		IGNORE_RETVAL(ComboBox_ResetContent(hDeviceList));
+		for (i = 0; i < new_entry.Index; i++)
+			IGNORE_RETVAL(ComboBox_SetItemData(hDeviceList,
+				ComboBox_AddStringU(hDeviceList, new_entry.String[i]), new_index[i]));
+		// Adjust the Dropdown width to the maximum text size
+		SendMessage(hDeviceList, CB_SETDROPPEDWIDTH, (WPARAM)maxwidth, 0);
+		StrArrayDestroy(&combo_entry);
+		combo_entry = new_entry;
+		memcpy(combo_index, new_index, sizeof(combo_index));
+	} else {
+		uuprintf("Device list is unchanged - keeping current selection");
+		StrArrayDestroy(&new_entry);
+	}
 
 	if (devnum >= DRIVE_INDEX_MIN) {
 		for (i = 0; i < ComboBox_GetCount(hDeviceList); i++) {
@@ -978,13 +1212,18 @@ BOOL GetDevices(DWORD devnum)
 	}
 	if (!found)
 		i = 0;
-	IGNORE_RETVAL(ComboBox_SetCurSel(hDeviceList, i));
-	SendMessage(hMainDialog, WM_COMMAND, (CBN_SELCHANGE<<16) | IDC_DEVICE, 0);
+	if (changed || (ComboBox_GetCurSel(hDeviceList) != (int)i)) {
+		IGNORE_RETVAL(ComboBox_SetCurSel(hDeviceList, i));
+		SendMessage(hMainDialog, WM_COMMAND, (CBN_SELCHANGE<<16) | IDC_DEVICE, 0);
+	}
 	r = TRUE;
 
 out:
 	// Set 'Start' as the selected button, so that tab selection works
 	SendMessage(hMainDialog, WM_NEXTDLGCTL, (WPARAM)GetDlgItem(hMainDialog, IDC_START), TRUE);
+	WaitUSBPropertiesPool();
+	if (!r)
+		StrArrayDestroy(&new_entry);
 	safe_free(devid_list);
 	StrArrayDestroy(&dev_if_path);
 	htab_destroy(&htab_devid);
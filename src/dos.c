@@ -248,9 +248,10 @@ static BOOL ExtractFAT(int entry, const char* path)
 		Patch_IO_SYS(filestart, filesize);
 	}
 
-	/* Create a file, using the same attributes as found in the FAT */
-	hFile = CreateFileA(filename, GENERIC_READ|GENERIC_WRITE, FILE_SHARE_READ,
-		NULL, CREATE_ALWAYS, dir_entry->Attributes, NULL);
+	/* Create a file, using the same attributes as found in the FAT.
+	   The size is known up front, so preallocate it in the create call. */
+	hFile = CreatePreallocatedFile(filename, GENERIC_READ|GENERIC_WRITE, FILE_SHARE_READ,
+		NULL, CREATE_ALWAYS, dir_entry->Attributes, (LONGLONG)filesize);
 	if (hFile == INVALID_HANDLE_VALUE) {
 		uprintf("Unable to create file '%s': %s.", filename, WindowsErrorString());
 		return FALSE;
@@ -377,8 +378,9 @@ BOOL ExtractFreeDOS(const char* path)
 		static_strcpy(filename, ((i<2)?path:locale_path));
 		static_strcat(filename, res_name[i]);
 
-		hFile = CreateFileA(filename, GENERIC_READ|GENERIC_WRITE, FILE_SHARE_READ, NULL,
-			CREATE_ALWAYS, (i<2)?(FILE_ATTRIBUTE_HIDDEN|FILE_ATTRIBUTE_SYSTEM):FILE_ATTRIBUTE_NORMAL, NULL);
+		// The resource size is known up front, so preallocate the file in the create call
+		hFile = CreatePreallocatedFile(filename, GENERIC_READ|GENERIC_WRITE, FILE_SHARE_READ, NULL,
+			CREATE_ALWAYS, (i<2)?(FILE_ATTRIBUTE_HIDDEN|FILE_ATTRIBUTE_SYSTEM):FILE_ATTRIBUTE_NORMAL, (LONGLONG)res_size);
 		if ((hFile == NULL) || (hFile == INVALID_HANDLE_VALUE)) {
 			uprintf("Unable to create file '%s': %s.", filename, WindowsErrorString());
 			return FALSE;
@@ -405,11 +407,33 @@ BOOL ExtractFreeDOS(const char* path)
 
 BOOL ExtractDOS(const char* path)
 {
+	BOOL r = FALSE;
+	char volume_path[8];
+	HANDLE hVolume;
+
 	switch(ComboBox_GetCurItemData(hBootType)) {
 	case BT_MSDOS:
-		return ExtractMSDOS(path);
+		r = ExtractMSDOS(path);
+		break;
 	case BT_FREEDOS:
-		return ExtractFreeDOS(path);
+		r = ExtractFreeDOS(path);
+		break;
 	}
-	return FALSE;
+	// Release the cached directory handles, so that they can't prevent the
+	// target volume from being locked
+	CloseDirHandleCache();
+	if (r) {
+		// The individual file writes above all went through the cache, so
+		// issue a single volume wide barrier now, rather than paying for a
+		// flush on each of the dozens of small files we just deployed
+		static_sprintf(volume_path, "\\\\.\\%c:", path[0]);
+		hVolume = CreateFileA(volume_path, GENERIC_WRITE, FILE_SHARE_READ|FILE_SHARE_WRITE,
+			NULL, OPEN_EXISTING, 0, NULL);
+		if (hVolume != INVALID_HANDLE_VALUE) {
+			if (!WriteBarrier(hVolume, WB_BULK))
+				uprintf("Could not flush DOS files: %s", WindowsErrorString());
+			safe_closehandle(hVolume);
+		}
+	}
+	return r;
 }
@@ -129,6 +129,9 @@
 /*
  * The following lists the keyboard code that are supported in each
  * of the WinMe DOS KEYBOARD.SYS, KEYBRD2.SYS, ...
+ * NB: All the keyboard and codepage tables below are kept sorted (keyboard
+ * codes alphabetically, codepages numerically), so that the lookups can use
+ * binary search rather than walk the whole table.
  */
 static const char* ms_kb1[] = {
 	"be", "br", "cf", "cz", "dk", "fr", "gr", "hu", "it", "la",
@@ -194,28 +197,39 @@ static kb_list fd_kb_list[] = {
 	{ ARRAYSIZE(fd_kb4), fd_kb4 }
 };
 
+// Binary search for a keyboard code in one of the sorted lists above
+static BOOL kb_found(const char* kb, const char** list, int size)
+{
+	int lo = 0, hi = size - 1, mid, c;
+	while (lo <= hi) {
+		mid = (lo + hi) / 2;
+		c = strcmp(kb, list[mid]);
+		if (c == 0)
+			return TRUE;
+		if (c > 0)
+			lo = mid + 1;
+		else
+			hi = mid - 1;
+	}
+	return FALSE;
+}
+
 static int ms_get_kbdrv(const char* kb)
 {
-	unsigned int i, j;
+	unsigned int i;
 	for (i=0; i<ARRAYSIZE(ms_kb_list); i++) {
-		for (j=0; j<ms_kb_list[i].size; j++) {
-			if (safe_strcmp(ms_kb_list[i].list[j], kb) == 0) {
-				return i;
-			}
-		}
+		if (kb_found(kb, ms_kb_list[i].list, (int)ms_kb_list[i].size))
+			return i;
 	}
 	return -1;
 }
 
 static int fd_get_kbdrv(const char* kb)
 {
-	unsigned int i, j;
+	unsigned int i;
 	for (i=0; i<ARRAYSIZE(fd_kb_list); i++) {
-		for (j=0; j<fd_kb_list[i].size; j++) {
-			if (safe_strcmp(fd_kb_list[i].list[j], kb) == 0) {
-				return i;
-			}
-		}
+		if (kb_found(kb, fd_kb_list[i].list, (int)fd_kb_list[i].size))
+			return i;
 	}
 	return -1;
 }
@@ -226,75 +240,80 @@ static int fd_get_kbdrv(const char* kb)
  */
 static const char* kb_hr_list[][2] = {
 	{"ar", "Arabic"},			// Left enabled, but doesn't seem to work in FreeDOS
+	{"az", "Azeri"},
+	{"be", "Belgian-French"},
 	{"bg", "Bulgarian"},
+	{"bl", "Belarusian"},
+	{"br", "Brazilian"},
+	{"cf", "CA-French"},
 	{"ch", "Chinese"},
 	{"cz", "Czech"},
 	{"dk", "Danish"},
-	{"gr", "German"},
-	{"sg", "Swiss-German"},
-	{"gk", "Greek"},
-	{"us", "US-English"},
-	{"uk", "UK-English"},
-	{"cf", "CA-French"},
 	{"dv", "US-Dvorak"},
-	{"lh", "US-Dvorak (LH)"},
-	{"rh", "US-Dvorak (RH)"},
-	{"sp", "Spanish"},
-	{"la", "Latin-American"},
-	{"su", "Finnish"},
+	{"et", "Estonian"},
+//	{"fa", "Persian"};			// Unsupported by FreeDOS?
+	{"fo", "Faeroese"},
 	{"fr", "French"},
-	{"be", "Belgian-French"},
-	{"sf", "Swiss-French"},
-	{"il", "Hebrew"},
+	{"gk", "Greek"},
+	{"gr", "German"},
 	{"hu", "Hungarian"},
+	{"hy", "Armenian"},
+	{"il", "Hebrew"},
 	{"is", "Icelandic"},
 	{"it", "Italian"},
 	{"jp", "Japanese"},
+	{"ka", "Georgian"},
+	{"kk", "Kazakh"},
 //	{"ko", "Korean"},			// Unsupported by FreeDOS?
+	{"ky", "Kyrgyz"},
+	{"la", "Latin-American"},
+	{"lh", "US-Dvorak (LH)"},
+	{"lt", "Lithuanian"},
+	{"lv", "Latvian"},
+	{"mk", "Macedonian"},
+	{"mt", "Maltese"},
 	{"nl", "Dutch"},
 	{"no", "Norwegian"},
 	{"pl", "Polish"},
-	{"br", "Brazilian"},
 	{"po", "Portuguese"},
+	{"rh", "US-Dvorak (RH)"},
 	{"ro", "Romanian"},
 	{"ru", "Russian"},
-	{"yu", "YU-Latin"},
-	{"yc", "YU-Cyrillic"},
+	{"sf", "Swiss-French"},
+	{"sg", "Swiss-German"},
 	{"sl", "Slovak"},
+	{"sp", "Spanish"},
 	{"sq", "Albanian"},
+	{"su", "Finnish"},
 	{"sv", "Swedish"},
-	{"tr", "Turkish"},
-	{"ur", "Ukrainian"},
-	{"bl", "Belarusian"},
-	{"et", "Estonian"},
-	{"lv", "Latvian"},
-	{"lt", "Lithuanian"},
 	{"tj", "Tajik"},
-//	{"fa", "Persian"};			// Unsupported by FreeDOS?
-	{"vi", "Vietnamese"},
-	{"hy", "Armenian"},
-	{"az", "Azeri"},
-	{"mk", "Macedonian"},
-	{"ka", "Georgian"},
-	{"fo", "Faeroese"},
-	{"mt", "Maltese"},
-	{"kk", "Kazakh"},
-	{"ky", "Kyrgyz"},
-	{"uz", "Uzbek"},
 	{"tm", "Turkmen"},
+	{"tr", "Turkish"},
 	{"tt", "Tatar"},
+	{"uk", "UK-English"},
+	{"ur", "Ukrainian"},
+	{"us", "US-English"},
+	{"uz", "Uzbek"},
+	{"vi", "Vietnamese"},
+	{"yc", "YU-Cyrillic"},
+	{"yu", "YU-Latin"},
 };
 
 static const char* kb_to_hr(const char* kb)
 {
-	int i;
-	for (i=0; i<ARRAYSIZE(kb_hr_list); i++) {
-		if (safe_strcmp(kb, kb_hr_list[i][0]) == 0) {
-			return kb_hr_list[i][1];
-		}
+	int lo = 0, hi = ARRAYSIZE(kb_hr_list) - 1, mid, c;
+	while (lo <= hi) {
+		mid = (lo + hi) / 2;
+		c = strcmp(kb, kb_hr_list[mid][0]);
+		if (c == 0)
+			return kb_hr_list[mid][1];
+		if (c > 0)
+			lo = mid + 1;
+		else
+			hi = mid - 1;
 	}
 	// Should never happen, so let's try to get some attention here
-	assert(i < ARRAYSIZE(kb_hr_list));
+	assert(lo <= hi);
 	return NULL;
 }
 
@@ -425,14 +444,18 @@ static cp_list cp_hr_list[] = {
 
 static const char* cp_to_hr(ULONG cp)
 {
-	int i;
-	for (i=0; i<ARRAYSIZE(cp_hr_list); i++) {
-		if (cp_hr_list[i].cp == cp) {
-			return cp_hr_list[i].name;
-		}
+	int lo = 0, hi = ARRAYSIZE(cp_hr_list) - 1, mid;
+	while (lo <= hi) {
+		mid = (lo + hi) / 2;
+		if (cp_hr_list[mid].cp == cp)
+			return cp_hr_list[mid].name;
+		if (cp_hr_list[mid].cp < cp)
+			lo = mid + 1;
+		else
+			hi = mid - 1;
 	}
 	// Should never happen, so this oughta get some attention
-	assert(i < ARRAYSIZE(cp_hr_list));
+	assert(lo <= hi);
 	return NULL;
 }
 
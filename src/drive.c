@@ -43,6 +43,7 @@
 #include "drive.h"
 #include "mbr_types.h"
 #include "gpt_types.h"
+#include "ext2fs/hashmap.h"
 #include "br.h"
 #include "fat16.h"
 #include "fat32.h"
@@ -72,6 +73,8 @@ PF_TYPE_DECL(NTAPI, NTSTATUS, NtQueryVolumeInformationFile, (HANDLE, PIO_STATUS_
  * Globals
  */
 RUFUS_DRIVE_INFO SelectedDrive;
+RUFUS_DRIVE_CAPS SelectedDriveCaps;
+extern StrArray DriveId;
 extern BOOL write_as_esp;
 extern int nWindowsVersion, nWindowsBuildNumber;
 uint64_t partition_offset[PI_MAX];
@@ -235,12 +238,93 @@ out:
 HANDLE GetPhysicalHandle(DWORD DriveIndex, BOOL bLockDrive, BOOL bWriteAccess, BOOL bWriteShare)
 {
 	HANDLE hPhysical = INVALID_HANDLE_VALUE;
-	char* PhysicalPath = GetPhysicalName(DriveIndex);
+	char* PhysicalPath;
+	// Drop the analysis session whenever someone wants the drive locked or
+	// writable, so that our cached handle can never get in the way of a lock
+	if (bLockDrive || bWriteAccess)
+		CloseDriveSession();
+	PhysicalPath = GetPhysicalName(DriveIndex);
 	hPhysical = GetHandle(PhysicalPath, bLockDrive, bWriteAccess, bWriteShare);
 	safe_free(PhysicalPath);
 	return hPhysical;
 }
 
+/*
+ * Selecting or enumerating a drive has us issue a whole bunch of IOCTLs and boot
+ * record reads, and each used to pay for its own open/close of the same physical
+ * device. Instead, we keep a single read-only, write-shared "session" handle that
+ * all the analysis calls below share, along with the disk size, which the UI and
+ * enumeration code ask for repeatedly. The session is automatically dropped as
+ * soon as lock or write access is requested on a physical drive.
+ */
+static HANDLE hDriveSession = INVALID_HANDLE_VALUE;
+static DWORD SessionDriveIndex;
+static uint64_t SessionDriveSize;
+
+static HANDLE GetDriveSessionHandle(DWORD DriveIndex)
+{
+	if ((hDriveSession != INVALID_HANDLE_VALUE) && (SessionDriveIndex == DriveIndex))
+		return hDriveSession;
+	CloseDriveSession();
+	hDriveSession = GetPhysicalHandle(DriveIndex, FALSE, FALSE, TRUE);
+	if (hDriveSession != INVALID_HANDLE_VALUE)
+		SessionDriveIndex = DriveIndex;
+	return hDriveSession;
+}
+
+/*
+ * Close the shared analysis handle and invalidate the cached drive data
+ */
+void CloseDriveSession(void)
+{
+	safe_closehandle(hDriveSession);
+	SessionDriveSize = 0;
+}
+
+/*
+ * Compute a fingerprint for the drive, from its size, partition layout and
+ * first sector, that is used to key the probing results we cache in the
+ * settings, so that startup and re-selection can skip the expensive probes
+ * whose inputs haven't changed since a previous session.
+ * Returns an empty string on error.
+ */
+static char* GetDriveFingerprint(DWORD DriveIndex)
+{
+	static char fingerprint[40];
+	BOOL r;
+	HANDLE hPhysical;
+	BYTE* mbr = NULL;
+	DWORD size, layout_size, sector_size;
+	BYTE geometry[256] = { 0 }, layout[4096] = { 0 };
+	PDISK_GEOMETRY_EX DiskGeometry = (PDISK_GEOMETRY_EX)(void*)geometry;
+
+	fingerprint[0] = 0;
+	hPhysical = GetDriveSessionHandle(DriveIndex);
+	if (hPhysical == INVALID_HANDLE_VALUE)
+		goto out;
+	r = DeviceIoControl(hPhysical, IOCTL_DISK_GET_DRIVE_GEOMETRY_EX,
+		NULL, 0, geometry, sizeof(geometry), &size, NULL);
+	if (!r || size <= 0)
+		goto out;
+	sector_size = max(DiskGeometry->Geometry.BytesPerSector, 512);
+	r = DeviceIoControl(hPhysical, IOCTL_DISK_GET_DRIVE_LAYOUT_EX,
+		NULL, 0, layout, sizeof(layout), &layout_size, NULL);
+	if (!r || layout_size <= 0)
+		goto out;
+	// Include the first sector, so that boot code updates invalidate the cache
+	mbr = calloc(sector_size, 1);
+	if (mbr == NULL)
+		goto out;
+	if (read_sectors(hPhysical, sector_size, 0, 1, mbr) <= 0)
+		goto out;
+	static_sprintf(fingerprint, "%016" PRIX64 "-%08X-%08X", (uint64_t)DiskGeometry->DiskSize.QuadPart,
+		ext2fs_djb2_hash(layout, layout_size), ext2fs_djb2_hash(mbr, sector_size));
+
+out:
+	free(mbr);
+	return fingerprint;
+}
+
 /*
  * Return the GUID volume name for the disk and partition specified, or NULL if not found.
  * See http://msdn.microsoft.com/en-us/library/cc542456.aspx
@@ -444,16 +528,28 @@ static const char* VdsErrorString(HRESULT hr) {
 }
 
 /*
- * Per https://docs.microsoft.com/en-us/windows/win32/api/combaseapi/nf-combaseapi-cocreateinstance
- * and even though we aren't a UWP app, Windows Store prevents the ability to use of VDS when the
- * Store version of Rufus is running (the call to IVdsServiceLoader_LoadService() will return
- * E_ACCESSDENIED).
+ * Loading the VDS Service (loader instantiation, out of process service load,
+ * readiness wait) takes a sizeable fraction of a second and used to be repeated
+ * by every single VDS entry point, several times over during a format. So keep
+ * one service session per thread instead. COM interface pointers cannot roam
+ * between apartments, which is why the cache lives in thread local storage (so
+ * that concurrent threads don't stomp on each other's session), and why worker
+ * threads should call VdsReleaseService() before they exit.
  */
-BOOL IsVdsAvailable(BOOL bSilent)
+#if defined(_MSC_VER)
+static __declspec(thread) IVdsService* pCachedVdsService = NULL;
+#else
+static __thread IVdsService* pCachedVdsService = NULL;
+#endif
+
+IVdsService* GetVdsService(BOOL bSilent)
 {
 	HRESULT hr = S_FALSE;
-	IVdsService* pService = NULL;
 	IVdsServiceLoader* pLoader = NULL;
+	IVdsService* pService = NULL;
+
+	if (pCachedVdsService != NULL)
+		return pCachedVdsService;
 
 	// Initialize COM
 	IGNORE_RETVAL(CoInitializeEx(NULL, COINIT_APARTMENTTHREADED | COINIT_DISABLE_OLE1DDE));
@@ -464,23 +560,55 @@ BOOL IsVdsAvailable(BOOL bSilent)
 	hr = CoCreateInstance(&CLSID_VdsLoader, NULL, CLSCTX_LOCAL_SERVER | CLSCTX_REMOTE_SERVER,
 		&IID_IVdsServiceLoader, (void**)&pLoader);
 	if (hr != S_OK) {
-		suprintf("Notice: Disabling VDS (Could not create VDS Loader Instance: %s)", VdsErrorString(hr));
+		suprintf("Could not create VDS Loader Instance: %s", VdsErrorString(hr));
 		goto out;
 	}
 
+	// Load the VDS Service
 	hr = IVdsServiceLoader_LoadService(pLoader, L"", &pService);
 	if (hr != S_OK) {
-		suprintf("Notice: Disabling VDS (Could not load VDS Service: %s)", VdsErrorString(hr));
+		suprintf("Could not load VDS Service: %s", VdsErrorString(hr));
+		goto out;
+	}
+
+	// Wait for the Service to become ready if needed
+	hr = IVdsService_WaitForServiceReady(pService);
+	if (hr != S_OK) {
+		suprintf("VDS Service is not ready: %s", VdsErrorString(hr));
 		goto out;
 	}
 
 out:
-	if (pService != NULL)
-		IVdsService_Release(pService);
 	if (pLoader != NULL)
 		IVdsServiceLoader_Release(pLoader);
-	VDS_SET_ERROR(hr);
-	return (hr == S_OK);
+	if (hr != S_OK) {
+		if (pService != NULL)
+			IVdsService_Release(pService);
+		VDS_SET_ERROR(hr);
+		return NULL;
+	}
+	pCachedVdsService = pService;
+	return pCachedVdsService;
+}
+
+// Release the calling thread's cached service session, if any
+void VdsReleaseService(void)
+{
+	if (pCachedVdsService != NULL) {
+		IVdsService_Release(pCachedVdsService);
+		pCachedVdsService = NULL;
+	}
+}
+
+/*
+ * Per https://docs.microsoft.com/en-us/windows/win32/api/combaseapi/nf-combaseapi-cocreateinstance
+ * and even though we aren't a UWP app, Windows Store prevents the ability to use of VDS when the
+ * Store version of Rufus is running (the call to IVdsServiceLoader_LoadService() will return
+ * E_ACCESSDENIED).
+ */
+BOOL IsVdsAvailable(BOOL bSilent)
+{
+	return (GetVdsService(bSilent) != NULL);
 }
 
 /*
@@ -490,39 +618,15 @@ BOOL RefreshLayout(DWORD DriveIndex)
 {
 	HRESULT hr = S_FALSE;
 	wchar_t wPhysicalName[24];
-	IVdsServiceLoader* pLoader = NULL;
-	IVdsService* pService = NULL;
-	IEnumVdsObject *pEnum;
+	IVdsService* pService;
+	IEnumVdsObject *pEnum = NULL;
 
 	CheckDriveIndex(DriveIndex);
 	wnsprintf(wPhysicalName, ARRAYSIZE(wPhysicalName), L"\\\\?\\PhysicalDrive%lu", DriveIndex);
 
-	// Initialize COM
-	IGNORE_RETVAL(CoInitializeEx(NULL, COINIT_APARTMENTTHREADED | COINIT_DISABLE_OLE1DDE));
-	IGNORE_RETVAL(CoInitializeSecurity(NULL, -1, NULL, NULL, RPC_C_AUTHN_LEVEL_CONNECT,
-		RPC_C_IMP_LEVEL_IMPERSONATE, NULL, 0, NULL));
-
-	// Create a VDS Loader Instance
-	hr = CoCreateInstance(&CLSID_VdsLoader, NULL, CLSCTX_LOCAL_SERVER | CLSCTX_REMOTE_SERVER,
-		&IID_IVdsServiceLoader, (void **)&pLoader);
-	if (hr != S_OK) {
-		uprintf("Could not create VDS Loader Instance: %s", VdsErrorString(hr));
-		goto out;
-	}
-
-	// Load the VDS Service
-	hr = IVdsServiceLoader_LoadService(pLoader, L"", &pService);
-	if (hr != S_OK) {
-		uprintf("Could not load VDS Service: %s", VdsErrorString(hr));
-		goto out;
-	}
-
-	// Wait for the Service to become ready if needed
-	hr = IVdsService_WaitForServiceReady(pService);
-	if (hr != S_OK) {
-		uprintf("VDS Service is not ready: %s", VdsErrorString(hr));
+	pService = GetVdsService(FALSE);
+	if (pService == NULL)
 		goto out;
-	}
 
 	// Query the VDS Service Providers
 	hr = IVdsService_QueryProviders(pService, VDS_QUERY_SOFTWARE_PROVIDERS, &pEnum);
@@ -553,10 +657,8 @@ BOOL RefreshLayout(DWORD DriveIndex)
 	}
 
 out:
-	if (pService != NULL)
-		IVdsService_Release(pService);
-	if (pLoader != NULL)
-		IVdsServiceLoader_Release(pLoader);
+	if (pEnum != NULL)
+		IEnumVdsObject_Release(pEnum);
 	VDS_SET_ERROR(hr);
 	return (hr == S_OK);
 }
@@ -571,7 +673,6 @@ static BOOL GetVdsDiskInterface(DWORD DriveIndex, const IID* InterfaceIID, void*
 	HRESULT hr = S_FALSE;
 	ULONG ulFetched;
 	wchar_t wPhysicalName[24];
-	IVdsServiceLoader* pLoader;
 	IVdsService* pService;
 	IEnumVdsObject* pEnum;
 	IUnknown* pUnk;
@@ -580,37 +681,12 @@ static BOOL GetVdsDiskInterface(DWORD DriveIndex, const IID* InterfaceIID, void*
 	CheckDriveIndex(DriveIndex);
 	wnsprintf(wPhysicalName, ARRAYSIZE(wPhysicalName), L"\\\\?\\PhysicalDrive%lu", DriveIndex);
 
-	// Initialize COM
-	IGNORE_RETVAL(CoInitializeEx(NULL, COINIT_APARTMENTTHREADED | COINIT_DISABLE_OLE1DDE));
-	IGNORE_RETVAL(CoInitializeSecurity(NULL, -1, NULL, NULL, RPC_C_AUTHN_LEVEL_CONNECT,
-		RPC_C_IMP_LEVEL_IMPERSONATE, NULL, 0, NULL));
-
-	// Create a VDS Loader Instance
-	hr = CoCreateInstance(&CLSID_VdsLoader, NULL, CLSCTX_LOCAL_SERVER | CLSCTX_REMOTE_SERVER,
-		&IID_IVdsServiceLoader, (void**)&pLoader);
-	if (hr != S_OK) {
-		suprintf("Could not create VDS Loader Instance: %s", VdsErrorString(hr));
-		goto out;
-	}
-
-	// Load the VDS Service
-	hr = IVdsServiceLoader_LoadService(pLoader, L"", &pService);
-	IVdsServiceLoader_Release(pLoader);
-	if (hr != S_OK) {
-		suprintf("Could not load VDS Service: %s", VdsErrorString(hr));
+	pService = GetVdsService(bSilent);
+	if (pService == NULL)
 		goto out;
-	}
-
-	// Wait for the Service to become ready if needed
-	hr = IVdsService_WaitForServiceReady(pService);
-	if (hr != S_OK) {
-		suprintf("VDS Service is not ready: %s", VdsErrorString(hr));
-		goto out;
-	}
 
 	// Query the VDS Service Providers
 	hr = IVdsService_QueryProviders(pService, VDS_QUERY_SOFTWARE_PROVIDERS, &pEnum);
-	IVdsService_Release(pService);
 	if (hr != S_OK) {
 		suprintf("Could not query VDS Service Providers: %s", VdsErrorString(hr));
 		goto out;
@@ -726,32 +802,11 @@ BOOL VdsRescan(DWORD dwRescanType, DWORD dwSleepTime, BOOL bSilent)
 {
 	BOOL ret = TRUE;
 	HRESULT hr = S_FALSE;
-	IVdsServiceLoader* pLoader;
 	IVdsService* pService;
 
-	IGNORE_RETVAL(CoInitializeEx(NULL, COINIT_APARTMENTTHREADED | COINIT_DISABLE_OLE1DDE));
-	IGNORE_RETVAL(CoInitializeSecurity(NULL, -1, NULL, NULL, RPC_C_AUTHN_LEVEL_CONNECT,
-		RPC_C_IMP_LEVEL_IMPERSONATE, NULL, 0, NULL));
-
-	hr = CoCreateInstance(&CLSID_VdsLoader, NULL, CLSCTX_LOCAL_SERVER | CLSCTX_REMOTE_SERVER,
-		&IID_IVdsServiceLoader, (void**)&pLoader);
-	if (hr != S_OK) {
-		suprintf("Could not create VDS Loader Instance: %s", VdsErrorString(hr));
-		return FALSE;
-	}
-
-	hr = IVdsServiceLoader_LoadService(pLoader, L"", &pService);
-	IVdsServiceLoader_Release(pLoader);
-	if (hr != S_OK) {
-		suprintf("Could not load VDS Service: %s", VdsErrorString(hr));
+	pService = GetVdsService(bSilent);
+	if (pService == NULL)
 		return FALSE;
-	}
-
-	hr = IVdsService_WaitForServiceReady(pService);
-	if (hr != S_OK) {
-		suprintf("VDS Service is not ready: %s", VdsErrorString(hr));
-		return FALSE;
-	}
 
 	// https://docs.microsoft.com/en-us/windows/win32/api/vds/nf-vds-ivdsservice-refresh
 	// This method synchronizes the disk layout to the layout known to the disk driver.
@@ -840,42 +895,16 @@ BOOL ListVdsVolumes(BOOL bSilent)
 {
 	HRESULT hr = S_FALSE;
 	ULONG ulFetched;
-	IVdsServiceLoader* pLoader;
 	IVdsService* pService;
 	IEnumVdsObject* pEnum;
 	IUnknown* pUnk;
 
-	// Initialize COM
-	IGNORE_RETVAL(CoInitializeEx(NULL, COINIT_APARTMENTTHREADED | COINIT_DISABLE_OLE1DDE));
-	IGNORE_RETVAL(CoInitializeSecurity(NULL, -1, NULL, NULL, RPC_C_AUTHN_LEVEL_CONNECT,
-		RPC_C_IMP_LEVEL_IMPERSONATE, NULL, 0, NULL));
-
-	// Create a VDS Loader Instance
-	hr = CoCreateInstance(&CLSID_VdsLoader, NULL, CLSCTX_LOCAL_SERVER | CLSCTX_REMOTE_SERVER,
-		&IID_IVdsServiceLoader, (void**)&pLoader);
-	if (hr != S_OK) {
-		suprintf("Could not create VDS Loader Instance: %s", VdsErrorString(hr));
-		goto out;
-	}
-
-	// Load the VDS Service
-	hr = IVdsServiceLoader_LoadService(pLoader, L"", &pService);
-	IVdsServiceLoader_Release(pLoader);
-	if (hr != S_OK) {
-		suprintf("Could not load VDS Service: %s", VdsErrorString(hr));
-		goto out;
-	}
-
-	// Wait for the Service to become ready if needed
-	hr = IVdsService_WaitForServiceReady(pService);
-	if (hr != S_OK) {
-		suprintf("VDS Service is not ready: %s", VdsErrorString(hr));
+	pService = GetVdsService(bSilent);
+	if (pService == NULL)
 		goto out;
-	}
 
 	// Query the VDS Service Providers
 	hr = IVdsService_QueryProviders(pService, VDS_QUERY_SOFTWARE_PROVIDERS, &pEnum);
-	IVdsService_Release(pService);
 	if (hr != S_OK) {
 		suprintf("Could not query VDS Service Providers: %s", VdsErrorString(hr));
 		goto out;
@@ -992,8 +1021,23 @@ out:
 /* Wait for a logical drive to reappear - Used when a drive has just been repartitioned */
 BOOL WaitForLogical(DWORD DriveIndex, uint64_t PartitionOffset)
 {
+	BOOL ret = FALSE;
 	uint64_t EndTime;
 	char* LogicalPath = NULL;
+	HANDLE hMountMgr;
+	DWORD size;
+	OVERLAPPED overlapped = { 0 };
+	MOUNTMGR_CHANGE_NOTIFY_INFO notify = { 0 };
+
+	// Rather than only polling GetLogicalName() at a fixed interval, have the
+	// mount manager signal us as soon as its mount point database changes, so
+	// that formatting resumes the instant the volume appears. The old interval
+	// is kept as the cancellation check granularity, and plain polling remains
+	// as a fallback in case notification can't be set up.
+	hMountMgr = CreateFileA(MOUNTMGR_DOS_DEVICE_NAME, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE,
+		NULL, OPEN_EXISTING, FILE_FLAG_OVERLAPPED, NULL);
+	if (hMountMgr != INVALID_HANDLE_VALUE)
+		overlapped.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
 
 	// GetLogicalName() calls may be slow, so use the system time to
 	// make sure we don't spend more than DRIVE_ACCESS_TIMEOUT in wait.
@@ -1002,16 +1046,38 @@ BOOL WaitForLogical(DWORD DriveIndex, uint64_t PartitionOffset)
 		LogicalPath = GetLogicalName(DriveIndex, PartitionOffset, FALSE, TRUE);
 		// Need to filter out GlobalRoot devices as we don't want to wait on those
 		if ((LogicalPath != NULL) && (strncmp(LogicalPath, groot_name, groot_len) != 0)) {
-			free(LogicalPath);
-			return TRUE;
+			ret = TRUE;
+			break;
 		}
-		free(LogicalPath);
+		safe_free(LogicalPath);
 		if (IS_ERROR(FormatStatus))	// User cancel
-			return FALSE;
+			break;
+		if (overlapped.hEvent != NULL) {
+			// The notification completes as soon as the mount manager's "epic
+			// number" no longer matches the one we pass in, i.e. as soon as any
+			// mount point was added or removed since our last query.
+			ResetEvent(overlapped.hEvent);
+			if (DeviceIoControl(hMountMgr, IOCTL_MOUNTMGR_CHANGE_NOTIFY, &notify, sizeof(notify),
+				&notify, sizeof(notify), &size, &overlapped) || (GetLastError() == ERROR_IO_PENDING)) {
+				if (WaitForSingleObject(overlapped.hEvent, DRIVE_ACCESS_TIMEOUT / DRIVE_ACCESS_RETRIES) != WAIT_OBJECT_0)
+					CancelIo(hMountMgr);
+				// Also reaps the cancellation, so that 'overlapped' can be reused
+				GetOverlappedResult(hMountMgr, &overlapped, &size, TRUE);
+				continue;
+			}
+			uprintf("Could not set up mount manager notification: %s", WindowsErrorString());
+			CloseHandle(overlapped.hEvent);
+			overlapped.hEvent = NULL;
+		}
 		Sleep(DRIVE_ACCESS_TIMEOUT / DRIVE_ACCESS_RETRIES);
 	} while (GetTickCount64() < EndTime);
-	uprintf("Timeout while waiting for logical drive");
-	return FALSE;
+	if ((!ret) && (!IS_ERROR(FormatStatus)))
+		uprintf("Timeout while waiting for logical drive");
+	free(LogicalPath);
+	if (overlapped.hEvent != NULL)
+		CloseHandle(overlapped.hEvent);
+	safe_closehandle(hMountMgr);
+	return ret;
 }
 
 /*
@@ -1206,6 +1272,43 @@ UINT GetDriveTypeFromIndex(DWORD DriveIndex)
 	return drive_type;
 }
 
+/*
+ * Logical drives snapshot service. GetUnusedDriveLetter() and
+ * IsDriveLetterInUse() are each invoked several times during a single format
+ * flow and used to re-query the system for the full list of logical drives
+ * on every call. The list is now captured once and served from memory; the
+ * snapshot is dropped whenever a device change notification is received
+ * (WM_DEVICECHANGE in the main dialog) or when we alter the mappings
+ * ourselves (mount, unmount, drive letter removal).
+ */
+static char logical_drives_snapshot[26 * 4 + 1] = { 0 };	/* "C:\", "D:\", etc., plus one NUL */
+static BOOL logical_drives_valid = FALSE;
+
+void InvalidateDriveLettersSnapshot(void)
+{
+	logical_drives_valid = FALSE;
+}
+
+static const char* GetLogicalDrivesSnapshot(void)
+{
+	DWORD size;
+
+	if (!logical_drives_valid) {
+		size = GetLogicalDriveStringsA(sizeof(logical_drives_snapshot), logical_drives_snapshot);
+		if (size == 0) {
+			uprintf("GetLogicalDriveStrings failed: %s", WindowsErrorString());
+			return NULL;
+		}
+		if (size > sizeof(logical_drives_snapshot)) {
+			uprintf("GetLogicalDriveStrings: Buffer too small (required %d vs. %d)",
+				size, sizeof(logical_drives_snapshot));
+			return NULL;
+		}
+		logical_drives_valid = TRUE;
+	}
+	return logical_drives_snapshot;
+}
+
 // Removes all drive letters associated with the specific drive, and return
 // either the first or last letter that was removed, according to bReturnLast.
 char RemoveDriveLetters(DWORD DriveIndex, BOOL bReturnLast, BOOL bSilent)
@@ -1243,6 +1346,7 @@ char RemoveDriveLetters(DWORD DriveIndex, BOOL bReturnLast, BOOL bSilent)
 		if (!DeleteVolumeMountPointA(drive_name))
 			suprintf("Failed to delete mountpoint %s: %s", drive_name, WindowsErrorString());
 	}
+	InvalidateDriveLettersSnapshot();
 	return drive_letters[bReturnLast ? (len - 1) : 0];
 }
 
@@ -1251,18 +1355,12 @@ char RemoveDriveLetters(DWORD DriveIndex, BOOL bReturnLast, BOOL bSilent)
  */
 char GetUnusedDriveLetter(void)
 {
-	DWORD size;
-	char drive_letter, *drive, drives[26*4 + 1];	/* "D:\", "E:\", etc., plus one NUL */
+	char drive_letter;
+	const char *drive, *drives;
 
-	size = GetLogicalDriveStringsA(sizeof(drives), drives);
-	if (size == 0) {
-		uprintf("GetLogicalDriveStrings failed: %s", WindowsErrorString());
-		return 0;
-	}
-	if (size > sizeof(drives)) {
-		uprintf("GetLogicalDriveStrings: Buffer too small (required %d vs. %d)", size, sizeof(drives));
+	drives = GetLogicalDrivesSnapshot();
+	if (drives == NULL)
 		return 0;
-	}
 
 	for (drive_letter = 'C'; drive_letter <= 'Z'; drive_letter++) {
 		for (drive = drives ; *drive; drive += safe_strlen(drive) + 1) {
@@ -1280,18 +1378,12 @@ char GetUnusedDriveLetter(void)
 
 BOOL IsDriveLetterInUse(const char drive_letter)
 {
-	DWORD size;
-	char *drive, drives[26 * 4 + 1];
+	const char *drive, *drives;
 
-	size = GetLogicalDriveStringsA(sizeof(drives), drives);
-	if (size == 0) {
-		uprintf("GetLogicalDriveStrings failed: %s", WindowsErrorString());
+	drives = GetLogicalDrivesSnapshot();
+	if (drives == NULL)
+		// Err on the safe side and report the letter as being in use
 		return TRUE;
-	}
-	if (size > sizeof(drives)) {
-		uprintf("GetLogicalDriveStrings: Buffer too small (required %d vs. %d)", size, sizeof(drives));
-		return TRUE;
-	}
 
 	for (drive = drives; *drive; drive += safe_strlen(drive) + 1) {
 		if (drive_letter == (char)toupper((int)*drive))
@@ -1309,6 +1401,7 @@ BOOL GetDriveLabel(DWORD DriveIndex, char* letters, char** label)
 {
 	HANDLE hPhysical;
 	DWORD size, error;
+	char* fingerprint;
 	static char VolumeLabel[MAX_PATH + 1] = { 0 };
 	char DrivePath[] = "#:\\", AutorunPath[] = "#:\\autorun.inf", *AutorunLabel = NULL;
 	WCHAR VolumeName[MAX_PATH + 1] = { 0 }, FileSystemName[64];
@@ -1337,13 +1430,12 @@ BOOL GetDriveLabel(DWORD DriveIndex, char* letters, char** label)
 	// Try to read an extended label from autorun first. Fallback to regular label if not found.
 	// In the case of card readers with no card, users can get an annoying popup asking them
 	// to insert media. Use IOCTL_STORAGE_CHECK_VERIFY to prevent this
-	hPhysical = GetPhysicalHandle(DriveIndex, FALSE, FALSE, TRUE);
+	hPhysical = GetDriveSessionHandle(DriveIndex);
 	if (DeviceIoControl(hPhysical, IOCTL_STORAGE_CHECK_VERIFY, NULL, 0, NULL, 0, &size, NULL))
 		AutorunLabel = get_token_data_file("label", AutorunPath);
 	else if (GetLastError() == ERROR_NOT_READY)
 		uprintf("Ignoring 'autorun.inf' label for drive %c: %s", toupper(letters[0]),
 		(HRESULT_CODE(GetLastError()) == ERROR_NOT_READY)?"No media":WindowsErrorString());
-	safe_closehandle(hPhysical);
 	if (AutorunLabel != NULL) {
 		uprintf("Using 'autorun.inf' label for drive %c: '%s'", toupper(letters[0]), AutorunLabel);
 		static_strcpy(VolumeLabel, AutorunLabel);
@@ -1353,9 +1445,21 @@ BOOL GetDriveLabel(DWORD DriveIndex, char* letters, char** label)
 		NULL, NULL, NULL, NULL, 0) && (VolumeLabel[0] != 0)) {
 		*label = VolumeLabel;
 	} else {
-		// Might be an extfs label
+		// Might be an extfs label, which is expensive to probe for, so cache the
+		// result in the settings, keyed on the drive's fingerprint
 		error = GetLastError();
-		*label = (char*)GetExtFsLabel(DriveIndex, 0);
+		fingerprint = GetDriveFingerprint(DriveIndex);
+		if ((fingerprint[0] != 0) && (strcmp(fingerprint, ReadSettingStr(SETTING_DRIVE_CACHE_EXT_ID)) == 0)) {
+			duprintf("Using cached ext label for drive 0x%02x", DriveIndex);
+			static_strcpy(VolumeLabel, ReadSettingStr(SETTING_DRIVE_CACHE_EXT_LABEL));
+			*label = (VolumeLabel[0] != 0) ? VolumeLabel : NULL;
+		} else {
+			*label = (char*)GetExtFsLabel(DriveIndex, 0);
+			if (fingerprint[0] != 0) {
+				WriteSettingStr(SETTING_DRIVE_CACHE_EXT_ID, fingerprint);
+				WriteSettingStr(SETTING_DRIVE_CACHE_EXT_LABEL, (*label != NULL) ? *label : "");
+			}
+		}
 		if (*label == NULL) {
 			SetLastError(error);
 			if (error != ERROR_UNRECOGNIZED_VOLUME)
@@ -1377,16 +1481,21 @@ uint64_t GetDriveSize(DWORD DriveIndex)
 	BYTE geometry[256];
 	PDISK_GEOMETRY_EX DiskGeometry = (PDISK_GEOMETRY_EX)(void*)geometry;
 
-	hPhysical = GetPhysicalHandle(DriveIndex, FALSE, FALSE, TRUE);
+	// The same size gets requested over and over during enumeration,
+	// so serve it from the session cache when we can
+	if ((hDriveSession != INVALID_HANDLE_VALUE) && (SessionDriveIndex == DriveIndex) && (SessionDriveSize != 0))
+		return SessionDriveSize;
+
+	hPhysical = GetDriveSessionHandle(DriveIndex);
 	if (hPhysical == INVALID_HANDLE_VALUE)
 		return FALSE;
 
 	r = DeviceIoControl(hPhysical, IOCTL_DISK_GET_DRIVE_GEOMETRY_EX,
 		NULL, 0, geometry, sizeof(geometry), &size, NULL);
-	safe_closehandle(hPhysical);
 	if (!r || size <= 0)
 		return 0;
-	return DiskGeometry->DiskSize.QuadPart;
+	SessionDriveSize = DiskGeometry->DiskSize.QuadPart;
+	return SessionDriveSize;
 }
 
 /*
@@ -1399,10 +1508,12 @@ BOOL IsMediaPresent(DWORD DriveIndex)
 	DWORD size;
 	BYTE geometry[128];
 
-	hPhysical = GetPhysicalHandle(DriveIndex, FALSE, FALSE, TRUE);
+	hPhysical = GetDriveSessionHandle(DriveIndex);
 	r = DeviceIoControl(hPhysical, IOCTL_DISK_GET_DRIVE_GEOMETRY_EX,
 			NULL, 0, geometry, sizeof(geometry), &size, NULL) && (size > 0);
-	safe_closehandle(hPhysical);
+	// Media may just have been removed - don't let a stale handle linger
+	if (!r)
+		CloseDriveSession();
 	return r;
 }
 
@@ -1638,6 +1749,65 @@ out:
 	return ret;
 }
 
+/*
+ * Move the end boundary of the persistence partition, without touching any of
+ * the other partitions. Only ever called on a layout we created ourselves,
+ * where the persistence partition sits last on the drive, so resizing it
+ * within its original allocation cannot collide with anything else.
+ */
+BOOL ResizePersistencePartition(DWORD DriveIndex, uint64_t PartitionOffset, uint64_t NewSize)
+{
+	const LONGLONG bytes_per_track = ((LONGLONG)SelectedDrive.SectorsPerTrack) * SelectedDrive.SectorSize;
+	BOOL r, ret = FALSE;
+	HANDLE hPhysical;
+	DWORD size, i;
+	BYTE layout[4096] = { 0 };
+	PDRIVE_LAYOUT_INFORMATION_EX DriveLayout = (PDRIVE_LAYOUT_INFORMATION_EX)(void*)layout;
+
+	// Keep the same track alignment as CreatePartition()
+	NewSize = ((LONGLONG)NewSize / bytes_per_track) * bytes_per_track;
+	if (NewSize == 0) {
+		uprintf("Invalid new persistence partition size");
+		return FALSE;
+	}
+
+	hPhysical = GetPhysicalHandle(DriveIndex, FALSE, TRUE, TRUE);
+	if (hPhysical == INVALID_HANDLE_VALUE)
+		return FALSE;
+
+	r = DeviceIoControl(hPhysical, IOCTL_DISK_GET_DRIVE_LAYOUT_EX,
+		NULL, 0, layout, sizeof(layout), &size, NULL);
+	if (!r || size <= 0) {
+		uprintf("Could not get layout for drive 0x%02x: %s", DriveIndex, WindowsErrorString());
+		goto out;
+	}
+
+	for (i = 0; i < DriveLayout->PartitionCount; i++) {
+		if (DriveLayout->PartitionEntry[i].StartingOffset.QuadPart == (LONGLONG)PartitionOffset)
+			break;
+	}
+	if (i >= DriveLayout->PartitionCount) {
+		uprintf("No persistence partition found at offset %" PRIu64, PartitionOffset);
+		goto out;
+	}
+
+	uprintf("● Resizing Linux Persistence Partition (offset: %lld, size: %s)", PartitionOffset,
+		SizeToHumanReadable(NewSize, TRUE, FALSE));
+	DriveLayout->PartitionEntry[i].PartitionLength.QuadPart = NewSize;
+	DriveLayout->PartitionEntry[i].RewritePartition = TRUE;
+	r = DeviceIoControl(hPhysical, IOCTL_DISK_SET_DRIVE_LAYOUT_EX, (BYTE*)DriveLayout, size, NULL, 0, &size, NULL);
+	if (!r) {
+		uprintf("Could not set drive layout: %s", WindowsErrorString());
+		goto out;
+	}
+	RefreshDriveLayout(hPhysical);
+	ret = TRUE;
+
+out:
+	safe_closehandle(hPhysical);
+	return ret;
+}
+
 // This is a crude attempt at detecting file systems through their superblock magic.
 // Note that we only attempt to detect the file systems that Rufus can format as
 // well as a couple other maintsream ones.
@@ -1776,6 +1946,7 @@ BOOL GetDrivePartitionData(DWORD DriveIndex, char* FileSystemName, DWORD FileSys
 	BOOL r, ret = FALSE, isUefiNtfs;
 	HANDLE hPhysical;
 	DWORD size, i, j, super_floppy_disk = FALSE;
+	char* fingerprint;
 	BYTE geometry[256] = {0}, layout[4096] = {0}, part_type;
 	PDISK_GEOMETRY_EX DiskGeometry = (PDISK_GEOMETRY_EX)(void*)geometry;
 	PDRIVE_LAYOUT_INFORMATION_EX DriveLayout = (PDRIVE_LAYOUT_INFORMATION_EX)(void*)layout;
@@ -1795,7 +1966,7 @@ BOOL GetDrivePartitionData(DWORD DriveIndex, char* FileSystemName, DWORD FileSys
 	}
 	safe_free(volume_name);
 
-	hPhysical = GetPhysicalHandle(DriveIndex, FALSE, FALSE, TRUE);
+	hPhysical = GetDriveSessionHandle(DriveIndex);
 	if (hPhysical == INVALID_HANDLE_VALUE)
 		return FALSE;
 
@@ -1803,10 +1974,11 @@ BOOL GetDrivePartitionData(DWORD DriveIndex, char* FileSystemName, DWORD FileSys
 			NULL, 0, geometry, sizeof(geometry), &size, NULL);
 	if (!r || size <= 0) {
 		suprintf("Could not get geometry for drive 0x%02x: %s", DriveIndex, WindowsErrorString());
-		safe_closehandle(hPhysical);
+		CloseDriveSession();
 		return FALSE;
 	}
 	SelectedDrive.DiskSize = DiskGeometry->DiskSize.QuadPart;
+	SessionDriveSize = SelectedDrive.DiskSize;
 	SelectedDrive.SectorSize = DiskGeometry->Geometry.BytesPerSector;
 	SelectedDrive.FirstDataSector = MAXDWORD;
 	if (SelectedDrive.SectorSize < 512) {
@@ -1826,7 +1998,7 @@ BOOL GetDrivePartitionData(DWORD DriveIndex, char* FileSystemName, DWORD FileSys
 			NULL, 0, layout, sizeof(layout), &size, NULL );
 	if (!r || size <= 0) {
 		suprintf("Could not get layout for drive 0x%02x: %s", DriveIndex, WindowsErrorString());
-		safe_closehandle(hPhysical);
+		CloseDriveSession();
 		return FALSE;
 	}
 
@@ -1847,7 +2019,16 @@ BOOL GetDrivePartitionData(DWORD DriveIndex, char* FileSystemName, DWORD FileSys
 			suprintf("Partition type: MBR, NB Partitions: %d", SelectedDrive.nPartitions);
 			SelectedDrive.has_mbr_uefi_marker = (DriveLayout->Mbr.Signature == MBR_UEFI_MARKER);
 			suprintf("Disk ID: 0x%08X %s", DriveLayout->Mbr.Signature, SelectedDrive.has_mbr_uefi_marker?"(UEFI target)":"");
-			AnalyzeMBR(hPhysical, "Drive", bSilent);
+			// Each boot record check re-reads the first sector, so skip the whole
+			// analysis when the fingerprint says nothing changed since we last ran it
+			fingerprint = GetDriveFingerprint(DriveIndex);
+			if ((fingerprint[0] != 0) && (strcmp(fingerprint, ReadSettingStr(SETTING_DRIVE_CACHE_MBR_ID)) == 0)) {
+				suprintf("Drive is unchanged since last boot record analysis");
+			} else {
+				AnalyzeMBR(hPhysical, "Drive", bSilent);
+				if (fingerprint[0] != 0)
+					WriteSettingStr(SETTING_DRIVE_CACHE_MBR_ID, fingerprint);
+			}
 		}
 		for (i = 0; i < DriveLayout->PartitionCount; i++) {
 			isUefiNtfs = FALSE;
@@ -1944,7 +2125,6 @@ BOOL GetDrivePartitionData(DWORD DriveIndex, char* FileSystemName, DWORD FileSys
 #if defined(__GNUC__)
 #pragma GCC diagnostic warning "-Warray-bounds"
 #endif
-	safe_closehandle(hPhysical);
 
 	return ret;
 }
@@ -1965,7 +2145,7 @@ static BOOL FlushDrive(char drive_letter)
 		uprintf("Failed to open %c: for flushing: %s", toupper(drive_letter), WindowsErrorString());
 		goto out;
 	}
-	r = FlushFileBuffers(hDrive);
+	r = WriteBarrier(hDrive, WB_FINAL);
 	if (r == FALSE)
 		uprintf("Failed to flush %c: %s", toupper(drive_letter), WindowsErrorString());
 
@@ -1974,6 +2154,23 @@ out:
 	return r;
 }
 
+/*
+ * Lock a volume, without dismounting it, so that its boot records can be
+ * patched in place. As opposed to an FSCTL_DISMOUNT_VOLUME + remount cycle,
+ * releasing this lock (FSCTL_UNLOCK_VOLUME) leaves the mounted file system
+ * valid, so the volume remains available for file access right away.
+ */
+BOOL LockVolume(HANDLE hDrive)
+{
+	DWORD size;
+
+	if (!DeviceIoControl(hDrive, FSCTL_LOCK_VOLUME, NULL, 0, NULL, 0, &size, NULL)) {
+		uprintf("Could not lock volume: %s", WindowsErrorString());
+		return FALSE;
+	}
+	return TRUE;
+}
+
 /*
  * Unmount of volume using the DISMOUNT_VOLUME ioctl
  */
@@ -2020,6 +2217,7 @@ BOOL MountVolume(char* drive_name, char *volume_name)
 			return FALSE;
 		}
 		uprintf("%s was successfully mounted as %c:", volume_name, toupper(drive_name[0]));
+		InvalidateDriveLettersSnapshot();
 		return TRUE;
 	}
 
@@ -2039,6 +2237,8 @@ BOOL MountVolume(char* drive_name, char *volume_name)
 	}
 #endif
 
+	// Whether the calls below succeed or not, the mappings may have been altered
+	InvalidateDriveLettersSnapshot();
 	if (!SetVolumeMountPointA(drive_name, volume_name)) {
 		if (GetLastError() == ERROR_DIR_NOT_EMPTY) {
 			if (!GetVolumeNameForVolumeMountPointA(drive_name, mounted_guid, sizeof(mounted_guid))) {
@@ -2098,6 +2298,7 @@ char* AltMountVolume(DWORD DriveIndex, uint64_t PartitionOffset, BOOL bSilent)
 		suprintf("Mount operation failed: %s", WindowsErrorString());
 		goto out;
 	}
+	InvalidateDriveLettersSnapshot();
 	ret = mounted_drive;
 
 out:
@@ -2117,6 +2318,7 @@ BOOL AltUnmountVolume(const char* drive_name, BOOL bSilent)
 		return FALSE;
 	}
 	suprintf("Successfully unmounted '%s'", drive_name);
+	InvalidateDriveLettersSnapshot();
 	return TRUE;
 }
 
@@ -2144,27 +2346,30 @@ BOOL RemountVolume(char* drive_name, BOOL bSilent)
 }
 
 /*
- * Zero the first 'size' bytes of a partition. This is needed because we haven't found a way to
- * properly reset Windows's cached view of a drive partitioning short of cycling the USB port
- * (especially IOCTL_DISK_UPDATE_PROPERTIES is *USELESS*), and therefore the OS will try to
- * read the file system data at an old location, even if the partition has just been deleted.
+ * Zero the first 'size' bytes of the partitions staged in batch[]. This is needed because
+ * we haven't found a way to properly reset Windows's cached view of a drive partitioning
+ * short of cycling the USB port (especially IOCTL_DISK_UPDATE_PROPERTIES is *USELESS*),
+ * and therefore the OS will try to read the file system data at an old location, even if
+ * the partition has just been deleted.
+ * All the staged partitions are cleared through a single batch submission, rather than
+ * one buffer allocation and one positioned write per partition.
  */
-static BOOL ClearPartition(HANDLE hDrive, LARGE_INTEGER offset, DWORD size)
+static BOOL ClearPartitions(HANDLE hDrive, batch_write_desc* batch, DWORD num, DWORD size)
 {
-	BOOL r = FALSE;
-	uint8_t* buffer = calloc(size, 1);
-
-	if (buffer == NULL)
-		return FALSE;
+	size_t zero_size = 0;
+	const uint8_t* pZeroBuf;
+	DWORD i;
 
-	if (!SetFilePointerEx(hDrive, offset, NULL, FILE_BEGIN)) {
-		free(buffer);
+	if (num == 0)
+		return TRUE;
+	pZeroBuf = GetZeroBuffer(&zero_size);
+	if ((pZeroBuf == NULL) || (zero_size < (size_t)size))
 		return FALSE;
+	for (i = 0; i < num; i++) {
+		batch[i].pBuffer = pZeroBuf;
+		batch[i].Length = size;
 	}
-
-	r = WriteFileWithRetry(hDrive, buffer, size, &size, WRITE_RETRIES);
-	free(buffer);
-	return r;
+	return WriteFileBatchWithRetry(hDrive, batch, num, WRITE_RETRIES);
 }
 
 /*
@@ -2186,8 +2391,9 @@ BOOL CreatePartition(HANDLE hDrive, int partition_style, int file_system, BOOL m
 	CREATE_DISK CreateDisk = {PARTITION_STYLE_RAW, {{0}}};
 	DRIVE_LAYOUT_INFORMATION_EX4 DriveLayoutEx = {0};
 	BOOL r;
-	DWORD i, size, bufsize, pn = 0;
+	DWORD i, size, bufsize, pn = 0, nb_clear = 0;
 	LONGLONG main_part_size_in_sectors, extra_part_size_in_tracks = 0;
+	batch_write_desc clear_batch[3] = { 0 };
 	// Go for a 260 MB sized ESP by default to keep everyone happy, including 4K sector users:
 	// https://docs.microsoft.com/en-us/windows-hardware/manufacture/desktop/configure-uefigpt-based-hard-drive-partitions
 	// and folks using MacOS: https://github.com/pbatard/rufus/issues/979
@@ -2244,9 +2450,8 @@ BOOL CreatePartition(HANDLE hDrive, int partition_style, int file_system, BOOL m
 			SizeToHumanReadable(DriveLayoutEx.PartitionEntry[pn].PartitionLength.QuadPart, TRUE, FALSE));
 		IGNORE_RETVAL(CoCreateGuid(&DriveLayoutEx.PartitionEntry[pn].Gpt.PartitionId));
 		wcsncpy(DriveLayoutEx.PartitionEntry[pn].Gpt.Name, extra_part_name, ARRAYSIZE(DriveLayoutEx.PartitionEntry[pn].Gpt.Name));
-		// Zero the first sectors from this partition to avoid file system caching issues
-		if (!ClearPartition(hDrive, DriveLayoutEx.PartitionEntry[pn].StartingOffset, size_to_clear))
-			uprintf("Could not zero %S: %s", extra_part_name, WindowsErrorString());
+		// Stage the first sectors of this partition for zeroing, to avoid file system caching issues
+		clear_batch[nb_clear++].Offset = DriveLayoutEx.PartitionEntry[pn].StartingOffset.QuadPart;
 		SelectedDrive.PartitionOffset[pn] = DriveLayoutEx.PartitionEntry[pn].StartingOffset.QuadPart;
 		SelectedDrive.PartitionSize[pn] = DriveLayoutEx.PartitionEntry[pn].PartitionLength.QuadPart;
 		partition_offset[PI_ESP] = SelectedDrive.PartitionOffset[pn];
@@ -2267,9 +2472,8 @@ BOOL CreatePartition(HANDLE hDrive, int partition_style, int file_system, BOOL m
 			SizeToHumanReadable(DriveLayoutEx.PartitionEntry[pn].PartitionLength.QuadPart, TRUE, FALSE));
 		IGNORE_RETVAL(CoCreateGuid(&DriveLayoutEx.PartitionEntry[pn].Gpt.PartitionId));
 		wcsncpy(DriveLayoutEx.PartitionEntry[pn].Gpt.Name, extra_part_name, ARRAYSIZE(DriveLayoutEx.PartitionEntry[pn].Gpt.Name));
-		// Zero the first sectors from this partition to avoid file system caching issues
-		if (!ClearPartition(hDrive, DriveLayoutEx.PartitionEntry[pn].StartingOffset, size_to_clear))
-			uprintf("Could not zero %S: %s", extra_part_name, WindowsErrorString());
+		// Stage the first sectors of this partition for zeroing, to avoid file system caching issues
+		clear_batch[nb_clear++].Offset = DriveLayoutEx.PartitionEntry[pn].StartingOffset.QuadPart;
 		SelectedDrive.PartitionOffset[pn] = DriveLayoutEx.PartitionEntry[pn].StartingOffset.QuadPart;
 		SelectedDrive.PartitionSize[pn] = DriveLayoutEx.PartitionEntry[pn].PartitionLength.QuadPart;
 		pn++;
@@ -2319,9 +2523,8 @@ BOOL CreatePartition(HANDLE hDrive, int partition_style, int file_system, BOOL m
 	}
 	uprintf("● Creating %S (offset: %lld, size: %s)", main_part_name, DriveLayoutEx.PartitionEntry[pn].StartingOffset.QuadPart,
 		SizeToHumanReadable(main_part_size_in_sectors * SelectedDrive.SectorSize, TRUE, FALSE));
-	// Zero the beginning of this partition to avoid conflicting leftovers
-	if (!ClearPartition(hDrive, DriveLayoutEx.PartitionEntry[pn].StartingOffset, size_to_clear))
-		uprintf("Could not zero %S: %s", main_part_name, WindowsErrorString());
+	// Stage the beginning of this partition for zeroing, to avoid conflicting leftovers
+	clear_batch[nb_clear++].Offset = DriveLayoutEx.PartitionEntry[pn].StartingOffset.QuadPart;
 
 	DriveLayoutEx.PartitionEntry[pn].PartitionLength.QuadPart = main_part_size_in_sectors * SelectedDrive.SectorSize;
 	if (partition_style == PARTITION_STYLE_MBR) {
@@ -2421,6 +2624,10 @@ BOOL CreatePartition(HANDLE hDrive, int partition_style, int file_system, BOOL m
 		pn++;
 	}
 
+	// Issue the deferred zeroing of the partition starts as a single batch of writes
+	if (!ClearPartitions(hDrive, clear_batch, nb_clear, size_to_clear))
+		uprintf("Could not zero partitions: %s", WindowsErrorString());
+
 	// Initialize the remaining partition data
 	for (i = 0; i < pn; i++) {
 		DriveLayoutEx.PartitionEntry[i].PartitionNumber = i + 1;
@@ -2499,6 +2706,130 @@ BOOL RefreshDriveLayout(HANDLE hDrive)
 	return r;
 }
 
+/* Layout of the 32-bit value under which the capabilities are cached in the
+ * settings: flags in the low byte, adapter max transfer length (in KB) above */
+#define DRIVE_CAPS_PROBED		0x01
+#define DRIVE_CAPS_TRIM			0x02
+#define DRIVE_CAPS_SEEK_PENALTY	0x04
+
+// Derive the settings key under which the capabilities of the currently selected
+// device are cached. Same derivation as format.c's FormatHistoryKey(): the Device
+// Instance ID (which, for USB devices, carries the VID:PID, firmware revision and
+// serial) is hashed with the sdbm algorithm.
+static char* DriveCapsKey(void)
+{
+	static char key[32];
+	uint32_t r = 0;
+	int c, index = ComboBox_GetCurSel(hDeviceList);
+	char* sz;
+
+	if ((index < 0) || (index >= (int)DriveId.Index) || (safe_strlen(DriveId.String[index]) < 8))
+		return NULL;
+	for (sz = DriveId.String[index]; (c = *sz++) != 0; )
+		r = c + (r << 6) + (r << 16) - r;
+	static_sprintf(key, "%s%08X", SETTING_DEVICE_CAPS_PREFIX, r);
+	return key;
+}
+
+/*
+ * Probe the optional I/O capabilities of the currently selected device, which the
+ * write operations use to gate features (TRIM, large transfers) on what the device
+ * actually reports, instead of finding out through failed requests. Because
+ * IOCTL_STORAGE_QUERY_PROPERTY can be slow, or outright misbehave, on cheap
+ * bridges, a device is only probed the first time it is seen, and the results are
+ * persisted in the settings.
+ */
+BOOL GetDriveCapabilities(HANDLE hPhysical)
+{
+	DWORD size;
+	uint32_t packed;
+	char* key = DriveCapsKey();
+	STORAGE_PROPERTY_QUERY query = { 0 };
+	DEVICE_TRIM_DESCRIPTOR trim_desc = { 0 };
+	DEVICE_SEEK_PENALTY_DESCRIPTOR seek_desc = { 0 };
+	STORAGE_ADAPTER_DESCRIPTOR adapter_desc = { 0 };
+
+	memset(&SelectedDriveCaps, 0, sizeof(SelectedDriveCaps));
+	if (key != NULL) {
+		packed = (uint32_t)ReadSetting32(key);
+		if (packed & DRIVE_CAPS_PROBED) {
+			SelectedDriveCaps.trim = (packed & DRIVE_CAPS_TRIM) ? TRUE : FALSE;
+			SelectedDriveCaps.seek_penalty = (packed & DRIVE_CAPS_SEEK_PENALTY) ? TRUE : FALSE;
+			SelectedDriveCaps.max_transfer_size = (DWORD)((packed >> 8) * KB);
+			SelectedDriveCaps.valid = TRUE;
+			uuprintf("Using cached device capabilities ('%s')", key);
+			return TRUE;
+		}
+	}
+
+	if ((hPhysical == INVALID_HANDLE_VALUE) || (hPhysical == NULL))
+		return FALSE;
+	query.QueryType = PropertyStandardQuery;
+	query.PropertyId = StorageDeviceTrimProperty;
+	if (DeviceIoControl(hPhysical, IOCTL_STORAGE_QUERY_PROPERTY, &query, sizeof(query),
+		&trim_desc, sizeof(trim_desc), &size, NULL))
+		SelectedDriveCaps.trim = trim_desc.TrimEnabled;
+	query.PropertyId = StorageDeviceSeekPenaltyProperty;
+	if (DeviceIoControl(hPhysical, IOCTL_STORAGE_QUERY_PROPERTY, &query, sizeof(query),
+		&seek_desc, sizeof(seek_desc), &size, NULL))
+		SelectedDriveCaps.seek_penalty = seek_desc.IncursSeekPenalty;
+	query.PropertyId = StorageAdapterProperty;
+	if (DeviceIoControl(hPhysical, IOCTL_STORAGE_QUERY_PROPERTY, &query, sizeof(query),
+		&adapter_desc, sizeof(adapter_desc), &size, NULL))
+		SelectedDriveCaps.max_transfer_size = adapter_desc.MaximumTransferLength;
+	SelectedDriveCaps.valid = TRUE;
+	uprintf("Device capabilities: TRIM: %s, Seek penalty: %s, Max transfer size: %s",
+		SelectedDriveCaps.trim ? "Yes" : "No", SelectedDriveCaps.seek_penalty ? "Yes" : "No",
+		(SelectedDriveCaps.max_transfer_size != 0) ?
+		SizeToHumanReadable(SelectedDriveCaps.max_transfer_size, FALSE, FALSE) : "Unknown");
+	if (key != NULL) {
+		packed = DRIVE_CAPS_PROBED;
+		if (SelectedDriveCaps.trim)
+			packed |= DRIVE_CAPS_TRIM;
+		if (SelectedDriveCaps.seek_penalty)
+			packed |= DRIVE_CAPS_SEEK_PENALTY;
+		packed |= (uint32_t)min(SelectedDriveCaps.max_transfer_size / KB, 0xFFFFFF) << 8;
+		WriteSetting32(key, (int32_t)packed);
+	}
+	return TRUE;
+}
+
+/*
+ * Issue a TRIM/UNMAP request for a range of the physical drive, so that flash
+ * devices can invalidate the mapped blocks without us having to write zeroes.
+ * Note that, unless the device reports Read Zero After Trim, there is no
+ * guarantee that trimmed blocks will read back as zeroes.
+ */
+BOOL TrimDriveRange(HANDLE hPhysical, uint64_t offset, uint64_t length)
+{
+	BOOL r;
+	DWORD size;
+	struct dsm_buffer {
+		DEVICE_MANAGE_DATA_SET_ATTRIBUTES attr;
+		DEVICE_DATA_SET_RANGE range;
+	} dsm = { {0}, {0} };
+
+	// If the capability probe established that the device doesn't do TRIM, don't
+	// aggravate a possibly flaky bridge with requests that cannot succeed
+	if (SelectedDriveCaps.valid && !SelectedDriveCaps.trim) {
+		uuprintf("Skipping TRIM request (not supported by this device)");
+		return FALSE;
+	}
+
+	dsm.attr.Size = sizeof(DEVICE_MANAGE_DATA_SET_ATTRIBUTES);
+	dsm.attr.Action = DeviceDsmAction_Trim;
+	dsm.attr.DataSetRangesOffset = FIELD_OFFSET(struct dsm_buffer, range);
+	dsm.attr.DataSetRangesLength = sizeof(DEVICE_DATA_SET_RANGE);
+	dsm.range.StartingOffset = (LONGLONG)offset;
+	dsm.range.LengthInBytes = (ULONGLONG)length;
+
+	r = DeviceIoControl(hPhysical, IOCTL_STORAGE_MANAGE_DATA_SET_ATTRIBUTES,
+		&dsm, sizeof(dsm), NULL, 0, &size, NULL);
+	if (!r)
+		uprintf("Could not TRIM drive range: %s", WindowsErrorString());
+	return r;
+}
+
 /* Initialize disk for partitioning */
 BOOL InitializeDisk(HANDLE hDrive)
 {
@@ -31,6 +31,12 @@
 	CTL_CODE(MOUNTMGRCONTROLTYPE, 15, METHOD_BUFFERED, FILE_ANY_ACCESS)
 #define IOCTL_MOUNTMGR_SET_AUTO_MOUNT       \
 	CTL_CODE(MOUNTMGRCONTROLTYPE, 16, METHOD_BUFFERED, FILE_READ_ACCESS | FILE_WRITE_ACCESS)
+#define IOCTL_MOUNTMGR_CHANGE_NOTIFY        \
+	CTL_CODE(MOUNTMGRCONTROLTYPE, 8, METHOD_BUFFERED, FILE_READ_ACCESS)
+
+typedef struct _MOUNTMGR_CHANGE_NOTIFY_INFO {
+	ULONG EpicNumber;
+} MOUNTMGR_CHANGE_NOTIFY_INFO, *PMOUNTMGR_CHANGE_NOTIFY_INFO;
 
 #define XP_MSR                              0x01
 #define XP_ESP                              0x02
@@ -371,14 +377,26 @@ typedef struct {
 extern RUFUS_DRIVE_INFO SelectedDrive;
 extern uint64_t partition_offset[PI_MAX];
 
+/* Probed I/O capabilities of the current drive, see GetDriveCapabilities() */
+typedef struct {
+	BOOL valid;				// capability data is usable (probed, or read back from the cache)
+	BOOL trim;				// device honours DSM TRIM requests
+	BOOL seek_penalty;		// device reports a seek penalty (rotational media)
+	DWORD max_transfer_size;	// adapter's maximum transfer length, in bytes (0 = unknown)
+} RUFUS_DRIVE_CAPS;
+extern RUFUS_DRIVE_CAPS SelectedDriveCaps;
+
 BOOL SetAutoMount(BOOL enable);
 BOOL GetAutoMount(BOOL* enabled);
 char* GetPhysicalName(DWORD DriveIndex);
 BOOL DeletePartition(DWORD DriveIndex, ULONGLONG PartitionOffset, BOOL bSilent);
+IVdsService* GetVdsService(BOOL bSilent);
+void VdsReleaseService(void);
 BOOL IsVdsAvailable(BOOL bSilent);
 BOOL ListVdsVolumes(BOOL bSilent);
 BOOL VdsRescan(DWORD dwRescanType, DWORD dwSleepTime, BOOL bSilent);
 HANDLE GetPhysicalHandle(DWORD DriveIndex, BOOL bLockDrive, BOOL bWriteAccess, BOOL bWriteShare);
+void CloseDriveSession(void);
 char* GetLogicalName(DWORD DriveIndex, uint64_t PartitionOffset, BOOL bKeepTrailingBackslash, BOOL bSilent);
 char* AltGetLogicalName(DWORD DriveIndex, uint64_t PartitionOffset, BOOL bKeepTrailingBackslash, BOOL bSilent);
 char* GetExtPartitionName(DWORD DriveIndex, uint64_t PartitionOffset);
@@ -388,6 +406,7 @@ HANDLE AltGetLogicalHandle(DWORD DriveIndex, uint64_t PartitionOffset, BOOL bLoc
 int GetDriveNumber(HANDLE hDrive, char* path);
 BOOL GetDriveLetters(DWORD DriveIndex, char* drive_letters);
 UINT GetDriveTypeFromIndex(DWORD DriveIndex);
+void InvalidateDriveLettersSnapshot(void);
 char GetUnusedDriveLetter(void);
 BOOL IsDriveLetterInUse(const char drive_letter);
 char RemoveDriveLetters(DWORD DriveIndex, BOOL bUseLast, BOOL bSilent);
@@ -397,6 +416,7 @@ BOOL IsMediaPresent(DWORD DriveIndex);
 BOOL AnalyzeMBR(HANDLE hPhysicalDrive, const char* TargetName, BOOL bSilent);
 BOOL AnalyzePBR(HANDLE hLogicalVolume);
 BOOL GetDrivePartitionData(DWORD DriveIndex, char* FileSystemName, DWORD FileSystemNameSize, BOOL bSilent);
+BOOL LockVolume(HANDLE hDrive);
 BOOL UnmountVolume(HANDLE hDrive);
 BOOL MountVolume(char* drive_name, char *drive_guid);
 BOOL AltUnmountVolume(const char* drive_name, BOOL bSilent);
@@ -405,6 +425,8 @@ BOOL RemountVolume(char* drive_name, BOOL bSilent);
 BOOL CreatePartition(HANDLE hDrive, int partition_style, int file_system, BOOL mbr_uefi_marker, uint8_t extra_partitions);
 BOOL InitializeDisk(HANDLE hDrive);
 BOOL RefreshDriveLayout(HANDLE hDrive);
+BOOL GetDriveCapabilities(HANDLE hPhysical);
+BOOL TrimDriveRange(HANDLE hPhysical, uint64_t offset, uint64_t length);
 const char* GetMBRPartitionType(const uint8_t type);
 const char* GetGPTPartitionType(const GUID* guid);
 const char* GetExtFsLabel(DWORD DriveIndex, uint64_t PartitionOffset);
@@ -414,3 +436,4 @@ int CycleDevice(int index);
 BOOL RefreshLayout(DWORD DriveIndex);
 BOOL GetOpticalMedia(IMG_SAVE* img_save);
 BOOL ToggleEsp(DWORD DriveIndex, uint64_t PartitionOffset);
+BOOL ResizePersistencePartition(DWORD DriveIndex, uint64_t PartitionOffset, uint64_t NewSize);
@@ -190,22 +190,56 @@ static void ba_mark_bmap_extent(ext2fs_generic_bitmap_64 bitmap, __u64 arg,
 				unsigned int num)
 {
 	ext2fs_ba_private bp = (ext2fs_ba_private) bitmap->private;
-	blk64_t bitno = (blk64_t) arg;
-	unsigned int i;
-
-	for (i = 0; i < num; i++)
-		ext2fs_fast_set_bit64(bitno + i - bitmap->start, bp->bitarray);
+	blk64_t bitno = (blk64_t) arg - bitmap->start;
+	unsigned char *addr = (unsigned char *) bp->bitarray;
+	unsigned int bits;
+
+	/* Set bits up to the next byte boundary */
+	if (bitno & 7) {
+		bits = 8 - (unsigned int)(bitno & 7);
+		if (bits > num)
+			bits = num;
+		addr[bitno >> 3] |= (unsigned char)(((1 << bits) - 1) << (bitno & 7));
+		bitno += bits;
+		num -= bits;
+	}
+	/* Set whole bytes at once */
+	if (num >= 8) {
+		memset(addr + (bitno >> 3), 0xff, num >> 3);
+		bitno += num & ~7U;
+		num &= 7;
+	}
+	/* Set the trailing bits */
+	if (num)
+		addr[bitno >> 3] |= (unsigned char)((1 << num) - 1);
 }
 
 static void ba_unmark_bmap_extent(ext2fs_generic_bitmap_64 bitmap, __u64 arg,
 				  unsigned int num)
 {
 	ext2fs_ba_private bp = (ext2fs_ba_private) bitmap->private;
-	blk64_t bitno = (blk64_t) arg;
-	unsigned int i;
-
-	for (i = 0; i < num; i++)
-		ext2fs_fast_clear_bit64(bitno + i - bitmap->start, bp->bitarray);
+	blk64_t bitno = (blk64_t) arg - bitmap->start;
+	unsigned char *addr = (unsigned char *) bp->bitarray;
+	unsigned int bits;
+
+	/* Clear bits up to the next byte boundary */
+	if (bitno & 7) {
+		bits = 8 - (unsigned int)(bitno & 7);
+		if (bits > num)
+			bits = num;
+		addr[bitno >> 3] &= (unsigned char)~(((1 << bits) - 1) << (bitno & 7));
+		bitno += bits;
+		num -= bits;
+	}
+	/* Clear whole bytes at once */
+	if (num >= 8) {
+		memset(addr + (bitno >> 3), 0, num >> 3);
+		bitno += num & ~7U;
+		num &= 7;
+	}
+	/* Clear the trailing bits */
+	if (num)
+		addr[bitno >> 3] &= (unsigned char)~((1 << num) - 1);
 }
 
 static int ba_test_clear_bmap_extent(ext2fs_generic_bitmap_64 bitmap,
@@ -471,6 +505,46 @@ static errcode_t ba_find_first_set(ext2fs_generic_bitmap_64 bitmap,
 	return ENOENT;
 }
 
+/* Count the set bits in [start, start + num), bulk counting whole bytes */
+static errcode_t ba_count_bmap_extent(ext2fs_generic_bitmap_64 bitmap,
+				      __u64 start, __u64 num, __u64 *out)
+{
+	ext2fs_ba_private bp = (ext2fs_ba_private) bitmap->private;
+	const unsigned char *addr = (const unsigned char *) bp->bitarray;
+	__u64 bitpos = start - bitmap->start;
+	__u64 count = 0, nbytes;
+
+	/* count bits until we hit a byte boundary */
+	while ((bitpos & 0x7) != 0 && num > 0) {
+		if (ext2fs_test_bit64(bitpos, bp->bitarray))
+			count++;
+		bitpos++;
+		num--;
+	}
+
+	/* count whole bytes, in chunks ext2fs_bitcount() can take */
+	nbytes = num >> 3;
+	while (nbytes) {
+		unsigned int n = (nbytes > (1U << 30)) ? (1U << 30) :
+				 (unsigned int) nbytes;
+
+		count += ext2fs_bitcount(addr + (bitpos >> 3), n);
+		bitpos += (__u64) n << 3;
+		nbytes -= n;
+	}
+	num &= 7;
+
+	/* count the trailing bits */
+	while (num-- > 0) {
+		if (ext2fs_test_bit64(bitpos, bp->bitarray))
+			count++;
+		bitpos++;
+	}
+
+	*out = count;
+	return 0;
+}
+
 struct ext2_bitmap_ops ext2fs_blkmap64_bitarray = {
 	.type = EXT2FS_BMAP64_BITARRAY,
 	.new_bmap = ba_new_bmap,
@@ -488,5 +562,6 @@ struct ext2_bitmap_ops ext2fs_blkmap64_bitarray = {
 	.clear_bmap = ba_clear_bmap,
 	.print_stats = ba_print_stats,
 	.find_first_zero = ba_find_first_zero,
-	.find_first_set = ba_find_first_set
+	.find_first_set = ba_find_first_set,
+	.count_bmap_extent = ba_count_bmap_extent
 };
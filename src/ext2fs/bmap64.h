@@ -100,6 +100,10 @@ struct ext2_bitmap_ops {
 	 * May be NULL, in which case a generic function is used. */
 	errcode_t (*find_first_set)(ext2fs_generic_bitmap_64 bitmap,
 				    __u64 start, __u64 end, __u64 *out);
+	/* Count the set bits in [start, start + num).
+	 * May be NULL, in which case a generic function is used. */
+	errcode_t (*count_bmap_extent)(ext2fs_generic_bitmap_64 bitmap,
+				       __u64 start, __u64 num, __u64 *out);
 };
 
 extern struct ext2_bitmap_ops ext2fs_blkmap64_bitarray;
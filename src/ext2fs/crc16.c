@@ -49,6 +49,30 @@ static __u16 const crc16_table[256] = {
 	0x8201, 0x42C0, 0x4380, 0x8341, 0x4100, 0x81C1, 0x8081, 0x4040
 };
 
+/*
+ * Slicing-by-8 extension of the table above: crc16_slice[k][i] is the CRC-16
+ * of byte i followed by k zero bytes, which lets the main loop fold 8 input
+ * bytes per iteration with independent table lookups instead of a serial
+ * byte-at-a-time dependency chain. The extension tables are derived from
+ * crc16_table[] on first use, the same way a generator tool would produce
+ * them (t[k][i] = (t[k-1][i] >> 8) ^ t[0][t[k-1][i] & 0xff]).
+ */
+static __u16 crc16_slice[8][256];
+static int crc16_slice_ready;
+
+static void crc16_slice_init(void)
+{
+	unsigned int i, k;
+
+	for (i = 0; i < 256; i++)
+		crc16_slice[0][i] = crc16_table[i];
+	for (k = 1; k < 8; k++)
+		for (i = 0; i < 256; i++)
+			crc16_slice[k][i] = (crc16_slice[k - 1][i] >> 8) ^
+				crc16_slice[0][crc16_slice[k - 1][i] & 0xffU];
+	crc16_slice_ready = 1;
+}
+
 /**
  * Compute the CRC-16 for the data buffer
  *
@@ -61,13 +85,29 @@ crc16_t ext2fs_crc16(crc16_t crc, const void *buffer, unsigned int len)
 {
 	const unsigned char *cp = buffer;
 
+	if (!crc16_slice_ready)
+		crc16_slice_init();
+
+	/*
+	 * for an unknown reason, PPC treats __u16 as signed
+	 * and keeps doing sign extension on the value.
+	 * Instead, use only the low 16 bits of an unsigned
+	 * int for holding the CRC value to avoid this.
+	 */
+	while (len >= 8) {
+		crc ^= cp[0] | (cp[1] << 8);
+		crc = (crc16_slice[7][crc & 0xffU] ^
+		       crc16_slice[6][(crc >> 8) & 0xffU] ^
+		       crc16_slice[5][cp[2]] ^
+		       crc16_slice[4][cp[3]] ^
+		       crc16_slice[3][cp[4]] ^
+		       crc16_slice[2][cp[5]] ^
+		       crc16_slice[1][cp[6]] ^
+		       crc16_slice[0][cp[7]]) & 0x0000ffffU;
+		cp += 8;
+		len -= 8;
+	}
 	while (len--)
-		/*
-		 * for an unknown reason, PPC treats __u16 as signed
-		 * and keeps doing sign extension on the value.
-		 * Instead, use only the low 16 bits of an unsigned
-		 * int for holding the CRC value to avoid this.
-		 */
 		crc = (((crc >> 8) & 0xffU) ^
 		       crc16_table[(crc ^ *cp++) & 0xffU]) & 0x0000ffffU;
 	return crc;
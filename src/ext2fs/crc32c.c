@@ -185,8 +185,77 @@ static inline uint32_t crc32_le_generic(uint32_t crc, unsigned char const *p,
 	return crc;
 }
 
+/*
+ * The SSE 4.2 crc32 instruction computes CRC32C (Castagnoli), which is
+ * exactly what ext2fs_crc32c_le() needs, so use it when available and
+ * fall back to the table based version otherwise.
+ */
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define CRC32C_HAS_SSE42_SUPPORT 1
+#include <nmmintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define CRC32C_TARGET_SSE42
+#else
+#include <cpuid.h>
+#define CRC32C_TARGET_SSE42 __attribute__((target("sse4.2")))
+#endif
+
+static int crc32c_has_sse42(void)
+{
+	static int ret = -1;
+	uint32_t ecx = 0;
+
+	if (ret < 0) {
+#if defined(_MSC_VER)
+		int regs[4];
+		__cpuid(regs, 1);
+		ecx = (uint32_t)regs[2];
+#else
+		uint32_t eax = 0, ebx = 0, edx = 0;
+		__get_cpuid(1, &eax, &ebx, &ecx, &edx);
+#endif
+		ret = (ecx & (1 << 20)) ? 1 : 0;	/* CPUID.01H:ECX.SSE4_2 */
+	}
+	return ret;
+}
+
+CRC32C_TARGET_SSE42
+static uint32_t crc32c_le_hw(uint32_t crc, unsigned char const *p, size_t len)
+{
+#if defined(__x86_64__) || defined(_M_X64)
+	while (((uintptr_t)p & 7) && len) {
+		crc = _mm_crc32_u8(crc, *p++);
+		len--;
+	}
+	while (len >= 8) {
+		crc = (uint32_t)_mm_crc32_u64(crc, *(const uint64_t *)p);
+		p += 8;
+		len -= 8;
+	}
+#else
+	while (((uintptr_t)p & 3) && len) {
+		crc = _mm_crc32_u8(crc, *p++);
+		len--;
+	}
+	while (len >= 4) {
+		crc = _mm_crc32_u32(crc, *(const uint32_t *)p);
+		p += 4;
+		len -= 4;
+	}
+#endif
+	while (len--)
+		crc = _mm_crc32_u8(crc, *p++);
+	return crc;
+}
+#endif /* x86 */
+
 uint32_t ext2fs_crc32c_le(uint32_t crc, unsigned char const *p, size_t len)
 {
+#ifdef CRC32C_HAS_SSE42_SUPPORT
+	if (crc32c_has_sse42())
+		return crc32c_le_hw(crc, p, len);
+#endif
 	return crc32_le_generic(crc, p, len, crc32ctable_le, CRC32C_POLY_LE);
 }
 
@@ -1196,6 +1196,19 @@ extern errcode_t ext2fs_dirhash2(int version, const char *name, int len,
 				 ext2_dirhash_t *ret_hash,
 				 ext2_dirhash_t *ret_minor_hash);
 
+struct ext2fs_dirhash_in {
+	const char	*name;
+	int		len;
+	ext2_dirhash_t	hash;
+	ext2_dirhash_t	minor_hash;
+};
+
+extern errcode_t ext2fs_dirhash2_batch(int version,
+				       struct ext2fs_dirhash_in *names,
+				       int count,
+				       const struct ext2fs_nls_table *charset,
+				       int hash_flags, const __u32 *seed);
+
 /* dir_iterate.c */
 extern errcode_t ext2fs_get_rec_len(ext2_filsys fs,
 				    struct ext2_dir_entry *dirent,
@@ -944,10 +944,24 @@ errcode_t ext2fs_find_first_set_generic_bmap(ext2fs_generic_bitmap bitmap,
 errcode_t ext2fs_count_used_clusters(ext2_filsys fs, blk64_t start,
 				     blk64_t end, blk64_t *out)
 {
+	ext2fs_generic_bitmap_64 bmap64 =
+		(ext2fs_generic_bitmap_64) fs->block_map;
 	blk64_t		next;
 	blk64_t		tot_set = 0;
 	errcode_t	retval = 0;
 
+	/* Backends that can popcount a range make this a single bulk pass
+	 * instead of alternating find_first_set/find_first_zero scans */
+	if (bmap64 && EXT2FS_IS_64_BITMAP(bmap64) && !bmap64->cluster_bits &&
+	    bmap64->bitmap_ops->count_bmap_extent &&
+	    start >= bmap64->start && end <= bmap64->end && start <= end) {
+		retval = bmap64->bitmap_ops->count_bmap_extent(bmap64, start,
+						end - start + 1, &tot_set);
+		if (!retval)
+			*out = EXT2FS_NUM_B2C(fs, tot_set);
+		return retval;
+	}
+
 	while (start < end) {
 		retval = ext2fs_find_first_set_block_bitmap2(fs->block_map,
 							start, end, &next);
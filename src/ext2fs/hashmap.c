@@ -1,20 +1,28 @@
 #include "hashmap.h"
 #include <string.h>
 
+/*
+ * Open addressing hashmap with robin hood probing.  Entries are stored
+ * inline in a single contiguous, power-of-two sized array, so lookups
+ * walk adjacent cache lines instead of chasing per-node heap pointers,
+ * and adding an entry allocates nothing (the table is grown in bulk
+ * when it reaches 7/8 occupancy).  An empty slot has key == NULL.
+ *
+ * Insertion order is recorded on the side so that
+ * ext2fs_hashmap_iter_in_order() keeps returning entries in the order
+ * they were added, independently of where probing places them.
+ */
+
 struct ext2fs_hashmap {
-	uint32_t size;
+	uint32_t size;		/* bucket count, always a power of two */
+	uint32_t count;
+	uint32_t limit;		/* grow when count reaches this */
 	uint32_t(*hash)(const void *key, size_t len);
 	void(*free)(void*);
-	struct ext2fs_hashmap_entry *first;
-	struct ext2fs_hashmap_entry *last;
-#if __GNUC_PREREQ (4, 8)
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Wpedantic"
-#endif
-	struct ext2fs_hashmap_entry *entries[0];
-#if __GNUC_PREREQ (4, 8)
-#pragma GCC diagnostic pop
-#endif
+	struct ext2fs_hashmap_entry *entries;
+	void **order;		/* data pointers, in insertion order */
+	uint32_t order_len;
+	uint32_t order_cap;
 };
 
 uint32_t ext2fs_djb2_hash(const void *str, size_t size)
@@ -30,76 +38,145 @@ uint32_t ext2fs_djb2_hash(const void *str, size_t size)
 	return hash;
 }
 
+static uint32_t hashmap_round_size(size_t size)
+{
+	uint32_t rounded = 16;
+
+	while (rounded < size)
+		rounded <<= 1;
+	return rounded;
+}
+
 struct ext2fs_hashmap *ext2fs_hashmap_create(
 				uint32_t(*hash_fct)(const void*, size_t),
 				void(*free_fct)(void*), size_t size)
 {
-	struct ext2fs_hashmap *h = calloc(sizeof(struct ext2fs_hashmap) +
-				sizeof(struct ext2fs_hashmap_entry) * size, 1);
+	struct ext2fs_hashmap *h = calloc(sizeof(struct ext2fs_hashmap), 1);
+
 	if (!h)
 		return h;
-	h->size = size;
+	h->size = hashmap_round_size(size);
+	h->limit = h->size - h->size / 8;
 	h->free = free_fct;
 	h->hash = hash_fct;
-	h->first = h->last = NULL;
+	h->entries = calloc(h->size, sizeof(struct ext2fs_hashmap_entry));
+	if (!h->entries) {
+		free(h);
+		return NULL;
+	}
 	return h;
 }
 
+/* Place an entry, displacing "richer" entries as we go (robin hood) */
+static void hashmap_place(struct ext2fs_hashmap_entry *entries, uint32_t size,
+			  struct ext2fs_hashmap_entry *e)
+{
+	uint32_t mask = size - 1;
+	uint32_t i = e->hash & mask;
+	struct ext2fs_hashmap_entry tmp;
+
+	e->psl = 0;
+	while (entries[i].key) {
+		if (entries[i].psl < e->psl) {
+			tmp = entries[i];
+			entries[i] = *e;
+			*e = tmp;
+		}
+		e->psl++;
+		i = (i + 1) & mask;
+	}
+	entries[i] = *e;
+}
+
+static int hashmap_grow(struct ext2fs_hashmap *h)
+{
+	struct ext2fs_hashmap_entry *entries;
+	uint32_t i, size = h->size << 1;
+
+	entries = calloc(size, sizeof(struct ext2fs_hashmap_entry));
+	if (!entries)
+		return -1;
+	for (i = 0; i < h->size; i++) {
+		if (h->entries[i].key)
+			hashmap_place(entries, size, &h->entries[i]);
+	}
+	free(h->entries);
+	h->entries = entries;
+	h->size = size;
+	h->limit = size - size / 8;
+	return 0;
+}
+
 void ext2fs_hashmap_add(struct ext2fs_hashmap *h, void *data, const void *key,
 			size_t key_len)
 {
-	uint32_t hash = h->hash(key, key_len) % h->size;
-	struct ext2fs_hashmap_entry *e = malloc(sizeof(*e));
-
-	if (!e)
-		return;
-	e->data = data;
-	e->key = key;
-	e->key_len = key_len;
-	e->next = h->entries[hash];
-	h->entries[hash] = e;
-
-	e->list_prev = NULL;
-	e->list_next = h->first;
-	if (h->first)
-		h->first->list_prev = e;
-	h->first = e;
-	if (!h->last)
-		h->last = e;
+	struct ext2fs_hashmap_entry e;
+
+	if (h->count >= h->limit && hashmap_grow(h) != 0 &&
+	    h->count == h->size)
+		return;	/* Table full and can't grow: drop the entry */
+
+	e.data = data;
+	e.key = key;
+	e.key_len = key_len;
+	e.hash = h->hash(key, key_len);
+	hashmap_place(h->entries, h->size, &e);
+	h->count++;
+
+	if (h->order_len == h->order_cap) {
+		uint32_t cap = h->order_cap ? h->order_cap << 1 : 16;
+		void **order = realloc(h->order, cap * sizeof(void*));
+		if (!order)
+			return;	/* Entry stays, but won't be iterated */
+		h->order = order;
+		h->order_cap = cap;
+	}
+	h->order[h->order_len++] = data;
 }
 
 void *ext2fs_hashmap_lookup(struct ext2fs_hashmap *h, const void *key,
 			    size_t key_len)
 {
-	struct ext2fs_hashmap_entry *iter;
-	uint32_t hash = h->hash(key, key_len) % h->size;
+	uint32_t mask = h->size - 1;
+	uint32_t hash = h->hash(key, key_len);
+	uint32_t i = hash & mask, psl = 0;
 
-	for (iter = h->entries[hash]; iter; iter = iter->next)
-		if (iter->key_len == key_len && !memcmp(iter->key, key, key_len))
-			return iter->data;
+	/* An entry probing shorter than us would have been displaced,
+	 * so the key can't be any further down the run */
+	while (h->entries[i].key && h->entries[i].psl >= psl) {
+		if (h->entries[i].hash == hash &&
+		    h->entries[i].key_len == key_len &&
+		    !memcmp(h->entries[i].key, key, key_len))
+			return h->entries[i].data;
+		psl++;
+		i = (i + 1) & mask;
+	}
 	return NULL;
 }
 
 void *ext2fs_hashmap_iter_in_order(struct ext2fs_hashmap *h,
 				   struct ext2fs_hashmap_entry **it)
 {
-	*it = *it ? (*it)->list_next : h->first;
-	return *it ? (*it)->data : NULL;
+	/* The opaque cursor holds the next insertion order index, plus one */
+	uintptr_t i = (uintptr_t)*it;
+
+	if (i >= h->order_len)
+		return NULL;
+	*it = (struct ext2fs_hashmap_entry *)(i + 1);
+	return h->order[i];
 }
 
 void ext2fs_hashmap_free(struct ext2fs_hashmap *h)
 {
-	size_t	i;
-
-	for (i = 0; i < h->size; ++i) {
-		struct ext2fs_hashmap_entry *it = h->entries[i];
-		while (it) {
-			struct ext2fs_hashmap_entry *tmp = it->next;
-			if (h->free)
-				h->free(it->data);
-			free(it);
-			it = tmp;
+	uint32_t i;
+
+	if (h->free) {
+		for (i = 0; i < h->size; i++) {
+			if (h->entries[i].key)
+				h->free(h->entries[i].data);
 		}
 	}
+	free(h->entries);
+	free(h->order);
 	free(h);
 }
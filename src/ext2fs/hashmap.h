@@ -19,9 +19,8 @@ struct ext2fs_hashmap_entry {
 	void *data;
 	const void *key;
 	size_t key_len;
-	struct ext2fs_hashmap_entry *next;
-	struct ext2fs_hashmap_entry *list_next;
-	struct ext2fs_hashmap_entry *list_prev;
+	uint32_t hash;		/* cached full hash of key */
+	uint32_t psl;		/* probe sequence length (robin hood) */
 };
 
 struct ext2fs_hashmap *ext2fs_hashmap_create(
@@ -120,7 +120,20 @@ errcode_t ext2fs_initialize(const char *name, int flags,
 	fs->magic = EXT2_ET_MAGIC_EXT2FS_FILSYS;
 	fs->flags = flags | EXT2_FLAG_RW;
 	fs->umask = 022;
-	fs->default_bitmap_type = EXT2FS_BMAP64_RBTREE;
+	/*
+	 * For small filesystems the flat bitarray is faster and barely larger
+	 * than the rb-tree nodes, while for large, mostly empty ones the
+	 * rb-tree avoids touching megabytes of RAM per bitmap. The crossover
+	 * used here (bitarrays above 4 MB, i.e. more than 2^25 clusters) was
+	 * established with the RUFUS_TEST bitmap benchmark in format_ext.c,
+	 * which can also force a backend through EXT2FS_BITMAP_TYPE.
+	 */
+	time_env = getenv("EXT2FS_BITMAP_TYPE");
+	if (time_env)
+		fs->default_bitmap_type = (__u16) strtoul(time_env, NULL, 0);
+	else
+		fs->default_bitmap_type = (ext2fs_blocks_count(param) > (1ULL << 25)) ?
+			EXT2FS_BMAP64_RBTREE : EXT2FS_BMAP64_BITARRAY;
 #ifdef WORDS_BIGENDIAN
 	fs->flags |= EXT2_FLAG_SWAP_BYTES;
 #endif
@@ -384,8 +384,8 @@ static errcode_t dx_split_leaf(ext2_filsys fs, ext2_ino_t dir,
 	int offset, move_size;
 	int i, count = 0;
 	struct dx_hash_map *map;
+	struct ext2fs_dirhash_in *hashes;
 	int continued;
-	__u32 minor_hash;
 
 	retval = ext2fs_get_mem(fs->blocksize, &buf2);
 	if (retval)
@@ -396,6 +396,13 @@ static errcode_t dx_split_leaf(ext2_filsys fs, ext2_ino_t dir,
 		ext2fs_free_mem(&buf2);
 		return retval;
 	}
+	retval = ext2fs_get_array(fs->blocksize / 12,
+				  sizeof(struct ext2fs_dirhash_in), &hashes);
+	if (retval) {
+		ext2fs_free_mem(&map);
+		ext2fs_free_mem(&buf2);
+		return retval;
+	}
 	for (offset = 0; offset < fs->blocksize; offset += rec_len) {
 		de = (struct ext2_dir_entry*)(buf + offset);
 		retval = ext2fs_get_rec_len(fs, de, &rec_len);
@@ -404,17 +411,18 @@ static errcode_t dx_split_leaf(ext2_filsys fs, ext2_ino_t dir,
 		if (ext2fs_dirent_name_len(de) > 0 && de->inode) {
 			map[count].off = offset;
 			map[count].size = rec_len;
-			retval = ext2fs_dirhash2(info->hash_alg, de->name,
-					ext2fs_dirent_name_len(de),
-					fs->encoding, hash_flags,
-					fs->super->s_hash_seed,
-					&(map[count].hash),
-					&minor_hash);
-			if (retval)
-				goto out;
+			hashes[count].name = de->name;
+			hashes[count].len = ext2fs_dirent_name_len(de);
 			count++;
 		}
 	}
+	retval = ext2fs_dirhash2_batch(info->hash_alg, hashes, count,
+				       fs->encoding, hash_flags,
+				       fs->super->s_hash_seed);
+	if (retval)
+		goto out;
+	for (i = 0; i < count; i++)
+		map[i].hash = hashes[i].hash;
 	qsort(map, count, sizeof(struct dx_hash_map), dx_hash_map_cmp);
 	move_size = 0;
 	/* Find place to split block */
@@ -446,6 +454,7 @@ static errcode_t dx_split_leaf(ext2_filsys fs, ext2_ino_t dir,
 out:
 	ext2fs_free_mem(&buf2);
 	ext2fs_free_mem(&map);
+	ext2fs_free_mem(&hashes);
 	return retval;
 }
 
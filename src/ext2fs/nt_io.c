@@ -1,7 +1,7 @@
 /*
  * nt_io.c --- This is the Nt I/O interface to the I/O manager.
  *
- * Implements a one-block write-through cache.
+ * Implements a multi-block writeback cache with coalesced flushes.
  *
  * Copyright (C) 1993, 1994, 1995 Theodore Ts'o.
  * Copyright (C) 1998 Andrey Shedel <andreys@ns.cr.cyco.com>
@@ -53,13 +53,29 @@ PF_TYPE_DECL(NTAPI, NTSTATUS, NtDelayExecution, (BOOLEAN, PLARGE_INTEGER));
 
 #define EXT2_ET_MAGIC_NT_IO_CHANNEL         0x10ed
 
+// The ext2fs library issues nearly all of its metadata updates as individual
+// single block writes, each of which used to hit the device on its own. We
+// aggregate them in a writeback cache instead, and flush dirty blocks in
+// coalesced sequential bursts, the same way the unix_io manager from upstream
+// e2fsprogs does.
+#define NT_CACHE_BLOCKS                     64
+
+typedef struct {
+    __u64   block;
+    char*   buffer;
+    BOOLEAN in_use;
+    BOOLEAN dirty;
+    ULONG   last_use;
+} NT_CACHE_ENTRY;
+
 // Private data block
 typedef struct _NT_PRIVATE_DATA {
     int     magic;
     HANDLE  handle;
     int     flags;
-    char*   buffer;
-    __u32   buffer_block_number;
+    NT_CACHE_ENTRY cache[NT_CACHE_BLOCKS];
+    char*   scratch;        // NT_CACHE_BLOCKS blocks, used to coalesce the writeback
+    ULONG   use_counter;
     ULONG   buffer_size;
     BOOLEAN read_only;
     BOOLEAN written;
@@ -438,6 +454,87 @@ static BOOLEAN _SetPartType(IN HANDLE Handle, IN UCHAR Type)
 						  IOCTL_DISK_SET_PARTITION_INFO, &Type, sizeof(Type), NULL, 0));
 }
 
+//
+// Writeback cache management
+//
+static NT_CACHE_ENTRY* _CacheFind(PNT_PRIVATE_DATA nt_data, __u64 block)
+{
+	int i;
+
+	for (i = 0; i < NT_CACHE_BLOCKS; i++) {
+		if (nt_data->cache[i].in_use && (nt_data->cache[i].block == block)) {
+			nt_data->cache[i].last_use = ++nt_data->use_counter;
+			return &nt_data->cache[i];
+		}
+	}
+	return NULL;
+}
+
+// Write out all dirty blocks, coalescing contiguous ones into single device writes
+static errcode_t _CacheWriteback(PNT_PRIVATE_DATA nt_data)
+{
+	NT_CACHE_ENTRY* sorted[NT_CACHE_BLOCKS];
+	LARGE_INTEGER offset;
+	errcode_t errcode = 0;
+	int i, j, n = 0, run;
+
+	for (i = 0; i < NT_CACHE_BLOCKS; i++) {
+		if (nt_data->cache[i].in_use && nt_data->cache[i].dirty)
+			sorted[n++] = &nt_data->cache[i];
+	}
+	if (n == 0)
+		return 0;
+
+	// Insertion sort by block number, so that contiguous blocks coalesce
+	for (i = 1; i < n; i++) {
+		NT_CACHE_ENTRY* e = sorted[i];
+		for (j = i - 1; (j >= 0) && (sorted[j]->block > e->block); j--)
+			sorted[j + 1] = sorted[j];
+		sorted[j + 1] = e;
+	}
+
+	for (i = 0; i < n; i += run) {
+		for (run = 1; (i + run < n) && (sorted[i + run]->block == sorted[i]->block + run); run++);
+		for (j = 0; j < run; j++)
+			memcpy(&nt_data->scratch[j * nt_data->buffer_size], sorted[i + j]->buffer, nt_data->buffer_size);
+		offset.QuadPart = sorted[i]->block * nt_data->buffer_size + nt_data->offset;
+		if (!_RawWrite(nt_data->handle, offset, run * nt_data->buffer_size, nt_data->scratch, &errcode))
+			return errcode;
+		for (j = 0; j < run; j++)
+			sorted[i + j]->dirty = FALSE;
+	}
+
+	return 0;
+}
+
+// Get a cache entry for block, evicting the least recently used one if needed
+static NT_CACHE_ENTRY* _CacheAlloc(PNT_PRIVATE_DATA nt_data, __u64 block, OUT errcode_t *Errno)
+{
+	NT_CACHE_ENTRY* victim = &nt_data->cache[0];
+	LARGE_INTEGER offset;
+	int i;
+
+	*Errno = 0;
+	for (i = 0; i < NT_CACHE_BLOCKS; i++) {
+		if (!nt_data->cache[i].in_use) {
+			victim = &nt_data->cache[i];
+			break;
+		}
+		if (nt_data->cache[i].last_use < victim->last_use)
+			victim = &nt_data->cache[i];
+	}
+	if (victim->in_use && victim->dirty) {
+		offset.QuadPart = victim->block * nt_data->buffer_size + nt_data->offset;
+		if (!_RawWrite(nt_data->handle, offset, nt_data->buffer_size, victim->buffer, Errno))
+			return NULL;
+	}
+	victim->block = block;
+	victim->in_use = TRUE;
+	victim->dirty = FALSE;
+	victim->last_use = ++nt_data->use_counter;
+	return victim;
+}
+
 //
 // Interface functions.
 // Is_mounted is set to 1 if the device is mounted, 0 otherwise
@@ -496,6 +593,7 @@ static errcode_t nt_open(const char *name, int flags, io_channel *channel)
 	io_channel io = NULL;
 	PNT_PRIVATE_DATA nt_data = NULL;
 	errcode_t errcode = 0;
+	int i;
 
 	if (name == NULL)
 		return EXT2_ET_BAD_DEVICE_NAME;
@@ -519,8 +617,15 @@ static errcode_t nt_open(const char *name, int flags, io_channel *channel)
 		goto out;
 	}
 
-	nt_data->buffer = malloc(EXT2_MIN_BLOCK_SIZE);
-	if (nt_data->buffer == NULL) {
+	for (i = 0; i < NT_CACHE_BLOCKS; i++) {
+		nt_data->cache[i].buffer = malloc(EXT2_MIN_BLOCK_SIZE);
+		if (nt_data->cache[i].buffer == NULL) {
+			errcode = ENOMEM;
+			goto out;
+		}
+	}
+	nt_data->scratch = malloc(NT_CACHE_BLOCKS * EXT2_MIN_BLOCK_SIZE);
+	if (nt_data->scratch == NULL) {
 		errcode = ENOMEM;
 		goto out;
 	}
@@ -533,7 +638,6 @@ static errcode_t nt_open(const char *name, int flags, io_channel *channel)
 	io->refcount = 1;
 
 	nt_data->magic = EXT2_ET_MAGIC_NT_IO_CHANNEL;
-	nt_data->buffer_block_number = 0xffffffff;
 	nt_data->buffer_size = EXT2_MIN_BLOCK_SIZE;
 	io->private_data = nt_data;
 
@@ -560,7 +664,9 @@ out:
 				_UnlockDrive(nt_data->handle);
 				_CloseDisk(nt_data->handle);
 			}
-			free(nt_data->buffer);
+			for (i = 0; i < NT_CACHE_BLOCKS; i++)
+				free(nt_data->cache[i].buffer);
+			free(nt_data->scratch);
 			free(nt_data);
 		}
 	}
@@ -571,6 +677,7 @@ out:
 static errcode_t nt_close(io_channel channel)
 {
 	PNT_PRIVATE_DATA nt_data = NULL;
+	int i;
 
 	if (channel == NULL)
 		return 0;
@@ -586,9 +693,14 @@ static errcode_t nt_close(io_channel channel)
 	free(channel);
 
 	if (nt_data != NULL) {
+		// Push out whatever is still pending in the writeback cache
+		if (!nt_data->read_only)
+			_CacheWriteback(nt_data);
 		if (nt_data->handle != NULL)
 			CloseHandle(nt_data->handle);
-		free(nt_data->buffer);
+		for (i = 0; i < NT_CACHE_BLOCKS; i++)
+			free(nt_data->cache[i].buffer);
+		free(nt_data->scratch);
 		free(nt_data);
 	}
 
@@ -598,21 +710,34 @@ static errcode_t nt_close(io_channel channel)
 static errcode_t nt_set_blksize(io_channel channel, int blksize)
 {
 	PNT_PRIVATE_DATA nt_data = NULL;
+	errcode_t errcode;
+	int i;
 
 	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
 	nt_data = (PNT_PRIVATE_DATA) channel->private_data;
 	EXT2_CHECK_MAGIC(nt_data, EXT2_ET_MAGIC_NT_IO_CHANNEL);
 
 	if (channel->block_size != blksize) {
+		// Block numbers change meaning with the block size, so the cache
+		// must be emptied and resized
+		errcode = _CacheWriteback(nt_data);
+		if (errcode)
+			return errcode;
 		channel->block_size = blksize;
 
-		free(nt_data->buffer);
-		nt_data->buffer_block_number = 0xffffffff;
 		nt_data->buffer_size = channel->block_size;
 		assert((nt_data->buffer_size % 512) == 0);
 
-		nt_data->buffer = malloc(nt_data->buffer_size);
-		if (nt_data->buffer == NULL)
+		for (i = 0; i < NT_CACHE_BLOCKS; i++) {
+			free(nt_data->cache[i].buffer);
+			nt_data->cache[i].in_use = FALSE;
+			nt_data->cache[i].buffer = malloc(nt_data->buffer_size);
+			if (nt_data->cache[i].buffer == NULL)
+				return ENOMEM;
+		}
+		free(nt_data->scratch);
+		nt_data->scratch = malloc(NT_CACHE_BLOCKS * nt_data->buffer_size);
+		if (nt_data->scratch == NULL)
 			return ENOMEM;
 	}
 
@@ -621,8 +746,7 @@ static errcode_t nt_set_blksize(io_channel channel, int blksize)
 
 static errcode_t nt_read_blk64(io_channel channel, unsigned long long block, int count, void *buf)
 {
-	PVOID read_buffer;
-	ULONG read_size;
+	NT_CACHE_ENTRY* entry;
 	ULONG size;
 	LARGE_INTEGER offset;
 	PNT_PRIVATE_DATA nt_data = NULL;
@@ -632,42 +756,42 @@ static errcode_t nt_read_blk64(io_channel channel, unsigned long long block, int
 	nt_data = (PNT_PRIVATE_DATA) channel->private_data;
 	EXT2_CHECK_MAGIC(nt_data, EXT2_ET_MAGIC_NT_IO_CHANNEL);
 
-	// If it's in the cache, use it!
-	if ((count == 1) && (block == nt_data->buffer_block_number) &&
-	    (nt_data->buffer_block_number != 0xffffffff)) {
-		memcpy(buf, nt_data->buffer, channel->block_size);
-		return 0;
-	}
-
 	size = (count < 0) ? (ULONG)(-count) : (ULONG)(count * channel->block_size);
 
-	offset.QuadPart = block * channel->block_size + nt_data->offset;
-
-	// If not fit to the block
-	if (size <= nt_data->buffer_size) {
-		// Update the cache
-		nt_data->buffer_block_number = block;
-		read_buffer = nt_data->buffer;
-		read_size = nt_data->buffer_size;
-	} else {
-		read_size = size;
-		read_buffer = buf;
-		assert((read_size % channel->block_size) == 0);
+	// Single block reads go through the cache
+	if ((count == 1) && (size == nt_data->buffer_size)) {
+		entry = _CacheFind(nt_data, block);
+		if (entry != NULL) {
+			memcpy(buf, entry->buffer, channel->block_size);
+			return 0;
+		}
+		entry = _CacheAlloc(nt_data, block, &errcode);
+		if (entry == NULL)
+			goto err;
+		offset.QuadPart = block * channel->block_size + nt_data->offset;
+		if (!_RawRead(nt_data->handle, offset, channel->block_size, entry->buffer, &errcode)) {
+			entry->in_use = FALSE;
+			goto err;
+		}
+		memcpy(buf, entry->buffer, channel->block_size);
+		return 0;
 	}
 
-	if (!_RawRead(nt_data->handle, offset, read_size, read_buffer, &errcode)) {
-		if (channel->read_error)
-			return (channel->read_error)(channel, block, count, buf, size, 0, errcode);
-		else
-			return errcode;
-	}
+	// Direct read: push pending metadata out first, so we read fresh data
+	errcode = _CacheWriteback(nt_data);
+	if (errcode)
+		return errcode;
 
-	if (read_buffer != buf) {
-		assert(size <= read_size);
-		memcpy(buf, read_buffer, size);
-	}
+	offset.QuadPart = block * channel->block_size + nt_data->offset;
+	if (!_RawRead(nt_data->handle, offset, size, buf, &errcode))
+		goto err;
 
 	return 0;
+
+err:
+	if (channel->read_error)
+		return (channel->read_error)(channel, block, count, buf, size, 0, errcode);
+	return errcode;
 }
 
 static errcode_t nt_read_blk(io_channel channel, unsigned long block, int count, void* buf)
@@ -677,10 +801,12 @@ static errcode_t nt_read_blk(io_channel channel, unsigned long block, int count,
 
 static errcode_t nt_write_blk64(io_channel channel, unsigned long long block, int count, const void *buf)
 {
-	ULONG write_size;
+	NT_CACHE_ENTRY* entry;
+	ULONG write_size, num_blocks;
 	LARGE_INTEGER offset;
 	PNT_PRIVATE_DATA nt_data = NULL;
 	errcode_t errcode = 0;
+	int i;
 
 	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
 	nt_data = (PNT_PRIVATE_DATA) channel->private_data;
@@ -689,37 +815,50 @@ static errcode_t nt_write_blk64(io_channel channel, unsigned long long block, in
 	if (nt_data->read_only)
 		return EACCES;
 
-	if (count == 1) {
+	if (count == 1)
 		write_size = channel->block_size;
-	} else {
-		nt_data->buffer_block_number = 0xffffffff;
-		if (count < 0)
-			write_size = (ULONG)(-count);
-		else
-			write_size = (ULONG)(count * channel->block_size);
+	else if (count < 0)
+		write_size = (ULONG)(-count);
+	else
+		write_size = (ULONG)(count * channel->block_size);
+
+	// Single block writes only dirty the cache - the device write is deferred
+	// until the dirty blocks can be flushed as coalesced sequential bursts
+	if (count == 1) {
+		entry = _CacheFind(nt_data, block);
+		if (entry == NULL) {
+			entry = _CacheAlloc(nt_data, block, &errcode);
+			if (entry == NULL)
+				goto err;
+		}
+		memcpy(entry->buffer, buf, channel->block_size);
+		entry->dirty = TRUE;
+		nt_data->written = TRUE;
+		return 0;
 	}
 
+	// Drop any cached blocks this write supersedes
+	num_blocks = (write_size + channel->block_size - 1) / channel->block_size;
+	for (i = 0; i < NT_CACHE_BLOCKS; i++) {
+		if (nt_data->cache[i].in_use && (nt_data->cache[i].block >= block) &&
+		    (nt_data->cache[i].block < block + num_blocks))
+			nt_data->cache[i].in_use = FALSE;
+	}
 
 	assert((write_size % 512) == 0);
 	offset.QuadPart = block * channel->block_size + nt_data->offset;
 
-	if (!_RawWrite(nt_data->handle, offset, write_size, buf, &errcode)) {
-		if (channel->write_error)
-			return (channel->write_error)(channel, block, count, buf, write_size, 0, errcode);
-		else
-			return errcode;
-	}
-
-
-	// Stash a copy.
-	if(write_size >= nt_data->buffer_size) {
-		nt_data->buffer_block_number = block;
-		memcpy(nt_data->buffer, buf, nt_data->buffer_size);
-	}
+	if (!_RawWrite(nt_data->handle, offset, write_size, buf, &errcode))
+		goto err;
 
 	nt_data->written = TRUE;
 
 	return 0;
+
+err:
+	if (channel->write_error)
+		return (channel->write_error)(channel, block, count, buf, write_size, 0, errcode);
+	return errcode;
 }
 
 static errcode_t nt_write_blk(io_channel channel, unsigned long block, int count, const void* buf)
@@ -730,6 +869,7 @@ static errcode_t nt_write_blk(io_channel channel, unsigned long block, int count
 static errcode_t nt_flush(io_channel channel)
 {
 	PNT_PRIVATE_DATA nt_data = NULL;
+	errcode_t errcode;
 
 	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
 	nt_data = (PNT_PRIVATE_DATA) channel->private_data;
@@ -738,6 +878,10 @@ static errcode_t nt_flush(io_channel channel)
 	if(nt_data->read_only)
 		return 0;
 
+	// Write out the dirty blocks from the cache.
+	errcode = _CacheWriteback(nt_data);
+	if (errcode)
+		return errcode;
 
 	// Flush file buffers.
 	_FlushDrive(nt_data->handle);
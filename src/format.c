@@ -62,7 +62,38 @@
 const char* FileSystemLabel[FS_MAX] = { "FAT", "FAT32", "NTFS", "UDF", "exFAT", "ReFS", "ext2", "ext3", "ext4" };
 DWORD FormatStatus = 0, LastWriteError = 0;
 badblocks_report report = { 0 };
+
+/*
+ * Streamed from BadBlocks() as each coalesced range of defective blocks
+ * closes, so nothing needs to be re-walked once the scan completes
+ */
+static void bad_block_range(blk64_t start, blk64_t end, enum error_types error_type)
+{
+	const char* type = (error_type == READ_ERROR) ? "read" : ((error_type == WRITE_ERROR) ? "write" : "corruption");
+	if (start == end)
+		uprintf("Bad Blocks: Block %llu (%s error)", (unsigned long long)start, type);
+	else
+		uprintf("Bad Blocks: Blocks %llu-%llu (%s errors)", (unsigned long long)start, (unsigned long long)end, type);
+}
+// Cancellation-aware wait, used by the retry paths so that a user abort during
+// a long backoff doesn't have to sit out the full delay: the sleep proceeds in
+// short slices and returns TRUE as soon as a cancellation has been flagged.
+static BOOL SleepOrCancel(DWORD duration)
+{
+	DWORD slice;
+
+	while (duration != 0) {
+		if (IS_ERROR(FormatStatus) && (SCODE_CODE(FormatStatus) == ERROR_CANCELLED))
+			return TRUE;
+		slice = min(duration, 100);
+		Sleep(slice);
+		duration -= slice;
+	}
+	return IS_ERROR(FormatStatus) && (SCODE_CODE(FormatStatus) == ERROR_CANCELLED);
+}
+
 static float format_percent = 0.0f;
+static DWORD last_format_percent = (DWORD)-1;
 static int task_number = 0;
 static unsigned int sec_buf_pos = 0;
 extern const int nb_steps[FS_MAX];
@@ -70,10 +101,129 @@ extern uint32_t dur_mins, dur_secs;
 extern uint32_t wim_nb_files, wim_proc_files, wim_extra_files;
 static int actual_fs_type, wintogo_index = -1, wininst_index = 0;
 extern BOOL force_large_fat32, enable_ntfs_compression, lock_drive, zero_drive, fast_zeroing, enable_file_indexing, write_as_image;
-extern BOOL use_vds, write_as_esp, is_vds_available;
+extern BOOL enable_multi_target;
+extern BOOL use_vds, write_as_esp, is_vds_available, use_unbuffered_io, verify_writes, use_differential_write;
+extern StrArray DriveId;
 uint8_t *grub2_buf = NULL, *sec_buf = NULL;
 long grub2_len;
 
+/*
+ * Per-phase format timing telemetry. The duration of each phase of the format
+ * operation, along with the write throughput, is kept in a rolling per-device
+ * history (keyed on the device instance ID, i.e. VID:PID + serial) in the
+ * settings store, and each successful run is compared against that device's
+ * historical baseline, so that a stick whose flash is degrading gets called
+ * out in the log before it fails in the field.
+ */
+#define PH_ANALYZE		0
+#define PH_PARTITION	1
+#define PH_FORMAT		2
+#define PH_WRITE		3
+#define PH_VERIFY		4
+#define PH_MAX			5
+#define PH_HISTORY_LEN	8
+static const char* phase_name[PH_MAX] = { "analyze", "partition", "format", "write", "verify" };
+static uint64_t phase_time[PH_MAX];
+static uint64_t phase_start = 0;
+static int cur_phase = -1;
+
+static void FormatPhase(int phase)
+{
+	uint64_t now = GetTickCount64();
+	if (cur_phase >= 0)
+		phase_time[cur_phase] += now - phase_start;
+	cur_phase = phase;
+	phase_start = now;
+}
+
+static void FormatPhaseReset(void)
+{
+	memset(phase_time, 0, sizeof(phase_time));
+	cur_phase = -1;
+}
+
+// Derive a per-device settings key (format history, DD transfer size tuning).
+// Settings keys can't accommodate a full device instance path, so it gets
+// hashed, using the same sdbm algorithm as htab_hash().
+static char* DeviceSettingKey(const char* prefix)
+{
+	static char key[32];
+	uint32_t r = 0;
+	int c, index = ComboBox_GetCurSel(hDeviceList);
+	char* sz;
+
+	if ((index < 0) || (index >= (int)DriveId.Index) || (safe_strlen(DriveId.String[index]) < 8))
+		return NULL;
+	for (sz = DriveId.String[index]; (c = *sz++) != 0; )
+		r = c + (r << 6) + (r << 16) - r;
+	static_sprintf(key, "%s%08X", prefix, r);
+	return key;
+}
+
+static void FormatPhaseReport(uint64_t write_bytes)
+{
+	char *key, *history, *p, *sep, record[64], new_history[512];
+	uint32_t throughput = 0, avg_throughput = 0, nb_records = 0;
+	uint64_t total = 0, avg_total = 0;
+	int i;
+
+	FormatPhase(-1);
+	for (i = 0; i < PH_MAX; i++)
+		total += phase_time[i];
+	if (total == 0)
+		return;
+	if ((write_bytes != 0) && (phase_time[PH_WRITE] != 0))
+		throughput = (uint32_t)((write_bytes * 1000) / (phase_time[PH_WRITE] * KB));
+	uprintf("Format timings:");
+	for (i = 0; i < PH_MAX; i++) {
+		if (phase_time[i] != 0)
+			uprintf("  %s: %llu.%03llu s", phase_name[i],
+				(unsigned long long)(phase_time[i] / 1000), (unsigned long long)(phase_time[i] % 1000));
+	}
+	if (throughput != 0)
+		uprintf("  write throughput: %s/s", SizeToHumanReadable((uint64_t)throughput * KB, FALSE, FALSE));
+
+	key = DeviceSettingKey(SETTING_FORMAT_HISTORY_PREFIX);
+	if (key == NULL)
+		return;
+	// Each history record is '<total ms>:<write throughput KB/s>'
+	history = ReadSettingStr(key);
+	for (p = history; (p != NULL) && (*p != 0) && (nb_records < PH_HISTORY_LEN); nb_records++) {
+		avg_total += strtoull(p, NULL, 10);
+		sep = strchr(p, ':');
+		if (sep != NULL)
+			avg_throughput += (uint32_t)strtoul(sep + 1, NULL, 10);
+		p = strchr(p, ',');
+		if (p != NULL)
+			p++;
+	}
+	if (nb_records != 0) {
+		avg_total /= nb_records;
+		avg_throughput /= nb_records;
+		// Flag runs that fall more than 30% short of this device's own baseline
+		if ((avg_throughput != 0) && (throughput != 0) && (throughput * 10 < avg_throughput * 7))
+			uprintf("WARNING: This device wrote at %d%% of its historical average (%s/s) - "
+				"its flash may be degrading", (int)((throughput * 100) / avg_throughput),
+				SizeToHumanReadable((uint64_t)avg_throughput * KB, FALSE, FALSE));
+		else if ((avg_total != 0) && (total * 10 > avg_total * 13) && (throughput == 0))
+			uprintf("WARNING: This operation took %d%% of this device's historical average duration",
+				(int)((total * 100) / avg_total));
+	}
+	static_sprintf(record, "%llu:%lu", (unsigned long long)total, (unsigned long)throughput);
+	if (history[0] == 0)
+		static_strcpy(new_history, record);
+	else
+		static_sprintf(new_history, "%s,%s", record, history);
+	// Truncate to the last PH_HISTORY_LEN records
+	for (i = 0, nb_records = 0; new_history[i] != 0; i++) {
+		if (new_history[i] == ',' && (++nb_records >= PH_HISTORY_LEN)) {
+			new_history[i] = 0;
+			break;
+		}
+	}
+	WriteSettingStr(key, new_history);
+}
+
 /*
  * Convert the fmifs outputs messages (that use an OEM code page) to UTF-8
  */
@@ -117,9 +267,14 @@ static BOOLEAN __stdcall FormatExCallback(FILE_SYSTEM_CALLBACK_COMMAND Command,
 
 	switch(Command) {
 	case FCC_PROGRESS:
-		static_sprintf(percent_str, "%lu%%", *((DWORD*)pData));
-		PrintInfo(0, MSG_217, percent_str);
-		UpdateProgress(OP_FORMAT, 1.0f * (*((DWORD*)pData)));
+		// fmifs may invoke the callback more often than the percentage actually
+		// changes - only pay the synchronous UI update for real progress
+		if (*((DWORD*)pData) != last_format_percent) {
+			last_format_percent = *((DWORD*)pData);
+			static_sprintf(percent_str, "%lu%%", *((DWORD*)pData));
+			PrintInfo(0, MSG_217, percent_str);
+			UpdateProgress(OP_FORMAT, 1.0f * (*((DWORD*)pData)));
+		}
 		break;
 	case FCC_STRUCTURE_PROGRESS:	// No progress on quick format
 		if (task_number < nb_steps[actual_fs_type] - 1) {
@@ -200,6 +355,7 @@ static BOOLEAN __stdcall FormatExCallback(FILE_SYSTEM_CALLBACK_COMMAND Command,
 /*
  * Chkdsk callback. Return FALSE to halt operations
  */
+static int chkdsk_stage = 0;
 static BOOLEAN __stdcall ChkdskCallback(FILE_SYSTEM_CALLBACK_COMMAND Command, DWORD Action, PVOID pData)
 {
 	DWORD* percent;
@@ -218,9 +374,12 @@ static BOOLEAN __stdcall ChkdskCallback(FILE_SYSTEM_CALLBACK_COMMAND Command, DW
 			return FALSE;
 		}
 		break;
-	case FCC_UNKNOWN1A:
 	case FCC_DONE_WITH_STRUCTURE:
-		// Silence these specific calls
+		// Report the completion of each check stage as it happens
+		uprintf("Chkdsk: stage %d completed", ++chkdsk_stage);
+		break;
+	case FCC_UNKNOWN1A:
+		// Silence this specific call
 		break;
 	case FCC_INCOMPATIBLE_FILE_SYSTEM:
 		uprintf("Incompatible File System");
@@ -334,7 +493,6 @@ static BOOL FormatNativeVds(DWORD DriveIndex, uint64_t PartitionOffset, DWORD Cl
 	BOOL r = FALSE, bFoundVolume = FALSE;
 	HRESULT hr;
 	ULONG ulFetched;
-	IVdsServiceLoader *pLoader;
 	IVdsService *pService;
 	IEnumVdsObject *pEnum;
 	IUnknown *pUnk;
@@ -357,34 +515,11 @@ static BOOL FormatNativeVds(DWORD DriveIndex, uint64_t PartitionOffset, DWORD Cl
 		goto out;
 	}
 
-	// Initialize COM
-	IGNORE_RETVAL(CoInitializeEx(NULL, COINIT_APARTMENTTHREADED | COINIT_DISABLE_OLE1DDE));
-	IGNORE_RETVAL(CoInitializeSecurity(NULL, -1, NULL, NULL, RPC_C_AUTHN_LEVEL_CONNECT,
-		RPC_C_IMP_LEVEL_IMPERSONATE, NULL, 0, NULL));
-
-	// Create a VDS Loader Instance
-	hr = CoCreateInstance(&CLSID_VdsLoader, NULL, CLSCTX_LOCAL_SERVER | CLSCTX_REMOTE_SERVER,
-		&IID_IVdsServiceLoader, (void **)&pLoader);
-	if (hr != S_OK) {
-		VDS_SET_ERROR(hr);
-		uprintf("Could not create VDS Loader Instance: %s", WindowsErrorString());
-		goto out;
-	}
-
-	// Load the VDS Service
-	hr = IVdsServiceLoader_LoadService(pLoader, L"", &pService);
-	IVdsServiceLoader_Release(pLoader);
-	if (hr != S_OK) {
-		VDS_SET_ERROR(hr);
-		uprintf("Could not load VDS Service: %s", WindowsErrorString());
-		goto out;
-	}
-
-	// Wait for the Service to become ready if needed
-	hr = IVdsService_WaitForServiceReady(pService);
-	if (hr != S_OK) {
-		VDS_SET_ERROR(hr);
-		uprintf("VDS Service is not ready: %s", WindowsErrorString());
+	// Get the shared (per thread) VDS Service session
+	pService = GetVdsService(FALSE);
+	if (pService == NULL) {
+		hr = S_FALSE;
+		uprintf("Could not access VDS Service");
 		goto out;
 	}
 
@@ -458,8 +593,9 @@ static BOOL FormatNativeVds(DWORD DriveIndex, uint64_t PartitionOffset, DWORD Cl
 				BOOL match;
 				HRESULT hr2 = E_FAIL;
 				VDS_VOLUME_PROP VolumeProps;
+				VDS_ASYNC_OUTPUT AsyncOut;
 				LPWSTR *wszPathArray;
-				ULONG ulPercentCompleted, ulNumberOfPaths;
+				ULONG ulPercentCompleted, ulLastPercent = (ULONG)-1, ulNumberOfPaths;
 				USHORT usFsVersion = 0;
 				IVdsVolume *pVolume;
 				IVdsAsync* pAsync;
@@ -530,20 +666,34 @@ static BOOL FormatNativeVds(DWORD DriveIndex, uint64_t PartitionOffset, DWORD Cl
 					}
 					hr = IVdsAsync_QueryStatus(pAsync, &hr2, &ulPercentCompleted);
 					if (SUCCEEDED(hr)) {
-						if (Flags & FP_QUICK) {
-							// Progress report on quick format is useless, so we'll just pretend we have 2 tasks
-							PrintInfo(0, MSG_218, (ulPercentCompleted < 100) ? 1 : 2, 2);
-							UpdateProgress(OP_CREATE_FS, (float)ulPercentCompleted);
-						} else {
-							UpdateProgressWithInfo(OP_FORMAT, MSG_217, ulPercentCompleted, 100);
+						// Only relay actual progress changes to the UI
+						if (ulPercentCompleted != ulLastPercent) {
+							ulLastPercent = ulPercentCompleted;
+							if (Flags & FP_QUICK) {
+								// Progress report on quick format is useless, so we'll just pretend we have 2 tasks
+								PrintInfo(0, MSG_218, (ulPercentCompleted < 100) ? 1 : 2, 2);
+								UpdateProgress(OP_CREATE_FS, (float)ulPercentCompleted);
+							} else {
+								UpdateProgressWithInfo(OP_FORMAT, MSG_217, ulPercentCompleted, 100);
+							}
 						}
 						hr = hr2;
 						if (hr == S_OK)
 							break;
 						if (hr == VDS_E_OPERATION_PENDING)
 							hr = S_OK;
+						if (ulPercentCompleted >= 100) {
+							// All the data has been processed - instead of polling for the
+							// final state transition, block until the operation completes
+							hr = IVdsAsync_Wait(pAsync, &hr2, &AsyncOut);
+							if (SUCCEEDED(hr))
+								hr = hr2;
+							break;
+						}
 					}
-					Sleep(500);
+					// Poll at a rate that doesn't leave us sitting on a completed
+					// operation for half a second, like the old 500 ms sleep did
+					Sleep(100);
 				}
 				if (!SUCCEEDED(hr)) {
 					VDS_SET_ERROR(hr);
@@ -570,7 +720,6 @@ out:
 	safe_free(wVolumeName);
 	safe_free(wLabel);
 	safe_free(wFSName);
-	CoUninitialize();
 	return r;
 }
 
@@ -620,6 +769,7 @@ static BOOL FormatNative(DWORD DriveIndex, uint64_t PartitionOffset, DWORD Clust
 		uprintf("Using cluster size: %d bytes", ClusterSize);
 	}
 	format_percent = 0.0f;
+	last_format_percent = (DWORD)-1;
 	task_number = 0;
 
 	uprintf("%s format was selected", (Flags & FP_QUICK) ? "Quick" : "Slow");
@@ -629,7 +779,8 @@ static BOOL FormatNative(DWORD DriveIndex, uint64_t PartitionOffset, DWORD Clust
 		if (!IS_ERROR(FormatStatus) || (HRESULT_CODE(FormatStatus) == ERROR_CANCELLED))
 			break;
 		uprintf("%s - Retrying...", WindowsErrorString());
-		Sleep(WRITE_TIMEOUT);
+		if (SleepOrCancel(WRITE_TIMEOUT))
+			break;
 	}
 	if (IS_ERROR(FormatStatus))
 		goto out;
@@ -676,32 +827,69 @@ static BOOL FormatPartition(DWORD DriveIndex, uint64_t PartitionOffset, DWORD Un
 		return FormatNative(DriveIndex, PartitionOffset, UnitAllocationSize, FileSystemLabel[FSType], Label, Flags);
 }
 
+// Parameters we need to pass to the chkdsk worker
+static struct {
+	Chkdsk_t pfChkdsk;
+	WCHAR wDriveRoot[4];
+	WCHAR wFSType[32];
+	BOOL quick;
+} chkdsk_params;
+
+static DWORD WINAPI ChkdskThread(void* param)
+{
+	return (DWORD)chkdsk_params.pfChkdsk(chkdsk_params.wDriveRoot, chkdsk_params.wFSType,
+		FALSE, FALSE, chkdsk_params.quick, FALSE, NULL, NULL, ChkdskCallback);
+}
+
 /*
- * Call on fmifs.dll's Chkdsk() to fixup the filesystem
+ * Call on fmifs.dll's Chkdsk() to fixup the filesystem.
+ * The call is issued on a worker thread, so that a user cancellation doesn't
+ * leave us stuck behind a check that is in a long I/O stretch between two
+ * callback invocations. With bQuickOnly set, the volume is only checked if it
+ * is marked dirty, which is all a freshly created volume warrants.
  */
-static BOOL CheckDisk(char DriveLetter)
+static BOOL CheckDisk(char DriveLetter, BOOL bQuickOnly)
 {
 	BOOL r = FALSE;
 	PF_DECL(Chkdsk);
-	WCHAR wDriveRoot[] = L"?:\\";
-	WCHAR wFSType[32];
+	HANDLE chkdsk_thread;
 	size_t i;
 
-	wDriveRoot[0] = (WCHAR)DriveLetter;
 	PrintInfoDebug(0, MSG_223);
 
 	PF_INIT_OR_OUT(Chkdsk, Fmifs);
 
-	GetWindowTextW(hFileSystem, wFSType, ARRAYSIZE(wFSType));
+	wcscpy(chkdsk_params.wDriveRoot, L"?:\\");
+	chkdsk_params.wDriveRoot[0] = (WCHAR)DriveLetter;
+	GetWindowTextW(hFileSystem, chkdsk_params.wFSType, ARRAYSIZE(chkdsk_params.wFSType));
 	// We may have a " (Default)" trail
-	for (i=0; i<wcslen(wFSType); i++) {
-		if (wFSType[i] == ' ') {
-			wFSType[i] = 0;
+	for (i=0; i<wcslen(chkdsk_params.wFSType); i++) {
+		if (chkdsk_params.wFSType[i] == ' ') {
+			chkdsk_params.wFSType[i] = 0;
 			break;
 		}
 	}
-
-	pfChkdsk(wDriveRoot, wFSType, FALSE, FALSE, FALSE, FALSE, NULL, NULL, ChkdskCallback);
+	chkdsk_params.pfChkdsk = pfChkdsk;
+	chkdsk_params.quick = bQuickOnly;
+	chkdsk_stage = 0;
+
+	chkdsk_thread = CreateThread(NULL, 0, ChkdskThread, NULL, 0, NULL);
+	if (chkdsk_thread == NULL) {
+		// Couldn't start the worker => run the check synchronously
+		pfChkdsk(chkdsk_params.wDriveRoot, chkdsk_params.wFSType, FALSE, FALSE,
+			bQuickOnly, FALSE, NULL, NULL, ChkdskCallback);
+	} else {
+		while (WaitForSingleObject(chkdsk_thread, 250) == WAIT_TIMEOUT) {
+			if (IS_ERROR(FormatStatus)) {
+				// ChkdskCallback() halts fmifs the next time it is invoked,
+				// but don't wait forever for that to happen
+				if (WaitForSingleObject(chkdsk_thread, DRIVE_ACCESS_TIMEOUT) != WAIT_OBJECT_0)
+					uprintf("Chkdsk thread did not exit in time - abandoning it");
+				break;
+			}
+		}
+		CloseHandle(chkdsk_thread);
+	}
 	if (!IS_ERROR(FormatStatus)) {
 		uprintf("NTFS Fixup completed.\n");
 		r = TRUE;
@@ -714,9 +902,11 @@ out:
 static BOOL ClearMBRGPT(HANDLE hPhysicalDrive, LONGLONG DiskSize, DWORD SectorSize, BOOL add1MB)
 {
 	BOOL r = FALSE;
-	LARGE_INTEGER liFilePointer;
 	uint64_t num_sectors_to_clear;
-	unsigned char* pZeroBuf = NULL;
+	size_t zero_size = 0;
+	const unsigned char* pZeroBuf;
+	unsigned char* pAllocBuf = NULL;
+	batch_write_desc batch[2] = { 0 };
 
 	PrintInfoDebug(0, MSG_224);
 	// http://en.wikipedia.org/wiki/GUID_Partition_Table tells us we should clear 34 sectors at the
@@ -734,41 +924,45 @@ static BOOL ClearMBRGPT(HANDLE hPhysicalDrive, LONGLONG DiskSize, DWORD SectorSi
 		num_sectors_to_clear = (DWORD)((add1MB ? 2048 : 0) + MAX_SECTORS_TO_CLEAR);
 
 	uprintf("Erasing %d sectors", num_sectors_to_clear);
-	pZeroBuf = calloc(SectorSize, (size_t)num_sectors_to_clear);
+	// Use the shared zero buffer, unless the clear is too large for it
+	pZeroBuf = GetZeroBuffer(&zero_size);
+	if ((size_t)SectorSize * num_sectors_to_clear > zero_size) {
+		pAllocBuf = calloc(SectorSize, (size_t)num_sectors_to_clear);
+		pZeroBuf = pAllocBuf;
+	}
 	if (pZeroBuf == NULL) {
 		FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | ERROR_NOT_ENOUGH_MEMORY;
 		goto out;
 	}
-	liFilePointer.QuadPart = 0ULL;
-	if (!SetFilePointerEx(hPhysicalDrive, liFilePointer, &liFilePointer, FILE_BEGIN) || (liFilePointer.QuadPart != 0ULL))
-		uprintf("Warning: Could not reset disk position");
-	if (!WriteFileWithRetry(hPhysicalDrive, pZeroBuf, (DWORD)(SectorSize * num_sectors_to_clear), NULL, WRITE_RETRIES))
+	// Both ends of the drive are cleared through a single batch submission
+	batch[0].Offset = 0ULL;
+	batch[0].pBuffer = pZeroBuf;
+	batch[0].Length = (DWORD)(SectorSize * num_sectors_to_clear);
+	batch[1].Offset = DiskSize - (LONGLONG)SectorSize * MAX_SECTORS_TO_CLEAR;
+	batch[1].pBuffer = pZeroBuf;
+	batch[1].Length = SectorSize * MAX_SECTORS_TO_CLEAR;
+	IGNORE_RETVAL(WriteFileBatchWithRetry(hPhysicalDrive, batch, ARRAYSIZE(batch), WRITE_RETRIES));
+	// Windows seems to be an ass about keeping a lock on a backup GPT,
+	// so we try to be lenient about not being able to clear it (batch[1]).
+	if (!batch[0].Completed)
 		goto out;
 	CHECK_FOR_USER_CANCEL;
-	liFilePointer.QuadPart = DiskSize - (LONGLONG)SectorSize * MAX_SECTORS_TO_CLEAR;
-	// Windows seems to be an ass about keeping a lock on a backup GPT,
-	// so we try to be lenient about not being able to clear it.
-	if (SetFilePointerEx(hPhysicalDrive, liFilePointer, &liFilePointer, FILE_BEGIN)) {
-		IGNORE_RETVAL(WriteFileWithRetry(hPhysicalDrive, pZeroBuf,
-			SectorSize * MAX_SECTORS_TO_CLEAR, NULL, WRITE_RETRIES));
-	}
 	r = TRUE;
 
 out:
-	safe_free(pZeroBuf);
+	safe_free(pAllocBuf);
 	return r;
 }
 
 /*
  * Process the Master Boot Record
+ * The caller is expected to have set up fp (and its optional staging buffer)
+ * for the physical drive, see WriteBootRecords()
  */
-static BOOL WriteMBR(HANDLE hPhysicalDrive)
+static BOOL WriteMBR(FILE* fp)
 {
 	BOOL r = FALSE;
-	DWORD size;
 	unsigned char* buffer = NULL;
-	FAKE_FD fake_fd = { 0 };
-	FILE* fp = (FILE*)&fake_fd;
 	const char* using_msg = "Using %s MBR";
 
 	if (SelectedDrive.SectorSize < 512)
@@ -776,11 +970,9 @@ static BOOL WriteMBR(HANDLE hPhysicalDrive)
 
 	if (partition_type == PARTITION_STYLE_GPT) {
 		// Add a notice with a protective MBR
-		fake_fd._handle = (char*)hPhysicalDrive;
-		set_bytes_per_sector(SelectedDrive.SectorSize);
 		uprintf(using_msg, "Rufus protective");
 		r = write_rufus_msg_mbr(fp);
-		goto notify;
+		goto out;
 	}
 
 	// FormatEx rewrites the MBR and removes the LBA attribute of FAT16
@@ -792,7 +984,7 @@ static BOOL WriteMBR(HANDLE hPhysicalDrive)
 		goto out;
 	}
 
-	if (!read_sectors(hPhysicalDrive, SelectedDrive.SectorSize, 0, 1, buffer)) {
+	if (!read_data(fp, 0, buffer, SelectedDrive.SectorSize)) {
 		uprintf("Could not read MBR\n");
 		FormatStatus = ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|ERROR_READ_FAULT;
 		goto out;
@@ -823,15 +1015,12 @@ static BOOL WriteMBR(HANDLE hPhysicalDrive)
 		uprintf("Set bootable USB partition as 0x%02X\n", buffer[0x1be]);
 	}
 
-	if (!write_sectors(hPhysicalDrive, SelectedDrive.SectorSize, 0, 1, buffer)) {
+	if (!write_data(fp, 0, buffer, SelectedDrive.SectorSize)) {
 		uprintf("Could not write MBR\n");
 		FormatStatus = ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|ERROR_WRITE_FAULT;
 		goto out;
 	}
 
-	fake_fd._handle = (char*)hPhysicalDrive;
-	set_bytes_per_sector(SelectedDrive.SectorSize);
-
 	// What follows is really a case statement with complex conditions listed
 	// by order of preference
 	if ((boot_type == BT_IMAGE) && HAS_WINDOWS(img_report) && (allow_dual_uefi_bios) && (target_type == TT_BIOS))
@@ -841,7 +1030,7 @@ static BOOL WriteMBR(HANDLE hPhysicalDrive)
 	if ((boot_type == BT_NON_BOOTABLE) || (target_type == TT_UEFI)) {
 		uprintf(using_msg, "Zeroed");
 		r = write_zero_mbr(fp);
-		goto notify;
+		goto out;
 	}
 
 	// Syslinux
@@ -849,35 +1038,35 @@ static BOOL WriteMBR(HANDLE hPhysicalDrive)
 		 ((boot_type == BT_IMAGE) && HAS_SYSLINUX(img_report)) ) {
 		uprintf(using_msg, "Syslinux");
 		r = write_syslinux_mbr(fp);
-		goto notify;
+		goto out;
 	}
 
 	// Grub 2.0
 	if ( ((boot_type == BT_IMAGE) && (img_report.has_grub2)) || (boot_type == BT_GRUB2) ) {
 		uprintf(using_msg, "Grub 2.0");
 		r = write_grub2_mbr(fp);
-		goto notify;
+		goto out;
 	}
 
 	// Grub4DOS
 	if ( ((boot_type == BT_IMAGE) && (img_report.has_grub4dos)) || (boot_type == BT_GRUB4DOS) ) {
 		uprintf(using_msg, "Grub4DOS");
 		r = write_grub4dos_mbr(fp);
-		goto notify;
+		goto out;
 	}
 
 	// ReactOS
 	if (boot_type == BT_REACTOS) {
 		uprintf(using_msg, "ReactOS");
 		r = write_reactos_mbr(fp);
-		goto notify;
+		goto out;
 	}
 
 	// KolibriOS
 	if ( (boot_type == BT_IMAGE) && HAS_KOLIBRIOS(img_report) && (IS_FAT(fs_type))) {
 		uprintf(using_msg, "KolibriOS");
 		r = write_kolibrios_mbr(fp);
-		goto notify;
+		goto out;
 	}
 
 	// If everything else failed, fall back to a conventional Windows/Rufus MBR
@@ -890,11 +1079,6 @@ windows_mbr:
 		r = write_win7_mbr(fp);
 	}
 
-notify:
-	// Tell the system we've updated the disk properties
-	if (!DeviceIoControl(hPhysicalDrive, IOCTL_DISK_UPDATE_PROPERTIES, NULL, 0, NULL, 0, &size, NULL))
-		uprintf("Failed to notify system about disk properties update: %s\n", WindowsErrorString());
-
 out:
 	safe_mm_free(buffer);
 	return r;
@@ -902,18 +1086,15 @@ out:
 
 /*
  * Write Secondary Boot Record (usually right after the MBR)
+ * As with WriteMBR(), fp is expected to have been set up by the caller
  */
-static BOOL WriteSBR(HANDLE hPhysicalDrive)
+static BOOL WriteSBR(FILE* fp)
 {
 	// TODO: Do we need anything special for 4K sectors?
 	DWORD size, max_size, br_size = 0x200;
 	int r, sub_type = boot_type;
 	unsigned char* buf = NULL;
-	FAKE_FD fake_fd = { 0 };
-	FILE* fp = (FILE*)&fake_fd;
 
-	fake_fd._handle = (char*)hPhysicalDrive;
-	set_bytes_per_sector(SelectedDrive.SectorSize);
 	// Syslinux has precedence over Grub
 	if ((boot_type == BT_IMAGE) && (!HAS_SYSLINUX(img_report))) {
 		if (img_report.has_grub4dos)
@@ -983,6 +1164,57 @@ static BOOL WriteSBR(HANDLE hPhysicalDrive)
 	return (r != 0);
 }
 
+/*
+ * Compose the MBR boot code, partition table fixups and Secondary Boot Record
+ * in a staged copy of the start of the drive, that is flushed with a single
+ * aligned write, rather than have each step pay for its own read-modify-write
+ * cycles against the first sectors of the device.
+ */
+static BOOL WriteBootRecords(HANDLE hPhysicalDrive)
+{
+	BOOL r = FALSE;
+	DWORD size;
+	uint64_t stage_size = min(1 * MB, SelectedDrive.PartitionOffset[0]);
+	FAKE_FD fake_fd = { 0 };
+	FILE* fp = (FILE*)&fake_fd;
+
+	fake_fd._handle = (char*)hPhysicalDrive;
+	set_bytes_per_sector(SelectedDrive.SectorSize);
+
+	stage_size -= stage_size % SelectedDrive.SectorSize;
+	if (stage_size != 0)
+		// Windows' WriteFile() may require a buffer that is aligned to the sector size
+		fake_fd._stage = _mm_malloc((size_t)stage_size, 4096);
+	if (fake_fd._stage != NULL) {
+		fake_fd._stage_size = stage_size;
+		if (read_sectors(hPhysicalDrive, SelectedDrive.SectorSize, 0,
+			stage_size / SelectedDrive.SectorSize, fake_fd._stage) <= 0) {
+			// Fall back to unstaged, per access, reads and writes
+			safe_mm_free(fake_fd._stage);
+			fake_fd._stage_size = 0;
+		}
+	}
+
+	if ((!WriteMBR(fp)) || (!WriteSBR(fp)))
+		goto out;
+	if (fake_fd._stage != NULL) {
+		if (write_sectors(hPhysicalDrive, SelectedDrive.SectorSize, 0,
+			stage_size / SelectedDrive.SectorSize, fake_fd._stage) <= 0)
+			goto out;
+		// Make sure the composed boot records have reached the medium
+		WriteBarrier(hPhysicalDrive, WB_METADATA);
+	}
+	r = TRUE;
+
+	// Tell the system we've updated the disk properties
+	if (!DeviceIoControl(hPhysicalDrive, IOCTL_DISK_UPDATE_PROPERTIES, NULL, 0, NULL, 0, &size, NULL))
+		uprintf("Failed to notify system about disk properties update: %s\n", WindowsErrorString());
+
+out:
+	safe_mm_free(fake_fd._stage);
+	return r;
+}
+
 /*
  * Process the Partition Boot Record
  */
@@ -998,6 +1230,8 @@ static __inline const char* bt_to_name(void) {
 BOOL WritePBR(HANDLE hLogicalVolume)
 {
 	int i;
+	BOOL r = FALSE;
+	uint64_t stage_size = max(64 * KB, 16 * (uint64_t)SelectedDrive.SectorSize);
 	FAKE_FD fake_fd = { 0 };
 	FILE* fp = (FILE*)&fake_fd;
 	const char* using_msg = "Using %s %s partition boot record";
@@ -1005,6 +1239,21 @@ BOOL WritePBR(HANDLE hLogicalVolume)
 	fake_fd._handle = (char*)hLogicalVolume;
 	set_bytes_per_sector(SelectedDrive.SectorSize);
 
+	// Stage the start of the volume, so that the per-variant boot record
+	// patch cycles below compose in memory and are committed as a single
+	// aligned write, instead of each paying for its own read-modify-write
+	// against the most rewritten sectors of the volume.
+	fake_fd._stage = _mm_malloc((size_t)stage_size, 4096);
+	if (fake_fd._stage != NULL) {
+		fake_fd._stage_size = stage_size;
+		if (read_sectors(hLogicalVolume, SelectedDrive.SectorSize, 0,
+			stage_size / SelectedDrive.SectorSize, fake_fd._stage) <= 0) {
+			// Fall back to unstaged, per access, reads and writes
+			safe_mm_free(fake_fd._stage);
+			fake_fd._stage_size = 0;
+		}
+	}
+
 	switch (actual_fs_type) {
 	case FS_FAT16:
 		uprintf(using_msg, bt_to_name(), "FAT16");
@@ -1025,7 +1274,7 @@ BOOL WritePBR(HANDLE hLogicalVolume)
 		// Disk Drive ID needs to be corrected on XP
 		if (!write_partition_physical_disk_drive_id_fat16(fp))
 			break;
-		return TRUE;
+		goto commit;
 	case FS_FAT32:
 		uprintf(using_msg, bt_to_name(), "FAT32");
 		for (i = 0; i < 2; i++) {
@@ -1053,7 +1302,7 @@ BOOL WritePBR(HANDLE hLogicalVolume)
 				break;
 			fake_fd._offset += 6 * SelectedDrive.SectorSize;
 		}
-		return TRUE;
+		goto commit;
 	case FS_NTFS:
 		uprintf(using_msg, bt_to_name(), "NTFS");
 		if (!is_ntfs_fs(fp)) {
@@ -1065,17 +1314,35 @@ BOOL WritePBR(HANDLE hLogicalVolume)
 		// Note: NTFS requires a full remount after writing the PBR. We dismount when we lock
 		// and also go through a forced remount, so that shouldn't be an issue.
 		// But with NTFS, if you don't remount, you don't boot!
-		return TRUE;
+		goto commit;
 	case FS_EXT2:
 	case FS_EXT3:
 	case FS_EXT4:
-		return TRUE;
+		// Nothing to patch - skip the staged commit altogether
+		r = TRUE;
+		goto out;
 	default:
 		uprintf("Unsupported FS for FS BR processing - aborting\n");
 		break;
 	}
 	FormatStatus = ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|ERROR_WRITE_FAULT;
-	return FALSE;
+	goto out;
+
+commit:
+	if (fake_fd._stage != NULL) {
+		if (write_sectors(hLogicalVolume, SelectedDrive.SectorSize, 0,
+			stage_size / SelectedDrive.SectorSize, fake_fd._stage) <= 0) {
+			FormatStatus = ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|ERROR_WRITE_FAULT;
+			goto out;
+		}
+		// Make sure the composed boot records have reached the medium
+		WriteBarrier(hLogicalVolume, WB_METADATA);
+	}
+	r = TRUE;
+
+out:
+	safe_mm_free(fake_fd._stage);
+	return r;
 }
 
 /*
@@ -1338,10 +1605,68 @@ out:
 // As opposed to the technet guide above, we don't set internal drives offline,
 // due to people wondering why they can't see them by default and we also use
 // bcdedit rather than 'unattend.xml' to disable the recovery environment.
+// EFI System Partition preparation for Windows To Go. This only depends on the
+// partition table, not on any of the applied files, so SetupWinToGo() runs it on
+// a worker thread, concurrently with the WIM apply of the main partition.
+static struct {
+	DWORD drive_index;
+	char* ms_efi;
+	BOOL success;
+} wtg_esp = { 0 };
+
+static DWORD WINAPI WtgPrepareEspThread(LPVOID param)
+{
+	ULONG cluster_size;
+
+	uprintf("Setting up EFI System Partition");
+	// According to Ubuntu (https://bugs.launchpad.net/ubuntu/+source/partman-efi/+bug/811485) you want to use FAT32.
+	// However, you have to be careful that the cluster size needs to be greater or equal to the sector size, which
+	// in turn has an impact on the minimum EFI partition size we can create (see ms_efi_size_MB in drive.c)
+	if (SelectedDrive.SectorSize <= 1024)
+		cluster_size = 1024;
+	else if (SelectedDrive.SectorSize <= 4096)
+		cluster_size = 4096;
+	else	// Go for broke
+		cluster_size = (ULONG)SelectedDrive.SectorSize;
+	// Boy do you *NOT* want to specify a label here, and spend HOURS figuring out why your EFI partition cannot boot...
+	// Also, we use the Large FAT32 facility Microsoft APIs are *UTTERLY USELESS* for achieving what we want:
+	// VDS cannot list ESP volumes (talk about allegedly improving on the old disk and volume APIs, only to
+	// completely neuter it) and IVdsDiskPartitionMF::FormatPartitionEx(), which is what you are supposed to
+	// use for ESPs, explicitly states: "This method cannot be used to format removable media."
+	if (!FormatPartition(wtg_esp.drive_index, partition_offset[PI_ESP], cluster_size, FS_FAT32, "",
+		FP_QUICK | FP_FORCE | FP_LARGE_FAT32 | FP_NO_BOOT)) {
+		uprintf("Could not format EFI System Partition");
+		return 1;
+	}
+	Sleep(200);
+	// Need to have the ESP mounted to invoke bcdboot
+	wtg_esp.ms_efi = AltMountVolume(wtg_esp.drive_index, partition_offset[PI_ESP], FALSE);
+	if (wtg_esp.ms_efi == NULL) {
+		FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | APPERR(ERROR_CANT_ASSIGN_LETTER);
+		return 1;
+	}
+	wtg_esp.success = TRUE;
+	return 0;
+}
+
+// Wait for the ESP preparation worker and unmount anything it left mounted.
+// Only needed when bailing out before the ESP gets used.
+static void WtgAbortEspPreparation(HANDLE esp_thread)
+{
+	if (esp_thread == NULL)
+		return;
+	WaitForSingleObject(esp_thread, INFINITE);
+	CloseHandle(esp_thread);
+	if (wtg_esp.ms_efi != NULL) {
+		AltUnmountVolume(wtg_esp.ms_efi, FALSE);
+		wtg_esp.ms_efi = NULL;
+	}
+}
+
 static BOOL SetupWinToGo(DWORD DriveIndex, const char* drive_name, BOOL use_esp)
 {
 	char *mounted_iso, *ms_efi = NULL, mounted_image_path[128], cmd[MAX_PATH];
-	ULONG cluster_size;
+	HANDLE esp_thread = NULL;
 
 	uprintf("Windows To Go mode selected");
 	// Additional sanity checks
@@ -1350,11 +1675,23 @@ static BOOL SetupWinToGo(DWORD DriveIndex, const char* drive_name, BOOL use_esp)
 		return FALSE;
 	}
 
+	if (use_esp) {
+		// The ESP preparation (format + mount) doesn't depend on any of the applied
+		// files, so run it concurrently with the WIM apply instead of after it
+		wtg_esp.drive_index = DriveIndex;
+		wtg_esp.ms_efi = NULL;
+		wtg_esp.success = FALSE;
+		esp_thread = CreateThread(NULL, 0, WtgPrepareEspThread, NULL, 0, NULL);
+		if (esp_thread == NULL)
+			uprintf("Unable to start ESP preparation thread - will prepare the ESP after apply");
+	}
+
 	if (!img_report.is_windows_img) {
 		mounted_iso = MountISO(image_path);
 		if (mounted_iso == NULL) {
 			uprintf("Could not mount ISO for Windows To Go installation");
 			FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | APPERR(ERROR_ISO_EXTRACT);
+			WtgAbortEspPreparation(esp_thread);
 			return FALSE;
 		}
 		static_sprintf(mounted_image_path, "%s%s", mounted_iso, &img_report.wininst_path[wininst_index][2]);
@@ -1368,37 +1705,29 @@ static BOOL SetupWinToGo(DWORD DriveIndex, const char* drive_name, BOOL use_esp)
 			FormatStatus = ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|APPERR(ERROR_ISO_EXTRACT);
 		if (!img_report.is_windows_img)
 			UnMountISO();
+		WtgAbortEspPreparation(esp_thread);
 		return FALSE;
 	}
 	if (!img_report.is_windows_img)
 		UnMountISO();
 
 	if (use_esp) {
-		uprintf("Setting up EFI System Partition");
-		// According to Ubuntu (https://bugs.launchpad.net/ubuntu/+source/partman-efi/+bug/811485) you want to use FAT32.
-		// However, you have to be careful that the cluster size needs to be greater or equal to the sector size, which
-		// in turn has an impact on the minimum EFI partition size we can create (see ms_efi_size_MB in drive.c)
-		if (SelectedDrive.SectorSize <= 1024)
-			cluster_size = 1024;
-		else if (SelectedDrive.SectorSize <= 4096)
-			cluster_size = 4096;
-		else	// Go for broke
-			cluster_size = (ULONG)SelectedDrive.SectorSize;
-		// Boy do you *NOT* want to specify a label here, and spend HOURS figuring out why your EFI partition cannot boot...
-		// Also, we use the Large FAT32 facility Microsoft APIs are *UTTERLY USELESS* for achieving what we want:
-		// VDS cannot list ESP volumes (talk about allegedly improving on the old disk and volume APIs, only to
-		// completely neuter it) and IVdsDiskPartitionMF::FormatPartitionEx(), which is what you are supposed to
-		// use for ESPs, explicitly states: "This method cannot be used to format removable media."
-		if (!FormatPartition(DriveIndex, partition_offset[PI_ESP], cluster_size, FS_FAT32, "",
-			FP_QUICK | FP_FORCE | FP_LARGE_FAT32 | FP_NO_BOOT)) {
-			uprintf("Could not format EFI System Partition");
-			return FALSE;
+		// Collect the ESP that was prepared while the image was being applied.
+		// bcdboot itself has to wait for the apply, since it copies its boot
+		// files from the \Windows directory we just populated.
+		if (esp_thread != NULL) {
+			WaitForSingleObject(esp_thread, INFINITE);
+			CloseHandle(esp_thread);
+			esp_thread = NULL;
+		} else {
+			// Fall back to preparing the ESP synchronously
+			IGNORE_RETVAL(WtgPrepareEspThread(NULL));
 		}
-		Sleep(200);
-		// Need to have the ESP mounted to invoke bcdboot
-		ms_efi = AltMountVolume(DriveIndex, partition_offset[PI_ESP], FALSE);
-		if (ms_efi == NULL) {
-			FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | APPERR(ERROR_CANT_ASSIGN_LETTER);
+		ms_efi = wtg_esp.ms_efi;
+		wtg_esp.ms_efi = NULL;
+		if (!wtg_esp.success) {
+			if (ms_efi != NULL)
+				AltUnmountVolume(ms_efi, FALSE);
 			return FALSE;
 		}
 	}
@@ -1530,22 +1859,140 @@ static void update_progress(const uint64_t processed_bytes)
 	}
 }
 
+// Write-behind machinery for compressed image writes: bled (which performs the
+// source reads and the decompression) runs on the format thread and enqueues
+// decompressed data into a ring of buffers, while a separate worker thread
+// drains that ring to the device. This decouples decompression stalls from
+// device write stalls, so neither has to wait for the other.
+#define WB_NUM_SLOTS  8
+#define WB_SLOT_SIZE  (2 * 1024 * 1024)
+
+static uint8_t* wb_buf = NULL;
+static DWORD wb_len[WB_NUM_SLOTS];
+static HANDLE wb_thread = NULL, wb_sem_free = NULL, wb_sem_data = NULL;
+static int wb_fd = -1, wb_head, wb_tail;
+static BOOL wb_error;
+
+static DWORD WINAPI WriteBehindThread(void* param)
+{
+	uint64_t start;
+	int written;
+
+	while (TRUE) {
+		// Time spent waiting for data = the decompressor is the laggard
+		start = GetTickCount64();
+		if (WaitForSingleObject(wb_sem_data, INFINITE) != WAIT_OBJECT_0) {
+			wb_error = TRUE;
+			return 1;
+		}
+		PipelineStatsAccount(PS_DECOMPRESS, 0, GetTickCount64() - start);
+		// A zero length slot is the end-of-stream marker
+		if (wb_len[wb_tail] == 0)
+			return 0;
+		if (!wb_error) {
+			start = GetTickCount64();
+			written = _write(wb_fd, &wb_buf[wb_tail * WB_SLOT_SIZE], wb_len[wb_tail]);
+			PipelineStatsAccount(PS_DEVICE_WRITE, wb_len[wb_tail], GetTickCount64() - start);
+			if (written != (int)wb_len[wb_tail]) {
+				uprintf("\r\nWrite error: %s", WindowsErrorString());
+				wb_error = TRUE;
+			}
+		}
+		wb_tail = (wb_tail + 1) % WB_NUM_SLOTS;
+		ReleaseSemaphore(wb_sem_free, 1, NULL);
+	}
+}
+
+// Enqueue data for the write-behind thread, splitting into slots as needed.
+// Matches the signature of the write function expected by bled.
+static int write_behind(int fd, const void* buf, unsigned int count)
+{
+	uint64_t start;
+	unsigned int pos, chunk;
+
+	wb_fd = fd;
+	PipelineStatsAccount(PS_DECOMPRESS, count, 0);
+	for (pos = 0; pos < count; pos += chunk) {
+		chunk = MIN(count - pos, WB_SLOT_SIZE);
+		// Time spent waiting for a free slot = the device is the laggard
+		start = GetTickCount64();
+		if (WaitForSingleObject(wb_sem_free, DRIVE_ACCESS_TIMEOUT) != WAIT_OBJECT_0)
+			return -1;
+		PipelineStatsAccount(PS_DEVICE_WRITE, 0, GetTickCount64() - start);
+		if (wb_error)
+			return -1;
+		LargeMemcpy(&wb_buf[wb_head * WB_SLOT_SIZE], &((const uint8_t*)buf)[pos], chunk);
+		wb_len[wb_head] = chunk;
+		wb_head = (wb_head + 1) % WB_NUM_SLOTS;
+		ReleaseSemaphore(wb_sem_data, 1, NULL);
+	}
+	return (int)count;
+}
+
+static BOOL StartWriteBehind(void)
+{
+	wb_head = wb_tail = 0;
+	wb_fd = -1;
+	wb_error = FALSE;
+	wb_buf = (uint8_t*)_mm_malloc(WB_NUM_SLOTS * WB_SLOT_SIZE, SelectedDrive.SectorSize);
+	wb_sem_free = CreateSemaphore(NULL, WB_NUM_SLOTS, WB_NUM_SLOTS, NULL);
+	wb_sem_data = CreateSemaphore(NULL, 0, WB_NUM_SLOTS, NULL);
+	if ((wb_buf == NULL) || (wb_sem_free == NULL) || (wb_sem_data == NULL))
+		return FALSE;
+	wb_thread = CreateThread(NULL, 0, WriteBehindThread, NULL, 0, NULL);
+	return (wb_thread != NULL);
+}
+
+// Flush remaining data, stop the write-behind thread and report whether all
+// the queued device writes were successful.
+static BOOL StopWriteBehind(void)
+{
+	if (wb_thread != NULL) {
+		// Enqueue the end-of-stream marker
+		if (WaitForSingleObject(wb_sem_free, DRIVE_ACCESS_TIMEOUT) == WAIT_OBJECT_0) {
+			wb_len[wb_head] = 0;
+			wb_head = (wb_head + 1) % WB_NUM_SLOTS;
+			ReleaseSemaphore(wb_sem_data, 1, NULL);
+			if (WaitForSingleObject(wb_thread, DRIVE_ACCESS_TIMEOUT) != WAIT_OBJECT_0)
+				wb_error = TRUE;
+		} else {
+			wb_error = TRUE;
+		}
+		if (wb_error)
+			TerminateThread(wb_thread, 1);
+		CloseHandle(wb_thread);
+		wb_thread = NULL;
+	}
+	safe_closehandle(wb_sem_free);
+	safe_closehandle(wb_sem_data);
+	safe_mm_free(wb_buf);
+	return !wb_error;
+}
+
 // Some compressed images use streams that aren't multiple of the sector
 // size and cause write failures => Use a write override that alleviates
 // the problem. See GitHub issue #1422 for details.
 static int sector_write(int fd, const void* _buf, unsigned int count)
 {
 	const uint8_t* buf = (const uint8_t*)_buf;
+	uint64_t start;
 	unsigned int sec_size = (unsigned int)SelectedDrive.SectorSize;
 	int written, fill_size = 0;
 
 	if (sec_size == 0)
 		sec_size = 512;
 
+	// Every decompressed byte goes through this call exactly once, in
+	// order, which makes it the place to tee the data into the checksum
+	// stream set up by WriteDrive().
+	start = GetTickCount64();
+	HashStreamWrite(buf, count);
+	PipelineStatsAccount(PS_HASH, count, GetTickCount64() - start);
+
 	// If we are on a sector boundary and count is multiple of the
-	// sector size, just issue a regular write
+	// sector size, just enqueue a regular write
 	if ((sec_buf_pos == 0) && (count % sec_size == 0))
-		return _write(fd, buf, count);
+		return write_behind(fd, buf, count);
 
 	// If we have an existing partial sector, fill and write it
 	if (sec_buf_pos > 0) {
@@ -1556,20 +2003,20 @@ static int sector_write(int fd, const void* _buf, unsigned int count)
 		if (sec_buf_pos < sec_size)
 			return (int)count;
 		sec_buf_pos = 0;
-		written = _write(fd, sec_buf, sec_size);
+		written = write_behind(fd, sec_buf, sec_size);
 		if (written != sec_size)
 			return written;
 	}
 
 	// Now write as many full sectors as we can
 	uint32_t sec_num = (count - fill_size) / sec_size;
-	written = _write(fd, &buf[fill_size], sec_num * sec_size);
+	written = write_behind(fd, &buf[fill_size], sec_num * sec_size);
 	if (written < 0)
 		return written;
 	else if (written != sec_num * sec_size)
 		return fill_size + written;
 	sec_buf_pos = count - fill_size - written;
-	assert(sec_buf_pos < sec_size);
+	hp_assert(sec_buf_pos < sec_size);
 
 	// Keep leftover bytes, if any, in the sector buffer
 	if (sec_buf_pos != 0)
@@ -1577,62 +2024,517 @@ static int sector_write(int fd, const void* _buf, unsigned int count)
 	return (int)count;
 }
 
-/* Write an image file or zero a drive */
-static BOOL WriteDrive(HANDLE hPhysicalDrive, BOOL bZeroDrive)
+// Extra physical drives that WriteDrive() should flash in parallel with the
+// selected one, from a single source read pipeline. Populated, in multi-target
+// mode (Ctrl-Alt-M), with every other listed drive that is large enough for
+// the image.
+static HANDLE extra_target_drive[MAX_TARGET_DRIVES - 1];
+static int num_extra_targets = 0;
+
+static void OpenExtraTargetDrives(DWORD DriveIndex)
 {
-	BOOL s, ret = FALSE;
-	LARGE_INTEGER li;
-	HANDLE hSourceImage = INVALID_HANDLE_VALUE;
-	DWORD i, read_size[NUM_BUFFERS], write_size, comp_size, buf_size;
-	uint64_t wb, target_size = bZeroDrive ? SelectedDrive.DiskSize : img_report.image_size;
-	uint64_t cur_value, last_value = UINT64_MAX;
-	int64_t bled_ret;
-	uint8_t* buffer = NULL;
-	uint32_t zero_data, *cmp_buffer = NULL;
-	int throttle_fast_zeroing = 0, read_bufnum = 0, proc_bufnum = 1;
+	DWORD drive_index;
+	HANDLE handle;
+	int i;
 
-	if (SelectedDrive.SectorSize < 512) {
-		uprintf("Unexpected sector size (%d) - Aborting", SelectedDrive.SectorSize);
-		return FALSE;
+	for (i = 0; (i < ComboBox_GetCount(hDeviceList)) &&
+		(num_extra_targets < MAX_TARGET_DRIVES - 1); i++) {
+		drive_index = (DWORD)ComboBox_GetItemData(hDeviceList, i);
+		if (drive_index == DriveIndex)
+			continue;
+		if (GetDriveSize(drive_index) < img_report.image_size) {
+			uprintf("Multi-target: skipping drive %d (too small for this image)", drive_index);
+			continue;
+		}
+		RemoveDriveLetters(drive_index, TRUE, TRUE);
+		handle = GetPhysicalHandle(drive_index, lock_drive, TRUE, !lock_drive);
+		if (handle == INVALID_HANDLE_VALUE) {
+			uprintf("Multi-target: could not open drive %d - skipping it", drive_index);
+			continue;
+		}
+		extra_target_drive[num_extra_targets++] = handle;
 	}
+	if (num_extra_targets == 0)
+		uprintf("Multi-target: no other suitable drive found");
+}
 
-	// We poked the MBR and other stuff, so we need to rewind
-	li.QuadPart = 0;
-	if (!SetFilePointerEx(hPhysicalDrive, li, NULL, FILE_BEGIN))
-		uprintf("Warning: Unable to rewind image position - wrong data might be copied!");
-	UpdateProgressWithInfoInit(NULL, FALSE);
+static void CloseExtraTargetDrives(void)
+{
+	int i;
 
-	if (bZeroDrive) {
-		uprintf(fast_zeroing ? "Fast-zeroing drive:" : "Zeroing drive:");
-		// Our buffer size must be a multiple of the sector size and *ALIGNED* to the sector size
-		buf_size = ((DD_BUFFER_SIZE + SelectedDrive.SectorSize - 1) / SelectedDrive.SectorSize) * SelectedDrive.SectorSize;
-		buffer = (uint8_t*)_mm_malloc(buf_size, SelectedDrive.SectorSize);
-		if (buffer == NULL) {
-			FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | ERROR_NOT_ENOUGH_MEMORY;
-			uprintf("Could not allocate disk zeroing buffer");
-			goto out;
-		}
-		assert((uintptr_t)buffer % SelectedDrive.SectorSize == 0);
+	for (i = 0; i < num_extra_targets; i++)
+		safe_unlockclose(extra_target_drive[i]);
+	num_extra_targets = 0;
+}
 
-		// Clear buffer
-		memset(buffer, fast_zeroing ? 0xff : 0x00, buf_size);
+// Check whether a buffer only contains zeroes. Both the sparse device writes
+// and the sparse image capture run this over every buffer, so the bulk of the
+// scan ORs 64 bytes per iteration into an SSE2 accumulator and tests it with
+// a single compare + movemask. SSE2 needs no runtime detection, since it is a
+// Windows 8 platform requirement.
+#if (defined(_M_X64) || defined(__x86_64__) || defined(_M_IX86) || defined(__i386__))
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#define TARGET_SSE2
+#else
+#define TARGET_SSE2 __attribute__ ((target("sse2")))
+#endif
 
-		if (fast_zeroing) {
-			cmp_buffer = (uint32_t*)_mm_malloc(buf_size, SelectedDrive.SectorSize);
-			if (cmp_buffer == NULL) {
-				FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | ERROR_NOT_ENOUGH_MEMORY;
-				uprintf("Could not allocate disk comparison buffer");
-				goto out;
+TARGET_SSE2 static BOOL IsZeroBuffer(const void* buf, DWORD size)
+{
+	const __m128i* p = (const __m128i*)buf;
+	const uint8_t* b = (const uint8_t*)buf;
+	__m128i acc;
+	DWORD i;
+
+	for (i = 0; i + 64 <= size; i += 64, p += 4) {
+		acc = _mm_or_si128(_mm_or_si128(_mm_loadu_si128(p), _mm_loadu_si128(p + 1)),
+			_mm_or_si128(_mm_loadu_si128(p + 2), _mm_loadu_si128(p + 3)));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(acc, _mm_setzero_si128())) != 0xffff)
+			return FALSE;
+	}
+	for (; i < size; i++)
+		if (b[i] != 0)
+			return FALSE;
+	return TRUE;
+}
+#else
+static __inline BOOL IsZeroBuffer(const void* buf, DWORD size)
+{
+	const uint64_t* p = (const uint64_t*)buf;
+	const uint8_t* b = (const uint8_t*)buf;
+	DWORD i;
+
+	for (i = 0; i < size / sizeof(uint64_t); i++)
+		if (p[i] != 0)
+			return FALSE;
+	for (i *= sizeof(uint64_t); i < size; i++)
+		if (b[i] != 0)
+			return FALSE;
+	return TRUE;
+}
+#endif
+
+// How often we should reassess the DD transfer size (in ms)
+#define DD_ADAPT_INTERVAL 1000
+
+// Adaptive sizing of the DD transfer size: start small, then regularly reassess
+// the sustained throughput, doubling the transfer size for as long as doing so
+// still improves it, and settling at the knee of the curve. This avoids both
+// overlong retries on slow media (where a large transfer amplifies the cost of
+// a failed write) and link underutilization on fast UASP/NVMe devices.
+// The settled size is recorded in the settings, per device, and seeds the next
+// run on the same device one doubling step below it, so that the ramp up is
+// mostly skipped while the last step still gets reconfirmed (and can be walked
+// back) every run, letting each host+device pair converge on its own optimum.
+static DWORD AdaptTransferSize(DWORD transfer_size, DWORD max_size, uint64_t wb)
+{
+	static uint64_t last_time = 0, last_wb = 0;
+	static double last_speed = 0.0;
+	static BOOL settled = FALSE;
+	uint64_t now = GetTickCount64();
+	double speed;
+	uint32_t tuned;
+	char* key;
+
+	// A zero position indicates the start of a new write pass
+	if (wb == 0) {
+		last_time = now;
+		last_wb = 0;
+		last_speed = 0.0;
+		settled = FALSE;
+		key = DeviceSettingKey(SETTING_DD_TUNE_PREFIX);
+		if (key != NULL) {
+			tuned = (DWORD)((((uint32_t)ReadSetting32(key)) & 0xffff) * KB) / 2;
+			if (tuned > transfer_size) {
+				while ((transfer_size * 2 <= max_size) && (transfer_size * 2 <= tuned))
+					transfer_size *= 2;
+				uprintf("Seeding DD transfer size at %s, from this device's previous runs",
+					SizeToHumanReadable(transfer_size, FALSE, FALSE));
 			}
-			assert((uintptr_t)cmp_buffer % SelectedDrive.SectorSize == 0);
 		}
+		return transfer_size;
+	}
+	if (settled || (now - last_time < DD_ADAPT_INTERVAL))
+		return transfer_size;
+	speed = (double)(wb - last_wb) / (double)(now - last_time);	// bytes/ms
+	if (last_speed > 0.0) {
+		if (speed < last_speed * 0.95) {
+			// Last size increase actually degraded throughput => revert it
+			transfer_size /= 2;
+			settled = TRUE;
+		} else if (speed < last_speed * 1.05) {
+			// Last size increase didn't improve throughput => we found the knee
+			settled = TRUE;
+		}
+	}
+	if (!settled) {
+		if (transfer_size * 2 <= max_size) {
+			transfer_size *= 2;
+		} else {
+			settled = TRUE;
+		}
+		last_speed = speed;
+		last_time = now;
+		last_wb = wb;
+	}
+	if (settled) {
+		uprintf("\r\nSettled on %s DD transfer size (%0.1f MB/s)",
+			SizeToHumanReadable(transfer_size, FALSE, FALSE), speed / 1048.576);
+		// Record the settled size (in KB, low word) along with the throughput
+		// it achieved (in MB/s, high word), to seed future runs on this device
+		key = DeviceSettingKey(SETTING_DD_TUNE_PREFIX);
+		if (key != NULL)
+			WriteSetting32(key, (int32_t)(((DWORD)(transfer_size / KB) & 0xffff) |
+				(min((uint32_t)(speed / 1048.576), 0xffff) << 16)));
+	}
+	return transfer_size;
+}
 
-		read_size[0] = buf_size;
-		for (wb = 0, write_size = 0; wb < target_size; wb += write_size) {
-			UpdateProgressWithInfo(OP_FORMAT, fast_zeroing ? MSG_306 : MSG_286, wb, target_size);
-			cur_value = (wb * min(80, target_size)) / target_size;
-			if (cur_value != last_value) {
-				last_value = cur_value;
+// Progress journal for resumable DD writes: the furthest fully completed
+// device offset is regularly persisted to the settings store, along with
+// enough image/device identity to detect staleness, so that an interrupted
+// write of a large image can restart close to where it left off rather than
+// from scratch. We back off by a safety margin on resume, since completed
+// writes may still have been sitting in the drive's cache.
+#define JOURNAL_GRANULARITY  (64 * 1024 * 1024)
+
+static uint64_t GetJournaledOffset(void)
+{
+	char* journal_image = ReadSettingStr(SETTING_DD_JOURNAL_IMAGE);
+	uint64_t offset;
+
+	if ((journal_image == NULL) || (journal_image[0] == 0) ||
+		(safe_strcmp(journal_image, image_path) != 0))
+		return 0;
+	if ((uint64_t)ReadSetting64(SETTING_DD_JOURNAL_IMAGE_SIZE) != img_report.image_size)
+		return 0;
+	if ((DWORD)ReadSetting32(SETTING_DD_JOURNAL_DEVICE) != SelectedDrive.DeviceNumber)
+		return 0;
+	offset = (uint64_t)ReadSetting64(SETTING_DD_JOURNAL_OFFSET);
+	// Back off by one journal interval, and round down to a sector boundary
+	offset = (offset > JOURNAL_GRANULARITY) ? offset - JOURNAL_GRANULARITY : 0;
+	offset = (offset / SelectedDrive.SectorSize) * SelectedDrive.SectorSize;
+	return offset;
+}
+
+static void UpdateJournaledOffset(uint64_t offset)
+{
+	static uint64_t last_journaled = 0;
+
+	if (offset == 0) {
+		last_journaled = 0;
+		WriteSettingStr(SETTING_DD_JOURNAL_IMAGE, image_path);
+		WriteSetting64(SETTING_DD_JOURNAL_IMAGE_SIZE, img_report.image_size);
+		WriteSetting32(SETTING_DD_JOURNAL_DEVICE, SelectedDrive.DeviceNumber);
+		WriteSetting64(SETTING_DD_JOURNAL_OFFSET, 0);
+		return;
+	}
+	if (offset - last_journaled < JOURNAL_GRANULARITY)
+		return;
+	last_journaled = offset;
+	WriteSetting64(SETTING_DD_JOURNAL_OFFSET, offset);
+}
+
+static void ClearJournaledOffset(void)
+{
+	WriteSettingStr(SETTING_DD_JOURNAL_IMAGE, "");
+	WriteSetting64(SETTING_DD_JOURNAL_IMAGE_SIZE, 0);
+	WriteSetting32(SETTING_DD_JOURNAL_DEVICE, 0);
+	WriteSetting64(SETTING_DD_JOURNAL_OFFSET, 0);
+}
+
+// Persist the exact confirmed offset, bypassing the granularity threshold.
+// Used when a write is aborted, so that a subsequent attempt resumes from the
+// furthest acknowledged data instead of the last journal mark, which may be
+// up to JOURNAL_GRANULARITY behind it.
+static void FlushJournaledOffset(uint64_t offset)
+{
+	if (offset != 0)
+		WriteSetting64(SETTING_DD_JOURNAL_OFFSET, offset);
+}
+
+// Injectable performance model, for benchmarking the write pipeline against a
+// disposable target (e.g. a file-backed VHD attached with virtual disk listing
+// enabled) instead of sacrificing physical sticks. Controlled through the
+// VirtualTarget* ini settings and only active when at least one of them is
+// nonzero: per-operation latency in ms, bandwidth cap in MB/s, and an injected
+// error rate in failures per 10000 writes. Combined with batch mode, this
+// allows scripted, reproducible pipeline measurements.
+static struct {
+	BOOL enabled;
+	uint32_t latency;
+	uint32_t bandwidth;
+	uint32_t error_rate;
+	uint32_t seed;
+	uint64_t start_time;
+	uint64_t bytes;
+} vt_model;
+
+static void VirtualTargetInit(void)
+{
+	vt_model.latency = (uint32_t)ReadSetting32(SETTING_VIRTUAL_TARGET_LATENCY);
+	vt_model.bandwidth = (uint32_t)ReadSetting32(SETTING_VIRTUAL_TARGET_BANDWIDTH);
+	vt_model.error_rate = (uint32_t)ReadSetting32(SETTING_VIRTUAL_TARGET_ERROR_RATE);
+	vt_model.enabled = (vt_model.latency != 0) || (vt_model.bandwidth != 0) || (vt_model.error_rate != 0);
+	// Fixed seed, so that the error pattern repeats from one run to the next
+	vt_model.seed = 0x48904730;
+	vt_model.start_time = GetTickCount64();
+	vt_model.bytes = 0;
+	if (vt_model.enabled)
+		uprintf("Virtual target model: latency %u ms, bandwidth %u MB/s, error rate %u/10000",
+			vt_model.latency, vt_model.bandwidth, vt_model.error_rate);
+}
+
+// Returns FALSE when the model injects a failure for this write, after sleeping
+// as needed to enforce the latency and bandwidth settings.
+static BOOL VirtualTargetWrite(DWORD size)
+{
+	uint64_t due;
+
+	if (!vt_model.enabled)
+		return TRUE;
+	if (vt_model.latency != 0)
+		Sleep(vt_model.latency);
+	if (vt_model.bandwidth != 0) {
+		vt_model.bytes += size;
+		// Stall until the running average drops back under the cap
+		due = vt_model.start_time + vt_model.bytes / (vt_model.bandwidth * MB / 1000ULL);
+		if (due > GetTickCount64())
+			Sleep((DWORD)(due - GetTickCount64()));
+	}
+	if (vt_model.error_rate != 0) {
+		// xorshift32
+		vt_model.seed ^= vt_model.seed << 13;
+		vt_model.seed ^= vt_model.seed >> 17;
+		vt_model.seed ^= vt_model.seed << 5;
+		if (vt_model.seed % 10000 < vt_model.error_rate) {
+			SetLastError(ERROR_IO_DEVICE);
+			return FALSE;
+		}
+	}
+	return TRUE;
+}
+
+// Synchronous chunk write with partial-chunk replay and staged backoff: retries
+// resume from the last acknowledged byte instead of re-sending the whole chunk,
+// and start with a short pause - transient hub glitches usually clear within
+// tens of milliseconds - only escalating to the long WRITE_TIMEOUT wait once
+// the short ones have failed to help.
+static BOOL WriteChunkWithRetry(HANDLE hDrive, uint8_t* chunk, DWORD size, uint64_t StartOffset)
+{
+	BOOL s;
+	DWORD i, write_size, written = 0, backoff = WRITE_BACKOFF;
+	LARGE_INTEGER li;
+	uint64_t stage_start;
+
+	for (i = 1; i <= WRITE_RETRIES; i++) {
+		CHECK_FOR_USER_CANCEL;
+		stage_start = GetTickCount64();
+		write_size = 0;
+		s = VirtualTargetWrite(size - written) &&
+			WriteFile(hDrive, &chunk[written], size - written, &write_size, NULL);
+		PipelineStatsAccount(PS_DEVICE_WRITE, write_size, GetTickCount64() - stage_start);
+		if ((s) && (write_size == size - written))
+			return TRUE;
+		if (s) {
+			uprintf("\r\nWrite error: Wrote %d bytes, expected %d bytes", write_size, size - written);
+			if (write_size != 0) {
+				// The device acknowledged part of the chunk, so resume after it
+				// and grant a fresh set of retries for the remainder
+				written += write_size;
+				i = 0;
+				backoff = WRITE_BACKOFF;
+			}
+		} else {
+			uprintf("\r\nWrite error at sector %lld: %s",
+				(StartOffset + written) / SelectedDrive.SectorSize, WindowsErrorString());
+		}
+		if (i < WRITE_RETRIES) {
+			uprintf("Retrying in %d.%03d seconds...", backoff / 1000, backoff % 1000);
+			if (SleepOrCancel(backoff))
+				goto out;
+			backoff = min(backoff * 4, WRITE_TIMEOUT);
+			li.QuadPart = StartOffset + written;
+			if (!SetFilePointerEx(hDrive, li, NULL, FILE_BEGIN)) {
+				uprintf("Write error: Could not reset position - %s", WindowsErrorString());
+				return FALSE;
+			}
+		}
+	}
+	FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | ERROR_WRITE_FAULT;
+out:
+	return FALSE;
+}
+
+// Wait for a previously issued overlapped write to complete, reissuing the part
+// of it that was not acknowledged, with the same backoff policy as above, if it
+// failed.
+static BOOL WaitForAsyncWriteEx(HANDLE hTargetDrive, DWORD slot, uint8_t* buf, uint64_t offset, DWORD size)
+{
+	DWORD i, write_size, written = 0, backoff = WRITE_BACKOFF;
+
+	for (i = 1; i <= WRITE_RETRIES; i++) {
+		if (IS_ERROR(FormatStatus) && (SCODE_CODE(FormatStatus) == ERROR_CANCELLED))
+			return FALSE;
+		write_size = 0;
+		if (WaitFileAsyncEx(hTargetDrive, slot, DRIVE_ACCESS_TIMEOUT) &&
+			GetSizeAsyncEx(hTargetDrive, slot, &write_size)) {
+			// Apply the device model only once the real operation has been
+			// collected, so that an injected failure can safely reissue the slot
+			if (!VirtualTargetWrite(write_size))
+				write_size = 0;
+			else if (write_size == size - written)
+				return TRUE;
+		}
+		if ((write_size != 0) && (write_size < size - written)) {
+			uprintf("\r\nWrite error: Wrote %d bytes, expected %d bytes", write_size, size - written);
+			// Part of the transfer was acknowledged - only replay the remainder
+			written += write_size;
+			i = 0;
+			backoff = WRITE_BACKOFF;
+		} else {
+			uprintf("\r\nWrite error at sector %lld: %s",
+				(offset + written) / SelectedDrive.SectorSize, WindowsErrorString());
+		}
+		if (i < WRITE_RETRIES) {
+			uprintf("Retrying in %d.%03d seconds...", backoff / 1000, backoff % 1000);
+			if (SleepOrCancel(backoff))
+				return FALSE;
+			backoff = min(backoff * 4, WRITE_TIMEOUT);
+			SeekFileAsyncEx(hTargetDrive, slot, offset + written);
+			WriteFileAsyncEx(hTargetDrive, slot, &buf[written], size - written);
+		}
+	}
+	FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | ERROR_WRITE_FAULT;
+	return FALSE;
+}
+
+static BOOL WaitForAsyncWrite(HANDLE hTargetDrive, uint8_t* buf, uint64_t offset, DWORD size)
+{
+	return WaitForAsyncWriteEx(hTargetDrive, 0, buf, offset, size);
+}
+
+// Optional post-write verification: read the written data back from the device,
+// with device reads pipelined against hashing, and compare its checksum with
+// that of the source image.
+static BOOL VerifyDrive(HANDLE hPhysicalDrive)
+{
+	LARGE_INTEGER li;
+	uint8_t device_sum[64], image_sum[64];
+
+	// With compressed images, the amount of data written can only be known by
+	// going through the decompressor again, so we don't support these for now.
+	if (img_report.compression_type != BLED_COMPRESSION_NONE) {
+		uprintf("Notice: Post-write verification is not supported for compressed images");
+		return TRUE;
+	}
+	uprintf("Verifying drive against '%s':", image_path);
+	li.QuadPart = 0;
+	if (!SetFilePointerEx(hPhysicalDrive, li, NULL, FILE_BEGIN))
+		uprintf("Warning: Unable to rewind device position");
+	if (!HashPhysicalDrive(CHECKSUM_MD5, hPhysicalDrive, SelectedDrive.SectorSize,
+		img_report.image_size, device_sum))
+		return FALSE;
+	if (!HashFile(CHECKSUM_MD5, image_path, image_sum))
+		return FALSE;
+	if (memcmp(device_sum, image_sum, 16) != 0) {
+		uprintf("Verification FAILED: Device data does not match the source image!");
+		FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | ERROR_CRC;
+		return FALSE;
+	}
+	uprintf("Verification passed: device data matches the source image");
+	return TRUE;
+}
+
+/* Write an image file or zero a drive */
+static BOOL WriteDrive(HANDLE hPhysicalDrive, BOOL bZeroDrive)
+{
+	BOOL s, write_pending = FALSE, ret = FALSE;
+	LARGE_INTEGER li;
+	HANDLE hSourceImage = INVALID_HANDLE_VALUE, hTargetDrive[MAX_TARGET_DRIVES] = { NULL };
+	HANDLE hCompareDrive = INVALID_HANDLE_VALUE;
+	DWORD i, read_size[NUM_BUFFERS], write_size, comp_size, buf_size, transfer_size, max_transfer_size;
+	uint64_t wb, resume_offset, confirmed_offset = 0;
+	uint64_t target_size = bZeroDrive ? SelectedDrive.DiskSize : img_report.image_size;
+	BOOL journal_active = FALSE;
+	uint64_t cur_value, last_value = UINT64_MAX, stage_start;
+	int64_t bled_ret;
+	uint8_t* buffer = NULL;
+	uint8_t image_sum[32];	// SHA256_HASHSIZE
+	char image_sum_str[65];
+	BOOL image_sum_ok = FALSE;
+	uint32_t zero_data, *cmp_buffer = NULL;
+	uint64_t diff_skipped = 0, diff_written = 0;
+	uint64_t zw_offset[2] = { 0 };
+	DWORD zw_size[2] = { 0 };
+	int zw_head = 0, zw_tail = 0, zw_in_flight = 0;
+	int t, stream_ret, throttle_fast_zeroing = 0, read_bufnum = 0, proc_bufnum = 1;
+	// A remote image is fed by net.c's streaming ring buffer instead of a source file
+	BOOL streaming = IsStreamingDownloadActive();
+	// A chunk manifest is fed sequentially from the local dedup store, see cdc.c
+	BOOL cdc = img_report.is_cdc_img;
+
+	if (SelectedDrive.SectorSize < 512) {
+		uprintf("Unexpected sector size (%d) - Aborting", SelectedDrive.SectorSize);
+		return FALSE;
+	}
+
+	// We poked the MBR and other stuff, so we need to rewind
+	li.QuadPart = 0;
+	if (!SetFilePointerEx(hPhysicalDrive, li, NULL, FILE_BEGIN))
+		uprintf("Warning: Unable to rewind image position - wrong data might be copied!");
+	UpdateProgressWithInfoInit(NULL, FALSE);
+
+	if (bZeroDrive) {
+		// Try a whole-drive TRIM first: on devices that support it, blocks are
+		// invalidated wholesale, and any block that subsequently reads back as
+		// zeroes (or erased flash) gets its write skipped by the fast-zeroing
+		// logic below, which can shorten the pass by orders of magnitude.
+		if (fast_zeroing && TrimDriveRange(hPhysicalDrive, 0, target_size))
+			uprintf("Issued whole-drive TRIM");
+		uprintf(fast_zeroing ? "Fast-zeroing drive:" : "Zeroing drive:");
+		// Our buffer size must be a multiple of the sector size and *ALIGNED* to the sector size
+		buf_size = ((DD_BUFFER_SIZE + SelectedDrive.SectorSize - 1) / SelectedDrive.SectorSize) * SelectedDrive.SectorSize;
+		buffer = GetIoBuffer(buf_size);
+		if (buffer == NULL) {
+			FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | ERROR_NOT_ENOUGH_MEMORY;
+			uprintf("Could not allocate disk zeroing buffer");
+			goto out;
+		}
+		hp_assert((uintptr_t)buffer % SelectedDrive.SectorSize == 0);
+
+		// Clear buffer
+		memset(buffer, fast_zeroing ? 0xff : 0x00, buf_size);
+
+		if (fast_zeroing) {
+			cmp_buffer = (uint32_t*)GetIoBuffer(buf_size);
+			if (cmp_buffer == NULL) {
+				FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | ERROR_NOT_ENOUGH_MEMORY;
+				uprintf("Could not allocate disk comparison buffer");
+				goto out;
+			}
+			hp_assert((uintptr_t)cmp_buffer % SelectedDrive.SectorSize == 0);
+		}
+
+		// Use a single sequential protocol on the write handle: writes go through
+		// an overlapped handle at explicit offsets, and fast-zeroing compare reads
+		// through a separate read handle with its own file pointer, so that we
+		// never have to move a file pointer back and forth between operations.
+		hTargetDrive[0] = WrapFileAsync(hPhysicalDrive, GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE,
+			use_unbuffered_io ? FILE_FLAG_NO_BUFFERING | FILE_FLAG_WRITE_THROUGH : 0);
+		if ((hTargetDrive[0] != NULL) && fast_zeroing) {
+			hCompareDrive = ReOpenFile(hPhysicalDrive, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, 0);
+			if (hCompareDrive == INVALID_HANDLE_VALUE)
+				uprintf("Warning: Could not open compare handle - %s", WindowsErrorString());
+		}
+
+		read_size[0] = buf_size;
+		for (wb = 0, write_size = 0; wb < target_size; wb += write_size) {
+			UpdateProgressWithInfo(OP_FORMAT, fast_zeroing ? MSG_306 : MSG_286, wb, target_size);
+			cur_value = (wb * min(80, target_size)) / target_size;
+			if (cur_value != last_value) {
+				last_value = cur_value;
 				uprintfs("+");
 			}
 			// Don't overflow our projected size (mostly for VHDs)
@@ -1652,8 +2554,16 @@ static BOOL WriteDrive(HANDLE hPhysicalDrive, BOOL bZeroDrive)
 			} else if (fast_zeroing) {
 				CHECK_FOR_USER_CANCEL;
 
-				// Read block and compare against the block that needs to be written
-				s = ReadFile(hPhysicalDrive, cmp_buffer, read_size[0], &comp_size, NULL);
+				// Read block and compare against the block that needs to be written.
+				// When we have one, use the dedicated compare handle, so that the
+				// write handle's position is not disturbed.
+				if (hCompareDrive != INVALID_HANDLE_VALUE) {
+					li.QuadPart = wb;
+					s = SetFilePointerEx(hCompareDrive, li, NULL, FILE_BEGIN) &&
+						ReadFile(hCompareDrive, cmp_buffer, read_size[0], &comp_size, NULL);
+				} else {
+					s = ReadFile(hPhysicalDrive, cmp_buffer, read_size[0], &comp_size, NULL);
+				}
 				if ((!s) || (comp_size != read_size[0])) {
 					uprintf("\r\nRead error: Could not read data for fast zeroing comparison - %s", WindowsErrorString());
 					goto out;
@@ -1672,41 +2582,49 @@ static BOOL WriteDrive(HANDLE hPhysicalDrive, BOOL bZeroDrive)
 					}
 				}
 
-				// Move the file pointer position back for writing
-				li.QuadPart = wb;
-				if (!SetFilePointerEx(hPhysicalDrive, li, NULL, FILE_BEGIN)) {
-					uprintf("\r\nError: Could not reset position - %s", WindowsErrorString());
-					goto out;
+				// Only the legacy single-handle mode needs its position moved back
+				if (hCompareDrive == INVALID_HANDLE_VALUE) {
+					li.QuadPart = wb;
+					if (!SetFilePointerEx(hPhysicalDrive, li, NULL, FILE_BEGIN)) {
+						uprintf("\r\nError: Could not reset position - %s", WindowsErrorString());
+						goto out;
+					}
 				}
 				// Throttle read operations
 				throttle_fast_zeroing = 15;
 			}
 
-			for (i = 1; i <= WRITE_RETRIES; i++) {
+			// Explicit-offset overlapped writes, when available. Since the source
+			// buffer never changes, we can keep two writes in flight (one per slot)
+			// and only collect the oldest when both slots are busy, so the device
+			// queue doesn't drain between bursts.
+			if (hTargetDrive[0] != NULL) {
 				CHECK_FOR_USER_CANCEL;
-				s = WriteFile(hPhysicalDrive, buffer, read_size[0], &write_size, NULL);
-				if ((s) && (write_size == read_size[0]))
-					break;
-				if (s)
-					uprintf("\r\nWrite error: Wrote %d bytes, expected %d bytes", write_size, read_size[0]);
-				else
-					uprintf("\r\nWrite error at sector %lld: %s", wb / SelectedDrive.SectorSize, WindowsErrorString());
-				if (i < WRITE_RETRIES) {
-					li.QuadPart = wb;
-					uprintf("Retrying in %d seconds...", WRITE_TIMEOUT / 1000);
-					Sleep(WRITE_TIMEOUT);
-					if (!SetFilePointerEx(hPhysicalDrive, li, NULL, FILE_BEGIN)) {
-						uprintf("Write error: Could not reset position - %s", WindowsErrorString());
+				if (zw_in_flight == ARRAYSIZE(zw_size)) {
+					if (!WaitForAsyncWriteEx(hTargetDrive[0], zw_tail, buffer, zw_offset[zw_tail], zw_size[zw_tail]))
 						goto out;
-					}
-				} else {
-					FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | ERROR_WRITE_FAULT;
-					goto out;
+					zw_tail = (zw_tail + 1) % ARRAYSIZE(zw_size);
+					zw_in_flight--;
 				}
-				Sleep(200);
+				zw_offset[zw_head] = wb;
+				zw_size[zw_head] = read_size[0];
+				SeekFileAsyncEx(hTargetDrive[0], zw_head, wb);
+				WriteFileAsyncEx(hTargetDrive[0], zw_head, buffer, read_size[0]);
+				zw_head = (zw_head + 1) % ARRAYSIZE(zw_size);
+				zw_in_flight++;
+				write_size = read_size[0];
+				continue;
 			}
-			if (i > WRITE_RETRIES)
+
+			if (!WriteChunkWithRetry(hPhysicalDrive, buffer, read_size[0], wb))
 				goto out;
+			write_size = read_size[0];
+		}
+		// Collect the zero-writes still in flight
+		for (; zw_in_flight > 0; zw_in_flight--) {
+			if (!WaitForAsyncWriteEx(hTargetDrive[0], zw_tail, buffer, zw_offset[zw_tail], zw_size[zw_tail]))
+				goto out;
+			zw_tail = (zw_tail + 1) % ARRAYSIZE(zw_size);
 		}
 	} else if (img_report.compression_type != BLED_COMPRESSION_NONE) {
 		uprintf("Writing compressed image:");
@@ -1723,11 +2641,23 @@ static BOOL WriteDrive(HANDLE hPhysicalDrive, BOOL bZeroDrive)
 			uprintf("Could not allocate disk write buffer");
 			goto out;
 		}
-		assert((uintptr_t)sec_buf % SelectedDrive.SectorSize == 0);
+		hp_assert((uintptr_t)sec_buf % SelectedDrive.SectorSize == 0);
 		sec_buf_pos = 0;
-		bled_init(_uprintf, NULL, sector_write, update_progress, NULL, &FormatStatus);
+		if (!StartWriteBehind()) {
+			StopWriteBehind();
+			FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | ERROR_NOT_ENOUGH_MEMORY;
+			uprintf("Could not start write-behind thread");
+			goto out;
+		}
+		// Hash the decompressed data as sector_write() sees it, so that the
+		// checksum of what was written is a free by-product of the operation
+		image_sum_ok = HashStreamInit(CHECKSUM_SHA256);
+		bled_init(DD_BUFFER_SIZE, _uprintf, NULL, sector_write, update_progress, NULL, &FormatStatus);
 		bled_ret = bled_uncompress_with_handles(hSourceImage, hPhysicalDrive, img_report.compression_type);
 		bled_exit();
+		// Flush pending device writes and collect any deferred write error
+		if (!StopWriteBehind() && (bled_ret >= 0))
+			bled_ret = -1;
 		uprintfs("\r\n");
 		if ((bled_ret >= 0) && (sec_buf_pos != 0)) {
 			// A disk image that doesn't end up on disk boundary should be a rare
@@ -1745,30 +2675,111 @@ static BOOL WriteDrive(HANDLE hPhysicalDrive, BOOL bZeroDrive)
 			goto out;
 		}
 	} else {
-		hSourceImage = CreateFileAsync(image_path, GENERIC_READ, FILE_SHARE_READ,
-			OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN);
-		if (hSourceImage == NULL) {
-			uprintf("Could not open image '%s': %s", image_path, WindowsErrorString());
-			FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | ERROR_OPEN_FAILED;
-			goto out;
+		if (cdc) {
+			if (!CdcStreamOpen(image_path, NULL)) {
+				uprintf("Could not open chunk manifest '%s'", image_path);
+				FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | ERROR_OPEN_FAILED;
+				goto out;
+			}
+			uprintf("Streaming image from the dedup store");
+		} else if (!streaming) {
+			hSourceImage = CreateFileAsync(image_path, GENERIC_READ, FILE_SHARE_READ,
+				OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN);
+			if (hSourceImage == NULL) {
+				uprintf("Could not open image '%s': %s", image_path, WindowsErrorString());
+				FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | ERROR_OPEN_FAILED;
+				goto out;
+			}
+			// Source reads usually complete well ahead of the device writes,
+			// so busy-poll them rather than block on an event per buffer
+			SetPollModeAsync(hSourceImage, TRUE);
 		}
 
 		// Our buffer size must be a multiple of the sector size and *ALIGNED* to the sector size
 		buf_size = ((DD_BUFFER_SIZE + SelectedDrive.SectorSize - 1) / SelectedDrive.SectorSize) * SelectedDrive.SectorSize;
-		buffer = (uint8_t*)_mm_malloc(buf_size * NUM_BUFFERS, SelectedDrive.SectorSize);
+		buffer = GetIoBuffer(buf_size * NUM_BUFFERS);
 		if (buffer == NULL) {
 			FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | ERROR_NOT_ENOUGH_MEMORY;
 			uprintf("Could not allocate disk write buffer");
 			goto out;
 		}
-		assert((uintptr_t)buffer % SelectedDrive.SectorSize == 0);
+		hp_assert((uintptr_t)buffer % SelectedDrive.SectorSize == 0);
 
-		// Start the initial read
-		ReadFileAsync(hSourceImage, &buffer[read_bufnum * buf_size], buf_size);
+		// Buffer used to check whether all-zero blocks from the image can be skipped
+		cmp_buffer = (uint32_t*)GetIoBuffer(buf_size);
+		if (cmp_buffer == NULL) {
+			FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | ERROR_NOT_ENOUGH_MEMORY;
+			uprintf("Could not allocate disk comparison buffer");
+			goto out;
+		}
+		hp_assert((uintptr_t)cmp_buffer % SelectedDrive.SectorSize == 0);
+
+		// Reopen the drive(s) for overlapped access, so that the device write of
+		// one buffer can proceed while the next buffer is being read from the
+		// source, and so that any extra target drives are written in parallel.
+		// If requested, also bypass the system file cache, so that multi-GB images
+		// don't evict everything else from memory as they are being written. Our
+		// buffers are sector aligned and sector sized, as unbuffered I/O requires.
+		hTargetDrive[0] = WrapFileAsync(hPhysicalDrive, GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE,
+			use_unbuffered_io ? FILE_FLAG_NO_BUFFERING | FILE_FLAG_WRITE_THROUGH : 0);
+		if (hTargetDrive[0] == NULL)
+			uprintf("Warning: Could not reopen drive for overlapped writes - using synchronous writes");
+		else if (use_unbuffered_io)
+			uprintf("Using unbuffered I/O for device writes");
+		for (t = 0; (hTargetDrive[0] != NULL) && (t < num_extra_targets); t++) {
+			hTargetDrive[t + 1] = WrapFileAsync(extra_target_drive[t], GENERIC_WRITE,
+				FILE_SHARE_READ | FILE_SHARE_WRITE,
+				use_unbuffered_io ? FILE_FLAG_NO_BUFFERING | FILE_FLAG_WRITE_THROUGH : 0);
+			if (hTargetDrive[t + 1] == NULL) {
+				uprintf("Could not reopen extra target drive %d: %s", t + 1, WindowsErrorString());
+				FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | ERROR_OPEN_FAILED;
+				goto out;
+			}
+		}
+		if (num_extra_targets != 0)
+			uprintf("Flashing %d drives in parallel", num_extra_targets + 1);
+
+		// Resume an interrupted write of the same image to the same device, if a
+		// journal entry for it exists. Extra targets cannot be resumed this way,
+		// and neither can a streamed image, which only delivers sequential data.
+		journal_active = (num_extra_targets == 0) && !streaming && !cdc;
+		resume_offset = journal_active ? GetJournaledOffset() : 0;
+		confirmed_offset = resume_offset;
+		if (resume_offset != 0) {
+			uprintf("Resuming interrupted write at offset %lld", resume_offset);
+			SeekFileAsync(hSourceImage, resume_offset);
+			li.QuadPart = resume_offset;
+			if (!SetFilePointerEx(hPhysicalDrive, li, NULL, FILE_BEGIN)) {
+				uprintf("Warning: Could not set resume position - restarting from scratch");
+				SeekFileAsync(hSourceImage, 0);
+				resume_offset = 0;
+			}
+		}
+		UpdateJournaledOffset(0);	// (Re)initialize the journal entry
+
+		// Hash the source data as it is being written, to get the image checksum
+		// without an extra read pass. A resumed write can't cover the full image,
+		// so no hash is produced in that case.
+		if (resume_offset == 0)
+			image_sum_ok = HashStreamInit(CHECKSUM_SHA256);
+
+		// Start the initial read, using a small transfer size that the adaptive
+		// sizer will then grow according to the measured throughput. Don't let it
+		// grow past the adapter's maximum transfer length, as the storage stack
+		// would just split the requests without any throughput to show for it.
+		max_transfer_size = buf_size;
+		if (SelectedDriveCaps.valid && (SelectedDriveCaps.max_transfer_size >= DD_MIN_TRANSFER_SIZE))
+			max_transfer_size = min(buf_size, SelectedDriveCaps.max_transfer_size);
+		transfer_size = ((DD_MIN_TRANSFER_SIZE + SelectedDrive.SectorSize - 1) /
+			SelectedDrive.SectorSize) * SelectedDrive.SectorSize;
+		AdaptTransferSize(transfer_size, max_transfer_size, 0);	// Reset the adaptive sizer
+		if (!streaming && !cdc)
+			ReadFileAsync(hSourceImage, &buffer[read_bufnum * buf_size], transfer_size);
 
 		read_size[proc_bufnum] = 1;	// To avoid early loop exit
-		for (wb = 0; read_size[proc_bufnum] != 0; wb += read_size[proc_bufnum]) {
-			// 0. Update the progress
+		for (wb = resume_offset; read_size[proc_bufnum] != 0; wb += read_size[proc_bufnum]) {
+			// 0. Update the progress and reassess the transfer size
+			transfer_size = AdaptTransferSize(transfer_size, max_transfer_size, wb - resume_offset);
 			UpdateProgressWithInfo(OP_FORMAT, MSG_261, wb, target_size);
 			cur_value = (wb * min(80, target_size)) / target_size;
 			if (cur_value != last_value) {
@@ -1776,71 +2787,390 @@ static BOOL WriteDrive(HANDLE hPhysicalDrive, BOOL bZeroDrive)
 				uprintfs("+");
 			}
 
-			// 1. Wait for the current read operation to complete (and update the read size)
-			if ((!WaitFileAsync(hSourceImage, DRIVE_ACCESS_TIMEOUT)) ||
+			// 1. Wait for the current read operation to complete (and update the read size).
+			// A streamed image has no async read in flight: data is drained from the
+			// download ring buffer instead, which the producer thread keeps filling
+			// while the device writes below are in progress.
+			stage_start = GetTickCount64();
+			if (cdc) {
+				stream_ret = CdcStreamRead(&buffer[read_bufnum * buf_size], transfer_size);
+				if (stream_ret < 0) {
+					uprintf("\r\nRead error: dedup store read failed");
+					FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | ERROR_READ_FAULT;
+					goto out;
+				}
+				read_size[read_bufnum] = (DWORD)stream_ret;
+			} else if (streaming) {
+				stream_ret = StreamingDownloadRead(&buffer[read_bufnum * buf_size], transfer_size);
+				if (stream_ret < 0) {
+					uprintf("\r\nRead error: streaming download failed");
+					FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | ERROR_READ_FAULT;
+					goto out;
+				}
+				read_size[read_bufnum] = (DWORD)stream_ret;
+			} else if ((!WaitFileAsync(hSourceImage, DRIVE_ACCESS_TIMEOUT)) ||
 				(!GetSizeAsync(hSourceImage, &read_size[read_bufnum]))) {
 				uprintf("\r\nRead error: %s", WindowsErrorString());
 				FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | ERROR_READ_FAULT;
 				goto out;
 			}
+			PipelineStatsAccount(PS_SOURCE_READ, read_size[read_bufnum], GetTickCount64() - stage_start);
 
 			// 2. Update the read size
 			// 2a) Don't overflow our projected size (mostly for VHDs)
 			if (wb + read_size[read_bufnum] > target_size)
 				read_size[read_bufnum] = (DWORD)(target_size - wb);
-			// 2b) WriteFile fails unless the size is a multiple of sector size
+			// 2b) Tee the buffer we just read into the checksum stream, before
+			// the sector size rounding below appends bytes that aren't image data
+			if (image_sum_ok) {
+				stage_start = GetTickCount64();
+				HashStreamWrite(&buffer[read_bufnum * buf_size], read_size[read_bufnum]);
+				PipelineStatsAccount(PS_HASH, read_size[read_bufnum], GetTickCount64() - stage_start);
+			}
+			// 2c) WriteFile fails unless the size is a multiple of sector size
 			if (read_size[read_bufnum] % SelectedDrive.SectorSize != 0)
 				read_size[read_bufnum] = ((read_size[read_bufnum] + SelectedDrive.SectorSize - 1) /
 					SelectedDrive.SectorSize) * SelectedDrive.SectorSize;
 
-			// 3. Switch to the next reading buffer
+			// 3. Wait for the overlapped write(s) of the previous buffer to complete, as
+			// we are about to reuse it for reading. Note that at this stage, wb has already
+			// been incremented with the size of that previous write.
+			if (write_pending) {
+				stage_start = GetTickCount64();
+				for (t = 0; t <= num_extra_targets; t++) {
+					if (!WaitForAsyncWrite(hTargetDrive[t], &buffer[proc_bufnum * buf_size],
+						wb - read_size[proc_bufnum], read_size[proc_bufnum]))
+						goto out;
+				}
+				PipelineStatsAccount(PS_DEVICE_WRITE, read_size[proc_bufnum], GetTickCount64() - stage_start);
+				write_pending = FALSE;
+				confirmed_offset = wb;
+				UpdateJournaledOffset(wb);
+			}
+
+			// 4. Switch to the next reading buffer
 			proc_bufnum = read_bufnum;
 			read_bufnum = (read_bufnum + 1) % NUM_BUFFERS;
 
-			// 3. Launch the next asynchronous read operation
-			ReadFileAsync(hSourceImage, &buffer[read_bufnum * buf_size], buf_size);
+			// 5. Launch the next asynchronous read operation
+			if (!streaming && !cdc)
+				ReadFileAsync(hSourceImage, &buffer[read_bufnum * buf_size], transfer_size);
+
+			// 6. Differential re-flash: when enabled, read back the matching device
+			// data and skip the write when it already matches the source, so that
+			// re-provisioning a mostly unchanged device only writes the delta.
+			// Unlike the zero-skip below, every block is compared, as the read back
+			// being wasted on a changed device is precisely what this mode trades
+			// against the much more expensive flash writes on an unchanged one.
+			if (use_differential_write && (num_extra_targets == 0) && (read_size[proc_bufnum] != 0)) {
+				CHECK_FOR_USER_CANCEL;
+				li.QuadPart = wb;
+				if (SetFilePointerEx(hPhysicalDrive, li, NULL, FILE_BEGIN) &&
+					ReadFile(hPhysicalDrive, cmp_buffer, read_size[proc_bufnum], &comp_size, NULL) &&
+					(comp_size == read_size[proc_bufnum]) &&
+					(memcmp(cmp_buffer, &buffer[proc_bufnum * buf_size], comp_size) == 0)) {
+					diff_skipped += read_size[proc_bufnum];
+					continue;
+				}
+				// Device data differs => restore the position and write the block
+				li.QuadPart = wb;
+				if (!SetFilePointerEx(hPhysicalDrive, li, NULL, FILE_BEGIN)) {
+					uprintf("\r\nError: Could not reset position - %s", WindowsErrorString());
+					goto out;
+				}
+				diff_written += read_size[proc_bufnum];
+			}
 
-			// 4. Synchronously write the current data buffer
-			for (i = 1; i <= WRITE_RETRIES; i++) {
+			// 6b. Sparse image handling: if the block we are about to write is all
+			// zeroes, and the matching device data, which we check with the same
+			// back-off strategy as fast-zeroing, is all zeroes too, skip the write.
+			else if (throttle_fast_zeroing) {
+				throttle_fast_zeroing--;
+			} else if ((num_extra_targets == 0) && (read_size[proc_bufnum] != 0) &&
+				IsZeroBuffer(&buffer[proc_bufnum * buf_size], read_size[proc_bufnum])) {
 				CHECK_FOR_USER_CANCEL;
-				s = WriteFile(hPhysicalDrive, &buffer[proc_bufnum * buf_size], read_size[proc_bufnum], &write_size, NULL);
-				if ((s) && (write_size == read_size[proc_bufnum]))
-					break;
-				if (s)
-					uprintf("\r\nWrite error: Wrote %d bytes, expected %d bytes", write_size, read_size[proc_bufnum]);
-				else
-					uprintf("\r\nWrite error at sector %lld: %s", wb / SelectedDrive.SectorSize, WindowsErrorString());
-				if (i < WRITE_RETRIES) {
-					li.QuadPart = wb;
-					uprintf("Retrying in %d seconds...", WRITE_TIMEOUT / 1000);
-					Sleep(WRITE_TIMEOUT);
-					if (!SetFilePointerEx(hPhysicalDrive, li, NULL, FILE_BEGIN)) {
-						uprintf("Write error: Could not reset position - %s", WindowsErrorString());
-						goto out;
-					}
-				} else {
-					FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | ERROR_WRITE_FAULT;
+				li.QuadPart = wb;
+				if (SetFilePointerEx(hPhysicalDrive, li, NULL, FILE_BEGIN) &&
+					ReadFile(hPhysicalDrive, cmp_buffer, read_size[proc_bufnum], &comp_size, NULL) &&
+					(comp_size == read_size[proc_bufnum]) && IsZeroBuffer(cmp_buffer, comp_size))
+					continue;
+				// Device data is not all zeroes => restore the position and write the block
+				li.QuadPart = wb;
+				if (!SetFilePointerEx(hPhysicalDrive, li, NULL, FILE_BEGIN)) {
+					uprintf("\r\nError: Could not reset position - %s", WindowsErrorString());
 					goto out;
 				}
-				Sleep(200);
+				throttle_fast_zeroing = 15;
+			}
+
+			// 7. Write the current data buffer to all targets, overlapped if we can
+			if ((hTargetDrive[0] != NULL) && (read_size[proc_bufnum] != 0)) {
+				CHECK_FOR_USER_CANCEL;
+				for (t = 0; t <= num_extra_targets; t++) {
+					SeekFileAsync(hTargetDrive[t], wb);
+					WriteFileAsync(hTargetDrive[t], &buffer[proc_bufnum * buf_size], read_size[proc_bufnum]);
+				}
+				write_pending = TRUE;
+				continue;
 			}
-			if (i > WRITE_RETRIES)
+
+			// 7b. Fallback: synchronously write the current data buffer
+			if (!WriteChunkWithRetry(hPhysicalDrive, &buffer[proc_bufnum * buf_size], read_size[proc_bufnum], wb))
 				goto out;
+			confirmed_offset = wb + read_size[proc_bufnum];
+			UpdateJournaledOffset(confirmed_offset);
 		}
 		uprintfs("\r\n");
+		ClearJournaledOffset();
+		if (use_differential_write && (diff_skipped + diff_written != 0)) {
+			uprintf("Differential write: %d%% of the image differed from the device",
+				(int)((diff_written * 100) / (diff_skipped + diff_written)));
+			uprintf("  Skipped writing %s of identical data",
+				SizeToHumanReadable(diff_skipped, FALSE, FALSE));
+		}
+	}
+	if (image_sum_ok && HashStreamFinal(image_sum)) {
+		for (i = 0; i < ARRAYSIZE(image_sum); i++)
+			sprintf(&image_sum_str[2 * i], "%02x", image_sum[i]);
+		uprintf("SHA256 of written image: %s", image_sum_str);
 	}
+	// Single end-of-operation barrier for all the bulk data written above
+	WriteBarrier(hPhysicalDrive, WB_FINAL);
 	RefreshDriveLayout(hPhysicalDrive);
 	ret = TRUE;
 out:
+	// A write that was cancelled or failed mid-image keeps its journal entry,
+	// updated with the exact confirmed offset rather than the last journal
+	// mark, so that a resume restarts from the furthest acknowledged data
+	if (!ret && journal_active)
+		FlushJournaledOffset(confirmed_offset);
+	HashStreamFinal(NULL);	// Abandon the checksum stream if we errored out mid-write
+	CdcStreamClose();
 	if (img_report.compression_type != BLED_COMPRESSION_NONE)
 		safe_closehandle(hSourceImage);
 	else
 		CloseFileAsync(hSourceImage);
-	safe_mm_free(buffer);
-	safe_mm_free(cmp_buffer);
+	for (t = 0; t < MAX_TARGET_DRIVES; t++)
+		CloseFileAsync(hTargetDrive[t]);
+	safe_closehandle(hCompareDrive);
+	ReleaseIoBuffer(buffer);
+	buffer = NULL;
+	ReleaseIoBuffer(cmp_buffer);
+	cmp_buffer = NULL;
 	return ret;
 }
 
+/*
+ * Acquiring the logical volume lock may have to sit through seconds of
+ * DRIVE_ACCESS_TIMEOUT retries, so it is run in its own thread, overlapped
+ * with the zapping of the stale MBR/GPT headers, and collected with
+ * FinishVolumeLock() before the handle is actually needed.
+ */
+static HANDLE volume_lock_thread = NULL;
+static HANDLE locked_volume = INVALID_HANDLE_VALUE;
+static DWORD volume_lock_drive_index;
+static BOOL volume_lock_write_share;
+
+static DWORD WINAPI VolumeLockThread(LPVOID param)
+{
+	locked_volume = GetLogicalHandle(volume_lock_drive_index, 0, TRUE, FALSE, volume_lock_write_share);
+	// If the call succeeds (and we don't get a NULL logical handle as returned for
+	// unpartitioned drives), try to unmount the volume.
+	if ((locked_volume == NULL) && (!UnmountVolume(locked_volume)))
+		uprintf("Trying to continue regardless...");
+	return 0;
+}
+
+static void StartVolumeLock(DWORD DriveIndex, BOOL bWriteShare)
+{
+	volume_lock_drive_index = DriveIndex;
+	volume_lock_write_share = bWriteShare;
+	locked_volume = INVALID_HANDLE_VALUE;
+	volume_lock_thread = CreateThread(NULL, 0, VolumeLockThread, NULL, 0, NULL);
+	if (volume_lock_thread == NULL) {
+		uprintf("Could not start volume lock thread - acquiring synchronously");
+		IGNORE_RETVAL(VolumeLockThread(NULL));
+	}
+}
+
+static HANDLE FinishVolumeLock(void)
+{
+	if (volume_lock_thread != NULL) {
+		WaitForSingleObject(volume_lock_thread, INFINITE);
+		CloseHandle(volume_lock_thread);
+		volume_lock_thread = NULL;
+	}
+	return locked_volume;
+}
+
+/*
+ * Post-extraction TRIM of the clusters that the freshly populated FAT32 file
+ * system leaves unallocated. Without this, free space still holds stale data
+ * from previous flashes, which the device's garbage collection has to shuffle
+ * around on subsequent writes. Failure is not fatal - plenty of flash drives
+ * simply don't support TRIM - so we stop after the first refused request.
+ */
+static void TrimFreeClusters(HANDLE hPhysicalDrive, uint64_t PartitionOffset)
+{
+	const DWORD chunk_size = 64 * KB;
+	uint8_t *bpb = NULL, *fat = NULL;
+	uint16_t bytes_per_sector, reserved_sectors;
+	uint8_t sectors_per_cluster, num_fats;
+	uint32_t i, fat_size, total_sectors, cluster_count, nb_entries, entry;
+	uint64_t data_start, cluster_size, run_start = 0, run_len = 0, trimmed = 0, fat_pos, cluster = 2;
+	DWORD size, nb_ranges = 0;
+	LARGE_INTEGER li;
+
+	bpb = (uint8_t*)_mm_malloc(SelectedDrive.SectorSize, SelectedDrive.SectorSize);
+	fat = (uint8_t*)_mm_malloc(chunk_size, SelectedDrive.SectorSize);
+	if ((bpb == NULL) || (fat == NULL))
+		goto out;
+
+	li.QuadPart = PartitionOffset;
+	if (!SetFilePointerEx(hPhysicalDrive, li, NULL, FILE_BEGIN) ||
+		!ReadFile(hPhysicalDrive, bpb, SelectedDrive.SectorSize, &size, NULL) ||
+		(size != SelectedDrive.SectorSize))
+		goto out;
+	// Make sure we are actually looking at a FAT32 volume
+	if (memcmp(&bpb[0x52], "FAT32   ", 8) != 0)
+		goto out;
+	bytes_per_sector = (uint16_t)bpb[0x0b] | ((uint16_t)bpb[0x0c] << 8);
+	sectors_per_cluster = bpb[0x0d];
+	reserved_sectors = (uint16_t)bpb[0x0e] | ((uint16_t)bpb[0x0f] << 8);
+	num_fats = bpb[0x10];
+	total_sectors = *(uint32_t*)&bpb[0x20];
+	fat_size = *(uint32_t*)&bpb[0x24];
+	if ((bytes_per_sector == 0) || (sectors_per_cluster == 0) || (fat_size == 0))
+		goto out;
+	data_start = (uint64_t)reserved_sectors + (uint64_t)num_fats * fat_size;
+	cluster_count = (uint32_t)((total_sectors - data_start) / sectors_per_cluster);
+	cluster_size = (uint64_t)sectors_per_cluster * bytes_per_sector;
+
+	// Walk the (first) FAT and coalesce runs of free clusters into TRIM ranges.
+	// Runs smaller than 1 MB aren't worth the command overhead.
+	fat_pos = PartitionOffset + (uint64_t)reserved_sectors * bytes_per_sector;
+	while (cluster < cluster_count + 2) {
+		li.QuadPart = fat_pos + (cluster * 4 / chunk_size) * chunk_size;
+		if (!SetFilePointerEx(hPhysicalDrive, li, NULL, FILE_BEGIN) ||
+			!ReadFile(hPhysicalDrive, fat, chunk_size, &size, NULL) || (size == 0))
+			goto out;
+		nb_entries = size / 4;
+		for (i = (uint32_t)(cluster % (chunk_size / 4)); (i < nb_entries) &&
+			(cluster < cluster_count + 2); i++, cluster++) {
+			entry = (*(uint32_t*)&fat[i * 4]) & 0x0fffffff;
+			if (entry == 0) {
+				if (run_len == 0)
+					run_start = PartitionOffset + (data_start + (cluster - 2) *
+						sectors_per_cluster) * bytes_per_sector;
+				run_len += cluster_size;
+				continue;
+			}
+			if (run_len >= 1 * MB) {
+				if (!TrimDriveRange(hPhysicalDrive, run_start, run_len))
+					goto out;
+				trimmed += run_len;
+				nb_ranges++;
+			}
+			run_len = 0;
+		}
+	}
+	if (run_len >= 1 * MB) {
+		if (!TrimDriveRange(hPhysicalDrive, run_start, run_len))
+			goto out;
+		trimmed += run_len;
+		nb_ranges++;
+	}
+	if (nb_ranges != 0)
+		uprintf("Trimmed %s of unallocated space (%d range%s)",
+			SizeToHumanReadable(trimmed, FALSE, FALSE), nb_ranges, (nb_ranges == 1) ? "" : "s");
+
+out:
+	if (fat != NULL)
+		_mm_free(fat);
+	if (bpb != NULL)
+		_mm_free(bpb);
+}
+
+// Snapshot of the last successful persistence-enabled run, used to decide whether
+// a follow-up run on the same drive can take the fast resize path, i.e. only move
+// the persistence partition boundary and recreate its file system, instead of
+// repartitioning and re-extracting the whole image.
+static struct {
+	BOOL valid;
+	DWORD DriveIndex;
+	int partition_type;
+	int target_type;
+	int fs_type;
+	uint64_t casper_offset;
+	// Size that was requested when the partition was carved out = upper bound for regrowth
+	uint64_t casper_max_size;
+	uint64_t casper_cur_size;
+	char image_path[MAX_PATH];
+} last_casper;
+
+/*
+ * Returns TRUE if the only effective difference between the current selection and
+ * the last successful run on this drive is the persistence size, in which case the
+ * persistence partition can be resized in place rather than the whole drive rebuilt.
+ */
+BOOL CanResizePersistence(DWORD DriveIndex)
+{
+	if (!last_casper.valid || (last_casper.DriveIndex != DriveIndex))
+		return FALSE;
+	if ((boot_type != BT_IMAGE) || write_as_image || write_as_esp || zero_drive)
+		return FALSE;
+	if ((image_path == NULL) || (strcmp(image_path, last_casper.image_path) != 0))
+		return FALSE;
+	if ((partition_type != last_casper.partition_type) || (target_type != last_casper.target_type) ||
+		(fs_type != last_casper.fs_type))
+		return FALSE;
+	if (!HAS_PERSISTENCE(img_report) || (persistence_size == 0))
+		return FALSE;
+	// The partition sits last on the drive, so it can't grow past the slice
+	// that was carved out for it on the full run
+	if (persistence_size > last_casper.casper_max_size)
+		return FALSE;
+	return (persistence_size != last_casper.casper_cur_size);
+}
+
+/*
+ * Standalone thread for the fast persistence resize path. Because the bundled
+ * ext2fs library has no resizer, the persistence file system is recreated at
+ * the new size rather than resized, but the payload partition - and the lengthy
+ * image extraction that populated it - is left entirely untouched.
+ */
+DWORD WINAPI PersistenceResizeThread(void* param)
+{
+	DWORD DriveIndex = (DWORD)(uintptr_t)param;
+	uint32_t ext_version = ReadSetting32(SETTING_USE_EXT_VERSION);
+
+	if ((ext_version < 2) || (ext_version > 4))
+		ext_version = 3;
+	uprintf("Resizing persistence partition to %s", SizeToHumanReadable(persistence_size, TRUE, FALSE));
+	if (!ResizePersistencePartition(DriveIndex, last_casper.casper_offset, persistence_size)) {
+		if (!IS_ERROR(FormatStatus))
+			FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | ERROR_WRITE_FAULT;
+		goto out;
+	}
+	CHECK_FOR_USER_CANCEL;
+	if (!FormatPartition(DriveIndex, last_casper.casper_offset, 0, FS_EXT2 + (ext_version - 2),
+		img_report.uses_casper ? "casper-rw" : "persistence",
+		(img_report.uses_casper ? 0 : FP_CREATE_PERSISTENCE_CONF) |
+		(IsChecked(IDC_QUICK_FORMAT) ? FP_QUICK : 0))) {
+		if (!IS_ERROR(FormatStatus))
+			FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | ERROR_WRITE_FAULT;
+		goto out;
+	}
+	last_casper.casper_cur_size = persistence_size;
+
+out:
+	// Any failure may have left the layout out of sync with our snapshot
+	if (IS_ERROR(FormatStatus))
+		last_casper.valid = FALSE;
+	PostMessage(hMainDialog, UM_FORMAT_COMPLETED, (WPARAM)TRUE, 0);
+	ExitThread(0);
+}
+
 /*
  * Standalone thread for the formatting operation
  * According to http://msdn.microsoft.com/en-us/library/windows/desktop/aa364562.aspx
@@ -1858,7 +3188,8 @@ DWORD WINAPI FormatThread(void* param)
 	BOOL ret, use_large_fat32, windows_to_go, actual_lock_drive = lock_drive;
 	// Windows 11 and VDS (which I suspect is what fmifs.dll's FormatEx() is now calling behind the scenes)
 	// require us to unlock the physical drive to format the drive, else access denied is returned.
-	BOOL need_logical = FALSE, must_unlock_physical = (use_vds || nWindowsVersion >= WINDOWS_11);
+	BOOL need_logical = FALSE, locking_volume = FALSE, pbr_write_through = FALSE;
+	BOOL must_unlock_physical = (use_vds || nWindowsVersion >= WINDOWS_11);
 	DWORD cr, DriveIndex = (DWORD)(uintptr_t)param, ClusterSize, Flags;
 	HANDLE hPhysicalDrive = INVALID_HANDLE_VALUE;
 	HANDLE hLogicalVolume = INVALID_HANDLE_VALUE;
@@ -1881,6 +3212,12 @@ DWORD WINAPI FormatThread(void* param)
 	large_drive = (SelectedDrive.DiskSize > (1*TB));
 	if (large_drive)
 		uprintf("Notice: Large drive detected (may produce short writes)");
+	// Bulk data doesn't need to hit the medium until the final barrier
+	SetWriteBarrierPolicy(WB_POLICY_FINAL_ONLY);
+	PipelineStatsReset();
+	VirtualTargetInit();
+	FormatPhaseReset();
+	FormatPhase(PH_ANALYZE);
 	// Find out if we need to add any extra partitions
 	if ((windows_to_go) && (target_type == TT_UEFI) && (partition_type == PARTITION_STYLE_GPT))
 		// According to Microsoft, every GPT disk (we RUN Windows from) must have an MSR due to not having hidden sectors
@@ -1910,6 +3247,10 @@ DWORD WINAPI FormatThread(void* param)
 		goto out;
 	}
 
+	// Probe (or read back from the cache) the device capabilities, which the
+	// write operations below use to gate optional features
+	GetDriveCapabilities(hPhysicalDrive);
+
 	// At this stage we have both a handle and a lock to the physical drive
 	if (!GetDriveLetters(DriveIndex, drive_letters)) {
 		uprintf("Failed to get a drive letter");
@@ -1957,16 +3298,9 @@ DWORD WINAPI FormatThread(void* param)
 	// Also need to lock logical drive if we couldn't delete partitions, to keep Windows happy...
 	if (((boot_type == BT_IMAGE) && write_as_image) || (need_logical)) {
 		uprintf("Requesting logical volume handle...");
-		hLogicalVolume = GetLogicalHandle(DriveIndex, 0, TRUE, FALSE, !actual_lock_drive);
-		if (hLogicalVolume == INVALID_HANDLE_VALUE) {
-			uprintf("Could not access logical volume");
-			FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | ERROR_OPEN_FAILED;
-			goto out;
-		// If the call succeeds (and we don't get a NULL logical handle as returned for
-		// unpartitioned drives), try to unmount the volume.
-		} else if ((hLogicalVolume == NULL) && (!UnmountVolume(hLogicalVolume))) {
-			uprintf("Trying to continue regardless...");
-		}
+		// Overlap the lock acquisition with the MBR/GPT zapping below
+		StartVolumeLock(DriveIndex, !actual_lock_drive);
+		locking_volume = TRUE;
 	}
 	CHECK_FOR_USER_CANCEL;
 
@@ -1977,6 +3311,16 @@ DWORD WINAPI FormatThread(void* param)
 	}
 
 	if (zero_drive) {
+		if (locking_volume) {
+			hLogicalVolume = FinishVolumeLock();
+			locking_volume = FALSE;
+			if (hLogicalVolume == INVALID_HANDLE_VALUE) {
+				uprintf("Could not access logical volume");
+				FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | ERROR_OPEN_FAILED;
+				goto out;
+			}
+		}
+		FormatPhase(PH_WRITE);
 		WriteDrive(hPhysicalDrive, TRUE);
 		goto out;
 	}
@@ -1994,9 +3338,22 @@ DWORD WINAPI FormatThread(void* param)
 		}
 	}
 
+	if (locking_volume) {
+		hLogicalVolume = FinishVolumeLock();
+		locking_volume = FALSE;
+		if (hLogicalVolume == INVALID_HANDLE_VALUE) {
+			uprintf("Could not access logical volume");
+			FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | ERROR_OPEN_FAILED;
+			goto out;
+		}
+	}
+	CHECK_FOR_USER_CANCEL;
+
 	if (IsChecked(IDC_BAD_BLOCKS)) {
 		do {
 			int sel = ComboBox_GetCurSel(hNBPasses);
+			int bb_mode = (sel < BADLOCKS_PATTERN_TYPES) ? BB_MODE_STANDARD :
+				((sel == BADLOCKS_PATTERN_TYPES) ? BB_MODE_ONE_PASS : BB_MODE_CAPACITY_PROBE);
 			// create a log file for bad blocks report. Since %USERPROFILE% may
 			// have localized characters, we use the UTF-8 API.
 			userdir = getenvU("USERPROFILE");
@@ -2015,7 +3372,9 @@ DWORD WINAPI FormatThread(void* param)
 				fflush(log_fd);
 			}
 
-			if (!BadBlocks(hPhysicalDrive, SelectedDrive.DiskSize, (sel >= 2) ? 4 : sel +1, sel, &report, log_fd)) {
+			if (!BadBlocks(hPhysicalDrive, SelectedDrive.DiskSize,
+				(bb_mode != BB_MODE_STANDARD) ? 1 : ((sel >= 2) ? 4 : sel +1),
+				(bb_mode != BB_MODE_STANDARD) ? 0 : sel, bb_mode, bad_block_range, &report, log_fd)) {
 				uprintf("Bad blocks: Check failed.");
 				if (!IS_ERROR(FormatStatus))
 					FormatStatus = ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|APPERR(ERROR_BADBLOCKS_FAILURE);
@@ -2061,7 +3420,37 @@ DWORD WINAPI FormatThread(void* param)
 
 	// Write an image file
 	if ((boot_type == BT_IMAGE) && write_as_image) {
-		WriteDrive(hPhysicalDrive, FALSE);
+		if (img_report.is_ffu_img) {
+			// FFU images are applied by dism, which needs exclusive drive access
+			safe_unlockclose(hLogicalVolume);
+			safe_unlockclose(hPhysicalDrive);
+			if (!WriteFfuImage(image_path, DriveIndex)) {
+				if (!IS_ERROR(FormatStatus))
+					FormatStatus = ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|ERROR_WRITE_FAULT;
+			}
+			goto out;
+		}
+		// A remote image is streamed from the network straight into the DD write
+		// path, with its hash computed inline, rather than being staged on disk.
+		if (IS_REMOTE_IMAGE(image_path) &&
+			!StartStreamingDownload(image_path, &img_report.image_size)) {
+			FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | ERROR_READ_FAULT;
+			goto out;
+		}
+		// In multi-target mode (Ctrl-Alt-M), every other listed drive that can
+		// take the image is flashed in parallel with the selected one
+		if (enable_multi_target)
+			OpenExtraTargetDrives(DriveIndex);
+		FormatPhase(PH_WRITE);
+		ret = WriteDrive(hPhysicalDrive, FALSE);
+		CloseExtraTargetDrives();
+		StopStreamingDownload();
+		// No post-write verification for a streamed image: there is no local
+		// copy to compare against, and the inline hash already covers it.
+		if (ret && verify_writes && !IS_REMOTE_IMAGE(image_path)) {
+			FormatPhase(PH_VERIFY);
+			VerifyDrive(hPhysicalDrive);
+		}
 
 		// Trying to mount accessible partitions after writing an image leads to the
 		// creation of the infamous 'System Volume Information' folder on ESPs, which
@@ -2085,6 +3474,7 @@ DWORD WINAPI FormatThread(void* param)
 	UpdateProgress(OP_ZERO_MBR, -1.0f);
 	CHECK_FOR_USER_CANCEL;
 
+	FormatPhase(PH_PARTITION);
 	if (!CreatePartition(hPhysicalDrive, partition_type, fs_type, (partition_type == PARTITION_STYLE_MBR)
 		&& (target_type == TT_UEFI), extra_partitions)) {
 		FormatStatus = (LastWriteError != 0) ? LastWriteError : (ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|ERROR_PARTITION_FAILURE);
@@ -2144,6 +3534,7 @@ DWORD WINAPI FormatThread(void* param)
 	}
 	CHECK_FOR_USER_CANCEL;
 
+	FormatPhase(PH_FORMAT);
 	// Format Casper partition if required. Do it before we format anything with
 	// a file system that Windows will recognize, to avoid concurrent access.
 	if (extra_partitions & XP_CASPER) {
@@ -2193,7 +3584,7 @@ DWORD WINAPI FormatThread(void* param)
 	// Thanks to Microsoft, we must fix the MBR AFTER the drive has been formatted
 	if ((partition_type == PARTITION_STYLE_MBR) || ((boot_type != BT_NON_BOOTABLE) && (partition_type == PARTITION_STYLE_GPT))) {
 		PrintInfoDebug(0, MSG_228);	// "Writing master boot record..."
-		if ((!WriteMBR(hPhysicalDrive)) || (!WriteSBR(hPhysicalDrive))) {
+		if (!WriteBootRecords(hPhysicalDrive)) {
 			if (!IS_ERROR(FormatStatus))
 				FormatStatus = ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|ERROR_WRITE_FAULT;
 			goto out;
@@ -2274,11 +3665,23 @@ DWORD WINAPI FormatThread(void* param)
 			// NB: if you unmount the logical volume here, XP will report error:
 			// [0x00000456] The media in the drive may have changed
 			PrintInfoDebug(0, MSG_229);
+			// Take a volume lock (without dismounting) while we patch the boot record,
+			// so that the in-place update can't race the file system driver. This keeps
+			// the mounted volume valid and, except for NTFS, saves the dismount/remount
+			// cycle that used to follow the patching.
+			pbr_write_through = LockVolume(hLogicalVolume);
 			if (!WritePBR(hLogicalVolume)) {
 				if (!IS_ERROR(FormatStatus))
 					FormatStatus = ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|ERROR_WRITE_FAULT;
 				goto out;
 			}
+			if (pbr_write_through && !WriteBarrier(hLogicalVolume, WB_METADATA)) {
+				uprintf("Failed to flush patched boot record: %s", WindowsErrorString());
+				pbr_write_through = FALSE;
+			}
+			// With NTFS, if you don't remount, you don't boot!
+			if (fs_type == FS_NTFS)
+				pbr_write_through = FALSE;
 			// We must close and unlock the volume to write files to it
 			safe_unlockclose(hLogicalVolume);
 		}
@@ -2291,10 +3694,14 @@ DWORD WINAPI FormatThread(void* param)
 	// We issue a complete remount of the filesystem on account of:
 	// - Ensuring the file explorer properly detects that the volume was updated
 	// - Ensuring that an NTFS system will be reparsed so that it becomes bootable
-	if (!RemountVolume(drive_name, FALSE))
+	// If the boot record was patched write-through under a volume lock, the mounted
+	// file system was never invalidated and the flush already took place, so the
+	// remount cycle can be skipped altogether.
+	if (!pbr_write_through && !RemountVolume(drive_name, FALSE))
 		goto out;
 	CHECK_FOR_USER_CANCEL;
 
+	FormatPhase(PH_WRITE);
 	if (boot_type != BT_NON_BOOTABLE) {
 		if ((boot_type == BT_MSDOS) || (boot_type == BT_FREEDOS)) {
 			UpdateProgress(OP_FILE_COPY, -1.0f);
@@ -2391,12 +3798,21 @@ DWORD WINAPI FormatThread(void* param)
 				if (PRIMARYLANGID(GetThreadUILanguage()) != LANG_ENGLISH)
 					uprintf("Note: CheckDisk messages may be localized");
 			}
-			CheckDisk(drive_name[0]);
+			// The fixup is the point of this call, so no quick-only mode here
+			CheckDisk(drive_name[0], FALSE);
 			UpdateProgress(OP_FINALIZE, -1.0f);
 		}
+		// Now that the file copy is complete, discard whatever the file system
+		// leaves unallocated, to keep reflashed sticks at native write speed
+		if ((boot_type == BT_IMAGE) && img_report.is_iso && (fs_type == FS_FAT32))
+			TrimFreeClusters(hPhysicalDrive, partition_offset[PI_MAIN]);
 	}
 
 out:
+	// If we bailed out while the volume lock was still being acquired, collect it
+	// now, so that the cleanup below operates on the actual handle
+	if (locking_volume)
+		hLogicalVolume = FinishVolumeLock();
 	if (write_as_esp && volume_name != NULL)
 		AltUnmountVolume(volume_name, TRUE);
 	else
@@ -2405,6 +3821,8 @@ out:
 		PrintInfo(0, MSG_320, lmprintf(MSG_307));
 		VdsRescan(VDS_RESCAN_REFRESH, 0, TRUE);
 	}
+	// Release the cached VDS session, if any of the calls above created one for this thread
+	VdsReleaseService();
 	safe_free(buffer);
 	safe_unlockclose(hLogicalVolume);
 	safe_unlockclose(hPhysicalDrive);	// This can take a while
@@ -2416,23 +3834,127 @@ out:
 			free(volume_name);
 		}
 	}
+	PipelineStatsPrint();
+	PrintWriteBarrierStats();
+	// Only successful runs feed the per-device timing history, so that aborted
+	// or failed ones don't skew the baseline
+	if (!IS_ERROR(FormatStatus))
+		FormatPhaseReport(zero_drive ? (uint64_t)SelectedDrive.DiskSize :
+			(write_as_image ? img_report.image_size :
+			((boot_type == BT_IMAGE) ? img_report.projected_size : 0)));
+	// A full run always repartitions, which invalidates any previous resize
+	// snapshot. If this one created a persistence partition, record its
+	// parameters so CanResizePersistence() can offer the fast path next time.
+	last_casper.valid = FALSE;
+	if (!IS_ERROR(FormatStatus) && (extra_partitions & XP_CASPER) && (image_path != NULL)) {
+		last_casper.DriveIndex = DriveIndex;
+		last_casper.partition_type = partition_type;
+		last_casper.target_type = target_type;
+		last_casper.fs_type = fs_type;
+		last_casper.casper_offset = partition_offset[PI_CASPER];
+		last_casper.casper_max_size = persistence_size;
+		last_casper.casper_cur_size = persistence_size;
+		static_strcpy(last_casper.image_path, image_path);
+		last_casper.valid = TRUE;
+	}
 	PostMessage(hMainDialog, UM_FORMAT_COMPLETED, (WPARAM)TRUE, 0);
 	ExitThread(0);
 }
 
+// Parallel gzip compression for the capture path: the read loop dispatches each
+// chunk to one of these slots round-robin and collects slots in that same order
+// before reuse, which keeps the output members sequential in the file while up
+// to GZ_SLOTS chunks compress concurrently with the (slow) device reads.
+#define GZ_SLOTS 4
+typedef struct {
+	HANDLE thread;
+	HANDLE ready;
+	HANDLE done;
+	uint8_t* in;
+	uint8_t* out;
+	DWORD in_size;
+	DWORD out_size;
+	DWORD out_max;
+	BOOL busy;
+	BOOL quit;
+} GZ_SLOT;
+
+static DWORD WINAPI GzWorkerThread(void* param)
+{
+	GZ_SLOT* slot = (GZ_SLOT*)param;
+
+	while (WaitForSingleObject(slot->ready, INFINITE) == WAIT_OBJECT_0) {
+		if (slot->quit)
+			break;
+		slot->out_size = GzCompress(slot->out, slot->out_max, slot->in, slot->in_size);
+		SetEvent(slot->done);
+	}
+	return 0;
+}
+
+static BOOL GzSlotsInit(GZ_SLOT* slots, DWORD buf_size)
+{
+	int i;
+
+	for (i = 0; i < GZ_SLOTS; i++) {
+		slots[i].in = (uint8_t*)malloc(buf_size);
+		slots[i].out_max = GzCompressBound(buf_size);
+		slots[i].out = (uint8_t*)malloc(slots[i].out_max);
+		slots[i].ready = CreateEvent(NULL, FALSE, FALSE, NULL);
+		slots[i].done = CreateEvent(NULL, FALSE, FALSE, NULL);
+		if ((slots[i].in == NULL) || (slots[i].out == NULL) ||
+			(slots[i].ready == NULL) || (slots[i].done == NULL))
+			return FALSE;
+		slots[i].thread = CreateThread(NULL, 0, GzWorkerThread, &slots[i], 0, NULL);
+		if (slots[i].thread == NULL)
+			return FALSE;
+	}
+	return TRUE;
+}
+
+static void GzSlotsFree(GZ_SLOT* slots)
+{
+	int i;
+
+	for (i = 0; i < GZ_SLOTS; i++) {
+		if (slots[i].thread != NULL) {
+			slots[i].quit = TRUE;
+			SetEvent(slots[i].ready);
+			WaitForSingleObject(slots[i].thread, INFINITE);
+			CloseHandle(slots[i].thread);
+		}
+		safe_closehandle(slots[i].ready);
+		safe_closehandle(slots[i].done);
+		safe_free(slots[i].in);
+		safe_free(slots[i].out);
+	}
+}
+
 DWORD WINAPI SaveImageThread(void* param)
 {
-	BOOL s;
-	DWORD rSize, wSize;
+	BOOL s, dest_sparse = FALSE, compress = FALSE;
+	DWORD rSize, wSize, write_size;
 	IMG_SAVE *img_save = (IMG_SAVE*)param;
 	HANDLE hPhysicalDrive = INVALID_HANDLE_VALUE;
+	HANDLE hSource = NULL;
 	HANDLE hDestImage = INVALID_HANDLE_VALUE;
+	GZ_SLOT gz_slots[GZ_SLOTS] = { 0 };
+	GZ_SLOT* slot;
 	LARGE_INTEGER li;
+	size_t path_len;
 	uint8_t *buffer = NULL;
-	uint64_t wb;
-	int i;
+	uint64_t wb, cb = 0, skipped = 0;
+	int i, read_bufnum = 0, proc_bufnum, gz_next = 0;
 
 	PrintInfoDebug(0, MSG_225);
+	// FFU capture is delegated to dism, which accesses the drive on its own
+	if (img_save->Type == IMG_SAVE_TYPE_FFU) {
+		if (CaptureFfuImage(img_save->ImagePath, img_save->DeviceNum))
+			uprintf("Operation complete.");
+		else
+			FormatStatus = ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|ERROR_WRITE_FAULT;
+		goto out;
+	}
 	switch (img_save->Type) {
 	case IMG_SAVE_TYPE_VHD:
 		hPhysicalDrive = GetPhysicalHandle(img_save->DeviceNum, TRUE, FALSE, FALSE);
@@ -2449,11 +3971,16 @@ DWORD WINAPI SaveImageThread(void* param)
 		goto out;
 	}
 
+	// A '.gz' destination selects inline compression, so that the archival
+	// pass overlaps the slow optical reads instead of running as its own job
+	path_len = safe_strlen(img_save->ImagePath);
+	compress = (img_save->Type == IMG_SAVE_TYPE_ISO) && (path_len > 3) &&
+		(stricmp(&img_save->ImagePath[path_len - 3], ".gz") == 0);
+
 	// Write an image file
-	// We may have poked the MBR and other stuff, so need to rewind
-	li.QuadPart = 0;
-	if (!SetFilePointerEx(hPhysicalDrive, li, NULL, FILE_BEGIN))
-		uprintf("Warning: Unable to rewind device position - wrong data might be copied!");
+	// Note: We may have poked the MBR and other stuff but, since all the reads
+	// go through an async wrapper that starts back at offset 0, no rewind of
+	// the original handle is needed.
 	hDestImage = CreateFileU(img_save->ImagePath, GENERIC_WRITE, FILE_SHARE_WRITE, NULL,
 		CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
 	if (hDestImage == INVALID_HANDLE_VALUE) {
@@ -2462,30 +3989,49 @@ DWORD WINAPI SaveImageThread(void* param)
 		goto out;
 	}
 
-	buffer = (uint8_t*)_mm_malloc(img_save->BufSize, 16);
+	// Try to make the destination sparse, so that the all-zero chunks we skip
+	// below don't consume any storage. A fixed VHD or an ISO with holes reads
+	// back all zeroes there, so the image contents are unchanged. Not relevant
+	// for a compressed destination, where zero runs barely take any space.
+	if (compress)
+		;
+	else if (DeviceIoControl(hDestImage, FSCTL_SET_SPARSE, NULL, 0, NULL, 0, &wSize, NULL))
+		dest_sparse = TRUE;
+	else
+		uprintf("Note: Could not set sparse attribute on destination - empty blocks will be written out");
+
+	if (compress && !GzSlotsInit(gz_slots, img_save->BufSize)) {
+		FormatStatus = ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|ERROR_NOT_ENOUGH_MEMORY;
+		uprintf("Could not set up compression workers");
+		goto out;
+	}
+
+	// The extra VHD_FOOTER_SIZE leaves room to append the footer to a full
+	// final chunk without trampling a buffer that still has a read in flight.
+	buffer = (uint8_t*)_mm_malloc(img_save->BufSize * NUM_BUFFERS + VHD_FOOTER_SIZE, 16);
 	if (buffer == NULL) {
 		FormatStatus = ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|ERROR_NOT_ENOUGH_MEMORY;
 		uprintf("could not allocate buffer");
 		goto out;
 	}
 
-	uprintf("Will use a buffer size of %s", SizeToHumanReadable(img_save->BufSize, FALSE, FALSE));
+	uprintf("Will use %d buffers of %s", NUM_BUFFERS, SizeToHumanReadable(img_save->BufSize, FALSE, FALSE));
 	uprintf("Saving to image '%s'...", img_save->ImagePath);
 
-	// Don't bother trying for something clever, using double buffering overlapped and whatnot:
-	// With Windows' default optimizations, sync read + sync write for sequential operations
-	// will be as fast, if not faster, than whatever async scheme you can come up with.
+	// Wrap the source into an async handle, so that the next device read can
+	// be in flight while the current chunk is being written to the image.
+	hSource = WrapFileAsync(hPhysicalDrive, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, 0);
+	if (hSource == NULL) {
+		FormatStatus = ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|ERROR_OPEN_FAILED;
+		uprintf("Could not reopen device for async access: %s", WindowsErrorString());
+		goto out;
+	}
+
 	UpdateProgressWithInfoInit(NULL, FALSE);
-	for (wb = 0; ; wb += wSize) {
-		if (img_save->Type == IMG_SAVE_TYPE_ISO) {
-			// Optical drives do not appear to increment the sectors to read automatically
-			li.QuadPart = wb;
-			if (!SetFilePointerEx(hPhysicalDrive, li, NULL, FILE_BEGIN))
-				uprintf("Warning: Unable to set device position - wrong data might be copied!");
-		}
-		s = ReadFile(hPhysicalDrive, buffer,
-			(DWORD)MIN(img_save->BufSize, img_save->DeviceSize - wb), &rSize, NULL);
-		if (!s) {
+	ReadFileAsync(hSource, &buffer[read_bufnum * img_save->BufSize],
+		(DWORD)MIN(img_save->BufSize, img_save->DeviceSize));
+	for (wb = 0; ; wb += rSize) {
+		if (!WaitFileAsync(hSource, DRIVE_ACCESS_TIMEOUT) || !GetSizeAsync(hSource, &rSize)) {
 			FormatStatus = ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|ERROR_READ_FAULT;
 			uprintf("Read error: %s", WindowsErrorString());
 			goto out;
@@ -2493,19 +4039,72 @@ DWORD WINAPI SaveImageThread(void* param)
 		if (rSize == 0)
 			break;
 		UpdateProgressWithInfo(OP_FORMAT, MSG_261, wb, img_save->DeviceSize);
+		proc_bufnum = read_bufnum;
+		if (wb + rSize < img_save->DeviceSize) {
+			read_bufnum = (read_bufnum + 1) % NUM_BUFFERS;
+			// Optical drives do not appear to increment the sectors to read automatically
+			if (img_save->Type == IMG_SAVE_TYPE_ISO)
+				SeekFileAsync(hSource, wb + rSize);
+			ReadFileAsync(hSource, &buffer[read_bufnum * img_save->BufSize],
+				(DWORD)MIN(img_save->BufSize, img_save->DeviceSize - (wb + rSize)));
+		}
+		// Don't write chunks that contain only zeroes when the destination is
+		// sparse. The final chunk is always written out, so that the file ends
+		// at the proper size (and carries the VHD footer when one is needed).
+		if (dest_sparse && (wb + rSize < img_save->DeviceSize) &&
+			IsZeroBuffer(&buffer[proc_bufnum * img_save->BufSize], rSize)) {
+			li.QuadPart = (LONGLONG)rSize;
+			if (!SetFilePointerEx(hDestImage, li, NULL, FILE_CURRENT)) {
+				uprintf("Write error: Could not skip empty block - %s", WindowsErrorString());
+				FormatStatus = ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|ERROR_WRITE_FAULT;
+				goto out;
+			}
+			skipped += rSize;
+			continue;
+		}
+		// Compression path: hand the chunk to the next worker slot, collecting
+		// the member that slot produced last time around before reusing it
+		if (compress) {
+			slot = &gz_slots[gz_next];
+			if (slot->busy) {
+				WaitForSingleObject(slot->done, INFINITE);
+				if ((slot->out_size == 0) ||
+					!WriteChunkWithRetry(hDestImage, slot->out, slot->out_size, cb)) {
+					if (!IS_ERROR(FormatStatus))
+						FormatStatus = ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|ERROR_WRITE_FAULT;
+					goto out;
+				}
+				cb += slot->out_size;
+			}
+			memcpy(slot->in, &buffer[proc_bufnum * img_save->BufSize], rSize);
+			slot->in_size = rSize;
+			slot->busy = TRUE;
+			SetEvent(slot->ready);
+			gz_next = (gz_next + 1) % GZ_SLOTS;
+			continue;
+		}
+		write_size = rSize;
+		// Compose the VHD footer right behind the final chunk, so that it goes
+		// out as part of the last write instead of a separate reopen and seek
+		if ((img_save->Type == IMG_SAVE_TYPE_VHD) && (wb + rSize == img_save->DeviceSize)) {
+			uprintf("Appending VHD footer...");
+			BuildVHDFooter(img_save->DeviceSize, &buffer[proc_bufnum * img_save->BufSize + rSize]);
+			write_size += VHD_FOOTER_SIZE;
+		}
 		for (i = 1; i <= WRITE_RETRIES; i++) {
 			CHECK_FOR_USER_CANCEL;
-			s = WriteFile(hDestImage, buffer, rSize, &wSize, NULL);
-			if ((s) && (wSize == rSize))
+			s = WriteFile(hDestImage, &buffer[proc_bufnum * img_save->BufSize], write_size, &wSize, NULL);
+			if ((s) && (wSize == write_size))
 				break;
 			if (s)
-				uprintf("Write error: Wrote %d bytes, expected %d bytes", wSize, rSize);
+				uprintf("Write error: Wrote %d bytes, expected %d bytes", wSize, write_size);
 			else
 				uprintf("Write error: %s", WindowsErrorString());
 			if (i < WRITE_RETRIES) {
 				li.QuadPart = wb;
 				uprintf("Retrying in %d seconds...", WRITE_TIMEOUT / 1000);
-				Sleep(WRITE_TIMEOUT);
+				if (SleepOrCancel(WRITE_TIMEOUT))
+					goto out;
 				if (!SetFilePointerEx(hDestImage, li, NULL, FILE_BEGIN)) {
 					uprintf("Write error: Could not reset position - %s", WindowsErrorString());
 					goto out;
@@ -2519,24 +4118,39 @@ DWORD WINAPI SaveImageThread(void* param)
 		if (i > WRITE_RETRIES)
 			goto out;
 	}
+	// Collect the compressed members still in flight, in dispatch order
+	for (i = 0; compress && (i < GZ_SLOTS); i++) {
+		slot = &gz_slots[(gz_next + i) % GZ_SLOTS];
+		if (!slot->busy)
+			continue;
+		WaitForSingleObject(slot->done, INFINITE);
+		if ((slot->out_size == 0) ||
+			!WriteChunkWithRetry(hDestImage, slot->out, slot->out_size, cb)) {
+			if (!IS_ERROR(FormatStatus))
+				FormatStatus = ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|ERROR_WRITE_FAULT;
+			goto out;
+		}
+		cb += slot->out_size;
+		slot->busy = FALSE;
+	}
 	if (wb != img_save->DeviceSize) {
 		uprintf("Error: wrote %s, expected %s", SizeToHumanReadable(wb, FALSE, FALSE),
 			SizeToHumanReadable(img_save->DeviceSize, FALSE, FALSE));
 		FormatStatus = ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|ERROR_WRITE_FAULT;
 		goto out;
 	}
-	if (img_save->Type == IMG_SAVE_TYPE_VHD) {
-		uprintf("Appending VHD footer...");
-		if (!AppendVHDFooter(img_save->ImagePath)) {
-			FormatStatus = ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|ERROR_WRITE_FAULT;
-			goto out;
-		}
-	}
+	if (skipped > 0)
+		uprintf("%s of empty blocks were stored as sparse", SizeToHumanReadable(skipped, FALSE, FALSE));
+	if (compress && (wb != 0))
+		uprintf("Compressed image is %s (%d%% of the original size)",
+			SizeToHumanReadable(cb, FALSE, FALSE), (int)((cb * 100) / wb));
 	uprintf("Operation complete (Wrote %s).", SizeToHumanReadable(wb, FALSE, FALSE));
 
 out:
+	GzSlotsFree(gz_slots);
 	safe_free(img_save->ImagePath);
 	safe_mm_free(buffer);
+	CloseFileAsync(hSource);
 	safe_closehandle(hDestImage);
 	safe_unlockclose(hPhysicalDrive);
 	PostMessage(hMainDialog, UM_FORMAT_COMPLETED, (WPARAM)TRUE, 0);
@@ -112,3 +112,4 @@ typedef BOOLEAN (WINAPI* EnableVolumeCompression_t)(
 BOOL WritePBR(HANDLE hLogicalDrive);
 BOOL FormatLargeFAT32(DWORD DriveIndex, uint64_t PartitionOffset, DWORD ClusterSize, LPCSTR FSName, LPCSTR Label, DWORD Flags);
 BOOL FormatExtFs(DWORD DriveIndex, uint64_t PartitionOffset, DWORD BlockSize, LPCSTR FSName, LPCSTR Label, DWORD Flags);
+BOOL ExtInjectSeedDir(DWORD DriveIndex, uint64_t PartitionOffset, const char* SeedDir);
@@ -36,6 +36,7 @@
 #include "resource.h"
 #include "msapi_utf8.h"
 #include "localization.h"
+#include "settings.h"
 #include "ext2fs/ext2fs.h"
 
 extern const char* FileSystemLabel[FS_MAX];
@@ -221,10 +222,281 @@ const char* GetExtFsLabel(DWORD DriveIndex, uint64_t PartitionOffset)
 	return (r == 0) ? label : NULL;
 }
 
+// Batched injection of local files into an ext file system, used to seed a
+// casper-rw/persistence partition with content at format time. All writes go
+// through the same physical volume handle as the format operation, so the
+// usual mount/copy/unmount cycle (and its per-file overhead) is avoided.
+#define EXT2_INJECT_BUF_SIZE        (512 * KB)
+
+static uint32_t num_injected_files;
+static uint64_t num_injected_bytes;
+
+static errcode_t ext2_inject_file(ext2_filsys fs, ext2_ino_t dir_ino, const char* name, const char* path)
+{
+	errcode_t r;
+	HANDLE h = INVALID_HANDLE_VALUE;
+	ext2_file_t ext2fd = NULL;
+	ext2_ino_t inode_id;
+	uint32_t ctime = (uint32_t)time(0);
+	struct ext2_inode inode = { 0 };
+	uint8_t* buf = NULL;
+	DWORD rd;
+	int written;
+
+	h = CreateFileU(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (h == INVALID_HANDLE_VALUE) {
+		uprintf("Could not open '%s': %s", path, WindowsErrorString());
+		return EXT2_ET_FILE_NOT_FOUND;
+	}
+	buf = malloc(EXT2_INJECT_BUF_SIZE);
+	if (buf == NULL) {
+		CloseHandle(h);
+		return EXT2_ET_NO_MEMORY;
+	}
+	inode.i_mode = 0100644;
+	inode.i_links_count = 1;
+	inode.i_atime = ctime;
+	inode.i_ctime = ctime;
+	inode.i_mtime = ctime;
+
+	r = ext2fs_new_inode(fs, dir_ino, 010755, 0, &inode_id);
+	if (r == 0) {
+		r = ext2fs_link(fs, dir_ino, name, inode_id, EXT2_FT_REG_FILE);
+		if (r == EXT2_ET_DIR_NO_SPACE) {
+			r = ext2fs_expand_dir(fs, dir_ino);
+			if (r == 0)
+				r = ext2fs_link(fs, dir_ino, name, inode_id, EXT2_FT_REG_FILE);
+		}
+	}
+	if (r == 0) {
+		ext2fs_inode_alloc_stats(fs, inode_id, 1);
+		r = ext2fs_write_new_inode(fs, inode_id, &inode);
+	}
+	if (r == 0)
+		r = ext2fs_file_open(fs, inode_id, EXT2_FILE_WRITE, &ext2fd);
+	while (r == 0) {
+		if (!ReadFile(h, buf, EXT2_INJECT_BUF_SIZE, &rd, NULL)) {
+			uprintf("Could not read '%s': %s", path, WindowsErrorString());
+			r = EXT2_ET_SHORT_READ;
+			break;
+		}
+		if (rd == 0)
+			break;
+		// ext2fs_file_write() maintains the inode size as we extend the file
+		r = ext2fs_file_write(ext2fd, buf, rd, &written);
+		if ((r == 0) && ((DWORD)written != rd))
+			r = EXT2_ET_SHORT_WRITE;
+		num_injected_bytes += rd;
+		if (IS_ERROR(FormatStatus))
+			r = EXT2_ET_CANCEL_REQUESTED;
+	}
+	if (ext2fd != NULL)
+		ext2fs_file_close(ext2fd);
+	free(buf);
+	CloseHandle(h);
+	if (r == 0)
+		num_injected_files++;
+	return r;
+}
+
+static errcode_t ext2_inject_tree(ext2_filsys fs, ext2_ino_t dir_ino, const char* src_dir)
+{
+	errcode_t r = 0;
+	char path[MAX_PATH];
+	char* name = NULL;
+	wchar_t* wpath = NULL;
+	ext2_ino_t sub_ino;
+	WIN32_FIND_DATAW fd;
+	HANDLE hFind;
+
+	static_sprintf(path, "%s\\*", src_dir);
+	wpath = utf8_to_wchar(path);
+	if (wpath == NULL)
+		return EXT2_ET_NO_MEMORY;
+	hFind = FindFirstFileW(wpath, &fd);
+	free(wpath);
+	if (hFind == INVALID_HANDLE_VALUE)
+		return EXT2_ET_FILE_NOT_FOUND;
+	do {
+		if ((wcscmp(fd.cFileName, L".") == 0) || (wcscmp(fd.cFileName, L"..") == 0))
+			continue;
+		name = wchar_to_utf8(fd.cFileName);
+		if (name == NULL) {
+			r = EXT2_ET_NO_MEMORY;
+			break;
+		}
+		static_sprintf(path, "%s\\%s", src_dir, name);
+		if (fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
+			r = ext2fs_mkdir(fs, dir_ino, 0, name);
+			if (r == EXT2_ET_DIR_NO_SPACE) {
+				r = ext2fs_expand_dir(fs, dir_ino);
+				if (r == 0)
+					r = ext2fs_mkdir(fs, dir_ino, 0, name);
+			}
+			if (r == 0)
+				r = ext2fs_namei(fs, EXT2_ROOT_INO, dir_ino, name, &sub_ino);
+			if (r == 0)
+				r = ext2_inject_tree(fs, sub_ino, path);
+		} else {
+			r = ext2_inject_file(fs, dir_ino, name, path);
+		}
+		safe_free(name);
+	} while ((r == 0) && FindNextFileW(hFind, &fd));
+	safe_free(name);
+	FindClose(hFind);
+	return r;
+}
+
+/*
+ * Stream the contents of local directory SeedDir into an existing ext2/ext3
+ * volume, through the physical drive handle. FormatExtFs() performs the same
+ * injection on the file system it just created when the "PersistenceSeedDir"
+ * setting points to a directory, which avoids this extra volume open.
+ */
+BOOL ExtInjectSeedDir(DWORD DriveIndex, uint64_t PartitionOffset, const char* SeedDir)
+{
+	BOOL ret = FALSE;
+	errcode_t r;
+	ext2_filsys ext2fs = NULL;
+	char* volume_name = GetExtPartitionName(DriveIndex, PartitionOffset);
+
+	if ((volume_name == NULL) || (SeedDir == NULL))
+		goto out;
+	r = ext2fs_open(volume_name, EXT2_FLAG_RW | EXT2_FLAG_EXCLUSIVE | EXT2_FLAG_SKIP_MMP, 0, 0, nt_io_manager, &ext2fs);
+	if (r != 0) {
+		uprintf("Could not open ext volume: %s", error_message(r));
+		goto out;
+	}
+	r = ext2fs_read_bitmaps(ext2fs);
+	if (r != 0) {
+		uprintf("Could not read ext volume bitmaps: %s", error_message(r));
+		goto out;
+	}
+	uprintf("Populating ext volume from '%s'...", SeedDir);
+	num_injected_files = 0;
+	num_injected_bytes = 0;
+	r = ext2_inject_tree(ext2fs, EXT2_ROOT_INO, SeedDir);
+	if (r != 0) {
+		uprintf("Could not populate ext volume: %s", error_message(r));
+		goto out;
+	}
+	// A successful close flushes the bitmaps and frees the file system
+	r = ext2fs_close(ext2fs);
+	ext2fs = NULL;
+	if (r != 0) {
+		uprintf("Could not flush ext volume: %s", error_message(r));
+		goto out;
+	}
+	uprintf("Wrote %d file(s) (%s) from seed directory", (int)num_injected_files,
+		SizeToHumanReadable(num_injected_bytes, FALSE, FALSE));
+	ret = TRUE;
+
+out:
+	if (ext2fs != NULL)
+		ext2fs_close(ext2fs);
+	free(volume_name);
+	return ret;
+}
+
 #define TEST_IMG_PATH               "\\??\\C:\\tmp\\disk.img"
 #define TEST_IMG_SIZE               4000		// Size in MB
 #define SET_EXT2_FORMAT_ERROR(x)    if (!IS_ERROR(FormatStatus)) FormatStatus = ext2_last_winerror(x)
 
+// Worker pool used to initialize the inode tables of independent block groups
+// in parallel. Each worker opens its own io_channel on the volume, so no
+// ext2fs library state is shared between threads.
+#define EXT2_NUM_WORKERS            4
+#define EXT2_ZERO_STRIDE            1024	// Blocks zeroed per device write
+
+typedef struct {
+	const char* volume_name;
+	int block_size;
+	blk64_t* start;
+	int* count;
+	int num_ranges;
+	int worker_index;
+	volatile LONG* num_done;
+	errcode_t err;
+} ext2_zero_job_t;
+
+static DWORD WINAPI ZeroInodeTablesThread(LPVOID param)
+{
+	ext2_zero_job_t* job = (ext2_zero_job_t*)param;
+	io_channel channel = NULL;
+	uint8_t* buf = NULL;
+	errcode_t r;
+	int i, chunk, count;
+	blk64_t cur;
+
+	r = nt_io_manager->open(job->volume_name, EXT2_FLAG_RW, &channel);
+	if (r != 0)
+		goto out;
+	r = io_channel_set_blksize(channel, job->block_size);
+	if (r != 0)
+		goto out;
+	buf = calloc(EXT2_ZERO_STRIDE, job->block_size);
+	if (buf == NULL) {
+		r = EXT2_ET_NO_MEMORY;
+		goto out;
+	}
+
+	// Ranges are striped across the workers
+	for (i = job->worker_index; i < job->num_ranges; i += EXT2_NUM_WORKERS) {
+		cur = job->start[i];
+		count = job->count[i];
+		while ((count > 0) && (r == 0)) {
+			chunk = min(count, EXT2_ZERO_STRIDE);
+			r = io_channel_write_blk64(channel, cur, chunk, buf);
+			cur += chunk;
+			count -= chunk;
+		}
+		InterlockedIncrement(job->num_done);
+		if ((r != 0) || IS_ERROR(FormatStatus))
+			break;
+	}
+
+out:
+	if (channel != NULL)
+		io_channel_close(channel);
+	free(buf);
+	job->err = r;
+	return (r == 0) ? 0 : 1;
+}
+
+#if defined(RUFUS_TEST)
+#include <psapi.h>
+// Format the test image once with each block/inode bitmap backend, reporting
+// the duration and peak RSS of both through the log, so that the size
+// crossover applied by ext2fs_initialize() can be validated. Note that
+// PeakWorkingSetSize is monotonic for the whole process, which is why the
+// lean rb-tree backend is benchmarked first.
+static BOOL bitmap_benchmark_done = FALSE;
+static void BitmapBackendBenchmark(DWORD DriveIndex, uint64_t PartitionOffset, DWORD BlockSize, LPCSTR FSName, LPCSTR Label, DWORD Flags)
+{
+	const struct { const char* name; int type; } backend[2] = {
+		{ "rb-tree", EXT2FS_BMAP64_RBTREE },
+		{ "bitarray", EXT2FS_BMAP64_BITARRAY }
+	};
+	PROCESS_MEMORY_COUNTERS pmc = { sizeof(pmc) };
+	char env[32];
+	uint64_t start_time;
+	int i;
+
+	bitmap_benchmark_done = TRUE;
+	for (i = 0; i < ARRAYSIZE(backend); i++) {
+		static_sprintf(env, "EXT2FS_BITMAP_TYPE=%d", backend[i].type);
+		_putenv(env);
+		start_time = GetTickCount64();
+		if (!FormatExtFs(DriveIndex, PartitionOffset, BlockSize, FSName, Label, Flags))
+			uprintf("Bitmap benchmark: %s backend failed", backend[i].name);
+		IGNORE_RETVAL(GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc)));
+		uprintf("Bitmap benchmark: %s backend: %llu ms, process peak RSS %s", backend[i].name,
+			GetTickCount64() - start_time, SizeToHumanReadable(pmc.PeakWorkingSetSize, FALSE, FALSE));
+	}
+	_putenv("EXT2FS_BITMAP_TYPE=");
+}
+#endif
+
 BOOL FormatExtFs(DWORD DriveIndex, uint64_t PartitionOffset, DWORD BlockSize, LPCSTR FSName, LPCSTR Label, DWORD Flags)
 {
 	// Mostly taken from mke2fs.conf
@@ -239,11 +511,17 @@ BOOL FormatExtFs(DWORD DriveIndex, uint64_t PartitionOffset, DWORD BlockSize, LP
 
 	BOOL ret = FALSE;
 	char* volume_name = NULL;
-	int i, count;
+	char* seed_dir = NULL;
+	int i, count, num_ranges = 0, num_workers = 0;
 	struct ext2_super_block features = { 0 };
 	io_manager manager = nt_io_manager;
 	blk_t journal_size;
-	blk64_t size = 0, cur;
+	blk64_t size = 0;
+	blk64_t* zero_start = NULL;
+	int* zero_count = NULL;
+	ext2_zero_job_t zero_job[EXT2_NUM_WORKERS] = { {0} };
+	HANDLE zero_thread[EXT2_NUM_WORKERS] = { NULL };
+	volatile LONG zero_done = 0;
 	ext2_filsys ext2fs = NULL;
 	errcode_t r;
 	uint8_t* buf = NULL;
@@ -254,6 +532,8 @@ BOOL FormatExtFs(DWORD DriveIndex, uint64_t PartitionOffset, DWORD BlockSize, LP
 	HANDLE h;
 	DWORD dwSize;
 	HCRYPTPROV hCryptProv = 0;
+	if (!bitmap_benchmark_done)
+		BitmapBackendBenchmark(DriveIndex, PartitionOffset, BlockSize, FSName, Label, Flags);
 	volume_name = strdup(TEST_IMG_PATH);
 	uprintf("Creating '%s'...", volume_name);
 	if (!CryptAcquireContext(&hCryptProv, NULL, NULL, PROV_RSA_FULL, CRYPT_VERIFYCONTEXT) || !CryptGenRandom(hCryptProv, sizeof(zb), zb)) {
@@ -340,6 +620,14 @@ BOOL FormatExtFs(DWORD DriveIndex, uint64_t PartitionOffset, DWORD BlockSize, LP
 	ext2fs_set_feature_xattr(&features);
 	if (FSName[3] != '2')
 		ext2fs_set_feature_journal(&features);
+	// Use checksummed group descriptors (uninit_bg) to defer inode table init:
+	// each group then records how much of its inode table is unused, so the
+	// zeroing pass below only touches the tables that are actually in use,
+	// instead of writing out every block group serially. This is a RO_COMPAT
+	// feature that the legacy ext2 driver doesn't know about, so we only apply
+	// it to ext3, which any ext4-capable driver mounts with it just fine.
+	if ((Flags & FP_QUICK) && (FSName[3] != '2'))
+		ext2fs_set_feature_gdt_csum(&features);
 	features.s_default_mount_opts = EXT2_DEFM_XATTR_USER | EXT2_DEFM_ACL;
 
 	// Now that we have set our base features, initialize a virtual superblock
@@ -349,6 +637,8 @@ BOOL FormatExtFs(DWORD DriveIndex, uint64_t PartitionOffset, DWORD BlockSize, LP
 		uprintf("Could not initialize %s features: %s", FSName, error_message(r));
 		goto out;
 	}
+	uprintf("Using %s bitmaps for block allocation",
+		(ext2fs->default_bitmap_type == EXT2FS_BMAP64_RBTREE) ? "rb-tree" : "flat bitarray");
 
 	// Zero 16 blocks of data from the start of our volume
 	buf = calloc(16, ext2fs->io->block_size);
@@ -388,19 +678,58 @@ BOOL FormatExtFs(DWORD DriveIndex, uint64_t PartitionOffset, DWORD BlockSize, LP
 	ext2_percent_share = (FSName[3] == '2') ? 1.0f : 0.5f;
 	uprintf("Creating %d inode sets: [1 marker = %0.1f set(s)]", ext2fs->group_desc_count,
 		max((float)ext2fs->group_desc_count / ext2_max_marker, 1.0f));
+	// Block groups are independent, so their inode tables can be zeroed by a
+	// worker pool rather than one group at a time
+	zero_start = malloc(ext2fs->group_desc_count * sizeof(blk64_t));
+	zero_count = malloc(ext2fs->group_desc_count * sizeof(int));
+	if ((zero_start == NULL) || (zero_count == NULL)) {
+		SET_EXT2_FORMAT_ERROR(ERROR_NOT_ENOUGH_MEMORY);
+		goto out;
+	}
 	for (i = 0; i < (int)ext2fs->group_desc_count; i++) {
-		if (ext2fs_print_progress((int64_t)i, (int64_t)ext2fs->group_desc_count))
-			goto out;
-		cur = ext2fs_inode_table_loc(ext2fs, i);
 		count = ext2fs_div_ceil((ext2fs->super->s_inodes_per_group - ext2fs_bg_itable_unused(ext2fs, i))
 			* EXT2_INODE_SIZE(ext2fs->super), EXT2_BLOCK_SIZE(ext2fs->super));
-		r = ext2fs_zero_blocks2(ext2fs, cur, count, &cur, &count);
-		if (r != 0) {
+		// With uninit_bg, most groups have their whole inode table marked unused
+		if (count == 0)
+			continue;
+		zero_start[num_ranges] = ext2fs_inode_table_loc(ext2fs, i);
+		zero_count[num_ranges++] = count;
+	}
+	for (i = 0; i < EXT2_NUM_WORKERS && i < num_ranges; i++) {
+		zero_job[i].volume_name = volume_name;
+		zero_job[i].block_size = EXT2_BLOCK_SIZE(ext2fs->super);
+		zero_job[i].start = zero_start;
+		zero_job[i].count = zero_count;
+		zero_job[i].num_ranges = num_ranges;
+		zero_job[i].worker_index = i;
+		zero_job[i].num_done = &zero_done;
+		// Keep the handle array compact so it can be waited on as one block
+		zero_thread[num_workers] = CreateThread(NULL, 0, ZeroInodeTablesThread, &zero_job[i], 0, NULL);
+		if (zero_thread[num_workers] == NULL)
+			// Run this worker's share synchronously
+			IGNORE_RETVAL(ZeroInodeTablesThread(&zero_job[i]));
+		else
+			num_workers++;
+	}
+	while (num_workers > 0) {
+		if (WaitForMultipleObjects(num_workers, zero_thread, TRUE, 100) != WAIT_TIMEOUT)
+			break;
+		// Keeps the progress moving and lets the workers see a user cancel
+		IGNORE_RETVAL(ext2fs_print_progress((int64_t)zero_done, (int64_t)num_ranges));
+	}
+	if (num_workers > 0)
+		WaitForMultipleObjects(num_workers, zero_thread, TRUE, INFINITE);
+	for (i = 0; i < num_workers; i++)
+		safe_closehandle(zero_thread[i]);
+	for (i = 0; i < EXT2_NUM_WORKERS && i < num_ranges; i++) {
+		if (zero_job[i].err != 0) {
 			SET_EXT2_FORMAT_ERROR(ERROR_WRITE_FAULT);
-			uprintf("\r\nCould not zero inode set at position %llu (%d blocks): %s", cur, count, error_message(r));
+			uprintf("\r\nCould not zero inode sets: %s", error_message(zero_job[i].err));
 			goto out;
 		}
 	}
+	if (IS_ERROR(FormatStatus))
+		goto out;
 	uprintfs("\r\n");
 
 	// Create root and lost+found dirs
@@ -483,6 +812,29 @@ BOOL FormatExtFs(DWORD DriveIndex, uint64_t PartitionOffset, DWORD BlockSize, LP
 		ext2fs_file_close(ext2fd);
 	}
 
+	// Stream seed content into the fresh file system, if a seed directory was
+	// provided. This reuses the physical handle we just formatted through, so
+	// no OS-level mount of the new volume is needed.
+	seed_dir = ReadSettingStr(SETTING_PERSISTENCE_SEED_DIR);
+	if (seed_dir[0] != 0) {
+		if ((GetFileAttributesU(seed_dir) == INVALID_FILE_ATTRIBUTES) ||
+			!(GetFileAttributesU(seed_dir) & FILE_ATTRIBUTE_DIRECTORY)) {
+			uprintf("Seed directory '%s' is not accessible - ignoring it", seed_dir);
+		} else {
+			uprintf("Populating file system from '%s'...", seed_dir);
+			num_injected_files = 0;
+			num_injected_bytes = 0;
+			r = ext2_inject_tree(ext2fs, EXT2_ROOT_INO, seed_dir);
+			if (r != 0) {
+				SET_EXT2_FORMAT_ERROR(ERROR_WRITE_FAULT);
+				uprintf("Could not populate file system: %s", error_message(r));
+				goto out;
+			}
+			uprintf("Wrote %d file(s) (%s) from the seed directory", (int)num_injected_files,
+				SizeToHumanReadable(num_injected_bytes, FALSE, FALSE));
+		}
+	}
+
 	// Finally we can call close() to get the file system gets created
 	r = ext2fs_close(ext2fs);
 	if (r != 0) {
@@ -497,6 +849,8 @@ BOOL FormatExtFs(DWORD DriveIndex, uint64_t PartitionOffset, DWORD BlockSize, LP
 out:
 	free(volume_name);
 	ext2fs_free(ext2fs);
+	free(zero_start);
+	free(zero_count);
 	free(buf);
 	return ret;
 }
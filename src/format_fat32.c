@@ -168,7 +168,11 @@ BOOL FormatLargeFAT32(DWORD DriveIndex, uint64_t PartitionOffset, DWORD ClusterS
 	DWORD BackupBootSect = 6;
 	DWORD VolumeId = 0; // calculated before format
 	char* VolumeName = NULL;
-	DWORD BurstSize = 128; // Zero in blocks of 64K typically
+	DWORD BurstSize = 0; // Computed later, 8 MB worth of sectors
+	// Sectors of the system area that must not be zero: boot record, FSInfo,
+	// their backups, and the first sector of each FAT
+	struct { DWORD Sector; void* pData; } SpecialSector[8];
+	DWORD NumSpecial = 0;
 
 	// Calculated later
 	DWORD FatSize = 0;
@@ -409,35 +413,50 @@ BOOL FormatLargeFAT32(DWORD DriveIndex, uint64_t PartitionOffset, DWORD ClusterS
 
 	// First zero out ReservedSect + FatSize * NumFats + SectorsPerCluster
 	SystemAreaSize = ReservedSectCount + (NumFATs * FatSize) + SectorsPerCluster;
-	uprintf("Clearing out %d sectors for reserved sectors, FATs and root cluster...", SystemAreaSize);
+	uprintf("Initializing %d sectors for reserved sectors, FATs and root cluster...", SystemAreaSize);
 
-	// Not the most effective, but easy on RAM
+	// On a 2 TB drive the FATs alone span gigabytes, so issue large aligned
+	// bursts rather than pay for tens of thousands of individual requests
+	BurstSize = (8 * MB) / BytesPerSect;
 	pZeroSect = (BYTE*)calloc(BytesPerSect, BurstSize);
 	if (!pZeroSect) {
 		die("Failed to allocate memory", ERROR_NOT_ENOUGH_MEMORY);
 	}
 
-	for (i = 0; i < (SystemAreaSize + BurstSize - 1); i += BurstSize) {
-		UpdateProgressWithInfo(OP_FORMAT, MSG_217, (uint64_t)i, (uint64_t)SystemAreaSize + BurstSize);
-		CHECK_FOR_USER_CANCEL;
-		if (write_sectors(hLogicalVolume, BytesPerSect, i, BurstSize, pZeroSect) != (BytesPerSect * BurstSize)) {
-			die("Error clearing reserved sectors", ERROR_WRITE_FAULT);
-		}
-	}
-
-	uprintf ("Initializing reserved sectors and FATs...");
-	// Now we should write the boot sector and fsinfo twice, once at 0 and once at the backup boot sect position
-	for (i = 0; i < 2; i++) {
-		int SectorStart = (i == 0) ? 0 : BackupBootSect;
-		write_sectors(hLogicalVolume, BytesPerSect, SectorStart, 1, pFAT32BootSect);
-		write_sectors(hLogicalVolume, BytesPerSect, SectorStart + 1, 1, pFAT32FsInfo);
+	// The boot sector and fsinfo go in twice, once at 0 and once at the backup boot sect position,
+	// and each FAT starts with a copy of the reserved cluster chain
+	SpecialSector[NumSpecial].Sector = 0;
+	SpecialSector[NumSpecial++].pData = pFAT32BootSect;
+	SpecialSector[NumSpecial].Sector = 1;
+	SpecialSector[NumSpecial++].pData = pFAT32FsInfo;
+	SpecialSector[NumSpecial].Sector = BackupBootSect;
+	SpecialSector[NumSpecial++].pData = pFAT32BootSect;
+	SpecialSector[NumSpecial].Sector = BackupBootSect + 1;
+	SpecialSector[NumSpecial++].pData = pFAT32FsInfo;
+	for (i = 0; i < NumFATs; i++) {
+		uprintf("FAT #%d sector at address: %d", i, ReservedSectCount + (i * FatSize));
+		SpecialSector[NumSpecial].Sector = ReservedSectCount + (i * FatSize);
+		SpecialSector[NumSpecial++].pData = pFirstSectOfFat;
 	}
+	assert(NumSpecial <= ARRAYSIZE(SpecialSector));
 
-	// Write the first fat sector in the right places
-	for (i = 0; i < NumFATs; i++) {
-		int SectorStart = ReservedSectCount + (i * FatSize);
-		uprintf("FAT #%d sector at address: %d", i, SectorStart);
-		write_sectors(hLogicalVolume, BytesPerSect, SectorStart, 1, pFirstSectOfFat);
+	for (i = 0; i < SystemAreaSize; i += BurstSize) {
+		DWORD j, Burst = min(BurstSize, SystemAreaSize - i);
+		UpdateProgressWithInfo(OP_FORMAT, MSG_217, (uint64_t)i, (uint64_t)SystemAreaSize);
+		CHECK_FOR_USER_CANCEL;
+		// Overlay the non zero sectors that fall inside this burst, so that the
+		// whole system area goes out as a single sequence of large writes
+		for (j = 0; j < NumSpecial; j++) {
+			if ((SpecialSector[j].Sector >= i) && (SpecialSector[j].Sector < i + Burst))
+				memcpy(&pZeroSect[(SpecialSector[j].Sector - i) * BytesPerSect], SpecialSector[j].pData, BytesPerSect);
+		}
+		if (write_sectors(hLogicalVolume, BytesPerSect, i, Burst, pZeroSect) != ((int64_t)Burst * BytesPerSect)) {
+			die("Error initializing system area", ERROR_WRITE_FAULT);
+		}
+		for (j = 0; j < NumSpecial; j++) {
+			if ((SpecialSector[j].Sector >= i) && (SpecialSector[j].Sector < i + Burst))
+				memset(&pZeroSect[(SpecialSector[j].Sector - i) * BytesPerSect], 0, BytesPerSect);
+		}
 	}
 
 	if (!(Flags & FP_NO_BOOT)) {
@@ -0,0 +1,277 @@
+/*
+ * Rufus: The Reliable USB Formatting Utility
+ * Gzip compression, for the optical media capture path
+ * Copyright © 2022 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * This is a deliberately small DEFLATE encoder (RFC 1951), wrapped into the
+ * gzip format (RFC 1952). It only produces fixed Huffman blocks, with greedy
+ * hash-head LZ77 matching, and falls back to stored blocks for incompressible
+ * data, which keeps it a few hundred lines while compressing typical ISO9660
+ * content to roughly what 'gzip -2' achieves. Each call to GzCompress() emits
+ * a complete, independent gzip member - concatenated members are valid gzip
+ * per RFC 1952 - which is what allows the capture path to compress multiple
+ * chunks in parallel and simply write them out in order.
+ */
+
+/* Memory leaks detection - define _CRTDBG_MAP_ALLOC as preprocessor macro */
+#ifdef _CRTDBG_MAP_ALLOC
+#include <stdlib.h>
+#include <crtdbg.h>
+#endif
+
+#include <windows.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rufus.h"
+
+#define GZ_WINDOW_SIZE      32768
+#define GZ_MIN_MATCH        3
+#define GZ_MAX_MATCH        258
+#define GZ_HASH_BITS        15
+#define GZ_HASH_SIZE        (1 << GZ_HASH_BITS)
+#define GZ_STORED_MAX       65535
+
+static uint32_t crc32_table[256];
+static BOOL crc32_table_ready = FALSE;
+
+static void gz_crc32_init(void)
+{
+	uint32_t c, i, j;
+
+	for (i = 0; i < 256; i++) {
+		c = i;
+		for (j = 0; j < 8; j++)
+			c = (c & 1) ? (c >> 1) ^ 0xedb88320 : (c >> 1);
+		crc32_table[i] = c;
+	}
+	crc32_table_ready = TRUE;
+}
+
+static uint32_t gz_crc32(const uint8_t* buf, uint32_t size)
+{
+	uint32_t crc = 0xffffffff, i;
+
+	for (i = 0; i < size; i++)
+		crc = crc32_table[(crc ^ buf[i]) & 0xff] ^ (crc >> 8);
+	return crc ^ 0xffffffff;
+}
+
+/* LSB-first bit writer, as DEFLATE requires */
+typedef struct {
+	uint8_t* buf;
+	uint32_t size;
+	uint32_t pos;
+	uint32_t bitbuf;
+	int bitcnt;
+	BOOL overflow;
+} gz_bitstream;
+
+static void gz_put_bits(gz_bitstream* bs, uint32_t bits, int count)
+{
+	bs->bitbuf |= bits << bs->bitcnt;
+	bs->bitcnt += count;
+	while (bs->bitcnt >= 8) {
+		if (bs->pos < bs->size)
+			bs->buf[bs->pos] = (uint8_t)bs->bitbuf;
+		else
+			bs->overflow = TRUE;
+		bs->pos++;
+		bs->bitbuf >>= 8;
+		bs->bitcnt -= 8;
+	}
+}
+
+/* Huffman codes are transmitted MSB first, so reverse them before emission */
+static void gz_put_code(gz_bitstream* bs, uint32_t code, int len)
+{
+	uint32_t rev = 0;
+	int i;
+
+	for (i = 0; i < len; i++)
+		rev |= ((code >> i) & 1) << (len - 1 - i);
+	gz_put_bits(bs, rev, len);
+}
+
+static void gz_flush_bits(gz_bitstream* bs)
+{
+	if (bs->bitcnt > 0)
+		gz_put_bits(bs, 0, 8 - bs->bitcnt);
+}
+
+/* Fixed Huffman literal/length code, per RFC 1951 3.2.6 */
+static void gz_put_lit(gz_bitstream* bs, uint32_t sym)
+{
+	if (sym <= 143)
+		gz_put_code(bs, 0x30 + sym, 8);
+	else if (sym <= 255)
+		gz_put_code(bs, 0x190 + sym - 144, 9);
+	else if (sym <= 279)
+		gz_put_code(bs, sym - 256, 7);
+	else
+		gz_put_code(bs, 0xc0 + sym - 280, 8);
+}
+
+static const uint16_t len_base[29] = {
+	3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+	35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+static const uint8_t len_extra[29] = {
+	0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+	3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+static const uint16_t dist_base[30] = {
+	1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+	257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577
+};
+static const uint8_t dist_extra[30] = {
+	0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+	7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
+
+static void gz_put_match(gz_bitstream* bs, uint32_t len, uint32_t dist)
+{
+	int i;
+
+	for (i = 28; len < len_base[i]; i--);
+	gz_put_lit(bs, 257 + i);
+	gz_put_bits(bs, len - len_base[i], len_extra[i]);
+	for (i = 29; dist < dist_base[i]; i--);
+	gz_put_code(bs, i, 5);
+	gz_put_bits(bs, dist - dist_base[i], dist_extra[i]);
+}
+
+static __inline uint32_t gz_hash(const uint8_t* p)
+{
+	return (((uint32_t)p[0] << 16) ^ ((uint32_t)p[1] << 8) ^ p[2]) * 2654435761u >> (32 - GZ_HASH_BITS);
+}
+
+/*
+ * Worst case output size for a source of the provided size, reached when the
+ * data is incompressible and gets emitted as stored blocks.
+ */
+uint32_t GzCompressBound(uint32_t size)
+{
+	return size + 5 * (size / GZ_STORED_MAX + 1) + 18;
+}
+
+/* Emit the whole source as stored blocks, used when fixed Huffman loses */
+static uint32_t gz_store(uint8_t* dst, uint32_t dst_size, const uint8_t* src, uint32_t src_size, uint32_t pos)
+{
+	uint32_t block_size, p = 0;
+
+	while (TRUE) {
+		block_size = min(src_size - p, GZ_STORED_MAX);
+		if (pos + 5 + block_size > dst_size)
+			return 0;
+		dst[pos++] = (p + block_size == src_size) ? 1 : 0;
+		dst[pos++] = (uint8_t)block_size;
+		dst[pos++] = (uint8_t)(block_size >> 8);
+		dst[pos++] = (uint8_t)~block_size;
+		dst[pos++] = (uint8_t)(~block_size >> 8);
+		memcpy(&dst[pos], &src[p], block_size);
+		pos += block_size;
+		p += block_size;
+		if (p >= src_size)
+			return pos;
+	}
+}
+
+/*
+ * Compress a buffer into a single complete gzip member.
+ * Returns the compressed size, or 0 if the destination is too small
+ * (which cannot happen when it was sized with GzCompressBound).
+ */
+uint32_t GzCompress(uint8_t* dst, uint32_t dst_size, const uint8_t* src, uint32_t src_size)
+{
+	static const uint8_t gz_header[10] = { 0x1f, 0x8b, 0x08, 0x00, 0, 0, 0, 0, 0x00, 0x03 };
+	int32_t* head = NULL;
+	uint32_t p = 0, i, h, cand, len, max_len, crc, pos;
+	gz_bitstream bs = { 0 };
+
+	if ((dst == NULL) || (src == NULL) || (dst_size < GzCompressBound(0)))
+		return 0;
+	if (!crc32_table_ready)
+		gz_crc32_init();
+
+	memcpy(dst, gz_header, sizeof(gz_header));
+	bs.buf = dst;
+	bs.size = dst_size - 8;	// Always leave room for the trailer
+	bs.pos = sizeof(gz_header);
+
+	head = (int32_t*)malloc(GZ_HASH_SIZE * sizeof(int32_t));
+	if (head == NULL)
+		return 0;
+	memset(head, 0xff, GZ_HASH_SIZE * sizeof(int32_t));
+
+	// Single fixed Huffman block (BFINAL = 1, BTYPE = 01)
+	gz_put_bits(&bs, 0x3, 3);
+	while (p < src_size) {
+		len = 0;
+		if (p + GZ_MIN_MATCH <= src_size) {
+			h = gz_hash(&src[p]);
+			cand = head[h];
+			head[h] = p;
+			if (((int32_t)cand >= 0) && (p - cand <= GZ_WINDOW_SIZE)) {
+				max_len = min(GZ_MAX_MATCH, src_size - p);
+				while ((len < max_len) && (src[cand + len] == src[p + len]))
+					len++;
+			}
+		}
+		if (len >= GZ_MIN_MATCH) {
+			gz_put_match(&bs, len, p - cand);
+			// Keep the hash heads current across the matched range
+			for (i = 1; (i < len) && (p + i + GZ_MIN_MATCH <= src_size); i++)
+				head[gz_hash(&src[p + i])] = p + i;
+			p += len;
+		} else {
+			gz_put_lit(&bs, src[p]);
+			p++;
+		}
+		// Bail out early once fixed Huffman is already losing to stored
+		if (bs.pos > sizeof(gz_header) + src_size + 5 * (src_size / GZ_STORED_MAX + 1))
+			break;
+	}
+	free(head);
+
+	if (p >= src_size) {
+		gz_put_lit(&bs, 256);	// End of block
+		gz_flush_bits(&bs);
+		pos = bs.overflow ? 0 : bs.pos;
+	} else {
+		pos = 0;
+	}
+	// Stored fallback for incompressible data
+	if ((pos == 0) || (pos > sizeof(gz_header) + src_size + 5 * (src_size / GZ_STORED_MAX + 1)))
+		pos = gz_store(dst, dst_size - 8, src, src_size, sizeof(gz_header));
+	if (pos == 0)
+		return 0;
+
+	crc = gz_crc32(src, src_size);
+	dst[pos++] = (uint8_t)crc;
+	dst[pos++] = (uint8_t)(crc >> 8);
+	dst[pos++] = (uint8_t)(crc >> 16);
+	dst[pos++] = (uint8_t)(crc >> 24);
+	dst[pos++] = (uint8_t)src_size;
+	dst[pos++] = (uint8_t)(src_size >> 8);
+	dst[pos++] = (uint8_t)(src_size >> 16);
+	dst[pos++] = (uint8_t)(src_size >> 24);
+	return pos;
+}
@@ -48,6 +48,7 @@
 #include "resource.h"
 #include "msapi_utf8.h"
 #include "localization.h"
+#include "winio.h"
 #include "bled/bled.h"
 
 // How often should we update the progress bar (in 2K blocks) as updating
@@ -119,11 +120,289 @@ static const char* stupid_antivirus = "  NOTE: This is usually caused by a poorl
 	"look into using a *SMARTER* antivirus solution.";
 const char* old_c32_name[NB_OLD_C32] = OLD_C32_NAMES;
 static const int64_t old_c32_threshold[NB_OLD_C32] = OLD_C32_THRESHOLD;
+
+/*
+ * Consolidated matcher for all the exact (case insensitive) file names that
+ * check_iso_props() looks for. A single binary search probe on the lowercased
+ * basename tells which of the name sets above - if any - a directory record
+ * can possibly belong to, instead of chaining stricmp() calls over every
+ * known name for each of the (possibly 100k+) records of a scan. The original
+ * per-set checks then only run on a positive probe, to refine indexes and
+ * extra conditions (directory, file size, ...).
+ * NB: This list must be kept sorted and in sync with the name sets above.
+ */
+#define NM_SYSLINUX_CFG		0x0001
+#define NM_OLD_C32			0x0002
+#define NM_GRUB_CFG			0x0004
+#define NM_MENU_CFG			0x0008
+#define NM_LDLINUX_SYS		0x0010
+#define NM_LDLINUX_C32		0x0020
+#define NM_ROOT_MARKER		0x0040	// bootmgr[.efi], grldr, kolibri.img, .miso, md5sums
+#define NM_REACTOS			0x0080
+#define NM_EFI_BOOT			0x0100
+#define NM_WININST			0x0200
+#define NM_COMPATRES		0x0400
+#define NM_PE_FILE			0x0800
+#define NM_ISOLINUX_BIN		0x1000
+typedef struct {
+	const char* name;
+	uint16_t mask;
+} known_name;
+static const known_name known_name_list[] = {
+	{ ".miso", NM_ROOT_MARKER },
+	{ "boot.bin", NM_ISOLINUX_BIN },
+	{ "bootaa64.efi", NM_EFI_BOOT },
+	{ "bootarm.efi", NM_EFI_BOOT },
+	{ "bootebc.efi", NM_EFI_BOOT },
+	{ "bootia32.efi", NM_EFI_BOOT },
+	{ "bootia64.efi", NM_EFI_BOOT },
+	{ "bootmgr", NM_ROOT_MARKER },
+	{ "bootmgr.efi", NM_ROOT_MARKER },
+	{ "bootriscv128.efi", NM_EFI_BOOT },
+	{ "bootriscv32.efi", NM_EFI_BOOT },
+	{ "bootriscv64.efi", NM_EFI_BOOT },
+	{ "bootx64.efi", NM_EFI_BOOT },
+	{ "compatresources.dll", NM_COMPATRES },
+	{ "extlinux.conf", NM_SYSLINUX_CFG },
+	{ "grldr", NM_ROOT_MARKER },
+	{ "grub.cfg", NM_GRUB_CFG },
+	{ "install.esd", NM_WININST },
+	{ "install.swm", NM_WININST },
+	{ "install.wim", NM_WININST },
+	{ "isolinux.bin", NM_ISOLINUX_BIN },
+	{ "isolinux.cfg", NM_SYSLINUX_CFG },
+	{ "kolibri.img", NM_ROOT_MARKER },
+	{ "ldlinux.c32", NM_LDLINUX_C32 },
+	{ "ldlinux.sys", NM_LDLINUX_SYS },
+	{ "loopback.cfg", NM_GRUB_CFG },
+	{ "md5sum.txt", NM_ROOT_MARKER },
+	{ "md5sums", NM_ROOT_MARKER },
+	{ "menu.c32", NM_OLD_C32 },
+	{ "menu.cfg", NM_MENU_CFG },
+	{ "ntdetect.com", NM_PE_FILE },
+	{ "setupldr.bin", NM_PE_FILE },
+	{ "setupldr.sys", NM_REACTOS },
+	{ "syslinux.cfg", NM_SYSLINUX_CFG },
+	{ "txt.cfg", NM_SYSLINUX_CFG },
+	{ "txtsetup.sif", NM_PE_FILE },
+	{ "vesamenu.c32", NM_OLD_C32 },
+};
+
+static uint16_t known_name_mask(const char* psz_basename)
+{
+	char name[32];
+	int lo = 0, hi = ARRAYSIZE(known_name_list) - 1, mid, c;
+	size_t i;
+
+	// All the known names are short, so anything longer can't match
+	for (i = 0; psz_basename[i] != 0; i++) {
+		if (i >= sizeof(name) - 1)
+			return 0;
+		name[i] = (char)tolower(psz_basename[i]);
+	}
+	name[i] = 0;
+	while (lo <= hi) {
+		mid = (lo + hi) / 2;
+		c = strcmp(name, known_name_list[mid].name);
+		if (c == 0)
+			return known_name_list[mid].mask;
+		if (c > 0)
+			lo = mid + 1;
+		else
+			hi = mid - 1;
+	}
+	return 0;
+}
+
 static uint8_t joliet_level = 0;
 static uint64_t total_blocks, nb_blocks;
 static BOOL scan_only = FALSE;
 static StrArray config_path, isolinux_path, modified_path;
 
+// In-memory index of the image's file list, built during the scan pass, so that
+// rescans of the same (unmodified) image and later ExtractISOFile() lookups don't
+// have to walk the whole directory tree again.
+typedef struct {
+	char* path;		// ISO path, with '/' separators
+	int64_t size;
+	lsn_t lsn;		// Start LSN (ISO9660 only, 0 for UDF)
+} ISO_INDEX_ENTRY;
+static ISO_INDEX_ENTRY* iso_index = NULL;
+static uint32_t iso_index_len = 0, iso_index_max = 0;
+static char iso_index_image[MAX_PATH] = "";
+static int64_t iso_index_image_size = 0;
+static time_t iso_index_image_mtime = 0;
+static BOOL iso_index_complete = FALSE;
+static RUFUS_IMG_REPORT iso_index_report;
+static uint64_t iso_index_total_blocks = 0;
+// Hash table over the index paths, so that candidate path lookups don't
+// have to scan the whole file list. Built lazily on the first lookup.
+static htab_table iso_index_htab = HTAB_EMPTY;
+
+static void iso_index_clear(void)
+{
+	uint32_t i;
+	htab_destroy(&iso_index_htab);
+	for (i = 0; i < iso_index_len; i++)
+		safe_free(iso_index[i].path);
+	safe_free(iso_index);
+	iso_index_len = 0;
+	iso_index_max = 0;
+	iso_index_image[0] = 0;
+	iso_index_complete = FALSE;
+}
+
+static void iso_index_set_image(const char* iso)
+{
+	struct __stat64 stat;
+	iso_index_clear();
+	if (_stat64U(iso, &stat) != 0)
+		return;
+	static_strcpy(iso_index_image, iso);
+	iso_index_image_size = stat.st_size;
+	iso_index_image_mtime = stat.st_mtime;
+}
+
+static void iso_index_add(const char* psz_path, int64_t file_length, lsn_t lsn)
+{
+	ISO_INDEX_ENTRY* new_index;
+	if (iso_index_image[0] == 0)
+		return;
+	if (iso_index_len >= iso_index_max) {
+		iso_index_max = (iso_index_max == 0) ? 1024 : iso_index_max * 2;
+		new_index = (ISO_INDEX_ENTRY*)realloc(iso_index, iso_index_max * sizeof(ISO_INDEX_ENTRY));
+		if (new_index == NULL) {
+			uprintf("Could not grow ISO index - invalidating it");
+			iso_index_clear();
+			return;
+		}
+		iso_index = new_index;
+	}
+	iso_index[iso_index_len].path = safe_strdup(psz_path);
+	iso_index[iso_index_len].size = file_length;
+	iso_index[iso_index_len].lsn = lsn;
+	if (iso_index[iso_index_len].path != NULL)
+		iso_index_len++;
+}
+
+// Returns TRUE if we hold a complete index for this exact (unmodified) image
+static BOOL iso_index_matches(const char* iso)
+{
+	struct __stat64 stat;
+	if ((!iso_index_complete) || (safe_strcmp(iso_index_image, iso) != 0))
+		return FALSE;
+	if (_stat64U(iso, &stat) != 0)
+		return FALSE;
+	return (stat.st_size == iso_index_image_size) && (stat.st_mtime == iso_index_image_mtime);
+}
+
+// Normalized (no leading slash, lowercase) copy of a path, for hashing
+static char* iso_index_key(const char* path)
+{
+	char* key;
+	size_t i;
+	if (path[0] == '/')
+		path++;
+	key = safe_strdup(path);
+	if (key != NULL)
+		for (i = 0; key[i] != 0; i++)
+			key[i] = (char)tolower((unsigned char)key[i]);
+	return key;
+}
+
+static void iso_index_build_htab(void)
+{
+	uint32_t i, idx;
+	char* key;
+
+	if ((iso_index_htab.table != NULL) || (iso_index_len == 0))
+		return;
+	if (!htab_create(2 * iso_index_len, &iso_index_htab))
+		return;
+	for (i = 0; i < iso_index_len; i++) {
+		key = iso_index_key(iso_index[i].path);
+		if (key == NULL)
+			continue;
+		idx = htab_hash(key, &iso_index_htab);
+		if ((idx != 0) && (iso_index_htab.table[idx].data == NULL))
+			iso_index_htab.table[idx].data = &iso_index[i];
+		free(key);
+	}
+}
+
+static const ISO_INDEX_ENTRY* iso_index_lookup(const char* iso_file)
+{
+	const ISO_INDEX_ENTRY* ret = NULL;
+	const char* path;
+	char* key;
+	uint32_t i, idx;
+
+	iso_index_build_htab();
+	if (iso_index_htab.table != NULL) {
+		key = iso_index_key(iso_file);
+		// Lookups insert a placeholder entry => don't touch a (near) full table
+		if ((key != NULL) && (iso_index_htab.filled < iso_index_htab.size - 1)) {
+			idx = htab_hash(key, &iso_index_htab);
+			if (idx != 0)
+				ret = (const ISO_INDEX_ENTRY*)iso_index_htab.table[idx].data;
+		}
+		safe_free(key);
+		return ret;
+	}
+
+	// No hash table (e.g. allocation failure) => scan the index
+	if (iso_file[0] == '/')
+		iso_file++;
+	for (i = 0; i < iso_index_len; i++) {
+		path = iso_index[i].path;
+		if (path[0] == '/')
+			path++;
+		if (safe_stricmp(path, iso_file) == 0)
+			return &iso_index[i];
+	}
+	return NULL;
+}
+
+// Scratch buffer for the single file read paths (ExtractISOFile() and
+// GetInstallWimVersion()), which get invoked repeatedly during image
+// selection. Allocated once and reused, so that these calls don't pay
+// allocation and page-fault costs on every image (re)scan.
+#define ISO_SCRATCH_SIZE	(512 * KB)	// Multiple of ISO_BLOCKSIZE & UDF_BLOCKSIZE
+// Upper bound for the in-memory version sniffing of isolinux.bin/normal.mod
+#define SNIFF_BUF_SIZE		(512 * KB)
+static uint8_t* iso_scratch = NULL;
+
+static uint8_t* iso_get_scratch(void)
+{
+	if (iso_scratch == NULL)
+		iso_scratch = malloc(ISO_SCRATCH_SIZE);
+	if (iso_scratch == NULL)
+		uprintf("Could not allocate scratch buffer");
+	return iso_scratch;
+}
+
+// Open handles of the image ExtractISO() is currently processing, published
+// while the post-scan probes (Syslinux/Grub version sniffing, WIM version,
+// txtsetup.sif, compatresources.dll, efi.img bootloaders) run, so that the
+// single file readers below can share them instead of each paying for a
+// fresh udf_open()/iso9660_open_ext() - and the volume descriptor reads
+// that come with it - on every probed file.
+static const char* iso_shared_path = NULL;
+static iso9660_t* iso_shared_iso = NULL;
+static udf_t* iso_shared_udf = NULL;
+
+static __inline BOOL iso_shared_handles_match(const char* iso)
+{
+	return (iso_shared_path != NULL) && (safe_stricmp(iso, iso_shared_path) == 0);
+}
+
+// Per-chunk callback for iso_read_file(). Invoked with each in-flight buffer
+// as it is read from the image ('last' is set on the final chunk). Returning
+// TRUE stops the read early, so a sniffer only costs the I/O it actually needs.
+typedef BOOL (*iso_sniff_fn_t)(const uint8_t* chunk, size_t chunk_size, BOOL last);
+static int64_t iso_read_file(const char* iso, const char* iso_file, uint8_t* buf,
+	size_t size, iso_sniff_fn_t sniff_fn);
+
 // Ensure filenames do not contain invalid FAT32 or NTFS characters
 static __inline char* sanitize_filename(char* filename, BOOL* is_identical)
 {
@@ -163,18 +442,25 @@ static BOOL check_iso_props(const char* psz_dirname, int64_t file_length, const
 	const char* psz_fullpath, EXTRACT_PROPS *props)
 {
 	size_t i, j, len;
+	uint16_t mask;
 
-	// Check for an isolinux/syslinux config file anywhere
 	memset(props, 0, sizeof(EXTRACT_PROPS));
-	for (i = 0; i < ARRAYSIZE(syslinux_cfg); i++) {
-		if (safe_stricmp(psz_basename, syslinux_cfg[i]) == 0) {
-			props->is_cfg = TRUE;	// Required for "extlinux.conf"
-			props->is_syslinux_cfg = TRUE;
-			// Maintain a list of all the isolinux/syslinux config files identified so far
-			if ((scan_only) && (i < 3))
-				StrArrayAdd(&config_path, psz_fullpath, TRUE);
-			if ((scan_only) && (i == 1) && (safe_stricmp(psz_dirname, efi_dirname) == 0))
-				img_report.has_efi_syslinux = TRUE;
+	// Probe the consolidated name list once, then only run the checks whose
+	// name set the basename belongs to
+	mask = known_name_mask(psz_basename);
+
+	// Check for an isolinux/syslinux config file anywhere
+	if (mask & NM_SYSLINUX_CFG) {
+		for (i = 0; i < ARRAYSIZE(syslinux_cfg); i++) {
+			if (safe_stricmp(psz_basename, syslinux_cfg[i]) == 0) {
+				props->is_cfg = TRUE;	// Required for "extlinux.conf"
+				props->is_syslinux_cfg = TRUE;
+				// Maintain a list of all the isolinux/syslinux config files identified so far
+				if ((scan_only) && (i < 3))
+					StrArrayAdd(&config_path, psz_fullpath, TRUE);
+				if ((scan_only) && (i == 1) && (safe_stricmp(psz_dirname, efi_dirname) == 0))
+					img_report.has_efi_syslinux = TRUE;
+			}
 		}
 	}
 
@@ -185,9 +471,11 @@ static BOOL check_iso_props(const char* psz_dirname, int64_t file_length, const
 	}
 
 	// Check for an old incompatible c32 file anywhere
-	for (i = 0; i < NB_OLD_C32; i++) {
-		if ((safe_stricmp(psz_basename, old_c32_name[i]) == 0) && (file_length <= old_c32_threshold[i]))
-			props->is_old_c32[i] = TRUE;
+	if (mask & NM_OLD_C32) {
+		for (i = 0; i < NB_OLD_C32; i++) {
+			if ((safe_stricmp(psz_basename, old_c32_name[i]) == 0) && (file_length <= old_c32_threshold[i]))
+				props->is_old_c32[i] = TRUE;
+		}
 	}
 
 	if (!scan_only) {	// Write-time checks
@@ -195,17 +483,14 @@ static BOOL check_iso_props(const char* psz_dirname, int64_t file_length, const
 		len = safe_strlen(psz_basename);
 		if ((len >= 4) && safe_stricmp(&psz_basename[len - 4], ".cfg") == 0) {
 			props->is_cfg = TRUE;
-			for (i = 0; i < ARRAYSIZE(grub_cfg); i++) {
-				if (safe_stricmp(psz_basename, grub_cfg[i]) == 0)
-					props->is_grub_cfg = TRUE;
-			}
-			if (safe_stricmp(psz_basename, menu_cfg) == 0) {
+			if (mask & NM_GRUB_CFG)
+				props->is_grub_cfg = TRUE;
+			if (mask & NM_MENU_CFG)
 				props->is_menu_cfg = TRUE;
-			}
 		}
 
 		// In case there's an ldlinux.sys on the ISO, prevent it from overwriting ours
-		if ((psz_dirname != NULL) && (psz_dirname[0] == 0) && (safe_stricmp(psz_basename, ldlinux_name) == 0)) {
+		if ((mask & NM_LDLINUX_SYS) && (psz_dirname != NULL) && (psz_dirname[0] == 0)) {
 			uprintf("Skipping '%s' file from ISO image", psz_basename);
 			return TRUE;
 		}
@@ -215,7 +500,7 @@ static BOOL check_iso_props(const char* psz_dirname, int64_t file_length, const
 			img_report.has_grub2 = TRUE;
 
 		// Check for a syslinux v5.0+ file anywhere
-		if (safe_stricmp(psz_basename, ldlinux_c32) == 0) {
+		if (mask & NM_LDLINUX_C32) {
 			has_ldlinux_c32 = TRUE;
 		}
 
@@ -227,7 +512,7 @@ static BOOL check_iso_props(const char* psz_dirname, int64_t file_length, const
 		}
 
 		// Check for various files in root (psz_dirname = "")
-		if ((psz_dirname != NULL) && (psz_dirname[0] == 0)) {
+		if ((mask & NM_ROOT_MARKER) && (psz_dirname != NULL) && (psz_dirname[0] == 0)) {
 			if (safe_stricmp(psz_basename, bootmgr_name) == 0) {
 				img_report.has_bootmgr = TRUE;
 			}
@@ -251,7 +536,7 @@ static BOOL check_iso_props(const char* psz_dirname, int64_t file_length, const
 		}
 
 		// Check for ReactOS' setupldr.sys anywhere
-		if ((img_report.reactos_path[0] == 0) && (safe_stricmp(psz_basename, reactos_name) == 0))
+		if ((mask & NM_REACTOS) && (img_report.reactos_path[0] == 0))
 			static_strcpy(img_report.reactos_path, psz_fullpath);
 
 		// Check for the first 'efi*.img' we can find (that hopefully contains EFI boot files)
@@ -261,43 +546,40 @@ static BOOL check_iso_props(const char* psz_dirname, int64_t file_length, const
 			static_strcpy(img_report.efi_img_path, psz_fullpath);
 
 		// Check for the EFI boot entries
-		if (safe_stricmp(psz_dirname, efi_dirname) == 0) {
+		if ((mask & NM_EFI_BOOT) && (safe_stricmp(psz_dirname, efi_dirname) == 0)) {
 			for (i = 0; i < ARRAYSIZE(efi_bootname); i++)
 				if (safe_stricmp(psz_basename, efi_bootname[i]) == 0)
 					img_report.has_efi |= (2 << i);	// start at 2 since "bootmgr.efi" is bit 0
 		}
 
-		if (psz_dirname != NULL) {
+		if ((mask & (NM_WININST | NM_COMPATRES)) && (psz_dirname != NULL)) {
 			if (safe_stricmp(&psz_dirname[max(0, ((int)safe_strlen(psz_dirname)) -
 				((int)strlen(sources_str)))], sources_str) == 0) {
 				// Check for "install.###" in "###/sources/"
-				for (i = 0; i < ARRAYSIZE(wininst_name); i++) {
-					if (safe_stricmp(psz_basename, wininst_name[i]) == 0) {
-						if (img_report.wininst_index < MAX_WININST) {
-							static_sprintf(img_report.wininst_path[img_report.wininst_index],
-								"?:%s", psz_fullpath);
-							img_report.wininst_index++;
-						}
+				if (mask & NM_WININST) {
+					if (img_report.wininst_index < MAX_WININST) {
+						static_sprintf(img_report.wininst_path[img_report.wininst_index],
+							"?:%s", psz_fullpath);
+						img_report.wininst_index++;
 					}
 				}
 				// Check for "compatresources.dll" in "###/sources/"
-				if (safe_stricmp(psz_basename, compatresources_dll) == 0)
+				if (mask & NM_COMPATRES)
 					img_report.has_compatresources_dll = TRUE;
 			}
 		}
 
 		// Check for PE (XP) specific files in "/i386", "/amd64" or "/minint"
-		for (i=0; i<ARRAYSIZE(pe_dirname); i++)
-			if (safe_stricmp(psz_dirname, pe_dirname[i]) == 0)
-				for (j=0; j<ARRAYSIZE(pe_file); j++)
-					if (safe_stricmp(psz_basename, pe_file[j]) == 0)
-						img_report.winpe |= (1<<j)<<(ARRAYSIZE(pe_dirname)*i);
-
-		for (i=0; i<ARRAYSIZE(isolinux_bin); i++) {
-			if (safe_stricmp(psz_basename, isolinux_bin[i]) == 0) {
-				// Maintain a list of all the isolinux.bin files found
-				StrArrayAdd(&isolinux_path, psz_fullpath, TRUE);
-			}
+		if (mask & NM_PE_FILE)
+			for (i=0; i<ARRAYSIZE(pe_dirname); i++)
+				if (safe_stricmp(psz_dirname, pe_dirname[i]) == 0)
+					for (j=0; j<ARRAYSIZE(pe_file); j++)
+						if (safe_stricmp(psz_basename, pe_file[j]) == 0)
+							img_report.winpe |= (1<<j)<<(ARRAYSIZE(pe_dirname)*i);
+
+		if (mask & NM_ISOLINUX_BIN) {
+			// Maintain a list of all the isolinux.bin files found
+			StrArrayAdd(&isolinux_path, psz_fullpath, TRUE);
 		}
 
 		for (i=0; i<NB_OLD_C32; i++) {
@@ -314,34 +596,69 @@ static BOOL check_iso_props(const char* psz_dirname, int64_t file_length, const
 	return FALSE;
 }
 
-// Apply various workarounds to Linux config files
-static void fix_config(const char* psz_fullpath, const char* psz_path, const char* psz_basename, EXTRACT_PROPS* props)
+// Apply various workarounds to Linux config files.
+// The file that actually gets patched is psz_staged (usually a local staging
+// copy of the file, so that the repeated read + rewrite passes below don't
+// touch the slow target), while psz_fullpath is the final path of the file on
+// the target, used for reporting and for the modified files list. A NULL
+// psz_staged means the file at psz_fullpath is patched in place.
+static void fix_config(const char* psz_staged, const char* psz_fullpath, const char* psz_path, const char* psz_basename, EXTRACT_PROPS* props)
 {
 	BOOL modified = FALSE;
 	size_t i, nul_pos;
-	char *iso_label = NULL, *usb_label = NULL, *src, *dst;
+	char *iso_label = NULL, *usb_label = NULL, *src, *dst, *tgt;
+	char freenas_iso[MAX_PATH] = "", freenas_usb[MAX_PATH];
+	const char* markers[6];
+	uint32_t occ;
 
+	if (psz_staged == NULL)
+		psz_staged = psz_fullpath;
 	nul_pos = safe_strlen(psz_fullpath);
-	src = safe_strdup(psz_fullpath);
-	if (src == NULL)
+	src = safe_strdup(psz_staged);
+	tgt = safe_strdup(psz_fullpath);
+	if ((src == NULL) || (tgt == NULL)) {
+		safe_free(src);
+		safe_free(tgt);
 		return;
-	for (i=0; i<nul_pos; i++)
+	}
+	for (i=0; i<safe_strlen(src); i++)
 		if (src[i] == '/') src[i] = '\\';
+	for (i=0; i<nul_pos; i++)
+		if (tgt[i] == '/') tgt[i] = '\\';
+
+	// Precompute the strings we may have to replace, then find out, in a single pass
+	// over the file content, which of them are actually present, so that we only run
+	// the costly read + rewrite cycle of replace_in_token_data() for markers that
+	// exist. Markers we can't precompute, as well as the whole file if it can't be
+	// byte-matched, are reported as present, in which case behaviour is unchanged.
+	if ((props->is_cfg) || (props->is_conf)) {
+		iso_label = replace_char(img_report.label, ' ', "\\x20");
+		usb_label = replace_char(img_report.usb_label, ' ', "\\x20");
+	}
+	if (props->is_grub_cfg)
+		static_sprintf(freenas_iso, "cd9660:/dev/iso9660/%s", img_report.label);
+	markers[0] = "file=/cdrom/preseed";
+	markers[1] = "maybe-ubiquity";
+	markers[2] = "boot=live";
+	markers[3] = iso_label;
+	markers[4] = "inst.stage2";
+	markers[5] = freenas_iso;
+	occ = scan_file_for_strings(src, markers, ARRAYSIZE(markers));
 
 	// Add persistence to the kernel options
 	if ((boot_type == BT_IMAGE) && HAS_PERSISTENCE(img_report) && persistence_size) {
 		if ((props->is_grub_cfg) || (props->is_menu_cfg) || (props->is_syslinux_cfg)) {
-			if (replace_in_token_data(src, props->is_grub_cfg ? "linux" : "append",
+			if ((occ & 0x01) && replace_in_token_data(src, props->is_grub_cfg ? "linux" : "append",
 				"file=/cdrom/preseed", "persistent file=/cdrom/preseed", TRUE) != NULL) {
 				// Ubuntu & derivatives are assumed to use 'file=/cdrom/preseed/...'
 				// somewhere in their kernel options and use 'persistent' as keyword.
 				uprintf("  Added 'persistent' kernel option");
 				modified = TRUE;
 				// Also remove Ubuntu's "maybe-ubiquity" to avoid splash screen (GRUB only)
-				if ((props->is_grub_cfg) && replace_in_token_data(src, "linux",
+				if ((props->is_grub_cfg) && (occ & 0x02) && replace_in_token_data(src, "linux",
 					"maybe-ubiquity", "", TRUE))
 					uprintf("  Removed 'maybe-ubiquity' kernel option");
-			} else if (replace_in_token_data(src, props->is_grub_cfg ? "linux" : "append",
+			} else if ((occ & 0x04) && replace_in_token_data(src, props->is_grub_cfg ? "linux" : "append",
 				"boot=live", "boot=live persistence", TRUE) != NULL) {
 				// Debian & derivatives are assumed to use 'boot=live' in
 				// their kernel options and use 'persistence' as keyword.
@@ -359,10 +676,8 @@ static void fix_config(const char* psz_fullpath, const char* psz_path, const cha
 	// Workaround for config files requiring an ISO label for kernel append that may be
 	// different from our USB label. Oh, and these labels must have spaces converted to \x20.
 	if ((props->is_cfg) || (props->is_conf)) {
-		iso_label = replace_char(img_report.label, ' ', "\\x20");
-		usb_label = replace_char(img_report.usb_label, ' ', "\\x20");
 		if ((iso_label != NULL) && (usb_label != NULL)) {
-			if (props->is_grub_cfg) {
+			if ((props->is_grub_cfg) && (occ & 0x08)) {
 				// Older versions of GRUB EFI used "linuxefi", newer just use "linux"
 				if ((replace_in_token_data(src, "linux", iso_label, usb_label, TRUE) != NULL) ||
 					(replace_in_token_data(src, "linuxefi", iso_label, usb_label, TRUE) != NULL) ||
@@ -370,12 +685,13 @@ static void fix_config(const char* psz_fullpath, const char* psz_path, const cha
 					// line to their grub.cfg, which means that their kernel option token is no
 					// longer 'linux' but '$linux'... and we have to add a workaround for that.
 					(replace_in_token_data(src, "$linux", iso_label, usb_label, TRUE) != NULL)) {
-					uprintf("  Patched %s: '%s' ➔ '%s'\n", src, iso_label, usb_label);
+					uprintf("  Patched %s: '%s' ➔ '%s'\n", tgt, iso_label, usb_label);
 					modified = TRUE;
 				}
-			} else if (replace_in_token_data(src, (props->is_conf) ? "options" : "append",
+			} else if ((!props->is_grub_cfg) && (occ & 0x08) && replace_in_token_data(src,
+				(props->is_conf) ? "options" : "append",
 				iso_label, usb_label, TRUE) != NULL) {
-				uprintf("  Patched %s: '%s' ➔ '%s'\n", src, iso_label, usb_label);
+				uprintf("  Patched %s: '%s' ➔ '%s'\n", tgt, iso_label, usb_label);
 				modified = TRUE;
 			}
 			//
@@ -383,9 +699,9 @@ static void fix_config(const char* psz_fullpath, const char* psz_path, const cha
 			// Red Hat derivatives have changed their CD-ROM detection policy which leads to the installation source
 			// not being found. So we need to use 'inst.repo' instead of 'inst.stage2' in the kernel options.
 			//
-			if (img_report.rh8_derivative && (replace_in_token_data(src, props->is_grub_cfg ?
+			if (img_report.rh8_derivative && (occ & 0x10) && (replace_in_token_data(src, props->is_grub_cfg ?
 				"linuxefi" : "append", "inst.stage2", "inst.repo", TRUE) != NULL)) {
-				uprintf("  Patched %s: '%s' ➔ '%s'\n", src, "inst.stage2", "inst.repo");
+				uprintf("  Patched %s: '%s' ➔ '%s'\n", tgt, "inst.stage2", "inst.repo");
 				modified = TRUE;
 			}
 		}
@@ -396,33 +712,51 @@ static void fix_config(const char* psz_fullpath, const char* psz_path, const cha
 	// Fix dual BIOS + EFI support for tails and other ISOs
 	if ( (props->is_syslinux_cfg) && (safe_stricmp(psz_path, efi_dirname) == 0) &&
 		 (safe_stricmp(psz_basename, syslinux_cfg[0]) == 0) &&
-		 (!img_report.has_efi_syslinux) && (dst = safe_strdup(src)) ) {
+		 (!img_report.has_efi_syslinux) && (dst = safe_strdup(tgt)) ) {
 		dst[nul_pos-12] = 's'; dst[nul_pos-11] = 'y'; dst[nul_pos-10] = 's';
 		CopyFileA(src, dst, TRUE);
-		uprintf("Duplicated %s to %s\n", src, dst);
+		uprintf("Duplicated %s to %s\n", tgt, dst);
 		free(dst);
 	}
 
 	// Workaround for FreeNAS
-	if (props->is_grub_cfg) {
-		iso_label = malloc(MAX_PATH);
-		usb_label = malloc(MAX_PATH);
-		if ((iso_label != NULL) && (usb_label != NULL)) {
-			safe_sprintf(iso_label, MAX_PATH, "cd9660:/dev/iso9660/%s", img_report.label);
-			safe_sprintf(usb_label, MAX_PATH, "msdosfs:/dev/msdosfs/%s", img_report.usb_label);
-			if (replace_in_token_data(src, "set", iso_label, usb_label, TRUE) != NULL) {
-				uprintf("  Patched %s: '%s' ➔ '%s'\n", src, iso_label, usb_label);
-				modified = TRUE;
-			}
+	if ((props->is_grub_cfg) && (occ & 0x20)) {
+		static_sprintf(freenas_usb, "msdosfs:/dev/msdosfs/%s", img_report.usb_label);
+		if (replace_in_token_data(src, "set", freenas_iso, freenas_usb, TRUE) != NULL) {
+			uprintf("  Patched %s: '%s' ➔ '%s'\n", tgt, freenas_iso, freenas_usb);
+			modified = TRUE;
 		}
-		safe_free(iso_label);
-		safe_free(usb_label);
 	}
 
 	if (modified)
 		StrArrayAdd(&modified_path, psz_fullpath, TRUE);
 
 	free(src);
+	free(tgt);
+}
+
+// Commit a locally staged (and possibly patched) config file to its final
+// path on the target, in a single write, then discard the staging copy
+static BOOL commit_staged_file(const char* psz_staged, const char* psz_fullpath,
+	LPFILETIME creation, LPFILETIME last_access, LPFILETIME modify)
+{
+	BOOL r;
+	HANDLE handle;
+
+	r = CopyFileU(psz_staged, psz_fullpath, FALSE);
+	if (!r) {
+		uprintf("  Error writing file: %s", WindowsErrorString());
+	} else if (modify != NULL) {
+		handle = CreateFileU(psz_fullpath, FILE_WRITE_ATTRIBUTES, FILE_SHARE_READ,
+			NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+		if (handle != INVALID_HANDLE_VALUE) {
+			if (!SetFileTime(handle, creation, last_access, modify))
+				uprintf("  Could not set timestamp: %s", WindowsErrorString());
+			CloseHandle(handle);
+		}
+	}
+	DeleteFileU(psz_staged);
+	return r;
 }
 
 static void print_extracted_file(char* psz_fullpath, uint64_t file_length)
@@ -437,7 +771,7 @@ static void print_extracted_file(char* psz_fullpath, uint64_t file_length)
 		if (psz_fullpath[i] == '/')
 			psz_fullpath[i] = '\\';
 	safe_sprintf(&psz_fullpath[nul_pos], 24, " (%s)", SizeToHumanReadable(file_length, TRUE, FALSE));
-	uprintf("Extracting: %s\n", psz_fullpath);
+	hpuprintf("Extracting: %s\n", psz_fullpath);
 	safe_sprintf(&psz_fullpath[nul_pos], 24, " (%s)", SizeToHumanReadable(file_length, FALSE, FALSE));
 	PrintStatus(0, MSG_000, psz_fullpath);	// MSG_000 is "%s"
 	// ISO9660 cannot handle backslashes
@@ -450,7 +784,7 @@ static void print_extracted_file(char* psz_fullpath, uint64_t file_length)
 
 static void alt_print_extracted_file(const char* psz_fullpath, uint64_t file_length)
 {
-	uprintf("Extracting: %s (%s)", psz_fullpath, SizeToHumanReadable(file_length, FALSE, FALSE));
+	hpuprintf("Extracting: %s (%s)", psz_fullpath, SizeToHumanReadable(file_length, FALSE, FALSE));
 	PrintStatus(0, MSG_000, psz_fullpath);
 }
 
@@ -479,20 +813,323 @@ static void __inline set_directory_timestamp(char* path, LPFILETIME creation, LP
 	safe_closehandle(dir_handle);
 }
 
+// Deferred directory timestamps. Stamping a directory as soon as it is created
+// is wasted effort, since the creation of its entries updates its modification
+// time again, and reopening every directory mid-extraction costs a metadata
+// flush each on exFAT. So we queue the timestamps during the walk and apply
+// them in a single post-extraction pass, deepest directories first.
+typedef struct {
+	char* path;
+	int depth;
+	FILETIME ft[3];		// Creation, access, modification
+} DIR_TIMESTAMP;
+
+static DIR_TIMESTAMP* dir_timestamp = NULL;
+static uint32_t dir_timestamp_len = 0, dir_timestamp_size = 0;
+
+static void defer_directory_timestamp(char* path, LPFILETIME creation, LPFILETIME last_access, LPFILETIME modify)
+{
+	int i;
+	DIR_TIMESTAMP* dt;
+
+	if (dir_timestamp_len >= dir_timestamp_size) {
+		dir_timestamp_size = max(dir_timestamp_size * 2, 512);
+		dt = realloc(dir_timestamp, dir_timestamp_size * sizeof(DIR_TIMESTAMP));
+		if (dt == NULL) {
+			// Not fatal: fall back to stamping the directory right away
+			set_directory_timestamp(path, creation, last_access, modify);
+			return;
+		}
+		dir_timestamp = dt;
+	}
+	dt = &dir_timestamp[dir_timestamp_len];
+	dt->path = safe_strdup(path);
+	if (dt->path == NULL) {
+		set_directory_timestamp(path, creation, last_access, modify);
+		return;
+	}
+	dt->depth = 0;
+	for (i = 0; dt->path[i] != 0; i++)
+		if ((dt->path[i] == '\\') || (dt->path[i] == '/'))
+			dt->depth++;
+	dt->ft[0] = *creation;
+	dt->ft[1] = *last_access;
+	dt->ft[2] = *modify;
+	dir_timestamp_len++;
+}
+
+static int __cdecl dir_timestamp_cmp(const void* a, const void* b)
+{
+	// Deepest directories first, so that parents are always stamped last
+	return ((const DIR_TIMESTAMP*)b)->depth - ((const DIR_TIMESTAMP*)a)->depth;
+}
+
+// Apply and free all the deferred directory timestamps
+static void apply_directory_timestamps(void)
+{
+	uint32_t i;
+
+	if (dir_timestamp_len != 0) {
+		uprintf("Restoring timestamps for %d directories", dir_timestamp_len);
+		qsort(dir_timestamp, dir_timestamp_len, sizeof(DIR_TIMESTAMP), dir_timestamp_cmp);
+		for (i = 0; i < dir_timestamp_len; i++) {
+			set_directory_timestamp(dir_timestamp[i].path, &dir_timestamp[i].ft[0],
+				&dir_timestamp[i].ft[1], &dir_timestamp[i].ft[2]);
+			safe_free(dir_timestamp[i].path);
+		}
+	}
+	safe_free(dir_timestamp);
+	dir_timestamp_len = dir_timestamp_size = 0;
+}
+
+// Parallel extraction pool: the directory walker stays the single reader of
+// the image (libcdio handles are not thread safe), but instead of writing each
+// file synchronously it streams the data to a small pool of writer threads,
+// each owning its own target file. With the 100k+ small files of a Windows
+// ISO, this overlaps the target-side open/write/close latency between files
+// and keeps the device's queue depth busy.
+#define XP_NUM_WRITERS            4
+#define XP_NUM_CHUNKS             4
+#define XP_CHUNK_SIZE             (512 * KB)	// Multiple of ISO_BLOCKSIZE & UDF_BLOCKSIZE
+
+typedef struct {
+	HANDLE thread;
+	HANDLE idle;			// Signaled when the slot can accept a new file
+	HANDLE start;			// Signaled by the producer when a new job is set up
+	HANDLE sem_free, sem_data;
+	char* path;			// Target path (ownership is transferred to the writer)
+	uint64_t file_length;
+	FILETIME ft[3];			// Creation, access, modification
+	BOOL set_time;
+	BOOL quit;
+	int head, tail;
+	DWORD chunk_len[XP_NUM_CHUNKS];
+	uint8_t* chunk[XP_NUM_CHUNKS];
+} XP_WRITER;
+
+static XP_WRITER xp_writer[XP_NUM_WRITERS];
+static BOOL xp_active = FALSE, xp_error = FALSE;
+static int xp_next_slot = 0;
+
+static DWORD WINAPI XpWriterThread(void* param)
+{
+	XP_WRITER* w = (XP_WRITER*)param;
+	HANDLE h, ha;
+	DWORD len, wr_size, pending_len, err;
+	uint64_t start;
+	BOOL ok, r;
+
+	for (;;) {
+		WaitForSingleObject(w->start, INFINITE);
+		if (w->quit)
+			return 0;
+		h = CreatePreallocatedFile(w->path, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ,
+			NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, w->file_length);
+		ok = (h != INVALID_HANDLE_VALUE);
+		if (!ok) {
+			err = GetLastError();
+			uprintf("  Unable to create file: %s", WindowsErrorString());
+			if (((err == ERROR_ACCESS_DENIED) || (err == ERROR_INVALID_HANDLE)) &&
+				(safe_strcmp(&w->path[3], autorun_name) == 0))
+				uprintf(stupid_antivirus);
+			else
+				xp_error = TRUE;
+		}
+		// Reopen the target for overlapped access, so that we can keep one write
+		// in flight (write-behind) while the reader fills the next chunk. Since
+		// the file was preallocated at its full length, NTFS/exFAT don't have to
+		// extend it from within the overlapped writes either.
+		// Files that fit in a single chunk (the overwhelming majority on a
+		// Windows ISO) can't benefit from write-behind, so spare them the cost
+		// of the ReOpenFile() and use the synchronous path below instead.
+		ha = (ok && (w->file_length > XP_CHUNK_SIZE)) ?
+			WrapFileAsync(h, GENERIC_WRITE, FILE_SHARE_READ, 0) : NULL;
+		pending_len = 0;
+		// Drain the data chunks for this file, even after an error
+		for (;;) {
+			WaitForSingleObject(w->sem_data, INFINITE);
+			len = w->chunk_len[w->tail];
+			// Complete the previous overlapped write before its chunk can be reused
+			if (pending_len != 0) {
+				start = GetTickCount64();
+				ISO_BLOCKING(r = WaitFileAsync(ha, DRIVE_ACCESS_TIMEOUT) && GetSizeAsync(ha, &wr_size));
+				PipelineStatsAccount(PS_DEVICE_WRITE, pending_len, GetTickCount64() - start);
+				if (!r || (wr_size != pending_len)) {
+					uprintf("  Error writing file %s: %s", w->path, WindowsErrorString());
+					ok = FALSE;
+					xp_error = TRUE;
+				}
+				pending_len = 0;
+				ReleaseSemaphore(w->sem_free, 1, NULL);
+			}
+			if (len == 0) {
+				w->tail = (w->tail + 1) % XP_NUM_CHUNKS;
+				ReleaseSemaphore(w->sem_free, 1, NULL);
+				break;
+			}
+			if (ok && (ha != NULL)) {
+				if (WriteFileAsync(ha, w->chunk[w->tail], len)) {
+					// Keep this chunk reserved until the write has completed
+					pending_len = len;
+					w->tail = (w->tail + 1) % XP_NUM_CHUNKS;
+					continue;
+				}
+				uprintf("  Error writing file %s: %s", w->path, WindowsErrorString());
+				ok = FALSE;
+				xp_error = TRUE;
+			} else if (ok) {
+				// Synchronous fallback, if the handle could not be reopened overlapped
+				start = GetTickCount64();
+				ISO_BLOCKING(r = WriteFileWithRetry(h, w->chunk[w->tail], len,
+					&wr_size, WRITE_RETRIES));
+				PipelineStatsAccount(PS_DEVICE_WRITE, len, GetTickCount64() - start);
+				if (!r) {
+					uprintf("  Error writing file %s: %s", w->path, WindowsErrorString());
+					ok = FALSE;
+					xp_error = TRUE;
+				}
+			}
+			w->tail = (w->tail + 1) % XP_NUM_CHUNKS;
+			ReleaseSemaphore(w->sem_free, 1, NULL);
+		}
+		if (ha != NULL)
+			CloseFileAsync(ha);
+		if (ok && w->set_time && !SetFileTime(h, &w->ft[0], &w->ft[1], &w->ft[2]))
+			uprintf("  Could not set timestamp: %s", WindowsErrorString());
+		if (h != INVALID_HANDLE_VALUE)
+			ISO_BLOCKING(safe_closehandle(h));
+		safe_free(w->path);
+		SetEvent(w->idle);
+	}
+}
+
+static void xp_exit(void)
+{
+	int i, j;
+
+	for (i = 0; i < XP_NUM_WRITERS; i++) {
+		if (xp_writer[i].thread != NULL) {
+			// Wait for any in-flight file to complete before asking the thread to quit
+			WaitForSingleObject(xp_writer[i].idle, INFINITE);
+			xp_writer[i].quit = TRUE;
+			SetEvent(xp_writer[i].start);
+			WaitForSingleObject(xp_writer[i].thread, INFINITE);
+			safe_closehandle(xp_writer[i].thread);
+		}
+		safe_closehandle(xp_writer[i].idle);
+		safe_closehandle(xp_writer[i].start);
+		safe_closehandle(xp_writer[i].sem_free);
+		safe_closehandle(xp_writer[i].sem_data);
+		for (j = 0; j < XP_NUM_CHUNKS; j++)
+			safe_free(xp_writer[i].chunk[j]);
+	}
+	memset(xp_writer, 0, sizeof(xp_writer));
+	xp_active = FALSE;
+}
+
+static BOOL xp_init(void)
+{
+	int i, j;
+
+	memset(xp_writer, 0, sizeof(xp_writer));
+	xp_error = FALSE;
+	xp_next_slot = 0;
+	for (i = 0; i < XP_NUM_WRITERS; i++) {
+		xp_writer[i].idle = CreateEvent(NULL, FALSE, TRUE, NULL);
+		xp_writer[i].start = CreateEvent(NULL, FALSE, FALSE, NULL);
+		xp_writer[i].sem_free = CreateSemaphore(NULL, XP_NUM_CHUNKS, XP_NUM_CHUNKS, NULL);
+		xp_writer[i].sem_data = CreateSemaphore(NULL, 0, XP_NUM_CHUNKS, NULL);
+		if ((xp_writer[i].idle == NULL) || (xp_writer[i].start == NULL) ||
+			(xp_writer[i].sem_free == NULL) || (xp_writer[i].sem_data == NULL))
+			goto err;
+		for (j = 0; j < XP_NUM_CHUNKS; j++) {
+			xp_writer[i].chunk[j] = malloc(XP_CHUNK_SIZE);
+			if (xp_writer[i].chunk[j] == NULL)
+				goto err;
+		}
+		xp_writer[i].thread = CreateThread(NULL, 0, XpWriterThread, &xp_writer[i], 0, NULL);
+		if (xp_writer[i].thread == NULL)
+			goto err;
+	}
+	xp_active = TRUE;
+	return TRUE;
+
+err:
+	uprintf("Could not set up extraction pool - using single threaded extraction");
+	xp_exit();
+	return FALSE;
+}
+
+// Assign the next writer slot to a new target file. May block until a slot
+// frees up. The timestamps, when provided, must be copied before returning
+// as to_filetime() rotates through static entries.
+static XP_WRITER* xp_new_file(const char* path, uint64_t file_length,
+	LPFILETIME creation, LPFILETIME last_access, LPFILETIME modify)
+{
+	XP_WRITER* w = &xp_writer[xp_next_slot];
+
+	xp_next_slot = (xp_next_slot + 1) % XP_NUM_WRITERS;
+	WaitForSingleObject(w->idle, INFINITE);
+	if (xp_error) {
+		SetEvent(w->idle);
+		return NULL;
+	}
+	w->path = safe_strdup(path);
+	if (w->path == NULL) {
+		SetEvent(w->idle);
+		return NULL;
+	}
+	w->file_length = file_length;
+	w->set_time = (creation != NULL);
+	if (w->set_time) {
+		w->ft[0] = *creation;
+		w->ft[1] = *last_access;
+		w->ft[2] = *modify;
+	}
+	w->head = w->tail = 0;
+	SetEvent(w->start);
+	return w;
+}
+
+// Return the next free chunk buffer for the writer. May block until the
+// writer has caught up.
+static uint8_t* xp_get_chunk(XP_WRITER* w)
+{
+	uint64_t start = GetTickCount64();
+
+	WaitForSingleObject(w->sem_free, INFINITE);
+	// Time the reader spends waiting here = the target device is the laggard
+	PipelineStatsAccount(PS_DEVICE_WRITE, 0, GetTickCount64() - start);
+	return w->chunk[w->head];
+}
+
+// Hand a filled chunk over to the writer. A zero length marks the end of
+// the current file (and must always be sent, even when aborting).
+static void xp_submit_chunk(XP_WRITER* w, DWORD len)
+{
+	w->chunk_len[w->head] = len;
+	w->head = (w->head + 1) % XP_NUM_CHUNKS;
+	ReleaseSemaphore(w->sem_data, 1, NULL);
+}
+
 // Returns 0 on success, nonzero on error
 static int udf_extract_files(udf_t *p_udf, udf_dirent_t *p_udf_dirent, const char *psz_path)
 {
 	HANDLE file_handle = NULL;
-	DWORD buf_size, wr_size, err;
+	DWORD buf_size, wr_size, err, chunk_size;
+	uint32_t n_blocks;
 	EXTRACT_PROPS props;
 	BOOL r, is_identical;
 	int length;
 	size_t i;
-	char tmp[128], *psz_fullpath = NULL, *psz_sanpath = NULL;
+	char tmp[128], staging_path[MAX_PATH], *psz_fullpath = NULL, *psz_sanpath = NULL;
 	const char* psz_basename;
 	udf_dirent_t *p_udf_dirent2;
 	uint8_t buf[UDF_BLOCKSIZE];
 	int64_t read, file_length;
+	uint64_t stage_start;
+	BOOL is_staged = FALSE;
+	XP_WRITER* w;
 
 	if ((p_udf_dirent == NULL) || (psz_path == NULL))
 		return 1;
@@ -521,7 +1158,7 @@ static int udf_extract_files(udf_t *p_udf, udf_dirent_t *p_udf_dirent, const cha
 				psz_sanpath = sanitize_filename(psz_fullpath, &is_identical);
 				IGNORE_RETVAL(_mkdirU(psz_sanpath));
 				if (preserve_timestamps) {
-					set_directory_timestamp(psz_sanpath, to_filetime(udf_get_attribute_time(p_udf_dirent)),
+					defer_directory_timestamp(psz_sanpath, to_filetime(udf_get_attribute_time(p_udf_dirent)),
 						to_filetime(udf_get_access_time(p_udf_dirent)), to_filetime(udf_get_modification_time(p_udf_dirent)));
 				}
 				safe_free(psz_sanpath);
@@ -533,6 +1170,8 @@ static int udf_extract_files(udf_t *p_udf, udf_dirent_t *p_udf_dirent, const cha
 			}
 		} else {
 			file_length = udf_get_file_length(p_udf_dirent);
+			if (scan_only)
+				iso_index_add(&psz_fullpath[strlen(psz_extract_dir)], file_length, 0);
 			if (check_iso_props(psz_path, file_length, psz_basename, psz_fullpath, &props)) {
 				safe_free(psz_fullpath);
 				continue;
@@ -553,48 +1192,105 @@ static int udf_extract_files(udf_t *p_udf, udf_dirent_t *p_udf_dirent, const cha
 			psz_sanpath = sanitize_filename(psz_fullpath, &is_identical);
 			if (!is_identical)
 				uprintf("  File name sanitized to '%s'", psz_sanpath);
-			file_handle = CreatePreallocatedFile(psz_sanpath, GENERIC_READ | GENERIC_WRITE,
-				FILE_SHARE_READ, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, file_length);
-			if (file_handle == INVALID_HANDLE_VALUE) {
-				err = GetLastError();
-				uprintf("  Unable to create file: %s", WindowsErrorString());
-				if (((err == ERROR_ACCESS_DENIED) || (err == ERROR_INVALID_HANDLE)) &&
-					(safe_strcmp(&psz_sanpath[3], autorun_name) == 0))
-					uprintf(stupid_antivirus);
-				else
+			if (xp_active && !props.is_cfg && !props.is_conf) {
+				// Stream the file data to one of the pool writers, so that the
+				// target side open/write/close overlaps with our reads
+				if (preserve_timestamps) {
+					FILETIME ft_c = *to_filetime(udf_get_attribute_time(p_udf_dirent));
+					FILETIME ft_a = *to_filetime(udf_get_access_time(p_udf_dirent));
+					FILETIME ft_m = *to_filetime(udf_get_modification_time(p_udf_dirent));
+					w = xp_new_file(psz_sanpath, file_length, &ft_c, &ft_a, &ft_m);
+				} else {
+					w = xp_new_file(psz_sanpath, file_length, NULL, NULL, NULL);
+				}
+				if (w == NULL)
 					goto out;
-			} else {
 				while (file_length > 0) {
-					if (FormatStatus) goto out;
-					memset(buf, 0, UDF_BLOCKSIZE);
-					read = udf_read_block(p_udf_dirent, buf, 1);
-					if (read < 0) {
-						uprintf("  Error reading UDF file %s", &psz_fullpath[strlen(psz_extract_dir)]);
+					uint8_t* chunk = xp_get_chunk(w);
+					if (FormatStatus) {
+						xp_submit_chunk(w, 0);
 						goto out;
 					}
-					buf_size = (DWORD)MIN(file_length, read);
-					ISO_BLOCKING(r = WriteFileWithRetry(file_handle, buf, buf_size, &wr_size, WRITE_RETRIES));
-					if (!r) {
-						uprintf("  Error writing file: %s", WindowsErrorString());
+					// Read a whole multi-block extent in one libcdio call
+					n_blocks = (uint32_t)MIN(XP_CHUNK_SIZE / UDF_BLOCKSIZE,
+						(file_length + UDF_BLOCKSIZE - 1) / UDF_BLOCKSIZE);
+					stage_start = GetTickCount64();
+					read = udf_read_block(p_udf_dirent, chunk, n_blocks);
+					PipelineStatsAccount(PS_SOURCE_READ, (read > 0) ? read : 0, GetTickCount64() - stage_start);
+					if (read <= 0) {
+						uprintf("  Error reading UDF file %s", &psz_fullpath[strlen(psz_extract_dir)]);
+						xp_submit_chunk(w, 0);
 						goto out;
 					}
+					chunk_size = (DWORD)MIN(file_length, read);
 					file_length -= read;
-					if (nb_blocks++ % PROGRESS_THRESHOLD == 0)
-						UpdateProgressWithInfo(OP_FILE_COPY, MSG_231, nb_blocks, total_blocks);
+					nb_blocks += (read + UDF_BLOCKSIZE - 1) / UDF_BLOCKSIZE;
+					UpdateProgressWithInfo(OP_FILE_COPY, MSG_231, nb_blocks, total_blocks);
+					xp_submit_chunk(w, chunk_size);
 				}
-			}
-			if ((preserve_timestamps) && (!SetFileTime(file_handle, to_filetime(udf_get_attribute_time(p_udf_dirent)),
-				to_filetime(udf_get_access_time(p_udf_dirent)), to_filetime(udf_get_modification_time(p_udf_dirent)))))
-				uprintf("  Could not set timestamp: %s", WindowsErrorString());
+				// A zero length chunk marks the end of the file
+				xp_get_chunk(w);
+				xp_submit_chunk(w, 0);
+			} else {
+				// Config files are extracted to a local staging file, so that the patching
+				// passes of fix_config() run on local storage, and the patched result is
+				// then committed to the target in a single write, with no read back
+				is_staged = (props.is_cfg || props.is_conf) &&
+					(GetTempFileNameU(temp_dir, APPLICATION_NAME, 0, staging_path) != 0);
+				file_handle = CreatePreallocatedFile(is_staged ? staging_path : psz_sanpath,
+					GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ,
+					NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, file_length);
+				if (file_handle == INVALID_HANDLE_VALUE) {
+					err = GetLastError();
+					uprintf("  Unable to create file: %s", WindowsErrorString());
+					if (((err == ERROR_ACCESS_DENIED) || (err == ERROR_INVALID_HANDLE)) &&
+						(safe_strcmp(&psz_sanpath[3], autorun_name) == 0))
+						uprintf(stupid_antivirus);
+					else
+						goto out;
+				} else {
+					while (file_length > 0) {
+						if (FormatStatus) goto out;
+						memset(buf, 0, UDF_BLOCKSIZE);
+						read = udf_read_block(p_udf_dirent, buf, 1);
+						if (read < 0) {
+							uprintf("  Error reading UDF file %s", &psz_fullpath[strlen(psz_extract_dir)]);
+							goto out;
+						}
+						buf_size = (DWORD)MIN(file_length, read);
+						ISO_BLOCKING(r = WriteFileWithRetry(file_handle, buf, buf_size, &wr_size, WRITE_RETRIES));
+						if (!r) {
+							uprintf("  Error writing file: %s", WindowsErrorString());
+							goto out;
+						}
+						file_length -= read;
+						if (nb_blocks++ % PROGRESS_THRESHOLD == 0)
+							UpdateProgressWithInfo(OP_FILE_COPY, MSG_231, nb_blocks, total_blocks);
+					}
+				}
+				if ((!is_staged) && (preserve_timestamps) && (!SetFileTime(file_handle, to_filetime(udf_get_attribute_time(p_udf_dirent)),
+					to_filetime(udf_get_access_time(p_udf_dirent)), to_filetime(udf_get_modification_time(p_udf_dirent)))))
+					uprintf("  Could not set timestamp: %s", WindowsErrorString());
 
-			// If you have a fast USB 3.0 device, the default Windows buffering does an
-			// excellent job at compensating for our small blocks read/writes to max out the
-			// device's bandwidth.
-			// The drawback however is with cancellation. With a large file, CloseHandle()
-			// may take forever to complete and is not interruptible. We try to detect this.
-			ISO_BLOCKING(safe_closehandle(file_handle));
-			if (props.is_cfg || props.is_conf)
-				fix_config(psz_sanpath, psz_path, psz_basename, &props);
+				// If you have a fast USB 3.0 device, the default Windows buffering does an
+				// excellent job at compensating for our small blocks read/writes to max out the
+				// device's bandwidth.
+				// The drawback however is with cancellation. With a large file, CloseHandle()
+				// may take forever to complete and is not interruptible. We try to detect this.
+				ISO_BLOCKING(safe_closehandle(file_handle));
+			}
+			if (props.is_cfg || props.is_conf) {
+				fix_config(is_staged ? staging_path : NULL, psz_sanpath, psz_path, psz_basename, &props);
+				if (is_staged) {
+					r = commit_staged_file(staging_path, psz_sanpath,
+						preserve_timestamps ? to_filetime(udf_get_attribute_time(p_udf_dirent)) : NULL,
+						preserve_timestamps ? to_filetime(udf_get_access_time(p_udf_dirent)) : NULL,
+						preserve_timestamps ? to_filetime(udf_get_modification_time(p_udf_dirent)) : NULL);
+					is_staged = FALSE;
+					if (!r)
+						goto out;
+				}
+			}
 			safe_free(psz_sanpath);
 		}
 		safe_free(psz_fullpath);
@@ -605,6 +1301,8 @@ out:
 	if (p_udf_dirent != NULL)
 		udf_dirent_free(p_udf_dirent);
 	ISO_BLOCKING(safe_closehandle(file_handle));
+	if (is_staged)
+		DeleteFileU(staging_path);
 	safe_free(psz_sanpath);
 	safe_free(psz_fullpath);
 	return 1;
@@ -621,7 +1319,7 @@ static void update_md5sum(void)
 	intptr_t pos;
 	uint32_t i, j, size, md5_size;
 	uint8_t *buf = NULL, sum[16];
-	char md5_path[64], *md5_data = NULL, *str_pos;
+	char md5_path[64], *md5_data = NULL, *str_pos, end;
 
 	if (!img_report.has_md5sum)
 		goto out;
@@ -636,7 +1334,17 @@ static void update_md5sum(void)
 		goto out;
 
 	for (i = 0; i < modified_path.Index; i++) {
-		str_pos = strstr(md5_data, &modified_path.String[i][2]);
+		// Only accept a full path field match ("<MD5SUM> <FILE_PATH>\n"), as a
+		// bare substring search could land in the middle of a longer path that
+		// merely ends with the name of the file we patched.
+		for (str_pos = strstr(md5_data, &modified_path.String[i][2]); str_pos != NULL;
+			 str_pos = strstr(str_pos + 1, &modified_path.String[i][2])) {
+			end = str_pos[strlen(&modified_path.String[i][2])];
+			if ((str_pos > md5_data) && (str_pos[-1] != ' ') && (str_pos[-1] != '*') && (str_pos[-1] != '.'))
+				continue;
+			if ((end == 0) || (end == '\r') || (end == '\n'))
+				break;
+		}
 		if (str_pos == NULL)
 			// File is not listed in md5 sums
 			continue;
@@ -667,14 +1375,17 @@ out:
 }
 
 // Returns 0 on success, >0 on error, <0 to ignore current dir
-static int iso_extract_files(iso9660_t* p_iso, const char *psz_path)
+// p_dir_stat, when provided, is the stat of psz_path's directory, which spares
+// libcdio a costly full path re-walk from the root for every directory visited.
+static int iso_extract_files(iso9660_t* p_iso, const char *psz_path, const iso9660_stat_t *p_dir_stat)
 {
 	HANDLE file_handle = NULL;
-	DWORD buf_size, wr_size, err;
+	DWORD buf_size, wr_size, err, chunk_size;
+	uint32_t n_blocks;
 	EXTRACT_PROPS props;
 	BOOL is_symlink, is_identical;
 	int length, r = 1;
-	char tmp[128], psz_fullpath[MAX_PATH], *psz_basename = NULL, *psz_sanpath = NULL;
+	char tmp[128], staging_path[MAX_PATH], psz_fullpath[MAX_PATH], *psz_basename = NULL, *psz_sanpath = NULL;
 	const char *psz_iso_name = &psz_fullpath[strlen(psz_extract_dir)];
 	unsigned char buf[ISO_BLOCKSIZE];
 	CdioListNode_t* p_entnode;
@@ -683,6 +1394,9 @@ static int iso_extract_files(iso9660_t* p_iso, const char *psz_path)
 	size_t i;
 	lsn_t lsn;
 	int64_t file_length;
+	uint64_t stage_start;
+	BOOL is_staged = FALSE;
+	XP_WRITER* w;
 
 	if ((p_iso == NULL) || (psz_path == NULL))
 		return 1;
@@ -692,7 +1406,8 @@ static int iso_extract_files(iso9660_t* p_iso, const char *psz_path)
 		return 1;
 	psz_basename = &psz_fullpath[length];
 
-	p_entlist = iso9660_ifs_readdir(p_iso, psz_path);
+	p_entlist = (p_dir_stat != NULL) ? iso9660_ifs_readdir_stat(p_iso, p_dir_stat) :
+		iso9660_ifs_readdir(p_iso, psz_path);
 	if (!p_entlist) {
 		uprintf("Could not access directory %s", psz_path);
 		return 1;
@@ -749,17 +1464,19 @@ static int iso_extract_files(iso9660_t* p_iso, const char *psz_path)
 				IGNORE_RETVAL(_mkdirU(psz_sanpath));
 				if (preserve_timestamps) {
 					LPFILETIME ft = to_filetime(mktime(&p_statbuf->tm));
-					set_directory_timestamp(psz_sanpath, ft, ft, ft);
+					defer_directory_timestamp(psz_sanpath, ft, ft, ft);
 				}
 				safe_free(psz_sanpath);
 			}
-			r = iso_extract_files(p_iso, psz_iso_name);
+			r = iso_extract_files(p_iso, psz_iso_name, p_statbuf);
 			if (r > 0)
 				goto out;
 			if (r < 0)	// Stop processing current dir
 				break;
 		} else {
 			file_length = p_statbuf->total_size;
+			if (scan_only)
+				iso_index_add(psz_iso_name, file_length, p_statbuf->lsn);
 			if (check_iso_props(psz_path, file_length, psz_basename, psz_fullpath, &props)) {
 				continue;
 			}
@@ -784,43 +1501,99 @@ static int iso_extract_files(iso9660_t* p_iso, const char *psz_path)
 					uprintf("  Ignoring Rock Ridge symbolic link to '%s'", p_statbuf->rr.psz_symlink);
 				safe_free(p_statbuf->rr.psz_symlink);
 			}
-			file_handle = CreatePreallocatedFile(psz_sanpath, GENERIC_READ | GENERIC_WRITE,
-				FILE_SHARE_READ, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, file_length);
-			if (file_handle == INVALID_HANDLE_VALUE) {
-				err = GetLastError();
-				uprintf("  Unable to create file: %s", WindowsErrorString());
-				if (((err == ERROR_ACCESS_DENIED) || (err == ERROR_INVALID_HANDLE)) &&
-					(safe_strcmp(&psz_sanpath[3], autorun_name) == 0))
-					uprintf(stupid_antivirus);
-				else
-					goto out;
-			} else for (i = 0; file_length > 0; i++) {
-				if (FormatStatus) goto out;
-				memset(buf, 0, ISO_BLOCKSIZE);
-				lsn = p_statbuf->lsn + (lsn_t)i;
-				if (iso9660_iso_seek_read(p_iso, buf, lsn, 1) != ISO_BLOCKSIZE) {
-					uprintf("  Error reading ISO9660 file %s at LSN %lu",
-						psz_iso_name, (long unsigned int)lsn);
-					goto out;
+			if (xp_active && !props.is_cfg && !props.is_conf) {
+				// Stream the file data to one of the pool writers, so that the
+				// target side open/write/close overlaps with our reads
+				if (preserve_timestamps) {
+					LPFILETIME pft = to_filetime(mktime(&p_statbuf->tm));
+					w = xp_new_file(psz_sanpath, file_length, pft, pft, pft);
+				} else {
+					w = xp_new_file(psz_sanpath, file_length, NULL, NULL, NULL);
 				}
-				buf_size = (DWORD)MIN(file_length, ISO_BLOCKSIZE);
-				ISO_BLOCKING(r = WriteFileWithRetry(file_handle, buf, buf_size, &wr_size, WRITE_RETRIES));
-				if (!r) {
-					uprintf("  Error writing file: %s", WindowsErrorString());
+				if (w == NULL)
 					goto out;
-				}
-				file_length -= ISO_BLOCKSIZE;
-				if (nb_blocks++ % PROGRESS_THRESHOLD == 0)
+				for (i = 0; file_length > 0; ) {
+					uint8_t* chunk = xp_get_chunk(w);
+					if (FormatStatus) {
+						xp_submit_chunk(w, 0);
+						goto out;
+					}
+					// Read a whole contiguous LSN range in one libcdio call
+					n_blocks = (uint32_t)MIN(XP_CHUNK_SIZE / ISO_BLOCKSIZE,
+						(file_length + ISO_BLOCKSIZE - 1) / ISO_BLOCKSIZE);
+					lsn = p_statbuf->lsn + (lsn_t)i;
+					stage_start = GetTickCount64();
+					if (iso9660_iso_seek_read(p_iso, chunk, lsn, n_blocks) != n_blocks * ISO_BLOCKSIZE) {
+						PipelineStatsAccount(PS_SOURCE_READ, 0, GetTickCount64() - stage_start);
+						uprintf("  Error reading ISO9660 file %s at LSN %lu",
+							psz_iso_name, (long unsigned int)lsn);
+						xp_submit_chunk(w, 0);
+						goto out;
+					}
+					PipelineStatsAccount(PS_SOURCE_READ, n_blocks * (uint64_t)ISO_BLOCKSIZE, GetTickCount64() - stage_start);
+					i += n_blocks;
+					chunk_size = (DWORD)MIN(file_length, n_blocks * (int64_t)ISO_BLOCKSIZE);
+					file_length -= n_blocks * (int64_t)ISO_BLOCKSIZE;
+					nb_blocks += n_blocks;
 					UpdateProgressWithInfo(OP_FILE_COPY, MSG_231, nb_blocks, total_blocks);
+					xp_submit_chunk(w, chunk_size);
+				}
+				// A zero length chunk marks the end of the file
+				xp_get_chunk(w);
+				xp_submit_chunk(w, 0);
+			} else {
+				// Config files are extracted to a local staging file, so that the patching
+				// passes of fix_config() run on local storage, and the patched result is
+				// then committed to the target in a single write, with no read back
+				is_staged = (props.is_cfg || props.is_conf) &&
+					(GetTempFileNameU(temp_dir, APPLICATION_NAME, 0, staging_path) != 0);
+				file_handle = CreatePreallocatedFile(is_staged ? staging_path : psz_sanpath,
+					GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ,
+					NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, file_length);
+				if (file_handle == INVALID_HANDLE_VALUE) {
+					err = GetLastError();
+					uprintf("  Unable to create file: %s", WindowsErrorString());
+					if (((err == ERROR_ACCESS_DENIED) || (err == ERROR_INVALID_HANDLE)) &&
+						(safe_strcmp(&psz_sanpath[3], autorun_name) == 0))
+						uprintf(stupid_antivirus);
+					else
+						goto out;
+				} else for (i = 0; file_length > 0; i++) {
+					if (FormatStatus) goto out;
+					memset(buf, 0, ISO_BLOCKSIZE);
+					lsn = p_statbuf->lsn + (lsn_t)i;
+					if (iso9660_iso_seek_read(p_iso, buf, lsn, 1) != ISO_BLOCKSIZE) {
+						uprintf("  Error reading ISO9660 file %s at LSN %lu",
+							psz_iso_name, (long unsigned int)lsn);
+						goto out;
+					}
+					buf_size = (DWORD)MIN(file_length, ISO_BLOCKSIZE);
+					ISO_BLOCKING(r = WriteFileWithRetry(file_handle, buf, buf_size, &wr_size, WRITE_RETRIES));
+					if (!r) {
+						uprintf("  Error writing file: %s", WindowsErrorString());
+						goto out;
+					}
+					file_length -= ISO_BLOCKSIZE;
+					if (nb_blocks++ % PROGRESS_THRESHOLD == 0)
+						UpdateProgressWithInfo(OP_FILE_COPY, MSG_231, nb_blocks, total_blocks);
+				}
+				if ((!is_staged) && (preserve_timestamps)) {
+					LPFILETIME ft = to_filetime(mktime(&p_statbuf->tm));
+					if (!SetFileTime(file_handle, ft, ft, ft))
+						uprintf("  Could not set timestamp: %s", WindowsErrorString());
+				}
+				ISO_BLOCKING(safe_closehandle(file_handle));
 			}
-			if (preserve_timestamps) {
-				LPFILETIME ft = to_filetime(mktime(&p_statbuf->tm));
-				if (!SetFileTime(file_handle, ft, ft, ft))
-					uprintf("  Could not set timestamp: %s", WindowsErrorString());
+			if (props.is_cfg || props.is_conf) {
+				LPFILETIME ft = preserve_timestamps ? to_filetime(mktime(&p_statbuf->tm)) : NULL;
+				fix_config(is_staged ? staging_path : NULL, psz_sanpath, psz_path, psz_basename, &props);
+				if (is_staged) {
+					BOOL committed = commit_staged_file(staging_path, psz_sanpath, ft, ft, ft);
+					is_staged = FALSE;
+					if (!committed)
+						goto out;
+				}
 			}
-			ISO_BLOCKING(safe_closehandle(file_handle));
-			if (props.is_cfg || props.is_conf)
-				fix_config(psz_sanpath, psz_path, psz_basename, &props);
 			safe_free(psz_sanpath);
 		}
 	}
@@ -828,18 +1601,26 @@ static int iso_extract_files(iso9660_t* p_iso, const char *psz_path)
 
 out:
 	ISO_BLOCKING(safe_closehandle(file_handle));
+	if (is_staged)
+		DeleteFileU(staging_path);
 	iso9660_filelist_free(p_entlist);
 	safe_free(psz_sanpath);
 	return r;
 }
 
+static const char grub_version_str[] = "GRUB  version %s";
+
 void GetGrubVersion(char* buf, size_t buf_size)
 {
 	char *p, unauthorized[] = {'<', '>', ':', '|', '*', '?', '\\', '/'};
 	size_t i;
-	const char grub_version_str[] = "GRUB  version %s";
 
-	for (i=0; i<buf_size; i++) {
+	// Rather than memcmp() at every single offset, fast-forward to each 'G' candidate
+	for (i=0; i+sizeof(grub_version_str)<=buf_size; i++) {
+		p = (char*)memchr(&buf[i], 'G', buf_size - sizeof(grub_version_str) + 1 - i);
+		if (p == NULL)
+			break;
+		i = p - buf;
 		if (memcmp(&buf[i], grub_version_str, sizeof(grub_version_str)) == 0) {
 			static_strcpy(img_report.grub2_version, &buf[i + sizeof(grub_version_str)]);
 			break;
@@ -858,12 +1639,84 @@ void GetGrubVersion(char* buf, size_t buf_size)
 		img_report.grub2_version[0] = 0;
 }
 
+// Streaming version of the above, fed by iso_read_file(): each in-flight chunk
+// of normal.mod gets scanned for the marker as it comes off the image, and the
+// read stops as soon as the version is found, so detection costs no buffering
+// and no extra I/O. A tail of the previous chunk is carried over and stitched
+// to the head of the next one, so that a marker straddling a chunk boundary is
+// still caught.
+#define GRUB_SNIFF_SPAN	(sizeof(grub_version_str) + sizeof(img_report.grub2_version))
+static struct {
+	uint8_t buf[2 * GRUB_SNIFF_SPAN];
+	size_t len;
+} grub_sniff_carry;
+
+static BOOL grub_version_sniff(const uint8_t* chunk, size_t chunk_size, BOOL last)
+{
+	size_t take, keep = GRUB_SNIFF_SPAN - 1;
+
+	// Resolve a potential marker straddling the previous chunk boundary. The
+	// reduced buf_size restricts matches to markers that start in the carried
+	// tail - ones starting in this chunk are left to the direct scan below.
+	if (grub_sniff_carry.len != 0) {
+		take = MIN(chunk_size, GRUB_SNIFF_SPAN);
+		memcpy(&grub_sniff_carry.buf[grub_sniff_carry.len], chunk, take);
+		GetGrubVersion((char*)grub_sniff_carry.buf,
+			grub_sniff_carry.len + sizeof(grub_version_str) - 1);
+		if (img_report.grub2_version[0] != 0)
+			return TRUE;
+	}
+	// Unless this is the last chunk, hold back a version string's worth of
+	// tail bytes, so that a marker matched here always has a full version
+	// string behind it in the same chunk. Markers starting in the held back
+	// region all land in the carried tail and are caught by the next stitch.
+	if (last)
+		GetGrubVersion((char*)chunk, chunk_size);
+	else if (chunk_size > sizeof(img_report.grub2_version))
+		GetGrubVersion((char*)chunk, chunk_size - sizeof(img_report.grub2_version));
+	if (img_report.grub2_version[0] != 0)
+		return TRUE;
+	grub_sniff_carry.len = MIN(chunk_size, keep);
+	memcpy(grub_sniff_carry.buf, &chunk[chunk_size - grub_sniff_carry.len],
+		grub_sniff_carry.len);
+	return FALSE;
+}
+
 // Linking to version.lib would result in DLL sideloading issues, so we don't
 // See https://github.com/pbatard/rufus/pull/1838
 PF_TYPE_DECL(WINAPI, DWORD, GetFileVersionInfoSizeW, (LPCWSTR, LPDWORD));
 PF_TYPE_DECL(WINAPI, BOOL, GetFileVersionInfoW, (LPCWSTR, DWORD, DWORD, LPVOID));
 PF_TYPE_DECL(WINAPI, BOOL, VerQueryValueA, (LPCVOID, LPCSTR, LPVOID, PUINT));
 
+// ISO9660 open probe, run on its own thread so that, on hybrid images, it can
+// proceed concurrently with the UDF probe (both are read-only accesses, over
+// independent handles) and we only pay for the slower of the two.
+typedef struct {
+	const char* path;
+	iso_extension_mask_t mask;
+	iso9660_t* p_iso;
+} ISO_PROBE;
+
+static DWORD WINAPI IsoProbeThread(void* param)
+{
+	ISO_PROBE* probe = (ISO_PROBE*)param;
+	probe->p_iso = iso9660_open_ext(probe->path, probe->mask);
+	return 0;
+}
+
+// Collect the probe's result (or perform the open inline if the probe thread
+// could not be created)
+static iso9660_t* iso_probe_join(HANDLE* thread, ISO_PROBE* probe)
+{
+	if (*thread != NULL) {
+		WaitForSingleObject(*thread, INFINITE);
+		safe_closehandle(*thread);
+	} else if (probe->p_iso == NULL) {
+		probe->p_iso = iso9660_open_ext(probe->path, probe->mask);
+	}
+	return probe->p_iso;
+}
+
 BOOL ExtractISO(const char* src_iso, const char* dest_dir, BOOL scan)
 {
 	size_t i, j, size, sl_index = 0;
@@ -879,6 +1732,8 @@ BOOL ExtractISO(const char* src_iso, const char* dest_dir, BOOL scan)
 	const char* basedir[] = { "i386", "amd64", "minint" };
 	const char* tmp_sif = ".\\txtsetup.sif~";
 	iso_extension_mask_t iso_extension_mask = ISO_EXTENSION_ALL;
+	ISO_PROBE probe = { 0 };
+	HANDLE probe_thread = NULL;
 	char* spacing = "  ";
 
 	if ((!enable_iso) || (src_iso == NULL) || (dest_dir == NULL))
@@ -899,10 +1754,23 @@ BOOL ExtractISO(const char* src_iso, const char* dest_dir, BOOL scan)
 		SendMessage(hMainDialog, UM_PROGRESS_INIT, PBS_MARQUEE, 0);
 		total_blocks = 0;
 		has_ldlinux_c32 = FALSE;
-		// String array of all isolinux/syslinux locations
-		StrArrayCreate(&config_path, 8);
-		StrArrayCreate(&isolinux_path, 8);
 		PrintInfo(0, MSG_202);
+		// If this exact image was already analyzed, reuse the previous results
+		// instead of walking the whole directory tree again. The whole report
+		// is flat (fixed size strings, no heap references), so handing it over
+		// is a single memcpy.
+		if (iso_index_matches(src_iso)) {
+			uprintf("  Reusing analysis from previous scan");
+			memcpy(&img_report, &iso_index_report, sizeof(img_report));
+			total_blocks = iso_index_total_blocks;
+			SendMessage(hMainDialog, UM_PROGRESS_EXIT, 0, 0);
+			return TRUE;
+		}
+		iso_index_set_image(src_iso);
+		// String array of all isolinux/syslinux locations, only needed (and
+		// only built) when we actually walk the directory tree
+		StrArrayCreateArena(&config_path, 8, 512);
+		StrArrayCreateArena(&isolinux_path, 8, 512);
 	} else {
 		uprintf("Extracting files...\n");
 		IGNORE_RETVAL(_chdirU(app_data_dir));
@@ -913,10 +1781,29 @@ BOOL ExtractISO(const char* src_iso, const char* dest_dir, BOOL scan)
 		}
 		nb_blocks = 0;
 		iso_blocking_status = 0;
-		StrArrayCreate(&modified_path, 8);
+		StrArrayCreateArena(&modified_path, 8, 512);
+		// Extraction is single threaded if the pool can't be set up
+		xp_init();
 	}
 
-	// First try to open as UDF - fallback to ISO if it failed
+	// Perform our first scan with Joliet disabled (if Rock Ridge is enabled), so that we can find if
+	// there exists a Rock Ridge file with a name > 64 chars or if there are symlinks. If that is the
+	// case then we also disable Joliet during the extract phase.
+	if ((!enable_joliet) || (enable_rockridge && (scan_only || img_report.has_long_filename ||
+		(img_report.has_symlinks == SYMLINKS_RR)))) {
+		iso_extension_mask &= ~ISO_EXTENSION_JOLIET;
+	}
+	if (!enable_rockridge) {
+		iso_extension_mask &= ~ISO_EXTENSION_ROCK_RIDGE;
+	}
+
+	// Kick off the ISO9660 probe, then try to open as UDF while it runs.
+	// Whichever of the two filesystems wins is used, and the loser's open
+	// latency is hidden behind the winner's.
+	probe.path = src_iso;
+	probe.mask = iso_extension_mask;
+	probe_thread = CreateThread(NULL, 0, IsoProbeThread, &probe, 0, NULL);
+
 	p_udf = udf_open(src_iso);
 	if (p_udf == NULL)
 		goto try_iso;
@@ -930,25 +1817,14 @@ BOOL ExtractISO(const char* src_iso, const char* dest_dir, BOOL scan)
 	if (scan_only) {
 		if (udf_get_logical_volume_id(p_udf, img_report.label, sizeof(img_report.label)) <= 0)
 			img_report.label[0] = 0;
-		// Open the UDF as ISO so that we can perform size checks
-		p_iso = iso9660_open(src_iso);
+		// Grab the UDF-as-ISO handle from the probe so that we can perform size checks
+		p_iso = iso_probe_join(&probe_thread, &probe);
 	}
 	r = udf_extract_files(p_udf, p_udf_root, "");
 	goto out;
 
 try_iso:
-	// Perform our first scan with Joliet disabled (if Rock Ridge is enabled), so that we can find if
-	// there exists a Rock Ridge file with a name > 64 chars or if there are symlinks. If that is the
-	// case then we also disable Joliet during the extract phase.
-	if ((!enable_joliet) || (enable_rockridge && (scan_only || img_report.has_long_filename ||
-		(img_report.has_symlinks == SYMLINKS_RR)))) {
-		iso_extension_mask &= ~ISO_EXTENSION_JOLIET;
-	}
-	if (!enable_rockridge) {
-		iso_extension_mask &= ~ISO_EXTENSION_ROCK_RIDGE;
-	}
-
-	p_iso = iso9660_open_ext(src_iso, iso_extension_mask);
+	p_iso = iso_probe_join(&probe_thread, &probe);
 	if (p_iso == NULL) {
 		uprintf("%s'%s' doesn't look like an ISO image", spacing, src_iso);
 		r = 1;
@@ -969,12 +1845,26 @@ try_iso:
 		else
 			uprintf("%sThis image will not be extracted using any ISO extensions", spacing);
 	}
-	r = iso_extract_files(p_iso, "");
+	r = iso_extract_files(p_iso, "", NULL);
 
 out:
+	if (!scan_only) {
+		// Wait for the pool writers to drain and check for any deferred error
+		xp_exit();
+		if (xp_error)
+			r = 1;
+		// Stamp the directories only once all their content has been written
+		apply_directory_timestamps();
+	}
 	iso_blocking_status = -1;
 	if (scan_only) {
 		struct __stat64 stat;
+		// Publish our open handles, so that the single file probes below share
+		// them instead of reopening the image once per probed file - on a slow
+		// or remote medium, every reopen re-reads the volume descriptors
+		iso_shared_path = src_iso;
+		iso_shared_iso = p_iso;
+		iso_shared_udf = p_udf;
 		// Find if there is a mismatch between the ISO size, as reported by the PVD, and the actual file size
 		if ((iso9660_ifs_read_pvd(p_iso, &pvd)) && (_stat64U(src_iso, &stat) == 0))
 			img_report.mismatch_size = (int64_t)(iso9660_get_pvd_space_size(&pvd)) * ISO_BLOCKSIZE - stat.st_size;
@@ -1014,21 +1904,18 @@ out:
 			uprintf("  Will use '%s' for Syslinux", img_report.cfg_path);
 			// Extract all of the isolinux.bin files we found to identify their versions
 			for (i=0; i<isolinux_path.Index; i++) {
-				char isolinux_tmp[MAX_PATH];
-				static_sprintf(isolinux_tmp, "%s\\isolinux.tmp", temp_dir);
-				size = (size_t)ExtractISOFile(src_iso, isolinux_path.String[i], isolinux_tmp, FILE_ATTRIBUTE_NORMAL);
-				if (size == 0) {
+				// Sniff the version from memory - no need to stage a copy
+				// of isolinux.bin to disk just to inspect it
+				int64_t sniff_size;
+				buf = (char*)malloc(SNIFF_BUF_SIZE);
+				if (buf == NULL) break;
+				sniff_size = ExtractISOFileToBuffer(src_iso, isolinux_path.String[i],
+					(uint8_t*)buf, SNIFF_BUF_SIZE);
+				if (sniff_size <= 0) {
 					uprintf("  Could not access %s", isolinux_path.String[i]);
+					free(buf);
 				} else {
-					buf = (char*)calloc(size, 1);
-					if (buf == NULL) break;
-					fd = fopen(isolinux_tmp, "rb");
-					if (fd == NULL) {
-						free(buf);
-						continue;
-					}
-					fread(buf, 1, size, fd);
-					fclose(fd);
+					size = (size_t)sniff_size;
 					sl_version = GetSyslinuxVersion(buf, size, &ext);
 					if (img_report.sl_version == 0) {
 						static_strcpy(img_report.sl_version_ext, ext);
@@ -1049,7 +1936,6 @@ out:
 					}
 					free(buf);
 				}
-				DeleteFileU(isolinux_tmp);
 			}
 			if (img_report.sl_version != 0) {
 				static_sprintf(img_report.sl_version_str, "%d.%02d",
@@ -1092,23 +1978,14 @@ out:
 			img_report.wininst_version = GetInstallWimVersion(src_iso);
 		}
 		if (img_report.has_grub2) {
-			// In case we have a GRUB2 based iso, we extract boot/grub/i386-pc/normal.mod to parse its version
+			// In case we have a GRUB2 based iso, we sniff boot/grub/i386-pc/normal.mod
+			// for its version marker, scanning each buffer in-flight as it is read from
+			// the image and stopping the read as soon as the version is found
 			img_report.grub2_version[0] = 0;
-			// coverity[swapped_arguments]
-			if (GetTempFileNameU(temp_dir, APPLICATION_NAME, 0, path) != 0) {
-				size = (size_t)ExtractISOFile(src_iso, "boot/grub/i386-pc/normal.mod", path, FILE_ATTRIBUTE_NORMAL);
-				buf = (char*)calloc(size, 1);
-				fd = fopen(path, "rb");
-				if ((size == 0) || (buf == NULL) || (fd == NULL)) {
-					uprintf("  Could not read Grub version from 'boot/grub/i386-pc/normal.mod'");
-				} else {
-					fread(buf, 1, size, fd);
-					fclose(fd);
-					GetGrubVersion(buf, size);
-				}
-				free(buf);
-				DeleteFileU(path);
-			}
+			grub_sniff_carry.len = 0;
+			if (iso_read_file(src_iso, "boot/grub/i386-pc/normal.mod", NULL, SNIFF_BUF_SIZE,
+				grub_version_sniff) <= 0)
+				uprintf("  Could not read Grub version from 'boot/grub/i386-pc/normal.mod'");
 			if (img_report.grub2_version[0] != 0)
 				uprintf("  Detected Grub version: %s", img_report.grub2_version);
 			else {
@@ -1151,6 +2028,19 @@ out:
 				free(wpath);
 			}
 		}
+		// Keep the results of this analysis, so that selecting different options
+		// (which triggers a rescan of the same image) can reuse them
+		if ((r == 0) && (FormatStatus == 0)) {
+			memcpy(&iso_index_report, &img_report, sizeof(iso_index_report));
+			iso_index_total_blocks = total_blocks;
+			iso_index_complete = TRUE;
+		} else {
+			iso_index_clear();
+		}
+		// Reclaim the published handles before they get closed below
+		iso_shared_path = NULL;
+		iso_shared_iso = NULL;
+		iso_shared_udf = NULL;
 		StrArrayDestroy(&config_path);
 		StrArrayDestroy(&isolinux_path);
 		SendMessage(hMainDialog, UM_PROGRESS_EXIT, 0, 0);
@@ -1194,11 +2084,21 @@ out:
 		update_md5sum();
 		if (archive_path != NULL) {
 			uprintf("● Adding files from %s", archive_path);
-			bled_init(NULL, NULL, NULL, NULL, alt_print_extracted_file, NULL);
+			bled_init(0, NULL, NULL, NULL, NULL, alt_print_extracted_file, NULL);
 			bled_uncompress_to_dir(archive_path, dest_dir, BLED_COMPRESSION_ZIP);
 			bled_exit();
 		}
+		// Release the cached directory handles, so that they can't prevent
+		// the target volume from being locked
+		CloseDirHandleCache();
+	}
+	// Reap the probe thread and claim its handle if we didn't use it
+	if (probe_thread != NULL) {
+		WaitForSingleObject(probe_thread, INFINITE);
+		safe_closehandle(probe_thread);
 	}
+	if (p_iso == NULL)
+		p_iso = probe.p_iso;
 	if (p_iso != NULL)
 		iso9660_close(p_iso);
 	if (p_udf != NULL)
@@ -1213,14 +2113,19 @@ int64_t ExtractISOFile(const char* iso, const char* iso_file, const char* dest_f
 	size_t i;
 	ssize_t read_size;
 	int64_t file_length, r = 0;
-	char buf[UDF_BLOCKSIZE];
+	uint8_t* buf;
+	uint32_t n_blocks;
 	DWORD buf_size, wr_size;
 	iso9660_t* p_iso = NULL;
 	udf_t* p_udf = NULL;
 	udf_dirent_t *p_udf_root = NULL, *p_udf_file = NULL;
 	iso9660_stat_t *p_statbuf = NULL;
-	lsn_t lsn;
+	lsn_t lsn, base_lsn = 0;
 	HANDLE file_handle = INVALID_HANDLE_VALUE;
+	BOOL shared = iso_shared_handles_match(iso);
+
+	if ((buf = iso_get_scratch()) == NULL)
+		goto out;
 
 	file_handle = CreateFileU(dest_file, GENERIC_READ | GENERIC_WRITE,
 		FILE_SHARE_READ, NULL, CREATE_ALWAYS, attributes, NULL);
@@ -1229,8 +2134,14 @@ int64_t ExtractISOFile(const char* iso, const char* iso_file, const char* dest_f
 		goto out;
 	}
 
-	// First try to open as UDF - fallback to ISO if it failed
-	p_udf = udf_open(iso);
+	if (shared) {
+		// Borrow the handles published by ExtractISO() for this image
+		p_udf = iso_shared_udf;
+		p_iso = iso_shared_iso;
+	} else {
+		// First try to open as UDF - fallback to ISO if it failed
+		p_udf = udf_open(iso);
+	}
 	if (p_udf == NULL)
 		goto try_iso;
 
@@ -1246,9 +2157,10 @@ int64_t ExtractISOFile(const char* iso, const char* iso_file, const char* dest_f
 	}
 	file_length = udf_get_file_length(p_udf_file);
 	while (file_length > 0) {
-		memset(buf, 0, UDF_BLOCKSIZE);
-		read_size = udf_read_block(p_udf_file, buf, 1);
-		if (read_size < 0) {
+		n_blocks = (uint32_t)MIN(ISO_SCRATCH_SIZE / UDF_BLOCKSIZE,
+			(file_length + UDF_BLOCKSIZE - 1) / UDF_BLOCKSIZE);
+		read_size = udf_read_block(p_udf_file, buf, n_blocks);
+		if (read_size <= 0) {
 			uprintf("Error reading UDF file %s", iso_file);
 			goto out;
 		}
@@ -1265,33 +2177,46 @@ int64_t ExtractISOFile(const char* iso, const char* iso_file, const char* dest_f
 try_iso:
 	// Make sure to enable extensions, else we may not match the name of the file we are looking
 	// for since Rock Ridge may be needed to translate something like 'I386_PC' into 'i386-pc'...
-	p_iso = iso9660_open_ext(iso, ISO_EXTENSION_MASK);
+	if (p_iso == NULL)
+		p_iso = iso9660_open_ext(iso, ISO_EXTENSION_MASK);
 	if (p_iso == NULL) {
 		uprintf("Unable to open image '%s'", iso);
 		goto out;
 	}
 
-	p_statbuf = iso9660_ifs_stat_translate(p_iso, iso_file);
-	if (p_statbuf == NULL) {
-		uprintf("Could not get ISO-9660 file information for file %s", iso_file);
-		goto out;
+	// Reuse the LSN/size gathered by the scan pass when we can, as
+	// iso9660_ifs_stat_translate() walks the directory tree on every call
+	if (iso_index_matches(iso)) {
+		const ISO_INDEX_ENTRY* p_entry = iso_index_lookup(iso_file);
+		if ((p_entry != NULL) && (p_entry->lsn != 0)) {
+			base_lsn = p_entry->lsn;
+			file_length = p_entry->size;
+		}
 	}
-
-	file_length = p_statbuf->total_size;
-	for (i = 0; file_length > 0; i++) {
-		memset(buf, 0, ISO_BLOCKSIZE);
-		lsn = p_statbuf->lsn + (lsn_t)i;
-		if (iso9660_iso_seek_read(p_iso, buf, lsn, 1) != ISO_BLOCKSIZE) {
+	if (base_lsn == 0) {
+		p_statbuf = iso9660_ifs_stat_translate(p_iso, iso_file);
+		if (p_statbuf == NULL) {
+			uprintf("Could not get ISO-9660 file information for file %s", iso_file);
+			goto out;
+		}
+		base_lsn = p_statbuf->lsn;
+		file_length = p_statbuf->total_size;
+	}
+	for (i = 0; file_length > 0; i += n_blocks) {
+		n_blocks = (uint32_t)MIN(ISO_SCRATCH_SIZE / ISO_BLOCKSIZE,
+			(file_length + ISO_BLOCKSIZE - 1) / ISO_BLOCKSIZE);
+		lsn = base_lsn + (lsn_t)i;
+		if (iso9660_iso_seek_read(p_iso, buf, lsn, n_blocks) != n_blocks * ISO_BLOCKSIZE) {
 			uprintf("  Error reading ISO9660 file %s at LSN %lu", iso_file, (long unsigned int)lsn);
 			goto out;
 		}
-		buf_size = (DWORD)MIN(file_length, ISO_BLOCKSIZE);
+		buf_size = (DWORD)MIN(file_length, n_blocks * (int64_t)ISO_BLOCKSIZE);
 		if (!WriteFileWithRetry(file_handle, buf, buf_size, &wr_size, WRITE_RETRIES)) {
 			uprintf("  Error writing file %s: %s", dest_file, WindowsErrorString());
 			goto out;
 		}
-		file_length -= ISO_BLOCKSIZE;
-		r += ISO_BLOCKSIZE;
+		file_length -= n_blocks * (int64_t)ISO_BLOCKSIZE;
+		r += n_blocks * ISO_BLOCKSIZE;
 	}
 
 out:
@@ -1303,32 +2228,46 @@ out:
 		udf_dirent_free(p_udf_root);
 	if (p_udf_file != NULL)
 		udf_dirent_free(p_udf_file);
-	if (p_iso != NULL)
-		iso9660_close(p_iso);
-	if (p_udf != NULL)
-		udf_close(p_udf);
+	if (!shared) {
+		if (p_iso != NULL)
+			iso9660_close(p_iso);
+		if (p_udf != NULL)
+			udf_close(p_udf);
+	}
 	return r;
 }
 
-uint32_t GetInstallWimVersion(const char* iso)
+// Read up to 'size' bytes from the start of an embedded ISO file, without
+// staging anything to disk. Each chunk is copied into 'buf' (if provided) and
+// handed to 'sniff_fn' (if provided) as it comes off the image, with the read
+// stopping early if the sniffer reports it is done. Returns the number of
+// bytes read, or a negative value on error.
+static int64_t iso_read_file(const char* iso, const char* iso_file, uint8_t* buf,
+	size_t size, iso_sniff_fn_t sniff_fn)
 {
-	char *wim_path = NULL, *p, buf[UDF_BLOCKSIZE] = { 0 };
-	uint32_t* wim_header = (uint32_t*)buf, r = 0xffffffff;
+	size_t i;
+	ssize_t read_size;
+	int64_t chunk, pos = 0, file_length, r = -1;
+	uint32_t n_blocks;
+	uint8_t* scratch;
 	iso9660_t* p_iso = NULL;
 	udf_t* p_udf = NULL;
 	udf_dirent_t *p_udf_root = NULL, *p_udf_file = NULL;
 	iso9660_stat_t *p_statbuf = NULL;
+	lsn_t base_lsn = 0;
+	BOOL shared = iso_shared_handles_match(iso);
 
-	wim_path = safe_strdup(&img_report.wininst_path[0][2]);
-	if (wim_path == NULL)
-		goto out;
-	// UDF indiscriminately accepts slash or backslash delimiters,
-	// but ISO-9660 requires slash
-	for (p = wim_path; *p != 0; p++)
-		if (*p == '\\') *p = '/';
+	if ((scratch = iso_get_scratch()) == NULL)
+		return -1;
 
-	// First try to open as UDF - fallback to ISO if it failed
-	p_udf = udf_open(iso);
+	if (shared) {
+		// Borrow the handles published by ExtractISO() for this image
+		p_udf = iso_shared_udf;
+		p_iso = iso_shared_iso;
+	} else {
+		// First try to open as UDF - fallback to ISO if it failed
+		p_udf = udf_open(iso);
+	}
 	if (p_udf == NULL)
 		goto try_iso;
 
@@ -1337,34 +2276,76 @@ uint32_t GetInstallWimVersion(const char* iso)
 		uprintf("Could not locate UDF root directory");
 		goto out;
 	}
-	p_udf_file = udf_fopen(p_udf_root, wim_path);
+	p_udf_file = udf_fopen(p_udf_root, iso_file);
 	if (!p_udf_file) {
-		uprintf("Could not locate file %s in ISO image", wim_path);
+		uprintf("Could not locate file %s in ISO image", iso_file);
 		goto out;
 	}
-	if (udf_read_block(p_udf_file, buf, 1) != UDF_BLOCKSIZE) {
-		uprintf("Error reading UDF file %s", wim_path);
-		goto out;
+	file_length = MIN((int64_t)size, udf_get_file_length(p_udf_file));
+	while (pos < file_length) {
+		n_blocks = (uint32_t)MIN(ISO_SCRATCH_SIZE / UDF_BLOCKSIZE,
+			(file_length - pos + UDF_BLOCKSIZE - 1) / UDF_BLOCKSIZE);
+		read_size = udf_read_block(p_udf_file, scratch, n_blocks);
+		if (read_size <= 0) {
+			uprintf("Error reading UDF file %s", iso_file);
+			goto out;
+		}
+		chunk = MIN(file_length - pos, (int64_t)read_size);
+		if (buf != NULL)
+			LargeMemcpy(&buf[pos], scratch, (size_t)chunk);
+		pos += chunk;
+		if ((sniff_fn != NULL) && sniff_fn(scratch, (size_t)chunk, pos >= file_length)) {
+			// The sniffer found what it was after - no need to read any further
+			r = pos;
+			goto out;
+		}
 	}
-	r = wim_header[3];
+	r = pos;
 	goto out;
 
 try_iso:
-	p_iso = iso9660_open_ext(iso, ISO_EXTENSION_MASK);
+	if (p_iso == NULL)
+		p_iso = iso9660_open_ext(iso, ISO_EXTENSION_MASK);
 	if (p_iso == NULL) {
-		uprintf("Could not open image '%s'", iso);
+		uprintf("Unable to open image '%s'", iso);
 		goto out;
 	}
-	p_statbuf = iso9660_ifs_stat_translate(p_iso, wim_path);
-	if (p_statbuf == NULL) {
-		uprintf("Could not get ISO-9660 file information for file %s", wim_path);
-		goto out;
+	// Reuse the LSN/size gathered by the scan pass when we can
+	if (iso_index_matches(iso)) {
+		const ISO_INDEX_ENTRY* p_entry = iso_index_lookup(iso_file);
+		if ((p_entry != NULL) && (p_entry->lsn != 0)) {
+			base_lsn = p_entry->lsn;
+			file_length = p_entry->size;
+		}
 	}
-	if (iso9660_iso_seek_read(p_iso, buf, p_statbuf->lsn, 1) != ISO_BLOCKSIZE) {
-		uprintf("Error reading ISO-9660 file %s at LSN %d", wim_path, p_statbuf->lsn);
-		goto out;
+	if (base_lsn == 0) {
+		p_statbuf = iso9660_ifs_stat_translate(p_iso, iso_file);
+		if (p_statbuf == NULL) {
+			uprintf("Could not get ISO-9660 file information for file %s", iso_file);
+			goto out;
+		}
+		base_lsn = p_statbuf->lsn;
+		file_length = p_statbuf->total_size;
 	}
-	r = wim_header[3];
+	file_length = MIN((int64_t)size, file_length);
+	for (i = 0; pos < file_length; i += n_blocks) {
+		n_blocks = (uint32_t)MIN(ISO_SCRATCH_SIZE / ISO_BLOCKSIZE,
+			(file_length - pos + ISO_BLOCKSIZE - 1) / ISO_BLOCKSIZE);
+		if (iso9660_iso_seek_read(p_iso, scratch, base_lsn + (lsn_t)i, n_blocks) != n_blocks * ISO_BLOCKSIZE) {
+			uprintf("  Error reading ISO9660 file %s at LSN %lu", iso_file,
+				(long unsigned int)(base_lsn + (lsn_t)i));
+			goto out;
+		}
+		chunk = MIN(file_length - pos, (int64_t)n_blocks * ISO_BLOCKSIZE);
+		if (buf != NULL)
+			LargeMemcpy(&buf[pos], scratch, (size_t)chunk);
+		pos += chunk;
+		if ((sniff_fn != NULL) && sniff_fn(scratch, (size_t)chunk, pos >= file_length)) {
+			r = pos;
+			goto out;
+		}
+	}
+	r = pos;
 
 out:
 	if (p_statbuf != NULL)
@@ -1374,10 +2355,42 @@ out:
 		udf_dirent_free(p_udf_root);
 	if (p_udf_file != NULL)
 		udf_dirent_free(p_udf_file);
-	if (p_iso != NULL)
-		iso9660_close(p_iso);
-	if (p_udf != NULL)
-		udf_close(p_udf);
+	if (!shared) {
+		if (p_iso != NULL)
+			iso9660_close(p_iso);
+		if (p_udf != NULL)
+			udf_close(p_udf);
+	}
+	return r;
+}
+
+int64_t ExtractISOFileToBuffer(const char* iso, const char* iso_file, uint8_t* buf, size_t size)
+{
+	return iso_read_file(iso, iso_file, buf, size, NULL);
+}
+
+uint32_t GetInstallWimVersion(const char* iso)
+{
+	char *wim_path = NULL, *p;
+	uint32_t wim_header[4], r = 0xffffffff;
+
+	wim_path = safe_strdup(&img_report.wininst_path[0][2]);
+	if (wim_path == NULL)
+		goto out;
+	// UDF indiscriminately accepts slash or backslash delimiters,
+	// but ISO-9660 requires slash
+	for (p = wim_path; *p != 0; p++)
+		if (*p == '\\') *p = '/';
+
+	// Only the WIM header is needed to get the version, so read it from memory
+	if (ExtractISOFileToBuffer(iso, wim_path, (uint8_t*)wim_header,
+		sizeof(wim_header)) != sizeof(wim_header)) {
+		uprintf("Could not read WIM header from %s", wim_path);
+		goto out;
+	}
+	r = wim_header[3];
+
+out:
 	safe_free(wim_path);
 	return bswap_uint32(r);
 }
@@ -1429,29 +2442,46 @@ BOOL HasEfiImgBootLoaders(void)
 	iso9660_stat_t* p_statbuf = NULL;
 	iso9660_readfat_private* p_private = NULL;
 	int32_t dc, c;
+	lsn_t base_lsn = 0;
 	struct libfat_filesystem *lf_fs = NULL;
 	struct libfat_direntry direntry;
 	char name[12] = { 0 };
 	int i, j, k;
+	BOOL shared;
 
 	if ((image_path == NULL) || !HAS_EFI_IMG(img_report))
 		return FALSE;
 
-	p_iso = iso9660_open_ext(image_path, ISO_EXTENSION_MASK);
+	// Borrow the ISO-9660 handle published by ExtractISO() when we can
+	shared = iso_shared_handles_match(image_path) && (iso_shared_iso != NULL);
+	if (shared)
+		p_iso = iso_shared_iso;
+	else
+		p_iso = iso9660_open_ext(image_path, ISO_EXTENSION_MASK);
 	if (p_iso == NULL) {
 		uprintf("Could not open image '%s' as an ISO-9660 file system", image_path);
 		goto out;
 	}
-	p_statbuf = iso9660_ifs_stat_translate(p_iso, img_report.efi_img_path);
-	if (p_statbuf == NULL) {
-		uprintf("Could not get ISO-9660 file information for file %s\n", img_report.efi_img_path);
-		goto out;
+	// Reuse the LSN gathered by the scan pass when we can, rather than
+	// having iso9660_ifs_stat_translate() walk the directory tree again
+	if (iso_index_matches(image_path)) {
+		const ISO_INDEX_ENTRY* p_entry = iso_index_lookup(img_report.efi_img_path);
+		if (p_entry != NULL)
+			base_lsn = p_entry->lsn;
+	}
+	if (base_lsn == 0) {
+		p_statbuf = iso9660_ifs_stat_translate(p_iso, img_report.efi_img_path);
+		if (p_statbuf == NULL) {
+			uprintf("Could not get ISO-9660 file information for file %s\n", img_report.efi_img_path);
+			goto out;
+		}
+		base_lsn = p_statbuf->lsn;
 	}
 	p_private = malloc(sizeof(iso9660_readfat_private));
 	if (p_private == NULL)
 		goto out;
 	p_private->p_iso = p_iso;
-	p_private->lsn = p_statbuf->lsn;
+	p_private->lsn = base_lsn;
 	p_private->sec_start = 0;
 	// Populate our initial buffer
 	if (iso9660_iso_seek_read(p_private->p_iso, p_private->buf, p_private->lsn, ISO_NB_BLOCKS) != ISO_NB_BLOCKS * ISO_BLOCKSIZE) {
@@ -1500,7 +2530,7 @@ out:
 		safe_free(p_statbuf->rr.psz_symlink);
 	safe_free(p_statbuf);
 	safe_free(p_private);
-	if (p_iso != NULL)
+	if ((!shared) && (p_iso != NULL))
 		iso9660_close(p_iso);
 	return ret;
 }
@@ -1510,16 +2540,18 @@ BOOL DumpFatDir(const char* path, int32_t cluster)
 	// We don't have concurrent calls to this function, so a static lf_fs is fine
 	static struct libfat_filesystem *lf_fs = NULL;
 	void* buf;
+	uint8_t* run_buf;
 	char *target = NULL, *name = NULL;
 	BOOL ret = FALSE;
 	HANDLE handle = NULL;
-	DWORD size, written;
+	DWORD size, written, run_len;
 	libfat_diritem_t diritem = { 0 };
 	libfat_dirpos_t dirpos = { cluster, -1, 0 };
 	libfat_sector_t s;
 	iso9660_t* p_iso = NULL;
 	iso9660_stat_t* p_statbuf = NULL;
 	iso9660_readfat_private* p_private = NULL;
+	lsn_t base_lsn = 0;
 
 	if (path == NULL)
 		return -1;
@@ -1533,16 +2565,25 @@ BOOL DumpFatDir(const char* path, int32_t cluster)
 			uprintf("Could not open image '%s' as an ISO-9660 file system", image_path);
 			goto out;
 		}
-		p_statbuf = iso9660_ifs_stat_translate(p_iso, img_report.efi_img_path);
-		if (p_statbuf == NULL) {
-			uprintf("Could not get ISO-9660 file information for file %s\n", img_report.efi_img_path);
-			goto out;
+		// Reuse the LSN gathered by the scan pass when we can
+		if (iso_index_matches(image_path)) {
+			const ISO_INDEX_ENTRY* p_entry = iso_index_lookup(img_report.efi_img_path);
+			if (p_entry != NULL)
+				base_lsn = p_entry->lsn;
+		}
+		if (base_lsn == 0) {
+			p_statbuf = iso9660_ifs_stat_translate(p_iso, img_report.efi_img_path);
+			if (p_statbuf == NULL) {
+				uprintf("Could not get ISO-9660 file information for file %s\n", img_report.efi_img_path);
+				goto out;
+			}
+			base_lsn = p_statbuf->lsn;
 		}
 		p_private = malloc(sizeof(iso9660_readfat_private));
 		if (p_private == NULL)
 			goto out;
 		p_private->p_iso = p_iso;
-		p_private->lsn = p_statbuf->lsn;
+		p_private->lsn = base_lsn;
 		p_private->sec_start = 0;
 		// Populate our initial buffer
 		if (iso9660_iso_seek_read(p_private->p_iso, p_private->buf, p_private->lsn, ISO_NB_BLOCKS) != ISO_NB_BLOCKS * ISO_BLOCKSIZE) {
@@ -1590,28 +2631,39 @@ BOOL DumpFatDir(const char* path, int32_t cluster)
 					continue;
 				}
 
+				if ((run_buf = iso_get_scratch()) == NULL)
+					goto out;
 				written = 0;
 				s = libfat_clustertosector(lf_fs, dirpos.cluster);
 				while ((s != 0) && (s < 0xFFFFFFFFULL) && (written < diritem.size)) {
-					buf = libfat_get_sector(lf_fs, s);
-					if (buf == NULL)
-						FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | ERROR_SECTOR_NOT_FOUND;
-					if (FormatStatus)
-						goto out;
-					size = MIN(LIBFAT_SECTOR_SIZE, diritem.size - written);
-					if (!WriteFileWithRetry(handle, buf, size, &size, WRITE_RETRIES) ||
-						(size != MIN(LIBFAT_SECTOR_SIZE, diritem.size - written))) {
+					// Coalesce the cluster chain into large runs, so that we issue
+					// one big write (and one cache flush) per run, rather than one
+					// per 512 byte sector
+					run_len = 0;
+					while ((s != 0) && (s < 0xFFFFFFFFULL) && (run_len < ISO_SCRATCH_SIZE) &&
+						(written + run_len < diritem.size)) {
+						buf = libfat_get_sector(lf_fs, s);
+						if (buf == NULL)
+							FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | ERROR_SECTOR_NOT_FOUND;
+						if (FormatStatus)
+							goto out;
+						memcpy(&run_buf[run_len], buf, LIBFAT_SECTOR_SIZE);
+						run_len += LIBFAT_SECTOR_SIZE;
+						s = libfat_nextsector(lf_fs, s);
+					}
+					// Now that libfat's sector cache is bounded (LRU eviction),
+					// there is no need to libfat_flush() between runs anymore
+					size = MIN(run_len, diritem.size - written);
+					if (!WriteFileWithRetry(handle, run_buf, size, &size, WRITE_RETRIES) ||
+						(size != MIN(run_len, diritem.size - written))) {
 						uprintf("Could not write '%s': %s", target, WindowsErrorString());
 						break;
 					}
 					written += size;
-					s = libfat_nextsector(lf_fs, s);
-					// Trust me, you *REALLY* want to invoke libfat_flush() here
-					libfat_flush(lf_fs);
 				}
 				safe_closehandle(handle);
 				if (props.is_conf)
-					fix_config(target, NULL, NULL, &props);
+					fix_config(NULL, target, NULL, NULL, &props);
 			}
 			safe_free(target);
 			safe_free(name);
@@ -1098,6 +1098,23 @@ CdioList_t * iso9660_fs_readdir (CdIo_t *p_cdio, const char psz_path[]);
 */
 CdioList_t * iso9660_ifs_readdir (iso9660_t *p_iso, const char psz_path[]);
 
+/*!
+  Same as iso9660_ifs_readdir() but takes the already retrieved stat of
+  the directory instead of a path, which avoids re-walking every path
+  component when the caller is recursing over directory listings.
+
+  @param p_iso the ISO-9660 file image to get data from
+
+  @param p_stat the stat of the directory to read, as previously
+  returned by one of the stat or readdir calls. Ownership stays with
+  the caller.
+
+  @return the list of entries inside the directory. The caller must
+  free the returned result using iso9660_stat_free().
+*/
+CdioList_t * iso9660_ifs_readdir_stat (iso9660_t *p_iso,
+                                       const iso9660_stat_t *p_stat);
+
 /*!
   Return the PVD's application ID.
 
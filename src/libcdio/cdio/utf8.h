@@ -96,6 +96,20 @@ bool cdio_charset_to_utf8(const char *src, size_t src_len, cdio_utf8_t **dst,
                           const char * src_charset);
 
 #ifdef _WIN32
+/** \brief Allocation-free variant of cdio_charset_to_utf8(), converting into
+ *  a caller-provided buffer. Intended for hot enumeration paths, where the
+ *  per-call scratch allocations of the generic version add up.
+ *  \param src Source string
+ *  \param src_len Length of the source string (or -1 to use wcslen)
+ *  \param dst Destination buffer (0 terminated on success)
+ *  \param dst_len Size of the destination buffer
+ *  \param src_charset The characterset to convert from (only "UCS-2BE")
+ *  \returns true if conversion was successful, false else.
+ *  This is a convenience function available on Windows platforms only.
+ */
+bool cdio_charset_to_utf8_buf(const char *src, size_t src_len, char *dst,
+                              size_t dst_len, const char *src_charset);
+
 /** \brief Convert an UTF8 string to UTF-16 (allocate returned string)
  *  \param str Source string
  *  \returns NULL if the conversion was unsuccesful. Caller must free the
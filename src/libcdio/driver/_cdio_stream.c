@@ -45,13 +45,42 @@
  * DataSource implementations
  */
 
+/* Block cache parameters. Repeated metadata reads (root directory, path
+   tables, Rock Ridge continuation areas, ...) are small and hit the same
+   blocks over and over, so a few MB of direct-mapped cache in front of
+   the underlying stream turns them into memory copies. Reads larger than
+   one cache block (bulk file data) bypass the cache entirely. */
+#define STREAM_CACHE_BLOCKSIZE (32*1024)
+#define STREAM_CACHE_NUM_BLOCKS 128
+
+typedef struct {
+  off_t base;      /* byte offset of the cached block, -1 if the slot is empty */
+  size_t len;      /* number of valid bytes (< blocksize only at end of stream) */
+} stream_cache_entry_t;
+
 struct _CdioDataSource {
   void* user_data;
   cdio_stream_io_functions op;
   int is_open;
   off_t position;
+  /* position of the underlying stream, which trails this->position once
+     reads are being served from the cache; -1 if unknown */
+  off_t phys_position;
+  stream_cache_entry_t *cache_entry;
+  uint8_t *cache_data;
+  bool cache_failed;
 };
 
+static void
+_stream_cache_drop(CdioDataSource_t *p_obj)
+{
+  unsigned int i;
+
+  if (!p_obj->cache_entry) return;
+  for (i = 0; i < STREAM_CACHE_NUM_BLOCKS; i++)
+    p_obj->cache_entry[i].base = -1;
+}
+
 void
 cdio_stream_close(CdioDataSource_t *p_obj)
 {
@@ -62,6 +91,9 @@ cdio_stream_close(CdioDataSource_t *p_obj)
     p_obj->op.close(p_obj->user_data);
     p_obj->is_open  = 0;
     p_obj->position = 0;
+    p_obj->phys_position = 0;
+    /* The source may point to different data when it is reopened */
+    _stream_cache_drop(p_obj);
   }
 }
 
@@ -72,6 +104,8 @@ cdio_stream_destroy(CdioDataSource_t *p_obj)
 
   cdio_stream_close(p_obj);
 
+  free(p_obj->cache_entry);
+  free(p_obj->cache_data);
   p_obj->op.free(p_obj->user_data);
   p_obj->user_data = NULL;
   free(p_obj);
@@ -124,8 +158,64 @@ _cdio_stream_open_if_necessary(CdioDataSource_t *p_obj)
       cdio_debug ("opened source...");
       p_obj->is_open = 1;
       p_obj->position = 0;
+      p_obj->phys_position = 0;
+    }
+  }
+  return true;
+}
+
+/*
+   Read i_size bytes at the given byte offset of the underlying stream,
+   seeking it there first if needed.
+*/
+static ssize_t
+_cdio_stream_read_raw(CdioDataSource_t *p_obj, void *ptr, off_t offset,
+                      size_t i_size)
+{
+  long read_bytes;
+
+  if (p_obj->phys_position != offset) {
+    if (p_obj->op.seek(p_obj->user_data, offset, SEEK_SET)) {
+      p_obj->phys_position = -1;
+      return 0;
     }
+    p_obj->phys_position = offset;
+  }
+
+  read_bytes = (p_obj->op.read)(p_obj->user_data, ptr, i_size);
+  if (read_bytes < 0) {
+    p_obj->phys_position = -1;
+    return 0;
+  }
+  p_obj->phys_position += read_bytes;
+
+  return read_bytes;
+}
+
+/*
+   Allocate the block cache on first use. Returns false if the cache is
+   not available, in which case reads fall through to the stream.
+*/
+static bool
+_stream_cache_init(CdioDataSource_t *p_obj)
+{
+  if (p_obj->cache_entry) return true;
+  if (p_obj->cache_failed) return false;
+
+  p_obj->cache_entry = calloc (STREAM_CACHE_NUM_BLOCKS,
+                               sizeof (stream_cache_entry_t));
+  p_obj->cache_data = malloc ((size_t) STREAM_CACHE_NUM_BLOCKS *
+                              STREAM_CACHE_BLOCKSIZE);
+  if (!p_obj->cache_entry || !p_obj->cache_data) {
+    cdio_warn ("could not allocate stream block cache");
+    free (p_obj->cache_entry);
+    free (p_obj->cache_data);
+    p_obj->cache_entry = NULL;
+    p_obj->cache_data = NULL;
+    p_obj->cache_failed = true;
+    return false;
   }
+  _stream_cache_drop (p_obj);
   return true;
 }
 
@@ -149,13 +239,49 @@ _cdio_stream_open_if_necessary(CdioDataSource_t *p_obj)
 ssize_t
 cdio_stream_read(CdioDataSource_t* p_obj, void *ptr, size_t size, size_t nmemb)
 {
-  long read_bytes;
+  const size_t i_size = size * nmemb;
+  size_t read_bytes = 0;
 
   if (!p_obj) return 0;
   if (!_cdio_stream_open_if_necessary(p_obj)) return 0;
 
-  read_bytes = (p_obj->op.read)(p_obj->user_data, ptr, size*nmemb);
-  p_obj->position += read_bytes;
+  /* Bulk reads (file data extraction) bypass the cache: they are read
+     once and would only evict the metadata blocks we care about. */
+  if (i_size > STREAM_CACHE_BLOCKSIZE || !_stream_cache_init(p_obj)) {
+    read_bytes = _cdio_stream_read_raw(p_obj, ptr, p_obj->position, i_size);
+    p_obj->position += read_bytes;
+    return read_bytes;
+  }
+
+  while (read_bytes < i_size) {
+    const off_t base = p_obj->position - (p_obj->position %
+                                          STREAM_CACHE_BLOCKSIZE);
+    const size_t block_offset = (size_t) (p_obj->position - base);
+    stream_cache_entry_t *p_entry = &p_obj->cache_entry[
+      (size_t) (base / STREAM_CACHE_BLOCKSIZE) % STREAM_CACHE_NUM_BLOCKS];
+    uint8_t *p_block = &p_obj->cache_data[
+      (size_t) (p_entry - p_obj->cache_entry) * STREAM_CACHE_BLOCKSIZE];
+    size_t chunk;
+
+    if (p_entry->base != base) {
+      p_entry->base = base;
+      p_entry->len = _cdio_stream_read_raw(p_obj, p_block, base,
+                                           STREAM_CACHE_BLOCKSIZE);
+      if (p_entry->len == 0) {
+        p_entry->base = -1;
+        break;
+      }
+    }
+
+    if (block_offset >= p_entry->len)
+      break; /* Past the end of the stream */
+    chunk = MIN(i_size - read_bytes, p_entry->len - block_offset);
+    memcpy(&((uint8_t *) ptr)[read_bytes], &p_block[block_offset], chunk);
+    p_obj->position += chunk;
+    read_bytes += chunk;
+    if (p_entry->len < STREAM_CACHE_BLOCKSIZE)
+      break; /* Short block: end of the stream */
+  }
 
   return read_bytes;
 }
@@ -192,6 +318,10 @@ cdio_stream_seek(CdioDataSource_t* p_obj, off_t offset, int whence)
     cdio_warn("had to reposition DataSource from %ld to %ld!", p_obj->position, offset);
 #endif
     p_obj->position = offset;
+    if (whence == SEEK_SET)
+      /* The underlying stream is repositioned on the next uncached read */
+      return 0;
+    p_obj->phys_position = -1;
     return p_obj->op.seek(p_obj->user_data, offset, whence);
   }
 
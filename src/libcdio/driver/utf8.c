@@ -346,6 +346,40 @@ bool cdio_charset_to_utf8(const char *src, size_t src_len, cdio_utf8_t **dst,
 
   return (*dst != NULL);
 }
+
+bool cdio_charset_to_utf8_buf(const char *src, size_t src_len, char *dst,
+                              size_t dst_len, const char *src_charset)
+{
+  /* ISO 9660 directory record identifiers are at most 255 bytes, so the
+     byte-reversal scratch can live on the stack */
+  wchar_t le_src[256];
+  size_t i;
+
+  if (src == NULL || dst == NULL || dst_len == 0 || src_charset == NULL ||
+      strcmp(src_charset, "UCS-2BE") != 0)
+    return false;
+
+  /* Compute UCS-2 src length */
+  if (src_len == (size_t)-1) {
+    for (src_len = 0; ((uint16_t*)src)[src_len] !=0; src_len++);
+  } else {
+    src_len >>=1;
+  }
+
+  /* Eliminate empty or oversized strings */
+  if ((src_len < 1) || (src_len >= sizeof(le_src)/sizeof(le_src[0])) ||
+      ((src[0] == 0) && (src[1] == 0)))
+    return false;
+
+  /* Perform byte reversal */
+  for (i=0; i<src_len; i++) {
+    ((char*)le_src)[2*i] = src[2*i+1];
+    ((char*)le_src)[2*i+1] = src[2*i];
+  }
+  le_src[src_len] = 0;
+  return WideCharToMultiByte(CP_UTF8, 0, le_src, -1, dst, (int)dst_len,
+                             NULL, NULL) != 0;
+}
 #else
 # error "The iconv library is needed to build drivers, but it is not detected"
 #endif /* HAVE_ICONV */
@@ -818,6 +818,14 @@ _iso9660_dir_to_statbuf (iso9660_dir_t *p_iso9660_dir,
   /* .. string in statbuf is one longer than in p_iso9660_dir's listing '\1' */
   stat_len = sizeof(iso9660_stat_t) + i_fname + 2;
 
+#ifdef HAVE_ROCK
+  /* When Rock Ridge may supply a longer alternate name, reserve room for the
+     longest possible NM value up front, so that the common case below does
+     not have to reallocate-and-copy the statbuf once the name is known */
+  if (_iso9660_is_rock_ridge_enabled(p_image))
+    stat_len = sizeof(iso9660_stat_t) + 256;
+#endif
+
   /* Reuse multiextent p_stat if not NULL */
   if (!p_stat) {
     p_stat = calloc(1, stat_len);
@@ -881,7 +889,7 @@ _iso9660_dir_to_statbuf (iso9660_dir_t *p_iso9660_dir,
 #endif
 
     if (i_rr_fname > 0) {
-      if (i_rr_fname > i_fname) {
+      if (i_rr_fname + 2 > (int)(stat_len - sizeof(iso9660_stat_t))) {
 	/* realloc gives valgrind errors */
 	iso9660_stat_t *p_stat_new =
 	  calloc(1, sizeof(iso9660_stat_t)+i_rr_fname+2);
@@ -902,6 +910,18 @@ _iso9660_dir_to_statbuf (iso9660_dir_t *p_iso9660_dir,
 #ifdef HAVE_JOLIET
       else if (u_joliet_level) {
 	int i_inlen = i_fname;
+#ifdef _WIN32
+	/* Convert into a stack buffer: the generic conversion below costs
+	   three heap allocations per directory record, which adds up during
+	   a full-tree scan of a large Joliet ISO */
+	char utf8_fname[1024];
+	if (cdio_charset_to_utf8_buf(&p_iso9660_dir->filename.str[1], i_inlen,
+                             utf8_fname, sizeof(utf8_fname), "UCS-2BE")) {
+          strncpy(p_stat->filename, utf8_fname, i_fname);
+        } else {
+          goto fail;
+        }
+#else
 	cdio_utf8_t *p_psz_out = NULL;
 	if (cdio_charset_to_utf8(&p_iso9660_dir->filename.str[1], i_inlen,
                              &p_psz_out, "UCS-2BE")) {
@@ -910,6 +930,7 @@ _iso9660_dir_to_statbuf (iso9660_dir_t *p_iso9660_dir,
         } else {
           goto fail;
         }
+#endif
       }
 #endif /*HAVE_JOLIET*/
       else {
@@ -1522,103 +1543,129 @@ iso9660_fs_readdir (CdIo_t *p_cdio, const char psz_path[])
 }
 
 /*!
-  Read psz_path (a directory) and return a list of iso9660_stat_t
-  of the files inside that. The caller must free the returned result.
+  Read the directory described by p_stat and return a list of
+  iso9660_stat_t of the entries inside it. p_stat is left untouched.
 */
-CdioISO9660FileList_t *
-iso9660_ifs_readdir (iso9660_t *p_iso, const char psz_path[])
+static CdioISO9660FileList_t *
+_ifs_readdir_from_stat (iso9660_t *p_iso, const iso9660_stat_t *p_stat)
 {
   iso9660_dir_t *p_iso9660_dir;
   iso9660_stat_t *p_iso9660_stat = NULL;
-  iso9660_stat_t *p_stat;
+  long int ret;
+  unsigned offset = 0;
+  uint8_t *_dirbuf = NULL;
+  uint32_t blocks = CDIO_EXTENT_BLOCKS(p_stat->total_size);
+  CdioList_t *retval = _cdio_list_new ();
+  const size_t dirbuf_len = blocks * ISO_BLOCKSIZE;
+  bool skip_following_extents = false;
 
-  if (!p_iso)    return NULL;
-  if (!psz_path) return NULL;
+  if (!dirbuf_len)
+    {
+      cdio_warn("Invalid directory buffer sector size %u", blocks);
+      _cdio_list_free (retval, true, NULL);
+      return NULL;
+    }
 
-  p_stat = iso9660_ifs_stat (p_iso, psz_path);
-  if (!p_stat)   return NULL;
+  _dirbuf = calloc(1, dirbuf_len);
+  if (!_dirbuf)
+    {
+      cdio_warn("Couldn't calloc(1, %lu)", (unsigned long)dirbuf_len);
+      _cdio_list_free (retval, true, NULL);
+      return NULL;
+    }
 
-  if (p_stat->type != _STAT_DIR) {
-    iso9660_stat_free(p_stat);
+  ret = iso9660_iso_seek_read (p_iso, _dirbuf, p_stat->lsn, blocks);
+  if (ret != dirbuf_len) 	  {
+    _cdio_list_free (retval, true, NULL);
+    free (_dirbuf);
     return NULL;
   }
 
-  {
-    long int ret;
-    unsigned offset = 0;
-    uint8_t *_dirbuf = NULL;
-    uint32_t blocks = CDIO_EXTENT_BLOCKS(p_stat->total_size);
-    CdioList_t *retval = _cdio_list_new ();
-    const size_t dirbuf_len = blocks * ISO_BLOCKSIZE;
-    bool skip_following_extents = false;
+  while (offset < (dirbuf_len))
+    {
+      p_iso9660_dir = (void *) &_dirbuf[offset];
 
-    if (!dirbuf_len)
-      {
-        cdio_warn("Invalid directory buffer sector size %u", blocks);
-	iso9660_stat_free(p_stat);
-	_cdio_list_free (retval, true, NULL);
-        return NULL;
-      }
+      if (iso9660_check_dir_block_end(p_iso9660_dir, &offset))
+	continue;
 
-    _dirbuf = calloc(1, dirbuf_len);
-    if (!_dirbuf)
-      {
-        cdio_warn("Couldn't calloc(1, %lu)", (unsigned long)dirbuf_len);
-	iso9660_stat_free(p_stat);
-	_cdio_list_free (retval, true, NULL);
-        return NULL;
+      if (skip_following_extents) {
+	/* Do not register remaining extents of ill file */
+	p_iso9660_stat = NULL;
+      } else {
+	p_iso9660_stat = _iso9660_dir_to_statbuf(p_iso9660_dir,
+						 p_iso9660_stat,
+						 p_iso,
+						 p_iso->b_xa,
+						 p_iso->u_joliet_level);
+	if (NULL == p_iso9660_stat)
+	  skip_following_extents = true; /* Start ill file mode */
+	else if (p_iso9660_stat->rr.u_su_fields & ISO_ROCK_SUF_RE)
+	  continue; /* Ignore RE entries */
+      }
+      if ((p_iso9660_dir->file_flags & ISO_MULTIEXTENT) == 0)
+	skip_following_extents = false; /* Ill or not: The file ends now */
+      if ((p_iso9660_stat) &&
+	  ((p_iso9660_dir->file_flags & ISO_MULTIEXTENT) == 0)) {
+	_cdio_list_append(retval, p_iso9660_stat);
+	p_iso9660_stat = NULL;
       }
 
-    ret = iso9660_iso_seek_read (p_iso, _dirbuf, p_stat->lsn, blocks);
-    if (ret != dirbuf_len) 	  {
-      _cdio_list_free (retval, true, NULL);
-      iso9660_stat_free(p_stat);
-      free (_dirbuf);
-      return NULL;
+      offset += iso9660_get_dir_len(p_iso9660_dir);
     }
 
-    while (offset < (dirbuf_len))
-      {
-	p_iso9660_dir = (void *) &_dirbuf[offset];
+  free (_dirbuf);
 
-	if (iso9660_check_dir_block_end(p_iso9660_dir, &offset))
-	  continue;
+  if (offset != dirbuf_len) {
+    _cdio_list_free (retval, true, (CdioDataFree_t) iso9660_stat_free);
+    return NULL;
+  }
 
-	if (skip_following_extents) {
-	  /* Do not register remaining extents of ill file */
-	  p_iso9660_stat = NULL;
-	} else {
-	  p_iso9660_stat = _iso9660_dir_to_statbuf(p_iso9660_dir,
-						   p_iso9660_stat,
-						   p_iso,
-						   p_iso->b_xa,
-						   p_iso->u_joliet_level);
-	  if (NULL == p_iso9660_stat)
-	    skip_following_extents = true; /* Start ill file mode */
-	  else if (p_iso9660_stat->rr.u_su_fields & ISO_ROCK_SUF_RE)
-	    continue; /* Ignore RE entries */
-	}
-	if ((p_iso9660_dir->file_flags & ISO_MULTIEXTENT) == 0)
-	  skip_following_extents = false; /* Ill or not: The file ends now */
-	if ((p_iso9660_stat) &&
-	    ((p_iso9660_dir->file_flags & ISO_MULTIEXTENT) == 0)) {
-	  _cdio_list_append(retval, p_iso9660_stat);
-	  p_iso9660_stat = NULL;
-	}
+  return retval;
+}
 
-	offset += iso9660_get_dir_len(p_iso9660_dir);
-      }
+/*!
+  Read psz_path (a directory) and return a list of iso9660_stat_t
+  of the files inside that. The caller must free the returned result.
+*/
+CdioISO9660FileList_t *
+iso9660_ifs_readdir (iso9660_t *p_iso, const char psz_path[])
+{
+  iso9660_stat_t *p_stat;
+  CdioISO9660FileList_t *retval;
 
-    free (_dirbuf);
-    iso9660_stat_free(p_stat);
+  if (!p_iso)    return NULL;
+  if (!psz_path) return NULL;
 
-    if (offset != dirbuf_len) {
-      _cdio_list_free (retval, true, (CdioDataFree_t) iso9660_stat_free);
-      return NULL;
-    }
+  p_stat = iso9660_ifs_stat (p_iso, psz_path);
+  if (!p_stat)   return NULL;
 
-    return retval;
+  if (p_stat->type != _STAT_DIR) {
+    iso9660_stat_free(p_stat);
+    return NULL;
   }
+
+  retval = _ifs_readdir_from_stat (p_iso, p_stat);
+  iso9660_stat_free(p_stat);
+  return retval;
+}
+
+/*!
+  Same as iso9660_ifs_readdir(), but takes the already retrieved stat of
+  the directory instead of a path, which spares re-walking every path
+  component (and re-reading every ancestor directory extent) when the
+  caller is itself iterating over directory listings. The caller keeps
+  ownership of p_stat.
+*/
+CdioISO9660FileList_t *
+iso9660_ifs_readdir_stat (iso9660_t *p_iso, const iso9660_stat_t *p_stat)
+{
+  if (!p_iso)  return NULL;
+  if (!p_stat) return NULL;
+
+  if (p_stat->type != _STAT_DIR)
+    return NULL;
+
+  return _ifs_readdir_from_stat (p_iso, p_stat);
 }
 
 typedef CdioISO9660FileList_t * (iso9660_readdir_t)
@@ -140,6 +140,24 @@ void add_message_command(loc_cmd* lcmd)
 	lcmd->txt[1] = NULL;	// String would be freed after this call otherwise
 }
 
+// Because the parser issues (and releases) one loc_cmd per line, a full parse
+// of the loc file churns through thousands of identically sized allocations.
+// Recycle the structs through a small pool to keep that off the heap.
+static loc_cmd* loc_cmd_pool[256];
+static unsigned int loc_cmd_pool_len = 0;
+
+loc_cmd* alloc_loc_cmd(void)
+{
+	loc_cmd* lcmd;
+
+	if (loc_cmd_pool_len > 0) {
+		lcmd = loc_cmd_pool[--loc_cmd_pool_len];
+		memset(lcmd, 0, sizeof(loc_cmd));
+		return lcmd;
+	}
+	return (loc_cmd*)calloc(sizeof(loc_cmd), 1);
+}
+
 void free_loc_cmd(loc_cmd* lcmd)
 {
 	if (lcmd == NULL)
@@ -147,7 +165,16 @@ void free_loc_cmd(loc_cmd* lcmd)
 	safe_free(lcmd->txt[0]);
 	safe_free(lcmd->txt[1]);
 	safe_free(lcmd->unum);
-	free(lcmd);
+	if (loc_cmd_pool_len < ARRAYSIZE(loc_cmd_pool))
+		loc_cmd_pool[loc_cmd_pool_len++] = lcmd;
+	else
+		free(lcmd);
+}
+
+static void free_loc_cmd_pool(void)
+{
+	while (loc_cmd_pool_len > 0)
+		free(loc_cmd_pool[--loc_cmd_pool_len]);
 }
 
 void free_dialog_list(void)
@@ -200,6 +227,8 @@ void _exit_localization(BOOL reinit) {
 	free_dialog_list();
 	mtab_destroy(reinit);
 	htab_destroy(&htab_loc);
+	if (!reinit)
+		free_loc_cmd_pool();
 }
 
 /*
@@ -267,11 +296,23 @@ BOOL dispatch_loc_cmd(loc_cmd* lcmd)
 		break;
 	case LC_BASE:
 		base_locale = get_locale_from_name(lcmd->txt[0], FALSE);
-		if (base_locale != NULL) {
+		if (base_locale == NULL) {
+			luprintf("locale base '%s' not found - ignoring", lcmd->txt[0]);
+		} else if (base_locale == list_entry(locale_list.next, loc_cmd, list)) {
+			// The default locale was already parsed into default_msg_table at startup, and
+			// its dialog strings duplicate the dialog resources (which is also all that gets
+			// displayed when the default locale itself is selected), so we can service a
+			// default base from the in-memory table instead of re-parsing its whole section.
+			uprintf("localization: using cached locale base '%s'\n", lcmd->txt[0]);
+			for (i = 1; i < MSG_MAX - MSG_000; i++) {
+				if (default_msg_table[i] != NULL) {
+					safe_free(msg_table[i]);
+					msg_table[i] = safe_strdup(default_msg_table[i]);
+				}
+			}
+		} else {
 			uprintf("localization: using locale base '%s'\n", lcmd->txt[0]);
 			get_loc_data_file(NULL, base_locale);
-		} else {
-			luprintf("locale base '%s' not found - ignoring", lcmd->txt[0]);
 		}
 		free_loc_cmd(lcmd);
 		break;
@@ -152,6 +152,7 @@ extern int loc_line_nr;
 extern char *loc_filename, *embedded_loc_filename;
 extern BOOL en_msg_mode;
 
+loc_cmd* alloc_loc_cmd(void);
 void free_loc_cmd(loc_cmd* lcmd);
 BOOL dispatch_loc_cmd(loc_cmd* lcmd);
 void _init_localization(BOOL reinit);
@@ -163,6 +164,7 @@ void apply_localization(int dlg_id, HWND hDlg);
 void reset_localization(int dlg_id);
 void free_dialog_list(void);
 char* lmprintf(uint32_t msg_id, ...);
+void set_loc_buffer(const char* data, long size);
 BOOL get_supported_locales(const char* filename);
 BOOL get_loc_data_file(const char* filename, loc_cmd* lcmd);
 void free_locale_list(void);
@@ -146,6 +146,14 @@ int read_data(FILE *fp, uint64_t Position,
 
    Position += fd->_offset;
 
+   /* Serve fully staged ranges from memory */
+   if((fd->_stage != NULL) && (Position + Len <= fd->_stage_size))
+   {
+      memcpy(pData, &fd->_stage[Position], (size_t)Len);
+      r = 1;
+      goto out;
+   }
+
    StartSector = Position/ulBytesPerSector;
    EndSector   = (Position+Len+ulBytesPerSector -1)/ulBytesPerSector;
    NumSectors  = (size_t)(EndSector - StartSector);
@@ -168,6 +176,10 @@ int read_data(FILE *fp, uint64_t Position,
 
    memcpy(pData, &aucBuf[Position - StartSector*ulBytesPerSector], (size_t)Len);
 
+   /* The start of a straddling range may have pending staged updates */
+   if((fd->_stage != NULL) && (Position < fd->_stage_size))
+      memcpy(pData, &fd->_stage[Position], (size_t)(fd->_stage_size - Position));
+
    r = 1;
 
 out:
@@ -191,6 +203,23 @@ int write_data(FILE *fp, uint64_t Position,
 
    Position += fd->_offset;
 
+   /* Compose staged ranges in memory - the caller performs the single device
+      write once all the boot records have been assembled */
+   if((fd->_stage != NULL) && (Position < fd->_stage_size))
+   {
+      uint64_t Staged = fd->_stage_size - Position;
+      if(Staged > Len)
+         Staged = Len;
+      memcpy(&fd->_stage[Position], pData, (size_t)Staged);
+      if(Staged == Len)
+      {
+         r = 1;
+         goto out;
+      }
+      /* A straddling range still needs its tail written to the device, and
+         the RMW below rewrites the staged head with the same content */
+   }
+
    StartSector = Position/ulBytesPerSector;
    EndSector   = (Position+Len+ulBytesPerSector-1)/ulBytesPerSector;
    NumSectors  = EndSector - StartSector;
@@ -10,6 +10,11 @@
 typedef struct {
 	void *_handle;
 	uint64_t _offset;
+	/* Optional staging buffer: when set, accesses to the first _stage_size bytes
+	   of the device are serviced from memory, so that a series of boot record
+	   updates can be composed and flushed with a single aligned device write */
+	unsigned char *_stage;
+	uint64_t _stage_size;
 } FAKE_FD;
 
 /* Checks if a file contains a data pattern of length Len at position
@@ -80,19 +80,134 @@ extern "C" {
 #define walloc(p, size) wchar_t* w ## p = (p == NULL)?NULL:(wchar_t*)calloc(size, sizeof(wchar_t))
 #define wfree(p) sfree(w ## p)
 
+// ASCII fast path for the UTF-8 ↔ UTF-16 converters below. The vast majority of
+// the strings we convert (paths, log messages) are pure ASCII, for which the
+// MultiByteToWideChar()/WideCharToMultiByte() size query plus conversion round
+// trip is overkill — a straight widening or narrowing copy is all that's needed.
+#if (defined(_M_X64) || defined(__x86_64__) || defined(_M_IX86) || defined(__i386__))
+#define MSAPI_UTF8_CAN_USE_SSE2
+#include <emmintrin.h>
+#endif
+
+/*
+ * Returns the length of str if it is pure ASCII, -1 otherwise
+ */
+static __inline int ascii_len(const char* str)
+{
+	int i = 0;
+#if defined(MSAPI_UTF8_CAN_USE_SSE2)
+	__m128i chunk, zero = _mm_setzero_si128();
+
+	// Scalar scan until 16-byte aligned, so that the aligned vector loads
+	// below can never straddle a page boundary
+	for (; (((ULONG_PTR)&str[i]) & 15) != 0; i++) {
+		if (str[i] == 0)
+			return i;
+		if (((unsigned char)str[i]) >= 0x80)
+			return -1;
+	}
+	for (; ; i += 16) {
+		chunk = _mm_load_si128((const __m128i*)&str[i]);
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, zero)) != 0)
+			break;	// NUL in this chunk: finish with the scalar loop below
+		if (_mm_movemask_epi8(chunk) != 0)
+			return -1;
+	}
+#endif
+	for (; str[i] != 0; i++)
+		if (((unsigned char)str[i]) >= 0x80)
+			return -1;
+	return i;
+}
+
+/*
+ * Returns the length of wstr if all its code units are ASCII, -1 otherwise
+ */
+static __inline int wascii_len(const wchar_t* wstr)
+{
+	int i = 0;
+#if defined(MSAPI_UTF8_CAN_USE_SSE2)
+	__m128i chunk, zero = _mm_setzero_si128(), nonascii = _mm_set1_epi16((short)0xff80);
+
+	for (; (((ULONG_PTR)&wstr[i]) & 15) != 0; i++) {
+		if (wstr[i] == 0)
+			return i;
+		if (wstr[i] >= 0x80)
+			return -1;
+	}
+	for (; ; i += 8) {
+		chunk = _mm_load_si128((const __m128i*)&wstr[i]);
+		if (_mm_movemask_epi8(_mm_cmpeq_epi16(chunk, zero)) != 0)
+			break;
+		if (_mm_movemask_epi8(_mm_cmpeq_epi16(_mm_and_si128(chunk, nonascii), zero)) != 0xffff)
+			return -1;
+	}
+#endif
+	for (; wstr[i] != 0; i++)
+		if (wstr[i] >= 0x80)
+			return -1;
+	return i;
+}
+
+/*
+ * NUL-terminated widening copy of an ASCII string validated by ascii_len()
+ */
+static __inline void ascii_widen(const char* str, wchar_t* wstr, int len)
+{
+	int i = 0;
+#if defined(MSAPI_UTF8_CAN_USE_SSE2)
+	__m128i chunk, zero = _mm_setzero_si128();
+
+	for (; i + 16 <= len; i += 16) {
+		chunk = _mm_loadu_si128((const __m128i*)&str[i]);
+		_mm_storeu_si128((__m128i*)&wstr[i], _mm_unpacklo_epi8(chunk, zero));
+		_mm_storeu_si128((__m128i*)&wstr[i + 8], _mm_unpackhi_epi8(chunk, zero));
+	}
+#endif
+	for (; i < len; i++)
+		wstr[i] = (wchar_t)(unsigned char)str[i];
+	wstr[len] = 0;
+}
+
+/*
+ * NUL-terminated narrowing copy of an ASCII string validated by wascii_len()
+ */
+static __inline void ascii_narrow(const wchar_t* wstr, char* str, int len)
+{
+	int i = 0;
+#if defined(MSAPI_UTF8_CAN_USE_SSE2)
+	for (; i + 16 <= len; i += 16)
+		_mm_storeu_si128((__m128i*)&str[i],
+			_mm_packus_epi16(_mm_loadu_si128((const __m128i*)&wstr[i]),
+				_mm_loadu_si128((const __m128i*)&wstr[i + 8])));
+#endif
+	for (; i < len; i++)
+		str[i] = (char)wstr[i];
+	str[len] = 0;
+}
+
 /*
  * Converts an UTF-16 string to UTF8 (allocate returned string)
  * Returns NULL on error
  */
 static __inline char* wchar_to_utf8(const wchar_t* wstr)
 {
-	int size = 0;
+	int len, size = 0;
 	char* str = NULL;
 
 	// Convert the empty string too
 	if (wstr[0] == 0)
 		return (char*)calloc(1, 1);
 
+	// ASCII fast path: skip the WideCharToMultiByte() round trips
+	len = wascii_len(wstr);
+	if (len > 0) {
+		if ((str = (char*)malloc((size_t)len + 1)) == NULL)
+			return NULL;
+		ascii_narrow(wstr, str, len);
+		return str;
+	}
+
 	// Find out the size we need to allocate for our converted string
 	size = WideCharToMultiByte(CP_UTF8, 0, wstr, -1, NULL, 0, NULL, NULL);
 	if (size <= 1)	// An empty string would be size 1
@@ -115,7 +230,7 @@ static __inline char* wchar_to_utf8(const wchar_t* wstr)
  */
 static __inline wchar_t* utf8_to_wchar(const char* str)
 {
-	int size = 0;
+	int len, size = 0;
 	wchar_t* wstr = NULL;
 
 	if (str == NULL)
@@ -125,6 +240,15 @@ static __inline wchar_t* utf8_to_wchar(const char* str)
 	if (str[0] == 0)
 		return (wchar_t*)calloc(1, sizeof(wchar_t));
 
+	// ASCII fast path: skip the MultiByteToWideChar() round trips
+	len = ascii_len(str);
+	if (len > 0) {
+		if ((wstr = (wchar_t*)malloc(((size_t)len + 1) * sizeof(wchar_t))) == NULL)
+			return NULL;
+		ascii_widen(str, wstr, len);
+		return wstr;
+	}
+
 	// Find out the size we need to allocate for our converted string
 	size = MultiByteToWideChar(CP_UTF8, 0, str, -1, NULL, 0);
 	if (size <= 1)	// An empty string would be size 1
@@ -43,8 +43,14 @@
 
 /* Maximum download chunk size, in bytes */
 #define DOWNLOAD_BUFFER_SIZE    (10*KB)
+/* Number of parallel connections for segmented file downloads */
+#define DOWNLOAD_NUM_SEGMENTS   4
+/* Minimum file size before a download gets segmented */
+#define DOWNLOAD_SEGMENT_THRESHOLD (8*MB)
 /* Default delay between update checks (1 day) */
 #define DEFAULT_UPDATE_INTERVAL (24*3600)
+/* How long a "no version file on server" result is cached, in seconds */
+#define UPDATE_NEG_CACHE_TTL    (24*3600)
 
 DWORD DownloadStatus;
 BYTE* fido_script = NULL;
@@ -261,6 +267,11 @@ static char* GetShortName(const char* url)
 	return short_name;
 }
 
+// The WinINet session is shared by all downloads, so that its DNS cache and
+// keep-alive connection pool survive from one request to the next (and can be
+// warmed up ahead of the first interactive download)
+static volatile HINTERNET hInternetSession = NULL;
+
 // Open an Internet session
 static HINTERNET GetInternetSession(BOOL bRetry)
 {
@@ -275,8 +286,15 @@ static HINTERNET GetInternetSession(BOOL bRetry)
 
 	PF_TYPE_DECL(WINAPI, HINTERNET, InternetOpenA, (LPCSTR, DWORD, LPCSTR, LPCSTR, DWORD));
 	PF_TYPE_DECL(WINAPI, BOOL, InternetSetOptionA, (HINTERNET, DWORD, LPVOID, DWORD));
+	PF_TYPE_DECL(WINAPI, BOOL, InternetCloseHandle, (HINTERNET));
 	PF_INIT_OR_OUT(InternetOpenA, WinInet);
 	PF_INIT_OR_OUT(InternetSetOptionA, WinInet);
+	PF_INIT_OR_OUT(InternetCloseHandle, WinInet);
+
+	// Reuse the shared session if we already have one
+	hSession = hInternetSession;
+	if (hSession != NULL)
+		goto out;
 
 	// Create a NetworkListManager Instance to check the network connection
 	IGNORE_RETVAL(CoInitializeEx(NULL, COINIT_APARTMENTTHREADED | COINIT_DISABLE_OLE1DDE));
@@ -307,10 +325,424 @@ static HINTERNET GetInternetSession(BOOL bRetry)
 	// Enable HTTP/2 protocol support
 	pfInternetSetOptionA(hSession, INTERNET_OPTION_ENABLE_HTTP_PROTOCOL, (LPVOID)&dwProtocolSupport, sizeof(dwProtocolSupport));
 
+	// Cache the session for reuse, guarding against a concurrent creation
+	if (InterlockedCompareExchangePointer((PVOID volatile *)&hInternetSession, hSession, NULL) != NULL) {
+		pfInternetCloseHandle(hSession);
+		hSession = hInternetSession;
+	}
+
 out:
 	return hSession;
 }
 
+typedef struct {
+	const char* file;
+	const char* short_name;
+	HINTERNET hSession;
+	URL_COMPONENTSA* url_parts;
+	uint64_t start;
+	uint64_t end;				// Last byte of the segment, inclusive
+	volatile LONG64* dl_size;
+	volatile BOOL* abort;
+	BOOL success;
+} dl_segment_t;
+
+// Fetch one byte range of a segmented download, writing it at its final
+// position in the (preallocated) destination file.
+static DWORD WINAPI DownloadSegmentThread(LPVOID param)
+{
+	dl_segment_t* seg = (dl_segment_t*)param;
+	const char* accept_types[] = { "*/*\0", NULL };
+	unsigned char buf[DOWNLOAD_BUFFER_SIZE];
+	char headers[128];
+	DWORD dwSize, dwDownloaded, dwWritten, status = 0;
+	HANDLE hFile = INVALID_HANDLE_VALUE;
+	HINTERNET hConnection = NULL, hRequest = NULL;
+	LARGE_INTEGER li;
+	uint64_t pos = seg->start;
+
+	PF_TYPE_DECL(WINAPI, HINTERNET, InternetConnectA, (HINTERNET, LPCSTR, INTERNET_PORT, LPCSTR, LPCSTR, DWORD, DWORD, DWORD_PTR));
+	PF_TYPE_DECL(WINAPI, BOOL, InternetReadFile, (HINTERNET, LPVOID, DWORD, LPDWORD));
+	PF_TYPE_DECL(WINAPI, BOOL, InternetCloseHandle, (HINTERNET));
+	PF_TYPE_DECL(WINAPI, HINTERNET, HttpOpenRequestA, (HINTERNET, LPCSTR, LPCSTR, LPCSTR, LPCSTR, LPCSTR*, DWORD, DWORD_PTR));
+	PF_TYPE_DECL(WINAPI, BOOL, HttpSendRequestA, (HINTERNET, LPCSTR, DWORD, LPVOID, DWORD));
+	PF_TYPE_DECL(WINAPI, BOOL, HttpQueryInfoA, (HINTERNET, DWORD, LPVOID, LPDWORD, LPDWORD));
+	PF_INIT_OR_OUT(InternetConnectA, WinInet);
+	PF_INIT_OR_OUT(InternetReadFile, WinInet);
+	PF_INIT_OR_OUT(InternetCloseHandle, WinInet);
+	PF_INIT_OR_OUT(HttpOpenRequestA, WinInet);
+	PF_INIT_OR_OUT(HttpSendRequestA, WinInet);
+	PF_INIT_OR_OUT(HttpQueryInfoA, WinInet);
+
+	hConnection = pfInternetConnectA(seg->hSession, seg->url_parts->lpszHostName, seg->url_parts->nPort,
+		NULL, NULL, INTERNET_SERVICE_HTTP, 0, (DWORD_PTR)NULL);
+	if (hConnection == NULL) {
+		uprintf("Could not connect to server %s:%d: %s", seg->url_parts->lpszHostName,
+			seg->url_parts->nPort, WinInetErrorString());
+		goto out;
+	}
+	hRequest = pfHttpOpenRequestA(hConnection, "GET", seg->url_parts->lpszUrlPath, NULL, NULL, accept_types,
+		INTERNET_FLAG_IGNORE_REDIRECT_TO_HTTP|INTERNET_FLAG_IGNORE_REDIRECT_TO_HTTPS|
+		INTERNET_FLAG_NO_COOKIES|INTERNET_FLAG_NO_UI|INTERNET_FLAG_NO_CACHE_WRITE|INTERNET_FLAG_HYPERLINK|
+		((seg->url_parts->nScheme==INTERNET_SCHEME_HTTPS)?INTERNET_FLAG_SECURE:0), (DWORD_PTR)NULL);
+	if (hRequest == NULL)
+		goto out;
+	// No compressed transfer encoding, as it would not preserve the ranges
+	static_sprintf(headers, "Accept-Encoding: identity\r\nRange: bytes=%llu-%llu", seg->start, seg->end);
+	if (!pfHttpSendRequestA(hRequest, headers, -1L, NULL, 0)) {
+		uprintf("Unable to send request: %s", WinInetErrorString());
+		goto out;
+	}
+	dwSize = sizeof(status);
+	pfHttpQueryInfoA(hRequest, HTTP_QUERY_STATUS_CODE|HTTP_QUERY_FLAG_NUMBER, (LPVOID)&status, &dwSize, NULL);
+	if (status != 206) {
+		uprintf("Server did not honor ranged request: %d", status);
+		goto out;
+	}
+	hFile = CreateFileU(seg->file, GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
+		OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (hFile == INVALID_HANDLE_VALUE) {
+		uprintf("Unable to open file '%s': %s", seg->short_name, WinInetErrorString());
+		goto out;
+	}
+	li.QuadPart = (LONGLONG)seg->start;
+	if (!SetFilePointerEx(hFile, li, NULL, FILE_BEGIN))
+		goto out;
+	while (pos <= seg->end) {
+		if (*seg->abort)
+			goto out;
+		if (!pfInternetReadFile(hRequest, buf, (DWORD)MIN(sizeof(buf), seg->end - pos + 1), &dwDownloaded) ||
+			(dwDownloaded == 0))
+			break;
+		if (!WriteFile(hFile, buf, dwDownloaded, &dwWritten, NULL) || (dwDownloaded != dwWritten)) {
+			uprintf("Error writing file '%s': %s", seg->short_name, WinInetErrorString());
+			goto out;
+		}
+		pos += dwDownloaded;
+		InterlockedExchangeAdd64(seg->dl_size, dwDownloaded);
+	}
+	seg->success = (pos == seg->end + 1);
+
+out:
+	// A failed segment dooms the whole download => have the others bail out
+	if (!seg->success)
+		*seg->abort = TRUE;
+	safe_closehandle(hFile);
+	if (hRequest)
+		pfInternetCloseHandle(hRequest);
+	if (hConnection)
+		pfInternetCloseHandle(hConnection);
+	return seg->success ? 0 : 1;
+}
+
+/* Geometry of the streaming download ring buffer */
+#define DOWNLOAD_STREAM_SLOT_SIZE   (1*MB)
+#define DOWNLOAD_STREAM_NUM_SLOTS   64
+
+// Streaming download state: a producer thread fills a bounded ring of slots
+// from the network, while StreamingDownloadRead() drains them, so that a
+// remote image can be consumed as it downloads, without first being staged
+// on disk. Slot availability is tracked with a pair of counted semaphores,
+// and a slot that isn't completely filled marks the end of the transfer.
+static struct {
+	BOOL active;
+	BOOL eof;
+	BOOL error;
+	BOOL abort;
+	BOOL slot_held;
+	char* url;
+	uint8_t* buf;
+	DWORD slot_len[DOWNLOAD_STREAM_NUM_SLOTS];
+	DWORD rpos;
+	int rslot, wslot;
+	uint64_t total_size;
+	HANDLE sem_free, sem_data, thread, ready;
+} dl_stream = { 0 };
+
+static DWORD WINAPI StreamingDownloadThread(LPVOID param)
+{
+	const char* accept_types[] = { "*/*\0", NULL };
+	char hostname[64], urlpath[128], strsize[32];
+	BOOL success = FALSE;
+	DWORD dwSize, dwDownloaded, filled, status = 0;
+	HINTERNET hSession = NULL, hConnection = NULL, hRequest = NULL;
+	URL_COMPONENTSA UrlParts = { sizeof(URL_COMPONENTSA), NULL, 1, (INTERNET_SCHEME)0,
+		hostname, sizeof(hostname), 0, NULL, 1, urlpath, sizeof(urlpath), NULL, 1 };
+	uint8_t* slot;
+
+	PF_TYPE_DECL(WINAPI, BOOL, InternetCrackUrlA, (LPCSTR, DWORD, DWORD, LPURL_COMPONENTSA));
+	PF_TYPE_DECL(WINAPI, HINTERNET, InternetConnectA, (HINTERNET, LPCSTR, INTERNET_PORT, LPCSTR, LPCSTR, DWORD, DWORD, DWORD_PTR));
+	PF_TYPE_DECL(WINAPI, BOOL, InternetReadFile, (HINTERNET, LPVOID, DWORD, LPDWORD));
+	PF_TYPE_DECL(WINAPI, BOOL, InternetCloseHandle, (HINTERNET));
+	PF_TYPE_DECL(WINAPI, HINTERNET, HttpOpenRequestA, (HINTERNET, LPCSTR, LPCSTR, LPCSTR, LPCSTR, LPCSTR*, DWORD, DWORD_PTR));
+	PF_TYPE_DECL(WINAPI, BOOL, HttpSendRequestA, (HINTERNET, LPCSTR, DWORD, LPVOID, DWORD));
+	PF_TYPE_DECL(WINAPI, BOOL, HttpQueryInfoA, (HINTERNET, DWORD, LPVOID, LPDWORD, LPDWORD));
+	PF_INIT_OR_OUT(InternetCrackUrlA, WinInet);
+	PF_INIT_OR_OUT(InternetConnectA, WinInet);
+	PF_INIT_OR_OUT(InternetReadFile, WinInet);
+	PF_INIT_OR_OUT(InternetCloseHandle, WinInet);
+	PF_INIT_OR_OUT(HttpOpenRequestA, WinInet);
+	PF_INIT_OR_OUT(HttpSendRequestA, WinInet);
+	PF_INIT_OR_OUT(HttpQueryInfoA, WinInet);
+
+	if ((!pfInternetCrackUrlA(dl_stream.url, (DWORD)safe_strlen(dl_stream.url), 0, &UrlParts))
+	  || (UrlParts.lpszHostName == NULL) || (UrlParts.lpszUrlPath == NULL)) {
+		uprintf("Unable to decode URL: %s", WinInetErrorString());
+		goto out;
+	}
+	hostname[sizeof(hostname) - 1] = 0;
+
+	hSession = GetInternetSession(TRUE);
+	if (hSession == NULL) {
+		uprintf("Could not open Internet session: %s", WinInetErrorString());
+		goto out;
+	}
+	hConnection = pfInternetConnectA(hSession, UrlParts.lpszHostName, UrlParts.nPort,
+		NULL, NULL, INTERNET_SERVICE_HTTP, 0, (DWORD_PTR)NULL);
+	if (hConnection == NULL) {
+		uprintf("Could not connect to server %s:%d: %s", UrlParts.lpszHostName, UrlParts.nPort, WinInetErrorString());
+		goto out;
+	}
+	hRequest = pfHttpOpenRequestA(hConnection, "GET", UrlParts.lpszUrlPath, NULL, NULL, accept_types,
+		INTERNET_FLAG_IGNORE_REDIRECT_TO_HTTP|INTERNET_FLAG_IGNORE_REDIRECT_TO_HTTPS|
+		INTERNET_FLAG_NO_COOKIES|INTERNET_FLAG_NO_UI|INTERNET_FLAG_NO_CACHE_WRITE|INTERNET_FLAG_HYPERLINK|
+		((UrlParts.nScheme==INTERNET_SCHEME_HTTPS)?INTERNET_FLAG_SECURE:0), (DWORD_PTR)NULL);
+	if (hRequest == NULL) {
+		uprintf("Could not open URL %s: %s", dl_stream.url, WinInetErrorString());
+		goto out;
+	}
+	// No compressed transfer encoding, as the bytes we hand out must be the
+	// exact bytes of the image, for both size and checksum purposes
+	if (!pfHttpSendRequestA(hRequest, "Accept-Encoding: identity", -1L, NULL, 0)) {
+		uprintf("Unable to send request: %s", WinInetErrorString());
+		goto out;
+	}
+	dwSize = sizeof(status);
+	pfHttpQueryInfoA(hRequest, HTTP_QUERY_STATUS_CODE|HTTP_QUERY_FLAG_NUMBER, (LPVOID)&status, &dwSize, NULL);
+	if (status != 200) {
+		uprintf("Unable to access file: %d", status);
+		goto out;
+	}
+	dwSize = sizeof(strsize);
+	if (!pfHttpQueryInfoA(hRequest, HTTP_QUERY_CONTENT_LENGTH, (LPVOID)strsize, &dwSize, NULL)) {
+		uprintf("Unable to retrieve file length: %s", WinInetErrorString());
+		goto out;
+	}
+	dl_stream.total_size = (uint64_t)atoll(strsize);
+	if (dl_stream.total_size == 0)
+		goto out;
+
+	// The headers checked out => let StartStreamingDownload() return, and
+	// start filling the ring
+	SetEvent(dl_stream.ready);
+
+	while (!dl_stream.abort && !IS_ERROR(FormatStatus)) {
+		while (WaitForSingleObject(dl_stream.sem_free, 100) == WAIT_TIMEOUT) {
+			if (dl_stream.abort || IS_ERROR(FormatStatus))
+				goto out;
+		}
+		slot = &dl_stream.buf[dl_stream.wslot * DOWNLOAD_STREAM_SLOT_SIZE];
+		for (filled = 0; filled < DOWNLOAD_STREAM_SLOT_SIZE; filled += dwDownloaded) {
+			if (!pfInternetReadFile(hRequest, &slot[filled], DOWNLOAD_STREAM_SLOT_SIZE - filled, &dwDownloaded)) {
+				uprintf("Streaming download error: %s", WinInetErrorString());
+				goto out;
+			}
+			if (dwDownloaded == 0)
+				break;
+		}
+		dl_stream.slot_len[dl_stream.wslot] = filled;
+		dl_stream.wslot = (dl_stream.wslot + 1) % DOWNLOAD_STREAM_NUM_SLOTS;
+		ReleaseSemaphore(dl_stream.sem_data, 1, NULL);
+		// A slot that isn't full marks the end of the transfer
+		if (filled < DOWNLOAD_STREAM_SLOT_SIZE) {
+			success = TRUE;
+			break;
+		}
+	}
+
+out:
+	if (!success) {
+		dl_stream.error = TRUE;
+		// Wake up whichever side might be blocked on us
+		SetEvent(dl_stream.ready);
+		ReleaseSemaphore(dl_stream.sem_data, 1, NULL);
+	}
+	if (hRequest)
+		pfInternetCloseHandle(hRequest);
+	if (hConnection)
+		pfInternetCloseHandle(hConnection);
+	// The shared session is kept open for reuse
+	return success ? 0 : 1;
+}
+
+// Tear a streaming download session down. Safe to call when none is active.
+void StopStreamingDownload(void)
+{
+	if (dl_stream.thread != NULL) {
+		dl_stream.abort = TRUE;
+		// Unblock the producer if it is waiting for a free slot
+		if (dl_stream.sem_free != NULL)
+			ReleaseSemaphore(dl_stream.sem_free, 1, NULL);
+		if (WaitForSingleObject(dl_stream.thread, NET_SESSION_TIMEOUT) != WAIT_OBJECT_0)
+			TerminateThread(dl_stream.thread, 1);
+		CloseHandle(dl_stream.thread);
+	}
+	safe_closehandle(dl_stream.sem_free);
+	safe_closehandle(dl_stream.sem_data);
+	safe_closehandle(dl_stream.ready);
+	safe_free(dl_stream.url);
+	safe_free(dl_stream.buf);
+	memset((void*)&dl_stream, 0, sizeof(dl_stream));
+}
+
+/*
+ * Start a streaming download of 'url'. On success, the size of the remote
+ * file is returned in 'size', and sequential calls to StreamingDownloadRead()
+ * then return the file's content as it is being downloaded.
+ */
+BOOL StartStreamingDownload(const char* url, uint64_t* size)
+{
+	if (dl_stream.active)
+		StopStreamingDownload();
+
+	dl_stream.url = safe_strdup(url);
+	dl_stream.buf = malloc(DOWNLOAD_STREAM_NUM_SLOTS * DOWNLOAD_STREAM_SLOT_SIZE);
+	dl_stream.sem_free = CreateSemaphore(NULL, DOWNLOAD_STREAM_NUM_SLOTS, DOWNLOAD_STREAM_NUM_SLOTS, NULL);
+	dl_stream.sem_data = CreateSemaphore(NULL, 0, DOWNLOAD_STREAM_NUM_SLOTS + 1, NULL);
+	dl_stream.ready = CreateEvent(NULL, TRUE, FALSE, NULL);
+	if ((dl_stream.url == NULL) || (dl_stream.buf == NULL) || (dl_stream.sem_free == NULL) ||
+		(dl_stream.sem_data == NULL) || (dl_stream.ready == NULL))
+		goto err;
+	uprintf("Streaming download of %s", url);
+	dl_stream.thread = CreateThread(NULL, 0, StreamingDownloadThread, NULL, 0, NULL);
+	if (dl_stream.thread == NULL)
+		goto err;
+	while (WaitForSingleObject(dl_stream.ready, 100) == WAIT_TIMEOUT) {
+		if (IS_ERROR(FormatStatus))
+			goto err;
+	}
+	if (dl_stream.error)
+		goto err;
+	if (size != NULL)
+		*size = dl_stream.total_size;
+	dl_stream.active = TRUE;
+	return TRUE;
+
+err:
+	StopStreamingDownload();
+	return FALSE;
+}
+
+/*
+ * Return up to 'size' sequential bytes of the streamed file into 'buf'.
+ * Blocks until that much data is available, and only returns less once the
+ * end of the transfer has been reached. Returns -1 on error.
+ */
+int StreamingDownloadRead(uint8_t* buf, DWORD size)
+{
+	DWORD chunk, copied = 0;
+
+	if (!dl_stream.active || dl_stream.error)
+		return -1;
+	while (copied < size) {
+		if (!dl_stream.slot_held) {
+			if (dl_stream.eof)
+				break;
+			// Wait for the producer to hand us the next slot
+			while (WaitForSingleObject(dl_stream.sem_data, 100) == WAIT_TIMEOUT) {
+				if (IS_ERROR(FormatStatus))
+					return -1;
+			}
+			if (dl_stream.error)
+				return -1;
+			if (dl_stream.slot_len[dl_stream.rslot] < DOWNLOAD_STREAM_SLOT_SIZE)
+				dl_stream.eof = TRUE;
+			if (dl_stream.slot_len[dl_stream.rslot] == 0)
+				break;
+			dl_stream.slot_held = TRUE;
+			dl_stream.rpos = 0;
+		}
+		chunk = MIN(size - copied, dl_stream.slot_len[dl_stream.rslot] - dl_stream.rpos);
+		memcpy(&buf[copied], &dl_stream.buf[dl_stream.rslot * DOWNLOAD_STREAM_SLOT_SIZE + dl_stream.rpos], chunk);
+		copied += chunk;
+		dl_stream.rpos += chunk;
+		if (dl_stream.rpos >= dl_stream.slot_len[dl_stream.rslot]) {
+			dl_stream.slot_held = FALSE;
+			dl_stream.rslot = (dl_stream.rslot + 1) % DOWNLOAD_STREAM_NUM_SLOTS;
+			ReleaseSemaphore(dl_stream.sem_free, 1, NULL);
+		}
+	}
+	return (int)copied;
+}
+
+BOOL IsStreamingDownloadActive(void)
+{
+	return dl_stream.active;
+}
+
+/* How often the journal of a resumable download is persisted */
+#define DOWNLOAD_JOURNAL_INTERVAL   (128*MB)
+
+// Journal of an interrupted download, persisted in the settings, so that the
+// next attempt at the same URL can resume with an HTTP ranged request instead
+// of restarting from zero. Alongside the URL and the received length, the
+// rolling checksum state is saved, so the digest of a resumed download still
+// covers the whole file, without re-reading the partial one.
+static uint64_t GetDownloadJournal(const char* url, const char* file, BOOL* match)
+{
+	char* str;
+	uint8_t state[MAX_HASH_STATE_SIZE];
+	size_t i, len;
+	uint64_t offset;
+	struct __stat64 stat;
+
+	*match = FALSE;
+	str = ReadSettingStr(SETTING_DL_JOURNAL_URL);
+	if ((str == NULL) || (str[0] == 0) || (strcmp(str, url) != 0))
+		return 0;
+	*match = TRUE;
+	offset = (uint64_t)ReadSetting64(SETTING_DL_JOURNAL_OFFSET);
+	// The partial file must still exist and cover the journaled extent
+	if ((offset == 0) || (_stat64U(file, &stat) != 0) || ((uint64_t)stat.st_size < offset))
+		return 0;
+	str = ReadSettingStr(SETTING_DL_JOURNAL_SUM_STATE);
+	len = safe_strlen(str) / 2;
+	if ((len == 0) || (len > sizeof(state)))
+		return 0;
+	for (i = 0; i < len; i++) {
+		if (sscanf(&str[2 * i], "%2hhx", &state[i]) != 1)
+			return 0;
+	}
+	if (!HashStreamRestore(state, len))
+		return 0;
+	return offset;
+}
+
+// Record 'offset' bytes of 'url' as received, along with the live checksum
+// state. An offset of 0 only marks the URL, which disables segmentation on
+// the next attempt (a failed segmented download leaves no resumable partial).
+static void UpdateDownloadJournal(const char* url, uint64_t offset)
+{
+	char str[2 * MAX_HASH_STATE_SIZE + 1] = "";
+	uint8_t state[MAX_HASH_STATE_SIZE];
+	size_t i, len = 0;
+
+	WriteSettingStr(SETTING_DL_JOURNAL_URL, url);
+	WriteSetting64(SETTING_DL_JOURNAL_OFFSET, offset);
+	if (offset != 0)
+		len = HashStreamSave(state, sizeof(state));
+	for (i = 0; i < len; i++)
+		sprintf(&str[2 * i], "%02x", state[i]);
+	WriteSettingStr(SETTING_DL_JOURNAL_SUM_STATE, str);
+}
+
+static void ClearDownloadJournal(void)
+{
+	WriteSettingStr(SETTING_DL_JOURNAL_URL, "");
+	WriteSetting64(SETTING_DL_JOURNAL_OFFSET, 0);
+	WriteSettingStr(SETTING_DL_JOURNAL_SUM_STATE, "");
+}
+
 /*
  * Download a file or fill a buffer from an URL
  * Mostly taken from http://support.microsoft.com/kb/234913
@@ -326,14 +758,23 @@ uint64_t DownloadToFileOrBuffer(const char* url, const char* file, BYTE** buffer
 	const char* accept_types[] = {"*/*\0", NULL};
 	const char* short_name;
 	unsigned char buf[DOWNLOAD_BUFFER_SIZE];
-	char hostname[64], urlpath[128], strsize[32];
-	BOOL r = FALSE;
+	char hostname[64], urlpath[128], strsize[32], accept_ranges[32];
+	char range_hdr[64], sum_str[65];
+	uint8_t sum[32];	// SHA256_HASHSIZE
+	BOOL r = FALSE, segmented = FALSE, journal_match = FALSE, hash_ok = FALSE;
 	DWORD dwSize, dwWritten, dwDownloaded;
 	HANDLE hFile = INVALID_HANDLE_VALUE;
+	LARGE_INTEGER li;
+	uint64_t resume_offset = 0;
 	HINTERNET hSession = NULL, hConnection = NULL, hRequest = NULL;
 	URL_COMPONENTSA UrlParts = {sizeof(URL_COMPONENTSA), NULL, 1, (INTERNET_SCHEME)0,
 		hostname, sizeof(hostname), 0, NULL, 1, urlpath, sizeof(urlpath), NULL, 1};
-	uint64_t size = 0, total_size = 0;
+	dl_segment_t segment[DOWNLOAD_NUM_SEGMENTS] = { {0} };
+	HANDLE segment_thread[DOWNLOAD_NUM_SEGMENTS] = { NULL };
+	volatile LONG64 dl_size = 0;
+	volatile BOOL dl_abort = FALSE;
+	uint64_t size = 0, total_size = 0, seg_size;
+	int i;
 
 	// Can't link with wininet.lib because of sideloading issues
 	PF_TYPE_DECL(WINAPI, BOOL, InternetCrackUrlA, (LPCSTR, DWORD, DWORD, LPURL_COMPONENTSA));
@@ -367,6 +808,12 @@ uint64_t DownloadToFileOrBuffer(const char* url, const char* file, BYTE** buffer
 		uprintf("Downloading %s", url);
 	}
 
+	// If a journal entry for this URL exists, a previous download attempt was
+	// interrupted => resume it with a ranged request if we have a usable
+	// partial file and checksum state, and don't segment the transfer
+	if (file != NULL)
+		resume_offset = GetDownloadJournal(url, file, &journal_match);
+
 	if ( (!pfInternetCrackUrlA(url, (DWORD)safe_strlen(url), 0, &UrlParts))
 	  || (UrlParts.lpszHostName == NULL) || (UrlParts.lpszUrlPath == NULL)) {
 		uprintf("Unable to decode URL: %s", WinInetErrorString());
@@ -395,7 +842,11 @@ uint64_t DownloadToFileOrBuffer(const char* url, const char* file, BYTE** buffer
 		goto out;
 	}
 
-	if (!pfHttpSendRequestA(hRequest, request_headers, -1L, NULL, 0)) {
+	// On resume, ask for the remainder of the file only. No compressed transfer
+	// encoding in that case, as it would not preserve the range.
+	if (resume_offset != 0)
+		static_sprintf(range_hdr, "Accept-Encoding: identity\r\nRange: bytes=%llu-", resume_offset);
+	if (!pfHttpSendRequestA(hRequest, (resume_offset != 0) ? range_hdr : request_headers, -1L, NULL, 0)) {
 		uprintf("Unable to send request: %s", WinInetErrorString());
 		goto out;
 	}
@@ -403,18 +854,29 @@ uint64_t DownloadToFileOrBuffer(const char* url, const char* file, BYTE** buffer
 	// Get the file size
 	dwSize = sizeof(DownloadStatus);
 	pfHttpQueryInfoA(hRequest, HTTP_QUERY_STATUS_CODE|HTTP_QUERY_FLAG_NUMBER, (LPVOID)&DownloadStatus, &dwSize, NULL);
-	if (DownloadStatus != 200) {
+	if ((DownloadStatus != 200) && !((DownloadStatus == 206) && (resume_offset != 0))) {
 		error_code = ERROR_INTERNET_ITEM_NOT_FOUND;
 		SetLastError(ERROR_SEVERITY_ERROR | FAC(FACILITY_HTTP) | error_code);
 		uprintf("Unable to access file: %d", DownloadStatus);
 		goto out;
 	}
+	if ((resume_offset != 0) && (DownloadStatus != 206)) {
+		// Server ignored the range => restart the transfer from zero
+		uprintf("Server did not honor ranged request - restarting download");
+		HashStreamFinal(NULL);
+		resume_offset = 0;
+	}
 	dwSize = sizeof(strsize);
 	if (!pfHttpQueryInfoA(hRequest, HTTP_QUERY_CONTENT_LENGTH, (LPVOID)strsize, &dwSize, NULL)) {
 		uprintf("Unable to retrieve file length: %s", WinInetErrorString());
 		goto out;
 	}
 	total_size = (uint64_t)atoll(strsize);
+	// A 206 content length only covers the remainder of the file
+	if (resume_offset != 0) {
+		total_size += resume_offset;
+		uprintf("Resuming download at %s", SizeToHumanReadable(resume_offset, FALSE, FALSE));
+	}
 	if (hProgressDialog != NULL) {
 		char msg[128];
 		uprintf("File length: %s", SizeToHumanReadable(total_size, FALSE, FALSE));
@@ -425,12 +887,40 @@ uint64_t DownloadToFileOrBuffer(const char* url, const char* file, BYTE** buffer
 		PrintStatus(5000, MSG_085, msg);
 	}
 
+	// See if the server honors ranged requests, in which case a large file
+	// can be downloaded over multiple parallel connections. Not when the
+	// journal points at this URL though: a previous attempt was interrupted,
+	// and only a single sequential stream can be journaled and resumed.
+	if ((file != NULL) && (total_size >= DOWNLOAD_SEGMENT_THRESHOLD) && !journal_match) {
+		static_strcpy(accept_ranges, "Accept-Ranges");
+		dwSize = sizeof(accept_ranges);
+		if (pfHttpQueryInfoA(hRequest, HTTP_QUERY_CUSTOM, (LPVOID)accept_ranges, &dwSize, NULL) &&
+			(strcmp(accept_ranges, "bytes") == 0))
+			segmented = TRUE;
+	}
+
 	if (file != NULL) {
-		hFile = CreateFileU(file, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+		// Preallocating the full file upfront lets the download segments land
+		// directly at their final position, and avoids fragmentation either way.
+		// On resume, the existing partial file is reopened and appended to.
+		hFile = CreatePreallocatedFile(file, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE,
+			NULL, (resume_offset != 0) ? OPEN_ALWAYS : CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, (LONGLONG)total_size);
 		if (hFile == INVALID_HANDLE_VALUE) {
 			uprintf("Unable to create file '%s': %s", short_name, WinInetErrorString());
 			goto out;
 		}
+		if (resume_offset != 0) {
+			li.QuadPart = (LONGLONG)resume_offset;
+			if (!SetFilePointerEx(hFile, li, NULL, FILE_BEGIN)) {
+				uprintf("Unable to set resume position in '%s': %s", short_name, WinInetErrorString());
+				goto out;
+			}
+		}
+		// Hash the transfer inline, so that the digest of the download is
+		// available without re-reading the file, even across resumed attempts
+		// (for which the journaled checksum state was restored above)
+		if (!segmented)
+			hash_ok = (resume_offset != 0) || HashStreamInit(CHECKSUM_SHA256);
 	} else {
 		if (buffer == NULL) {
 			uprintf("No buffer pointer provided for download");
@@ -444,36 +934,96 @@ uint64_t DownloadToFileOrBuffer(const char* url, const char* file, BYTE** buffer
 		}
 	}
 
-	// Keep checking for data until there is nothing left.
-	while (1) {
-		// User may have cancelled the download
+	if (segmented) {
+		// The initial request would keep feeding us the whole body => drop it
+		pfInternetCloseHandle(hRequest);
+		hRequest = NULL;
+		uprintf("Downloading with %d parallel segments", DOWNLOAD_NUM_SEGMENTS);
+		seg_size = total_size / DOWNLOAD_NUM_SEGMENTS;
+		for (i = 0; i < DOWNLOAD_NUM_SEGMENTS; i++) {
+			segment[i].file = file;
+			segment[i].short_name = short_name;
+			segment[i].hSession = hSession;
+			segment[i].url_parts = &UrlParts;
+			segment[i].start = i * seg_size;
+			segment[i].end = (i == DOWNLOAD_NUM_SEGMENTS - 1) ? total_size - 1 : (i + 1) * seg_size - 1;
+			segment[i].dl_size = &dl_size;
+			segment[i].abort = &dl_abort;
+			segment_thread[i] = CreateThread(NULL, 0, DownloadSegmentThread, &segment[i], 0, NULL);
+			if (segment_thread[i] == NULL) {
+				uprintf("Unable to start download thread");
+				dl_abort = TRUE;
+				break;
+			}
+		}
+		if (i == DOWNLOAD_NUM_SEGMENTS) {
+			while (WaitForMultipleObjects(DOWNLOAD_NUM_SEGMENTS, segment_thread, TRUE, 100) == WAIT_TIMEOUT) {
+				// User may have cancelled the download
+				if (IS_ERROR(FormatStatus))
+					dl_abort = TRUE;
+				if (hProgressDialog != NULL)
+					UpdateProgressWithInfo(OP_NOOP, MSG_241, (uint64_t)dl_size, total_size);
+			}
+		} else {
+			for (i = 0; (i < DOWNLOAD_NUM_SEGMENTS) && (segment_thread[i] != NULL); i++)
+				WaitForSingleObject(segment_thread[i], INFINITE);
+		}
+		for (i = 0; i < DOWNLOAD_NUM_SEGMENTS; i++)
+			safe_closehandle(segment_thread[i]);
 		if (IS_ERROR(FormatStatus))
 			goto out;
-		if (!pfInternetReadFile(hRequest, buf, sizeof(buf), &dwDownloaded) || (dwDownloaded == 0))
-			break;
-		if (hProgressDialog != NULL)
-			UpdateProgressWithInfo(OP_NOOP, MSG_241, size, total_size);
-		if (file != NULL) {
-			if (!WriteFile(hFile, buf, dwDownloaded, &dwWritten, NULL)) {
-				uprintf("Error writing file '%s': %s", short_name, WinInetErrorString());
-				goto out;
-			} else if (dwDownloaded != dwWritten) {
-				uprintf("Error writing file '%s': Only %d/%d bytes written", short_name, dwWritten, dwDownloaded);
+		for (i = 0; i < DOWNLOAD_NUM_SEGMENTS; i++) {
+			if (segment[i].success)
+				size += segment[i].end - segment[i].start + 1;
+		}
+	} else {
+		// Keep checking for data until there is nothing left.
+		while (1) {
+			// User may have cancelled the download
+			if (IS_ERROR(FormatStatus))
 				goto out;
+			if (!pfInternetReadFile(hRequest, buf, sizeof(buf), &dwDownloaded) || (dwDownloaded == 0))
+				break;
+			if (hProgressDialog != NULL)
+				UpdateProgressWithInfo(OP_NOOP, MSG_241, resume_offset + size, total_size);
+			if (file != NULL) {
+				if (!WriteFile(hFile, buf, dwDownloaded, &dwWritten, NULL)) {
+					uprintf("Error writing file '%s': %s", short_name, WinInetErrorString());
+					goto out;
+				} else if (dwDownloaded != dwWritten) {
+					uprintf("Error writing file '%s': Only %d/%d bytes written", short_name, dwWritten, dwDownloaded);
+					goto out;
+				}
+				if (hash_ok) {
+					HashStreamWrite(buf, dwDownloaded);
+					// Periodically persist the journal, so that even a hard
+					// kill only costs us the last interval
+					if (((resume_offset + size) / DOWNLOAD_JOURNAL_INTERVAL) !=
+						((resume_offset + size + dwDownloaded) / DOWNLOAD_JOURNAL_INTERVAL))
+						UpdateDownloadJournal(url, resume_offset + size + dwDownloaded);
+				}
+			} else {
+				memcpy(&(*buffer)[size], buf, dwDownloaded);
 			}
-		} else {
-			memcpy(&(*buffer)[size], buf, dwDownloaded);
+			size += dwDownloaded;
 		}
-		size += dwDownloaded;
 	}
 
-	if (size != total_size) {
+	if (resume_offset + size != total_size) {
 		uprintf("Could not download complete file - read: %lld bytes, expected: %lld bytes", size, total_size);
 		FormatStatus = ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|ERROR_WRITE_FAULT;
 		goto out;
 	} else {
 		DownloadStatus = 200;
 		r = TRUE;
+		if (hash_ok && HashStreamFinal(sum)) {
+			for (i = 0; i < ARRAYSIZE(sum); i++)
+				sprintf(&sum_str[2 * i], "%02x", sum[i]);
+			uprintf("SHA256 of download: %s", sum_str);
+			hash_ok = FALSE;
+		}
+		if (journal_match || (resume_offset != 0))
+			ClearDownloadJournal();
 		if (hProgressDialog != NULL) {
 			UpdateProgressWithInfo(OP_NOOP, MSG_241, total_size, total_size);
 			uprintf("Successfully downloaded '%s'", short_name);
@@ -488,8 +1038,22 @@ out:
 		CloseHandle(hFile);
 	}
 	if (!r) {
-		if (file != NULL)
+		if (hash_ok && (resume_offset + size != 0)) {
+			// Keep the partial download, and journal its extent along with the
+			// live checksum state, so the next attempt resumes where this one
+			// stopped instead of restarting from zero
+			UpdateDownloadJournal(url, resume_offset + size);
+			HashStreamFinal(NULL);
+			uprintf("Download interrupted at %s - will resume on next attempt",
+				SizeToHumanReadable(resume_offset + size, FALSE, FALSE));
+		} else if (file != NULL) {
+			if (segmented && (total_size >= DOWNLOAD_SEGMENT_THRESHOLD)) {
+				// A failed segmented download leaves no resumable partial, but
+				// mark the URL so the next attempt uses a single, resumable stream
+				UpdateDownloadJournal(url, 0);
+			}
 			DeleteFileU(file);
+		}
 		if (buffer != NULL)
 			safe_free(*buffer);
 	}
@@ -497,11 +1061,10 @@ out:
 		pfInternetCloseHandle(hRequest);
 	if (hConnection)
 		pfInternetCloseHandle(hConnection);
-	if (hSession)
-		pfInternetCloseHandle(hSession);
+	// The shared session is kept open for reuse
 
 	SetLastError(error_code);
-	return r ? size : 0;
+	return r ? (resume_offset + size) : 0;
 }
 
 // Download and validate a signed file. The file must have a corresponding '.sig' on the server.
@@ -605,6 +1168,46 @@ static __inline uint64_t to_uint64_t(uint16_t x[4]) {
 /*
  * Background thread to check for updates
  */
+typedef struct {
+	HINTERNET hConnection;
+	INTERNET_SCHEME scheme;
+	char urlpath[128];
+	HINTERNET hRequest;
+	DWORD status;
+} update_probe_t;
+
+// Probe one candidate version file on the update server. On a 200, the open
+// request is left for the caller to read the file from.
+static DWORD WINAPI UpdateProbeThread(LPVOID param)
+{
+	update_probe_t* probe = (update_probe_t*)param;
+	const char* accept_types[] = { "*/*\0", NULL };
+	DWORD dwSize = sizeof(probe->status);
+
+	PF_TYPE_DECL(WINAPI, HINTERNET, HttpOpenRequestA, (HINTERNET, LPCSTR, LPCSTR, LPCSTR, LPCSTR, LPCSTR*, DWORD, DWORD_PTR));
+	PF_TYPE_DECL(WINAPI, BOOL, HttpSendRequestA, (HINTERNET, LPCSTR, DWORD, LPVOID, DWORD));
+	PF_TYPE_DECL(WINAPI, BOOL, HttpQueryInfoA, (HINTERNET, DWORD, LPVOID, LPDWORD, LPDWORD));
+	PF_INIT_OR_OUT(HttpOpenRequestA, WinInet);
+	PF_INIT_OR_OUT(HttpSendRequestA, WinInet);
+	PF_INIT_OR_OUT(HttpQueryInfoA, WinInet);
+
+	probe->status = 404;
+	probe->hRequest = pfHttpOpenRequestA(probe->hConnection, "GET", probe->urlpath, NULL, NULL, accept_types,
+		INTERNET_FLAG_IGNORE_REDIRECT_TO_HTTP|INTERNET_FLAG_IGNORE_REDIRECT_TO_HTTPS|
+		INTERNET_FLAG_NO_COOKIES|INTERNET_FLAG_NO_UI|INTERNET_FLAG_NO_CACHE_WRITE|INTERNET_FLAG_HYPERLINK|
+		((probe->scheme == INTERNET_SCHEME_HTTPS)?INTERNET_FLAG_SECURE:0), (DWORD_PTR)NULL);
+	if (probe->hRequest == NULL)
+		goto out;
+	if (!pfHttpSendRequestA(probe->hRequest, request_headers, -1L, NULL, 0)) {
+		uprintf("Unable to send request: %s", WinInetErrorString());
+		goto out;
+	}
+	pfHttpQueryInfoA(probe->hRequest, HTTP_QUERY_STATUS_CODE|HTTP_QUERY_FLAG_NUMBER, (LPVOID)&probe->status, &dwSize, NULL);
+
+out:
+	return (probe->status == 200) ? 0 : 1;
+}
+
 static DWORD WINAPI CheckForUpdatesThread(LPVOID param)
 {
 	BOOL releases_only = TRUE, found_new_version = FALSE;
@@ -613,7 +1216,6 @@ static DWORD WINAPI CheckForUpdatesThread(LPVOID param)
 	int i, j, k, max_channel, verbose = 0, verpos[4];
 	static const char* archname[] = {"win_x86", "win_x64", "win_arm", "win_arm64", "win_none"};
 	static const char* channel[] = {"release", "beta", "test"};		// release channel
-	const char* accept_types[] = {"*/*\0", NULL};
 	char* buf = NULL;
 	char agent[64], hostname[64], urlpath[128], sigpath[256];
 	DWORD dwSize, dwDownloaded, dwTotalSize, dwStatus;
@@ -625,6 +1227,8 @@ static DWORD WINAPI CheckForUpdatesThread(LPVOID param)
 	SYSTEMTIME ServerTime, LocalTime;
 	FILETIME FileTime;
 	int64_t local_time = 0, reg_time, server_time, update_interval;
+	update_probe_t probe[ARRAYSIZE(verpos)];
+	HANDLE probe_thread[ARRAYSIZE(verpos)] = { NULL };
 
 	// Can't link with wininet.lib because of sideloading issues
 	PF_TYPE_DECL(WINAPI, BOOL, InternetCrackUrlA, (LPCSTR, DWORD, DWORD, LPURL_COMPONENTSA));
@@ -673,6 +1277,14 @@ static DWORD WINAPI CheckForUpdatesThread(LPVOID param)
 				vuprintf("Next update check in %" PRId64 " seconds.", reg_time + update_interval - local_time);
 				goto out;
 			}
+			// Cached negative result: if the server had no version file for us
+			// recently, don't hit it again at every launch until the TTL expires
+			reg_time = ReadSetting64(SETTING_LAST_UPDATE_NEG);
+			if ((reg_time != 0) && (local_time < reg_time + UPDATE_NEG_CACHE_TTL)) {
+				vuprintf("No version file was found on the last check - next probe in %" PRId64 " seconds.",
+					reg_time + UPDATE_NEG_CACHE_TTL - local_time);
+				goto out;
+			}
 		}
 	}
 
@@ -711,9 +1323,13 @@ static DWORD WINAPI CheckForUpdatesThread(LPVOID param)
 #endif
 	vuprintf("Using %s for the update check", RUFUS_URL);
 	for (k=0; (k<max_channel) && (!found_new_version); k++) {
-		// Free any previous buffers we might have used
+		// Free any previous buffers and request we might have used
 		safe_free(buf);
 		safe_free(sig);
+		if (hRequest != NULL) {
+			pfInternetCloseHandle(hRequest);
+			hRequest = NULL;
+		}
 		uprintf("Checking %s channel...", channel[k]);
 		// At this stage we can query the server for various update version files.
 		// We first try to lookup for "<appname>_<os_arch>_<os_version_major>_<os_version_minor>.ver"
@@ -730,33 +1346,50 @@ static DWORD WINAPI CheckForUpdatesThread(LPVOID param)
 		}
 		assert(i == ARRAYSIZE(verpos));
 
-		UrlParts.lpszUrlPath = urlpath;
-		UrlParts.dwUrlPathLength = sizeof(urlpath);
+		// Issue all the candidate probes concurrently and keep the most specific
+		// of the successful ones, so that a slow link or proxy costs us a single
+		// round-trip rather than one per candidate.
 		for (i=0; i<ARRAYSIZE(verpos); i++) {
-			vvuprintf("Trying %s", UrlParts.lpszUrlPath);
-			hRequest = pfHttpOpenRequestA(hConnection, "GET", UrlParts.lpszUrlPath, NULL, NULL, accept_types,
-				INTERNET_FLAG_IGNORE_REDIRECT_TO_HTTP|INTERNET_FLAG_IGNORE_REDIRECT_TO_HTTPS|
-				INTERNET_FLAG_NO_COOKIES|INTERNET_FLAG_NO_UI|INTERNET_FLAG_NO_CACHE_WRITE|INTERNET_FLAG_HYPERLINK|
-				((UrlParts.nScheme == INTERNET_SCHEME_HTTPS)?INTERNET_FLAG_SECURE:0), (DWORD_PTR)NULL);
-			if ((hRequest == NULL) || (!pfHttpSendRequestA(hRequest, request_headers, -1L, NULL, 0))) {
-				uprintf("Unable to send request: %s", WinInetErrorString());
-				goto out;
+			memset(&probe[i], 0, sizeof(probe[i]));
+			probe[i].hConnection = hConnection;
+			probe[i].scheme = UrlParts.nScheme;
+			static_strcpy(probe[i].urlpath, urlpath);
+			if (i > 0)
+				safe_strcpy(&probe[i].urlpath[verpos[i-1]], 5, ".ver");
+			vvuprintf("Trying %s", probe[i].urlpath);
+			probe_thread[i] = CreateThread(NULL, 0, UpdateProbeThread, &probe[i], 0, NULL);
+			if (probe_thread[i] == NULL)
+				IGNORE_RETVAL(UpdateProbeThread(&probe[i]));
+		}
+		for (i=0; i<ARRAYSIZE(verpos); i++) {
+			if (probe_thread[i] != NULL) {
+				WaitForSingleObject(probe_thread[i], INFINITE);
+				CloseHandle(probe_thread[i]);
+				probe_thread[i] = NULL;
+			}
+		}
+		dwStatus = 404;
+		for (i=0; i<ARRAYSIZE(verpos); i++) {
+			if ((dwStatus != 200) && (probe[i].status == 200)) {
+				// First success wins - the remaining requests are discarded
+				dwStatus = 200;
+				hRequest = probe[i].hRequest;
+				static_strcpy(urlpath, probe[i].urlpath);
+			} else if (probe[i].hRequest != NULL) {
+				pfInternetCloseHandle(probe[i].hRequest);
 			}
-
-			// Ensure that we get a text file
-			dwSize = sizeof(dwStatus);
-			dwStatus = 404;
-			pfHttpQueryInfoA(hRequest, HTTP_QUERY_STATUS_CODE|HTTP_QUERY_FLAG_NUMBER, (LPVOID)&dwStatus, &dwSize, NULL);
-			if (dwStatus == 200)
-				break;
-			pfInternetCloseHandle(hRequest);
-			hRequest = NULL;
-			safe_strcpy(&urlpath[verpos[i]], 5, ".ver");
 		}
 		if (dwStatus != 200) {
 			vuprintf("Could not find a %s version file on server %s", channel[k], server_url);
-			if ((releases_only) || (k+1 >= ARRAYSIZE(channel)))
+			if ((releases_only) || (k+1 >= ARRAYSIZE(channel))) {
+				// Cache the negative result, so the probes are not repeated at
+				// every launch until the TTL expires
+				GetSystemTime(&LocalTime);
+				if (SystemTimeToFileTime(&LocalTime, &FileTime))
+					WriteSetting64(SETTING_LAST_UPDATE_NEG,
+						((((int64_t)FileTime.dwHighDateTime)<<32) + FileTime.dwLowDateTime) / 10000000);
 				goto out;
+			}
 			continue;
 		}
 		vuprintf("Found match for %s on server %s", urlpath, server_url);
@@ -773,6 +1406,9 @@ static DWORD WINAPI CheckForUpdatesThread(LPVOID param)
 		vvuprintf("Server time: %" PRId64, server_time);
 		// Always store the server response time - the only clock we trust!
 		WriteSetting64(SETTING_LAST_UPDATE, server_time);
+		// And drop any cached negative result, since the server has a version file now
+		if (ReadSetting64(SETTING_LAST_UPDATE_NEG) != 0)
+			WriteSetting64(SETTING_LAST_UPDATE_NEG, 0);
 		// Might as well let the user know
 		if (!force_update_check) {
 			if ((local_time > server_time + 600) || (local_time < server_time - 600)) {
@@ -824,8 +1460,7 @@ out:
 		pfInternetCloseHandle(hRequest);
 	if (hConnection)
 		pfInternetCloseHandle(hConnection);
-	if (hSession)
-		pfInternetCloseHandle(hSession);
+	// The shared session is kept open for reuse
 	switch (status) {
 	case 1:
 		PrintInfoDebug(3000, MSG_244);
@@ -929,7 +1564,7 @@ static DWORD WINAPI DownloadISOThread(LPVOID param)
 		free(sig);
 		uprintf("Download signature is valid ✓");
 		uncompressed_size = *((uint64_t*)&compressed[5]);
-		if ((uncompressed_size < 1 * MB) && (bled_init(_uprintf, NULL, NULL, NULL, NULL, &FormatStatus) >= 0)) {
+		if ((uncompressed_size < 1 * MB) && (bled_init(0, _uprintf, NULL, NULL, NULL, NULL, &FormatStatus) >= 0)) {
 			fido_script = malloc((size_t)uncompressed_size);
 			size = bled_uncompress_from_buffer_to_buffer(compressed, dwCompressedSize, fido_script, (size_t)uncompressed_size, BLED_COMPRESSION_LZMA);
 			bled_exit();
@@ -1016,6 +1651,15 @@ static DWORD WINAPI DownloadISOThread(LPVOID param)
 #if defined(_MSC_VER)
 #pragma warning(default: 6386)
 #endif
+			// With the streaming option enabled, skip saving the ISO to disk:
+			// hand the URL over as the selected image, and it will be streamed
+			// from the network to the drive, in DD mode, at write time.
+			if (ReadSettingBool(SETTING_STREAMING_DOWNLOAD)) {
+				safe_free(image_path);
+				image_path = safe_strdup(url);
+				PostMessage(hMainDialog, UM_SELECT_ISO, 0, 0);
+				goto out;
+			}
 			EXT_DECL(img_ext, GetShortName(url), __VA_GROUP__("*.iso"), __VA_GROUP__(lmprintf(MSG_036)));
 			img_save.Type = IMG_SAVE_TYPE_ISO;
 			img_save.ImagePath = FileDialog(TRUE, NULL, &img_ext, 0);
@@ -1137,8 +1781,75 @@ out:
 		pfInternetCloseHandle(hRequest);
 	if (hConnection)
 		pfInternetCloseHandle(hConnection);
-	if (hSession)
-		pfInternetCloseHandle(hSession);
+	// The shared session is kept open for reuse
 
 	return (dwTotalSize > 0);
 }
+
+// Create the shared Internet session and pre-connect to the update server, so
+// that the first interactive download doesn't pay DNS resolution and the
+// TCP + TLS handshakes inline. WinINet keeps the warmed-up connection in the
+// session's keep-alive pool.
+static DWORD WINAPI SessionWarmupThread(LPVOID param)
+{
+	const char* server_url = RUFUS_URL "/";
+	const char* accept_types[] = { "*/*\0", NULL };
+	char hostname[64], urlpath[128];
+	HINTERNET hSession = NULL, hConnection = NULL, hRequest = NULL;
+	URL_COMPONENTSA UrlParts = { sizeof(URL_COMPONENTSA), NULL, 1, (INTERNET_SCHEME)0,
+		hostname, sizeof(hostname), 0, NULL, 1, urlpath, sizeof(urlpath), NULL, 1 };
+
+	PF_TYPE_DECL(WINAPI, BOOL, InternetCrackUrlA, (LPCSTR, DWORD, DWORD, LPURL_COMPONENTSA));
+	PF_TYPE_DECL(WINAPI, HINTERNET, InternetConnectA, (HINTERNET, LPCSTR, INTERNET_PORT, LPCSTR, LPCSTR, DWORD, DWORD, DWORD_PTR));
+	PF_TYPE_DECL(WINAPI, BOOL, InternetCloseHandle, (HINTERNET));
+	PF_TYPE_DECL(WINAPI, HINTERNET, HttpOpenRequestA, (HINTERNET, LPCSTR, LPCSTR, LPCSTR, LPCSTR, LPCSTR*, DWORD, DWORD_PTR));
+	PF_TYPE_DECL(WINAPI, BOOL, HttpSendRequestA, (HINTERNET, LPCSTR, DWORD, LPVOID, DWORD));
+	PF_INIT_OR_OUT(InternetCrackUrlA, WinInet);
+	PF_INIT_OR_OUT(InternetConnectA, WinInet);
+	PF_INIT_OR_OUT(InternetCloseHandle, WinInet);
+	PF_INIT_OR_OUT(HttpOpenRequestA, WinInet);
+	PF_INIT_OR_OUT(HttpSendRequestA, WinInet);
+
+	// GetInternetSession() uses the NetworkListManager COM instance
+	IGNORE_RETVAL(CoInitializeEx(NULL, COINIT_APARTMENTTHREADED | COINIT_DISABLE_OLE1DDE));
+
+	if ((!pfInternetCrackUrlA(server_url, (DWORD)safe_strlen(server_url), 0, &UrlParts))
+		|| (UrlParts.lpszHostName == NULL))
+		goto out;
+	hostname[sizeof(hostname) - 1] = 0;
+
+	hSession = GetInternetSession(FALSE);
+	if (hSession == NULL)
+		goto out;
+	hConnection = pfInternetConnectA(hSession, UrlParts.lpszHostName, UrlParts.nPort, NULL, NULL, INTERNET_SERVICE_HTTP, 0, (DWORD_PTR)NULL);
+	if (hConnection == NULL)
+		goto out;
+
+	// A HEAD of the server root is enough to force the connection setup
+	hRequest = pfHttpOpenRequestA(hConnection, "HEAD", "/", NULL, NULL, accept_types,
+		INTERNET_FLAG_IGNORE_REDIRECT_TO_HTTP | INTERNET_FLAG_IGNORE_REDIRECT_TO_HTTPS |
+		INTERNET_FLAG_NO_COOKIES | INTERNET_FLAG_NO_UI | INTERNET_FLAG_NO_CACHE_WRITE | INTERNET_FLAG_HYPERLINK |
+		((UrlParts.nScheme == INTERNET_SCHEME_HTTPS) ? INTERNET_FLAG_SECURE : 0), (DWORD_PTR)NULL);
+	if (hRequest == NULL)
+		goto out;
+	if (pfHttpSendRequestA(hRequest, NULL, 0, NULL, 0))
+		uprintf("Warmed up Internet session to %s", UrlParts.lpszHostName);
+
+out:
+	if (hRequest)
+		pfInternetCloseHandle(hRequest);
+	if (hConnection)
+		pfInternetCloseHandle(hConnection);
+	CoUninitialize();
+	return 0;
+}
+
+void WarmupInternetSession(void)
+{
+	HANDLE warmup_thread = CreateThread(NULL, 0, SessionWarmupThread, NULL, 0, NULL);
+
+	if (warmup_thread == NULL)
+		uprintf("Unable to start session warmup thread");
+	else
+		CloseHandle(warmup_thread);
+}
@@ -62,7 +62,7 @@ static loc_cmd* get_loc_cmd(char c, char* line) {
 		return NULL;
 	}
 
-	lcmd = (loc_cmd*)calloc(sizeof(loc_cmd), 1);
+	lcmd = alloc_loc_cmd();
 	if (lcmd == NULL) {
 		luprint("could not allocate command");
 		return NULL;
@@ -197,21 +197,118 @@ static void get_loc_data_line(char* line)
 }
 
 /*
- * Open a localization file and store its file name, with special case
- * when dealing with the embedded loc file.
+ * Localization data source, which can either be file-backed (external
+ * rufus.loc) or memory-backed (the embedded.loc resource, parsed straight
+ * from the resource section without a temp file extraction).
  */
-FILE* open_loc_file(const char* filename)
+typedef struct {
+	FILE* fd;			// File-backed source, or NULL when memory-backed
+	const char* buf;	// Memory-backed source
+	long size;
+	long pos;
+} locfile_t;
+
+// The embedded.loc resource data, set with set_loc_buffer()
+static const char* loc_buffer = NULL;
+static long loc_buffer_size = 0;
+
+/*
+ * Register the embedded loc resource data, so that the parser can consume it
+ * directly from memory. The buffer must remain valid for the app's lifetime
+ * (which is the case for resource data returned by GetResource()).
+ */
+void set_loc_buffer(const char* data, long size)
 {
-	FILE* fd = NULL;
+	loc_buffer = data;
+	loc_buffer_size = size;
+}
+
+static int loc_getc(locfile_t* f)
+{
+	if (f->fd != NULL)
+		return getc(f->fd);
+	return (f->pos < f->size) ? (int)(uint8_t)f->buf[f->pos++] : EOF;
+}
+
+static char* loc_gets(char* s, int n, locfile_t* f)
+{
+	int i = 0, c;
+
+	if (f->fd != NULL)
+		return fgets(s, n, f->fd);
+	if (f->pos >= f->size)
+		return NULL;
+	while ((i < n - 1) && ((c = loc_getc(f)) != EOF)) {
+		s[i++] = (char)c;
+		if (c == '\n')
+			break;
+	}
+	s[i] = 0;
+	return (i == 0) ? NULL : s;
+}
+
+static long loc_tell(locfile_t* f)
+{
+	return (f->fd != NULL) ? ftell(f->fd) : f->pos;
+}
+
+static int loc_seek(locfile_t* f, long offset)
+{
+	if (f->fd != NULL)
+		return fseek(f->fd, offset, SEEK_SET);
+	if ((offset < 0) || (offset > f->size))
+		return -1;
+	f->pos = offset;
+	return 0;
+}
+
+static size_t loc_read(void* ptr, size_t size, locfile_t* f)
+{
+	if (f->fd != NULL)
+		return fread(ptr, 1, size, f->fd);
+	if (f->pos + (long)size > f->size)
+		size = (size_t)(f->size - f->pos);
+	memcpy(ptr, &f->buf[f->pos], size);
+	f->pos += (long)size;
+	return size;
+}
+
+static void loc_close(locfile_t* f)
+{
+	if (f == NULL)
+		return;
+	if (f->fd != NULL)
+		fclose(f->fd);
+	free(f);
+}
+
+/*
+ * Open a localization source and store its file name, with special case
+ * when dealing with the embedded loc data.
+ */
+static locfile_t* open_loc_file(const char* filename)
+{
+	locfile_t* f = NULL;
 	wchar_t *wfilename = NULL;
 	const char* tmp_ext = ".tmp";
 
 	if (filename == NULL)
 		return NULL;
 
+	f = (locfile_t*)calloc(1, sizeof(locfile_t));
+	if (f == NULL)
+		return NULL;
+
 	if (loc_filename != embedded_loc_filename) {
 		safe_free(loc_filename);
 	}
+	if ((loc_buffer != NULL) && (safe_strcmp(filename, embedded_loc_filename) == 0)) {
+		// Embedded loc data - parse it straight from the resource section
+		loc_filename = embedded_loc_filename;
+		f->buf = loc_buffer;
+		f->size = loc_buffer_size;
+		return f;
+	}
 	if (safe_strcmp(tmp_ext, &filename[safe_strlen(filename)-4]) == 0) {
 		loc_filename = embedded_loc_filename;
 	} else {
@@ -222,14 +319,18 @@ FILE* open_loc_file(const char* filename)
 		uprintf(conversion_error, filename);
 		goto out;
 	}
-	fd = _wfopen(wfilename, L"rb");
-	if (fd == NULL) {
+	f->fd = _wfopen(wfilename, L"rb");
+	if (f->fd == NULL) {
 		uprintf("localization: could not open '%s'\n", filename);
 	}
 
 out:
 	safe_free(wfilename);
-	return fd;
+	if ((f != NULL) && (f->fd == NULL)) {
+		free(f);
+		f = NULL;
+	}
+	return f;
 }
 
 /*
@@ -238,7 +339,7 @@ out:
  */
 BOOL get_supported_locales(const char* filename)
 {
-	FILE* fd = NULL;
+	locfile_t* fd = NULL;
 	BOOL r = FALSE;
 	char line[1024];
 	size_t i, j, k;
@@ -252,7 +353,7 @@ BOOL get_supported_locales(const char* filename)
 		goto out;
 
 	// Check that the file doesn't contain a BOM and was saved in DOS mode
-	i = fread(line, 1, sizeof(line), fd);
+	i = loc_read(line, sizeof(line), fd);
 	if (i < sizeof(line)) {
 		uprintf("Invalid loc file: the file is too small!");
 		goto out;
@@ -267,15 +368,15 @@ BOOL get_supported_locales(const char* filename)
 		uprintf("Invalid loc file: the file MUST be saved in DOS mode (CR/LF)");
 		goto out;
 	}
-	fseek(fd, 0, SEEK_SET);
+	loc_seek(fd, 0);
 
 	loc_line_nr = 0;
 	line[0] = 0;
 	free_locale_list();
 	do {
 		// adjust the last block
-		end_of_block = ftell(fd);
-		if (fgets(line, sizeof(line), fd) == NULL)
+		end_of_block = loc_tell(fd);
+		if (loc_gets(line, sizeof(line), fd) == NULL)
 			break;
 		loc_line_nr++;
 		// Skip leading spaces
@@ -301,7 +402,7 @@ BOOL get_supported_locales(const char* filename)
 					last_lcmd->num[1] = (int32_t)end_of_block;
 				}
 			}
-			lcmd->num[0] = (int32_t)ftell(fd);
+			lcmd->num[0] = (int32_t)loc_tell(fd);
 			// Add our locale command to the locale list
 			list_add_tail(&lcmd->list, &locale_list);
 			uprintf("localization: found locale '%s'\n", lcmd->txt[0]);
@@ -357,7 +458,7 @@ BOOL get_supported_locales(const char* filename)
 			list_del(&last_lcmd->list);
 			free_loc_cmd(last_lcmd);
 		} else {
-			last_lcmd->num[1] = (int32_t)ftell(fd);
+			last_lcmd->num[1] = (int32_t)loc_tell(fd);
 		}
 	}
 	r = !list_empty(&locale_list);
@@ -365,8 +466,7 @@ BOOL get_supported_locales(const char* filename)
 		uprintf("localization: '%s' contains no valid locale sections\n", filename);
 
 out:
-	if (fd != NULL)
-		fclose(fd);
+	loc_close(fd);
 	return r;
 }
 
@@ -377,7 +477,7 @@ out:
 BOOL get_loc_data_file(const char* filename, loc_cmd* lcmd)
 {
 	size_t bufsize = 1024;
-	static FILE* fd = NULL;
+	static locfile_t* fd = NULL;
 	static BOOL populate_default = FALSE;
 	char *buf = NULL;
 	size_t i = 0;
@@ -406,7 +506,7 @@ BOOL get_loc_data_file(const char* filename, loc_cmd* lcmd)
 	if (reentrant) {
 		// Called, from a 'b' command - no need to reopen the file,
 		// just save the current offset and current line number
-		cur_offset = ftell(fd);
+		cur_offset = loc_tell(fd);
 		old_loc_line_nr = loc_line_nr;
 	} else {
 		if ((filename == NULL) || (filename[0] == 0))
@@ -435,13 +535,13 @@ BOOL get_loc_data_file(const char* filename, loc_cmd* lcmd)
 		goto out;
 	}
 
-	if (fseek(fd, offset, SEEK_SET) != 0) {
+	if (loc_seek(fd, offset) != 0) {
 		uprintf("localization: could not rewind\n");
 		goto out;
 	}
 
 	do {	// custom readline handling for string collation, realloc, line numbers, etc.
-		c = getc(fd);
+		c = loc_getc(fd);
 		switch(c) {
 		case EOF:
 			buf[i] = 0;
@@ -527,7 +627,7 @@ BOOL get_loc_data_file(const char* filename, loc_cmd* lcmd)
 			}
 			break;
 		}
-		if ((c == EOF) || (ftell(fd) > end_offset))
+		if ((c == EOF) || (loc_tell(fd) > end_offset))
 			break;
 		// Have at least 2 chars extra, for \r\n sequences
 		if (i >= bufsize-2) {
@@ -548,13 +648,13 @@ BOOL get_loc_data_file(const char* filename, loc_cmd* lcmd)
 out:
 	// Don't close on a reentrant call
 	if (reentrant) {
-		if ((cur_offset < 0) || (fseek(fd, cur_offset, SEEK_SET) != 0)) {
+		if ((cur_offset < 0) || (loc_seek(fd, cur_offset) != 0)) {
 			uprintf("localization: unable to reset reentrant position\n");
 			ret = FALSE;
 		}
 		loc_line_nr = old_loc_line_nr;
 	} else if (fd != NULL) {
-		fclose(fd);
+		loc_close(fd);
 		fd = NULL;
 	}
 	safe_free(buf);
@@ -673,6 +773,49 @@ out:
 	return ret;
 }
 
+/*
+ * Replace 'filename' with the content of its temp copy 'wtmpname' using a single
+ * read and a single write, optionally stripping the CRs that writing through a
+ * text-mode ("w, ccs=...") stream reintroduced. 'mode' is the same BOM-derived
+ * encoding indicator the callers use (2 = UTF-16LE ➔ work on 16-bit units).
+ * This replaces a one-fread-plus-one-fwrite-per-character loop, which was rather
+ * painful on the multi-MB config files some distros ship.
+ */
+static BOOL splice_file_from_temp(const char* filename, const wchar_t* wtmpname, int mode, BOOL dos2unix)
+{
+	BOOL ret = FALSE;
+	char* tmpname = NULL;
+	uint8_t* buf = NULL;
+	uint32_t i, o, size, unit = (mode == 2) ? 2 : 1;
+
+	if (wtmpname == NULL)
+		return FALSE;
+	tmpname = wchar_to_utf8(wtmpname);
+	if (tmpname == NULL)
+		return FALSE;
+	size = read_file(tmpname, &buf);
+	if (size == 0)
+		goto out;
+	if (dos2unix) {
+		// Strip the CRs in memory
+		for (i = 0, o = 0; i + unit <= size; i += unit) {
+			if (buf[i] == 0x0D)
+				continue;
+			buf[o] = buf[i];
+			if (unit == 2)
+				buf[o + 1] = buf[i + 1];
+			o += unit;
+		}
+		size = o;
+	}
+	ret = (write_file(filename, buf, size) == size);
+
+out:
+	safe_free(tmpname);
+	safe_free(buf);
+	return ret;
+}
+
 /*
  * replace or add 'data' for token 'token' in config file 'filename'
  */
@@ -682,9 +825,9 @@ char* set_token_data_file(const char* token, const char* data, const char* filen
 	wchar_t *wtoken = NULL, *wfilename = NULL, *wtmpname = NULL, *wdata = NULL, bom = 0;
 	wchar_t buf[1024];
 	FILE *fd_in = NULL, *fd_out = NULL;
-	size_t i, size;
+	size_t i;
 	int mode = 0;
-	char *ret = NULL, tmp[2];
+	char *ret = NULL;
 
 	if ((filename == NULL) || (token == NULL) || (data == NULL))
 		return NULL;
@@ -807,22 +950,9 @@ out:
 
 	// If an insertion occurred, delete existing file and use the new one
 	if (ret != NULL) {
-		// We're in Windows text mode => Remove CRs if requested
-		if (wtmpname != NULL)
-			fd_in = _wfopen(wtmpname, L"rb");
-		fd_out = _wfopen(wfilename, L"wb");
-		// Don't check fds
-		if ((fd_in != NULL) && (fd_out != NULL)) {
-			size = (mode==2)?2:1;
-			while(fread(tmp, size, 1, fd_in) == 1)
-				fwrite(tmp, size, 1, fd_out);
-			fclose(fd_in);
-			fclose(fd_out);
-		} else {
+		if (!splice_file_from_temp(filename, wtmpname, mode, FALSE)) {
 			uprintf("Could not write '%s' - original file has been left unmodified\n", filename);
 			ret = NULL;
-			if (fd_in != NULL) fclose(fd_in);
-			if (fd_out != NULL) fclose(fd_out);
 		}
 	}
 	if (wtmpname != NULL)
@@ -835,33 +965,169 @@ out:
 	return ret;
 }
 
+/*
+ * Cursor-based scanner over a token buffer (ANSI or UTF-8). The buffer is
+ * tokenized into a line index once, at init, after which indexed token
+ * queries only walk the index. Queries for increasing occurrences of the
+ * same token resume from an internal cursor, so iterating over all the
+ * occurrences is linear in the buffer size rather than quadratic.
+ */
+BOOL token_scanner_init(token_scanner* ts, const char* buffer, size_t buffer_size)
+{
+	unsigned int curly_count;
+	wchar_t** wline;
+	size_t i;
+	uint32_t allocated = 64;
+	BOOL done;
+
+	// We're handling remote data => better safe than sorry
+	if ((ts == NULL) || (buffer == NULL) || (buffer_size <= 4) || (buffer_size > 65536) ||
+		(buffer[buffer_size-1] != 0))
+		return FALSE;
+
+	memset(ts, 0, sizeof(token_scanner));
+	ts->wbuffer = utf8_to_wchar(buffer);
+	ts->wline = (wchar_t**)malloc(allocated * sizeof(wchar_t*));
+	if ((ts->wbuffer == NULL) || (ts->wline == NULL)) {
+		token_scanner_destroy(ts);
+		return FALSE;
+	}
+
+	// Process individual lines (or multiple lines when between {}, for RTF)
+	for (i=0,done=FALSE; !done; ) {
+		if (ts->line_count >= allocated) {
+			allocated *= 2;
+			wline = (wchar_t**)realloc(ts->wline, allocated * sizeof(wchar_t*));
+			if (wline == NULL) {
+				token_scanner_destroy(ts);
+				return FALSE;
+			}
+			ts->wline = wline;
+		}
+		ts->wline[ts->line_count++] = &ts->wbuffer[i];
+
+		for(curly_count=0;((curly_count>0)||((ts->wbuffer[i]!=L'\n')&&(ts->wbuffer[i]!=L'\r')))&&(ts->wbuffer[i]!=0);i++) {
+			if (ts->wbuffer[i] == L'{') curly_count++;
+			if (ts->wbuffer[i] == L'}') curly_count--;
+		}
+		if (ts->wbuffer[i]==0) {
+			done = TRUE;
+		} else {
+			ts->wbuffer[i++] = 0;
+		}
+	}
+	return TRUE;
+}
+
+/*
+ * Return the data for the 'n'th occurrence of 'token' from a scanner.
+ * The returned string is UTF-8 and MUST be freed by the caller.
+ */
+char* token_scanner_get(token_scanner* ts, const char* token, unsigned int n)
+{
+	wchar_t *wtoken = NULL, *wdata = NULL;
+	uint32_t line;
+	unsigned int found;
+	char* ret = NULL;
+
+	if ((ts == NULL) || (ts->wbuffer == NULL) || (token == NULL) || (n == 0))
+		return NULL;
+
+	wtoken = utf8_to_wchar(token);
+	if (wtoken == NULL)
+		return NULL;
+
+	// Resume from the cursor when iterating over occurrences of the same token
+	if ((strcmp(token, ts->last_token) == 0) && (n > ts->last_n)) {
+		line = ts->last_line + 1;
+		found = ts->last_n;
+	} else {
+		line = 0;
+		found = 0;
+	}
+
+	for (; line < ts->line_count; line++) {
+		wdata = get_token_data_line(wtoken, ts->wline[line]);
+		if (wdata == NULL)
+			continue;
+		if (++found == n)
+			break;
+		wdata = NULL;
+	}
+	if (wdata != NULL) {
+		ret = wchar_to_utf8(wdata);
+		if (safe_strlen(token) < sizeof(ts->last_token)) {
+			static_strcpy(ts->last_token, token);
+			ts->last_n = n;
+			ts->last_line = line;
+		} else {
+			ts->last_token[0] = 0;
+		}
+	}
+	safe_free(wtoken);
+	return ret;
+}
+
+void token_scanner_destroy(token_scanner* ts)
+{
+	if (ts == NULL)
+		return;
+	safe_free(ts->wbuffer);
+	safe_free(ts->wline);
+	ts->line_count = 0;
+	ts->last_token[0] = 0;
+}
+
 /*
  * Parse a buffer (ANSI or UTF-8) and return the data for the 'n'th occurrence of 'token'
  * The returned string is UTF-8 and MUST be freed by the caller
+ * NB: repeated indexed queries over the same buffer should use a token_scanner
+ * directly, so the line index only gets built once.
  */
 char* get_token_data_buffer(const char* token, unsigned int n, const char* buffer, size_t buffer_size)
 {
-	unsigned int j, curly_count;
-	wchar_t *wtoken = NULL, *wdata = NULL, *wbuffer = NULL, *wline = NULL;
-	size_t i;
-	BOOL done = FALSE;
-	char* ret = NULL;
+	token_scanner ts;
+	char* ret;
+
+	if (!token_scanner_init(&ts, buffer, buffer_size))
+		return NULL;
+	ret = token_scanner_get(&ts, token, n);
+	token_scanner_destroy(&ts);
+	return ret;
+}
+
+/*
+ * Tokenize a buffer (ANSI or UTF-8) in a single pass, and store every 'token = data'
+ * pair found into a hash table, keyed by token name. Only the first occurrence of
+ * each token is kept, to match get_token_data_buffer(token, 1, ...) semantics.
+ * The data elements are UTF-8 and belong to the table => use tokenize_buffer_destroy()
+ * rather than htab_destroy() to dispose of it.
+ */
+static BOOL tokenize_buffer(const char* buffer, size_t buffer_size, htab_table* htab)
+{
+	unsigned int curly_count;
+	wchar_t *wbuffer = NULL, *wline, *wdata, wname[64];
+	uint32_t idx;
+	size_t i, k;
+	char* name;
+	BOOL done;
 
 	// We're handling remote data => better safe than sorry
-	if ((token == NULL) || (buffer == NULL) || (buffer_size <= 4) || (buffer_size > 65536))
-		goto out;
+	if ((buffer == NULL) || (buffer_size <= 4) || (buffer_size > 65536) ||
+		(buffer[buffer_size-1] != 0) || (htab == NULL))
+		return FALSE;
 
-	// Ensure that our buffer is NUL terminated
-	if (buffer[buffer_size-1] != 0)
-		goto out;
+	if (!htab_create(100, htab))
+		return FALSE;
 
 	wbuffer = utf8_to_wchar(buffer);
-	wtoken = utf8_to_wchar(token);
-	if ((wbuffer == NULL) || (wtoken == NULL))
-		goto out;
+	if (wbuffer == NULL) {
+		htab_destroy(htab);
+		return FALSE;
+	}
 
 	// Process individual lines (or multiple lines when between {}, for RTF)
-	for (i=0,j=0,done=FALSE; (j!=n)&&(!done); ) {
+	for (i=0,done=FALSE; !done; ) {
 		wline = &wbuffer[i];
 
 		for(curly_count=0;((curly_count>0)||((wbuffer[i]!=L'\n')&&(wbuffer[i]!=L'\r')))&&(wbuffer[i]!=0);i++) {
@@ -873,23 +1139,56 @@ char* get_token_data_buffer(const char* token, unsigned int n, const char* buffe
 		} else {
 			wbuffer[i++] = 0;
 		}
-		wdata = get_token_data_line(wtoken, wline);
-		if (wdata != NULL) {
-			j++;
-		}
+
+		// Isolate the token name, which must begin the line
+		k = wcsspn(wline, wspace);
+		if (wline[k] == L'<')
+			k++;
+		k += wcsspn(&wline[k], wspace);
+		wcsncpy(wname, &wline[k], ARRAYSIZE(wname));
+		wname[ARRAYSIZE(wname)-1] = 0;
+		for (k=0; (wname[k]!=0)&&(wname[k]!=L'=')&&(wname[k]!=L'>')&&(wcschr(wspace, wname[k])==NULL); k++);
+		wname[k] = 0;
+		if (wname[0] == 0)
+			continue;
+
+		wdata = get_token_data_line(wname, wline);
+		if (wdata == NULL)
+			continue;
+
+		name = wchar_to_utf8(wname);
+		idx = htab_hash(name, htab);
+		// Only keep the first occurrence of each token
+		if ((idx != 0) && (htab->table[idx].data == NULL))
+			htab->table[idx].data = wchar_to_utf8(wdata);
+		safe_free(name);
 	}
-out:
-	if (wdata != NULL)
-		ret = wchar_to_utf8(wdata);
 	safe_free(wbuffer);
-	safe_free(wtoken);
-	return ret;
+	return TRUE;
+}
+
+static void tokenize_buffer_destroy(htab_table* htab)
+{
+	uint32_t i;
+
+	if ((htab != NULL) && (htab->table != NULL)) {
+		for (i=0; i<htab->size+1; i++) {
+			if (htab->table[i].used)
+				safe_free(htab->table[i].data);
+		}
+	}
+	htab_destroy(htab);
 }
 
-static __inline char* get_sanitized_token_data_buffer(const char* token, unsigned int n, const char* buffer, size_t buffer_size)
+static char* get_sanitized_token_map_data(const char* token, htab_table* htab)
 {
 	size_t i;
-	char* data = get_token_data_buffer(token, n, buffer, buffer_size);
+	uint32_t idx;
+	char* data = NULL;
+
+	idx = htab_hash((char*)token, htab);
+	if ((idx != 0) && (htab->table[idx].data != NULL))
+		data = safe_strdup((char*)htab->table[idx].data);
 	if (data != NULL) {
 		for (i=0; i<strlen(data); i++) {
 			if ((data[i] == '\\') && (data[i+1] == 'n')) {
@@ -915,6 +1214,7 @@ void parse_update(char* buf, size_t len)
 	char allowed_std_chars[] = "\r\n ABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789!\"$%^&+=<>(){}[].,;#@/?";
 	char download_url_name[24];
 	char *arch_names[CPU_ARCH_MAX] = { "x86", "x64", "arm", "arm64", "none" };
+	htab_table token_map = HTAB_EMPTY;
 
 	// strchr includes the NUL terminator in the search, so take care of backslash before NUL
 	if ((buf == NULL) || (len < 2) || (len > 64 * KB) || (buf[len-1] != 0) || (buf[len-2] == '\\'))
@@ -939,23 +1239,27 @@ void parse_update(char* buf, size_t len)
 	update.platform_min[1] = 2;	// XP or later
 	safe_free(update.download_url);
 	safe_free(update.release_notes);
-	if ((data = get_sanitized_token_data_buffer("version", 1, buf, len)) != NULL) {
+	// Tokenize the buffer in a single pass, rather than rescanning it for every token
+	if (!tokenize_buffer(buf, len, &token_map))
+		return;
+	if ((data = get_sanitized_token_map_data("version", &token_map)) != NULL) {
 		for (i=0; (i<3) && ((token = strtok((i==0)?data:NULL, ".")) != NULL); i++) {
 			update.version[i] = (uint16_t)atoi(token);
 		}
 		safe_free(data);
 	}
-	if ((data = get_sanitized_token_data_buffer("platform_min", 1, buf, len)) != NULL) {
+	if ((data = get_sanitized_token_map_data("platform_min", &token_map)) != NULL) {
 		for (i=0; (i<2) && ((token = strtok((i==0)?data:NULL, ".")) != NULL); i++) {
 			update.platform_min[i] = (uint32_t)atoi(token);
 		}
 		safe_free(data);
 	}
 	static_sprintf(download_url_name, "download_url_%s", arch_names[GetCpuArch()]);
-	update.download_url = get_sanitized_token_data_buffer(download_url_name, 1, buf, len);
+	update.download_url = get_sanitized_token_map_data(download_url_name, &token_map);
 	if (update.download_url == NULL)
-		update.download_url = get_sanitized_token_data_buffer("download_url", 1, buf, len);
-	update.release_notes = get_sanitized_token_data_buffer("release_notes", 1, buf, len);
+		update.download_url = get_sanitized_token_map_data("download_url", &token_map);
+	update.release_notes = get_sanitized_token_map_data("release_notes", &token_map);
+	tokenize_buffer_destroy(&token_map);
 }
 
 /*
@@ -968,9 +1272,9 @@ char* insert_section_data(const char* filename, const char* section, const char*
 	wchar_t *wsection = NULL, *wfilename = NULL, *wtmpname = NULL, *wdata = NULL, bom = 0;
 	wchar_t buf[1024];
 	FILE *fd_in = NULL, *fd_out = NULL;
-	size_t i, size;
+	size_t i;
 	int mode = 0;
-	char *ret = NULL, tmp[2];
+	char *ret = NULL;
 
 	if ((filename == NULL) || (section == NULL) || (data == NULL))
 		return NULL;
@@ -1061,22 +1365,9 @@ out:
 	// If an insertion occurred, delete existing file and use the new one
 	if (ret != NULL && wtmpname != NULL && wfilename != NULL) {
 		// We're in Windows text mode => Remove CRs if requested
-		fd_in = _wfopen(wtmpname, L"rb");
-		fd_out = _wfopen(wfilename, L"wb");
-		// Don't check fds
-		if ((fd_in != NULL) && (fd_out != NULL)) {
-			size = (mode==2)?2:1;
-			while(fread(tmp, size, 1, fd_in) == 1) {
-				if ((!dos2unix) || (tmp[0] != 0x0D))
-					fwrite(tmp, size, 1, fd_out);
-			}
-			fclose(fd_in);
-			fclose(fd_out);
-		} else {
+		if (!splice_file_from_temp(filename, wtmpname, mode, dos2unix)) {
 			uprintf("Could not write '%s' - original file has been left unmodified\n", filename);
 			ret = NULL;
-			if (fd_in != NULL) fclose(fd_in);
-			if (fd_out != NULL) fclose(fd_out);
 		}
 	}
 	if (wtmpname != NULL)
@@ -1103,9 +1394,9 @@ char* replace_in_token_data(const char* filename, const char* token, const char*
 	wchar_t *wtoken = NULL, *wfilename = NULL, *wtmpname = NULL, *wsrc = NULL, *wrep = NULL, bom = 0;
 	wchar_t buf[1024], *torep[MAX_OCCURRENCES + 1] = { NULL };
 	FILE *fd_in = NULL, *fd_out = NULL;
-	size_t i, j, p[MAX_OCCURRENCES + 1] = { 0 }, ns, size;
+	size_t i, j, p[MAX_OCCURRENCES + 1] = { 0 }, ns;
 	int mode = 0;
-	char *ret = NULL, tmp[2];
+	char *ret = NULL;
 
 	if ((filename == NULL) || (token == NULL) || (src == NULL) || (rep == NULL))
 		return NULL;
@@ -1238,22 +1529,9 @@ out:
 	// If a replacement occurred, delete existing file and use the new one
 	if (ret != NULL && wtmpname != NULL && wfilename != NULL) {
 		// We're in Windows text mode => Remove CRs if requested
-		fd_in = _wfopen(wtmpname, L"rb");
-		fd_out = _wfopen(wfilename, L"wb");
-		// Don't check fds
-		if ((fd_in != NULL) && (fd_out != NULL)) {
-			size = (mode==2)?2:1;
-			while(fread(tmp, size, 1, fd_in) == 1) {
-				if ((!dos2unix) || (tmp[0] != 0x0D))
-					fwrite(tmp, size, 1, fd_out);
-			}
-			fclose(fd_in);
-			fclose(fd_out);
-		} else {
+		if (!splice_file_from_temp(filename, wtmpname, mode, dos2unix)) {
 			uprintf("Could not write '%s' - original file has been left unmodified.\n", filename);
 			ret = NULL;
-			if (fd_in != NULL) fclose(fd_in);
-			if (fd_out != NULL) fclose(fd_out);
 		}
 	}
 	if (wtmpname != NULL)
@@ -1267,6 +1545,59 @@ out:
 	return ret;
 }
 
+/*
+ * Single-pass multi-pattern search: report which of the 'count' (max 32) UTF-8
+ * 'patterns' occur in file 'filename'. All the patterns are looked for at once
+ * during a single traversal of the file content, which makes this a cheap
+ * prescan to weed out per-pattern processing, such as the full read + rewrite
+ * cycle of replace_in_token_data(), for patterns that aren't there.
+ * Returns a bitmask with bit i set if patterns[i] was found. NULL or empty
+ * patterns are reported as found, and so is everything if the content can't
+ * be matched byte for byte (unreadable file, UTF-16 content), so that callers
+ * err on the side of processing. Matching is exact (case-sensitive).
+ */
+uint32_t scan_file_for_strings(const char* filename, const char* patterns[], size_t count)
+{
+	uint8_t* buf = NULL;
+	uint32_t i, j, size, cand, found = 0, all, first[0x100] = { 0 };
+	size_t len[32];
+
+	if ((filename == NULL) || (patterns == NULL) || (count == 0) || (count > 32))
+		return 0xFFFFFFFF;
+	all = (count >= 32) ? 0xFFFFFFFF : ((1UL << count) - 1);
+
+	for (j = 0; j < count; j++) {
+		if ((patterns[j] == NULL) || (patterns[j][0] == 0)) {
+			found |= 1UL << j;
+			continue;
+		}
+		len[j] = strlen(patterns[j]);
+		first[(uint8_t)patterns[j][0]] |= 1UL << j;
+	}
+	if (found == all)
+		return all;
+
+	size = read_file(filename, &buf);
+	if (size == 0)
+		return all;
+	if ((size >= 2) && (((buf[0] == 0xFF) && (buf[1] == 0xFE)) || ((buf[0] == 0xFE) && (buf[1] == 0xFF)))) {
+		free(buf);
+		return all;
+	}
+
+	for (i = 0; (i < size) && (found != all); i++) {
+		// 'first' narrows the candidates down to the patterns starting with buf[i]
+		cand = first[buf[i]] & ~found;
+		for (j = 0; cand != 0; j++, cand >>= 1) {
+			if ((cand & 1) && (i + len[j] <= size) && (memcmp(&buf[i], patterns[j], len[j]) == 0))
+				found |= 1UL << j;
+		}
+	}
+
+	free(buf);
+	return found;
+}
+
 /*
  * Replace all 'c' characters in string 'src' with the substring 'rep'
  * The returned string is allocated and must be freed by the caller.
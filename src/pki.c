@@ -569,6 +569,103 @@ out:
 	return timestamp;
 }
 
+// Process-lifetime cache of signer certificates for which a full chain validation,
+// online revocation checks included, has already succeeded. Entries are published
+// atomically (claim slot ➔ write hash ➔ mark valid), so no lock is needed.
+#define PKI_THUMBPRINT_SIZE     20	// SHA-1, which is what CERT_HASH_PROP_ID returns
+#define PKI_CHAIN_CACHE_SIZE    8
+typedef struct {
+	BYTE hash[PKI_THUMBPRINT_SIZE];
+	volatile LONG state;	// 0 = free, -1 = being written, 1 = valid
+} pki_chain_cache_entry;
+static pki_chain_cache_entry pki_chain_cache[PKI_CHAIN_CACHE_SIZE];
+
+// Compute the SHA-1 thumbprint of the signer certificate of 'path'
+// (or of the current runtime if path is NULL)
+static BOOL GetSignerThumbprint(const char* path, BYTE* thumbprint, DWORD thumbprint_size)
+{
+	BOOL r = FALSE;
+	HCERTSTORE hStore = NULL;
+	HCRYPTMSG hMsg = NULL;
+	PCCERT_CONTEXT pCertContext = NULL;
+	DWORD dwSize, dwEncoding, dwContentType, dwFormatType;
+	PCMSG_SIGNER_INFO pSignerInfo = NULL;
+	DWORD dwSignerInfo = 0;
+	CERT_INFO CertInfo = { 0 };
+	wchar_t* szFileName = NULL;
+
+	if (path == NULL) {
+		szFileName = calloc(MAX_PATH, sizeof(wchar_t));
+		if (szFileName == NULL)
+			return FALSE;
+		dwSize = GetModuleFileNameW(NULL, szFileName, MAX_PATH);
+		if ((dwSize == 0) || ((dwSize == MAX_PATH) && (GetLastError() == ERROR_INSUFFICIENT_BUFFER)))
+			goto out;
+	} else {
+		szFileName = utf8_to_wchar(path);
+		if (szFileName == NULL)
+			return FALSE;
+	}
+
+	if (!CryptQueryObject(CERT_QUERY_OBJECT_FILE, szFileName,
+		CERT_QUERY_CONTENT_FLAG_PKCS7_SIGNED_EMBED, CERT_QUERY_FORMAT_FLAG_BINARY,
+		0, &dwEncoding, &dwContentType, &dwFormatType, &hStore, &hMsg, NULL))
+		goto out;
+	if (!CryptMsgGetParam(hMsg, CMSG_SIGNER_INFO_PARAM, 0, NULL, &dwSignerInfo))
+		goto out;
+	pSignerInfo = (PCMSG_SIGNER_INFO)calloc(dwSignerInfo, 1);
+	if (pSignerInfo == NULL)
+		goto out;
+	if (!CryptMsgGetParam(hMsg, CMSG_SIGNER_INFO_PARAM, 0, (PVOID)pSignerInfo, &dwSignerInfo))
+		goto out;
+	CertInfo.Issuer = pSignerInfo->Issuer;
+	CertInfo.SerialNumber = pSignerInfo->SerialNumber;
+	pCertContext = CertFindCertificateInStore(hStore, ENCODING, 0, CERT_FIND_SUBJECT_CERT, (PVOID)&CertInfo, NULL);
+	if (pCertContext == NULL)
+		goto out;
+	dwSize = thumbprint_size;
+	r = CertGetCertificateContextProperty(pCertContext, CERT_HASH_PROP_ID, thumbprint, &dwSize);
+
+out:
+	safe_free(pSignerInfo);
+	safe_free(szFileName);
+	if (pCertContext != NULL)
+		CertFreeCertificateContext(pCertContext);
+	if (hStore != NULL)
+		CertCloseStore(hStore, 0);
+	if (hMsg != NULL)
+		CryptMsgClose(hMsg);
+	return r;
+}
+
+static BOOL IsChainCached(const BYTE* thumbprint)
+{
+	int i;
+
+	for (i = 0; i < PKI_CHAIN_CACHE_SIZE; i++) {
+		if ((pki_chain_cache[i].state == 1) &&
+			(memcmp(pki_chain_cache[i].hash, thumbprint, PKI_THUMBPRINT_SIZE) == 0))
+			return TRUE;
+	}
+	return FALSE;
+}
+
+static void CacheValidatedChain(const BYTE* thumbprint)
+{
+	int i;
+
+	if (IsChainCached(thumbprint))
+		return;
+	for (i = 0; i < PKI_CHAIN_CACHE_SIZE; i++) {
+		if (InterlockedCompareExchange(&pki_chain_cache[i].state, -1, 0) == 0) {
+			memcpy(pki_chain_cache[i].hash, thumbprint, PKI_THUMBPRINT_SIZE);
+			InterlockedExchange(&pki_chain_cache[i].state, 1);
+			return;
+		}
+	}
+	// Cache full => subsequent validations for new signers stay full-chain
+}
+
 // From https://msdn.microsoft.com/en-us/library/windows/desktop/aa382384.aspx
 LONG ValidateSignature(HWND hDlg, const char* path)
 {
@@ -580,6 +677,8 @@ LONG ValidateSignature(HWND hDlg, const char* path)
 	char *signature_name;
 	size_t i;
 	uint64_t current_ts, update_ts;
+	BYTE thumbprint[PKI_THUMBPRINT_SIZE];
+	BOOL has_thumbprint, cached = FALSE;
 
 	// Check the signature name. Make it specific enough (i.e. don't simply check for "Akeo")
 	// so that, besides hacking our server, it'll place an extra hurdle on any malicious entity
@@ -622,13 +721,31 @@ LONG ValidateSignature(HWND hDlg, const char* path)
 	trust_data.fdwRevocationChecks = WTD_REVOKE_WHOLECHAIN;
 	// 0x400 = WTD_MOTW  for Windows 8.1 or later
 	trust_data.dwProvFlags = WTD_REVOCATION_CHECK_CHAIN | 0x400;
+	// If a full chain validation, online revocation checks included, already succeeded
+	// for this signer during this session, only use the cached revocation data, so that
+	// repeated signed downloads don't block on CRL/OCSP round-trips. The signature and
+	// chain themselves are still fully verified for each file.
+	has_thumbprint = GetSignerThumbprint(path, thumbprint, sizeof(thumbprint));
+	cached = has_thumbprint && IsChainCached(thumbprint);
+	if (cached)
+		// 0x1000 = WTD_CACHE_ONLY_URL_RETRIEVAL
+		trust_data.dwProvFlags |= 0x1000;
 	trust_data.dwUnionChoice = WTD_CHOICE_FILE;
 	trust_data.pFile = &trust_file;
 
 	r = WinVerifyTrustEx(INVALID_HANDLE_VALUE, &guid_generic_verify, &trust_data);
+	// If cache-only retrieval didn't cut it (cached revocation data expired or was
+	// evicted), fall back to a full online validation rather than failing
+	if (cached && (r != ERROR_SUCCESS)) {
+		trust_data.dwProvFlags &= ~0x1000;
+		cached = FALSE;
+		r = WinVerifyTrustEx(INVALID_HANDLE_VALUE, &guid_generic_verify, &trust_data);
+	}
 	safe_free(trust_file.pcwszFilePath);
 	switch (r) {
 	case ERROR_SUCCESS:
+		if (has_thumbprint && !cached)
+			CacheValidatedChain(thumbprint);
 		// hDlg = INVALID_HANDLE_VALUE is used when validating the Fido PS1 script
 		if (hDlg == INVALID_HANDLE_VALUE)
 			break;
@@ -664,6 +781,49 @@ LONG ValidateSignature(HWND hDlg, const char* path)
 	return r;
 }
 
+// Validate our own binary's signing chain, online revocation checks included, so
+// that the revocation data for our chain lands in the system cache (and our
+// validated-chain cache is seeded) before any signed download needs it
+static DWORD WINAPI RevocationPrefetchThread(LPVOID param)
+{
+	WINTRUST_DATA trust_data = { 0 };
+	WINTRUST_FILE_INFO trust_file = { 0 };
+	GUID guid_generic_verify =	// WINTRUST_ACTION_GENERIC_VERIFY_V2
+		{ 0xaac56b, 0xcd44, 0x11d0,{ 0x8c, 0xc2, 0x0, 0xc0, 0x4f, 0xc2, 0x95, 0xee } };
+	wchar_t wpath[MAX_PATH];
+	BYTE thumbprint[PKI_THUMBPRINT_SIZE];
+	DWORD size;
+
+	size = GetModuleFileNameW(NULL, wpath, ARRAYSIZE(wpath));
+	if ((size == 0) || ((size == ARRAYSIZE(wpath)) && (GetLastError() == ERROR_INSUFFICIENT_BUFFER)))
+		return 1;
+
+	trust_file.cbStruct = sizeof(trust_file);
+	trust_file.pcwszFilePath = wpath;
+	trust_data.cbStruct = sizeof(trust_data);
+	trust_data.dwUIChoice = WTD_UI_NONE;
+	trust_data.fdwRevocationChecks = WTD_REVOKE_WHOLECHAIN;
+	trust_data.dwProvFlags = WTD_REVOCATION_CHECK_CHAIN;
+	trust_data.dwUnionChoice = WTD_CHOICE_FILE;
+	trust_data.pFile = &trust_file;
+	if (WinVerifyTrustEx(INVALID_HANDLE_VALUE, &guid_generic_verify, &trust_data) == ERROR_SUCCESS) {
+		if (GetSignerThumbprint(NULL, thumbprint, sizeof(thumbprint)))
+			CacheValidatedChain(thumbprint);
+		uprintf("Prefetched revocation data for our signing chain");
+	}
+	return 0;
+}
+
+void PrefetchRevocationData(void)
+{
+	HANDLE prefetch_thread = CreateThread(NULL, 0, RevocationPrefetchThread, NULL, 0, NULL);
+
+	if (prefetch_thread == NULL)
+		uprintf("Unable to start revocation prefetch thread");
+	else
+		CloseHandle(prefetch_thread);
+}
+
 // Why-oh-why am I the only one on github doing this openssl vs MS signature validation?!?
 // For once, I'd like to find code samples from *OTHER PEOPLE* who went through this ordeal first...
 BOOL ValidateOpensslSignature(BYTE* pbBuffer, DWORD dwBufferLen, BYTE* pbSignature, DWORD dwSigLen)
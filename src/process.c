@@ -418,58 +418,135 @@ out:
 	return wcmdline;
 }
 
-static DWORD WINAPI SearchProcessThread(LPVOID param)
+// Maximum number of threads used to scan the system handle table
+#define MAX_SEARCH_PROCESS_THREADS 4
+
+// Handle name cache, so that closely spaced rescans (e.g. the drive access retry
+// loops) don't have to re-issue NtDuplicateObject/NtQueryObject for handles that
+// were already examined. Entries are keyed by PID + handle value + object pointer
+// and store the object name (or a marker for non storage handles), which is valid
+// regardless of the target being searched for.
+#define SEARCH_CACHE_SIZE     65536
+#define SEARCH_CACHE_TTL      30000
+#define SEARCH_CACHE_NOT_DISK 0xFFFF
+
+typedef struct {
+	USHORT name_len;	// UNICODE_STRING Length (in bytes), or SEARCH_CACHE_NOT_DISK
+	wchar_t name[1];
+} cached_name_t;
+
+static htab_table search_cache = HTAB_EMPTY;
+static uint64_t search_cache_time = 0;
+static CRITICAL_SECTION search_cache_lock;
+static BOOL search_cache_lock_init = FALSE;
+static volatile LONG search_abort = 0;
+
+static cached_name_t* SearchCacheLookup(char* key)
+{
+	uint32_t idx;
+	cached_name_t* ret = NULL;
+
+	EnterCriticalSection(&search_cache_lock);
+	// Lookups insert a placeholder entry => don't touch a (near) full table
+	if ((search_cache.table != NULL) && (search_cache.filled < search_cache.size - 1)) {
+		idx = htab_hash(key, &search_cache);
+		if (idx != 0)
+			ret = (cached_name_t*)search_cache.table[idx].data;
+	}
+	LeaveCriticalSection(&search_cache_lock);
+	return ret;
+}
+
+// info = NULL marks the handle as pointing to a non storage object
+static void SearchCacheStore(char* key, POBJECT_NAME_INFORMATION info)
+{
+	uint32_t idx;
+	size_t nb_chars = (info == NULL) ? 0 : info->Name.Length / sizeof(wchar_t);
+	cached_name_t* entry;
+
+	entry = (cached_name_t*)malloc(sizeof(cached_name_t) + nb_chars * sizeof(wchar_t));
+	if (entry == NULL)
+		return;
+	if (info == NULL) {
+		entry->name_len = SEARCH_CACHE_NOT_DISK;
+		entry->name[0] = 0;
+	} else {
+		entry->name_len = info->Name.Length;
+		memcpy(entry->name, info->Name.Buffer, nb_chars * sizeof(wchar_t));
+		entry->name[nb_chars] = 0;
+	}
+	EnterCriticalSection(&search_cache_lock);
+	idx = ((search_cache.table != NULL) && (search_cache.filled < search_cache.size - 1)) ?
+		htab_hash(key, &search_cache) : 0;
+	if ((idx != 0) && (search_cache.table[idx].data == NULL))
+		search_cache.table[idx].data = entry;
+	else
+		free(entry);
+	LeaveCriticalSection(&search_cache_lock);
+}
+
+static void SearchCacheDestroy(void)
+{
+	uint32_t i;
+
+	if (search_cache.table != NULL) {
+		for (i = 0; i < search_cache.size + 1; i++) {
+			if (search_cache.table[i].used)
+				safe_free(search_cache.table[i].data);
+		}
+	}
+	htab_destroy(&search_cache);
+}
+
+// Context for the parallel scan of the system handle table. Each worker owns a
+// contiguous slice of the table (split on process boundaries, so that all the
+// handles from one process are examined by the same worker) as well as a private
+// non serialized heap for its object name queries.
+typedef struct {
+	PSYSTEM_HANDLE_INFORMATION_EX handles;
+	ULONG_PTR first;
+	ULONG_PTR last;
+	PVOID heap;
+	USHORT wHandleNameLen;
+	BYTE access_mask;
+	StrArray found;
+} search_chunk_t;
+
+static DWORD WINAPI SearchProcessWorker(LPVOID param)
 {
 	const char *access_rights_str[8] = { "n", "r", "w", "rw", "x", "rx", "wx", "rwx" };
+	search_chunk_t* chunk = (search_chunk_t*)param;
+	PSYSTEM_HANDLE_INFORMATION_EX handles = chunk->handles;
 	char tmp[MAX_PATH];
-	NTSTATUS status = STATUS_SUCCESS;
-	PSYSTEM_HANDLE_INFORMATION_EX handles = NULL;
+	NTSTATUS status;
 	POBJECT_NAME_INFORMATION buffer = NULL;
 	ULONG_PTR i;
 	ULONG_PTR pid[2];
 	ULONG_PTR last_access_denied_pid = 0;
 	ULONG bufferSize;
-	USHORT wHandleNameLen;
 	HANDLE dupHandle = NULL;
 	HANDLE processHandle = NULL;
-	BOOLEAN bFound = FALSE, bGotCmdLine, verbose = !_bQuiet;
+	BOOLEAN bFound = FALSE, bGotCmdLine;
 	ULONG access_rights = 0;
 	DWORD size;
 	char cmdline[MAX_PATH] = { 0 };
+	char key[64];
 	wchar_t wexe_path[MAX_PATH], *wcmdline;
+	cached_name_t* cached;
 	int cur_pid;
 
-	PF_INIT_OR_SET_STATUS(NtQueryObject, Ntdll);
-	PF_INIT_OR_SET_STATUS(NtDuplicateObject, NtDll);
-	PF_INIT_OR_SET_STATUS(NtClose, NtDll);
-
-	StrArrayClear(&BlockingProcess);
-
-	if (NT_SUCCESS(status))
-		status = PhCreateHeap();
-
-	if (NT_SUCCESS(status))
-		status = PhEnumHandlesEx(&handles);
-
-	if (!NT_SUCCESS(status)) {
-		uprintf("Warning: Could not enumerate process handles: %s", NtStatusError(status));
-		goto out;
-	}
-
 	pid[0] = (ULONG_PTR)0;
 	cur_pid = 1;
 
-	wHandleNameLen = (USHORT)wcslen(_wHandleName);
-
 	bufferSize = 0x200;
-	buffer = PhAllocate(bufferSize);
+	buffer = pfRtlAllocateHeap(chunk->heap, 0, bufferSize);
 	if (buffer == NULL)
 		goto out;
 
-	for (i = 0; ; i++) {
+	for (i = chunk->first; ; i++) {
 		ULONG attempts = 8;
 		PSYSTEM_HANDLE_TABLE_ENTRY_INFO_EX handleInfo =
-			(i < handles->NumberOfHandles) ? &handles->Handles[i] : NULL;
+			(i < chunk->last) ? &handles->Handles[i] : NULL;
 
 		if ((dupHandle != NULL) && (processHandle != NtCurrentProcess())) {
 			pfNtClose(dupHandle);
@@ -483,11 +560,10 @@ static DWORD WINAPI SearchProcessThread(LPVOID param)
 		if (pid[0] != pid[1]) {
 			cur_pid = (cur_pid + 1) % 2;
 
-			// If we're switching process and found a match, print it
+			// If we're switching process and found a match, store it
 			if (bFound) {
 				static_sprintf (tmp, "● [%06u] %s (%s)", (uint32_t)pid[cur_pid], cmdline, access_rights_str[access_rights & 0x7]);
-				vuprintf(tmp);
-				StrArrayAdd(&BlockingProcess, tmp, TRUE);
+				StrArrayAdd(&chunk->found, tmp, TRUE);
 				bFound = FALSE;
 				access_rights = 0;
 			}
@@ -502,8 +578,17 @@ static DWORD WINAPI SearchProcessThread(LPVOID param)
 
 		CHECK_FOR_USER_CANCEL;
 
+		// Another worker already found a definite blocker => flush and stop
+		if (search_abort) {
+			if (bFound) {
+				static_sprintf (tmp, "â [%06u] %s (%s)", (uint32_t)pid[cur_pid], cmdline, access_rights_str[access_rights & 0x7]);
+				StrArrayAdd(&chunk->found, tmp, TRUE);
+			}
+			break;
+		}
+
 		// Exit loop condition
-		if (i >= handles->NumberOfHandles)
+		if (i >= chunk->last)
 			break;
 
 		if (handleInfo == NULL)
@@ -533,6 +618,22 @@ static DWORD WINAPI SearchProcessThread(LPVOID param)
 			}
 		}
 
+		// See if we already know this handle's object name from a previous scan
+		static_sprintf(key, "%llx:%llx:%p", (ULONGLONG)handleInfo->UniqueProcessId,
+			(ULONGLONG)handleInfo->HandleValue, handleInfo->Object);
+		cached = SearchCacheLookup(key);
+		if (cached != NULL) {
+			if (cached->name_len == SEARCH_CACHE_NOT_DISK)
+				continue;
+			if ((!_bPartialMatch) && (chunk->wHandleNameLen != cached->name_len))
+				continue;
+			if ((_bPartialMatch) && (chunk->wHandleNameLen > cached->name_len))
+				continue;
+			if (wcsncmp(_wHandleName, cached->name, chunk->wHandleNameLen) != 0)
+				continue;
+			goto matched;
+		}
+
 		// Now duplicate this handle onto our own process, so that we can access its properties
 		if (processHandle == NtCurrentProcess()) {
 			if (_bIgnoreSelf)
@@ -546,8 +647,10 @@ static DWORD WINAPI SearchProcessThread(LPVOID param)
 		}
 
 		// Filter non-storage handles. We're not interested in them and they make NtQueryObject() freeze
-		if (GetFileType(dupHandle) != FILE_TYPE_DISK)
+		if (GetFileType(dupHandle) != FILE_TYPE_DISK) {
+			SearchCacheStore(key, NULL);
 			continue;
+		}
 
 		// A loop is needed because the I/O subsystem likes to give us the wrong return lengths...
 		do {
@@ -558,8 +661,8 @@ static DWORD WINAPI SearchProcessThread(LPVOID param)
 				status == STATUS_BUFFER_TOO_SMALL) {
 				uuprintf("SearchProcess: Realloc from %d to %d", bufferSize, returnSize);
 				bufferSize = returnSize;
-				PhFree(buffer);
-				buffer = PhAllocate(bufferSize);
+				pfRtlFreeHeap(chunk->heap, 0, buffer);
+				buffer = pfRtlAllocateHeap(chunk->heap, 0, bufferSize);
 			} else {
 				break;
 			}
@@ -570,18 +673,22 @@ static DWORD WINAPI SearchProcessThread(LPVOID param)
 			continue;
 		}
 
+		// Remember this handle's name for subsequent rescans
+		SearchCacheStore(key, buffer);
+
 		// Don't bother comparing if we are looking for full match and the length is different
-		if ((!_bPartialMatch) && (wHandleNameLen != buffer->Name.Length))
+		if ((!_bPartialMatch) && (chunk->wHandleNameLen != buffer->Name.Length))
 			continue;
 
 		// Likewise, if we are looking for a partial match and the current length is smaller
-		if ((_bPartialMatch) && (wHandleNameLen > buffer->Name.Length))
+		if ((_bPartialMatch) && (chunk->wHandleNameLen > buffer->Name.Length))
 			continue;
 
 		// Match against our target string
-		if (wcsncmp(_wHandleName, buffer->Name.Buffer, wHandleNameLen) != 0)
+		if (wcsncmp(_wHandleName, buffer->Name.Buffer, chunk->wHandleNameLen) != 0)
 			continue;
 
+matched:
 		// If we are here, we have a process accessing our target!
 		bFound = TRUE;
 
@@ -590,11 +697,12 @@ static DWORD WINAPI SearchProcessThread(LPVOID param)
 		// The Executable bit is in a place we don't like => reposition it
 		if (access_rights & 0x20)
 			access_rights = (access_rights & 0x03) | 0x04;
-		access_mask |= (BYTE) (access_rights & 0x7) + 0x80;	// Bit 7 is always set if a process was found
+		chunk->access_mask |= (BYTE) (access_rights & 0x7) + 0x80;	// Bit 7 is always set if a process was found
 
-		// If this is the very first process we find, print a header
-		if (cmdline[0] == 0)
-			vuprintf("WARNING: The following process(es) or service(s) are accessing %S:", _wHandleName);
+		// In quiet mode the caller only needs to know whether a write/execute blocker
+		// exists => let the other workers know they can stop scanning
+		if (_bQuiet && ((chunk->access_mask & 0x06) != 0))
+			InterlockedExchange(&search_abort, 1);
 
 		// Where possible, try to get the full command line
 		bGotCmdLine = FALSE;
@@ -633,12 +741,132 @@ static DWORD WINAPI SearchProcessThread(LPVOID param)
 	}
 
 out:
-	if (cmdline[0] != 0)
+	if ((dupHandle != NULL) && (processHandle != NtCurrentProcess()))
+		pfNtClose(dupHandle);
+	if ((processHandle != NULL) && (processHandle != NtCurrentProcess()))
+		pfNtClose(processHandle);
+	if (buffer != NULL)
+		pfRtlFreeHeap(chunk->heap, 0, buffer);
+	return 0;
+}
+
+static DWORD WINAPI SearchProcessThread(LPVOID param)
+{
+	NTSTATUS status = STATUS_SUCCESS;
+	PSYSTEM_HANDLE_INFORMATION_EX handles = NULL;
+	search_chunk_t* chunk = NULL;
+	HANDLE thread[MAX_SEARCH_PROCESS_THREADS] = { NULL };
+	SYSTEM_INFO si;
+	ULONG_PTR split, n;
+	uint32_t i, j, nb_threads;
+	BOOLEAN found, verbose = !_bQuiet;
+
+	PF_INIT_OR_SET_STATUS(NtQueryObject, Ntdll);
+	PF_INIT_OR_SET_STATUS(NtDuplicateObject, NtDll);
+	PF_INIT_OR_SET_STATUS(NtClose, NtDll);
+	PF_INIT_OR_SET_STATUS(RtlCreateHeap, Ntdll);
+	PF_INIT_OR_SET_STATUS(RtlDestroyHeap, Ntdll);
+	PF_INIT_OR_SET_STATUS(RtlAllocateHeap, Ntdll);
+	PF_INIT_OR_SET_STATUS(RtlFreeHeap, Ntdll);
+
+	StrArrayClear(&BlockingProcess);
+	search_abort = 0;
+
+	// (Re)create the handle name cache used across closely spaced rescans
+	if (!search_cache_lock_init) {
+		InitializeCriticalSection(&search_cache_lock);
+		search_cache_lock_init = TRUE;
+	}
+	if ((search_cache.table != NULL) && (GetTickCount64() > search_cache_time + SEARCH_CACHE_TTL))
+		SearchCacheDestroy();
+	if (search_cache.table == NULL)
+		htab_create(SEARCH_CACHE_SIZE, &search_cache);
+	search_cache_time = GetTickCount64();
+
+	if (NT_SUCCESS(status))
+		status = PhCreateHeap();
+
+	if (NT_SUCCESS(status))
+		status = PhEnumHandlesEx(&handles);
+
+	if (!NT_SUCCESS(status)) {
+		uprintf("Warning: Could not enumerate process handles: %s", NtStatusError(status));
+		goto out;
+	}
+
+	// The handles are independent, so the table can be scanned by multiple workers,
+	// bounded by the number of cores rather than by the handle count.
+	GetNativeSystemInfo(&si);
+	nb_threads = min(max(si.dwNumberOfProcessors, 1), MAX_SEARCH_PROCESS_THREADS);
+	// Not worth spinning up threads for a small table
+	if (handles->NumberOfHandles < 4096)
+		nb_threads = 1;
+
+	chunk = (search_chunk_t*)calloc(nb_threads, sizeof(search_chunk_t));
+	if (chunk == NULL)
+		goto out;
+
+	split = 0;
+	for (i = 0; i < nb_threads; i++) {
+		chunk[i].handles = handles;
+		chunk[i].wHandleNameLen = (USHORT)wcslen(_wHandleName);
+		chunk[i].first = split;
+		n = ((ULONG_PTR)handles->NumberOfHandles * (i + 1)) / nb_threads;
+		// Align the split on a process boundary, so that all the handles from
+		// one process are examined by the same worker
+		while ((n < handles->NumberOfHandles) &&
+			(handles->Handles[n].UniqueProcessId == handles->Handles[n - 1].UniqueProcessId))
+			n++;
+		chunk[i].last = n;
+		split = n;
+		StrArrayCreate(&chunk[i].found, 16);
+		chunk[i].heap = pfRtlCreateHeap(HEAP_NO_SERIALIZE | HEAP_GROWABLE, NULL, 2 * MB, 1 * MB, NULL, NULL);
+		if (chunk[i].heap == NULL) {
+			// This worker's slice must still be scanned, else processes holding
+			// handles to the drive could go unreported => fall back to the
+			// (serialized) process heap
+			uprintf("Warning: Could not create private heap for handle scan thread - using process heap");
+			chunk[i].heap = GetProcessHeap();
+		}
+		thread[i] = CreateThread(NULL, 0, SearchProcessWorker, &chunk[i], 0, NULL);
+		if (thread[i] == NULL) {
+			uprintf("Warning: Unable to create handle scan thread - scanning inline");
+			SearchProcessWorker(&chunk[i]);
+		}
+	}
+	for (i = 0; i < nb_threads; i++) {
+		if (thread[i] != NULL) {
+			WaitForSingleObject(thread[i], INFINITE);
+			CloseHandle(thread[i]);
+		}
+	}
+
+	// Merge the per worker results, in table order
+	for (i = 0; i < nb_threads; i++)
+		access_mask |= chunk[i].access_mask;
+	found = (access_mask & 0x80);
+	if (found)
+		vuprintf("WARNING: The following process(es) or service(s) are accessing %S:", _wHandleName);
+	for (i = 0; i < nb_threads; i++) {
+		for (j = 0; j < chunk[i].found.Index; j++) {
+			vuprintf("%s", chunk[i].found.String[j]);
+			StrArrayAdd(&BlockingProcess, chunk[i].found.String[j], TRUE);
+		}
+	}
+	if (found)
 		vuprintf("You should close these applications before attempting to reformat the drive.");
 	else
 		vuprintf("NOTE: Could not identify the process(es) or service(s) accessing %S", _wHandleName);
 
-	PhFree(buffer);
+out:
+	if (chunk != NULL) {
+		for (i = 0; i < nb_threads; i++) {
+			StrArrayDestroy(&chunk[i].found);
+			if ((chunk[i].heap != NULL) && (chunk[i].heap != GetProcessHeap()))
+				pfRtlDestroyHeap(chunk[i].heap);
+		}
+		free(chunk);
+	}
 	PhFree(handles);
 	PhDestroyHeap();
 	ExitThread(0);
@@ -744,6 +972,9 @@ BOOL EnablePrivileges(void)
 	// be obtained at https://technet.microsoft.com/en-us/library/dn221963.aspx
 	const DWORD requestedPrivileges[] = {
 		SE_DEBUG_PRIVILEGE,
+		// For MEM_LARGE_PAGES allocations in the I/O buffer pool. Most tokens
+		// don't hold it, in which case the pool falls back to regular pages.
+		SE_LOCK_MEMORY_PRIVILEGE,
 	};
 	NTSTATUS status = STATUS_NOT_IMPLEMENTED;
 	HANDLE tokenHandle;
@@ -766,7 +997,7 @@ BOOL EnablePrivileges(void)
 		for (i = 0; i < privileges->PrivilegeCount; i++) {
 			privileges->Privileges[i].Attributes = SE_PRIVILEGE_ENABLED;
 			privileges->Privileges[i].Luid.HighPart = 0;
-			privileges->Privileges[0].Luid.LowPart = requestedPrivileges[i];
+			privileges->Privileges[i].Luid.LowPart = requestedPrivileges[i];
 		}
 
 		status = pfNtAdjustPrivilegesToken(tokenHandle, FALSE, privileges, 0, NULL, NULL);
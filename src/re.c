@@ -32,12 +32,17 @@
 #include "re.h"
 #include <stdio.h>
 #include <ctype.h>
+#include <string.h>
+#include <stdint.h>
 
 /* Definitions: */
 
 #define MAX_REGEXP_OBJECTS      30    /* Max number of regex symbols in expression. */
 #define MAX_CHAR_CLASS_LEN      40    /* Max length of character-class buffer in.   */
 
+#define RE_CACHE_SIZE            8    /* Number of compiled patterns kept by re_match(). */
+#define RE_CACHE_PATTERN_LEN    64    /* Max length of a pattern eligible for caching.   */
+
 /* ALPHA may be defined for Rufus ALPHA releases => undefine it */
 #ifdef ALPHA
 #undef ALPHA
@@ -55,9 +60,41 @@ typedef struct regex_t
   } u;
 } regex_t;
 
+/* Flattened form of a compiled pattern, used by the linear-time Thompson
+   simulation in matchprogram(). Each unit is a single-character matcher;
+   'X+' is expanded into 'XX*' so that every unit either consumes exactly
+   one character or can repeat/be skipped, which lets us represent the
+   whole NFA state-set as one bitmask (unit count <= 2 * MAX_REGEXP_OBJECTS
+   fits in a uint64_t). */
+typedef struct
+{
+  regex_t        unit[2 * MAX_REGEXP_OBJECTS];
+  unsigned char  rep[2 * MAX_REGEXP_OBJECTS];   /* unit may consume more than once ('*') */
+  unsigned char  opt[2 * MAX_REGEXP_OBJECTS];   /* unit may be skipped ('*' or '?')      */
+  int            count;
+  int            has_end;                       /* pattern is '$'-anchored               */
+} re_program;
+
+/* Cache of compiled patterns for re_match(), so that repeatedly matching the
+   same expressions (e.g. a static list of patterns applied to every scanned
+   image) doesn't recompile them on each call. Like re_compile()'s static
+   buffers, this is not thread-safe. */
+typedef struct
+{
+  char           pattern[RE_CACHE_PATTERN_LEN];
+  regex_t        objs[MAX_REGEXP_OBJECTS];
+  unsigned char  ccl[MAX_CHAR_CLASS_LEN];
+} re_cache_entry;
+
+static re_cache_entry re_cache[RE_CACHE_SIZE];
+static int re_cache_next = 0;
+
 
 
 /* Private function declarations: */
+static re_t re_compile_into(const char* pattern, regex_t* re_compiled, unsigned char* ccl_buf);
+static int re_flatten(regex_t* pattern, re_program* prog);
+static int matchprogram(re_program* prog, const char* text, int* matchlength);
 static int matchpattern(regex_t* pattern, const char* text, int* matchlength);
 static int matchcharclass(char c, const char* str);
 static int matchstar(regex_t p, regex_t* pattern, const char* text, int* matchlength);
@@ -76,16 +113,44 @@ static int ismetachar(char c);
 /* Public functions: */
 int re_match(const char* pattern, const char* text, int* matchlength)
 {
+  int i;
+
+  if ((pattern[0] != '\0') && (strlen(pattern) < RE_CACHE_PATTERN_LEN))
+  {
+    for (i = 0; i < RE_CACHE_SIZE; i++)
+    {
+      if (strcmp(re_cache[i].pattern, pattern) == 0)
+        return re_matchp(re_cache[i].objs, text, matchlength);
+    }
+    /* Not cached yet -> compile into the next slot (round-robin eviction) */
+    i = re_cache_next;
+    if (re_compile_into(pattern, re_cache[i].objs, re_cache[i].ccl) != 0)
+    {
+      strcpy(re_cache[i].pattern, pattern);
+      re_cache_next = (re_cache_next + 1) % RE_CACHE_SIZE;
+      return re_matchp(re_cache[i].objs, text, matchlength);
+    }
+    re_cache[i].pattern[0] = '\0';
+    return re_matchp(0, text, matchlength);
+  }
   return re_matchp(re_compile(pattern), text, matchlength);
 }
 
 int re_matchp(re_t pattern, const char* text, int* matchlength)
 {
+  re_program prog;
+  int use_nfa;
+
   *matchlength = 0;
   if (pattern != 0)
   {
+    /* Prefer the Thompson simulation, which runs in linear time per attempt,
+       over the backtracking matcher, whose worst case is exponential. */
+    use_nfa = re_flatten((pattern[0].type == BEGIN) ? &pattern[1] : pattern, &prog);
     if (pattern[0].type == BEGIN)
     {
+      if (use_nfa)
+        return (matchprogram(&prog, text, matchlength) ? 0 : -1);
       return ((matchpattern(&pattern[1], text, matchlength)) ? 0 : -1);
     }
     else
@@ -96,7 +161,7 @@ int re_matchp(re_t pattern, const char* text, int* matchlength)
       {
         idx += 1;
 
-        if (matchpattern(pattern, text, matchlength))
+        if (use_nfa ? matchprogram(&prog, text, matchlength) : matchpattern(pattern, text, matchlength))
         {
           if (text[0] == '\0')
             return -1;
@@ -117,6 +182,16 @@ re_t re_compile(const char* pattern)
      MAX_CHAR_CLASS_LEN determines the size of buffer for chars in all char-classes in the expression. */
   static regex_t re_compiled[MAX_REGEXP_OBJECTS];
   static unsigned char ccl_buf[MAX_CHAR_CLASS_LEN];
+
+  return re_compile_into(pattern, re_compiled, ccl_buf);
+}
+
+/* Compile 'pattern' into the caller-provided buffers, which must hold at least
+   MAX_REGEXP_OBJECTS symbols and MAX_CHAR_CLASS_LEN class characters. This is
+   what allows multiple compiled patterns (e.g. the re_match() cache entries)
+   to coexist, which re_compile()'s static buffers can't do. */
+static re_t re_compile_into(const char* pattern, regex_t* re_compiled, unsigned char* ccl_buf)
+{
   int ccl_bufidx = 1;
 
   char c;     /* current char in pattern   */
@@ -456,6 +531,127 @@ static int matchquestion(regex_t p, regex_t* pattern, const char* text, int* mat
   return 0;
 }
 
+/* Flatten a compiled pattern into an re_program. Returns 0 if the pattern
+   uses a construct the simulation can't represent (e.g. a misplaced anchor
+   or a dangling modifier), in which case the caller falls back to the
+   backtracking matcher. A leading BEGIN must be stripped by the caller. */
+static int re_flatten(regex_t* pattern, re_program* prog)
+{
+  int i = 0, n = 0;
+
+  prog->has_end = 0;
+  while ((pattern[i].type != UNUSED) && (n + 1 < 2 * MAX_REGEXP_OBJECTS))
+  {
+    unsigned char t = pattern[i].type;
+
+    if ((t == END) && (pattern[i+1].type == UNUSED))
+    {
+      prog->has_end = 1;
+      break;
+    }
+    if ((t == BEGIN) || (t == END) || (t == QUESTIONMARK) || (t == STAR) || (t == PLUS))
+      return 0;
+
+    switch (pattern[i+1].type)
+    {
+      case STAR:
+        prog->unit[n] = pattern[i];
+        prog->rep[n] = 1;
+        prog->opt[n] = 1;
+        n += 1;
+        i += 2;
+        break;
+      case PLUS:
+        /* 'X+' == 'XX*' */
+        prog->unit[n] = pattern[i];
+        prog->rep[n] = 0;
+        prog->opt[n] = 0;
+        n += 1;
+        prog->unit[n] = pattern[i];
+        prog->rep[n] = 1;
+        prog->opt[n] = 1;
+        n += 1;
+        i += 2;
+        break;
+      case QUESTIONMARK:
+        prog->unit[n] = pattern[i];
+        prog->rep[n] = 0;
+        prog->opt[n] = 1;
+        n += 1;
+        i += 2;
+        break;
+      default:
+        prog->unit[n] = pattern[i];
+        prog->rep[n] = 0;
+        prog->opt[n] = 0;
+        n += 1;
+        i += 1;
+        break;
+    }
+  }
+  if ((pattern[i].type != UNUSED) && (prog->has_end == 0))
+    return 0;
+
+  prog->count = n;
+  return 1;
+}
+
+/* Add the epsilon-closure of state-set 's': a state sitting on a skippable
+   unit can also be past it. Epsilon edges only point forward, so a single
+   ascending pass reaches the fixpoint. */
+static uint64_t re_closure(re_program* prog, uint64_t s)
+{
+  int i;
+
+  for (i = 0; i < prog->count; i++)
+  {
+    if ((s & (1ULL << i)) && prog->opt[i])
+      s |= (1ULL << (i + 1));
+  }
+  return s;
+}
+
+/* Thompson NFA simulation: advance the whole state-set one text character at
+   a time, so the run time is O(text * pattern) with no backtracking, whatever
+   the pattern. Returns the length of the longest match starting at text[0]
+   (the backtracking matcher is greedy too, except for '?', which it treats as
+   "prefer zero" - a difference only in the reported length, not in whether a
+   match is found). */
+static int matchprogram(re_program* prog, const char* text, int* matchlength)
+{
+  uint64_t s, ns;
+  uint64_t accept = 1ULL << prog->count;
+  int i, pos = 0, last = -1;
+
+  s = re_closure(prog, 1ULL);
+  for (;;)
+  {
+    if (s == 0)
+      break;
+    if ((s & accept) && ((prog->has_end == 0) || (text[pos] == '\0')))
+      last = pos;
+    if (text[pos] == '\0')
+      break;
+    ns = 0;
+    for (i = 0; i < prog->count; i++)
+    {
+      if ((s & (1ULL << i)) && matchone(prog->unit[i], text[pos]))
+      {
+        ns |= (1ULL << (i + 1));
+        if (prog->rep[i])
+          ns |= (1ULL << i);
+      }
+    }
+    s = re_closure(prog, ns);
+    pos += 1;
+  }
+  if (last < 0)
+    return 0;
+
+  *matchlength = last;
+  return 1;
+}
+
 
 #if 0
 
@@ -12,6 +12,7 @@
 #define IDD_NEW_VERSION                 108
 #define IDD_CHECKSUM                    109
 #define IDD_LIST                        110
+#define IDD_BENCHMARK                   111
 #define IDI_ICON                        120
 #define IDI_LANG_16                     121
 #define IDI_INFO_16                     122
@@ -195,6 +196,10 @@
 #define IDC_LIST_ITEM14                 1109
 #define IDC_LIST_ITEM15                 1110
 #define IDC_LIST_ITEMMAX                1111
+#define IDC_BENCHMARK                   1113
+#define IDC_BENCHMARK_REPORT            1114
+#define IDC_BENCHMARK_PROGRESS          1115
+#define IDC_BENCHMARK_START             1116
 #define IDS_DEVICE_TXT                  2000
 #define IDS_PARTITION_TYPE_TXT          2001
 #define IDS_FILE_SYSTEM_TXT             2002
@@ -574,7 +579,7 @@
 #define _APS_NO_MFC                     1
 #define _APS_NEXT_RESOURCE_VALUE        505
 #define _APS_NEXT_COMMAND_VALUE         40001
-#define _APS_NEXT_CONTROL_VALUE         1112
+#define _APS_NEXT_CONTROL_VALUE         1117
 #define _APS_NEXT_SYMED_VALUE           4000
 #endif
 #endif
@@ -69,6 +69,12 @@ static BOOL existing_key = FALSE;	// For LGP set/restore
 static BOOL size_check = TRUE;
 static BOOL log_displayed = FALSE;
 static BOOL img_provided = FALSE;
+// Batch (unattended) mode: auto-select the target device, start the operation
+// as soon as the provided image has been scanned, suppress the interactive
+// confirmations and report the outcome through the process exit code
+static BOOL batch_mode = FALSE;
+static BOOL batch_started = FALSE;
+static int batch_device = -1;
 static BOOL user_notified = FALSE;
 static BOOL relaunch = FALSE;
 static BOOL dont_display_image_name = FALSE;
@@ -82,6 +88,8 @@ static int image_index = 0, select_index = 0;
 static RECT relaunch_rc = { -65536, -65536, 0, 0};
 static UINT uMBRChecked = BST_UNCHECKED;
 static HANDLE format_thread = NULL;
+static HANDLE image_scan_thread = NULL;
+static char* queued_image_path = NULL;
 static HWND hSelectImage = NULL, hStart = NULL;
 static char szTimer[12] = "00:00:00";
 static unsigned int timer;
@@ -122,6 +130,7 @@ BOOL advanced_mode_device, advanced_mode_format, allow_dual_uefi_bios, detect_fa
 BOOL use_fake_units, preserve_timestamps = FALSE, fast_zeroing = FALSE, app_changed_size = FALSE;
 BOOL zero_drive = FALSE, list_non_usb_removable_drives = FALSE, enable_file_indexing, large_drive = FALSE;
 BOOL write_as_image = FALSE, write_as_esp = FALSE, use_vds = FALSE, ignore_boot_marker = FALSE;
+BOOL use_unbuffered_io = FALSE, verify_writes = FALSE, use_differential_write = FALSE, enable_multi_target = FALSE;
 BOOL appstore_version = FALSE, is_vds_available = TRUE;
 float fScale = 1.0f;
 int dialog_showing = 0, selection_default = BT_IMAGE, persistence_unit_selection = -1, imop_win_sel = 0;
@@ -894,6 +903,7 @@ static void EnableControls(BOOL enable, BOOL remove_checkboxes)
 	enable = (ComboBox_GetCurSel(hDeviceList) < 0) ? FALSE : enable;
 	EnableWindow(hImageOption, enable);
 	EnableWindow(hSaveToolbar, enable);
+	EnableWindow(GetDlgItem(hMainDialog, IDC_BENCHMARK), enable);
 
 	// Enable or disable the Start button and the other boot options
 	enable = ((boot_type == BT_IMAGE) && (image_path == NULL)) ? FALSE : enable;
@@ -910,28 +920,90 @@ static void EnableControls(BOOL enable, BOOL remove_checkboxes)
 	EnableWindow(hClusterSize, enable);
 }
 
-// Populate the UI main dropdown properties.
-// This should be called on device or boot type change.
-static BOOL PopulateProperties(void)
-{
-	char* device_tooltip;
-	int device_index = ComboBox_GetCurSel(hDeviceList);
+// The drive partition data of the selected device is collected on a worker
+// thread (same principle as ImageScanThread for images), so that a slow or
+// wedged device can never freeze the selection of other drives. The result
+// is posted back to the UI with UM_DRIVE_PROPS_READY.
+static HANDLE drive_props_thread = NULL;
+static DWORD drive_props_pending = 0;
+static char drive_props_fs_name[32];
+
+// Cache of collected drive partition data, keyed on device number, so that
+// reselecting a recently inspected drive repopulates the dropdowns without
+// issuing any device I/O. Invalidated on device arrival/removal and after
+// formatting, since both can change the partition data behind our back.
+#define DRIVE_PROPS_CACHE_SIZE 4
+typedef struct {
+	DWORD device_number;
+	uint64_t last_used;
 	char fs_name[32];
+	RUFUS_DRIVE_INFO drive;
+} drive_props_cache_entry;
+static drive_props_cache_entry drive_props_cache[DRIVE_PROPS_CACHE_SIZE];
+static uint64_t drive_props_cache_clock = 0;
 
-	memset(&SelectedDrive, 0, sizeof(SelectedDrive));
-	EnableWindow(hStart, FALSE);
+static void InvalidateDrivePropsCache(void)
+{
+	memset(drive_props_cache, 0, sizeof(drive_props_cache));
+}
 
-	if (device_index < 0)
-		goto out;
+static BOOL GetCachedDriveProps(DWORD device_number)
+{
+	int i;
 
-	persistence_unit_selection = -1;
-	// Get data from the currently selected drive
-	SelectedDrive.DeviceNumber = (DWORD)ComboBox_GetItemData(hDeviceList, device_index);
+	for (i = 0; i < ARRAYSIZE(drive_props_cache); i++) {
+		if ((drive_props_cache[i].last_used != 0) && (drive_props_cache[i].device_number == device_number)) {
+			memcpy(&SelectedDrive, &drive_props_cache[i].drive, sizeof(SelectedDrive));
+			static_strcpy(drive_props_fs_name, drive_props_cache[i].fs_name);
+			drive_props_cache[i].last_used = ++drive_props_cache_clock;
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+static void CacheDriveProps(DWORD device_number)
+{
+	int i, entry = 0;
+
+	for (i = 0; i < ARRAYSIZE(drive_props_cache); i++) {
+		if ((drive_props_cache[i].last_used != 0) && (drive_props_cache[i].device_number == device_number)) {
+			// Refresh the existing entry in place
+			entry = i;
+			break;
+		}
+		if (drive_props_cache[i].last_used < drive_props_cache[entry].last_used)
+			entry = i;
+	}
+	drive_props_cache[entry].device_number = device_number;
+	drive_props_cache[entry].last_used = ++drive_props_cache_clock;
+	static_strcpy(drive_props_cache[entry].fs_name, drive_props_fs_name);
+	memcpy(&drive_props_cache[entry].drive, &SelectedDrive, sizeof(SelectedDrive));
+}
+
+static DWORD WINAPI DrivePropsThread(LPVOID param)
+{
 	// This fills the SelectedDrive properties
-	GetDrivePartitionData(SelectedDrive.DeviceNumber, fs_name, sizeof(fs_name), FALSE);
+	GetDrivePartitionData((DWORD)(uintptr_t)param, drive_props_fs_name, sizeof(drive_props_fs_name), FALSE);
+	PostMessage(hMainDialog, UM_DRIVE_PROPS_READY, 0, (LPARAM)(uintptr_t)param);
+	return 0;
+}
+
+// Complete the population of the UI main dropdown properties, once the
+// partition data of the selected drive has been collected.
+static BOOL PopulatePropertiesPost(void)
+{
+	char* device_tooltip;
+	int device_index = ComboBox_GetCurSel(hDeviceList);
+
+	if (device_index < 0) {
+		SetProposedLabel(device_index);
+		return TRUE;
+	}
+
 	SetPartitionSchemeAndTargetSystem(FALSE);
 	// Attempt to reselect the last file system explicitly set by the user
-	if (!SetFileSystemAndClusterSize((selected_fs == FS_UNKNOWN) ? fs_name : NULL)) {
+	if (!SetFileSystemAndClusterSize((selected_fs == FS_UNKNOWN) ? drive_props_fs_name : NULL)) {
 		SetProposedLabel(-1);
 		uprintf("No file system is selectable for this drive\n");
 		return FALSE;
@@ -956,11 +1028,51 @@ static BOOL PopulateProperties(void)
 		free(device_tooltip);
 	}
 
-out:
 	SetProposedLabel(device_index);
 	return TRUE;
 }
 
+static BOOL StartDrivePropsThread(DWORD device_number)
+{
+	memset(&SelectedDrive, 0, sizeof(SelectedDrive));
+	SelectedDrive.DeviceNumber = device_number;
+	drive_props_fs_name[0] = 0;
+	// On a cache hit, repopulate without a worker or any device I/O
+	if (GetCachedDriveProps(device_number))
+		return PopulatePropertiesPost();
+	drive_props_thread = CreateThread(NULL, 0, DrivePropsThread, (LPVOID)(uintptr_t)device_number, 0, NULL);
+	if (drive_props_thread != NULL)
+		return TRUE;
+	// If we can't get a thread, fall back to collecting synchronously
+	uprintf("Unable to start drive properties thread - collecting synchronously");
+	GetDrivePartitionData(device_number, drive_props_fs_name, sizeof(drive_props_fs_name), FALSE);
+	return PopulatePropertiesPost();
+}
+
+// Populate the UI main dropdown properties.
+// This should be called on device or boot type change.
+static BOOL PopulateProperties(void)
+{
+	int device_index = ComboBox_GetCurSel(hDeviceList);
+
+	EnableWindow(hStart, FALSE);
+
+	if (device_index < 0) {
+		memset(&SelectedDrive, 0, sizeof(SelectedDrive));
+		SetProposedLabel(device_index);
+		return TRUE;
+	}
+
+	persistence_unit_selection = -1;
+	if (drive_props_thread != NULL) {
+		// Collection is already under way for a previous selection - queue
+		// this device and let UM_DRIVE_PROPS_READY restart the worker
+		drive_props_pending = (DWORD)ComboBox_GetItemData(hDeviceList, device_index);
+		return TRUE;
+	}
+	return StartDrivePropsThread((DWORD)ComboBox_GetItemData(hDeviceList, device_index));
+}
+
 // Callback for the log window
 BOOL CALLBACK LogCallback(HWND hDlg, UINT message, WPARAM wParam, LPARAM lParam)
 {
@@ -1044,6 +1156,16 @@ BOOL CALLBACK LogCallback(HWND hDlg, UINT message, WPARAM wParam, LPARAM lParam)
 		ResizeButtonHeight(hDlg, IDC_LOG_SAVE);
 		ResizeButtonHeight(hDlg, IDC_LOG_CLEAR);
 		return TRUE;
+	case UM_LOG_APPEND:
+		// Asynchronous log output, posted by _uprintf() from worker threads.
+		// We own the string passed in lParam.
+		if (lParam != 0) {
+			Edit_SetSel(hLog, MAX_LOG_SIZE, MAX_LOG_SIZE);
+			Edit_ReplaceSel(hLog, (wchar_t*)lParam);
+			Edit_Scroll(hLog, Edit_GetLineCount(hLog), 0);
+			free((wchar_t*)lParam);
+		}
+		return TRUE;
 	}
 	return FALSE;
 }
@@ -1255,6 +1377,76 @@ out:
 }
 
 // The scanning process can be blocking for message processing => use a thread
+// Small LRU cache of completed image scan results, keyed on path + mtime + size,
+// so that flipping back to a recently scanned image doesn't rescan it from media.
+#define IMG_REPORT_CACHE_SIZE 4
+typedef struct {
+	char path[MAX_PATH];
+	int64_t mtime;
+	int64_t size;
+	uint64_t last_used;
+	RUFUS_IMG_REPORT report;
+} img_report_cache_entry;
+static img_report_cache_entry img_report_cache[IMG_REPORT_CACHE_SIZE];
+static uint64_t img_report_cache_clock = 0;
+
+static BOOL GetCachedImageReport(const char* path, RUFUS_IMG_REPORT* report)
+{
+	int i;
+	struct __stat64 stat64 = { 0 };
+
+	if ((path == NULL) || (_stat64U(path, &stat64) != 0))
+		return FALSE;
+	for (i = 0; i < ARRAYSIZE(img_report_cache); i++) {
+		if ((img_report_cache[i].path[0] != 0) && (strcmp(img_report_cache[i].path, path) == 0) &&
+			(img_report_cache[i].mtime == stat64.st_mtime) && (img_report_cache[i].size == stat64.st_size)) {
+			memcpy(report, &img_report_cache[i].report, sizeof(RUFUS_IMG_REPORT));
+			img_report_cache[i].last_used = ++img_report_cache_clock;
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+static void CacheImageReport(const char* path, const RUFUS_IMG_REPORT* report)
+{
+	int i, entry = 0;
+	struct __stat64 stat64 = { 0 };
+
+	if ((path == NULL) || (safe_strlen(path) >= MAX_PATH) || (_stat64U(path, &stat64) != 0))
+		return;
+	for (i = 0; i < ARRAYSIZE(img_report_cache); i++) {
+		if (strcmp(img_report_cache[i].path, path) == 0) {
+			// Refresh the existing entry in place
+			entry = i;
+			break;
+		}
+		if (img_report_cache[i].last_used < img_report_cache[entry].last_used)
+			entry = i;
+	}
+	static_strcpy(img_report_cache[entry].path, path);
+	img_report_cache[entry].mtime = stat64.st_mtime;
+	img_report_cache[entry].size = stat64.st_size;
+	img_report_cache[entry].last_used = ++img_report_cache_clock;
+	memcpy(&img_report_cache[entry].report, report, sizeof(RUFUS_IMG_REPORT));
+}
+
+// Bootability probe, run on its own thread so that its header reads (and, for
+// compressed images, the trial decompression of the MBR) proceed concurrently
+// with the ISO scan, and image selection costs the longer of the two instead
+// of their sum. The probe only touches img_report fields the scan leaves alone.
+typedef struct {
+	const char* path;
+	int8_t result;
+} IMG_PROBE;
+
+static DWORD WINAPI BootableImageProbeThread(void* param)
+{
+	IMG_PROBE* probe = (IMG_PROBE*)param;
+	probe->result = IsBootableImage(probe->path);
+	return 0;
+}
+
 DWORD WINAPI ImageScanThread(LPVOID param)
 {
 	// Regexp patterns used to match ISO labels for the Red Hat 8 derivatives
@@ -1271,7 +1463,10 @@ DWORD WINAPI ImageScanThread(LPVOID param)
 	};
 	int i, len;
 	uint8_t arch;
+	BOOL cached = FALSE;
 	char tmp_path[MAX_PATH];
+	IMG_PROBE probe = { NULL, -1 };
+	HANDLE probe_thread = NULL;
 
 	if (image_path == NULL)
 		goto out;
@@ -1279,8 +1474,29 @@ DWORD WINAPI ImageScanThread(LPVOID param)
 	user_notified = FALSE;
 	EnableControls(FALSE, FALSE);
 	memset(&img_report, 0, sizeof(img_report));
-	img_report.is_iso = (BOOLEAN)ExtractISO(image_path, "", TRUE);
-	img_report.is_bootable_img = IsBootableImage(image_path);
+	if (IS_REMOTE_IMAGE(image_path)) {
+		// A remote image is streamed from the network to the drive at write
+		// time, in DD mode, so all we establish here is that the server will
+		// serve it, and what its size is.
+		if (StartStreamingDownload(image_path, &img_report.image_size))
+			img_report.is_bootable_img = 1;
+		StopStreamingDownload();
+	} else if (GetCachedImageReport(image_path, &img_report)) {
+		uprintf("Reusing cached scan results for '%s'", image_path);
+		cached = TRUE;
+	} else {
+		probe.path = image_path;
+		probe_thread = CreateThread(NULL, 0, BootableImageProbeThread, &probe, 0, NULL);
+		img_report.is_iso = (BOOLEAN)ExtractISO(image_path, "", TRUE);
+		if (probe_thread != NULL) {
+			WaitForSingleObject(probe_thread, INFINITE);
+			safe_closehandle(probe_thread);
+			img_report.is_bootable_img = probe.result;
+		} else {
+			// Probe inline if the thread could not be created
+			img_report.is_bootable_img = IsBootableImage(image_path);
+		}
+	}
 	ComboBox_ResetContent(hImageOption);
 	imop_win_sel = 0;
 
@@ -1295,18 +1511,22 @@ DWORD WINAPI ImageScanThread(LPVOID param)
 		PrintInfoDebug(0, MSG_203);
 		PrintStatus(0, MSG_203);
 		EnableControls(TRUE, FALSE);
-		if (img_report.is_bootable_img < 0)
-			MessageBoxExU(hMainDialog, lmprintf(MSG_325, image_path), lmprintf(MSG_042), MB_OK | MB_ICONERROR | MB_IS_RTL, selected_langid);
-		else
-			MessageBoxExU(hMainDialog, lmprintf(MSG_082), lmprintf(MSG_081), MB_OK | MB_ICONINFORMATION | MB_IS_RTL, selected_langid);
+		// Don't report an invalid image when the scan was merely preempted by a new selection
+		if (FormatStatus != (ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | ERROR_CANCELLED)) {
+			if (img_report.is_bootable_img < 0)
+				MessageBoxExU(hMainDialog, lmprintf(MSG_325, image_path), lmprintf(MSG_042), MB_OK | MB_ICONERROR | MB_IS_RTL, selected_langid);
+			else
+				MessageBoxExU(hMainDialog, lmprintf(MSG_082), lmprintf(MSG_081), MB_OK | MB_ICONINFORMATION | MB_IS_RTL, selected_langid);
+		}
 		safe_free(image_path);
 		goto out;
 	}
 
 	if (img_report.is_windows_img) {
 		selection_default = BT_IMAGE;
+		// The EFI boot manager probe requires a WIM extraction, so reuse cached results when we have them
 		// coverity[swapped_arguments]
-		if (GetTempFileNameU(temp_dir, APPLICATION_NAME, 0, tmp_path) != 0) {
+		if (!cached && GetTempFileNameU(temp_dir, APPLICATION_NAME, 0, tmp_path) != 0) {
 			// Only look at index 1 for now. If people complain, we may look for more.
 			if (WimExtractFile(image_path, 1, "Windows\\Boot\\EFI\\bootmgr.efi", tmp_path, TRUE)) {
 				arch = FindArch(tmp_path);
@@ -1389,6 +1609,9 @@ DWORD WINAPI ImageScanThread(LPVOID param)
 		SendMessage(hMainDialog, WM_NEXTDLGCTL, (WPARAM)hStart, TRUE);
 	}
 
+	if (!cached && (image_path != NULL) && !IS_REMOTE_IMAGE(image_path))
+		CacheImageReport(image_path, &img_report);
+
 	// Need to invalidate as we may have changed the UI and may get artifacts if we don't
 	// Oh and we need to invoke BOTH RedrawWindow() and InvalidateRect() because UI refresh
 	// in the Microsoft worlds SUCKS!!!! (we may lose the disabled "Start" button otherwise)
@@ -1398,9 +1621,30 @@ DWORD WINAPI ImageScanThread(LPVOID param)
 out:
 	dont_display_image_name = FALSE;
 	PrintInfo(0, MSG_210);
+	// Let the main thread close our handle and start any scan that was queued while we ran
+	PostMessage(hMainDialog, UM_IMAGE_SCAN_EXIT, 0, 0);
 	ExitThread(0);
 }
 
+// Start a scan of the current image_path, preempting any scan already in progress.
+// A running scan is cancelled cooperatively, through the FormatStatus checks in the
+// extraction code, and the last selection queued is scanned as soon as it has exited.
+static void StartImageScan(void)
+{
+	if (image_scan_thread != NULL) {
+		safe_free(queued_image_path);
+		queued_image_path = safe_strdup(image_path);
+		FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | ERROR_CANCELLED;
+		return;
+	}
+	FormatStatus = 0;
+	image_scan_thread = CreateThread(NULL, 0, ImageScanThread, NULL, 0, NULL);
+	if (image_scan_thread == NULL) {
+		uprintf("Unable to start ISO scanning thread");
+		FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | APPERR(ERROR_CANT_START_THREAD);
+	}
+}
+
 // Likewise, boot check will block message processing => use a thread
 static DWORD WINAPI BootCheckThread(LPVOID param)
 {
@@ -1815,6 +2059,18 @@ static __inline const char* IsAlphaOrBeta(void)
 #endif
 }
 
+// Startup phase profiler: logs how long each initialization phase took, so that
+// slow cold starts (AV interception, sluggish registry, ...) can be diagnosed
+// straight from the log. Call with NULL to (re)set the baseline without logging.
+static uint64_t startup_phase_ts = 0;
+static void LogStartupPhase(const char* phase)
+{
+	uint64_t now = GetTickCount64();
+	if ((phase != NULL) && (startup_phase_ts != 0))
+		uprintf("Startup: %s took %llu ms", phase, now - startup_phase_ts);
+	startup_phase_ts = now;
+}
+
 static void InitDialog(HWND hDlg)
 {
 	DWORD len;
@@ -1867,10 +2123,15 @@ static void InitDialog(HWND hDlg)
 	CharUpperBuffU(uppercase_cancel, sizeof(uppercase_cancel));
 
 	CreateSmallButtons(hDlg);
-	GetBasicControlsWidth(hDlg);
-	GetMainButtonsWidth(hDlg);
-	GetHalfDropwdownWidth(hDlg);
-	GetFullWidth(hDlg);
+	// Apply the layout metrics cached for this version/locale/DPI in one pass,
+	// or run the measurement passes and cache the result for the next startup
+	if (!LoadLayoutCache(hDlg)) {
+		GetBasicControlsWidth(hDlg);
+		GetMainButtonsWidth(hDlg);
+		GetHalfDropwdownWidth(hDlg);
+		GetFullWidth(hDlg);
+		SaveLayoutCache(hDlg);
+	}
 
 	// Set some missing labels
 	SetAccessibleName(hNBPasses, lmprintf(MSG_316));
@@ -1934,6 +2195,8 @@ static void InitDialog(HWND hDlg)
 		msg = (i == 1) ? lmprintf(MSG_034, 1) : lmprintf(MSG_035, (i == 2) ? 2 : 4, (i == 2) ? "" : lmprintf(MSG_087, flash_type[i - 3]));
 		IGNORE_RETVAL(ComboBox_AddStringU(hNBPasses, msg));
 	}
+	IGNORE_RETVAL(ComboBox_AddStringU(hNBPasses, lmprintf(MSG_326)));
+	IGNORE_RETVAL(ComboBox_AddStringU(hNBPasses, lmprintf(MSG_327)));
 	IGNORE_RETVAL(ComboBox_SetCurSel(hNBPasses, 0));
 	SetPassesTooltip();
 
@@ -1948,10 +2211,10 @@ static void InitDialog(HWND hDlg)
 	IGNORE_RETVAL(ComboBox_SetCurSel(hDiskID, 0));
 
 	// Create the string arrays
-	StrArrayCreate(&DriveId, MAX_DRIVES);
-	StrArrayCreate(&DriveName, MAX_DRIVES);
-	StrArrayCreate(&DriveLabel, MAX_DRIVES);
-	StrArrayCreate(&DriveHub, MAX_DRIVES);
+	StrArrayCreateArena(&DriveId, MAX_DRIVES, 4096);
+	StrArrayCreateArena(&DriveName, MAX_DRIVES, 4096);
+	StrArrayCreateArena(&DriveLabel, MAX_DRIVES, 4096);
+	StrArrayCreateArena(&DriveHub, MAX_DRIVES, 4096);
 	StrArrayCreate(&BlockingProcess, 16);
 	StrArrayCreate(&ImageList, 16);
 	// Set various checkboxes
@@ -2021,8 +2284,12 @@ static void SaveVHD(void)
 	static IMG_SAVE img_save = { 0 };
 	char filename[128];
 	char path[MAX_PATH];
+	size_t len;
 	int DriveIndex = ComboBox_GetCurSel(hDeviceList);
 	EXT_DECL(img_ext, filename, __VA_GROUP__("*.vhd"), __VA_GROUP__(lmprintf(MSG_095)));
+	// Only offer FFU capture if the platform's dism can handle it
+	EXT_DECL(img_ext_ffu, filename, __VA_GROUP__("*.vhd", "*.ffu"),
+		__VA_GROUP__(lmprintf(MSG_095), "Full Flash Update image"));
 	ULARGE_INTEGER free_space;
 
 	if ((DriveIndex < 0) || (format_thread != NULL))
@@ -2031,9 +2298,12 @@ static void SaveVHD(void)
 	static_sprintf(filename, "%s.vhd", DriveLabel.String[DriveIndex]);
 	img_save.Type = IMG_SAVE_TYPE_VHD;
 	img_save.DeviceNum = (DWORD)ComboBox_GetItemData(hDeviceList, DriveIndex);
-	img_save.ImagePath = FileDialog(TRUE, NULL, &img_ext, 0);
+	img_save.ImagePath = FileDialog(TRUE, NULL, HasFfuSupport() ? &img_ext_ffu : &img_ext, 0);
 	img_save.BufSize = DD_BUFFER_SIZE;
 	img_save.DeviceSize = SelectedDrive.DiskSize;
+	len = safe_strlen(img_save.ImagePath);
+	if ((len > 4) && (stricmp(&img_save.ImagePath[len - 4], ".ffu") == 0))
+		img_save.Type = IMG_SAVE_TYPE_FFU;
 	if (img_save.ImagePath != NULL) {
 		// Reset all progress bars
 		SendMessage(hMainDialog, UM_PROGRESS_INIT, 0, 0);
@@ -2075,7 +2345,8 @@ static void SaveISO(void)
 {
 	static IMG_SAVE img_save = { 0 };
 	char filename[33] = "disc_image.iso";
-	EXT_DECL(img_ext, filename, __VA_GROUP__("*.iso"), __VA_GROUP__(lmprintf(MSG_036)));
+	EXT_DECL(img_ext, filename, __VA_GROUP__("*.iso", "*.iso.gz"),
+		__VA_GROUP__(lmprintf(MSG_036), "Gzipped ISO Image"));
 
 	if (op_in_progress || (format_thread != NULL))
 		return;
@@ -2582,11 +2853,7 @@ static INT_PTR CALLBACK MainCallback(HWND hDlg, UINT message, WPARAM wParam, LPA
 						free(old_image_path);
 					}
 				}
-				FormatStatus = 0;
-				if (CreateThread(NULL, 0, ImageScanThread, NULL, 0, NULL) == NULL) {
-					uprintf("Unable to start ISO scanning thread");
-					FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | APPERR(ERROR_CANT_START_THREAD);
-				}
+				StartImageScan();
 			}
 			break;
 		case IDC_RUFUS_MBR:
@@ -2660,6 +2927,10 @@ static INT_PTR CALLBACK MainCallback(HWND hDlg, UINT message, WPARAM wParam, LPA
 		case IDC_SAVE:
 			SaveVHD();
 			break;
+		case IDC_BENCHMARK:
+			if (!op_in_progress && (format_thread == NULL) && (ComboBox_GetCurSel(hDeviceList) >= 0))
+				MyDialogBox(hMainInstance, IDD_BENCHMARK, hDlg, BenchmarkCallback);
+			break;
 		case IDM_SELECT:
 		case IDM_DOWNLOAD:
 			select_index = LOWORD(wParam) - IDM_SELECT;
@@ -2674,6 +2945,29 @@ static INT_PTR CALLBACK MainCallback(HWND hDlg, UINT message, WPARAM wParam, LPA
 		ShowWindow(GetDlgItem(hMainDialog, IDS_CSM_HELP_TXT), ((target_type == TT_UEFI) || has_uefi_csm) ? SW_SHOW : SW_HIDE);
 		CreateTooltip(GetDlgItem(hMainDialog, IDS_CSM_HELP_TXT), lmprintf((target_type == TT_UEFI) ? MSG_152 : MSG_151), 30000);
 		break;
+	case UM_DRIVE_PROPS_READY:
+		if (drive_props_thread == NULL)
+			break;
+		WaitForSingleObject(drive_props_thread, INFINITE);
+		CloseHandle(drive_props_thread);
+		drive_props_thread = NULL;
+		if (drive_props_pending != 0) {
+			// The user switched device while we were collecting - discard
+			// this result and collect the latest selection instead
+			DeviceNum = drive_props_pending;
+			drive_props_pending = 0;
+			StartDrivePropsThread(DeviceNum);
+			break;
+		}
+		if ((DWORD)lParam != SelectedDrive.DeviceNumber)
+			break;
+		// Snapshot the pristine collected data (DiskSize == 0 means collection failed)
+		if (SelectedDrive.DiskSize != 0)
+			CacheDriveProps((DWORD)lParam);
+		PopulatePropertiesPost();
+		SendMessage(hMainDialog, WM_COMMAND, (CBN_SELCHANGE_INTERNAL << 16) | IDC_FILE_SYSTEM,
+			ComboBox_GetCurSel(hFileSystem));
+		break;
 	case UM_ENABLE_CONTROLS:
 		KillTimer(hMainDialog, TID_APP_TIMER);
 		if (!IS_ERROR(FormatStatus))
@@ -2704,10 +2998,56 @@ static INT_PTR CALLBACK MainCallback(HWND hDlg, UINT message, WPARAM wParam, LPA
 		SetWindowTextU(GetDlgItem(hDlg, IDC_SELECT), uppercase_select[0]);
 		SendMessage(hDlg, WM_COMMAND, IDC_SELECT, 0);
 		break;
+	case UM_DEFERRED_INIT:
+		// Non-critical initialization, posted from WM_INITDIALOG so that it only
+		// runs once the main window has been displayed
+		// The AppStore version always enables Fido
+		if (appstore_version)
+			SetFidoCheck();
+		else
+			SetUpdateCheck();
+		// The AppStore version does not need the internal check for updates
+		if (!appstore_version)
+			CheckForUpdates(FALSE);
+		// Warm the shared Internet session up in the background, so the first
+		// interactive download starts transferring without connection setup
+		WarmupInternetSession();
+		// Likewise, fetch the revocation data for our signing chain ahead of the
+		// signed-file validations that downloads will trigger
+		PrefetchRevocationData();
+		return (INT_PTR)TRUE;
+	case UM_IMAGE_SCAN_EXIT:
+		safe_closehandle(image_scan_thread);
+		if (queued_image_path != NULL) {
+			// A new selection preempted the scan that just exited - process it now
+			safe_free(image_path);
+			image_path = queued_image_path;
+			queued_image_path = NULL;
+			StartImageScan();
+		} else if (batch_mode && !batch_started) {
+			// Unattended mode: the image has been scanned, so kick off the operation,
+			// provided we positively identified the requested target device
+			if (image_path == NULL) {
+				uprintf("Batch mode: no usable image was provided - aborting");
+				PostQuitMessage(ERROR_FILE_NOT_FOUND);
+			} else if ((batch_device < 0) || (ComboBox_GetCurSel(hDeviceList) < 0) ||
+				((DWORD)ComboBox_GetCurItemData(hDeviceList) != (DWORD)(DRIVE_INDEX_MIN + batch_device))) {
+				// Never fall back to formatting whatever device happens to be selected
+				uprintf("Batch mode: could not select target device %d - aborting", batch_device);
+				PostQuitMessage(ERROR_FILE_NOT_FOUND);
+			} else {
+				batch_started = TRUE;
+				uprintf("Batch mode: starting operation on device %d", batch_device);
+				PostMessage(hDlg, WM_COMMAND, (WPARAM)IDC_START, 0);
+			}
+		}
+		return (INT_PTR)TRUE;
 	case UM_MEDIA_CHANGE:
 		wParam = DBT_CUSTOMEVENT;
 		// Fall through
 	case WM_DEVICECHANGE:
+		// The drive letter mappings may have changed behind our back
+		InvalidateDriveLettersSnapshot();
 		// The Windows hotplug subsystem sucks. Among other things, if you insert a GPT partitioned
 		// USB drive with zero partitions, the only device messages you will get are a stream of
 		// DBT_DEVNODES_CHANGED and that's it. But those messages are also issued when you get a
@@ -2722,11 +3062,20 @@ static INT_PTR CALLBACK MainCallback(HWND hDlg, UINT message, WPARAM wParam, LPA
 			switch (wParam) {
 			case DBT_DEVICEARRIVAL:
 			case DBT_DEVICEREMOVECOMPLETE:
+				// Plugging a populated hub produces a storm of arrival messages in
+				// quick succession. Coalesce the burst by (re)arming a short timer
+				// on each message, so that a single enumeration is performed once
+				// the events have settled.
+				LastRefresh = GetTickCount64();
+				SetTimer(hMainDialog, TID_REFRESH_TIMER, 250, RefreshTimer);
+				return (INT_PTR)TRUE;
 			case DBT_CUSTOMEVENT:	// Sent by our timer refresh function or for card reader media change
 				LastRefresh = GetTickCount64();
 				KillTimer(hMainDialog, TID_REFRESH_TIMER);
 				if (!op_in_progress) {
 					queued_hotplug_event = FALSE;
+					// The partition data of any drive may have changed behind our back
+					InvalidateDrivePropsCache();
 					GetDevices((DWORD)ComboBox_GetCurItemData(hDeviceList));
 					user_changed_label = FALSE;
 					EnableControls(TRUE, FALSE);
@@ -2759,21 +3108,23 @@ static INT_PTR CALLBACK MainCallback(HWND hDlg, UINT message, WPARAM wParam, LPA
 		fScale = GetDeviceCaps(hDC, LOGPIXELSX) / 96.0f;
 		safe_release_dc(hDlg, hDC);
 		apply_localization(IDD_DIALOG, hDlg);
-		// The AppStore version always enables Fido
-		if (appstore_version)
-			SetFidoCheck();
-		else
-			SetUpdateCheck();
+		LogStartupPhase("dialog localization");
 		first_log_display = TRUE;
 		log_displayed = FALSE;
 		hLogDialog = MyCreateDialog(hMainInstance, IDD_LOG, hDlg, (DLGPROC)LogCallback);
 		InitDialog(hDlg);
-		GetDevices(0);
+		LogStartupPhase("dialog initialization");
+		// In batch mode, have the device list select the requested physical drive
+		GetDevices((batch_mode && (batch_device >= 0)) ? (DWORD)(DRIVE_INDEX_MIN + batch_device) : 0);
+		LogStartupPhase("device enumeration");
 		EnableControls(TRUE, FALSE);
 		UpdateImage(FALSE);
-		// The AppStore version does not need the internal check for updates
-		if (!appstore_version)
-			CheckForUpdates(FALSE);
+		// Defer the update check setup and network warmups until after the first
+		// paint of the main window, as none of them are needed to interact with
+		// the UI and the update policy prompt on first run is modal
+		PostMessage(hDlg, UM_DEFERRED_INIT, 0, 0);
+		// Render worker thread progress updates from the UI thread (see _UpdateProgressWithInfo)
+		StartProgressCoalescing();
 		// Register MEDIA_INSERTED/MEDIA_REMOVED notifications for card readers
 		if (SUCCEEDED(SHGetSpecialFolderLocation(0, CSIDL_DESKTOP, &pidlDesktop))) {
 			NotifyEntry.pidl = pidlDesktop;
@@ -2986,7 +3337,9 @@ static INT_PTR CALLBACK MainCallback(HWND hDlg, UINT message, WPARAM wParam, LPA
 		// All subsequent aborts below translate to a user cancellation
 		wParam = BOOTCHECK_CANCEL;
 
-		if ((partition_type == PARTITION_STYLE_MBR) && (SelectedDrive.DiskSize > 2 * TB)) {
+		// In batch mode, all the confirmation prompts below are skipped - the caller
+		// explicitly designated the target device and asked for an unattended run
+		if (!batch_mode && (partition_type == PARTITION_STYLE_MBR) && (SelectedDrive.DiskSize > 2 * TB)) {
 			if (MessageBoxExU(hMainDialog, lmprintf(MSG_134, SizeToHumanReadable(SelectedDrive.DiskSize - 2 * TB, FALSE, FALSE)),
 				lmprintf(MSG_128, "MBR"), MB_YESNO | MB_ICONWARNING | MB_IS_RTL, selected_langid) != IDYES)
 				goto aborted_start;
@@ -2998,8 +3351,9 @@ static INT_PTR CALLBACK MainCallback(HWND hDlg, UINT message, WPARAM wParam, LPA
 			if (dur_secs > UDF_FORMAT_WARN) {
 				dur_mins = dur_secs / 60;
 				dur_secs -= dur_mins * 60;
-				MessageBoxExU(hMainDialog, lmprintf(MSG_112, dur_mins, dur_secs), lmprintf(MSG_113),
-					MB_OK | MB_ICONASTERISK | MB_IS_RTL, selected_langid);
+				if (!batch_mode)
+					MessageBoxExU(hMainDialog, lmprintf(MSG_112, dur_mins, dur_secs), lmprintf(MSG_113),
+						MB_OK | MB_ICONASTERISK | MB_IS_RTL, selected_langid);
 			} else {
 				dur_secs = 0;
 				dur_mins = 0;
@@ -3010,13 +3364,13 @@ static INT_PTR CALLBACK MainCallback(HWND hDlg, UINT message, WPARAM wParam, LPA
 			goto aborted_start;
 
 		GetWindowTextU(hDeviceList, tmp, ARRAYSIZE(tmp));
-		if (MessageBoxExU(hMainDialog, lmprintf(MSG_003, tmp),
+		if (!batch_mode && MessageBoxExU(hMainDialog, lmprintf(MSG_003, tmp),
 			APPLICATION_NAME, MB_OKCANCEL | MB_ICONWARNING | MB_IS_RTL, selected_langid) == IDCANCEL)
 			goto aborted_start;
-		if ((SelectedDrive.nPartitions > 1) && (MessageBoxExU(hMainDialog, lmprintf(MSG_093),
+		if (!batch_mode && (SelectedDrive.nPartitions > 1) && (MessageBoxExU(hMainDialog, lmprintf(MSG_093),
 			lmprintf(MSG_094), MB_OKCANCEL | MB_ICONWARNING | MB_IS_RTL, selected_langid) == IDCANCEL))
 			goto aborted_start;
-		if ((!zero_drive) && (boot_type != BT_NON_BOOTABLE) && (SelectedDrive.SectorSize != 512) &&
+		if (!batch_mode && (!zero_drive) && (boot_type != BT_NON_BOOTABLE) && (SelectedDrive.SectorSize != 512) &&
 			(MessageBoxExU(hMainDialog, lmprintf(MSG_196, SelectedDrive.SectorSize),
 				lmprintf(MSG_197), MB_OKCANCEL | MB_ICONWARNING | MB_IS_RTL, selected_langid) == IDCANCEL))
 			goto aborted_start;
@@ -3024,7 +3378,14 @@ static INT_PTR CALLBACK MainCallback(HWND hDlg, UINT message, WPARAM wParam, LPA
 		nDeviceIndex = ComboBox_GetCurSel(hDeviceList);
 		DeviceNum = (DWORD)ComboBox_GetItemData(hDeviceList, nDeviceIndex);
 		InitProgress(zero_drive || write_as_image);
-		format_thread = CreateThread(NULL, 0, FormatThread, (LPVOID)(uintptr_t)DeviceNum, 0, NULL);
+		if (CanResizePersistence(DeviceNum)) {
+			// Same drive, image and layout with only a new persistence size ->
+			// resize the persistence partition instead of rebuilding the drive
+			uprintf("Only the persistence size changed - using fast resize path");
+			format_thread = CreateThread(NULL, 0, PersistenceResizeThread, (LPVOID)(uintptr_t)DeviceNum, 0, NULL);
+		} else {
+			format_thread = CreateThread(NULL, 0, FormatThread, (LPVOID)(uintptr_t)DeviceNum, 0, NULL);
+		}
 		if (format_thread == NULL) {
 			uprintf("Unable to start formatting thread");
 			FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | APPERR(ERROR_CANT_START_THREAD);
@@ -3040,6 +3401,12 @@ static INT_PTR CALLBACK MainCallback(HWND hDlg, UINT message, WPARAM wParam, LPA
 			break;
 	aborted_start:
 		zero_drive = FALSE;
+		if (batch_mode) {
+			// No user to hand control back to
+			uprintf("Batch mode: operation was aborted before it could start");
+			PostQuitMessage(ERROR_CANCELLED);
+			break;
+		}
 		if (queued_hotplug_event)
 			SendMessage(hDlg, UM_MEDIA_CHANGE, 0, 0);
 		if (wParam == BOOTCHECK_CANCEL) {
@@ -3053,6 +3420,8 @@ static INT_PTR CALLBACK MainCallback(HWND hDlg, UINT message, WPARAM wParam, LPA
 	case UM_FORMAT_COMPLETED:
 		zero_drive = FALSE;
 		format_thread = NULL;
+		// Formatting just rewrote the partition data we had cached
+		InvalidateDrivePropsCache();
 		// Stop the timer
 		KillTimer(hMainDialog, TID_APP_TIMER);
 		// Close the cancel MessageBox and Blocking notification if active
@@ -3060,6 +3429,16 @@ static INT_PTR CALLBACK MainCallback(HWND hDlg, UINT message, WPARAM wParam, LPA
 		SendMessage(FindWindowA(MAKEINTRESOURCEA(32770), lmprintf(MSG_049)), WM_COMMAND, IDYES, 0);
 		EnableWindow(GetDlgItem(hMainDialog, IDCANCEL), TRUE);
 		EnableControls(TRUE, FALSE);
+		if (batch_mode) {
+			// Unattended run: skip the interactive post-format notifications and
+			// report the outcome through the process exit code
+			if (!IS_ERROR(FormatStatus))
+				uprintf("\r\nBatch mode: operation completed successfully");
+			else
+				uprintf("\r\nBatch mode: operation failed - %s", StrError(FormatStatus, FALSE));
+			PostQuitMessage(IS_ERROR(FormatStatus) ? (int)SCODE_CODE(FormatStatus) : 0);
+			break;
+		}
 		if (wParam) {
 			uprintf("\r\n");
 			GetDevices(DeviceNum);
@@ -3137,17 +3516,27 @@ static void PrintUsage(char* appname)
 	char fname[_MAX_FNAME];
 
 	_splitpath(appname, NULL, NULL, fname, NULL);
-	printf("\nUsage: %s [-x] [-g] [-h] [-f FILESYSTEM] [-i PATH] [-l LOCALE] [-w TIMEOUT]\n", fname);
+	printf("\nUsage: %s [-b] [-x] [-g] [-h] [-f FILESYSTEM] [-i PATH] [-m PATH] [-l LOCALE] [-s DRIVE] [-w TIMEOUT]\n", fname);
+	printf("  -b, --batch\n");
+	printf("     Run unattended: start as soon as the image selected with --iso has been\n");
+	printf("     scanned, without confirmation prompts, and exit with the operation status.\n");
+	printf("     Requires --iso and --select. The window is not displayed.\n");
 	printf("  -x, --extra-devs\n");
 	printf("     List extra devices, such as USB HDDs\n");
 	printf("  -g, --gui\n");
 	printf("     Start in GUI mode (disable the 'rufus.com' commandline hogger)\n");
 	printf("  -i PATH, --iso=PATH\n");
 	printf("     Select the ISO image pointed by PATH to be used on startup\n");
+	printf("  -m PATH, --import-image=PATH\n");
+	printf("     Import the image pointed by PATH into the local dedup store, producing\n");
+	printf("     a '.rcm' chunk manifest that can be selected in place of the image\n");
 	printf("  -l LOCALE, --locale=LOCALE\n");
 	printf("     Select the locale to be used on startup\n");
 	printf("  -f FILESYSTEM, --filesystem=FILESYSTEM\n");
 	printf("     Preselect the file system to be preferred when formatting\n");
+	printf("  -s DRIVE, --select=DRIVE\n");
+	printf("     Select the physical drive number (e.g. 1 for '\\\\.\\PhysicalDrive1') to be\n");
+	printf("     used as the target on startup. Mandatory when using --batch.\n");
 	printf("  -w TIMEOUT, --wait=TIMEOUT\n");
 	printf("     Wait TIMEOUT tens of seconds for the global application mutex to be released.\n");
 	printf("     Used when launching a newer version of " APPLICATION_NAME " from a running application.\n");
@@ -3226,29 +3615,33 @@ int WINAPI WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpCmdLine
 {
 	const char* rufus_loc = "rufus.loc";
 	int i, opt, option_index = 0, argc = 0, si = 0, lcid = GetUserDefaultUILanguage();
-	int wait_for_mutex = 0;
+	int wait_for_mutex = 0, exit_code = 0;
 	FILE* fd;
 	BOOL attached_console = FALSE, external_loc_file = FALSE, lgp_set = FALSE, automount = TRUE;
 	BOOL disable_hogger = FALSE, previous_enable_HDDs = FALSE, vc = IsRegistryNode(REGKEY_HKCU, vs_reg);
 	BOOL alt_pressed = FALSE, alt_command = FALSE;
 	BYTE *loc_data;
+	uint64_t startup_ts = GetTickCount64();
 	DWORD loc_size, u = 0, size = sizeof(u);
 	char tmp_path[MAX_PATH] = "", loc_file[MAX_PATH] = "", ini_path[MAX_PATH] = "", ini_flags[] = "rb";
 	char *tmp, *locale_name = NULL, **argv = NULL;
 	wchar_t **wenv, **wargv;
 	PF_TYPE_DECL(CDECL, int, __wgetmainargs, (int*, wchar_t***, wchar_t***, int, int*));
 	PF_TYPE_DECL(WINAPI, BOOL, SetDefaultDllDirectories, (DWORD));
-	HANDLE mutex = NULL, hogmutex = NULL, hFile = NULL;
+	HANDLE mutex = NULL, hogmutex = NULL;
 	HWND hDlg = NULL;
 	HDC hDC;
 	MSG msg;
 	struct option long_options[] = {
+		{"batch",      no_argument,       NULL, 'b'},
 		{"extra-devs", no_argument,       NULL, 'x'},
 		{"gui",        no_argument,       NULL, 'g'},
 		{"help",       no_argument,       NULL, 'h'},
+		{"import-image", required_argument, NULL, 'm'},
 		{"iso",        required_argument, NULL, 'i'},
 		{"locale",     required_argument, NULL, 'l'},
 		{"filesystem", required_argument, NULL, 'f'},
+		{"select",     required_argument, NULL, 's'},
 		{"wait",       required_argument, NULL, 'w'},
 		{0, 0, NULL, 0}
 	};
@@ -3276,6 +3669,7 @@ int WINAPI WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpCmdLine
 		pfSetDefaultDllDirectories(LOAD_LIBRARY_SEARCH_SYSTEM32);
 
 	uprintf("*** " APPLICATION_NAME " init ***\n");
+	LogStartupPhase(NULL);
 	its_a_me_mario = GetUserNameA((char*)(uintptr_t)&u, &size) && (u == 7104878);
 	// coverity[pointless_string_compare]
 	is_x86_32 = (strcmp(APPLICATION_ARCH, "x86") == 0);
@@ -3383,8 +3777,11 @@ int WINAPI WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpCmdLine
 				}
 			}
 
-			while ((opt = getopt_long(argc, argv, "xghf:i:w:l:", long_options, &option_index)) != EOF) {
+			while ((opt = getopt_long(argc, argv, "bxghf:i:m:w:l:s:", long_options, &option_index)) != EOF) {
 				switch (opt) {
+				case 'b':
+					batch_mode = TRUE;
+					break;
 				case 'x':
 					enable_HDDs = TRUE;
 					break;
@@ -3426,6 +3823,21 @@ int WINAPI WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpCmdLine
 						preselected_fs = FS_UNKNOWN;
 					selected_fs = preselected_fs;
 					break;
+				case 'm':
+					// Import an image into the local dedup store, then exit.
+					// The resulting '<image>.rcm' manifest can be selected in
+					// place of the image for any subsequent write.
+					if (_access(optarg, 0) != -1) {
+						exit_code = CdcImportImage(optarg) ? 0 : ERROR_GEN_FAILURE;
+						printf("Image import %s\n", (exit_code == 0) ? "succeeded" : "failed");
+					} else {
+						printf("Could not find image '%s'\n", optarg);
+						exit_code = ERROR_FILE_NOT_FOUND;
+					}
+					goto out;
+				case 's':
+					batch_device = atoi(optarg);
+					break;
 				case 'w':
 					wait_for_mutex = atoi(optarg);
 					break;
@@ -3449,6 +3861,13 @@ int WINAPI WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpCmdLine
 	}
 
 skip_args_processing:
+	if (batch_mode && (!img_provided || (batch_device < 0))) {
+		// Without both an image and an explicit target there is nothing we can safely
+		// run unattended, and waiting for user input would defeat the purpose
+		printf("Batch mode requires both --iso and --select\n");
+		exit_code = ERROR_INVALID_PARAMETER;
+		goto out;
+	}
 	if (appstore_version)
 		uprintf("AppStore version detected");
 
@@ -3465,6 +3884,8 @@ skip_args_processing:
 		fclose(fd);
 	}
 	uprintf("Will use settings from %s", (ini_file != NULL)?"INI file":"registry");
+	// Bulk-load the settings and start the write-behind flusher
+	SettingsInit();
 
 	// Use the locale specified by the settings, if any
 	tmp = ReadSettingStr(SETTING_LOCALE);
@@ -3480,8 +3901,15 @@ skip_args_processing:
 	use_fake_units = !ReadSettingBool(SETTING_USE_PROPER_SIZE_UNITS);
 	is_vds_available = IsVdsAvailable(FALSE);
 	use_vds = ReadSettingBool(SETTING_USE_VDS) && is_vds_available;
+	use_unbuffered_io = ReadSettingBool(SETTING_USE_UNBUFFERED_IO);
+	use_differential_write = ReadSettingBool(SETTING_USE_DIFFERENTIAL_WRITE);
+	verify_writes = ReadSettingBool(SETTING_ENABLE_WRITE_VERIFICATION);
 	usb_debug = ReadSettingBool(SETTING_ENABLE_USB_DEBUG);
 	cdio_loglevel_default = usb_debug ? CDIO_LOG_DEBUG : CDIO_LOG_WARN;
+	// Shared memory log channel for external monitors
+	enable_log_section = ReadSettingBool(SETTING_ENABLE_LOG_SECTION);
+	if (enable_log_section)
+		OpenLogSection();
 	detect_fakes = !ReadSettingBool(SETTING_DISABLE_FAKE_DRIVES_CHECK);
 	allow_dual_uefi_bios = ReadSettingBool(SETTING_ENABLE_WIN_DUAL_EFI_BIOS);
 	force_large_fat32 = ReadSettingBool(SETTING_FORCE_LARGE_FAT32_FORMAT);
@@ -3493,6 +3921,8 @@ skip_args_processing:
 	// We want above normal priority by default, so we offset the value.
 	default_thread_priority = ReadSetting32(SETTING_DEFAULT_THREAD_PRIORITY) + THREAD_PRIORITY_ABOVE_NORMAL;
 
+	LogStartupPhase("command line and settings processing");
+
 	// Initialize the global scaling, in case we need it before we initialize the dialog
 	hDC = GetDC(NULL);
 	fScale = GetDeviceCaps(hDC, LOGPIXELSX) / 96.0f;
@@ -3506,20 +3936,14 @@ skip_args_processing:
 		uprintf("loc file not found in current directory - embedded one will be used");
 
 		loc_data = (BYTE*)GetResource(hMainInstance, MAKEINTRESOURCEA(IDR_LC_RUFUS_LOC), _RT_RCDATA, "embedded.loc", &loc_size, FALSE);
-		if ( (GetTempFileNameU(temp_dir, APPLICATION_NAME, 0, loc_file) == 0) || (loc_file[0] == 0) ) {
-			// Last ditch effort to get a loc file - just extract it to the current directory
-			static_strcpy(loc_file, rufus_loc);
-		}
-
-		hFile = CreateFileU(loc_file, GENERIC_READ|GENERIC_WRITE, FILE_SHARE_READ,
-			NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
-		if ((hFile == INVALID_HANDLE_VALUE) || (!WriteFileWithRetry(hFile, loc_data, loc_size, &size, WRITE_RETRIES))) {
-			uprintf("localization: unable to extract '%s': %s", loc_file, WindowsErrorString());
-			safe_closehandle(hFile);
+		if (loc_data == NULL) {
+			uprintf("localization: unable to access the embedded loc data");
 			goto out;
 		}
-		uprintf("localization: extracted data to '%s'", loc_file);
-		safe_closehandle(hFile);
+		// Have the parser consume the resource data straight from memory, rather than
+		// paying a multi-hundred KB write + read to an AV-scanned temp directory
+		set_loc_buffer((char*)loc_data, (long)loc_size);
+		static_strcpy(loc_file, embedded_loc_filename);
 	} else {
 		static_sprintf(loc_file, "%s\\%s", app_dir, rufus_loc);
 		external_loc_file = TRUE;
@@ -3534,9 +3958,11 @@ skip_args_processing:
 		goto out;
 	}
 	selected_langid = get_language_id(selected_locale);
+	LogStartupPhase("locale setup");
 
 	// Set the Windows version
 	GetWindowsVersion();
+	LogStartupPhase("Windows version detection");
 
 	// ...and nothing of value was lost
 	if (nWindowsVersion < WINDOWS_7) {
@@ -3606,6 +4032,7 @@ skip_args_processing:
 		if (!SetAutoMount(TRUE))
 			uprintf("Failed to enable AutoMount");
 	}
+	LogStartupPhase("system policies setup");
 
 relaunch:
 	ubprintf("Localization set to '%s'", selected_locale->txt[0]);
@@ -3652,8 +4079,15 @@ relaunch:
 	if (!SetAlertPromptHook())
 		uprintf("Warning: Could not set alert prompt hook");
 
-	ShowWindow(hDlg, SW_SHOWNORMAL);
+	// In batch mode the dialog still needs to exist, since the format operation reads
+	// its state from the dialog controls, but it doesn't need to be displayed
+	ShowWindow(hDlg, batch_mode ? SW_HIDE : SW_SHOWNORMAL);
 	UpdateWindow(hDlg);
+	LogStartupPhase("main dialog creation");
+	if (startup_ts != 0) {
+		uprintf("Startup: first paint %llu ms after launch", GetTickCount64() - startup_ts);
+		startup_ts = 0;
+	}
 
 	// Do our own event processing and process "magic" commands
 	while(GetMessage(&msg, NULL, 0, 0)) {
@@ -3699,6 +4133,8 @@ relaunch:
 			&& (msg.wParam == 'T')) {
 			//extern int TestChecksum(void);
 			//TestChecksum();
+			//extern int BenchmarkSuite(void);
+			//BenchmarkSuite();
 			ListVdsVolumes(FALSE);
 			continue;
 		}
@@ -3978,6 +4414,18 @@ relaunch:
 				continue;
 			}
 
+			// Ctrl-Alt-M => Flash every other listed drive in parallel with the selected one - CAUTION!!!
+			if ((msg.message == WM_KEYDOWN) && (msg.wParam == 'M') &&
+				(GetKeyState(VK_CONTROL) & 0x8000) && (GetKeyState(VK_MENU) & 0x8000)) {
+				enable_multi_target = !enable_multi_target;
+				PrintStatusTimeout("Multi-target writes", enable_multi_target);
+				uprintf("%sMulti-target writes %s", enable_multi_target ? "CAUTION: " : "",
+					enable_multi_target ? "enabled" : "disabled");
+				if (enable_multi_target)
+					uprintf("In DD image mode, EVERY OTHER LISTED DRIVE large enough for the image WILL BE OVERWRITTEN!");
+				continue;
+			}
+
 			// Ctrl-Alt-Y => Force update check to be successful and ignore timestamp errors
 			if ((msg.message == WM_KEYDOWN) && (msg.wParam == 'Y') &&
 				(GetKeyState(VK_CONTROL) & 0x8000) && (GetKeyState(VK_MENU) & 0x8000)) {
@@ -4002,6 +4450,8 @@ relaunch:
 			DispatchMessage(&msg);
 		}
 	}
+	// Preserve the WM_QUIT exit code, so that batch mode can report the operation status
+	exit_code = (int)msg.wParam;
 	if (hFidoDlg != NULL)
 		SendMessage(hFidoDlg, WM_CLOSE, 0, 0);
 	if (relaunch) {
@@ -4019,10 +4469,15 @@ out:
 	// Kill the update check thread if running
 	if (update_check_thread != NULL)
 		TerminateThread(update_check_thread, 1);
-	if ((!external_loc_file) && (loc_file[0] != 0))
+	if ((!external_loc_file) && (loc_file[0] != 0) && (safe_strcmp(loc_file, embedded_loc_filename) != 0))
 		DeleteFileU(loc_file);
 	DestroyAllTooltips();
 	ClrAlertPromptHook();
+	CloseLogSection();
+	CloseDirHandleCache();
+	FreeIoBufferPool();
+	// Commit any settings still pending in the write-behind cache
+	SettingsExit();
 	exit_localization();
 	safe_free(image_path);
 	safe_free(archive_path);
@@ -4057,5 +4512,5 @@ out:
 	_CrtDumpMemoryLeaks();
 #endif
 
-	return 0;
+	return exit_code;
 }
@@ -74,6 +74,7 @@
 #define MAX_REFRESH                 25			// How long we should wait to refresh UI elements (in ms)
 #define MAX_GUID_STRING_LENGTH      40
 #define MAX_PARTITIONS              16			// Maximum number of partitions we handle
+#define MAX_TARGET_DRIVES           4			// Maximum number of drives we can flash in parallel
 #define MAX_ESP_TOGGLE              8			// Maximum number of entries we record to toggle GPT ESP back and forth
 #define MAX_ISO_TO_ESP_SIZE         512			// Maximum size we allow for the ISO → ESP option (in MB)
 #define MAX_DEFAULT_LIST_CARD_SIZE  200			// Size above which we don't list a card without enable HDD or Alt-F (in GB)
@@ -85,6 +86,7 @@
 #define STATUS_MSG_TIMEOUT          3500		// How long should cheat mode messages appear for on the status bar
 #define WRITE_RETRIES               4
 #define WRITE_TIMEOUT               5000		// How long we should wait between write retries (in ms)
+#define WRITE_BACKOFF               50			// Initial wait between write retries (in ms), escalated up to WRITE_TIMEOUT
 #if defined(_DEBUG)
 #define SEARCH_PROCESS_TIMEOUT      60000
 #else
@@ -107,7 +109,8 @@
 #define UDF_FORMAT_WARN             20			// Duration (in seconds) above which we warn about long UDF formatting times
 #define MAX_FAT32_SIZE              2.0f		// Threshold above which we disable FAT32 formatting (in TB)
 #define FAT32_CLUSTER_THRESHOLD     1.011f		// For FAT32, cluster size changes don't occur at power of 2 boundaries but slightly above
-#define DD_BUFFER_SIZE              (32 * 1024 * 1024)	// Minimum size of buffer to use for DD operations
+#define DD_BUFFER_SIZE              (64 * 1024 * 1024)	// Maximum size of transfer to use for DD operations
+#define DD_MIN_TRANSFER_SIZE        (2 * 1024 * 1024)	// Initial size of transfer, before adaptive sizing kicks in
 #define UBUFFER_SIZE                4096
 #define RSA_SIGNATURE_SIZE          256
 #define CBN_SELCHANGE_INTERNAL      (CBN_SELCHANGE + 256)
@@ -172,6 +175,9 @@
 
 extern void _uprintf(const char *format, ...);
 extern void _uprintfs(const char *str);
+extern BOOL OpenLogSection(void);
+extern void CloseLogSection(void);
+extern void LogSectionCounters(int op, uint64_t processed, uint64_t total);
 #define uprintf(...) _uprintf(__VA_ARGS__)
 #define uprintfs(s) _uprintfs(s)
 #define vuprintf(...) do { if (verbose) _uprintf(__VA_ARGS__); } while(0)
@@ -187,6 +193,17 @@ extern void _uprintfs(const char *str);
 #else
 #define duprintf(...)
 #endif
+// Hot-path diagnostics: assertions and per-operation prints that sit inside
+// the inner I/O loops. A performance profile build ('make hotpath', or the
+// RUFUS_HOT_PATH define, which MSVC Release sets) compiles these down to
+// nothing, while all error-path logging remains unconditional.
+#ifdef RUFUS_HOT_PATH
+#define hp_assert(cond)
+#define hpuprintf(...)
+#else
+#define hp_assert(cond) assert(cond)
+#define hpuprintf(...) _uprintf(__VA_ARGS__)
+#endif
 
 /* Custom Windows messages */
 enum user_message_type {
@@ -201,6 +218,12 @@ enum user_message_type {
 	UM_SELECT_ISO,
 	UM_TIMER_START,
 	UM_FORMAT_START,
+	UM_DRIVE_PROPS_READY,
+	UM_LOG_APPEND,
+	UM_DEFERRED_INIT,
+	UM_IMAGE_SCAN_EXIT,
+	UM_BENCHMARK_LINE,
+	UM_BENCHMARK_EXIT,
 	// Start of the WM IDs for the language menu items
 	UM_LANGUAGE_MENU = WM_APP + 0x100
 };
@@ -237,7 +260,8 @@ enum timer_type {
 	TID_APP_TIMER,
 	TID_BLOCKING_TIMER,
 	TID_REFRESH_TIMER,
-	TID_MARQUEE_TIMER
+	TID_MARQUEE_TIMER,
+	TID_PROGRESS_COALESCE
 };
 
 /* Action type, for progress bar breakdown */
@@ -334,6 +358,7 @@ enum checksum_type {
 #define HAS_WIN7_EFI(r)     ((r.has_efi == 1) && HAS_WININST(r))
 #define HAS_EFI_IMG(r)      (r.efi_img_path[0] != 0)
 #define IS_DD_BOOTABLE(r)   (r.is_bootable_img > 0)
+#define IS_REMOTE_IMAGE(p)  ((p != NULL) && ((strncmp(p, "http://", 7) == 0) || (strncmp(p, "https://", 8) == 0)))
 #define IS_DD_ONLY(r)       ((r.is_bootable_img > 0) && (!r.is_iso || r.disable_iso))
 #define IS_EFI_BOOTABLE(r)  (r.has_efi != 0)
 #define IS_BIOS_BOOTABLE(r) (HAS_BOOTMGR(r) || HAS_SYSLINUX(r) || HAS_WINPE(r) || HAS_GRUB(r) || HAS_REACTOS(r) || HAS_KOLIBRIOS(r))
@@ -365,6 +390,8 @@ typedef struct {
 	BOOLEAN is_iso;
 	int8_t is_bootable_img;
 	BOOLEAN is_vhd;
+	BOOLEAN is_ffu_img;
+	BOOLEAN is_cdc_img;
 	BOOLEAN is_windows_img;
 	BOOLEAN disable_iso;
 	BOOLEAN rh8_derivative;
@@ -410,6 +437,7 @@ typedef struct {
 
 #define IMG_SAVE_TYPE_VHD 1
 #define IMG_SAVE_TYPE_ISO 2
+#define IMG_SAVE_TYPE_FFU 3
 
 typedef struct {
 	DWORD Type;
@@ -491,7 +519,7 @@ extern HWND hInfo, hProgress, hDiskID;
 extern WORD selected_langid;
 extern DWORD FormatStatus, DownloadStatus, MainThreadId, LastWriteError;
 extern BOOL use_own_c32[NB_OLD_C32], detect_fakes, op_in_progress, right_to_left_mode;
-extern BOOL allow_dual_uefi_bios, large_drive, usb_debug;
+extern BOOL allow_dual_uefi_bios, large_drive, usb_debug, enable_log_section;
 extern int64_t iso_blocking_status;
 extern uint8_t image_options;
 extern uint16_t rufus_version[3], embedded_sl_version[2];
@@ -512,6 +540,7 @@ extern char app_data_dir[MAX_PATH], *image_path, *fido_url;
 extern void GetWindowsVersion(void);
 extern BOOL is_x64(void);
 extern BOOL GetCpuArch(void);
+extern void* LargeMemcpy(void* dst, const void* src, size_t n);
 extern const char *WindowsErrorString(void);
 extern void DumpBufferHex(void *buf, size_t size);
 extern void PrintStatusInfo(BOOL info, BOOL debug, unsigned int duration, int msg_id, ...);
@@ -552,6 +581,7 @@ extern BOOL ExtractAppIcon(const char* filename, BOOL bSilent);
 extern BOOL ExtractDOS(const char* path);
 extern BOOL ExtractISO(const char* src_iso, const char* dest_dir, BOOL scan);
 extern int64_t ExtractISOFile(const char* iso, const char* iso_file, const char* dest_file, DWORD attributes);
+extern int64_t ExtractISOFileToBuffer(const char* iso, const char* iso_file, uint8_t* buf, size_t size);
 extern BOOL HasEfiImgBootLoaders(void);
 extern BOOL DumpFatDir(const char* path, int32_t cluster);
 extern char* MountISO(const char* path);
@@ -572,7 +602,13 @@ extern LONG GetEntryWidth(HWND hDropDown, const char* entry);
 extern uint64_t DownloadToFileOrBuffer(const char* url, const char* file, BYTE** buffer, HWND hProgressDialog, BOOL bTaskBarProgress);
 extern DWORD DownloadSignedFile(const char* url, const char* file, HWND hProgressDialog, BOOL PromptOnError);
 extern HANDLE DownloadSignedFileThreaded(const char* url, const char* file, HWND hProgressDialog, BOOL bPromptOnError);
+extern void WarmupInternetSession(void);
+extern BOOL StartStreamingDownload(const char* url, uint64_t* size);
+extern int StreamingDownloadRead(uint8_t* buf, DWORD size);
+extern void StopStreamingDownload(void);
+extern BOOL IsStreamingDownloadActive(void);
 extern INT_PTR CALLBACK UpdateCallback(HWND hDlg, UINT message, WPARAM wParam, LPARAM lParam);
+extern INT_PTR CALLBACK BenchmarkCallback(HWND hDlg, UINT message, WPARAM wParam, LPARAM lParam);
 extern void SetFidoCheck(void);
 extern BOOL SetUpdateCheck(void);
 extern BOOL CheckForUpdates(BOOL force);
@@ -586,12 +622,43 @@ extern char* get_token_data_file_indexed(const char* token, const char* filename
 #define get_token_data_file(token, filename) get_token_data_file_indexed(token, filename, 1)
 extern char* set_token_data_file(const char* token, const char* data, const char* filename);
 extern char* get_token_data_buffer(const char* token, unsigned int n, const char* buffer, size_t buffer_size);
+// Cursor-based token scanner, for repeated indexed queries over the same buffer
+typedef struct {
+	wchar_t* wbuffer;
+	wchar_t** wline;
+	uint32_t line_count;
+	char last_token[64];
+	unsigned int last_n;
+	uint32_t last_line;
+} token_scanner;
+extern BOOL token_scanner_init(token_scanner* ts, const char* buffer, size_t buffer_size);
+extern char* token_scanner_get(token_scanner* ts, const char* token, unsigned int n);
+extern void token_scanner_destroy(token_scanner* ts);
 extern char* insert_section_data(const char* filename, const char* section, const char* data, BOOL dos2unix);
 extern char* replace_in_token_data(const char* filename, const char* token, const char* src, const char* rep, BOOL dos2unix);
+extern uint32_t scan_file_for_strings(const char* filename, const char* patterns[], size_t count);
 extern char* replace_char(const char* src, const char c, const char* rep);
 extern void parse_update(char* buf, size_t len);
 extern void* get_data_from_asn1(const uint8_t* buf, size_t buf_len, const char* oid_str, uint8_t asn1_type, size_t* data_len);
+// Content-defined chunking dedup store, see cdc.c
+extern BOOL CdcImportImage(const char* image_path);
+extern BOOL IsCdcManifest(const char* path);
+extern uint64_t CdcManifestSize(const char* path);
+extern BOOL CdcStreamOpen(const char* manifest_path, uint64_t* image_size);
+extern int CdcStreamRead(uint8_t* buf, DWORD size);
+extern void CdcStreamClose(void);
 extern uint8_t WimExtractCheck(BOOL bSilent);
+// WIM extraction session, keeping the wimgapi handles open so that multiple
+// extractions from the same image only pay the WIMLoadImage cost once
+typedef struct {
+	HANDLE hWim;
+	HANDLE hImage;
+	int index;
+	char image[MAX_PATH];
+} WIM_SESSION;
+extern BOOL WimSessionOpen(WIM_SESSION* session, const char* image, int index, BOOL bSilent);
+extern BOOL WimSessionExtract(WIM_SESSION* session, const char* src, const char* dst, BOOL bSilent);
+extern void WimSessionClose(WIM_SESSION* session, BOOL bSilent);
 extern BOOL WimExtractFile(const char* wim_image, int index, const char* src, const char* dst, BOOL bSilent);
 extern BOOL WimExtractFile_API(const char* image, int index, const char* src, const char* dst, BOOL bSilent);
 extern BOOL WimExtractFile_7z(const char* image, int index, const char* src, const char* dst, BOOL bSilent);
@@ -599,19 +666,64 @@ extern BOOL WimApplyImage(const char* image, int index, const char* dst);
 extern char* WimMountImage(const char* image, int index);
 extern BOOL WimUnmountImage(const char* image, int index);
 extern int8_t IsBootableImage(const char* path);
+extern uint32_t GzCompressBound(uint32_t size);
+extern uint32_t GzCompress(uint8_t* dst, uint32_t dst_size, const uint8_t* src, uint32_t src_size);
+#define VHD_FOOTER_SIZE 512
+extern void BuildVHDFooter(uint64_t image_size, void* footer);
 extern BOOL AppendVHDFooter(const char* vhd_path);
+extern BOOL HasFfuSupport(void);
+extern BOOL WriteFfuImage(const char* image, DWORD DriveIndex);
+extern BOOL CaptureFfuImage(const char* image, DWORD DriveIndex);
 extern int SetWinToGoIndex(void);
 extern int IsHDD(DWORD DriveIndex, uint16_t vid, uint16_t pid, const char* strid);
 extern char* GetSignatureName(const char* path, const char* country_code, BOOL bSilent);
 extern uint64_t GetSignatureTimeStamp(const char* path);
 extern LONG ValidateSignature(HWND hDlg, const char* path);
+extern void PrefetchRevocationData(void);
 extern BOOL ValidateOpensslSignature(BYTE* pbBuffer, DWORD dwBufferLen, BYTE* pbSignature, DWORD dwSigLen);
 extern BOOL IsFontAvailable(const char* font_name);
 extern BOOL WriteFileWithRetry(HANDLE hFile, LPCVOID lpBuffer, DWORD nNumberOfBytesToWrite,
 	LPDWORD lpNumberOfBytesWritten, DWORD nNumRetries);
+// Descriptor for a positioned write submitted through WriteFileBatchWithRetry()
+typedef struct {
+	uint64_t Offset;		// Byte offset of the write
+	const void* pBuffer;	// Data to write
+	DWORD Length;			// Number of bytes to write
+	BOOL Completed;			// Set when the write fully completed (out)
+} batch_write_desc;
+extern BOOL WriteFileBatchWithRetry(HANDLE hFile, batch_write_desc* batch, DWORD nNumDesc, DWORD nNumRetries);
+// Write barrier classes and policies, for WriteBarrier()
+#define WB_METADATA				0	// Must reach the medium before what depends on it
+#define WB_BULK					1	// Only needs to land before the final barrier
+#define WB_FINAL				2	// End-of-operation barrier
+#define WB_POLICY_ALL			0	// Issue a flush for every barrier
+#define WB_POLICY_FINAL_ONLY	1	// Elide bulk barriers, keep metadata and final ones
+extern void SetWriteBarrierPolicy(DWORD policy);
+extern BOOL WriteBarrier(HANDLE hFile, DWORD wb_class);
+extern void PrintWriteBarrierStats(void);
+// Pipeline stages, for PipelineStatsAccount()
+#define PS_SOURCE_READ			0
+#define PS_DECOMPRESS			1
+#define PS_HASH					2
+#define PS_DEVICE_WRITE			3
+#define PS_MAX_STAGE			4
+extern void PipelineStatsReset(void);
+extern void PipelineStatsAccount(int stage, uint64_t bytes, uint64_t stall_ms);
+extern void PipelineStatsPrint(void);
+extern const uint8_t* GetZeroBuffer(size_t* size);
 extern BOOL SetThreadAffinity(DWORD_PTR* thread_affinity, size_t num_threads);
 extern BOOL HashFile(const unsigned type, const char* path, uint8_t* sum);
+extern BOOL HashOpenedFile(const unsigned type, HANDLE h, uint8_t* sum);
 extern BOOL HashBuffer(const unsigned type, const uint8_t* buf, const size_t len, uint8_t* sum);
+extern BOOL HashPhysicalDrive(const unsigned type, HANDLE hPhysicalDrive, uint32_t sector_size,
+	uint64_t size, uint8_t* sum);
+extern BOOL HashFileTree(const unsigned type, const char* path, uint8_t* sum);
+extern BOOL HashStreamInit(const unsigned type);
+extern void HashStreamWrite(const uint8_t* buf, size_t len);
+extern BOOL HashStreamFinal(uint8_t* sum);
+#define MAX_HASH_STATE_SIZE 512
+extern size_t HashStreamSave(uint8_t* buf, size_t len);
+extern BOOL HashStreamRestore(const uint8_t* buf, size_t len);
 extern BOOL IsFileInDB(const char* path);
 extern BOOL IsBufferInDB(const unsigned char* buf, const size_t len);
 #define printbits(x) _printbits(sizeof(x), &x, 0)
@@ -628,12 +740,18 @@ extern BOOL EnablePrivileges(void);
 extern void FlashTaskbar(HANDLE handle);
 extern DWORD WaitForSingleObjectWithMessages(HANDLE hHandle, DWORD dwMilliseconds);
 extern HICON CreateMirroredIcon(HICON hiconOrg);
+extern void CloseDirHandleCache(void);
+extern uint8_t* GetIoBuffer(size_t size);
+extern void ReleaseIoBuffer(void* buf);
+extern void FreeIoBufferPool(void);
 extern HANDLE CreatePreallocatedFile(const char* lpFileName, DWORD dwDesiredAccess,
 	DWORD dwShareMode, LPSECURITY_ATTRIBUTES lpSecurityAttributes, DWORD dwCreationDisposition,
 	DWORD dwFlagsAndAttributes, LONGLONG fileSize);
 #define GetTextWidth(hDlg, id) GetTextSize(GetDlgItem(hDlg, id), NULL).cx
 
 DWORD WINAPI FormatThread(void* param);
+BOOL CanResizePersistence(DWORD DriveIndex);
+DWORD WINAPI PersistenceResizeThread(void* param);
 DWORD WINAPI SaveImageThread(void* param);
 DWORD WINAPI SumThread(void* param);
 
@@ -658,8 +776,12 @@ typedef struct {
 	char**   String;
 	uint32_t Index;		// Current array size
 	uint32_t Max;		// Maximum array size
+	char*    Arena;		// Optional string arena (see StrArrayCreateArena)
+	uint32_t ArenaMax;	// Current arena size
+	uint32_t ArenaUsed;	// Amount of arena currently in use
 } StrArray;
 extern void StrArrayCreate(StrArray* arr, uint32_t initial_size);
+extern void StrArrayCreateArena(StrArray* arr, uint32_t initial_size, uint32_t arena_size);
 extern int32_t StrArrayAdd(StrArray* arr, const char* str, BOOL );
 extern int32_t StrArrayFind(StrArray* arr, const char* str);
 extern void StrArrayClear(StrArray* arr);
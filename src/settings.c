@@ -0,0 +1,427 @@
+/*
+ * Rufus: The Reliable USB Formatting Utility
+ * Cached settings access, with bulk preload and write-behind flush
+ * Copyright © 2022 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Memory leaks detection - define _CRTDBG_MAP_ALLOC as preprocessor macro */
+#ifdef _CRTDBG_MAP_ALLOC
+#include <stdlib.h>
+#include <crtdbg.h>
+#endif
+
+#include <windows.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "rufus.h"
+#include "missing.h"
+#include "resource.h"
+#include "msapi_utf8.h"
+#include "localization.h"
+
+#include "settings.h"
+
+/*
+ * Settings used to be read from and written to their backend (registry or
+ * .ini file) on every single access, which can get *very* costly when the
+ * registry sits behind an endpoint protection filter driver and the access
+ * comes from the format thread. So we front the backend with a small cache:
+ * the registry hive is bulk-loaded once at startup (the .ini parser has no
+ * enumerator, so INI mode populates on first access instead), reads are
+ * served from memory, and writes land in the cache and are committed by a
+ * low-priority flusher thread shortly afterwards.
+ */
+
+// More than twice the number of settings we currently define
+#define SETTINGS_CACHE_SIZE   64
+// Must match the size of the static buffers used by ReadIniKeyStr/ReadRegistryKeyStr
+#define SETTINGS_VALUE_SIZE   512
+// How long the flusher waits for further writes to coalesce, in ms
+#define SETTINGS_FLUSH_DELAY  250
+
+typedef struct {
+	char key[64];
+	DWORD type;		// REG_DWORD, REG_QWORD or REG_SZ
+	int64_t num;
+	char str[SETTINGS_VALUE_SIZE];
+	BOOL dirty;
+} settings_entry;
+
+static settings_entry settings_cache[SETTINGS_CACHE_SIZE];
+static uint32_t settings_cache_size = 0;
+static BOOL settings_cache_active = FALSE;
+static CRITICAL_SECTION settings_cache_lock;
+static HANDLE settings_flush_thread = NULL;
+static HANDLE settings_flush_event = NULL, settings_exit_event = NULL;
+
+// The following two helpers must be called with the cache lock held
+static settings_entry* GetSettingsEntry(const char* key)
+{
+	uint32_t i;
+
+	for (i = 0; i < settings_cache_size; i++) {
+		if (strcmp(settings_cache[i].key, key) == 0)
+			return &settings_cache[i];
+	}
+	return NULL;
+}
+
+static settings_entry* AddSettingsEntry(const char* key, DWORD type)
+{
+	settings_entry* entry;
+
+	if ((settings_cache_size >= SETTINGS_CACHE_SIZE) ||
+		(safe_strlen(key) >= sizeof(settings_cache[0].key)))
+		return NULL;
+	entry = &settings_cache[settings_cache_size++];
+	memset(entry, 0, sizeof(settings_entry));
+	static_strcpy(entry->key, key);
+	entry->type = type;
+	return entry;
+}
+
+// Commit a (copied) entry to the backend. Must NOT be called with the lock
+// held, as the backend round-trip is the very thing we are hiding.
+static BOOL CommitSettingsEntry(const settings_entry* entry)
+{
+	switch (entry->type) {
+	case REG_DWORD:
+		return (ini_file != NULL) ? WriteIniKey32(entry->key, (int32_t)entry->num) :
+			WriteRegistryKey32(REGKEY_HKCU, entry->key, (int32_t)entry->num);
+	case REG_QWORD:
+		return (ini_file != NULL) ? WriteIniKey64(entry->key, entry->num) :
+			WriteRegistryKey64(REGKEY_HKCU, entry->key, entry->num);
+	case REG_SZ:
+		return (ini_file != NULL) ? WriteIniKeyStr(entry->key, entry->str) :
+			WriteRegistryKeyStr(REGKEY_HKCU, entry->key, (char*)entry->str);
+	}
+	return FALSE;
+}
+
+/*
+ * Commit all dirty entries to the backend. Entries are copied out one at a
+ * time so that readers and writers are never blocked on a registry access.
+ */
+BOOL SettingsFlush(void)
+{
+	BOOL r = TRUE;
+	uint32_t i;
+	settings_entry entry;
+
+	if (!settings_cache_active)
+		return TRUE;
+	for (i = 0; i < settings_cache_size; i++) {
+		EnterCriticalSection(&settings_cache_lock);
+		if (!settings_cache[i].dirty) {
+			LeaveCriticalSection(&settings_cache_lock);
+			continue;
+		}
+		memcpy(&entry, &settings_cache[i], sizeof(entry));
+		settings_cache[i].dirty = FALSE;
+		LeaveCriticalSection(&settings_cache_lock);
+		if (!CommitSettingsEntry(&entry)) {
+			uprintf("Failed to commit setting '%s'", entry.key);
+			r = FALSE;
+		}
+	}
+	return r;
+}
+
+static DWORD WINAPI SettingsFlushThread(void* param)
+{
+	HANDLE wait_for[2] = { settings_exit_event, settings_flush_event };
+
+	while (WaitForMultipleObjects(ARRAYSIZE(wait_for), wait_for, FALSE, INFINITE) == WAIT_OBJECT_0 + 1) {
+		// Coalesce bursts of writes (e.g. the DD journal updates) into one pass
+		Sleep(SETTINGS_FLUSH_DELAY);
+		SettingsFlush();
+	}
+	// Exit was requested - perform one last synchronous flush
+	SettingsFlush();
+	return 0;
+}
+
+// Bulk-load the existing settings from the registry in a single enumeration
+static void PreloadSettings(void)
+{
+	HKEY hApp = NULL;
+	DWORD i, rs, type, name_size, data_size;
+	char name[64];
+	uint8_t data[SETTINGS_VALUE_SIZE];
+	settings_entry* entry;
+
+	// The INI parser can only look up individual tokens, so INI mode gets
+	// populated on first access instead.
+	if (ini_file != NULL)
+		return;
+	if (RegOpenKeyExA(REGKEY_HKCU, "SOFTWARE\\" COMPANY_NAME "\\" APPLICATION_NAME,
+		0, KEY_READ, &hApp) != ERROR_SUCCESS)
+		return;
+	for (i = 0; ; i++) {
+		name_size = sizeof(name);
+		data_size = sizeof(data) - 1;
+		memset(data, 0, sizeof(data));
+		rs = RegEnumValueA(hApp, i, name, &name_size, NULL, &type, data, &data_size);
+		if (rs == ERROR_MORE_DATA)
+			// Oversized name or value - leave it to the backend
+			continue;
+		if (rs != ERROR_SUCCESS)
+			break;
+		if ((type != REG_DWORD) && (type != REG_QWORD) && (type != REG_SZ))
+			continue;
+		entry = GetSettingsEntry(name);
+		if (entry == NULL)
+			entry = AddSettingsEntry(name, type);
+		if (entry == NULL)
+			break;
+		entry->type = type;
+		switch (type) {
+		case REG_DWORD:
+			entry->num = (int64_t)*(int32_t*)data;
+			break;
+		case REG_QWORD:
+			entry->num = *(int64_t*)data;
+			break;
+		case REG_SZ:
+			static_strcpy(entry->str, (char*)data);
+			break;
+		}
+	}
+	RegCloseKey(hApp);
+	uprintf("Preloaded %d settings from the registry", (int)settings_cache_size);
+}
+
+/*
+ * Activate the settings cache. Must be called after ini_file has been set
+ * (or not) for the session. If this call is skipped, all settings accesses
+ * transparently fall through to the backend.
+ */
+void SettingsInit(void)
+{
+	if (settings_cache_active)
+		return;
+	InitializeCriticalSection(&settings_cache_lock);
+	PreloadSettings();
+	settings_flush_event = CreateEventA(NULL, FALSE, FALSE, NULL);
+	settings_exit_event = CreateEventA(NULL, FALSE, FALSE, NULL);
+	if ((settings_flush_event != NULL) && (settings_exit_event != NULL))
+		settings_flush_thread = CreateThread(NULL, 0, SettingsFlushThread, NULL, 0, NULL);
+	if (settings_flush_thread != NULL) {
+		SetThreadPriority(settings_flush_thread, THREAD_PRIORITY_LOWEST);
+		settings_cache_active = TRUE;
+	} else {
+		uprintf("Warning: Could not start the settings flusher - "
+			"settings will be accessed synchronously");
+		safe_closehandle(settings_flush_event);
+		safe_closehandle(settings_exit_event);
+	}
+}
+
+// Flush any pending writes and shut the flusher down
+void SettingsExit(void)
+{
+	if (!settings_cache_active)
+		return;
+	SetEvent(settings_exit_event);
+	if (WaitForSingleObject(settings_flush_thread, 5000) != WAIT_OBJECT_0) {
+		uprintf("Settings flusher did not exit in time - forcing a flush");
+		SettingsFlush();
+	}
+	settings_cache_active = FALSE;
+	safe_closehandle(settings_flush_thread);
+	safe_closehandle(settings_flush_event);
+	safe_closehandle(settings_exit_event);
+	DeleteCriticalSection(&settings_cache_lock);
+}
+
+/*
+ * The actual settings accessors. Served from the cache when it is active,
+ * with a backend read-through on first access, and a direct backend call
+ * when it isn't (e.g. accesses that occur before SettingsInit).
+ */
+int64_t ReadSetting64(const char* key)
+{
+	int64_t val;
+	settings_entry* entry;
+
+	if (!settings_cache_active)
+		return (ini_file != NULL) ? ReadIniKey64(key) : ReadRegistryKey64(REGKEY_HKCU, key);
+	EnterCriticalSection(&settings_cache_lock);
+	entry = GetSettingsEntry(key);
+	if ((entry != NULL) && (entry->type == REG_QWORD)) {
+		val = entry->num;
+		LeaveCriticalSection(&settings_cache_lock);
+		return val;
+	}
+	LeaveCriticalSection(&settings_cache_lock);
+	val = (ini_file != NULL) ? ReadIniKey64(key) : ReadRegistryKey64(REGKEY_HKCU, key);
+	EnterCriticalSection(&settings_cache_lock);
+	if (GetSettingsEntry(key) == NULL) {
+		entry = AddSettingsEntry(key, REG_QWORD);
+		if (entry != NULL)
+			entry->num = val;
+	}
+	LeaveCriticalSection(&settings_cache_lock);
+	return val;
+}
+
+BOOL WriteSetting64(const char* key, int64_t val)
+{
+	settings_entry* entry;
+
+	if (!settings_cache_active)
+		return (ini_file != NULL) ? WriteIniKey64(key, val) : WriteRegistryKey64(REGKEY_HKCU, key, val);
+	EnterCriticalSection(&settings_cache_lock);
+	entry = GetSettingsEntry(key);
+	if (entry == NULL)
+		entry = AddSettingsEntry(key, REG_QWORD);
+	if (entry != NULL) {
+		entry->type = REG_QWORD;
+		entry->num = val;
+		entry->dirty = TRUE;
+	}
+	LeaveCriticalSection(&settings_cache_lock);
+	if (entry == NULL)
+		// Cache is full - commit straight to the backend
+		return (ini_file != NULL) ? WriteIniKey64(key, val) : WriteRegistryKey64(REGKEY_HKCU, key, val);
+	SetEvent(settings_flush_event);
+	return TRUE;
+}
+
+int32_t ReadSetting32(const char* key)
+{
+	int32_t val;
+	settings_entry* entry;
+
+	if (!settings_cache_active)
+		return (ini_file != NULL) ? ReadIniKey32(key) : ReadRegistryKey32(REGKEY_HKCU, key);
+	EnterCriticalSection(&settings_cache_lock);
+	entry = GetSettingsEntry(key);
+	if ((entry != NULL) && (entry->type == REG_DWORD)) {
+		val = (int32_t)entry->num;
+		LeaveCriticalSection(&settings_cache_lock);
+		return val;
+	}
+	LeaveCriticalSection(&settings_cache_lock);
+	val = (ini_file != NULL) ? ReadIniKey32(key) : ReadRegistryKey32(REGKEY_HKCU, key);
+	EnterCriticalSection(&settings_cache_lock);
+	if (GetSettingsEntry(key) == NULL) {
+		entry = AddSettingsEntry(key, REG_DWORD);
+		if (entry != NULL)
+			entry->num = (int64_t)val;
+	}
+	LeaveCriticalSection(&settings_cache_lock);
+	return val;
+}
+
+BOOL WriteSetting32(const char* key, int32_t val)
+{
+	settings_entry* entry;
+
+	if (!settings_cache_active)
+		return (ini_file != NULL) ? WriteIniKey32(key, val) : WriteRegistryKey32(REGKEY_HKCU, key, val);
+	EnterCriticalSection(&settings_cache_lock);
+	entry = GetSettingsEntry(key);
+	if (entry == NULL)
+		entry = AddSettingsEntry(key, REG_DWORD);
+	if (entry != NULL) {
+		entry->type = REG_DWORD;
+		entry->num = (int64_t)val;
+		entry->dirty = TRUE;
+	}
+	LeaveCriticalSection(&settings_cache_lock);
+	if (entry == NULL)
+		return (ini_file != NULL) ? WriteIniKey32(key, val) : WriteRegistryKey32(REGKEY_HKCU, key, val);
+	SetEvent(settings_flush_event);
+	return TRUE;
+}
+
+BOOL ReadSettingBool(const char* key)
+{
+	return (ReadSetting32(key) != 0);
+}
+
+BOOL WriteSettingBool(const char* key, BOOL val)
+{
+	return WriteSetting32(key, val ? 1 : 0);
+}
+
+char* ReadSettingStr(const char* key)
+{
+	// Matches the static buffer behaviour of the backend readers
+	static char str[SETTINGS_VALUE_SIZE];
+	settings_entry* entry;
+
+	if (!settings_cache_active)
+		return (ini_file != NULL) ? ReadIniKeyStr(key) : ReadRegistryKeyStr(REGKEY_HKCU, key);
+	EnterCriticalSection(&settings_cache_lock);
+	entry = GetSettingsEntry(key);
+	if ((entry != NULL) && (entry->type == REG_SZ)) {
+		static_strcpy(str, entry->str);
+		LeaveCriticalSection(&settings_cache_lock);
+		return str;
+	}
+	LeaveCriticalSection(&settings_cache_lock);
+	static_strcpy(str, (ini_file != NULL) ? ReadIniKeyStr(key) : ReadRegistryKeyStr(REGKEY_HKCU, key));
+	EnterCriticalSection(&settings_cache_lock);
+	if (GetSettingsEntry(key) == NULL) {
+		entry = AddSettingsEntry(key, REG_SZ);
+		if (entry != NULL)
+			static_strcpy(entry->str, str);
+	}
+	LeaveCriticalSection(&settings_cache_lock);
+	return str;
+}
+
+BOOL WriteSettingStr(const char* key, char* val)
+{
+	settings_entry* entry;
+
+	if (!settings_cache_active)
+		return (ini_file != NULL) ? WriteIniKeyStr(key, val) : WriteRegistryKeyStr(REGKEY_HKCU, key, val);
+	if (safe_strlen(val) >= SETTINGS_VALUE_SIZE) {
+		// Too large for the cache - commit straight to the backend. Any existing
+		// cache entry (which reads are served from) must be updated too, else it
+		// would keep returning the old value for the rest of the session: store
+		// the truncated view of the value, which is what the backend readers
+		// would return anyway, and clear the dirty flag so that the flusher
+		// doesn't overwrite the backend with it.
+		EnterCriticalSection(&settings_cache_lock);
+		entry = GetSettingsEntry(key);
+		if (entry != NULL) {
+			entry->type = REG_SZ;
+			static_strcpy(entry->str, val);
+			entry->dirty = FALSE;
+		}
+		LeaveCriticalSection(&settings_cache_lock);
+		return (ini_file != NULL) ? WriteIniKeyStr(key, val) : WriteRegistryKeyStr(REGKEY_HKCU, key, val);
+	}
+	EnterCriticalSection(&settings_cache_lock);
+	entry = GetSettingsEntry(key);
+	if (entry == NULL)
+		entry = AddSettingsEntry(key, REG_SZ);
+	if (entry != NULL) {
+		entry->type = REG_SZ;
+		static_strcpy(entry->str, val);
+		entry->dirty = TRUE;
+	}
+	LeaveCriticalSection(&settings_cache_lock);
+	if (entry == NULL)
+		return (ini_file != NULL) ? WriteIniKeyStr(key, val) : WriteRegistryKeyStr(REGKEY_HKCU, key, val);
+	SetEvent(settings_flush_event);
+	return TRUE;
+}
@@ -32,27 +32,61 @@ extern char* ini_file;
 #define SETTING_ADVANCED_MODE_FORMAT        "ShowAdvancedFormatOptions"
 #define SETTING_COMM_CHECK                  "CommCheck64"
 #define SETTING_DEFAULT_THREAD_PRIORITY     "DefaultThreadPriority"
+#define SETTING_DD_JOURNAL_IMAGE            "DdJournalImage"
+#define SETTING_DD_JOURNAL_IMAGE_SIZE       "DdJournalImageSize"
+#define SETTING_DD_JOURNAL_DEVICE           "DdJournalDevice"
+#define SETTING_DD_JOURNAL_OFFSET           "DdJournalOffset"
+#define SETTING_DD_TUNE_PREFIX              "DdTune"
+#define SETTING_DEVICE_CAPS_PREFIX          "DeviceCaps"
+#define SETTING_DL_JOURNAL_URL              "DlJournalUrl"
+#define SETTING_DL_JOURNAL_OFFSET           "DlJournalOffset"
+#define SETTING_DL_JOURNAL_SUM_STATE        "DlJournalSumState"
 #define SETTING_DISABLE_FAKE_DRIVES_CHECK   "DisableFakeDrivesCheck"
 #define SETTING_DISABLE_LGP                 "DisableLGP"
 #define SETTING_DISABLE_SECURE_BOOT_NOTICE  "DisableSecureBootNotice"
 #define SETTING_DISABLE_VHDS                "DisableVHDs"
+#define SETTING_DRIVE_CACHE_EXT_ID          "DriveCacheExtLabelId"
+#define SETTING_DRIVE_CACHE_EXT_LABEL       "DriveCacheExtLabel"
+#define SETTING_DRIVE_CACHE_MBR_ID          "DriveCacheMbrId"
 #define SETTING_ENABLE_EXTRA_HASHES         "EnableExtraHashes"
+#define SETTING_ENABLE_WRITE_VERIFICATION   "EnableWriteVerification"
 #define SETTING_ENABLE_FILE_INDEXING        "EnableFileIndexing"
+#define SETTING_ENABLE_LOG_SECTION          "EnableLogSection"
 #define SETTING_ENABLE_USB_DEBUG            "EnableUsbDebug"
 #define SETTING_ENABLE_VMDK_DETECTION       "EnableVmdkDetection"
 #define SETTING_ENABLE_WIN_DUAL_EFI_BIOS    "EnableWindowsDualUefiBiosMode"
 #define SETTING_FORCE_LARGE_FAT32_FORMAT    "ForceLargeFat32Formatting"
+// Prefix for the per-device format timing history, completed by a hash of the device instance ID
+#define SETTING_FORMAT_HISTORY_PREFIX       "FormatHistory"
+#define SETTING_HASH_BUFFER_SIZE            "HashBufferSize"
+#define SETTING_HASH_CACHE_ID               "HashCacheId"
+#define SETTING_HASH_CACHE_MD5              "HashCacheMd5"
+#define SETTING_HASH_CACHE_SHA1             "HashCacheSha1"
+#define SETTING_HASH_CACHE_SHA256           "HashCacheSha256"
+#define SETTING_HASH_CACHE_SHA512           "HashCacheSha512"
 #define SETTING_IGNORE_BOOT_MARKER          "IgnoreBootMarker"
 #define SETTING_INCLUDE_BETAS               "CheckForBetas"
 #define SETTING_LAST_UPDATE                 "LastUpdateCheck"
+#define SETTING_LAST_UPDATE_NEG             "LastUpdateNegCheck"
 #define SETTING_LOCALE                      "Locale"
+// Local directory whose content gets injected into a freshly formatted ext partition
+#define SETTING_PERSISTENCE_SEED_DIR        "PersistenceSeedDir"
+#define SETTING_STREAMING_DOWNLOAD          "StreamingDownload"
+// Layout metrics for the main dialog, keyed per version/locale/DPI, see LoadLayoutCache()
+#define SETTING_UI_LAYOUT_CACHE             "UiLayoutCache"
 #define SETTING_UPDATE_INTERVAL             "UpdateCheckInterval"
+#define SETTING_USE_DIFFERENTIAL_WRITE      "UseDifferentialWrite"
 #define SETTING_USE_EXT_VERSION             "UseExtVersion"
 #define SETTING_USE_PROPER_SIZE_UNITS       "UseProperSizeUnits"
 #define SETTING_USE_UDF_VERSION             "UseUdfVersion"
+#define SETTING_USE_UNBUFFERED_IO           "UseUnbufferedIo"
 #define SETTING_USE_VDS                     "UseVds"
 #define SETTING_PRESERVE_TIMESTAMPS         "PreserveTimestamps"
 #define SETTING_VERBOSE_UPDATES             "VerboseUpdateCheck"
+// Injectable device model for write pipeline benchmarking, see WriteDrive()
+#define SETTING_VIRTUAL_TARGET_LATENCY      "VirtualTargetLatency"
+#define SETTING_VIRTUAL_TARGET_BANDWIDTH    "VirtualTargetBandwidth"
+#define SETTING_VIRTUAL_TARGET_ERROR_RATE   "VirtualTargetErrorRate"
 
 
 static __inline BOOL CheckIniKey(const char* key) {
@@ -117,29 +151,18 @@ static __inline BOOL WriteIniKeyStr(const char* key, const char* val) {
 #define WriteIniKeyBool(key, b) WriteIniKey32(key, (b)?1:0)
 
 /*
- * Read and store settings from/to ini file or registry
+ * Read and store settings from/to ini file or registry, through the cache
+ * implemented in settings.c. Until SettingsInit() has activated the cache,
+ * these degrade to direct (synchronous) backend accesses.
  */
-static __inline int64_t ReadSetting64(const char* key) {
-	return (ini_file != NULL)?ReadIniKey64(key):ReadRegistryKey64(REGKEY_HKCU, key);
-}
-static __inline BOOL WriteSetting64(const char* key, int64_t val) {
-	return (ini_file != NULL)?WriteIniKey64(key, val):WriteRegistryKey64(REGKEY_HKCU, key, val);
-}
-static __inline int32_t ReadSetting32(const char* key) {
-	return (ini_file != NULL)?ReadIniKey32(key):ReadRegistryKey32(REGKEY_HKCU, key);
-}
-static __inline BOOL WriteSetting32(const char* key, int32_t val) {
-	return (ini_file != NULL)?WriteIniKey32(key, val):WriteRegistryKey32(REGKEY_HKCU, key, val);
-}
-static __inline BOOL ReadSettingBool(const char* key) {
-	return (ini_file != NULL)?ReadIniKeyBool(key):ReadRegistryKeyBool(REGKEY_HKCU, key);
-}
-static __inline BOOL WriteSettingBool(const char* key, BOOL val) {
-	return (ini_file != NULL)?WriteIniKeyBool(key, val):WriteRegistryKeyBool(REGKEY_HKCU, key, val);
-}
-static __inline char* ReadSettingStr(const char* key) {
-	return (ini_file != NULL)?ReadIniKeyStr(key):ReadRegistryKeyStr(REGKEY_HKCU, key);
-}
-static __inline BOOL WriteSettingStr(const char* key, char* val) {
-	return (ini_file != NULL)?WriteIniKeyStr(key, val):WriteRegistryKeyStr(REGKEY_HKCU, key, val);
-}
+extern void SettingsInit(void);
+extern BOOL SettingsFlush(void);
+extern void SettingsExit(void);
+extern int64_t ReadSetting64(const char* key);
+extern BOOL WriteSetting64(const char* key, int64_t val);
+extern int32_t ReadSetting32(const char* key);
+extern BOOL WriteSetting32(const char* key, int32_t val);
+extern BOOL ReadSettingBool(const char* key);
+extern BOOL WriteSettingBool(const char* key, BOOL val);
+extern char* ReadSettingStr(const char* key);
+extern BOOL WriteSettingStr(const char* key, char* val);
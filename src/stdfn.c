@@ -34,6 +34,20 @@
 
 #include "settings.h"
 
+#if (defined(_M_X64) || defined(__x86_64__) || defined(_M_IX86) || defined(__i386__))
+#define CPU_HAS_LARGE_COPY_SUPPORT 1
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define TARGET_XSAVE
+#define TARGET_AVX2
+#else
+#include <cpuid.h>
+#define TARGET_XSAVE __attribute__ ((target("xsave")))
+#define TARGET_AVX2 __attribute__ ((target("avx2")))
+#endif
+#endif
+
 int nWindowsVersion = WINDOWS_UNDEFINED;
 int nWindowsBuildNumber = -1;
 int nWindowsEdition = 0;
@@ -225,20 +239,136 @@ BOOL is_x64(void)
 
 int GetCpuArch(void)
 {
+	static int cpu_arch = CPU_ARCH_MAX;
 	SYSTEM_INFO info = { 0 };
+
+	// The architecture is not going to change mid-run, so only probe it once
+	if (cpu_arch != CPU_ARCH_MAX)
+		return cpu_arch;
 	GetNativeSystemInfo(&info);
 	switch (info.wProcessorArchitecture) {
 	case PROCESSOR_ARCHITECTURE_AMD64:
-		return CPU_ARCH_X86_64;
+		cpu_arch = CPU_ARCH_X86_64;
+		break;
 	case PROCESSOR_ARCHITECTURE_INTEL:
-		return CPU_ARCH_X86_64;
+		cpu_arch = CPU_ARCH_X86_64;
+		break;
 	case PROCESSOR_ARCHITECTURE_ARM64:
-		return CPU_ARCH_ARM_64;
+		cpu_arch = CPU_ARCH_ARM_64;
+		break;
 	case PROCESSOR_ARCHITECTURE_ARM:
-		return CPU_ARCH_ARM_32;
+		cpu_arch = CPU_ARCH_ARM_32;
+		break;
 	default:
-		return CPU_ARCH_UNDEFINED;
+		cpu_arch = CPU_ARCH_UNDEFINED;
+		break;
+	}
+	return cpu_arch;
+}
+
+#if defined(CPU_HAS_LARGE_COPY_SUPPORT)
+// Feature bits for the large copy dispatch below
+#define LARGE_COPY_ERMS  1
+#define LARGE_COPY_AVX2  2
+static int large_copy_features = -1;
+
+TARGET_XSAVE static void DetectLargeCopyFeatures(void)
+{
+	uint32_t regs[4] = { 0 };
+
+	large_copy_features = 0;
+#if defined(_MSC_VER)
+	__cpuidex((int*)regs, 7, 0);
+	if (regs[1] & (1 << 9))
+		large_copy_features |= LARGE_COPY_ERMS;
+	if (regs[1] & (1 << 5)) {
+		__cpuidex((int*)regs, 1, 0);
+		if ((regs[2] & (1 << 27)) && (regs[2] & (1 << 28)) && ((_xgetbv(0) & 6) == 6))
+			large_copy_features |= LARGE_COPY_AVX2;
 	}
+#else
+	if (__get_cpuid_count(7, 0, &regs[0], &regs[1], &regs[2], &regs[3])) {
+		if (regs[1] & (1 << 9))
+			large_copy_features |= LARGE_COPY_ERMS;
+		if (regs[1] & (1 << 5)) {
+			__get_cpuid(1, &regs[0], &regs[1], &regs[2], &regs[3]);
+			if ((regs[2] & (1 << 27)) && (regs[2] & (1 << 28)) && ((_xgetbv(0) & 6) == 6))
+				large_copy_features |= LARGE_COPY_AVX2;
+		}
+	}
+#endif
+	if (large_copy_features != 0)
+		uprintf("Large buffer copies will use%s%s",
+			(large_copy_features & LARGE_COPY_ERMS) ? " ERMS" : "",
+			(large_copy_features & LARGE_COPY_AVX2) ? " AVX2-NT" : "");
+}
+
+// 'rep movsb', which microcode turns into full cache line moves on CPUs
+// that advertise Enhanced REP MOVSB
+static __inline void LargeMemcpyErms(uint8_t* dst, const uint8_t* src, size_t n)
+{
+#if defined(_MSC_VER)
+	__movsb(dst, src, n);
+#else
+	__asm__ __volatile__ ("rep movsb" : "+D" (dst), "+S" (src), "+c" (n) : : "memory");
+#endif
+}
+
+// Non-temporal streaming copy, so that buffers larger than the last level
+// cache don't evict every useful line on their way through
+TARGET_AVX2 static void LargeMemcpyNt(uint8_t* dst, const uint8_t* src, size_t n)
+{
+	size_t head = (32 - ((uintptr_t)dst & 31)) & 31;
+
+	if (head != 0) {
+		memcpy(dst, src, head);
+		dst += head;
+		src += head;
+		n -= head;
+	}
+	while (n >= 128) {
+		_mm256_stream_si256(&((__m256i*)dst)[0], _mm256_loadu_si256(&((const __m256i*)src)[0]));
+		_mm256_stream_si256(&((__m256i*)dst)[1], _mm256_loadu_si256(&((const __m256i*)src)[1]));
+		_mm256_stream_si256(&((__m256i*)dst)[2], _mm256_loadu_si256(&((const __m256i*)src)[2]));
+		_mm256_stream_si256(&((__m256i*)dst)[3], _mm256_loadu_si256(&((const __m256i*)src)[3]));
+		dst += 128;
+		src += 128;
+		n -= 128;
+	}
+	_mm_sfence();
+	if (n != 0)
+		memcpy(dst, src, n);
+}
+#endif /* CPU_HAS_LARGE_COPY_SUPPORT */
+
+// Copies below this size aren't worth dispatching at all
+#define LARGE_COPY_MIN_SIZE  (256 * KB)
+// Above this size, the write data can't fit the last level cache anyway,
+// so bypass it with non-temporal stores when the CPU allows it
+#define LARGE_COPY_NT_THRESHOLD  (8 * MB)
+
+/*
+ * memcpy() replacement for the multi-MB buffer moves of the DD write and
+ * extraction paths, dispatched at runtime on the CPU's capabilities.
+ * Same semantics as memcpy(), so the regions must not overlap.
+ */
+void* LargeMemcpy(void* dst, const void* src, size_t n)
+{
+#if defined(CPU_HAS_LARGE_COPY_SUPPORT)
+	if (n >= LARGE_COPY_MIN_SIZE) {
+		if (large_copy_features < 0)
+			DetectLargeCopyFeatures();
+		if ((n >= LARGE_COPY_NT_THRESHOLD) && (large_copy_features & LARGE_COPY_AVX2)) {
+			LargeMemcpyNt((uint8_t*)dst, (const uint8_t*)src, n);
+			return dst;
+		}
+		if (large_copy_features & LARGE_COPY_ERMS) {
+			LargeMemcpyErms((uint8_t*)dst, (const uint8_t*)src, n);
+			return dst;
+		}
+	}
+#endif
+	return memcpy(dst, src, n);
 }
 
 static const char* GetEdition(DWORD ProductType)
@@ -476,14 +606,35 @@ void StrArrayCreate(StrArray* arr, uint32_t initial_size)
 {
 	if (arr == NULL) return;
 	arr->Max = initial_size; arr->Index = 0;
+	arr->Arena = NULL; arr->ArenaMax = 0; arr->ArenaUsed = 0;
 	arr->String = (char**)calloc(arr->Max, sizeof(char*));
 	if (arr->String == NULL)
 		uprintf("Could not allocate string array\n");
 }
 
+// Same as the above, but the string contents are packed into a single growable
+// arena, so that arrays that get rebuilt over and over (e.g. on device refresh)
+// don't fragment the heap with individual string allocations, and clearing or
+// destroying the array doesn't have to free each string separately.
+// NB: strings are always copied into the arena, so the 'duplicate' parameter
+// of StrArrayAdd() is ignored for these arrays.
+void StrArrayCreateArena(StrArray* arr, uint32_t initial_size, uint32_t arena_size)
+{
+	StrArrayCreate(arr, initial_size);
+	if ((arr == NULL) || (arr->String == NULL))
+		return;
+	arr->ArenaMax = arena_size;
+	arr->Arena = (char*)malloc(arr->ArenaMax);
+	if (arr->Arena == NULL)
+		uprintf("Could not allocate string array arena\n");
+}
+
 int32_t StrArrayAdd(StrArray* arr, const char* str, BOOL duplicate)
 {
 	char** old_table;
+	char *old_arena, *new_arena;
+	size_t len;
+	uint32_t i;
 	if ((arr == NULL) || (arr->String == NULL) || (str == NULL))
 		return -1;
 	if (arr->Index == arr->Max) {
@@ -496,6 +647,29 @@ int32_t StrArrayAdd(StrArray* arr, const char* str, BOOL duplicate)
 			return -1;
 		}
 	}
+	if (arr->Arena != NULL) {
+		len = safe_strlen(str) + 1;
+		if (arr->ArenaUsed + len > arr->ArenaMax) {
+			while (arr->ArenaUsed + len > arr->ArenaMax)
+				arr->ArenaMax *= 2;
+			old_arena = arr->Arena;
+			new_arena = (char*)realloc(arr->Arena, arr->ArenaMax);
+			if (new_arena == NULL) {
+				uprintf("Could not reallocate string array arena\n");
+				return -1;
+			}
+			// The arena may have moved => rebase the string pointers
+			if (new_arena != old_arena) {
+				for (i = 0; i < arr->Index; i++)
+					arr->String[i] = &new_arena[arr->String[i] - old_arena];
+			}
+			arr->Arena = new_arena;
+		}
+		arr->String[arr->Index] = &arr->Arena[arr->ArenaUsed];
+		memcpy(arr->String[arr->Index], str, len);
+		arr->ArenaUsed += (uint32_t)len;
+		return arr->Index++;
+	}
 	arr->String[arr->Index] = (duplicate)?safe_strdup(str):(char*)str;
 	if (arr->String[arr->Index] == NULL) {
 		uprintf("Could not store string in array\n");
@@ -521,8 +695,13 @@ void StrArrayClear(StrArray* arr)
 	uint32_t i;
 	if ((arr == NULL) || (arr->String == NULL))
 		return;
-	for (i=0; i<arr->Index; i++) {
-		safe_free(arr->String[i]);
+	if (arr->Arena != NULL) {
+		// Arena backed strings are released all at once
+		arr->ArenaUsed = 0;
+	} else {
+		for (i=0; i<arr->Index; i++) {
+			safe_free(arr->String[i]);
+		}
 	}
 	arr->Index = 0;
 }
@@ -530,8 +709,11 @@ void StrArrayClear(StrArray* arr)
 void StrArrayDestroy(StrArray* arr)
 {
 	StrArrayClear(arr);
-	if (arr != NULL)
+	if (arr != NULL) {
 		safe_free(arr->String);
+		safe_free(arr->Arena);
+		arr->ArenaMax = 0;
+	}
 }
 
 /*
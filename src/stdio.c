@@ -45,6 +45,107 @@
 HWND hStatus;
 size_t ubuffer_pos = 0;
 char ubuffer[UBUFFER_SIZE];	// Buffer for ubpushf() messages we don't log right away
+BOOL enable_log_section = FALSE;
+
+/*
+ * Opt-in shared memory log channel ('EnableLogSection' setting), for external
+ * monitors that would otherwise have to scrape the log window text through UI
+ * automation. The named section holds a fixed header followed by a byte ring
+ * that carries the raw uprintf stream (UTF-8, CR/LF terminated lines), along
+ * with the latest per-stage counters as passed to UpdateProgressWithInfo().
+ * 'head' is a monotonic count of the bytes ever written: a monitor keeps its
+ * own tail and copies ring[tail % ring_size] up to ring[head % ring_size] to
+ * catch up. The named event is signaled on every publication, so that
+ * monitors don't need to poll. Since writers reserve their range before they
+ * copy, a monitor should treat the last few bytes below 'head' as possibly
+ * still in flight.
+ */
+#define LOG_SECTION_NAME	"Local\\" APPLICATION_NAME "Log"
+#define LOG_SECTION_EVENT	"Local\\" APPLICATION_NAME "LogEvent"
+#define LOG_SECTION_MAGIC	0x52464C47	// 'RFLG'
+#define LOG_RING_SIZE		(64 * KB)
+typedef struct {
+	uint32_t magic;
+	uint32_t ring_size;
+	volatile LONG64 head;		// Monotonic count of bytes ever written
+	volatile LONG op;			// Current operation (OP_xyz)
+	volatile LONG64 processed;	// Per-stage counters, as passed to
+	volatile LONG64 total;		// UpdateProgressWithInfo()
+	uint8_t ring[LOG_RING_SIZE];
+} log_section_t;
+
+static HANDLE log_section_handle = NULL, log_section_event = NULL;
+static log_section_t* log_section = NULL;
+
+BOOL OpenLogSection(void)
+{
+	log_section_handle = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE,
+		0, sizeof(log_section_t), LOG_SECTION_NAME);
+	if (log_section_handle == NULL) {
+		uprintf("Could not create log section '%s': %s", LOG_SECTION_NAME, WindowsErrorString());
+		goto err;
+	}
+	log_section_event = CreateEventA(NULL, FALSE, FALSE, LOG_SECTION_EVENT);
+	if (log_section_event == NULL) {
+		uprintf("Could not create log section event '%s': %s", LOG_SECTION_EVENT, WindowsErrorString());
+		goto err;
+	}
+	log_section = (log_section_t*)MapViewOfFile(log_section_handle, FILE_MAP_ALL_ACCESS, 0, 0, 0);
+	if (log_section == NULL) {
+		uprintf("Could not map log section: %s", WindowsErrorString());
+		goto err;
+	}
+	log_section->ring_size = LOG_RING_SIZE;
+	// Only set the magic once the rest of the header is usable
+	log_section->magic = LOG_SECTION_MAGIC;
+	uprintf("Opened log section '%s'", LOG_SECTION_NAME);
+	return TRUE;
+
+err:
+	CloseLogSection();
+	return FALSE;
+}
+
+void CloseLogSection(void)
+{
+	if (log_section != NULL)
+		UnmapViewOfFile(log_section);
+	log_section = NULL;
+	safe_closehandle(log_section_event);
+	safe_closehandle(log_section_handle);
+}
+
+static void LogSectionAppend(const char* buf, size_t len)
+{
+	LONG64 start;
+	size_t pos, chunk;
+
+	if (log_section == NULL)
+		return;
+	if (len > LOG_RING_SIZE) {
+		// Oversized payload - only keep the tail
+		buf += len - LOG_RING_SIZE;
+		len = LOG_RING_SIZE;
+	}
+	// Reserve our byte range up front, so that concurrent writers don't interleave
+	start = InterlockedExchangeAdd64(&log_section->head, (LONG64)len);
+	pos = (size_t)(start % LOG_RING_SIZE);
+	chunk = MIN(len, LOG_RING_SIZE - pos);
+	memcpy(&log_section->ring[pos], buf, chunk);
+	if (chunk < len)
+		memcpy(log_section->ring, &buf[chunk], len - chunk);
+	SetEvent(log_section_event);
+}
+
+void LogSectionCounters(int op, uint64_t processed, uint64_t total)
+{
+	if (log_section == NULL)
+		return;
+	log_section->op = (LONG)op;
+	InterlockedExchange64(&log_section->processed, (LONG64)processed);
+	InterlockedExchange64(&log_section->total, (LONG64)total);
+	SetEvent(log_section_event);
+}
 
 void _uprintf(const char *format, ...)
 {
@@ -67,11 +168,20 @@ void _uprintf(const char *format, ...)
 	*p++ = '\n';
 	*p   = '\0';
 
+	// Publish to the shared memory log section, if one is active
+	LogSectionAppend(buf, (size_t)(p - buf));
+
 	// Yay, Windows 10 *FINALLY* added actual Unicode support for OutputDebugStringW()!
 	wbuf = utf8_to_wchar(buf);
 	// Send output to Windows debug facility
 	OutputDebugStringW(wbuf);
 	if ((hLog != NULL) && (hLog != INVALID_HANDLE_VALUE)) {
+		// Updating an Edit control from a worker thread means blocking SendMessage()
+		// round trips to the UI thread, which makes logging itself measurable in the
+		// tight write/hash loops => post the message (with ownership of the string)
+		// and let the UI thread do the actual append when it gets to it.
+		if ((hLogDialog != NULL) && PostMessage(hLogDialog, UM_LOG_APPEND, 0, (LPARAM)wbuf))
+			return;
 		// Send output to our log Window
 		Edit_SetSel(hLog, MAX_LOG_SIZE, MAX_LOG_SIZE);
 		Edit_ReplaceSel(hLog, wbuf);
@@ -85,9 +195,12 @@ void _uprintf(const char *format, ...)
 void _uprintfs(const char* str)
 {
 	wchar_t* wstr;
+	LogSectionAppend(str, strlen(str));
 	wstr = utf8_to_wchar(str);
 	OutputDebugStringW(wstr);
 	if ((hLog != NULL) && (hLog != INVALID_HANDLE_VALUE)) {
+		if ((hLogDialog != NULL) && PostMessage(hLogDialog, UM_LOG_APPEND, 0, (LPARAM)wstr))
+			return;
 		Edit_SetSel(hLog, MAX_LOG_SIZE, MAX_LOG_SIZE);
 		Edit_ReplaceSel(hLog, wstr);
 		Edit_Scroll(hLog, Edit_GetLineCount(hLog), 0);
@@ -916,6 +1029,333 @@ BOOL WriteFileWithRetry(HANDLE hFile, LPCVOID lpBuffer, DWORD nNumberOfBytesToWr
 	return FALSE;
 }
 
+/*
+ * Write barrier policy layer.
+ * FlushFileBuffers() can stall for whole seconds on slow removable media, so
+ * instead of flushing ad hoc, the write paths issue classified barriers:
+ * metadata barriers (boot records, partition tables) that must reach the
+ * medium before whatever depends on them, bulk data barriers that only need
+ * to land before the operation completes, and the final end-of-operation
+ * barrier. The policy controls whether bulk barriers are actually issued, and
+ * every flush is timed so the log shows how long was lost stalling on them.
+ */
+static DWORD write_barrier_policy = WB_POLICY_ALL;
+static DWORD write_barrier_issued = 0, write_barrier_elided = 0;
+static uint64_t write_barrier_stall = 0;
+
+// Select the write barrier policy and reset the stall instrumentation
+void SetWriteBarrierPolicy(DWORD policy)
+{
+	write_barrier_policy = policy;
+	write_barrier_issued = 0;
+	write_barrier_elided = 0;
+	write_barrier_stall = 0;
+}
+
+// Issue (or elide, per the current policy) a write barrier on hFile
+BOOL WriteBarrier(HANDLE hFile, DWORD wb_class)
+{
+	BOOL r;
+	uint64_t start;
+
+	if ((wb_class == WB_BULK) && (write_barrier_policy == WB_POLICY_FINAL_ONLY)) {
+		write_barrier_elided++;
+		return TRUE;
+	}
+	start = GetTickCount64();
+	r = FlushFileBuffers(hFile);
+	write_barrier_stall += GetTickCount64() - start;
+	write_barrier_issued++;
+	return r;
+}
+
+// Report how much time was spent stalled in flushes since the last policy reset
+void PrintWriteBarrierStats(void)
+{
+	if (write_barrier_issued != 0 || write_barrier_elided != 0)
+		uprintf("Write barriers: %lu issued (%llums stalled), %lu elided",
+			write_barrier_issued, write_barrier_stall, write_barrier_elided);
+}
+
+/*
+ * Per-stage pipeline instrumentation.
+ * The write and extraction pipelines account the bytes they moved and the time
+ * they spent stalled, per stage (source read, decompression, hashing, device
+ * write), through the interlocked accessors below, and the totals are dumped
+ * as a table at the end of the operation. When a flash runs slower than
+ * expected, the stage with the dominant stall time is the bottleneck.
+ */
+static const char* pipeline_stage_name[PS_MAX_STAGE] = {
+	"source read", "decompress", "hash", "device write"
+};
+
+typedef struct {
+	LONG64 bytes;		// Bytes moved through the stage
+	LONG64 stall;		// Time (ms) the pipeline spent waiting on the stage
+	LONG64 ops;			// Number of operations (reads, writes, chunks)
+} pipeline_stage_stats;
+
+static pipeline_stage_stats pipeline_stats[PS_MAX_STAGE];
+
+// Reset all the stage counters at the start of an operation
+void PipelineStatsReset(void)
+{
+	memset(pipeline_stats, 0, sizeof(pipeline_stats));
+}
+
+// Account bytes moved through, and/or time spent stalled on, a pipeline stage.
+// Safe to call from any of the pipeline threads.
+void PipelineStatsAccount(int stage, uint64_t bytes, uint64_t stall_ms)
+{
+	if ((stage < 0) || (stage >= PS_MAX_STAGE))
+		return;
+	if (bytes != 0) {
+		InterlockedExchangeAdd64(&pipeline_stats[stage].bytes, (LONG64)bytes);
+		InterlockedIncrement64(&pipeline_stats[stage].ops);
+	}
+	if (stall_ms != 0)
+		InterlockedExchangeAdd64(&pipeline_stats[stage].stall, (LONG64)stall_ms);
+}
+
+// Dump the per-stage summary table to the log
+void PipelineStatsPrint(void)
+{
+	int i;
+	BOOL empty = TRUE;
+
+	for (i = 0; i < PS_MAX_STAGE; i++)
+		if ((pipeline_stats[i].bytes != 0) || (pipeline_stats[i].stall != 0))
+			empty = FALSE;
+	if (empty)
+		return;
+	uprintf("Pipeline statistics (the stage with the dominant stall time is the bottleneck):");
+	uprintf("  %-14s %12s %10s %10s", "Stage", "Bytes", "Ops", "Stalled");
+	for (i = 0; i < PS_MAX_STAGE; i++) {
+		if ((pipeline_stats[i].bytes == 0) && (pipeline_stats[i].stall == 0))
+			continue;
+		uprintf("  %-14s %12lld %10lld %8lldms", pipeline_stage_name[i],
+			pipeline_stats[i].bytes, pipeline_stats[i].ops, pipeline_stats[i].stall);
+	}
+}
+
+/*
+ * Shared zero buffer, for callers that need a large all-zero source to issue
+ * multi-MB zeroing writes from. Allocated on first use and kept for the life
+ * of the process, so repeated format operations don't reallocate and refill
+ * the same zeroes. Callers must treat the returned data as read-only.
+ */
+#define ZERO_BUFFER_SIZE (16 * MB)
+const uint8_t* GetZeroBuffer(size_t* size)
+{
+	static uint8_t* zero_buffer = NULL;
+
+	if (zero_buffer == NULL)
+		zero_buffer = calloc(ZERO_BUFFER_SIZE, 1);
+	if (size != NULL)
+		*size = (zero_buffer == NULL) ? 0 : ZERO_BUFFER_SIZE;
+	return zero_buffer;
+}
+
+/*
+ * Reusable pool for the large sector-aligned buffers of the DD write and hash
+ * pipelines. Buffers are allocated through VirtualAlloc() (whose 64 KB
+ * allocation granularity covers any sector alignment we need), with
+ * MEM_LARGE_PAGES when SeLockMemoryPrivilege could be acquired, which cuts
+ * TLB pressure on the copy and hash loops. Released buffers stay committed
+ * and are handed back on the next request of the same size, so repeat runs
+ * don't pay the first-touch soft faults of a 32 MB allocation again.
+ */
+#define IO_POOL_ENTRIES 6
+typedef struct {
+	uint8_t* buf;
+	size_t size;
+	BOOL in_use;
+} io_pool_entry;
+static io_pool_entry io_pool[IO_POOL_ENTRIES];
+static volatile LONG io_pool_lock = 0;
+static size_t large_page_size = 0;
+
+static __inline void IoPoolLock(void)
+{
+	while (InterlockedCompareExchange(&io_pool_lock, 1, 0) != 0)
+		Sleep(0);
+}
+
+static __inline void IoPoolUnlock(void)
+{
+	InterlockedExchange(&io_pool_lock, 0);
+}
+
+uint8_t* GetIoBuffer(size_t size)
+{
+	int i, avail = -1;
+	size_t lp_size;
+	uint8_t* buf = NULL;
+
+	IoPoolLock();
+	for (i = 0; i < IO_POOL_ENTRIES; i++) {
+		if ((io_pool[i].buf != NULL) && (!io_pool[i].in_use) && (io_pool[i].size == size)) {
+			io_pool[i].in_use = TRUE;
+			IoPoolUnlock();
+			return io_pool[i].buf;
+		}
+	}
+	// Prefer an empty slot; failing that, evict an idle entry of another size
+	for (i = 0; i < IO_POOL_ENTRIES; i++) {
+		if (io_pool[i].buf == NULL) {
+			avail = i;
+			break;
+		}
+		if ((avail < 0) && (!io_pool[i].in_use))
+			avail = i;
+	}
+	if (large_page_size == 0)
+		large_page_size = GetLargePageMinimum();
+	if (large_page_size != 0) {
+		lp_size = ((size + large_page_size - 1) / large_page_size) * large_page_size;
+		// Requires SeLockMemoryPrivilege, which EnablePrivileges() asked for
+		buf = VirtualAlloc(NULL, lp_size, MEM_COMMIT | MEM_RESERVE | MEM_LARGE_PAGES, PAGE_READWRITE);
+	}
+	if (buf == NULL)
+		buf = VirtualAlloc(NULL, size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+	if (buf == NULL) {
+		IoPoolUnlock();
+		return NULL;
+	}
+	if (avail >= 0) {
+		if (io_pool[avail].buf != NULL)
+			VirtualFree(io_pool[avail].buf, 0, MEM_RELEASE);
+		io_pool[avail].buf = buf;
+		io_pool[avail].size = size;
+		io_pool[avail].in_use = TRUE;
+	}
+	// If the pool is full of busy entries the buffer just isn't tracked, and
+	// ReleaseIoBuffer() frees it outright
+	IoPoolUnlock();
+	return buf;
+}
+
+void ReleaseIoBuffer(void* buf)
+{
+	int i;
+
+	if (buf == NULL)
+		return;
+	IoPoolLock();
+	for (i = 0; i < IO_POOL_ENTRIES; i++) {
+		if (io_pool[i].buf == buf) {
+			io_pool[i].in_use = FALSE;
+			IoPoolUnlock();
+			return;
+		}
+	}
+	IoPoolUnlock();
+	VirtualFree(buf, 0, MEM_RELEASE);
+}
+
+void FreeIoBufferPool(void)
+{
+	int i;
+
+	IoPoolLock();
+	for (i = 0; i < IO_POOL_ENTRIES; i++) {
+		if ((io_pool[i].buf != NULL) && (!io_pool[i].in_use)) {
+			VirtualFree(io_pool[i].buf, 0, MEM_RELEASE);
+			io_pool[i].buf = NULL;
+			io_pool[i].size = 0;
+		}
+	}
+	IoPoolUnlock();
+}
+
+/*
+ * Submit a batch of positioned writes in one go, using overlapped I/O, and aggregate
+ * their completions. On a handle opened with FILE_FLAG_OVERLAPPED the writes are
+ * queued concurrently; on a regular handle each write completes inline, but callers
+ * still benefit from positioned writes (no file pointer dance) and from a single
+ * retry pause per round of failures instead of one per failing write.
+ * Each descriptor's Completed member is updated, so callers that can tolerate the
+ * failure of some writes (e.g. clearing a locked backup GPT) can check individual
+ * outcomes. Returns TRUE only if every write completed in full.
+ */
+BOOL WriteFileBatchWithRetry(HANDLE hFile, batch_write_desc* batch, DWORD nNumDesc, DWORD nNumRetries)
+{
+	BOOL all_done;
+	DWORD i, nTry, written;
+	OVERLAPPED* ov;
+
+	if ((batch == NULL) || (nNumDesc == 0))
+		return FALSE;
+	ov = (OVERLAPPED*)calloc(nNumDesc, sizeof(OVERLAPPED));
+	if (ov == NULL)
+		return FALSE;
+	for (i = 0; i < nNumDesc; i++) {
+		batch[i].Completed = FALSE;
+		ov[i].hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+		if (ov[i].hEvent == NULL) {
+			while (i-- > 0)
+				CloseHandle(ov[i].hEvent);
+			free(ov);
+			return FALSE;
+		}
+	}
+
+	if (nNumRetries == 0)
+		nNumRetries = 1;
+	for (nTry = 1, all_done = FALSE; (nTry <= nNumRetries) && (!all_done); nTry++) {
+		if (nTry > 1) {
+			uprintf("Retrying in %d seconds...", WRITE_TIMEOUT / 1000);
+			// Don't sit idly but use the downtime to check for conflicting processes...
+			Sleep(CheckDriveAccess(WRITE_TIMEOUT, FALSE));
+		}
+		// Submit every write that hasn't fully completed yet
+		for (i = 0; i < nNumDesc; i++) {
+			if (batch[i].Completed)
+				continue;
+			ResetEvent(ov[i].hEvent);
+			ov[i].Internal = 0;
+			ov[i].InternalHigh = 0;
+			ov[i].Offset = (DWORD)batch[i].Offset;
+			ov[i].OffsetHigh = (DWORD)(batch[i].Offset >> 32);
+			if (!WriteFile(hFile, batch[i].pBuffer, batch[i].Length, NULL, &ov[i]) &&
+				(GetLastError() != ERROR_IO_PENDING)) {
+				uprintf("Write error [%u/%u]: %s", i + 1, nNumDesc, WindowsErrorString());
+				LastWriteError = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | GetLastError();
+				// Signalled event = nothing left to collect for this descriptor
+				SetEvent(ov[i].hEvent);
+				ov[i].Internal = (ULONG_PTR)-1;
+			}
+		}
+		// Collect the completions
+		for (i = 0, all_done = TRUE; i < nNumDesc; i++) {
+			if (batch[i].Completed || (ov[i].Internal == (ULONG_PTR)-1)) {
+				all_done = all_done && batch[i].Completed;
+				continue;
+			}
+			written = 0;
+			if (GetOverlappedResult(hFile, &ov[i], &written, TRUE)) {
+				if (written == batch[i].Length) {
+					batch[i].Completed = TRUE;
+					LastWriteError = 0;
+					continue;
+				}
+				uprintf("Wrote %d bytes but requested %d [%u/%u]", written, batch[i].Length, i + 1, nNumDesc);
+			} else {
+				uprintf("Write error [%u/%u]: %s", i + 1, nNumDesc, WindowsErrorString());
+			}
+			LastWriteError = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | GetLastError();
+			all_done = FALSE;
+		}
+	}
+
+	for (i = 0; i < nNumDesc; i++)
+		CloseHandle(ov[i].hEvent);
+	free(ov);
+	if (!all_done && (SCODE_CODE(GetLastError()) == ERROR_SUCCESS))
+		SetLastError(ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | ERROR_WRITE_FAULT);
+	return all_done;
+}
+
 // A WaitForSingleObject() equivalent that doesn't block Windows messages
 // This is needed, for instance, if you are waiting for a thread that may issue uprintf's
 DWORD WaitForSingleObjectWithMessages(HANDLE hHandle, DWORD dwMilliseconds)
@@ -963,17 +1403,116 @@ PF_TYPE_DECL(NTAPI, BOOLEAN, RtlDosPathNameToNtPathNameW, (PCWSTR, PUNICODE_STRI
 PF_TYPE_DECL(NTAPI, BOOLEAN, RtlFreeHeap, (PVOID, ULONG, PVOID));
 PF_TYPE_DECL(NTAPI, VOID, RtlSetLastWin32ErrorAndNtStatusFromNtStatus, (NTSTATUS));
 
+/*
+ * Destination directory handle cache for CreatePreallocatedFile().
+ * The extraction pipeline creates tens of thousands of files, a few
+ * directories at a time, and each create used to convert and resolve the
+ * full destination path from the root. We keep the last few destination
+ * directories open and issue relative NtCreateFile() calls against them
+ * (RootDirectory handle + final path component), so that only the new
+ * file's own name has to be resolved.
+ * The lock is held across the relative create, so that an entry can't be
+ * evicted from under a concurrent pool writer that is using its handle.
+ * Since open handles on the target volume would prevent it from being
+ * locked, extraction callers must issue CloseDirHandleCache() once done.
+ */
+#define DIR_CACHE_SIZE 8
+typedef struct {
+	char path[MAX_PATH];
+	HANDLE handle;
+	uint64_t last_used;
+} dir_cache_entry;
+static dir_cache_entry dir_cache[DIR_CACHE_SIZE];
+static uint64_t dir_cache_clock = 0;
+static CRITICAL_SECTION dir_cache_lock;
+static volatile LONG dir_cache_lock_state = 0;	// 0 = uninit, 1 = initializing, 2 = ready
+
+static void DirCacheLock(void)
+{
+	// First caller may be any of the pool writers, so latch the init
+	if (InterlockedCompareExchange(&dir_cache_lock_state, 1, 0) == 0) {
+		InitializeCriticalSection(&dir_cache_lock);
+		InterlockedExchange(&dir_cache_lock_state, 2);
+	} else {
+		while (dir_cache_lock_state != 2)
+			Sleep(0);
+	}
+	EnterCriticalSection(&dir_cache_lock);
+}
+
+// Return an open handle for the first 'len' chars of 'path', opening and
+// caching the directory on a miss. Must be called with the lock held.
+static HANDLE DirCacheGetRoot(const char* path, size_t len)
+{
+	int i, evict = 0;
+	char dir[MAX_PATH];
+
+	if ((len < 2) || (len >= sizeof(dir) - 1))
+		return INVALID_HANDLE_VALUE;
+	memcpy(dir, path, len);
+	// 'X:' on its own means "current directory of drive X" => keep the separator
+	if (dir[len - 1] == ':')
+		dir[len++] = '\\';
+	dir[len] = 0;
+	for (i = 0; i < DIR_CACHE_SIZE; i++) {
+		if ((dir_cache[i].handle != NULL) && (safe_stricmp(dir_cache[i].path, dir) == 0)) {
+			dir_cache[i].last_used = ++dir_cache_clock;
+			return dir_cache[i].handle;
+		}
+	}
+	// Miss: reuse an empty slot, or failing that evict the least recently used one
+	for (i = 0; i < DIR_CACHE_SIZE; i++) {
+		if (dir_cache[i].handle == NULL) {
+			evict = i;
+			break;
+		}
+		if (dir_cache[i].last_used < dir_cache[evict].last_used)
+			evict = i;
+	}
+	if (dir_cache[evict].handle != NULL)
+		CloseHandle(dir_cache[evict].handle);
+	dir_cache[evict].handle = CreateFileU(dir, FILE_TRAVERSE,
+		FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL,
+		OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, NULL);
+	if (dir_cache[evict].handle == INVALID_HANDLE_VALUE) {
+		dir_cache[evict].handle = NULL;
+		dir_cache[evict].path[0] = 0;
+		return INVALID_HANDLE_VALUE;
+	}
+	static_strcpy(dir_cache[evict].path, dir);
+	dir_cache[evict].last_used = ++dir_cache_clock;
+	return dir_cache[evict].handle;
+}
+
+void CloseDirHandleCache(void)
+{
+	int i;
+
+	if (dir_cache_lock_state != 2)
+		return;
+	EnterCriticalSection(&dir_cache_lock);
+	for (i = 0; i < DIR_CACHE_SIZE; i++) {
+		if (dir_cache[i].handle != NULL)
+			CloseHandle(dir_cache[i].handle);
+		dir_cache[i].handle = NULL;
+		dir_cache[i].path[0] = 0;
+	}
+	LeaveCriticalSection(&dir_cache_lock);
+}
+
 HANDLE CreatePreallocatedFile(const char* lpFileName, DWORD dwDesiredAccess,
 	DWORD dwShareMode, LPSECURITY_ATTRIBUTES lpSecurityAttributes, DWORD dwCreationDisposition,
 	DWORD dwFlagsAndAttributes, LONGLONG fileSize)
 {
-	HANDLE fileHandle = INVALID_HANDLE_VALUE;
+	HANDLE fileHandle = INVALID_HANDLE_VALUE, rootHandle;
 	OBJECT_ATTRIBUTES objectAttributes;
 	IO_STATUS_BLOCK ioStatusBlock;
 	UNICODE_STRING ntPath;
 	ULONG fileAttributes, flags = 0;
 	LARGE_INTEGER allocationSize;
 	NTSTATUS status = STATUS_SUCCESS;
+	const char* sep;
+	wchar_t* wBasename;
 
 	PF_INIT_OR_SET_STATUS(NtCreateFile, Ntdll);
 	PF_INIT_OR_SET_STATUS(RtlDosPathNameToNtPathNameW, Ntdll);
@@ -985,8 +1524,6 @@ HANDLE CreatePreallocatedFile(const char* lpFileName, DWORD dwDesiredAccess,
 			dwCreationDisposition, dwFlagsAndAttributes, NULL);
 	}
 
-	wconvert(lpFileName);
-
 	// Determine creation disposition and flags
 	switch (dwCreationDisposition) {
 	case CREATE_NEW:
@@ -1053,6 +1590,48 @@ HANDLE CreatePreallocatedFile(const char* lpFileName, DWORD dwDesiredAccess,
 
 	dwDesiredAccess |= (SYNCHRONIZE | FILE_READ_ATTRIBUTES);
 
+	allocationSize.QuadPart = fileSize;
+
+	// Try a relative create against a cached handle of the destination
+	// directory first, so that repeated creates under the same tree don't
+	// pay for a full path conversion and walk on every call
+	sep = strrchr(lpFileName, '\\');
+	if (sep == NULL)
+		sep = strrchr(lpFileName, '/');
+	if ((sep != NULL) && (sep != lpFileName) && (sep[1] != 0)) {
+		DirCacheLock();
+		rootHandle = DirCacheGetRoot(lpFileName, (size_t)(sep - lpFileName));
+		if (rootHandle != INVALID_HANDLE_VALUE) {
+			wBasename = utf8_to_wchar(&sep[1]);
+			if (wBasename != NULL) {
+				ntPath.Buffer = wBasename;
+				ntPath.Length = (USHORT)(wcslen(wBasename) * sizeof(wchar_t));
+				ntPath.MaximumLength = ntPath.Length + sizeof(wchar_t);
+				InitializeObjectAttributes(&objectAttributes, &ntPath, 0, rootHandle, NULL);
+				if (lpSecurityAttributes != NULL) {
+					if (lpSecurityAttributes->bInheritHandle)
+						objectAttributes.Attributes |= OBJ_INHERIT;
+					objectAttributes.SecurityDescriptor = lpSecurityAttributes->lpSecurityDescriptor;
+				}
+				if ((dwFlagsAndAttributes & FILE_FLAG_POSIX_SEMANTICS) == 0)
+					objectAttributes.Attributes |= OBJ_CASE_INSENSITIVE;
+				status = pfNtCreateFile(&fileHandle, dwDesiredAccess, &objectAttributes, &ioStatusBlock,
+					&allocationSize, fileAttributes, dwShareMode, dwCreationDisposition, flags, NULL, 0);
+				free(wBasename);
+				if (NT_SUCCESS(status)) {
+					LeaveCriticalSection(&dir_cache_lock);
+					pfRtlSetLastWin32ErrorAndNtStatusFromNtStatus(status);
+					return fileHandle;
+				}
+				// Fall through to the absolute path create below
+				fileHandle = INVALID_HANDLE_VALUE;
+			}
+		}
+		LeaveCriticalSection(&dir_cache_lock);
+	}
+
+	wconvert(lpFileName);
+
 	// Convert DOS path to NT format
 	if (!pfRtlDosPathNameToNtPathNameW(wlpFileName, &ntPath, NULL, NULL)) {
 		wfree(lpFileName);
@@ -1071,8 +1650,6 @@ HANDLE CreatePreallocatedFile(const char* lpFileName, DWORD dwDesiredAccess,
 	if ((dwFlagsAndAttributes & FILE_FLAG_POSIX_SEMANTICS) == 0)
 		objectAttributes.Attributes |= OBJ_CASE_INSENSITIVE;
 
-	allocationSize.QuadPart = fileSize;
-
 	// Call NtCreateFile
 	status = pfNtCreateFile(&fileHandle, dwDesiredAccess, &objectAttributes, &ioStatusBlock,
 		&allocationSize, fileAttributes, dwShareMode, dwCreationDisposition, flags, NULL, 0);
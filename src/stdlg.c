@@ -1856,23 +1856,31 @@ void SetTitleBarIcon(HWND hDlg)
 	SendMessage (hDlg, WM_SETICON, ICON_BIG, (LPARAM)hBigIcon);
 }
 
+/*
+ * Cache for GetTextSize(). Layout passes measure the same localized strings
+ * over and over (every localization change or DPI adjustment triggers a full
+ * re-layout), and each measurement is a GDI round trip. Extents are keyed on
+ * the text plus the font handle and scaling factor, so a font or DPI change
+ * simply misses the cache, and the table is flushed if it ever fills up
+ * (e.g. after enough language switches) rather than grown.
+ */
+#define TEXT_SIZE_CACHE_SIZE 1024
+static htab_table text_size_cache = HTAB_EMPTY;
+
 // Return the onscreen size of the text displayed by a control
 SIZE GetTextSize(HWND hCtrl, char* txt)
 {
-	SIZE sz = {0, 0};
-	HDC hDC;
+	SIZE sz = {0, 0}, *psz;
+	HDC hDC = NULL;
 	wchar_t *wstr = NULL;
+	char *str = NULL, *key = NULL;
 	int len;
+	uint32_t i, idx = 0;
 	HFONT hFont;
 
-	// Compute the size of the text
-	hDC = GetDC(hCtrl);
-	if (hDC == NULL)
-		goto out;
 	hFont = (HFONT)SendMessageA(hCtrl, WM_GETFONT, 0, 0);
 	if (hFont == NULL)
 		goto out;
-	SelectObject(hDC, hFont);
 	if (txt == NULL) {
 		len = GetWindowTextLengthW(hCtrl);
 		if (len <= 0)
@@ -1880,15 +1888,56 @@ SIZE GetTextSize(HWND hCtrl, char* txt)
 		wstr = calloc(len + 1, sizeof(wchar_t));
 		if (wstr == NULL)
 			goto out;
-		if (GetWindowTextW(hCtrl, wstr, len + 1) > 0)
-			GetTextExtentPoint32W(hDC, wstr, len, &sz);
+		if (GetWindowTextW(hCtrl, wstr, len + 1) <= 0)
+			goto out;
+		str = wchar_to_utf8(wstr);
 	} else {
 		wstr = utf8_to_wchar(txt);
-		if (wstr != NULL)
-			GetTextExtentPoint32W(hDC, wstr, (int)wcslen(wstr), &sz);
+		str = txt;
+	}
+	if ((wstr == NULL) || (str == NULL))
+		goto out;
+
+	// Look for a cached extent for this text, font and scaling factor
+	if (text_size_cache.table == NULL)
+		htab_create(TEXT_SIZE_CACHE_SIZE, &text_size_cache);
+	key = malloc(strlen(str) + 32);
+	if ((key != NULL) && (text_size_cache.table != NULL)) {
+		sprintf(key, "%d\t%p\t%s", (int)(fScale * 100.0f), (void*)hFont, str);
+		if (text_size_cache.filled >= text_size_cache.size - 1) {
+			// Cache is full => flush it and start over
+			for (i = 0; i < text_size_cache.size + 1; i++)
+				safe_free(text_size_cache.table[i].data);
+			htab_destroy(&text_size_cache);
+			htab_create(TEXT_SIZE_CACHE_SIZE, &text_size_cache);
+		}
+		idx = htab_hash(key, &text_size_cache);
+		if ((idx != 0) && (text_size_cache.table[idx].data != NULL)) {
+			sz = *(SIZE*)text_size_cache.table[idx].data;
+			goto out;
+		}
 	}
+
+	// Compute the size of the text
+	hDC = GetDC(hCtrl);
+	if (hDC == NULL)
+		goto out;
+	SelectObject(hDC, hFont);
+	if (!GetTextExtentPoint32W(hDC, wstr, (int)wcslen(wstr), &sz))
+		goto out;
+	if (idx != 0) {
+		psz = malloc(sizeof(SIZE));
+		if (psz != NULL) {
+			*psz = sz;
+			text_size_cache.table[idx].data = psz;
+		}
+	}
+
 out:
+	if (str != txt)
+		safe_free(str);
 	safe_free(wstr);
+	safe_free(key);
 	safe_release_dc(hCtrl, hDC);
 	return sz;
 }
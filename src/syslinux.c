@@ -45,6 +45,16 @@ unsigned long syslinux_ldlinux_len[2];
 unsigned char* syslinux_mboot = NULL;
 unsigned long syslinux_mboot_len;
 
+/*
+ * Session cache for the downloaded ldlinux.sys/ldlinux.bss payloads, so that
+ * back-to-back runs of a duplication batch don't re-read and re-validate the
+ * same files from disk for every flash. The cache holds the pristine content:
+ * the install below patches its own working copy with per-device sector maps.
+ */
+static unsigned char* ldlinux_cache[2] = { NULL, NULL };
+static unsigned long ldlinux_cache_len[2];
+static char ldlinux_cache_id[64] = "";
+
 /* Workaround for 4K support */
 uint32_t SECTOR_SHIFT = 9;
 uint32_t SECTOR_SIZE = 512;
@@ -52,6 +62,17 @@ uint32_t LIBFAT_SECTOR_SHIFT = 9;
 uint32_t LIBFAT_SECTOR_SIZE = 512;
 uint32_t LIBFAT_SECTOR_MASK = 511;
 
+/*
+ * Read-ahead cache for libfat_readfile below, so that walking the FAT chain
+ * of ldlinux.sys doesn't query high-latency media one sector at a time: on a
+ * miss, the next LIBFAT_CACHE_SECTORS sectors are fetched in a single request
+ * and subsequent lookups (the FAT sectors are contiguous) come from memory.
+ */
+#define LIBFAT_CACHE_SECTORS 64
+static unsigned char* libfat_cache = NULL;
+static libfat_sector_t libfat_cache_base = 0;
+static size_t libfat_cache_valid = 0;
+
 /*
  * Wrapper for ReadFile suitable for libfat
  */
@@ -60,12 +81,36 @@ int libfat_readfile(intptr_t pp, void *buf, size_t secsize, libfat_sector_t sect
 	LARGE_INTEGER offset;
 	DWORD bytes_read;
 
+	/* Serve the request from the read-ahead cache whenever possible */
+	if ((libfat_cache != NULL) && (sector >= libfat_cache_base) &&
+		(sector < libfat_cache_base + libfat_cache_valid)) {
+		memcpy(buf, &libfat_cache[(size_t)(sector - libfat_cache_base) * secsize], secsize);
+		return (int)secsize;
+	}
+
 	offset.QuadPart = (LONGLONG) sector * secsize;
 	if (!SetFilePointerEx((HANDLE) pp, offset, NULL, FILE_BEGIN)) {
 		uprintf("Could not set pointer to position %llu: %s", offset.QuadPart, WindowsErrorString());
 		return 0;
 	}
 
+	/* On a miss, coalesce the reads for the next sectors into one request */
+	if (libfat_cache != NULL) {
+		libfat_cache_valid = 0;
+		if (ReadFile((HANDLE) pp, libfat_cache, (DWORD) (LIBFAT_CACHE_SECTORS * secsize), &bytes_read, NULL)
+			&& (bytes_read >= secsize)) {
+			libfat_cache_base = sector;
+			libfat_cache_valid = bytes_read / secsize;
+			memcpy(buf, libfat_cache, secsize);
+			return (int)secsize;
+		}
+		/* Batched read failed or came up short (e.g. end of volume) - retry a single sector */
+		if (!SetFilePointerEx((HANDLE) pp, offset, NULL, FILE_BEGIN)) {
+			uprintf("Could not set pointer to position %llu: %s", offset.QuadPart, WindowsErrorString());
+			return 0;
+		}
+	}
+
 	if (!ReadFile((HANDLE) pp, buf, (DWORD) secsize, &bytes_read, NULL)) {
 		uprintf("Could not read sector %llu: %s", sector, WindowsErrorString());
 		return 0;
@@ -90,8 +135,10 @@ BOOL InstallSyslinux(DWORD drive_index, char drive_letter, int file_system)
 	HANDLE d_handle = INVALID_HANDLE_VALUE;
 	DWORD bytes_read, bytes_written, err;
 	S_NTFSSECT_VOLINFO vol_info = { 0 };
-	LARGE_INTEGER vcn, lba, len;
-	S_NTFSSECT_EXTENT extent;
+	S_NTFSSECT_EXTENT_LIST extent_list = { 0 };
+	S_NTFSSECT_LBA_RUN* lba_runs = NULL;
+	LARGE_INTEGER lba, len;
+	DWORD num_runs;
 	BOOL r = FALSE;
 	FILE* fd;
 	size_t length;
@@ -161,26 +208,54 @@ BOOL InstallSyslinux(DWORD drive_index, char drive_letter, int file_system)
 
 	/* Access a copy of the ldlinux.sys & ldlinux.bss resources (downloaded or embedded) */
 	if ((syslinux_ldlinux_len[0] != 0) && (syslinux_ldlinux_len[1] != 0)) {
-		IGNORE_RETVAL(_chdirU(app_data_dir));
-		for (i = 0; i < 2; i++) {
-			syslinux_ldlinux[i] = (unsigned char*) malloc(syslinux_ldlinux_len[i]);
-			if (syslinux_ldlinux[i] == NULL)
-				goto out;
-			static_sprintf(path, "%s\\%s-%s%s\\%s.%s", FILES_DIR, syslinux, img_report.sl_version_str,
-				img_report.sl_version_ext, ldlinux, i==0?"sys":"bss");
-			fd = fopen(path, "rb");
-			if (fd == NULL) {
-				uprintf("Could not open %s\\%s", app_data_dir, path);
-				goto out;
+		static_sprintf(tmp, "%s%s", img_report.sl_version_str, img_report.sl_version_ext);
+		if ((strcmp(tmp, ldlinux_cache_id) == 0) &&
+			(ldlinux_cache[0] != NULL) && (ldlinux_cache[1] != NULL)) {
+			/* Serve the already validated payloads from the session cache */
+			uprintf("Reusing 'ldlinux.sys' and 'ldlinux.bss' validated earlier this session");
+			for (i = 0; i < 2; i++) {
+				syslinux_ldlinux_len[i] = ldlinux_cache_len[i];
+				syslinux_ldlinux[i] = (unsigned char*) malloc(syslinux_ldlinux_len[i]);
+				if (syslinux_ldlinux[i] == NULL)
+					goto out;
+				memcpy(syslinux_ldlinux[i], ldlinux_cache[i], syslinux_ldlinux_len[i]);
 			}
-			length = fread(syslinux_ldlinux[i], 1, (size_t)syslinux_ldlinux_len[i], fd);
-			fclose(fd);
-			if (length != (size_t)syslinux_ldlinux_len[i]) {
-				uprintf("Could not read %s\\%s", app_data_dir, path);
-				goto out;
+		} else {
+			IGNORE_RETVAL(_chdirU(app_data_dir));
+			for (i = 0; i < 2; i++) {
+				syslinux_ldlinux[i] = (unsigned char*) malloc(syslinux_ldlinux_len[i]);
+				if (syslinux_ldlinux[i] == NULL)
+					goto out;
+				static_sprintf(path, "%s\\%s-%s%s\\%s.%s", FILES_DIR, syslinux, img_report.sl_version_str,
+					img_report.sl_version_ext, ldlinux, i==0?"sys":"bss");
+				fd = fopen(path, "rb");
+				if (fd == NULL) {
+					uprintf("Could not open %s\\%s", app_data_dir, path);
+					goto out;
+				}
+				length = fread(syslinux_ldlinux[i], 1, (size_t)syslinux_ldlinux_len[i], fd);
+				fclose(fd);
+				if (length != (size_t)syslinux_ldlinux_len[i]) {
+					uprintf("Could not read %s\\%s", app_data_dir, path);
+					goto out;
+				}
+				uprintf("Using existing '%s\\%s' %s", app_data_dir, path,
+					IsBufferInDB(syslinux_ldlinux[i], (size_t)syslinux_ldlinux_len[i])?"✓":"✗");
 			}
-			uprintf("Using existing '%s\\%s' %s", app_data_dir, path,
-				IsBufferInDB(syslinux_ldlinux[i], (size_t)syslinux_ldlinux_len[i])?"✓":"✗");
+			/* Keep a pristine copy for the next run of this session */
+			ldlinux_cache_id[0] = 0;
+			for (i = 0; i < 2; i++) {
+				safe_free(ldlinux_cache[i]);
+				ldlinux_cache[i] = (unsigned char*) malloc(syslinux_ldlinux_len[i]);
+				if (ldlinux_cache[i] == NULL)
+					break;
+				memcpy(ldlinux_cache[i], syslinux_ldlinux[i], syslinux_ldlinux_len[i]);
+				ldlinux_cache_len[i] = syslinux_ldlinux_len[i];
+			}
+			if (i == 2)
+				static_strcpy(ldlinux_cache_id, tmp);
+			else
+				safe_free(ldlinux_cache[0]);
 		}
 	} else {
 		for (i = 0; i < 2; i++) {
@@ -223,7 +298,7 @@ BOOL InstallSyslinux(DWORD drive_index, char drive_letter, int file_system)
 		UpdateProgress(OP_FILE_COPY, -1.0f);
 
 	/* Now flush the media */
-	if (!FlushFileBuffers(f_handle)) {
+	if (!WriteBarrier(f_handle, WB_METADATA)) {
 		uprintf("FlushFileBuffers failed");
 		goto out;
 	}
@@ -243,29 +318,38 @@ BOOL InstallSyslinux(DWORD drive_index, char drive_letter, int file_system)
 			uprintf("Could not fetch NTFS volume info");
 			goto out;
 		}
+		/* Retrieve the full coalesced extent mapping in a single ioctl */
+		err = NtfsSectGetFileExtentList(f_handle, &extent_list);
+		if (err != ERROR_SUCCESS) {
+			uprintf("Could not fetch 'ldlinux.sys' extents");
+			goto out;
+		}
+		num_runs = extent_list.Count;
+		lba_runs = (S_NTFSSECT_LBA_RUN*) calloc(num_runs, sizeof *lba_runs);
+		if (lba_runs == NULL)
+			goto out;
+		err = NtfsSectExtentListToLbaRuns(&vol_info, &extent_list, lba_runs, &num_runs);
+		if (err != ERROR_SUCCESS) {
+			uprintf("Could not translate 'ldlinux.sys' extents to disk LBAs");
+			goto out;
+		}
 		secp = sectors;
 		nsectors = 0;
-		for (vcn.QuadPart = 0;
-			NtfsSectGetFileVcnExtent(f_handle, &vcn, &extent) == ERROR_SUCCESS;
-			vcn = extent.NextVcn) {
-				err = NtfsSectLcnToLba(&vol_info, &extent.FirstLcn, &lba);
-				if (err != ERROR_SUCCESS) {
-					uprintf("Could not translate 'ldlinux.sys' LCN to disk LBA");
-					goto out;
-				}
-				lba.QuadPart -= vol_info.PartitionLba.QuadPart;
-				len.QuadPart = ((extent.NextVcn.QuadPart -
-					extent.FirstVcn.QuadPart) *
-					vol_info.SectorsPerCluster);
-				while (len.QuadPart-- && nsectors < ldlinux_sectors) {
-					*secp++ = lba.QuadPart++;
-					nsectors++;
-				}
+		for (i = 0; (i < (int)num_runs) && (nsectors < ldlinux_sectors); i++) {
+			lba.QuadPart = lba_runs[i].FirstLba.QuadPart - vol_info.PartitionLba.QuadPart;
+			len.QuadPart = lba_runs[i].SectorCount.QuadPart;
+			while (len.QuadPart-- && nsectors < ldlinux_sectors) {
+				*secp++ = lba.QuadPart++;
+				nsectors++;
+			}
 		}
 		break;
 	case FS_FAT16:
 	case FS_FAT32:
 	case FS_EXFAT:
+		/* Enable batched reads for the FAT chain walk below */
+		libfat_cache = _mm_malloc((size_t)LIBFAT_CACHE_SECTORS * SECTOR_SIZE, 16);
+		libfat_cache_valid = 0;
 		lf_fs = libfat_open(libfat_readfile, (intptr_t) d_handle);
 		if (lf_fs == NULL) {
 			uprintf("Syslinux FAT access error");
@@ -386,7 +470,10 @@ BOOL InstallSyslinux(DWORD drive_index, char drive_letter, int file_system)
 	r = TRUE;
 
 out:
+	NtfsSectFreeExtentList(&extent_list);
+	safe_free(lba_runs);
 	safe_mm_free(sectbuf);
+	safe_mm_free(libfat_cache);
 	safe_free(syslinux_ldlinux[0]);
 	safe_free(syslinux_ldlinux[1]);
 	safe_free(sectors);
@@ -13,13 +13,76 @@
 /*
  * cache.c
  *
- * Simple sector cache
+ * Hash-indexed sector cache with LRU eviction, so that FAT chain
+ * traversal stays O(1) per sector and hot FAT sectors are never
+ * dropped just because the cache is full.
  */
 
 #include <stdlib.h>
+#include <string.h>
 #include <malloc.h>
 #include "libfatint.h"
 
+static unsigned int libfat_hash(libfat_sector_t n)
+{
+    return (unsigned int)n & (LIBFAT_CACHE_BUCKETS - 1);
+}
+
+/* Remove a sector from both the hash chain and the LRU list */
+static void cache_unlink(struct libfat_filesystem *fs, struct libfat_sector *ls)
+{
+    struct libfat_sector **pp;
+
+    for (pp = &fs->buckets[libfat_hash(ls->n)]; *pp; pp = &(*pp)->next) {
+	if (*pp == ls) {
+	    *pp = ls->next;
+	    break;
+	}
+    }
+    if (ls->lru_prev)
+	ls->lru_prev->lru_next = ls->lru_next;
+    else
+	fs->lru_head = ls->lru_next;
+    if (ls->lru_next)
+	ls->lru_next->lru_prev = ls->lru_prev;
+    else
+	fs->lru_tail = ls->lru_prev;
+    fs->ncached--;
+}
+
+/* Insert a sector into its hash chain and at the front of the LRU list */
+static void cache_link(struct libfat_filesystem *fs, struct libfat_sector *ls,
+		       libfat_sector_t n)
+{
+    ls->n = n;
+    ls->next = fs->buckets[libfat_hash(n)];
+    fs->buckets[libfat_hash(n)] = ls;
+    ls->lru_prev = NULL;
+    ls->lru_next = fs->lru_head;
+    if (fs->lru_head)
+	fs->lru_head->lru_prev = ls;
+    else
+	fs->lru_tail = ls;
+    fs->lru_head = ls;
+    fs->ncached++;
+}
+
+/* Move a cached sector to the front of the LRU list */
+static void cache_touch(struct libfat_filesystem *fs, struct libfat_sector *ls)
+{
+    if (fs->lru_head == ls)
+	return;
+    ls->lru_prev->lru_next = ls->lru_next;
+    if (ls->lru_next)
+	ls->lru_next->lru_prev = ls->lru_prev;
+    else
+	fs->lru_tail = ls->lru_prev;
+    ls->lru_prev = NULL;
+    ls->lru_next = fs->lru_head;
+    fs->lru_head->lru_prev = ls;
+    fs->lru_head = ls;
+}
+
 /*
  * NB: We need to align our sector buffers to at least the 8-byte mark, as some Windows
  * disk devices, notably O2Micro PCI-E SD card readers, return ERROR_INVALID_PARAMETER
@@ -32,19 +95,26 @@ void *libfat_get_sector(struct libfat_filesystem *fs, libfat_sector_t n)
 {
     struct libfat_sector *ls;
 
-    for (ls = fs->sectors; ls; ls = ls->next) {
-	if (ls->n == n)
+    for (ls = fs->buckets[libfat_hash(n)]; ls; ls = ls->next) {
+	if (ls->n == n) {
+	    cache_touch(fs, ls);
 	    return ls->data;	/* Found in cache */
+	}
     }
 
-    /* Not found in cache */
-    ls = _mm_malloc(sizeof(struct libfat_sector) + LIBFAT_SECTOR_SIZE, 16);
-    if (!ls) {
-	libfat_flush(fs);
+    /* Not found in cache: evict the least recently used sector at capacity */
+    if (fs->ncached >= fs->cache_size && fs->lru_tail != NULL) {
+	ls = fs->lru_tail;
+	cache_unlink(fs, ls);
+    } else {
 	ls = _mm_malloc(sizeof(struct libfat_sector) + LIBFAT_SECTOR_SIZE, 16);
+	if (!ls) {
+	    libfat_flush(fs);
+	    ls = _mm_malloc(sizeof(struct libfat_sector) + LIBFAT_SECTOR_SIZE, 16);
 
-	if (!ls)
-	    return NULL;	/* Can't allocate memory */
+	    if (!ls)
+		return NULL;	/* Can't allocate memory */
+	}
     }
 
     if (fs->read(fs->readptr, ls->data, LIBFAT_SECTOR_SIZE, n)
@@ -53,9 +123,7 @@ void *libfat_get_sector(struct libfat_filesystem *fs, libfat_sector_t n)
 	return NULL;		/* I/O error */
     }
 
-    ls->n = n;
-    ls->next = fs->sectors;
-    fs->sectors = ls;
+    cache_link(fs, ls, n);
 
     return ls->data;
 }
@@ -64,11 +132,26 @@ void libfat_flush(struct libfat_filesystem *fs)
 {
     struct libfat_sector *ls, *lsnext;
 
-    lsnext = fs->sectors;
-    fs->sectors = NULL;
+    for (ls = fs->lru_head; ls; ls = lsnext) {
+	lsnext = ls->lru_next;
+	_mm_free(ls);
+    }
+    fs->lru_head = NULL;
+    fs->lru_tail = NULL;
+    memset(fs->buckets, 0, sizeof(fs->buckets));
+    fs->ncached = 0;
+}
+
+void libfat_set_cache_size(struct libfat_filesystem *fs, int nsectors)
+{
+    struct libfat_sector *ls;
 
-    for (ls = lsnext; ls; ls = lsnext) {
-	lsnext = ls->next;
+    if (nsectors < 1)
+	nsectors = 1;
+    fs->cache_size = nsectors;
+    while (fs->ncached > fs->cache_size && fs->lru_tail != NULL) {
+	ls = fs->lru_tail;
+	cache_unlink(fs, ls);
 	_mm_free(ls);
     }
 }
@@ -86,6 +86,12 @@ libfat_sector_t libfat_nextsector(struct libfat_filesystem *fs,
  */
 void libfat_flush(struct libfat_filesystem *fs);
 
+/*
+ * Set the sector cache capacity (in sectors), evicting the least
+ * recently used sectors if the cache is over the new capacity.
+ */
+void libfat_set_cache_size(struct libfat_filesystem *fs, int nsectors);
+
 /*
  * Get a pointer to a specific sector.
  */
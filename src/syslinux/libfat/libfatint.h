@@ -30,9 +30,15 @@
 #define ALIGN_END(m)
 #endif
 
+/* Sector cache geometry: hash-indexed, with LRU eviction - see cache.c */
+#define LIBFAT_CACHE_BUCKETS	256	/* Must be a power of two */
+#define LIBFAT_CACHE_SECTORS	1024	/* Default capacity, in sectors */
+
 ALIGN_START(16) struct libfat_sector {
 	libfat_sector_t n;		/* Sector number */
-	struct libfat_sector *next;	/* Next in list */
+	struct libfat_sector *next;	/* Next in hash bucket chain */
+	struct libfat_sector *lru_prev;	/* LRU list (head = most recent) */
+	struct libfat_sector *lru_next;
 	/* data[0] MUST be aligned to at least 8 bytes - see cache.c */
 	ALIGN_START(16) char data[0] ALIGN_END(16);
 } ALIGN_END(16);
@@ -58,7 +64,10 @@ struct libfat_filesystem {
     libfat_sector_t data;	/* Start of data area */
     libfat_sector_t end;	/* End of filesystem */
 
-    struct libfat_sector *sectors;
+    struct libfat_sector *buckets[LIBFAT_CACHE_BUCKETS];
+    struct libfat_sector *lru_head, *lru_tail;
+    int ncached;
+    int cache_size;		/* Capacity, in sectors */
 };
 
 #endif /* LIBFATINT_H */
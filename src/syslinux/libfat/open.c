@@ -18,6 +18,7 @@
  */
 
 #include <stdlib.h>
+#include <string.h>
 #include "libfatint.h"
 #include "ulint.h"
 
@@ -35,7 +36,8 @@ libfat_open(int (*readfunc) (intptr_t, void *, size_t, libfat_sector_t),
     if (!fs)
 	goto barf;
 
-    fs->sectors = NULL;
+    memset(fs, 0, sizeof(*fs));
+    fs->cache_size = LIBFAT_CACHE_SECTORS;
     fs->read = readfunc;
     fs->readptr = readptr;
 
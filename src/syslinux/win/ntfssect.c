@@ -22,6 +22,7 @@
 #include <windows.h>
 #include <winioctl.h>
 #include <stddef.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "ntfssect.h"
@@ -89,6 +90,130 @@ DWORD M_NTFSSECT_API NtfsSectGetFileVcnExtent(
     return rc;
   }
 
+DWORD M_NTFSSECT_API NtfsSectGetFileExtentList(
+    HANDLE File,
+    S_NTFSSECT_EXTENT_LIST * List
+  ) {
+    BOOL ok;
+    DWORD alloc_extents = 64;
+    DWORD i, output_size, rc;
+    STARTING_VCN_INPUT_BUFFER input;
+    RETRIEVAL_POINTERS_BUFFER * output = NULL;
+    S_NTFSSECT_EXTENT * extent;
+    LARGE_INTEGER vcn;
+
+    if (File == INVALID_HANDLE_VALUE || !List)
+      return ERROR_INVALID_PARAMETER;
+
+    List->Count = 0;
+    List->Extents = NULL;
+
+    /* Grow the output buffer until the whole mapping fits in a single call */
+    for (;;) {
+        output_size = (DWORD) (offsetof(RETRIEVAL_POINTERS_BUFFER, Extents) +
+            alloc_extents * sizeof output->Extents[0]);
+        free(output);
+        output = malloc(output_size);
+        if (!output) {
+            rc = ERROR_NOT_ENOUGH_MEMORY;
+            goto err;
+          }
+        input.StartingVcn.QuadPart = 0;
+        ok = DeviceIoControl(
+            File,
+            FSCTL_GET_RETRIEVAL_POINTERS,
+            &input,
+            sizeof input,
+            output,
+            output_size,
+            &output_size,
+            NULL
+          );
+        if (ok)
+          break;
+        rc = GetLastError();
+        if (rc != ERROR_MORE_DATA) {
+            M_ERR("NtfsSectGetFileExtentList(): Couldn't fetch retrieval pointers!");
+            goto err;
+          }
+        alloc_extents *= 2;
+      }
+
+    if (!output->ExtentCount) {
+        /* Resident file - it has no extents of its own */
+        rc = ERROR_HANDLE_EOF;
+        goto err;
+      }
+
+    List->Extents = malloc(output->ExtentCount * sizeof *List->Extents);
+    if (!List->Extents) {
+        rc = ERROR_NOT_ENOUGH_MEMORY;
+        goto err;
+      }
+
+    /* Merge runs whose clusters turn out to be contiguous on the volume */
+    vcn = output->StartingVcn;
+    extent = NULL;
+    for (i = 0; i < output->ExtentCount; i++) {
+        if (extent &&
+            output->Extents[i].Lcn.QuadPart == extent->FirstLcn.QuadPart +
+              (extent->NextVcn.QuadPart - extent->FirstVcn.QuadPart)) {
+            extent->NextVcn = output->Extents[i].NextVcn;
+          } else {
+            extent = extent ? extent + 1 : List->Extents;
+            extent->FirstVcn = vcn;
+            extent->NextVcn = output->Extents[i].NextVcn;
+            extent->FirstLcn = output->Extents[i].Lcn;
+          }
+        vcn = output->Extents[i].NextVcn;
+      }
+    List->Count = (DWORD) (extent - List->Extents) + 1;
+    free(output);
+    return ERROR_SUCCESS;
+
+    err:
+    free(output);
+    free(List->Extents);
+    List->Extents = NULL;
+    return rc;
+  }
+
+VOID M_NTFSSECT_API NtfsSectFreeExtentList(S_NTFSSECT_EXTENT_LIST * List) {
+    if (!List)
+      return;
+    free(List->Extents);
+    List->Extents = NULL;
+    List->Count = 0;
+    return;
+  }
+
+DWORD M_NTFSSECT_API NtfsSectExtentListToLbaRuns(
+    const S_NTFSSECT_VOLINFO * VolumeInfo,
+    const S_NTFSSECT_EXTENT_LIST * List,
+    S_NTFSSECT_LBA_RUN * Runs,
+    DWORD * Count
+  ) {
+    DWORD i, rc;
+
+    if (!List || !Runs || !Count)
+      return ERROR_INVALID_PARAMETER;
+    if (*Count < List->Count)
+      return ERROR_INSUFFICIENT_BUFFER;
+
+    for (i = 0; i < List->Count; i++) {
+        rc = NtfsSectLcnToLba(VolumeInfo, &List->Extents[i].FirstLcn, &Runs[i].FirstLba);
+        if (rc != ERROR_SUCCESS)
+          return rc;
+        Runs[i].SectorCount.QuadPart = (
+            (List->Extents[i].NextVcn.QuadPart -
+            List->Extents[i].FirstVcn.QuadPart) *
+            VolumeInfo->SectorsPerCluster
+          );
+      }
+    *Count = List->Count;
+    return ERROR_SUCCESS;
+  }
+
 /* Internal use only */
 static DWORD NtfsSectGetVolumeHandle(
     CHAR * VolumeName,
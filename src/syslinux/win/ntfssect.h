@@ -29,6 +29,12 @@
 /* An "extent;" a contiguous range of file data */
 typedef struct S_NTFSSECT_EXTENT_ S_NTFSSECT_EXTENT;
 
+/* A growable list of merged extents for a whole file */
+typedef struct S_NTFSSECT_EXTENT_LIST_ S_NTFSSECT_EXTENT_LIST;
+
+/* A contiguous run of volume sectors, in absolute disk LBAs */
+typedef struct S_NTFSSECT_LBA_RUN_ S_NTFSSECT_LBA_RUN;
+
 /* Volume info relevant to file cluster & sector info */
 typedef struct S_NTFSSECT_VOLINFO_ S_NTFSSECT_VOLINFO;
 
@@ -65,6 +71,44 @@ DWORD M_NTFSSECT_API NtfsSectGetFileVcnExtent(
     S_NTFSSECT_EXTENT * Extent
   );
 
+/**
+ * Fetch the entire extent mapping for a file in a single retrieval,
+ * merging runs that are contiguous on the volume
+ *
+ * @v File
+ * @v List
+ * @ret DWORD
+ */
+DWORD M_NTFSSECT_API NtfsSectGetFileExtentList(
+    HANDLE File,
+    S_NTFSSECT_EXTENT_LIST * List
+  );
+
+/**
+ * Free an extent list populated by NtfsSectGetFileExtentList()
+ *
+ * @v List
+ */
+VOID M_NTFSSECT_API NtfsSectFreeExtentList(S_NTFSSECT_EXTENT_LIST * List);
+
+/**
+ * Translate a whole extent list into absolute disk LBA runs.
+ * On entry, Count holds the capacity of Runs; on success, it receives
+ * the number of runs that were populated
+ *
+ * @v VolumeInfo
+ * @v List
+ * @v Runs
+ * @v Count
+ * @ret DWORD
+ */
+DWORD M_NTFSSECT_API NtfsSectExtentListToLbaRuns(
+    const S_NTFSSECT_VOLINFO * VolumeInfo,
+    const S_NTFSSECT_EXTENT_LIST * List,
+    S_NTFSSECT_LBA_RUN * Runs,
+    DWORD * Count
+  );
+
 /**
  * Populate a volume info object
  *
@@ -134,6 +178,16 @@ struct S_NTFSSECT_EXTENT_ {
     LARGE_INTEGER FirstLcn;
   };
 
+struct S_NTFSSECT_EXTENT_LIST_ {
+    DWORD Count;
+    S_NTFSSECT_EXTENT * Extents;
+  };
+
+struct S_NTFSSECT_LBA_RUN_ {
+    LARGE_INTEGER FirstLba;
+    LARGE_INTEGER SectorCount;
+  };
+
 struct S_NTFSSECT_VOLINFO_ {
     DWORD Size;
     HANDLE Handle;
@@ -38,6 +38,7 @@
 #include "resource.h"
 #include "msapi_utf8.h"
 #include "localization.h"
+#include "settings.h"
 
 #include "ui.h"
 #include "ui_data.h"
@@ -305,6 +306,56 @@ void GetFullWidth(HWND hDlg)
 	// TODO: Also pick a few choice messages from info/status
 }
 
+/*
+ * The control metrics computed above only depend on the application version,
+ * the translation strings, the DPI bucket and the Windows version, yet they
+ * cost a few dozen text measurement passes (each selecting a font into a DC)
+ * before anything can be painted. Cache them in the settings store, keyed by
+ * everything they depend on, so that subsequent cold starts can apply the
+ * precomputed layout in a single pass instead of re-measuring.
+ */
+static void GetLayoutSignature(HWND hDlg, char* sig, size_t sig_size)
+{
+	char title[64];
+
+	// The (unmodified) dialog title includes the full version, which takes
+	// care of invalidating the cache when the translations get updated
+	GetWindowTextU(hDlg, title, sizeof(title));
+	safe_sprintf(sig, sig_size, "%s,%s,%d,%d", title, selected_locale->txt[0],
+		(int)(fScale * 100.0f), nWindowsVersion);
+}
+
+BOOL LoadLayoutCache(HWND hDlg)
+{
+	char sig[128], *str;
+	size_t len;
+	int val[13];
+
+	GetLayoutSignature(hDlg, sig, sizeof(sig));
+	len = strlen(sig);
+	str = ReadSettingStr(SETTING_UI_LAYOUT_CACHE);
+	if ((str == NULL) || (strncmp(str, sig, len) != 0) || (str[len] != '|'))
+		return FALSE;
+	if (sscanf(&str[len + 1], "%d,%d,%d,%d,%d,%d,%d,%d,%d,%d,%d,%d,%d",
+		&val[0], &val[1], &val[2], &val[3], &val[4], &val[5], &val[6],
+		&val[7], &val[8], &val[9], &val[10], &val[11], &val[12]) != 13)
+		return FALSE;
+	cbw = val[0]; ddw = val[1]; sw = val[2]; mw = val[3]; bh = val[4];
+	sbw = val[5]; ssw = val[6]; tw = val[7]; dbw = val[8]; bw = val[9];
+	hw = val[10]; bsw = val[11]; fw = val[12];
+	return TRUE;
+}
+
+void SaveLayoutCache(HWND hDlg)
+{
+	char sig[128], str[256];
+
+	GetLayoutSignature(hDlg, sig, sizeof(sig));
+	static_sprintf(str, "%s|%d,%d,%d,%d,%d,%d,%d,%d,%d,%d,%d,%d,%d", sig,
+		cbw, ddw, sw, mw, bh, sbw, ssw, tw, dbw, bw, hw, bsw, fw);
+	WriteSettingStr(SETTING_UI_LAYOUT_CACHE, str);
+}
+
 void PositionMainControls(HWND hDlg)
 {
 	RECT rc;
@@ -352,7 +403,7 @@ void PositionMainControls(HWND hDlg)
 	GetWindowRect(hCtrl, &rc);
 	MapWindowPoints(NULL, hDlg, (POINT*)&rc, 2);
 	advanced_device_section_height = rc.top;
-	hCtrl = GetDlgItem(hDlg, IDC_RUFUS_MBR);
+	hCtrl = GetDlgItem(hDlg, IDC_BENCHMARK);
 	GetWindowRect(hCtrl, &rc);
 	MapWindowPoints(NULL, hDlg, (POINT*)&rc, 2);
 	advanced_device_section_height = rc.bottom - advanced_device_section_height;
@@ -475,10 +526,10 @@ void PositionMainControls(HWND hDlg)
 		hCtrl = GetDlgItem(hDlg, half_width_ids[i]);
 		GetWindowRect(hCtrl, &rc);
 		MapWindowPoints(NULL, hDlg, (POINT*)&rc, 2);
-		// First 5 controls are on the left handside
+		// First 6 controls are on the left handside
 		// First 2 controls may overflow into separator
 		hPrevCtrl = GetNextWindow(hCtrl, GW_HWNDPREV);
-		SetWindowPos(hCtrl, hPrevCtrl, (i < 5) ? rc.left : mw + hw + sw, rc.top,
+		SetWindowPos(hCtrl, hPrevCtrl, (i < 6) ? rc.left : mw + hw + sw, rc.top,
 			(i <2) ? hw + sw : hw, rc.bottom - rc.top, 0);
 	}
 
@@ -548,9 +599,9 @@ void AdjustForLowDPI(HWND hDlg)
 		}
 	}
 
-	section_vpos[1] += 9 * ddy;
-	section_vpos[2] += 16 * ddy + 1;
-	advanced_device_section_height += 3 * ddy;
+	section_vpos[1] += 10 * ddy;
+	section_vpos[2] += 17 * ddy + 1;
+	advanced_device_section_height += 4 * ddy;
 	advanced_format_section_height += 3 * ddy + 1;
 
 	ResizeDialogs(dy + 2 * ddy);
@@ -1303,6 +1354,10 @@ struct bar_progress {
 	uint64_t recent_bytes;          // bytes downloaded so far.
 	BOOL stalled;                   // set when no data arrives for longer than STALL_START_TIME, then reset when new data arrives.
 
+	// EWMA-smoothed transfer rate (bytes/s), from which the speed and ETA displays both derive.
+	double ewma_speed;
+	uint64_t ewma_time;             // time of the last EWMA update, measured since the beginning of download.
+
 	// The following are used to make sure that ETA information doesn't flicker.
 	uint64_t last_eta_time;         // time of the last update to download speed and ETA, measured since the beginning of download.
 	int last_eta_value;
@@ -1390,7 +1445,12 @@ static void bar_update(struct bar_progress* bp, uint64_t howmuch, uint64_t dltim
 // display percentage completed, rate of transfer and estimated remaining duration.
 // During init (op = OP_INIT) an optional HWND can be passed on which to look for
 // a progress bar. Part of the code (eta, speed) comes from GNU wget.
-void _UpdateProgressWithInfo(int op, int msg, uint64_t processed, uint64_t total, BOOL force)
+// Latest progress values deposited by the worker threads, rendered by the coalescing timer
+static volatile LONG progress_pending = 0;
+static volatile LONG progress_op = 0, progress_msg = 0;
+static volatile LONG64 progress_processed = 0, progress_total = 0;
+
+static void UpdateProgressWithInfoRender(int op, int msg, uint64_t processed, uint64_t total, BOOL force)
 {
 	static int last_update_progress_type = UPT_PERCENT;
 	static struct bar_progress bp = { 0 };
@@ -1400,6 +1460,8 @@ void _UpdateProgressWithInfo(int op, int msg, uint64_t processed, uint64_t total
 	uint64_t speed = 0, current_time = GetTickCount64();
 	double percent = 0.0;
 	char msg_data[128];
+	static int last_info_msg = -1;
+	static char last_msg_data[128];
 	static BOOL bNoAltMode = FALSE;
 
 	if (op == OP_INIT) {
@@ -1410,6 +1472,9 @@ void _UpdateProgressWithInfo(int op, int msg, uint64_t processed, uint64_t total
 		speed = 0;
 		memset(&bp, 0, sizeof(bp));
 		bp.total_length = total;
+		last_info_msg = -1;
+		last_msg_data[0] = 0;
+		InterlockedExchange(&progress_pending, 0);
 		hProgressBar = NULL;
 		bNoAltMode = (BOOL)msg;
 		if (hProgressDialog != NULL) {
@@ -1444,13 +1509,27 @@ void _UpdateProgressWithInfo(int op, int msg, uint64_t processed, uint64_t total
 			speed = 0;
 		}
 		bar_update(&bp, howmuch, dl_total_time);
+		// Fold the ring-averaged speed into an exponentially weighted moving average
+		// (first order filter, dt-weighted so the smoothing doesn't depend on how often
+		// we get to render). This produces a single rate that tracks genuine speed
+		// changes - such as a device's write cache filling up - without the jerkiness
+		// of the raw ring average, and that both the rate and ETA displays derive from.
+		if (speed != 0) {
+			double dt = (double)(dl_total_time - bp.ewma_time);
+			double alpha = dt / (dt + SPEED_EWMA_TAU);
+			bp.ewma_speed = (bp.ewma_speed == 0.0) ?
+				(1.0 * speed) : alpha * speed + (1.0 - alpha) * bp.ewma_speed;
+			bp.ewma_time = dl_total_time;
+		} else if (bp.stalled) {
+			bp.ewma_speed = 0.0;
+		}
 
 		if (bNoAltMode)
 			update_progress_type = UPT_PERCENT;
 		switch (update_progress_type) {
 		case UPT_SPEED:
-			if (speed != 0)
-				static_sprintf(msg_data, "%s/s", SizeToHumanReadable(speed, FALSE, FALSE));
+			if (bp.ewma_speed >= 1.0)
+				static_sprintf(msg_data, "%s/s", SizeToHumanReadable((uint64_t)bp.ewma_speed, FALSE, FALSE));
 			else
 				static_sprintf(msg_data, "---");
 			break;
@@ -1465,14 +1544,14 @@ void _UpdateProgressWithInfo(int op, int msg, uint64_t processed, uint64_t total
 					(dl_total_time - bp.last_eta_time < ETA_REFRESH_INTERVAL)) {
 					eta = bp.last_eta_value;
 				} else {
-					// Calculate ETA using the average download speed to predict
-					// the future speed. If you want to use a speed averaged
-					// over a more recent period, replace dl_total_time with
-					// hist->total_time and bp->count with hist->total_bytes.
-					// I found that doing that results in a very jerky and
-					// ultimately unreliable ETA.
+					// Predict using the EWMA-smoothed rate, which tracks genuine
+					// speed changes that the whole-run average would keep ignoring,
+					// without the jerkiness that made the raw ring average unusable
+					// for this purpose. Until the filter has data, fall back to the
+					// whole-run average.
 					uint64_t bytes_remaining = bp.total_length - processed;
-					double d_eta = (dl_total_time / 1000.0) * (bytes_remaining * 1.0) / (bp.count * 1.0);
+					double d_eta = (bp.ewma_speed >= 1.0) ? (bytes_remaining * 1.0) / bp.ewma_speed :
+						(dl_total_time / 1000.0) * (bytes_remaining * 1.0) / (bp.count * 1.0);
 					if (d_eta >= INT_MAX - 1)
 						goto skip_eta;
 					eta = (uint32_t)(d_eta + 0.5);
@@ -1499,7 +1578,13 @@ void _UpdateProgressWithInfo(int op, int msg, uint64_t processed, uint64_t total
 			}
 			if ((force) || ((msg >= 0) && ((current_time > bp.last_screen_update + SCREEN_REFRESH_INTERVAL) ||
 				(last_update_progress_type != update_progress_type) || (bp.count == bp.total_length)))) {
-				PrintInfo(0, msg, msg_data);
+				// Skip the message formatting and output altogether if it would produce
+				// the exact same string as the one currently being displayed.
+				if ((force) || (msg != last_info_msg) || (strcmp(msg_data, last_msg_data) != 0)) {
+					PrintInfo(0, msg, msg_data);
+					last_info_msg = msg;
+					static_strcpy(last_msg_data, msg_data);
+				}
 				bp.last_screen_update = current_time;
 			}
 			last_refresh = current_time;
@@ -1508,6 +1593,39 @@ void _UpdateProgressWithInfo(int op, int msg, uint64_t processed, uint64_t total
 	}
 }
 
+void _UpdateProgressWithInfo(int op, int msg, uint64_t processed, uint64_t total, BOOL force)
+{
+	// Publish the raw counters to the shared memory log section (if one is
+	// active) at full rate, since that path involves no UI at all
+	LogSectionCounters(op, processed, total);
+	// When called from a worker thread, rendering directly would mean message formatting
+	// and cross-thread SendMessage() round trips on every buffer of the write/hash loops.
+	// Just stash the latest values and let the ~30 Hz coalescing timer, which runs on the
+	// UI thread, perform the actual rendering.
+	if ((op != OP_INIT) && (!force) && (hMainDialog != NULL) &&
+		(GetCurrentThreadId() != GetWindowThreadProcessId(hMainDialog, NULL))) {
+		progress_op = op;
+		progress_msg = msg;
+		InterlockedExchange64(&progress_processed, (LONG64)processed);
+		InterlockedExchange64(&progress_total, (LONG64)total);
+		InterlockedExchange(&progress_pending, 1);
+		return;
+	}
+	UpdateProgressWithInfoRender(op, msg, processed, total, force);
+}
+
+static void CALLBACK ProgressCoalesceTimer(HWND hWnd, UINT uMsg, UINT_PTR idEvent, DWORD dwTime)
+{
+	if (InterlockedExchange(&progress_pending, 0))
+		UpdateProgressWithInfoRender(progress_op, progress_msg,
+			(uint64_t)progress_processed, (uint64_t)progress_total, FALSE);
+}
+
+void StartProgressCoalescing(void)
+{
+	SetTimer(hMainDialog, TID_PROGRESS_COALESCE, 33, ProgressCoalesceTimer);
+}
+
 void ShowLanguageMenu(RECT rcExclude)
 {
 	TPMPARAMS tpm;
@@ -1559,6 +1677,9 @@ void SetPassesTooltip(void)
 	{ BADBLOCK_PATTERN_ONE_PASS, BADBLOCK_PATTERN_TWO_PASSES, BADBLOCK_PATTERN_SLC,
 	  BADCLOCK_PATTERN_MLC, BADBLOCK_PATTERN_TLC };
 	int sel = ComboBox_GetCurSel(hNBPasses);
+	// The one-pass write+verify entry reuses the single pass pattern
+	if (sel >= BADLOCKS_PATTERN_TYPES)
+		sel = 0;
 	CreateTooltip(hNBPasses, lmprintf(MSG_153 + ((sel >= 2) ? 3 : sel),
 		pattern[sel][0], pattern[sel][1], pattern[sel][2], pattern[sel][3]), -1);
 }
@@ -71,6 +71,11 @@ enum update_progress_type {
 // This allows ETA to change approximately once per second.
 #define ETA_REFRESH_INTERVAL 990
 
+// Time constant (in ms) of the exponentially weighted moving average applied
+// on top of the ring-averaged speed, from which the rate and ETA displays are
+// both derived.
+#define SPEED_EWMA_TAU 3000.0
+
 extern HWND hMultiToolbar, hSaveToolbar, hHashToolbar, hAdvancedDeviceToolbar, hAdvancedFormatToolbar;
 extern HFONT hInfoFont;
 extern UINT_PTR UM_LANGUAGE_MENU_MAX;
@@ -88,6 +93,8 @@ extern void GetBasicControlsWidth(HWND hDlg);
 extern void GetMainButtonsWidth(HWND hDlg);
 extern void GetHalfDropwdownWidth(HWND hDlg);
 extern void GetFullWidth(HWND hDlg);
+extern BOOL LoadLayoutCache(HWND hDlg);
+extern void SaveLayoutCache(HWND hDlg);
 extern void PositionMainControls(HWND hDlg);
 extern void AdjustForLowDPI(HWND hDlg);
 extern void SetSectionHeaders(HWND hDlg);
@@ -100,6 +107,7 @@ extern void ToggleImageOptions(void);
 extern void CreateSmallButtons(HWND hDlg);
 extern void CreateAdditionalControls(HWND hDlg);
 extern void InitProgress(BOOL bOnlyFormat);
+extern void StartProgressCoalescing(void);
 extern void ShowLanguageMenu(RECT rcExclude);
 extern void SetPassesTooltip(void);
 extern void SetBootTypeDropdownWidth(void);
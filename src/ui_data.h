@@ -51,6 +51,7 @@ static int image_option_move_ids[] = {
 	IDC_OLD_BIOS_FIXES,
 	IDC_RUFUS_MBR,
 	IDC_DISK_ID,
+	IDC_BENCHMARK,
 	IDS_FORMAT_OPTIONS_TXT,
 	IDS_LABEL_TXT,
 	IDC_LABEL,
@@ -87,6 +88,7 @@ static int advanced_device_move_ids[] = {
 	IDC_LIST_USB_HDD,
 	IDC_OLD_BIOS_FIXES,
 	IDC_RUFUS_MBR,
+	IDC_BENCHMARK,
 	IDS_FORMAT_OPTIONS_TXT,
 	IDS_LABEL_TXT,
 	IDC_LABEL,
@@ -117,6 +119,7 @@ static int advanced_device_toggle_ids[] = {
 	IDC_OLD_BIOS_FIXES,
 	IDC_RUFUS_MBR,
 	IDC_DISK_ID,
+	IDC_BENCHMARK,
 };
 
 static int advanced_format_move_ids[] = {
@@ -171,6 +174,7 @@ static int full_width_checkboxes[] = {
 static int half_width_ids[] = {
 	IDC_BAD_BLOCKS,
 	IDC_RUFUS_MBR,
+	IDC_BENCHMARK,
 	IDS_PARTITION_TYPE_TXT,
 	IDC_PARTITION_TYPE,
 	IDC_FILE_SYSTEM,
@@ -191,6 +195,7 @@ static int adjust_dpi_ids[][5] = {
 	{ IDC_LIST_USB_HDD, 0, 0, 0, 0 },
 	{ IDC_OLD_BIOS_FIXES, 0, 0, 0, 0 },
 	{ IDC_RUFUS_MBR, IDC_DISK_ID, 0, 0, 0 },
+	{ IDC_BENCHMARK, 0, 0, 0, 0 },
 	{ IDS_FORMAT_OPTIONS_TXT, 0, 0, 0, 0 },
 	{ IDS_LABEL_TXT, IDC_LABEL, 0, 0, 0 },
 	{ IDS_FILE_SYSTEM_TXT, IDC_FILE_SYSTEM, IDS_CLUSTER_SIZE_TXT, IDC_CLUSTER_SIZE, 0 },
@@ -160,6 +160,7 @@ static uint64_t progress_offset = 0, progress_total = 100;
 static wchar_t wmount_path[MAX_PATH] = { 0 }, wmount_track[MAX_PATH] = { 0 };
 static char sevenzip_path[MAX_PATH];
 static const char conectix_str[] = VHD_FOOTER_COOKIE;
+static const char ffu_signature_str[] = "SignedImage ";
 static BOOL count_files;
 // Apply/Mount image functionality
 static const char *_image, *_dst;
@@ -175,15 +176,13 @@ static BOOL Get7ZipPath(void)
 	return FALSE;
 }
 
-BOOL AppendVHDFooter(const char* vhd_path)
+// Populate the fixed disk VHD footer for an image of the provided size.
+// 'buf' must point to a VHD_FOOTER_SIZE byte buffer.
+void BuildVHDFooter(uint64_t image_size, void* buf)
 {
 	const char creator_os[4] = VHD_FOOTER_CREATOR_HOST_OS_WINDOWS;
 	const char creator_app[4] = { 'r', 'u', 'f', 's' };
-	BOOL r = FALSE;
-	DWORD size;
-	LARGE_INTEGER li;
-	HANDLE handle = INVALID_HANDLE_VALUE;
-	vhd_footer* footer = NULL;
+	vhd_footer* footer = (vhd_footer*)buf;
 	uint64_t totalSectors;
 	uint16_t cylinders = 0;
 	uint8_t heads, sectorsPerTrack;
@@ -192,19 +191,7 @@ BOOL AppendVHDFooter(const char* vhd_path)
 	size_t i;
 
 	PF_INIT(UuidCreate, Rpcrt4);
-	handle = CreateFileU(vhd_path, GENERIC_WRITE, FILE_SHARE_WRITE, NULL,
-		OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
-	li.QuadPart = 0;
-	if ((handle == INVALID_HANDLE_VALUE) || (!SetFilePointerEx(handle, li, &li, FILE_END))) {
-		uprintf("Could not open image '%s': %s", vhd_path, WindowsErrorString());
-		goto out;
-	}
-	footer = (vhd_footer*)calloc(1, sizeof(vhd_footer));
-	if (footer == NULL) {
-		uprintf("Could not allocate VHD footer");
-		goto out;
-	}
-
+	memset(footer, 0, sizeof(vhd_footer));
 	memcpy(footer->cookie, conectix_str, sizeof(footer->cookie));
 	footer->features = bswap_uint32(VHD_FOOTER_FEATURES_RESERVED);
 	footer->file_format_version = bswap_uint32(VHD_FOOTER_FILE_FORMAT_V1_0);
@@ -213,14 +200,14 @@ BOOL AppendVHDFooter(const char* vhd_path)
 	memcpy(footer->creator_app, creator_app, sizeof(creator_app));
 	footer->creator_version = bswap_uint32((rufus_version[0]<<16)|rufus_version[1]);
 	memcpy(footer->creator_host_os, creator_os, sizeof(creator_os));
-	footer->original_size = bswap_uint64(li.QuadPart);
+	footer->original_size = bswap_uint64(image_size);
 	footer->current_size = footer->original_size;
 	footer->disk_type = bswap_uint32(VHD_FOOTER_TYPE_FIXED_HARD_DISK);
 	if ((pfUuidCreate == NULL) || (pfUuidCreate(&footer->unique_id) != RPC_S_OK))
 		uprintf("Warning: could not set VHD UUID");
 
 	// Compute CHS, as per the VHD specs
-	totalSectors = li.QuadPart / 512;
+	totalSectors = image_size / 512;
 	if (totalSectors > 65535 * 16 * 255) {
 		totalSectors = 65535 * 16 * 255;
 	}
@@ -258,6 +245,29 @@ BOOL AppendVHDFooter(const char* vhd_path)
 	for (checksum=0, i=0; i<sizeof(vhd_footer); i++)
 		checksum += ((uint8_t*)footer)[i];
 	footer->checksum = bswap_uint32(~checksum);
+}
+
+BOOL AppendVHDFooter(const char* vhd_path)
+{
+	BOOL r = FALSE;
+	DWORD size;
+	LARGE_INTEGER li;
+	HANDLE handle = INVALID_HANDLE_VALUE;
+	vhd_footer* footer = NULL;
+
+	handle = CreateFileU(vhd_path, GENERIC_WRITE, FILE_SHARE_WRITE, NULL,
+		OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	li.QuadPart = 0;
+	if ((handle == INVALID_HANDLE_VALUE) || (!SetFilePointerEx(handle, li, &li, FILE_END))) {
+		uprintf("Could not open image '%s': %s", vhd_path, WindowsErrorString());
+		goto out;
+	}
+	footer = (vhd_footer*)calloc(1, sizeof(vhd_footer));
+	if (footer == NULL) {
+		uprintf("Could not allocate VHD footer");
+		goto out;
+	}
+	BuildVHDFooter(li.QuadPart, footer);
 
 	if (!WriteFileWithRetry(handle, footer, sizeof(vhd_footer), &size, WRITE_RETRIES)) {
 		uprintf("Could not write VHD footer: %s", WindowsErrorString());
@@ -271,30 +281,119 @@ out:
 	return r;
 }
 
+// FFU (Full Flash Update) images can only be applied or captured whole-drive,
+// through the FfuProvider that was added to dism.exe with Windows 10 1709.
+BOOL HasFfuSupport(void)
+{
+	char path[MAX_PATH];
+
+	if (nWindowsBuildNumber < 16299)
+		return FALSE;
+	static_sprintf(path, "%s\\dism.exe", sysnative_dir);
+	return (_accessU(path, 0) == 0);
+}
+
+// Apply a .ffu image to a physical drive using dism. The caller must not hold
+// a handle on the drive, as dism requires exclusive access.
+BOOL WriteFfuImage(const char* image, DWORD DriveIndex)
+{
+	DWORD r;
+	char cmd[MAX_PATH + 128], *physical = NULL;
+
+	if (!HasFfuSupport()) {
+		uprintf("This version of Windows does not support applying FFU images");
+		return FALSE;
+	}
+	physical = GetPhysicalName(DriveIndex);
+	if (physical == NULL)
+		return FALSE;
+	static_sprintf(cmd, "%s\\dism.exe /Apply-Ffu /ApplyDrive:%s /ImageFile:\"%s\"", sysnative_dir, physical, image);
+	uprintf("Running command: '%s'", cmd);
+	r = RunCommand(cmd, sysnative_dir, TRUE);
+	safe_free(physical);
+	if (r != 0) {
+		SetLastError(r);
+		uprintf("Failed to apply FFU image: %s", WindowsErrorString());
+		return FALSE;
+	}
+	return TRUE;
+}
+
+// Capture a physical drive into a .ffu image using dism
+BOOL CaptureFfuImage(const char* image, DWORD DriveIndex)
+{
+	DWORD r;
+	const char* name;
+	char cmd[MAX_PATH + 192], *physical = NULL;
+
+	if (!HasFfuSupport()) {
+		uprintf("This version of Windows does not support capturing FFU images");
+		return FALSE;
+	}
+	physical = GetPhysicalName(DriveIndex);
+	if (physical == NULL)
+		return FALSE;
+	// dism requires a /Name, for which the image file name will do just fine
+	for (name = &image[strlen(image) - 1]; (name > image) && (*name != '\\') && (*name != '/'); name--);
+	if (name != image)
+		name++;
+	static_sprintf(cmd, "%s\\dism.exe /Capture-Ffu /CaptureDrive:%s /ImageFile:\"%s\" /Name:\"%s\"",
+		sysnative_dir, physical, image, name);
+	uprintf("Running command: '%s'", cmd);
+	r = RunCommand(cmd, sysnative_dir, TRUE);
+	safe_free(physical);
+	if (r != 0) {
+		SetLastError(r);
+		uprintf("Failed to capture FFU image: %s", WindowsErrorString());
+		return FALSE;
+	}
+	return TRUE;
+}
+
 typedef struct {
 	const char* ext;
 	bled_compression_type type;
+	// Leading magic bytes of the compressed format, when it has reliable
+	// ones, so that we can skip the decompressor run on a mismatch.
+	// A zero length means the format can't be identified from its header
+	// (e.g. raw LZMA, or VTSI which keeps its signature in a footer).
+	uint8_t magic_len;
+	uint8_t magic[8];
 } comp_assoc;
 
 static comp_assoc file_assoc[] = {
-	{ ".zip", BLED_COMPRESSION_ZIP },
-	{ ".Z", BLED_COMPRESSION_LZW },
-	{ ".gz", BLED_COMPRESSION_GZIP },
-	{ ".lzma", BLED_COMPRESSION_LZMA },
-	{ ".bz2", BLED_COMPRESSION_BZIP2 },
-	{ ".xz", BLED_COMPRESSION_XZ },
-	{ ".vtsi", BLED_COMPRESSION_VTSI },
+	{ ".zip", BLED_COMPRESSION_ZIP, 4, { 'P', 'K', 0x03, 0x04 } },
+	{ ".Z", BLED_COMPRESSION_LZW, 2, { 0x1f, 0x9d } },
+	{ ".gz", BLED_COMPRESSION_GZIP, 2, { 0x1f, 0x8b } },
+	{ ".lzma", BLED_COMPRESSION_LZMA, 0, { 0 } },
+	{ ".bz2", BLED_COMPRESSION_BZIP2, 3, { 'B', 'Z', 'h' } },
+	{ ".xz", BLED_COMPRESSION_XZ, 6, { 0xfd, '7', 'z', 'X', 'Z', 0x00 } },
+	{ ".vtsi", BLED_COMPRESSION_VTSI, 0, { 0 } },
+	{ ".zst", BLED_COMPRESSION_ZSTD, 4, { 0x28, 0xb5, 0x2f, 0xfd } },
 };
 
+// Single entry detection cache, keyed on the file's identity, so that
+// reselecting an unchanged image doesn't rerun the decompressor probe.
+static struct {
+	char path[MAX_PATH];
+	FILETIME mtime;
+	bled_compression_type type;
+	BOOL bootable;
+} comp_detect_cache = { "", { 0, 0 }, BLED_COMPRESSION_NONE, FALSE };
+
 // For now we consider that an image that matches a known extension is bootable
 #define MBR_SIZE 512	// Might need to review this once we see bootable 4k systems
 BOOL IsCompressedBootableImage(const char* path)
 {
 	char *p;
 	unsigned char *buf = NULL;
+	uint8_t hdr[8] = { 0 };
 	int i;
 	BOOL r = FALSE;
 	int64_t dc;
+	DWORD size;
+	HANDLE handle;
+	BY_HANDLE_FILE_INFORMATION info = { 0 };
 
 	img_report.compression_type = BLED_COMPRESSION_NONE;
 	for (p = (char*)&path[strlen(path)-1]; (*p != '.') && (p != path); p--);
@@ -304,20 +403,48 @@ BOOL IsCompressedBootableImage(const char* path)
 
 	for (i = 0; i<ARRAYSIZE(file_assoc); i++) {
 		if (strcmp(p, file_assoc[i].ext) == 0) {
+			handle = CreateFileU(path, GENERIC_READ, FILE_SHARE_READ, NULL,
+				OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+			if (handle == INVALID_HANDLE_VALUE)
+				return FALSE;
+			if (GetFileInformationByHandle(handle, &info) &&
+				(safe_strcmp(path, comp_detect_cache.path) == 0) &&
+				(CompareFileTime(&info.ftLastWriteTime, &comp_detect_cache.mtime) == 0)) {
+				CloseHandle(handle);
+				img_report.compression_type = comp_detect_cache.type;
+				return comp_detect_cache.bootable;
+			}
+			// Don't bother running the decompressor if the header can't match
+			r = ReadFile(handle, hdr, sizeof(hdr), &size, NULL) && (size == sizeof(hdr));
+			CloseHandle(handle);
+			if (!r)
+				return FALSE;
+			r = FALSE;
 			img_report.compression_type = file_assoc[i].type;
+			if ((file_assoc[i].magic_len != 0) &&
+				(memcmp(hdr, file_assoc[i].magic, file_assoc[i].magic_len) != 0)) {
+				uprintf("  File extension says '%s' but the header disagrees", &file_assoc[i].ext[1]);
+				goto out;
+			}
 			buf = malloc(MBR_SIZE);
 			if (buf == NULL)
 				return FALSE;
-			FormatStatus = 0;
-			bled_init(_uprintf, NULL, NULL, NULL, NULL, &FormatStatus);
+			// Don't reset FormatStatus here: it was zeroed when the scan was
+			// started, and this probe may now run concurrently with the ISO
+			// scan, whose cooperative cancellation (on preemption by a new
+			// selection) would otherwise be swallowed - which also means the
+			// decompression below gets aborted on cancellation, as it should.
+			bled_init(0, _uprintf, NULL, NULL, NULL, NULL, &FormatStatus);
 			dc = bled_uncompress_to_buffer(path, (char*)buf, MBR_SIZE, file_assoc[i].type);
 			bled_exit();
-			if (dc != MBR_SIZE) {
-				free(buf);
-				return FALSE;
-			}
-			r = (buf[0x1FE] == 0x55) && (buf[0x1FF] == 0xAA);
+			if (dc == MBR_SIZE)
+				r = (buf[0x1FE] == 0x55) && (buf[0x1FF] == 0xAA);
 			free(buf);
+		out:
+			static_strcpy(comp_detect_cache.path, path);
+			comp_detect_cache.mtime = info.ftLastWriteTime;
+			comp_detect_cache.type = img_report.compression_type;
+			comp_detect_cache.bootable = r;
 			return r;
 		}
 	}
@@ -335,6 +462,7 @@ int8_t IsBootableImage(const char* path)
 	size_t i;
 	uint32_t checksum, old_checksum;
 	uint64_t wim_magic = 0;
+	uint8_t ffu_hdr[16] = { 0 };
 	LARGE_INTEGER ptr = { 0 };
 	int8_t is_bootable_img;
 
@@ -346,6 +474,16 @@ int8_t IsBootableImage(const char* path)
 		goto out;
 	}
 
+	// A chunk manifest from the dedup store stands in for the raw disk image it references
+	img_report.is_cdc_img = IsCdcManifest(path);
+	if (img_report.is_cdc_img) {
+		img_report.image_size = CdcManifestSize(path);
+		uprintf("  Image is a chunk manifest from the dedup store (%s)",
+			SizeToHumanReadable(img_report.image_size, FALSE, FALSE));
+		is_bootable_img = 1;
+		goto out;
+	}
+
 	is_bootable_img = IsCompressedBootableImage(path) ? 1 : 0;
 	if (img_report.compression_type == BLED_COMPRESSION_NONE)
 		is_bootable_img = AnalyzeMBR(handle, "  Image", FALSE) ? 1 : (ignore_boot_marker ? 2 : 0);
@@ -362,6 +500,20 @@ int8_t IsBootableImage(const char* path)
 	if (img_report.is_windows_img)
 		goto out;
 
+	// Check for the security signature of an FFU (Full Flash Update) image,
+	// which sits at offset 0x04, right after the header size
+	size = sizeof(ffu_hdr);
+	ptr.QuadPart = 0;
+	IGNORE_RETVAL(SetFilePointerEx(handle, ptr, NULL, FILE_BEGIN));
+	img_report.is_ffu_img = ReadFile(handle, ffu_hdr, size, &size, NULL) &&
+		(memcmp(&ffu_hdr[4], ffu_signature_str, sizeof(ffu_signature_str) - 1) == 0);
+	if (img_report.is_ffu_img) {
+		uprintf("  Image is a Full Flash Update (FFU) image");
+		// FFUs can only be applied whole disk, through dism
+		is_bootable_img = 1;
+		goto out;
+	}
+
 	size = sizeof(vhd_footer);
 	if ((img_report.compression_type == BLED_COMPRESSION_NONE) && (img_report.image_size >= (512 + size))) {
 		footer = (vhd_footer*)malloc(size);
@@ -652,22 +804,15 @@ BOOL WimUnmountImage(const char* image, int index)
 	return dw;
 }
 
-// Extract a file from a WIM image using wimgapi.dll (Windows 7 or later)
-// NB: if you want progress from a WIM callback, you must run the WIM API call in its own thread
-// (which we don't do here) as it won't work otherwise. Thanks go to Erwan for figuring this out!
-BOOL WimExtractFile_API(const char* image, int index, const char* src, const char* dst, BOOL bSilent)
+// Open a WIM extraction session using wimgapi.dll (Windows 7 or later).
+// The session holds the WIM handle - and, lazily, the loaded image handle -
+// open, so that several files can be extracted from the same image while only
+// paying the expensive WIMCreateFile/WIMLoadImage setup once.
+BOOL WimSessionOpen(WIM_SESSION* session, const char* image, int index, BOOL bSilent)
 {
-	static char* index_name = "[1].xml";
 	BOOL r = FALSE;
-	DWORD dw = 0;
-	HANDLE hWim = NULL;
-	HANDLE hImage = NULL;
-	HANDLE hFile = NULL;
 	wchar_t wtemp[MAX_PATH] = {0};
 	wchar_t* wimage = utf8_to_wchar(image);
-	wchar_t* wsrc = utf8_to_wchar(src);
-	wchar_t* wdst = utf8_to_wchar(dst);
-	char* wim_info;
 
 	PF_INIT_OR_OUT(WIMCreateFile, Wimgapi);
 	PF_INIT_OR_OUT(WIMSetTemporaryPath, Wimgapi);
@@ -675,6 +820,10 @@ BOOL WimExtractFile_API(const char* image, int index, const char* src, const cha
 	PF_INIT_OR_OUT(WIMExtractImagePath, Wimgapi);
 	PF_INIT_OR_OUT(WIMCloseHandle, Wimgapi);
 
+	memset(session, 0, sizeof(WIM_SESSION));
+	session->index = index;
+	static_strcpy(session->image, image);
+
 	suprintf("Opening: %s:[%d] (API)", image, index);
 	if (GetTempPathW(ARRAYSIZE(wtemp), wtemp) == 0) {
 		uprintf("  Could not fetch temp path: %s", WindowsErrorString());
@@ -685,21 +834,44 @@ BOOL WimExtractFile_API(const char* image, int index, const char* src, const cha
 	// to open newer install.wim/install.esd images, without running into obnoxious error:
 	// [0x0000000B] An attempt was made to load a program with an incorrect format.
 	// No thanks to Microsoft for NOT DOCUMENTING THEIR UTTER BULLSHIT with the WIM API!
-	hWim = pfWIMCreateFile(wimage, WIM_GENERIC_READ, WIM_OPEN_EXISTING,
+	session->hWim = pfWIMCreateFile(wimage, WIM_GENERIC_READ, WIM_OPEN_EXISTING,
 		(img_report.wininst_version >= SPECIAL_WIM_VERSION) ? WIM_UNDOCUMENTED_BULLSHIT : 0, 0, NULL);
-	if (hWim == NULL) {
+	if (session->hWim == NULL) {
 		uprintf("  Could not access image: %s", WindowsErrorString());
 		goto out;
 	}
 
-	if (!pfWIMSetTemporaryPath(hWim, wtemp)) {
+	if (!pfWIMSetTemporaryPath(session->hWim, wtemp)) {
 		uprintf("  Could not set temp path: %s", WindowsErrorString());
+		pfWIMCloseHandle(session->hWim);
+		session->hWim = NULL;
 		goto out;
 	}
+	r = TRUE;
+
+out:
+	safe_free(wimage);
+	return r;
+}
+
+// Extract a file from an open WIM session. The image handle is loaded on the
+// first extraction that needs it, and reused by all subsequent ones.
+BOOL WimSessionExtract(WIM_SESSION* session, const char* src, const char* dst, BOOL bSilent)
+{
+	static char* index_name = "[1].xml";
+	BOOL r = FALSE;
+	DWORD dw = 0;
+	HANDLE hFile = NULL;
+	wchar_t* wsrc = utf8_to_wchar(src);
+	wchar_t* wdst = utf8_to_wchar(dst);
+	char* wim_info;
+
+	if ((session == NULL) || (session->hWim == NULL))
+		goto out;
 
 	suprintf("Extracting: %s (From %s)", dst, src);
 	if (safe_strcmp(src, index_name) == 0) {
-		if (!pfWIMGetImageInformation(hWim, &wim_info, &dw)) {
+		if (!pfWIMGetImageInformation(session->hWim, &wim_info, &dw)) {
 			uprintf("  Could not access WIM info: %s", WindowsErrorString());
 			goto out;
 		}
@@ -710,12 +882,14 @@ BOOL WimExtractFile_API(const char* image, int index, const char* src, const cha
 			goto out;
 		}
 	} else {
-		hImage = pfWIMLoadImage(hWim, (DWORD)index);
-		if (hImage == NULL) {
-			uprintf("  Could not set index: %s", WindowsErrorString());
-			goto out;
+		if (session->hImage == NULL) {
+			session->hImage = pfWIMLoadImage(session->hWim, (DWORD)session->index);
+			if (session->hImage == NULL) {
+				uprintf("  Could not set index: %s", WindowsErrorString());
+				goto out;
+			}
 		}
-		if (!pfWIMExtractImagePath(hImage, wsrc, wdst, 0)) {
+		if (!pfWIMExtractImagePath(session->hImage, wsrc, wdst, 0)) {
 			suprintf("  Could not extract file: %s", WindowsErrorString());
 			goto out;
 		}
@@ -723,23 +897,79 @@ BOOL WimExtractFile_API(const char* image, int index, const char* src, const cha
 	r = TRUE;
 
 out:
-	if ((hImage != NULL) || (hWim != NULL)) {
-		suprintf("Closing: %s", image);
-		if (hImage != NULL) pfWIMCloseHandle(hImage);
-		if (hWim != NULL) pfWIMCloseHandle(hWim);
-	}
 	safe_closehandle(hFile);
-	safe_free(wimage);
 	safe_free(wsrc);
 	safe_free(wdst);
 	return r;
 }
 
+// Close a WIM extraction session
+void WimSessionClose(WIM_SESSION* session, BOOL bSilent)
+{
+	if ((session == NULL) || ((session->hImage == NULL) && (session->hWim == NULL)))
+		return;
+	suprintf("Closing: %s", session->image);
+	if (session->hImage != NULL)
+		pfWIMCloseHandle(session->hImage);
+	if (session->hWim != NULL)
+		pfWIMCloseHandle(session->hWim);
+	memset(session, 0, sizeof(WIM_SESSION));
+}
+
+// Extract a single file from a WIM image using wimgapi.dll (Windows 7 or later)
+// NB: if you want progress from a WIM callback, you must run the WIM API call in its own thread
+// (which we don't do here) as it won't work otherwise. Thanks go to Erwan for figuring this out!
+BOOL WimExtractFile_API(const char* image, int index, const char* src, const char* dst, BOOL bSilent)
+{
+	BOOL r;
+	WIM_SESSION session;
+
+	if (!WimSessionOpen(&session, image, index, bSilent))
+		return FALSE;
+	r = WimSessionExtract(&session, src, dst, bSilent);
+	WimSessionClose(&session, bSilent);
+	return r;
+}
+
+// Retrieve the number of images stored in a WIM, from the dwImageCount field
+// of its header. The last answer is cached, since we usually extract several
+// files in a row from the same image.
+static DWORD GetWimImageCount(const char* image)
+{
+	static char last_image[MAX_PATH] = { 0 };
+	static DWORD last_count = 0;
+	HANDLE handle;
+	LARGE_INTEGER ptr;
+	uint64_t wim_magic = 0;
+	DWORD size, count = 0;
+
+	if (strcmp(image, last_image) == 0)
+		return last_count;
+	handle = CreateFileU(image, GENERIC_READ, FILE_SHARE_READ, NULL,
+		OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (handle == INVALID_HANDLE_VALUE)
+		return 0;
+	size = sizeof(wim_magic);
+	if (!ReadFile(handle, &wim_magic, size, &size, NULL) || (wim_magic != WIM_MAGIC))
+		goto out;
+	size = sizeof(count);
+	ptr.QuadPart = 0x2C;	// Offset of dwImageCount in the WIM header
+	if (!SetFilePointerEx(handle, ptr, NULL, FILE_BEGIN) ||
+		!ReadFile(handle, &count, size, &size, NULL))
+		count = 0;
+out:
+	safe_closehandle(handle);
+	static_strcpy(last_image, image);
+	last_count = count;
+	return count;
+}
+
 // Extract a file from a WIM image using 7-Zip
 BOOL WimExtractFile_7z(const char* image, int index, const char* src, const char* dst, BOOL bSilent)
 {
-	int n;
+	int n, n_first = 0, n_last = 2;
 	size_t i;
+	DWORD image_count;
 	char cmdline[MAX_PATH];
 	char tmpdst[MAX_PATH];
 	char index_prefix[] = "#\\";
@@ -760,7 +990,15 @@ BOOL WimExtractFile_7z(const char* image, int index, const char* src, const char
 	// only one image. Because of this (and because 7z will not
 	// return an error code if it can't extract the file), we need
 	// to issue 2 passes. See github issue #680.
-	for (n = 0; n < 2; n++) {
+	// Since each pass pays a full process spawn plus archive open, read
+	// the image count from the WIM header to issue the right invocation
+	// directly, and only fall back to both passes if it can't be read.
+	image_count = GetWimImageCount(image);
+	if (image_count == 1)
+		n_first = 1;
+	else if (image_count > 1)
+		n_last = 1;
+	for (n = n_first; n < n_last; n++) {
 		static_strcpy(tmpdst, dst);
 		for (i = strlen(tmpdst) - 1; (i > 0) && (tmpdst[i] != '\\') && (tmpdst[i] != '/'); i--);
 		tmpdst[i] = 0;
@@ -781,7 +1019,7 @@ BOOL WimExtractFile_7z(const char* image, int index, const char* src, const char
 			break;
 	}
 
-	if (n >= 2) {
+	if (n >= n_last) {
 		suprintf("  7z.exe did not extract %s", tmpdst);
 		return FALSE;
 	}
@@ -809,14 +1047,26 @@ BOOL WimExtractFile(const char* image, int index, const char* src, const char* d
 		  || ((wim_flags & WIM_HAS_API_EXTRACT) && WimExtractFile_API(image, index, src, dst, bSilent)) );
 }
 
+// Read the unsigned decimal content of an XML element, from the UTF-16
+// image information returned by WIMGetImageInformation()
+static uint64_t GetWimInfoValue(const wchar_t* wim_info, const wchar_t* wtag)
+{
+	const wchar_t* p = wcsstr(wim_info, wtag);
+	if (p == NULL)
+		return 0;
+	return wcstoull(&p[wcslen(wtag)], NULL, 10);
+}
+
 // Apply a WIM image using wimgapi.dll (Windows 7 or later)
 // https://docs.microsoft.com/en-us/previous-versions/msdn10/dd851944(v=msdn.10)
 // To get progress, we must run this call within its own thread
 static DWORD WINAPI WimApplyImageThread(LPVOID param)
 {
 	BOOL r = FALSE;
+	DWORD dw = 0;
 	HANDLE hWim = NULL;
 	HANDLE hImage = NULL;
+	char* wim_info = NULL;
 	wchar_t wtemp[MAX_PATH] = {0};
 	wchar_t* wimage = utf8_to_wchar(_image);
 	wchar_t* wdst = utf8_to_wchar(_dst);
@@ -866,21 +1116,32 @@ static DWORD WINAPI WimApplyImageThread(LPVOID param)
 
 	uprintf("Applying Windows image...");
 	UpdateProgressWithInfoInit(NULL, TRUE);
-	// Run a first pass using WIM_FLAG_NO_APPLY to count the files
 	wim_nb_files = 0;
 	wim_proc_files = 0;
 	wim_extra_files = 0;
-	count_files = TRUE;
-	if (!pfWIMApplyImage(hImage, wdst, WIM_FLAG_NO_APPLY)) {
-		uprintf("  Could not count the files to apply: %s", WindowsErrorString());
-		goto out;
+	// The file and directory counts are recorded in the image's XML data, so
+	// read them from there rather than spending minutes on a WIM_FLAG_NO_APPLY
+	// pass that walks the whole image metadata just to count its entries.
+	PF_INIT(WIMGetImageInformation, Wimgapi);
+	if ((pfWIMGetImageInformation != NULL) && pfWIMGetImageInformation(hImage, &wim_info, &dw)) {
+		wim_nb_files = (uint32_t)(GetWimInfoValue((wchar_t*)wim_info, L"<DIRCOUNT>") +
+			GetWimInfoValue((wchar_t*)wim_info, L"<FILECOUNT>"));
+		LocalFree(wim_info);
+	}
+	if (wim_nb_files == 0) {
+		// No usable XML data => fall back to counting with WIM_FLAG_NO_APPLY
+		count_files = TRUE;
+		if (!pfWIMApplyImage(hImage, wdst, WIM_FLAG_NO_APPLY)) {
+			uprintf("  Could not count the files to apply: %s", WindowsErrorString());
+			goto out;
+		}
+		// The latest Windows 10 ISOs have a ~17.5% discrepancy between the number of
+		// files and directories actually applied vs. the ones counted when not applying.
+		// Therefore, we add a 'safe' 20% to our counted files to compensate for yet
+		// another dismal Microsoft progress reporting API...
+		wim_nb_files += wim_nb_files / 5;
+		count_files = FALSE;
 	}
-	// The latest Windows 10 ISOs have a ~17.5% discrepancy between the number of
-	// files and directories actually applied vs. the ones counted when not applying.
-	// Therefore, we add a 'safe' 20% to our counted files to compensate for yet
-	// another dismal Microsoft progress reporting API...
-	wim_nb_files += wim_nb_files / 5;
-	count_files = FALSE;
 	// Actual apply
 	if (!pfWIMApplyImage(hImage, wdst, WIM_FLAG_FILEINFO)) {
 		uprintf("  Could not apply image: %s", WindowsErrorString());